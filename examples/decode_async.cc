@@ -0,0 +1,284 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// This C++ example decodes several JPEG XL images at once, the way an event
+// loop server would: input bytes arrive in chunks, as from sockets, and each
+// decoder only runs when it has new input. JxlDecoderProcessInput returns
+// JXL_DEC_NEED_MORE_INPUT instead of waiting for data, so no thread is parked
+// while a transfer is in progress. Decoding steps run on an executor supplied
+// by the application and report completion through a callback, and all the
+// decoders share one thread parallel runner for their group tasks.
+
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Minimal executor running closures on a few threads, standing for the one of
+// the application (e.g. the worker threads of its event loop).
+class Executor {
+ public:
+  explicit Executor(size_t num_threads) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this]() { Loop(); });
+    }
+  }
+  ~Executor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      exit_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& thread : threads_) thread.join();
+  }
+
+  void Post(std::function<void()> closure) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(closure));
+    }
+    cv_.notify_one();
+  }
+
+ private:
+  void Loop() {
+    for (;;) {
+      std::function<void()> closure;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return exit_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+        closure = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      closure();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> queue_;
+  bool exit_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// Decodes one image from input pushed with OnData. At most one decoding step
+// runs at a time; it is posted to the executor when new input arrives and
+// returns as soon as the decoder needs more of it.
+class AsyncDecoder {
+ public:
+  // Called once with the RGBA pixels, or with false on error.
+  using Callback = std::function<void(bool ok, size_t xsize, size_t ysize,
+                                      const std::vector<uint8_t>& pixels)>;
+
+  AsyncDecoder(Executor* executor, void* runner, Callback callback)
+      : executor_(executor),
+        dec_(JxlDecoderMake(nullptr)),
+        callback_(std::move(callback)) {
+    ok_ = JXL_DEC_SUCCESS ==
+              JxlDecoderSubscribeEvents(
+                  dec_.get(), JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) &&
+          JXL_DEC_SUCCESS == JxlDecoderSetParallelRunner(
+                                 dec_.get(), JxlThreadParallelRunner, runner);
+  }
+
+  // Called by the event loop when bytes arrive; `last` is set on the final
+  // chunk. Never blocks on decoding.
+  void OnData(const uint8_t* data, size_t size, bool last) {
+    bool post = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_) return;
+      incoming_.insert(incoming_.end(), data, data + size);
+      closed_ = closed_ || last;
+      if (!step_pending_) step_pending_ = post = true;
+    }
+    if (post) executor_->Post([this]() { Step(); });
+  }
+
+ private:
+  void Step() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      input_.insert(input_.end(), incoming_.begin(), incoming_.end());
+      incoming_.clear();
+      if (closed_) JxlDecoderCloseInput(dec_.get());
+    }
+    const bool done = !ok_ || Process();
+    bool post = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Data arrived while processing: run again rather than wait for more.
+      post = !done && !incoming_.empty();
+      step_pending_ = post;
+      finished_ = done;
+    }
+    if (done) {
+      callback_(ok_, xsize_, ysize_, pixels_);
+    } else if (post) {
+      executor_->Post([this]() { Step(); });
+    }
+  }
+
+  // Returns true once decoding is complete or failed.
+  bool Process() {
+    JxlDecoderSetInput(dec_.get(), input_.data(), input_.size());
+    JxlDecoderStatus status;
+    for (;;) {
+      status = JxlDecoderProcessInput(dec_.get());
+      if (status == JXL_DEC_BASIC_INFO) {
+        JxlBasicInfo info;
+        if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec_.get(), &info)) {
+          break;
+        }
+        xsize_ = info.xsize;
+        ysize_ = info.ysize;
+      } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        pixels_.resize(xsize_ * ysize_ * 4);
+        if (JXL_DEC_SUCCESS !=
+            JxlDecoderSetImageOutBuffer(dec_.get(), &format_, pixels_.data(),
+                                        pixels_.size())) {
+          break;
+        }
+      } else if (status != JXL_DEC_FULL_IMAGE) {
+        break;
+      }
+    }
+    // Keep the bytes the decoder has not consumed yet for the next step.
+    const size_t remaining = JxlDecoderReleaseInput(dec_.get());
+    input_.erase(input_.begin(), input_.end() - remaining);
+    if (status == JXL_DEC_NEED_MORE_INPUT) return false;
+    ok_ = status == JXL_DEC_SUCCESS;
+    return true;
+  }
+
+  Executor* executor_;
+  JxlDecoderPtr dec_;
+  Callback callback_;
+  const JxlPixelFormat format_ = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  bool ok_;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  std::vector<uint8_t> pixels_;
+  // Only accessed by the (single) running step.
+  std::vector<uint8_t> input_;
+
+  std::mutex mutex_;  // guards the following.
+  std::vector<uint8_t> incoming_;
+  bool closed_ = false;
+  bool step_pending_ = false;
+  bool finished_ = false;
+};
+
+bool LoadFile(const char* filename, std::vector<uint8_t>* out) {
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
+    return false;
+  }
+
+  if (fseek(file, 0, SEEK_END) != 0) {
+    fclose(file);
+    return false;
+  }
+
+  long size = ftell(file);  // NOLINT
+  // Avoid invalid file or directory.
+  if (size >= LONG_MAX || size < 0) {
+    fclose(file);
+    return false;
+  }
+
+  if (fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return false;
+  }
+
+  out->resize(size);
+  size_t readsize = fread(out->data(), 1, size, file);
+  if (fclose(file) != 0) {
+    return false;
+  }
+
+  return readsize == static_cast<size_t>(size);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s <jxl> [<jxl>...]\n"
+            "Where:\n"
+            "  jxl = input JPEG XL image filenames, decoded concurrently\n",
+            argv[0]);
+    return 1;
+  }
+  const size_t num_files = argc - 1;
+  std::vector<std::vector<uint8_t>> files(num_files);
+  for (size_t i = 0; i < num_files; ++i) {
+    if (!LoadFile(argv[i + 1], &files[i])) {
+      fprintf(stderr, "couldn't load %s\n", argv[i + 1]);
+      return 1;
+    }
+  }
+
+  // One runner for all the decoders; its workers are shared between them.
+  auto runner = JxlThreadParallelRunnerMake(
+      nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t num_done = 0;
+  bool all_ok = true;
+  std::vector<std::unique_ptr<AsyncDecoder>> decoders;
+  // Declared last, so that its threads are joined before the decoders and the
+  // state above are destroyed.
+  Executor executor(2);
+  for (size_t i = 0; i < num_files; ++i) {
+    const char* filename = argv[i + 1];
+    decoders.emplace_back(new AsyncDecoder(
+        &executor, runner.get(),
+        [&, filename](bool ok, size_t xsize, size_t ysize,
+                      const std::vector<uint8_t>& pixels) {
+          printf("%s: %s, %zux%zu, %zu bytes of pixels\n", filename,
+                 ok ? "decoded" : "error", xsize, ysize, pixels.size());
+          std::lock_guard<std::mutex> lock(mutex);
+          all_ok = all_ok && ok;
+          ++num_done;
+          cv.notify_one();
+        }));
+  }
+
+  // Stand-in for the event loop: deliver the files in small interleaved
+  // chunks, as they would arrive from the network.
+  constexpr size_t kChunkSize = 4096;
+  for (size_t offset = 0;; offset += kChunkSize) {
+    bool any = false;
+    for (size_t i = 0; i < num_files; ++i) {
+      if (offset >= files[i].size()) continue;
+      any = true;
+      const size_t size = std::min(kChunkSize, files[i].size() - offset);
+      decoders[i]->OnData(files[i].data() + offset, size,
+                          offset + size == files[i].size());
+    }
+    if (!any) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return num_done == num_files; });
+  return all_ok ? 0 : 1;
+}
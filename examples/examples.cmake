@@ -3,6 +3,8 @@
 # Use of this source code is governed by a BSD-style
 # license that can be found in the LICENSE file.
 
+add_executable(decode_async ${CMAKE_CURRENT_LIST_DIR}/decode_async.cc)
+target_link_libraries(decode_async jxl_dec jxl_threads)
 add_executable(decode_exif_metadata ${CMAKE_CURRENT_LIST_DIR}/decode_exif_metadata.cc)
 target_link_libraries(decode_exif_metadata jxl_dec jxl_threads)
 add_executable(decode_oneshot ${CMAKE_CURRENT_LIST_DIR}/decode_oneshot.cc)
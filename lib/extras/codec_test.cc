@@ -21,6 +21,7 @@
 #include <vector>
 
 #include "lib/extras/common.h"
+#include "lib/extras/dec/apng.h"
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/dec/decode.h"
 #include "lib/extras/enc/encode.h"
@@ -496,6 +497,57 @@ TEST(CodecTest, EncodeToPNG) {
                   decoded_ppf.info.bits_per_sample);
 }
 
+TEST(CodecTest, ChunkedPNGDecoder) {
+  if (!CanDecodeAPNG()) {
+    fprintf(stderr, "Skipping test because of missing codec support.\n");
+    return;
+  }
+  const std::string filename = "jxl/flower/flower.png";
+  PackedPixelFile ppf;
+  ASSERT_TRUE(extras::DecodeBytes(Bytes(jxl::test::ReadTestData(filename)),
+                                  ColorHints(), &ppf));
+  const PackedImage& expected = ppf.frames[0].color;
+
+  JXL_TEST_ASSIGN_OR_DIE(
+      ChunkedPNGDecoder decoder,
+      ChunkedPNGDecoder::Init(jxl::test::GetTestDataPath(filename).c_str()));
+  PackedPixelFile chunked_ppf;
+  ASSERT_TRUE(decoder.InitializePPF(ColorHints(), &chunked_ppf));
+  ASSERT_EQ(chunked_ppf.chunked_frames.size(), 1);
+  EXPECT_EQ(chunked_ppf.info.xsize, ppf.info.xsize);
+  EXPECT_EQ(chunked_ppf.info.ysize, ppf.info.ysize);
+  EXPECT_EQ(chunked_ppf.info.bits_per_sample, ppf.info.bits_per_sample);
+  JxlChunkedFrameInputSource input =
+      chunked_ppf.chunked_frames[0].GetInputSource();
+  JxlPixelFormat format;
+  input.get_color_channels_pixel_format(input.opaque, &format);
+  EXPECT_EQ(format.num_channels, expected.format.num_channels);
+  EXPECT_EQ(format.data_type, expected.format.data_type);
+
+  const size_t bytes_per_pixel = expected.stride / expected.xsize;
+  // Rows in order, then rows above the last ones, which decodes them again.
+  const size_t ysize = ppf.info.ysize;
+  for (size_t y0 : {size_t{0}, ysize / 2, ysize / 4}) {
+    for (size_t x0 = 0; x0 < ppf.info.xsize; x0 += 256) {
+      size_t xs = std::min<size_t>(256, ppf.info.xsize - x0);
+      size_t ys = std::min<size_t>(256, ysize - y0);
+      size_t row_offset;
+      const void* buffer = input.get_color_channel_data_at(
+          input.opaque, x0, y0, xs, ys, &row_offset);
+      ASSERT_NE(buffer, nullptr);
+      for (size_t y = 0; y < ys; ++y) {
+        EXPECT_EQ(0, memcmp(static_cast<const uint8_t*>(buffer) +
+                                y * row_offset,
+                            static_cast<const uint8_t*>(expected.pixels()) +
+                                (y0 + y) * expected.stride +
+                                x0 * bytes_per_pixel,
+                            xs * bytes_per_pixel));
+      }
+      input.release_buffer(input.opaque, buffer);
+    }
+  }
+}
+
 }  // namespace
 }  // namespace extras
 }  // namespace jxl
@@ -41,17 +41,21 @@
 
 #include <array>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "lib/extras/packed_image.h"
 #include "lib/extras/size_constraints.h"
 #include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/c_callback_support.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/printf_macros.h"
@@ -75,6 +79,20 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   return false;
 }
 
+struct ChunkedPNGDecoder::RowStream {};
+
+StatusOr<ChunkedPNGDecoder> ChunkedPNGDecoder::Init(const char* file_path) {
+  (void)file_path;
+  return JXL_FAILURE("PNG is not supported");
+}
+
+Status ChunkedPNGDecoder::InitializePPF(const ColorHints& color_hints,
+                                        PackedPixelFile* ppf) {
+  (void)color_hints;
+  (void)ppf;
+  return JXL_FAILURE("PNG is not supported");
+}
+
 #else  // JPEGXL_ENABLE_APNG
 
 namespace {
@@ -558,10 +576,15 @@ struct Context {
   /**
    * Initialize PNG decoder.
    *
+   * The rows go to `frameRaw`, unless `on_row` and its `progressive_ptr` are
+   * given.
+   *
    * TODO(eustas): add details
    */
   bool InitPngDecoder(const std::vector<Bytes>& chunksInfo,
-                      const RectT<uint64_t>& viewport) {
+                      const RectT<uint64_t>& viewport,
+                      png_progressive_row_ptr on_row = ProgressiveRead_OnRow,
+                      void* progressive_ptr = nullptr) {
     ResetPngDecoder();
 
     png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
@@ -582,9 +605,9 @@ struct Context {
                                 static_cast<int>(kIgnoredChunks.size() / 5));
 
     png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
-    png_set_progressive_read_fn(png_ptr, static_cast<void*>(&frameRaw),
-                                ProgressiveRead_OnInfo, ProgressiveRead_OnRow,
-                                nullptr);
+    png_set_progressive_read_fn(
+        png_ptr, progressive_ptr ? progressive_ptr : &frameRaw,
+        ProgressiveRead_OnInfo, on_row, nullptr);
 
     png_process_data(png_ptr, info_ptr,
                      const_cast<uint8_t*>(kPngSignature.data()),
@@ -636,6 +659,11 @@ struct Context {
     png_process_data(png_ptr, info_ptr, const_cast<uint8_t*>(kFooter.data()),
                      kFooter.size());
     // before destroying: check if we encountered any metadata chunks
+    DecodeTextChunks(metadata);
+    return true;
+  }
+
+  void DecodeTextChunks(PackedMetadata* metadata) {
     png_textp text_ptr = nullptr;
     int num_text = 0;
     if (png_get_text(png_ptr, info_ptr, &text_ptr, &num_text) != 0) {
@@ -646,8 +674,6 @@ struct Context {
         (void)result;
       }
     }
-
-    return true;
   }
 
   void ResetPngDecoder() {
@@ -760,6 +786,169 @@ enum class ColorInfoType {
   CICP = 3
 };
 
+// Default settings in case e.g. only gAMA is given.
+void SetDefaultInfo(PackedPixelFile* ppf) {
+  ppf->info.exponent_bits_per_sample = 0;
+  ppf->info.alpha_exponent_bits = 0;
+  ppf->info.orientation = JXL_ORIENT_IDENTITY;
+  ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
+  ppf->color_encoding.white_point = JXL_WHITE_POINT_D65;
+  ppf->color_encoding.primaries = JXL_PRIMARIES_SRGB;
+  ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_SRGB;
+  ppf->color_encoding.rendering_intent = JXL_RENDERING_INTENT_RELATIVE;
+}
+
+// Sets the dimensions and channels of `ppf` at the first IDAT, when all the
+// chunks that describe them are known. Returns the pixel format of the rows.
+Status SetImageInfo(const Context& ctx, const RectT<uint64_t>& image_rect,
+                    const SizeConstraints* constraints, PackedPixelFile* ppf,
+                    JxlPixelFormat* format, size_t* bytes_per_pixel) {
+  JXL_ENSURE(image_rect.xsize() ==
+             png_get_image_width(ctx.png_ptr, ctx.info_ptr));
+  JXL_ENSURE(image_rect.ysize() ==
+             png_get_image_height(ctx.png_ptr, ctx.info_ptr));
+  JXL_RETURN_IF_ERROR(
+      VerifyDimensions(constraints, image_rect.xsize(), image_rect.ysize()));
+  ppf->info.xsize = image_rect.xsize();
+  ppf->info.ysize = image_rect.ysize();
+
+  png_color_8p sig_bits = nullptr;
+  // Error is OK -> sig_bits remains nullptr.
+  png_get_sBIT(ctx.png_ptr, ctx.info_ptr, &sig_bits);
+  SetColorData(ppf, png_get_color_type(ctx.png_ptr, ctx.info_ptr),
+               png_get_bit_depth(ctx.png_ptr, ctx.info_ptr), sig_bits,
+               png_get_valid(ctx.png_ptr, ctx.info_ptr, PNG_INFO_tRNS));
+  uint32_t num_channels =
+      ppf->info.num_color_channels + (ppf->info.alpha_bits ? 1 : 0);
+  *format = {
+      /*num_channels=*/num_channels,
+      /*data_type=*/ppf->info.bits_per_sample > 8 ? JXL_TYPE_UINT16
+                                                  : JXL_TYPE_UINT8,
+      /*endianness=*/JXL_BIG_ENDIAN,
+      /*align=*/0,
+  };
+  *bytes_per_pixel =
+      num_channels * (format->data_type == JXL_TYPE_UINT16 ? 2 : 1);
+  return true;
+}
+
+// Decodes the chunks that only hold metadata. The other ones are passed to the
+// PNG decoder, and `*pass_through` tells that they may be needed again to
+// decode the pixels.
+Status DecodeMetadataChunk(uint32_t id, const Bytes& chunk, Context* ctx,
+                           ColorInfoType* color_info_type,
+                           PackedPixelFile* ppf, bool* pass_through) {
+  *pass_through = false;
+  // Cut 'size' and 'type' at front and 'CRC' at the end.
+  Bytes payload(chunk.data() + 8, chunk.size() - 12);
+  switch (id) {
+    case MakeTag('c', 'I', 'C', 'P'):
+      if (*color_info_type == ColorInfoType::CICP) {
+        JXL_DEBUG_V(2, "Excessive colorspace definition; cICP chunk ignored");
+        return true;
+      }
+      JXL_RETURN_IF_ERROR(DecodeCicpChunk(payload, &ppf->color_encoding));
+      ppf->icc.clear();
+      ppf->primary_color_representation =
+          PackedPixelFile::kColorEncodingIsPrimary;
+      *color_info_type = ColorInfoType::CICP;
+      return true;
+
+    case MakeTag('i', 'C', 'C', 'P'): {
+      if (*color_info_type == ColorInfoType::ICCP_OR_SRGB) {
+        return JXL_FAILURE("Repeated iCCP / sRGB chunk");
+      }
+      if (*color_info_type > ColorInfoType::ICCP_OR_SRGB) {
+        JXL_DEBUG_V(2, "Excessive colorspace definition; iCCP chunk ignored");
+        return true;
+      }
+      // Let PNG decoder deal with chunk processing.
+      if (!ctx->FeedChunks(chunk)) {
+        return JXL_FAILURE("Corrupt iCCP chunk");
+      }
+
+      // TODO(jon): catch special case of PQ and synthesize color encoding
+      // in that case
+      int compression_type = 0;
+      png_bytep profile = nullptr;
+      png_charp name = nullptr;
+      png_uint_32 profile_len = 0;
+      png_uint_32 ok =
+          png_get_iCCP(ctx->png_ptr, ctx->info_ptr, &name, &compression_type,
+                       &profile, &profile_len);
+      if (!ok || !profile_len) {
+        return JXL_FAILURE("Malformed / incomplete iCCP chunk");
+      }
+      ppf->icc.assign(profile, profile + profile_len);
+      ppf->primary_color_representation = PackedPixelFile::kIccIsPrimary;
+      *color_info_type = ColorInfoType::ICCP_OR_SRGB;
+      return true;
+    }
+
+    case MakeTag('s', 'R', 'G', 'B'):
+      if (*color_info_type == ColorInfoType::ICCP_OR_SRGB) {
+        return JXL_FAILURE("Repeated iCCP / sRGB chunk");
+      }
+      if (*color_info_type > ColorInfoType::ICCP_OR_SRGB) {
+        JXL_DEBUG_V(2, "Excessive colorspace definition; sRGB chunk ignored");
+        return true;
+      }
+      JXL_RETURN_IF_ERROR(DecodeSrgbChunk(payload, &ppf->color_encoding));
+      *color_info_type = ColorInfoType::ICCP_OR_SRGB;
+      return true;
+
+    case MakeTag('g', 'A', 'M', 'A'):
+      if (*color_info_type >= ColorInfoType::GAMA_OR_CHRM) {
+        JXL_DEBUG_V(2, "Excessive colorspace definition; gAMA chunk ignored");
+        return true;
+      }
+      JXL_RETURN_IF_ERROR(DecodeGamaChunk(payload, &ppf->color_encoding));
+      *color_info_type = ColorInfoType::GAMA_OR_CHRM;
+      return true;
+
+    case MakeTag('c', 'H', 'R', 'M'):
+      if (*color_info_type >= ColorInfoType::GAMA_OR_CHRM) {
+        JXL_DEBUG_V(2, "Excessive colorspace definition; cHRM chunk ignored");
+        return true;
+      }
+      JXL_RETURN_IF_ERROR(DecodeChrmChunk(payload, &ppf->color_encoding));
+      *color_info_type = ColorInfoType::GAMA_OR_CHRM;
+      return true;
+
+    case MakeTag('c', 'L', 'L', 'i'):
+      JXL_RETURN_IF_ERROR(
+          DecodeClliChunk(payload, &ppf->info.intensity_target));
+      return true;
+
+    case MakeTag('e', 'X', 'I', 'f'):
+      // TODO(eustas): next eXIF chunk overwrites current; is it ok?
+      ppf->metadata.exif.resize(payload.size());
+      memcpy(ppf->metadata.exif.data(), payload.data(), payload.size());
+      return true;
+
+    default:
+      // We don't know what is that, just pass through.
+      if (!ctx->FeedChunks(chunk)) {
+        return JXL_FAILURE("PNG decoder failed to process chunk");
+      }
+      *pass_through = true;
+      return true;
+  }
+}
+
+Status FinalizeColorEncoding(const ColorHints& color_hints,
+                             bool color_is_already_set, PackedPixelFile* ppf) {
+  bool is_gray = (ppf->info.num_color_channels == 1);
+  JXL_RETURN_IF_ERROR(
+      ApplyColorHints(color_hints, color_is_already_set, is_gray, ppf));
+
+  if (ppf->color_encoding.transfer_function != JXL_TRANSFER_FUNCTION_PQ) {
+    // Reset intensity target, in case we set it from cLLi but TF is not PQ.
+    ppf->info.intensity_target = 0.f;
+  }
+  return true;
+}
+
 }  // namespace
 
 bool CanDecodeAPNG() { return true; }
@@ -797,16 +986,9 @@ bool CanDecodeAPNG() { return true; }
 Status DecodeImageAPNG(const Span<const uint8_t> bytes,
                        const ColorHints& color_hints, PackedPixelFile* ppf,
                        const SizeConstraints* constraints) {
-  // Initialize output (default settings in case e.g. only gAMA is given).
+  // Initialize output.
   ppf->frames.clear();
-  ppf->info.exponent_bits_per_sample = 0;
-  ppf->info.alpha_exponent_bits = 0;
-  ppf->info.orientation = JXL_ORIENT_IDENTITY;
-  ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
-  ppf->color_encoding.white_point = JXL_WHITE_POINT_D65;
-  ppf->color_encoding.primaries = JXL_PRIMARIES_SRGB;
-  ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_SRGB;
-  ppf->color_encoding.rendering_intent = JXL_RENDERING_INTENT_RELATIVE;
+  SetDefaultInfo(ppf);
 
   Reader input(bytes);
 
@@ -855,7 +1037,6 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   // Flag that we processed some IDAT / fDAT after image / frame start.
   bool seen_pixel_data = false;
 
-  uint32_t num_channels;
   JxlPixelFormat format = {};
   size_t bytes_per_pixel = 0;
   std::vector<Frame> frames;
@@ -992,32 +1173,8 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
         if (!seen_idat) {
           // First IDAT means that all metadata is ready.
           seen_idat = true;
-          JXL_ENSURE(image_rect.xsize() ==
-                     png_get_image_width(ctx.png_ptr, ctx.info_ptr));
-          JXL_ENSURE(image_rect.ysize() ==
-                     png_get_image_height(ctx.png_ptr, ctx.info_ptr));
-          JXL_RETURN_IF_ERROR(VerifyDimensions(constraints, image_rect.xsize(),
-                                               image_rect.ysize()));
-          ppf->info.xsize = image_rect.xsize();
-          ppf->info.ysize = image_rect.ysize();
-
-          png_color_8p sig_bits = nullptr;
-          // Error is OK -> sig_bits remains nullptr.
-          png_get_sBIT(ctx.png_ptr, ctx.info_ptr, &sig_bits);
-          SetColorData(ppf, png_get_color_type(ctx.png_ptr, ctx.info_ptr),
-                       png_get_bit_depth(ctx.png_ptr, ctx.info_ptr), sig_bits,
-                       png_get_valid(ctx.png_ptr, ctx.info_ptr, PNG_INFO_tRNS));
-          num_channels =
-              ppf->info.num_color_channels + (ppf->info.alpha_bits ? 1 : 0);
-          format = {
-              /*num_channels=*/num_channels,
-              /*data_type=*/ppf->info.bits_per_sample > 8 ? JXL_TYPE_UINT16
-                                                          : JXL_TYPE_UINT8,
-              /*endianness=*/JXL_BIG_ENDIAN,
-              /*align=*/0,
-          };
-          bytes_per_pixel =
-              num_channels * (format.data_type == JXL_TYPE_UINT16 ? 2 : 1);
+          JXL_RETURN_IF_ERROR(SetImageInfo(ctx, image_rect, constraints, ppf,
+                                           &format, &bytes_per_pixel));
           // TODO(eustas): ensure multiplication is safe
           uint64_t row_bytes =
               static_cast<uint64_t>(image_rect.xsize()) * bytes_per_pixel;
@@ -1062,113 +1219,22 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
         continue;
       }
 
-      case MakeTag('c', 'I', 'C', 'P'):
-        if (color_info_type == ColorInfoType::CICP) {
-          JXL_DEBUG_V(2, "Excessive colorspace definition; cICP chunk ignored");
-          continue;
-        }
-        JXL_RETURN_IF_ERROR(DecodeCicpChunk(payload, &ppf->color_encoding));
-        ppf->icc.clear();
-        ppf->primary_color_representation =
-            PackedPixelFile::kColorEncodingIsPrimary;
-        color_info_type = ColorInfoType::CICP;
-        continue;
-
-      case MakeTag('i', 'C', 'C', 'P'): {
-        if (color_info_type == ColorInfoType::ICCP_OR_SRGB) {
-          return JXL_FAILURE("Repeated iCCP / sRGB chunk");
-        }
-        if (color_info_type > ColorInfoType::ICCP_OR_SRGB) {
-          JXL_DEBUG_V(2, "Excessive colorspace definition; iCCP chunk ignored");
-          continue;
-        }
-        // Let PNG decoder deal with chunk processing.
-        if (!ctx.FeedChunks(chunk)) {
-          return JXL_FAILURE("Corrupt iCCP chunk");
-        }
-
-        // TODO(jon): catch special case of PQ and synthesize color encoding
-        // in that case
-        int compression_type = 0;
-        png_bytep profile = nullptr;
-        png_charp name = nullptr;
-        png_uint_32 profile_len = 0;
-        png_uint_32 ok =
-            png_get_iCCP(ctx.png_ptr, ctx.info_ptr, &name, &compression_type,
-                         &profile, &profile_len);
-        if (!ok || !profile_len) {
-          return JXL_FAILURE("Malformed / incomplete iCCP chunk");
-        }
-        ppf->icc.assign(profile, profile + profile_len);
-        ppf->primary_color_representation = PackedPixelFile::kIccIsPrimary;
-        color_info_type = ColorInfoType::ICCP_OR_SRGB;
-        continue;
-      }
-
-      case MakeTag('s', 'R', 'G', 'B'):
-        if (color_info_type == ColorInfoType::ICCP_OR_SRGB) {
-          return JXL_FAILURE("Repeated iCCP / sRGB chunk");
-        }
-        if (color_info_type > ColorInfoType::ICCP_OR_SRGB) {
-          JXL_DEBUG_V(2, "Excessive colorspace definition; sRGB chunk ignored");
-          continue;
-        }
-        JXL_RETURN_IF_ERROR(DecodeSrgbChunk(payload, &ppf->color_encoding));
-        color_info_type = ColorInfoType::ICCP_OR_SRGB;
-        continue;
-
-      case MakeTag('g', 'A', 'M', 'A'):
-        if (color_info_type >= ColorInfoType::GAMA_OR_CHRM) {
-          JXL_DEBUG_V(2, "Excessive colorspace definition; gAMA chunk ignored");
-          continue;
-        }
-        JXL_RETURN_IF_ERROR(DecodeGamaChunk(payload, &ppf->color_encoding));
-        color_info_type = ColorInfoType::GAMA_OR_CHRM;
-        continue;
-
-      case MakeTag('c', 'H', 'R', 'M'):
-        if (color_info_type >= ColorInfoType::GAMA_OR_CHRM) {
-          JXL_DEBUG_V(2, "Excessive colorspace definition; cHRM chunk ignored");
-          continue;
-        }
-        JXL_RETURN_IF_ERROR(DecodeChrmChunk(payload, &ppf->color_encoding));
-        color_info_type = ColorInfoType::GAMA_OR_CHRM;
-        continue;
-
-      case MakeTag('c', 'L', 'L', 'i'):
-        JXL_RETURN_IF_ERROR(
-            DecodeClliChunk(payload, &ppf->info.intensity_target));
-        continue;
-
-      case MakeTag('e', 'X', 'I', 'f'):
-        // TODO(eustas): next eXIF chunk overwrites current; is it ok?
-        ppf->metadata.exif.resize(payload.size());
-        memcpy(ppf->metadata.exif.data(), payload.data(), payload.size());
-        continue;
-
-      default:
-        // We don't know what is that, just pass through.
-        if (!ctx.FeedChunks(chunk)) {
-          return JXL_FAILURE("PNG decoder failed to process chunk");
-        }
+      default: {
+        bool pass_through;
+        JXL_RETURN_IF_ERROR(DecodeMetadataChunk(
+            id, chunk, &ctx, &color_info_type, ppf, &pass_through));
         // If it happens before IDAT, we consider it metadata and pass to all
         // sub-decoders.
-        if (!seen_idat) {
+        if (pass_through && !seen_idat) {
           passthrough_chunks.push_back(chunk);
         }
         continue;
+      }
     }
   }
 
-  bool color_is_already_set = (color_info_type != ColorInfoType::NONE);
-  bool is_gray = (ppf->info.num_color_channels == 1);
-  JXL_RETURN_IF_ERROR(
-      ApplyColorHints(color_hints, color_is_already_set, is_gray, ppf));
-
-  if (ppf->color_encoding.transfer_function != JXL_TRANSFER_FUNCTION_PQ) {
-    // Reset intensity target, in case we set it from cLLi but TF is not PQ.
-    ppf->info.intensity_target = 0.f;
-  }
+  JXL_RETURN_IF_ERROR(FinalizeColorEncoding(
+      color_hints, color_info_type != ColorInfoType::NONE, ppf));
 
   bool has_nontrivial_background = false;
   bool previous_frame_should_be_cleared = false;
@@ -1287,7 +1353,351 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   return true;
 }
 
+// The streaming encoder asks for the rows of a DC group (2048 rows and an
+// 8-row border on each side) at a time; keeping two of them lets reordered
+// requests of neighbouring groups be served without decoding again.
+constexpr size_t kBandRows = 2 * (2048 + 16);
+// Rows decoded ahead of the last requested one, so that the next DC group is
+// ready when the encoder asks for it.
+constexpr size_t kLookaheadRows = 2048 + 16;
+// Compressed bytes per call to the PNG decoder, which bounds the rows that it
+// decodes past the requested ones.
+constexpr size_t kFeedSize = 4096;
+
+// The rows that the encoder may still ask for. A decoder thread inflates and
+// unfilters them ahead of the requests, while the encoder threads wait only
+// for rows that are not ready yet.
+struct ChunkedPNGDecoder::RowStream {
+  ~RowStream() {
+    if (!thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+  }
+
+  static void OnRow(png_structp png_ptr, png_bytep new_row,
+                    png_uint_32 row_num, int pass) {
+    RowStream* stream =
+        reinterpret_cast<RowStream*>(png_get_progressive_ptr(png_ptr));
+    if (row_num != stream->decoded_rows) {
+      stream->has_error = true;
+      return;
+    }
+    ++stream->decoded_rows;
+    if (row_num < stream->skip_below) return;
+    size_t offset = stream->pending.size();
+    stream->pending.resize(offset + stream->row_bytes);
+    png_progressive_combine_row(png_ptr, stream->pending.data() + offset,
+                                new_row);
+  }
+
+  // Called on the decoder thread, or before it starts.
+  Status Restart() {
+    if (!ctx.InitPngDecoder(header_chunks, image_rect, OnRow, this)) {
+      return JXL_FAILURE("Failed to initialize PNG decoder");
+    }
+    feed_pos = 0;
+    decoded_rows = 0;
+    pending.clear();
+    has_error = false;
+    next_row = 0;
+    band_y0 = 0;
+    band.clear();
+    max_requested_y1 = 0;
+    return true;
+  }
+
+  void Start() { thread = std::thread(&RowStream::Run, this); }
+
+  // Decodes the next piece of the image data into `pending`. Called on the
+  // decoder thread without holding the mutex.
+  Status FeedNext() {
+    if (feed_pos == idat.size()) {
+      return JXL_FAILURE("Truncated PNG image data");
+    }
+    size_t size = std::min(kFeedSize, idat.size() - feed_pos);
+    if (!ctx.FeedChunks(Bytes(idat.data() + feed_pos, size))) {
+      return JXL_FAILURE("Decoding IDAT failed");
+    }
+    feed_pos += size;
+    if (has_error) return JXL_FAILURE("Internal error");
+    return true;
+  }
+
+  // Moves the rows in `pending`, which end at `decoded_rows`, to the band.
+  void Publish() {
+    size_t num_pending = pending.size() / row_bytes;
+    size_t first = decoded_rows - num_pending;
+    size_t num_skipped =
+        band_y0 > first ? std::min(band_y0 - first, num_pending) : 0;
+    band.insert(band.end(), pending.begin() + num_skipped * row_bytes,
+                pending.end());
+    pending.clear();
+    next_row = decoded_rows;
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      cv.wait(lock, [this] {
+        return stop || restart_requested ||
+               (!failed && next_row < image_rect.ysize() &&
+                next_row < max_requested_y1 + kLookaheadRows);
+      });
+      if (stop) return;
+      if (restart_requested) {
+        restart_requested = false;
+        failed = !Restart();
+        cv.notify_all();
+        continue;
+      }
+      skip_below = band_y0;
+      lock.unlock();
+      bool ok = static_cast<bool>(FeedNext());
+      lock.lock();
+      if (ok) {
+        Publish();
+      } else {
+        failed = true;
+      }
+      cv.notify_all();
+    }
+  }
+
+  // Returns a copy of the rectangle, so that the band may move before it is
+  // released; nullptr on error.
+  const void* GetRect(size_t xpos, size_t ypos, size_t xsize, size_t ysize,
+                      size_t* row_offset) {
+    const size_t y1 = ypos + ysize;
+    if (y1 > image_rect.ysize()) return nullptr;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      while (!failed && (restart_requested || ypos < band_y0)) {
+        if (!restart_requested) {
+          restart_requested = true;
+          cv.notify_all();
+        }
+        cv.wait(lock);
+      }
+      size_t keep_from = std::min(ypos, y1 > kBandRows ? y1 - kBandRows : 0);
+      if (keep_from > band_y0) {
+        size_t band_end = band_y0 + band.size() / row_bytes;
+        size_t num_dropped = std::min(keep_from, band_end) - band_y0;
+        band.erase(band.begin(), band.begin() + num_dropped * row_bytes);
+        band_y0 = keep_from;
+      }
+      // A restart forgets the requested rows, so the waiting requests raise
+      // the limit of the decoder thread again whenever they wake up.
+      while (!failed && next_row < y1) {
+        if (max_requested_y1 < y1) {
+          max_requested_y1 = y1;
+          cv.notify_all();
+        }
+        cv.wait(lock);
+      }
+      if (failed) return nullptr;
+      // Other requests may have dropped the rows in the meantime.
+      if (ypos >= band_y0) break;
+    }
+    *row_offset = xsize * bytes_per_pixel;
+    uint8_t* rect = new uint8_t[ysize * *row_offset];
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(rect + y * *row_offset,
+             band.data() + (ypos + y - band_y0) * row_bytes +
+                 xpos * bytes_per_pixel,
+             *row_offset);
+    }
+    return rect;
+  }
+
+  Context ctx;
+  // Patched into the PNG decoder before the image data, e.g. PLTE and tRNS.
+  std::vector<Bytes> header_chunks;
+  RectT<uint64_t> image_rect;
+  // The consecutive IDAT chunks, fed in pieces.
+  Bytes idat;
+  JxlPixelFormat format;
+  size_t bytes_per_pixel;
+  size_t row_bytes;
+
+  // Only used by the decoder thread.
+  size_t feed_pos = 0;
+  size_t decoded_rows = 0;
+  size_t skip_below = 0;
+  std::vector<uint8_t> pending;
+  bool has_error = false;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next_row = 0;
+  // Holds the rows [band_y0, next_row), or none while band_y0 > next_row.
+  size_t band_y0 = 0;
+  std::vector<uint8_t> band;
+  size_t max_requested_y1 = 0;
+  bool restart_requested = false;
+  bool failed = false;
+  bool stop = false;
+  std::thread thread;
+};
+
+struct PNGChunkedInputFrame {
+  JxlChunkedFrameInputSource operator()() {
+    return JxlChunkedFrameInputSource{
+        this,
+        METHOD_TO_C_CALLBACK(
+            &PNGChunkedInputFrame::GetColorChannelsPixelFormat),
+        METHOD_TO_C_CALLBACK(&PNGChunkedInputFrame::GetColorChannelDataAt),
+        METHOD_TO_C_CALLBACK(&PNGChunkedInputFrame::GetExtraChannelPixelFormat),
+        METHOD_TO_C_CALLBACK(&PNGChunkedInputFrame::GetExtraChannelDataAt),
+        METHOD_TO_C_CALLBACK(&PNGChunkedInputFrame::ReleaseCurrentData)};
+  }
+
+  void /* NOLINT */ GetColorChannelsPixelFormat(JxlPixelFormat* pixel_format) {
+    *pixel_format = dec->rows_->format;
+  }
+
+  const void* GetColorChannelDataAt(size_t xpos, size_t ypos, size_t xsize,
+                                    size_t ysize, size_t* row_offset) {
+    return dec->rows_->GetRect(xpos, ypos, xsize, ysize, row_offset);
+  }
+
+  void GetExtraChannelPixelFormat(size_t ec_index,
+                                  JxlPixelFormat* pixel_format) {
+    (void)this;
+    *pixel_format = {};
+    JXL_DEBUG_ABORT("Not implemented");
+  }
+
+  const void* GetExtraChannelDataAt(size_t ec_index, size_t xpos, size_t ypos,
+                                    size_t xsize, size_t ysize,
+                                    size_t* row_offset) {
+    (void)this;
+    *row_offset = 0;
+    JXL_DEBUG_ABORT("Not implemented");
+    return nullptr;
+  }
+
+  void ReleaseCurrentData(const void* buffer) {
+    (void)this;
+    delete[] static_cast<const uint8_t*>(buffer);
+  }
+
+  const ChunkedPNGDecoder* dec;
+};
+
+StatusOr<ChunkedPNGDecoder> ChunkedPNGDecoder::Init(const char* file_path) {
+  ChunkedPNGDecoder dec;
+  JXL_ASSIGN_OR_RETURN(dec.png_, MemoryMappedFile::Init(file_path));
+  dec.rows_ = jxl::make_unique<RowStream>();
+  RowStream& rows = *dec.rows_;
+  PackedPixelFile* ppf = &dec.ppf_;
+  SetDefaultInfo(ppf);
+
+  Reader input(Bytes(dec.png_.data(), dec.png_.size()));
+  Bytes sig = input.Read(kPngSignature.size());
+  if (sig.size() != 8 ||
+      memcmp(sig.data(), kPngSignature.data(), kPngSignature.size()) != 0) {
+    return StatusCode::kGenericError;  // Not a PNG
+  }
+
+  Context& ctx = rows.ctx;
+  Bytes ihdr = input.ReadChunk();
+  if (ihdr.size() != ctx.ihdr.size()) {
+    return JXL_FAILURE("Unexpected first chunk payload size");
+  }
+  memcpy(ctx.ihdr.data(), ihdr.data(), ihdr.size());
+  if (LoadLE32(ihdr.data() + 4) != MakeTag('I', 'H', 'D', 'R')) {
+    return JXL_FAILURE("First chunk is not IHDR");
+  }
+  rows.image_rect = RectT<uint64_t>(0, 0, png_get_uint_32(ihdr.data() + 8),
+                                    png_get_uint_32(ihdr.data() + 12));
+  if (!ValidateViewport(rows.image_rect)) {
+    return JXL_FAILURE("PNG image dimensions are too large");
+  }
+  if (ihdr[20] != 0) {
+    return JXL_FAILURE("Interlaced PNG files can not be streamed");
+  }
+  if (!ctx.InitPngDecoder({}, rows.image_rect)) {
+    return JXL_FAILURE("Failed to initialize PNG decoder");
+  }
+
+  // Reads all the metadata, and finds the image data without decoding it.
+  ColorInfoType color_info_type = ColorInfoType::NONE;
+  size_t idat_begin = 0;
+  size_t idat_end = 0;
+  while (!input.Eof()) {
+    const size_t offset = input.offset_;
+    Bytes chunk = input.ReadChunk();
+    if (chunk.empty()) {
+      return JXL_FAILURE("Malformed chunk");
+    }
+    Bytes type(chunk.data() + 4, 4);
+    if (!isAbc(type[0]) || !isAbc(type[1]) || !isAbc(type[2]) ||
+        !isAbc(type[3])) {
+      return JXL_FAILURE("Exotic PNG chunk");
+    }
+    uint32_t id = LoadLE32(type.data());
+    if (id == MakeTag('I', 'E', 'N', 'D')) break;
+    if (id == MakeTag('a', 'c', 'T', 'L')) {
+      return JXL_FAILURE("Animated PNG files can not be streamed");
+    }
+    if (id == MakeTag('I', 'D', 'A', 'T')) {
+      if (idat_end == 0) {
+        idat_begin = offset;
+        JXL_RETURN_IF_ERROR(SetImageInfo(ctx, rows.image_rect, nullptr, ppf,
+                                         &rows.format, &rows.bytes_per_pixel));
+      } else if (offset != idat_end) {
+        return JXL_FAILURE("IDAT chunks are not consecutive");
+      }
+      idat_end = offset + chunk.size();
+      continue;
+    }
+    bool pass_through;
+    JXL_RETURN_IF_ERROR(DecodeMetadataChunk(id, chunk, &ctx, &color_info_type,
+                                            ppf, &pass_through));
+    if (pass_through && idat_end == 0) {
+      rows.header_chunks.push_back(chunk);
+    }
+  }
+  if (idat_end == 0) {
+    return JXL_FAILURE("No IDAT chunks");
+  }
+  ctx.DecodeTextChunks(&ppf->metadata);
+  dec.color_already_set_ = (color_info_type != ColorInfoType::NONE);
+
+  rows.idat = Bytes(dec.png_.data() + idat_begin, idat_end - idat_begin);
+  rows.row_bytes = rows.image_rect.xsize() * rows.bytes_per_pixel;
+  JXL_RETURN_IF_ERROR(rows.Restart());
+  rows.Start();
+  return dec;
+}
+
+Status ChunkedPNGDecoder::InitializePPF(const ColorHints& color_hints,
+                                        PackedPixelFile* ppf) {
+  ppf->info = ppf_.info;
+  ppf->primary_color_representation = ppf_.primary_color_representation;
+  ppf->color_encoding = ppf_.color_encoding;
+  ppf->icc = ppf_.icc;
+  ppf->metadata = ppf_.metadata;
+  JXL_RETURN_IF_ERROR(
+      FinalizeColorEncoding(color_hints, color_already_set_, ppf));
+
+  PNGChunkedInputFrame frame;
+  frame.dec = this;
+  ppf->chunked_frames.emplace_back(ppf->info.xsize, ppf->info.ysize, frame);
+  return true;
+}
+
 #endif  // JPEGXL_ENABLE_APNG
 
+ChunkedPNGDecoder::ChunkedPNGDecoder() = default;
+ChunkedPNGDecoder::~ChunkedPNGDecoder() = default;
+ChunkedPNGDecoder::ChunkedPNGDecoder(ChunkedPNGDecoder&&) noexcept = default;
+ChunkedPNGDecoder& ChunkedPNGDecoder::operator=(ChunkedPNGDecoder&&) noexcept =
+    default;
+
 }  // namespace extras
 }  // namespace jxl
@@ -9,8 +9,10 @@
 // Decodes APNG images in memory.
 
 #include <cstdint>
+#include <memory>
 
 #include "lib/extras/dec/color_hints.h"
+#include "lib/extras/mmap.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
@@ -28,6 +30,33 @@ Status DecodeImageAPNG(Span<const uint8_t> bytes, const ColorHints& color_hints,
                        PackedPixelFile* ppf,
                        const SizeConstraints* constraints = nullptr);
 
+// Decodes the rows of a non-interlaced, non-animated PNG file on a separate
+// thread, a little ahead of the rows that the encoder asks for, and keeps only
+// a band of rows in memory. Earlier rows are decoded again from the start of
+// the image data.
+class ChunkedPNGDecoder {
+ public:
+  static StatusOr<ChunkedPNGDecoder> Init(const char* file_path);
+  // Initializes `ppf` with a pointer to this `ChunkedPNGDecoder`.
+  Status InitializePPF(const ColorHints& color_hints, PackedPixelFile* ppf);
+
+  ChunkedPNGDecoder();                                         // NOLINT
+  ~ChunkedPNGDecoder();                                        // NOLINT
+  ChunkedPNGDecoder(ChunkedPNGDecoder&&) noexcept;             // NOLINT
+  ChunkedPNGDecoder& operator=(ChunkedPNGDecoder&&) noexcept;  // NOLINT
+
+ private:
+  struct RowStream;
+
+  MemoryMappedFile png_;
+  // Everything but the pixels.
+  PackedPixelFile ppf_;
+  bool color_already_set_ = false;
+  std::unique_ptr<RowStream> rows_;
+
+  friend struct PNGChunkedInputFrame;
+};
+
 }  // namespace extras
 }  // namespace jxl
 
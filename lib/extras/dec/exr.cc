@@ -28,6 +28,21 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
   (void)constraints;
   return JXL_FAILURE("EXR is not supported");
 }
+
+struct ChunkedEXRDecoder::RowStream {};
+
+StatusOr<ChunkedEXRDecoder> ChunkedEXRDecoder::Init(const char* file_path) {
+  (void)file_path;
+  return JXL_FAILURE("EXR is not supported");
+}
+
+Status ChunkedEXRDecoder::InitializePPF(const ColorHints& color_hints,
+                                        PackedPixelFile* ppf) {
+  (void)color_hints;
+  (void)ppf;
+  return JXL_FAILURE("EXR is not supported");
+}
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -38,8 +53,14 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
 #include <ImfRgbaFile.h>
 #include <ImfStandardAttributes.h>
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
 #include <vector>
 
+#include "lib/jxl/base/c_callback_support.h"
+
 #ifdef __EXCEPTIONS
 #include <stdexcept>
 #define JXL_EXR_THROW_LENGTH_ERROR() throw std::length_error("");
@@ -97,28 +118,9 @@ class InMemoryIStream : public OpenEXR::IStream {
   size_t pos_ = 0;
 };
 
-}  // namespace
-
-bool CanDecodeEXR() { return true; }
-
-Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
-                      PackedPixelFile* ppf,
-                      const SizeConstraints* constraints) {
-  InMemoryIStream is(bytes);
-
-#ifdef __EXCEPTIONS
-  std::unique_ptr<OpenEXR::RgbaInputFile> input_ptr;
-  try {
-    input_ptr = jxl::make_unique<OpenEXR::RgbaInputFile>(is);
-  } catch (...) {
-    // silently return false if it is not an EXR file
-    return false;
-  }
-  OpenEXR::RgbaInputFile& input = *input_ptr;
-#else
-  OpenEXR::RgbaInputFile input(is);
-#endif
-
+// Sets everything but the pixels of `ppf`, and returns their format.
+Status SetImageInfo(OpenEXR::RgbaInputFile& input, PackedPixelFile* ppf,
+                    JxlPixelFormat* format) {
   if ((input.channels() & OpenEXR::RgbaChannels::WRITE_RGB) !=
       OpenEXR::RgbaChannels::WRITE_RGB) {
     return JXL_FAILURE("only RGB OpenEXR files are supported");
@@ -141,61 +143,12 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
 
   const JxlDataType data_type =
       kExrBitsPerSample == 16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT;
-  const JxlPixelFormat format{
+  *format = {
       /*num_channels=*/3u + (has_alpha ? 1u : 0u),
       /*data_type=*/data_type,
       /*endianness=*/JXL_NATIVE_ENDIAN,
       /*align=*/0,
   };
-  ppf->frames.clear();
-  // Allocates the frame buffer.
-  {
-    JXL_ASSIGN_OR_RETURN(
-        PackedFrame frame,
-        PackedFrame::Create(image_size.x, image_size.y, format));
-    ppf->frames.emplace_back(std::move(frame));
-  }
-  const auto& frame = ppf->frames.back();
-
-  const int row_size = input.dataWindow().size().x + 1;
-  // Number of rows to read at a time.
-  // https://www.openexr.com/documentation/ReadingAndWritingImageFiles.pdf
-  // recommends reading the whole file at once.
-  const int y_chunk_size = input.displayWindow().size().y + 1;
-  std::vector<OpenEXR::Rgba> input_rows(row_size * y_chunk_size);
-  for (int start_y =
-           std::max(input.dataWindow().min.y, input.displayWindow().min.y);
-       start_y <=
-       std::min(input.dataWindow().max.y, input.displayWindow().max.y);
-       start_y += y_chunk_size) {
-    // Inclusive.
-    const int end_y = std::min(
-        start_y + y_chunk_size - 1,
-        std::min(input.dataWindow().max.y, input.displayWindow().max.y));
-    input.setFrameBuffer(
-        input_rows.data() - input.dataWindow().min.x - start_y * row_size,
-        /*xStride=*/1, /*yStride=*/row_size);
-    input.readPixels(start_y, end_y);
-    for (int exr_y = start_y; exr_y <= end_y; ++exr_y) {
-      const int image_y = exr_y - input.displayWindow().min.y;
-      const OpenEXR::Rgba* const JXL_RESTRICT input_row =
-          &input_rows[(exr_y - start_y) * row_size];
-      uint8_t* row = static_cast<uint8_t*>(frame.color.pixels()) +
-                     frame.color.stride * image_y;
-      const uint32_t pixel_size =
-          (3 + (has_alpha ? 1 : 0)) * kExrBitsPerSample / 8;
-      for (int exr_x =
-               std::max(input.dataWindow().min.x, input.displayWindow().min.x);
-           exr_x <=
-           std::min(input.dataWindow().max.x, input.displayWindow().max.x);
-           ++exr_x) {
-        const int image_x = exr_x - input.displayWindow().min.x;
-        // TODO(eustas): UB: OpenEXR::Rgba is not TriviallyCopyable
-        memcpy(row + image_x * pixel_size,
-               input_row + (exr_x - input.dataWindow().min.x), pixel_size);
-      }
-    }
-  }
 
   ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_LINEAR;
   ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
@@ -227,7 +180,229 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
   return true;
 }
 
+// Reads the rows [y0, y1) of the display window to `out`, whose rows are
+// `stride` bytes apart. The pixels outside of the data window are not written.
+void ReadDisplayRows(OpenEXR::RgbaInputFile& input, bool has_alpha, int y0,
+                     int y1, uint8_t* out, size_t stride) {
+  const auto& display = input.displayWindow();
+  const auto& data = input.dataWindow();
+  const int row_size = data.size().x + 1;
+  const int start_y = std::max(data.min.y, display.min.y + y0);
+  // Inclusive.
+  const int end_y = std::min(data.max.y, display.min.y + y1 - 1);
+  if (start_y > end_y) return;
+  // https://www.openexr.com/documentation/ReadingAndWritingImageFiles.pdf
+  // recommends reading all the rows at once.
+  std::vector<OpenEXR::Rgba> input_rows(static_cast<size_t>(row_size) *
+                                        (end_y - start_y + 1));
+  input.setFrameBuffer(input_rows.data() - data.min.x -
+                           static_cast<ptrdiff_t>(start_y) * row_size,
+                       /*xStride=*/1, /*yStride=*/row_size);
+  input.readPixels(start_y, end_y);
+  const uint32_t pixel_size = (3 + (has_alpha ? 1 : 0)) * kExrBitsPerSample / 8;
+  for (int exr_y = start_y; exr_y <= end_y; ++exr_y) {
+    const OpenEXR::Rgba* const JXL_RESTRICT input_row =
+        &input_rows[static_cast<size_t>(exr_y - start_y) * row_size];
+    uint8_t* row = out + stride * (exr_y - display.min.y - y0);
+    for (int exr_x = std::max(data.min.x, display.min.x);
+         exr_x <= std::min(data.max.x, display.max.x); ++exr_x) {
+      const int image_x = exr_x - display.min.x;
+      // TODO(eustas): UB: OpenEXR::Rgba is not TriviallyCopyable
+      memcpy(row + image_x * pixel_size, input_row + (exr_x - data.min.x),
+             pixel_size);
+    }
+  }
+}
+
+}  // namespace
+
+bool CanDecodeEXR() { return true; }
+
+Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
+                      PackedPixelFile* ppf,
+                      const SizeConstraints* constraints) {
+  InMemoryIStream is(bytes);
+
+#ifdef __EXCEPTIONS
+  std::unique_ptr<OpenEXR::RgbaInputFile> input_ptr;
+  try {
+    input_ptr = jxl::make_unique<OpenEXR::RgbaInputFile>(is);
+  } catch (...) {
+    // silently return false if it is not an EXR file
+    return false;
+  }
+  OpenEXR::RgbaInputFile& input = *input_ptr;
+#else
+  OpenEXR::RgbaInputFile input(is);
+#endif
+
+  JxlPixelFormat format;
+  JXL_RETURN_IF_ERROR(SetImageInfo(input, ppf, &format));
+  ppf->frames.clear();
+  // Allocates the frame buffer.
+  {
+    JXL_ASSIGN_OR_RETURN(
+        PackedFrame frame,
+        PackedFrame::Create(ppf->info.xsize, ppf->info.ysize, format));
+    ppf->frames.emplace_back(std::move(frame));
+  }
+  const auto& frame = ppf->frames.back();
+  ReadDisplayRows(input, format.num_channels == 4, 0, ppf->info.ysize,
+                  static_cast<uint8_t*>(frame.color.pixels()),
+                  frame.color.stride);
+  return true;
+}
+
+// The last rows that the encoder asked for.
+struct ChunkedEXRDecoder::RowStream {
+  explicit RowStream(Bytes bytes) : is(bytes) {}
+
+  Status Open() {
+#ifdef __EXCEPTIONS
+    try {
+      input = jxl::make_unique<OpenEXR::RgbaInputFile>(is);
+    } catch (...) {
+      // silently return false if it is not an EXR file
+      return false;
+    }
+#else
+    input = jxl::make_unique<OpenEXR::RgbaInputFile>(is);
+#endif
+    return true;
+  }
+
+  // Makes the rows [y0, y1) available in `band`.
+  Status Fill(size_t y0, size_t y1) {
+    if (y0 >= band_y0 && y1 <= band_y1) return true;
+    band.assign((y1 - y0) * row_bytes, 0);
+    band_y0 = band_y1 = 0;
+#ifdef __EXCEPTIONS
+    try {
+      ReadDisplayRows(*input, format.num_channels == 4, static_cast<int>(y0),
+                      static_cast<int>(y1), band.data(), row_bytes);
+    } catch (...) {
+      return JXL_FAILURE("Failed to read the EXR rows");
+    }
+#else
+    ReadDisplayRows(*input, format.num_channels == 4, static_cast<int>(y0),
+                    static_cast<int>(y1), band.data(), row_bytes);
+#endif
+    band_y0 = y0;
+    band_y1 = y1;
+    return true;
+  }
+
+  // Returns a copy of the rectangle, so that the band may move before it is
+  // released; nullptr on error.
+  const void* GetRect(size_t xpos, size_t ypos, size_t xsize, size_t ysize,
+                      size_t* row_offset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Fill(ypos, ypos + ysize)) return nullptr;
+    *row_offset = xsize * bytes_per_pixel;
+    uint8_t* rect = new uint8_t[ysize * *row_offset];
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(rect + y * *row_offset,
+             band.data() + (ypos + y - band_y0) * row_bytes +
+                 xpos * bytes_per_pixel,
+             *row_offset);
+    }
+    return rect;
+  }
+
+  InMemoryIStream is;
+  std::unique_ptr<OpenEXR::RgbaInputFile> input;
+  JxlPixelFormat format;
+  size_t bytes_per_pixel;
+  size_t row_bytes;
+
+  std::mutex mutex;
+  size_t band_y0 = 0;
+  size_t band_y1 = 0;
+  std::vector<uint8_t> band;
+};
+
+struct EXRChunkedInputFrame {
+  JxlChunkedFrameInputSource operator()() {
+    return JxlChunkedFrameInputSource{
+        this,
+        METHOD_TO_C_CALLBACK(
+            &EXRChunkedInputFrame::GetColorChannelsPixelFormat),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::GetColorChannelDataAt),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::GetExtraChannelPixelFormat),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::GetExtraChannelDataAt),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::ReleaseCurrentData)};
+  }
+
+  void /* NOLINT */ GetColorChannelsPixelFormat(JxlPixelFormat* pixel_format) {
+    *pixel_format = dec->rows_->format;
+  }
+
+  const void* GetColorChannelDataAt(size_t xpos, size_t ypos, size_t xsize,
+                                    size_t ysize, size_t* row_offset) {
+    return dec->rows_->GetRect(xpos, ypos, xsize, ysize, row_offset);
+  }
+
+  void GetExtraChannelPixelFormat(size_t ec_index,
+                                  JxlPixelFormat* pixel_format) {
+    (void)this;
+    *pixel_format = {};
+    JXL_DEBUG_ABORT("Not implemented");
+  }
+
+  const void* GetExtraChannelDataAt(size_t ec_index, size_t xpos, size_t ypos,
+                                    size_t xsize, size_t ysize,
+                                    size_t* row_offset) {
+    (void)this;
+    *row_offset = 0;
+    JXL_DEBUG_ABORT("Not implemented");
+    return nullptr;
+  }
+
+  void ReleaseCurrentData(const void* buffer) {
+    (void)this;
+    delete[] static_cast<const uint8_t*>(buffer);
+  }
+
+  const ChunkedEXRDecoder* dec;
+};
+
+StatusOr<ChunkedEXRDecoder> ChunkedEXRDecoder::Init(const char* file_path) {
+  ChunkedEXRDecoder dec;
+  JXL_ASSIGN_OR_RETURN(dec.exr_, MemoryMappedFile::Init(file_path));
+  dec.rows_ =
+      jxl::make_unique<RowStream>(Bytes(dec.exr_.data(), dec.exr_.size()));
+  RowStream& rows = *dec.rows_;
+  JXL_RETURN_IF_ERROR(rows.Open());
+  JXL_RETURN_IF_ERROR(SetImageInfo(*rows.input, &dec.ppf_, &rows.format));
+  rows.bytes_per_pixel = rows.format.num_channels * kExrBitsPerSample / 8;
+  rows.row_bytes = dec.ppf_.info.xsize * rows.bytes_per_pixel;
+  return dec;
+}
+
+Status ChunkedEXRDecoder::InitializePPF(const ColorHints& color_hints,
+                                        PackedPixelFile* ppf) {
+  (void)color_hints;
+  ppf->info = ppf_.info;
+  ppf->color_encoding = ppf_.color_encoding;
+  EXRChunkedInputFrame frame;
+  frame.dec = this;
+  ppf->chunked_frames.emplace_back(ppf->info.xsize, ppf->info.ysize, frame);
+  return true;
+}
+
 }  // namespace extras
 }  // namespace jxl
 
 #endif  // JPEGXL_ENABLE_EXR
+
+namespace jxl {
+namespace extras {
+
+ChunkedEXRDecoder::ChunkedEXRDecoder() = default;
+ChunkedEXRDecoder::~ChunkedEXRDecoder() = default;
+ChunkedEXRDecoder::ChunkedEXRDecoder(ChunkedEXRDecoder&&) noexcept = default;
+ChunkedEXRDecoder& ChunkedEXRDecoder::operator=(ChunkedEXRDecoder&&) noexcept =
+    default;
+
+}  // namespace extras
+}  // namespace jxl
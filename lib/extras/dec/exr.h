@@ -9,8 +9,10 @@
 // Decodes OpenEXR images in memory.
 
 #include <cstdint>
+#include <memory>
 
 #include "lib/extras/dec/color_hints.h"
+#include "lib/extras/mmap.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/span.h"
@@ -29,6 +31,31 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints = nullptr);
 
+// Decodes the rows of an OpenEXR file when the encoder asks for them, and
+// keeps only the last rows that it asked for in memory.
+class ChunkedEXRDecoder {
+ public:
+  static StatusOr<ChunkedEXRDecoder> Init(const char* file_path);
+  // Initializes `ppf` with a pointer to this `ChunkedEXRDecoder`. color_hints
+  // are ignored.
+  Status InitializePPF(const ColorHints& color_hints, PackedPixelFile* ppf);
+
+  ChunkedEXRDecoder();                                         // NOLINT
+  ~ChunkedEXRDecoder();                                        // NOLINT
+  ChunkedEXRDecoder(ChunkedEXRDecoder&&) noexcept;             // NOLINT
+  ChunkedEXRDecoder& operator=(ChunkedEXRDecoder&&) noexcept;  // NOLINT
+
+ private:
+  struct RowStream;
+
+  MemoryMappedFile exr_;
+  // Everything but the pixels.
+  PackedPixelFile ppf_;
+  std::unique_ptr<RowStream> rows_;
+
+  friend struct EXRChunkedInputFrame;
+};
+
 }  // namespace extras
 }  // namespace jxl
 
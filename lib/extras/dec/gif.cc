@@ -12,6 +12,7 @@
 #endif
 #include <jxl/codestream_header.h>
 
+#include <algorithm>
 #include <cstring>
 #include <memory>
 #include <utility>
@@ -62,23 +63,100 @@ Status ensure_have_alpha(PackedFrame* frame) {
               frame->color.xsize * frame->color.ysize, 255u);
   return true;
 }
-}  // namespace
-#endif
 
-bool CanDecodeGIF() {
-#if JPEGXL_ENABLE_GIF
-  return true;
-#else
-  return false;
-#endif
-}
+// The part of the compositing state that only depends on the frame headers.
+struct FrameGeometry {
+  Rect previous_rect_if_restore_to_background;
+  bool last_base_was_none = true;
 
-Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
-                      PackedPixelFile* ppf,
-                      const SizeConstraints* constraints) {
-#if JPEGXL_ENABLE_GIF
+  // Computes the rect that is stored for the next frame and whether it
+  // replaces the canvas there, and whether the frame before it was not kept as
+  // a reference.
+  void Next(const Rect& image_rect, int disposal_mode, bool have_animation,
+            Rect* total_rect, bool* replace, bool* base_was_none) {
+    if (previous_rect_if_restore_to_background.xsize() != 0 ||
+        previous_rect_if_restore_to_background.ysize() != 0) {
+      const size_t xbegin = std::min(
+          image_rect.x0(), previous_rect_if_restore_to_background.x0());
+      const size_t ybegin = std::min(
+          image_rect.y0(), previous_rect_if_restore_to_background.y0());
+      const size_t xend =
+          std::max(image_rect.x0() + image_rect.xsize(),
+                   previous_rect_if_restore_to_background.x0() +
+                       previous_rect_if_restore_to_background.xsize());
+      const size_t yend =
+          std::max(image_rect.y0() + image_rect.ysize(),
+                   previous_rect_if_restore_to_background.y0() +
+                       previous_rect_if_restore_to_background.ysize());
+      *total_rect = Rect(xbegin, ybegin, xend - xbegin, yend - ybegin);
+      previous_rect_if_restore_to_background = Rect();
+      *replace = true;
+    } else {
+      *total_rect = image_rect;
+      *replace = false;
+    }
+    *base_was_none = last_base_was_none;
+    if (have_animation) {
+      if (last_base_was_none) {
+        *replace = true;
+      }
+      switch (disposal_mode) {
+        case DISPOSE_DO_NOT:
+        case DISPOSE_BACKGROUND:
+          last_base_was_none = false;
+          break;
+        case DISPOSE_PREVIOUS:
+          break;
+        default:
+          last_base_was_none = true;
+      }
+    }
+    if (disposal_mode == DISPOSE_BACKGROUND) {
+      previous_rect_if_restore_to_background = image_rect;
+    }
+  }
+};
+
+// Composites the frames of a GIF one at a time, in order.
+class GIFFrameSource : public PackedFrameSource {
+ public:
+  // Returns false without an error message if `bytes` is not a GIF. `bytes`
+  // must outlive the source.
+  Status Init(Span<const uint8_t> bytes, const ColorHints& color_hints,
+              PackedPixelFile* ppf, const SizeConstraints* constraints);
+
+  size_t num_frames() const override { return gif_->ImageCount; }
+
+  Status Rewind() override {
+    std::fill_n(static_cast<PackedRgba*>(canvas_->pixels()),
+                canvas_->xsize * canvas_->ysize, background_rgba_);
+    geometry_ = FrameGeometry();
+    next_frame_ = 0;
+    return true;
+  }
+
+  Status NextFrame(std::unique_ptr<PackedFrame>* frame) override;
+
+ private:
+  ReadState state_;
+  GifUniquePtr gif_;
+  bool have_animation_ = false;
+  // Whether the frames have an alpha channel.
+  bool needs_alpha_ = false;
+  PackedRgba background_rgba_;
+  // The 'canvas' onto which we paint the (potentially individually cropped)
+  // GIF frames of an animation.
+  std::unique_ptr<PackedImage> canvas_;
+  FrameGeometry geometry_;
+  int next_frame_ = 0;
+};
+
+Status GIFFrameSource::Init(Span<const uint8_t> bytes,
+                            const ColorHints& color_hints,
+                            PackedPixelFile* ppf,
+                            const SizeConstraints* constraints) {
   int error = GIF_OK;
-  ReadState state = {bytes};
+  state_ = {bytes};
   const auto ReadFromSpan = [](GifFileType* const gif, GifByteType* const bytes,
                                int n) {
     ReadState* const state = reinterpret_cast<ReadState*>(gif->UserData);
@@ -90,8 +168,8 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
     if (!state->bytes.remove_prefix(n)) return 0;
     return n;
   };
-  GifUniquePtr gif(DGifOpen(&state, ReadFromSpan, &error));
-  if (gif == nullptr) {
+  gif_.reset(DGifOpen(&state_, ReadFromSpan, &error));
+  if (gif_ == nullptr) {
     if (error == D_GIF_ERR_NOT_GIF_FILE) {
       // Not an error.
       return false;
@@ -99,12 +177,13 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
       return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(error));
     }
   }
-  error = DGifSlurp(gif.get());
+  GifFileType* gif = gif_.get();
+  error = DGifSlurp(gif);
   if (error != GIF_OK) {
     return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(gif->Error));
   }
 
-  msan::UnpoisonMemory(gif.get(), sizeof(*gif));
+  msan::UnpoisonMemory(gif, sizeof(*gif));
   if (gif->SColorMap) {
     msan::UnpoisonMemory(gif->SColorMap, sizeof(*gif->SColorMap));
     msan::UnpoisonMemory(
@@ -141,48 +220,55 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
     }
   }
 
-  if (gif->ImageCount > 1) {
+  have_animation_ = gif->ImageCount > 1;
+  if (have_animation_) {
     ppf->info.have_animation = JXL_TRUE;
     // Delays in GIF are specified in censiseconds.
     ppf->info.animation.tps_numerator = 100;
     ppf->info.animation.tps_denominator = 1;
   }
 
-  ppf->frames.clear();
-  ppf->frames.reserve(gif->ImageCount);
-
   ppf->info.xsize = gif->SWidth;
   ppf->info.ysize = gif->SHeight;
   ppf->info.bits_per_sample = 8;
   ppf->info.exponent_bits_per_sample = 0;
-  // alpha_bits is later set to 8 if we find a frame with transparent pixels.
-  ppf->info.alpha_bits = 0;
   ppf->info.alpha_exponent_bits = 0;
   JXL_RETURN_IF_ERROR(ApplyColorHints(color_hints, /*color_already_set=*/false,
                                       /*is_gray=*/false, ppf));
 
   ppf->info.num_color_channels = 3;
 
-  // Pixel format for the 'canvas' onto which we paint
-  // the (potentially individually cropped) GIF frames
-  // of an animation.
+  // A frame gets an alpha channel as soon as it has a pixel (see
+  // set_pixel_alpha in NextFrame), and then every frame needs one. Since this
+  // only depends on the rects, it is known before compositing any frame.
+  FrameGeometry geometry;
+  for (int i = 0; i < gif->ImageCount; ++i) {
+    const SavedImage& image = gif->SavedImages[i];
+    msan::UnpoisonMemory(image.RasterBits, sizeof(*image.RasterBits) *
+                                               image.ImageDesc.Width *
+                                               image.ImageDesc.Height);
+    const Rect image_rect(image.ImageDesc.Left, image.ImageDesc.Top,
+                          image.ImageDesc.Width, image.ImageDesc.Height);
+    GraphicsControlBlock gcb;
+    DGifSavedExtensionToGCB(gif, i, &gcb);
+    msan::UnpoisonMemory(&gcb, sizeof(gcb));
+    Rect total_rect;
+    bool replace;
+    bool base_was_none;
+    geometry.Next(image_rect, gcb.DisposalMode, have_animation_, &total_rect,
+                  &replace, &base_was_none);
+    if (total_rect.xsize() != 0 && total_rect.ysize() != 0) {
+      needs_alpha_ = true;
+    }
+  }
+  ppf->info.alpha_bits = needs_alpha_ ? 8 : 0;
+
   const JxlPixelFormat canvas_format{
       /*num_channels=*/4u,
       /*data_type=*/JXL_TYPE_UINT8,
       /*endianness=*/JXL_NATIVE_ENDIAN,
       /*align=*/0,
   };
-
-  // Pixel format for the JXL PackedFrame that goes into the
-  // PackedPixelFile. Here, we use 3 color channels, and provide
-  // the alpha channel as an extra_channel wherever it is used.
-  const JxlPixelFormat packed_frame_format{
-      /*num_channels=*/3u,
-      /*data_type=*/JXL_TYPE_UINT8,
-      /*endianness=*/JXL_NATIVE_ENDIAN,
-      /*align=*/0,
-  };
-
   GifColorType background_color;
   if (gif->SColorMap == nullptr ||
       gif->SBackGroundColor >= gif->SColorMap->ColorCount) {
@@ -190,237 +276,220 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
   } else {
     background_color = gif->SColorMap->Colors[gif->SBackGroundColor];
   }
-  const PackedRgba background_rgba{background_color.Red, background_color.Green,
-                                   background_color.Blue, 0};
+  background_rgba_ = {background_color.Red, background_color.Green,
+                      background_color.Blue, 0};
   JXL_ASSIGN_OR_RETURN(
-      PackedFrame canvas,
-      PackedFrame::Create(gif->SWidth, gif->SHeight, canvas_format));
-  std::fill_n(static_cast<PackedRgba*>(canvas.color.pixels()),
-              canvas.color.xsize * canvas.color.ysize, background_rgba);
-  Rect canvas_rect{0, 0, canvas.color.xsize, canvas.color.ysize};
+      PackedImage canvas,
+      PackedImage::Create(gif->SWidth, gif->SHeight, canvas_format));
+  canvas_ = jxl::make_unique<PackedImage>(std::move(canvas));
+  return Rewind();
+}
 
-  Rect previous_rect_if_restore_to_background;
+Status GIFFrameSource::NextFrame(std::unique_ptr<PackedFrame>* result) {
+  result->reset();
+  if (next_frame_ == gif_->ImageCount) return true;
+  const int i = next_frame_++;
+  const SavedImage& image = gif_->SavedImages[i];
+  const Rect canvas_rect{0, 0, canvas_->xsize, canvas_->ysize};
+  const Rect image_rect(image.ImageDesc.Left, image.ImageDesc.Top,
+                        image.ImageDesc.Width, image.ImageDesc.Height);
+
+  GraphicsControlBlock gcb;
+  DGifSavedExtensionToGCB(gif_.get(), i, &gcb);
+  msan::UnpoisonMemory(&gcb, sizeof(gcb));
+
+  Rect total_rect;
+  bool replace;
+  bool last_base_was_none;
+  geometry_.Next(image_rect, gcb.DisposalMode, have_animation_, &total_rect,
+                 &replace, &last_base_was_none);
+  if (!image_rect.IsInside(canvas_rect)) {
+    return JXL_FAILURE("GIF frame extends outside of the canvas");
+  }
 
-  bool replace = true;
-  bool last_base_was_none = true;
-  for (int i = 0; i < gif->ImageCount; ++i) {
-    const SavedImage& image = gif->SavedImages[i];
-    msan::UnpoisonMemory(image.RasterBits, sizeof(*image.RasterBits) *
-                                               image.ImageDesc.Width *
-                                               image.ImageDesc.Height);
-    const Rect image_rect(image.ImageDesc.Left, image.ImageDesc.Top,
-                          image.ImageDesc.Width, image.ImageDesc.Height);
+  // Pixel format for the JXL PackedFrame that goes into the
+  // PackedPixelFile. Here, we use 3 color channels, and provide
+  // the alpha channel as an extra_channel wherever it is used.
+  const JxlPixelFormat packed_frame_format{
+      /*num_channels=*/3u,
+      /*data_type=*/JXL_TYPE_UINT8,
+      /*endianness=*/JXL_NATIVE_ENDIAN,
+      /*align=*/0,
+  };
+  JXL_ASSIGN_OR_RETURN(PackedFrame packed_frame,
+                       PackedFrame::Create(total_rect.xsize(),
+                                           total_rect.ysize(),
+                                           packed_frame_format));
+  std::unique_ptr<PackedFrame> frame_holder =
+      jxl::make_unique<PackedFrame>(std::move(packed_frame));
+  PackedFrame* frame = frame_holder.get();
+
+  auto set_pixel_alpha = [&frame](size_t x, size_t y, uint8_t a) -> Status {
+    // If we do not have an alpha-channel and a==255 (fully opaque),
+    // we can skip setting this pixel-value and rely on
+    // "no alpha channel = no transparency".
+    if (a == 255 && !frame->extra_channels.empty()) return true;
+    JXL_RETURN_IF_ERROR(ensure_have_alpha(frame));
+    static_cast<uint8_t*>(
+        frame->extra_channels[0].pixels())[y * frame->color.xsize + x] = a;
+    return true;
+  };
 
-    Rect total_rect;
-    if (previous_rect_if_restore_to_background.xsize() != 0 ||
-        previous_rect_if_restore_to_background.ysize() != 0) {
-      const size_t xbegin = std::min(
-          image_rect.x0(), previous_rect_if_restore_to_background.x0());
-      const size_t ybegin = std::min(
-          image_rect.y0(), previous_rect_if_restore_to_background.y0());
-      const size_t xend =
-          std::max(image_rect.x0() + image_rect.xsize(),
-                   previous_rect_if_restore_to_background.x0() +
-                       previous_rect_if_restore_to_background.xsize());
-      const size_t yend =
-          std::max(image_rect.y0() + image_rect.ysize(),
-                   previous_rect_if_restore_to_background.y0() +
-                       previous_rect_if_restore_to_background.ysize());
-      total_rect = Rect(xbegin, ybegin, xend - xbegin, yend - ybegin);
-      previous_rect_if_restore_to_background = Rect();
-      replace = true;
-    } else {
-      total_rect = image_rect;
-      replace = false;
-    }
-    if (!image_rect.IsInside(canvas_rect)) {
-      return JXL_FAILURE("GIF frame extends outside of the canvas");
+  const ColorMapObject* const color_map =
+      image.ImageDesc.ColorMap ? image.ImageDesc.ColorMap : gif_->SColorMap;
+  JXL_ENSURE(color_map);
+  msan::UnpoisonMemory(color_map, sizeof(*color_map));
+  msan::UnpoisonMemory(color_map->Colors,
+                       sizeof(*color_map->Colors) * color_map->ColorCount);
+  bool is_full_size = total_rect.x0() == 0 && total_rect.y0() == 0 &&
+                      total_rect.xsize() == canvas_->xsize &&
+                      total_rect.ysize() == canvas_->ysize;
+  if (have_animation_) {
+    frame->frame_info.duration = gcb.DelayTime;
+    frame->frame_info.layer_info.have_crop = static_cast<int>(!is_full_size);
+    frame->frame_info.layer_info.crop_x0 = total_rect.x0();
+    frame->frame_info.layer_info.crop_y0 = total_rect.y0();
+    frame->frame_info.layer_info.xsize = frame->color.xsize;
+    frame->frame_info.layer_info.ysize = frame->color.ysize;
+    frame->frame_info.layer_info.blend_info.blendmode =
+        replace ? JXL_BLEND_REPLACE : JXL_BLEND_BLEND;
+    // We always only reference at most the last frame
+    frame->frame_info.layer_info.blend_info.source =
+        last_base_was_none ? 0u : 1u;
+    frame->frame_info.layer_info.blend_info.clamp = 1;
+    frame->frame_info.layer_info.blend_info.alpha = 0;
+    // TODO(veluca): this could in principle be implemented.
+    if (last_base_was_none && (!is_full_size || !replace)) {
+      return JXL_FAILURE(
+          "GIF with dispose-to-0 is not supported for non-full or "
+          "blended frames");
     }
-
-    // Allocates the frame buffer.
-    {
-      JXL_ASSIGN_OR_RETURN(
-          PackedFrame frame,
-          PackedFrame::Create(total_rect.xsize(), total_rect.ysize(),
-                              packed_frame_format));
-      ppf->frames.emplace_back(std::move(frame));
+    switch (gcb.DisposalMode) {
+      case DISPOSE_DO_NOT:
+      case DISPOSE_BACKGROUND:
+        frame->frame_info.layer_info.save_as_reference = 1u;
+        break;
+      default:
+        frame->frame_info.layer_info.save_as_reference = 0u;
     }
+  }
 
-    PackedFrame* frame = &ppf->frames.back();
-
-    // We cannot tell right from the start whether there will be a
-    // need for an alpha channel. This is discovered only as soon as
-    // we see a transparent pixel. We hence initialize alpha lazily.
-    auto set_pixel_alpha = [&frame](size_t x, size_t y, uint8_t a) -> Status {
-      // If we do not have an alpha-channel and a==255 (fully opaque),
-      // we can skip setting this pixel-value and rely on
-      // "no alpha channel = no transparency".
-      if (a == 255 && !frame->extra_channels.empty()) return true;
-      JXL_RETURN_IF_ERROR(ensure_have_alpha(frame));
-      static_cast<uint8_t*>(
-          frame->extra_channels[0].pixels())[y * frame->color.xsize + x] = a;
-      return true;
-    };
-
-    const ColorMapObject* const color_map =
-        image.ImageDesc.ColorMap ? image.ImageDesc.ColorMap : gif->SColorMap;
-    JXL_ENSURE(color_map);
-    msan::UnpoisonMemory(color_map, sizeof(*color_map));
-    msan::UnpoisonMemory(color_map->Colors,
-                         sizeof(*color_map->Colors) * color_map->ColorCount);
-    GraphicsControlBlock gcb;
-    DGifSavedExtensionToGCB(gif.get(), i, &gcb);
-    msan::UnpoisonMemory(&gcb, sizeof(gcb));
-    bool is_full_size = total_rect.x0() == 0 && total_rect.y0() == 0 &&
-                        total_rect.xsize() == canvas.color.xsize &&
-                        total_rect.ysize() == canvas.color.ysize;
-    if (ppf->info.have_animation) {
-      frame->frame_info.duration = gcb.DelayTime;
-      frame->frame_info.layer_info.have_crop = static_cast<int>(!is_full_size);
-      frame->frame_info.layer_info.crop_x0 = total_rect.x0();
-      frame->frame_info.layer_info.crop_y0 = total_rect.y0();
-      frame->frame_info.layer_info.xsize = frame->color.xsize;
-      frame->frame_info.layer_info.ysize = frame->color.ysize;
-      if (last_base_was_none) {
-        replace = true;
-      }
-      frame->frame_info.layer_info.blend_info.blendmode =
-          replace ? JXL_BLEND_REPLACE : JXL_BLEND_BLEND;
-      // We always only reference at most the last frame
-      frame->frame_info.layer_info.blend_info.source =
-          last_base_was_none ? 0u : 1u;
-      frame->frame_info.layer_info.blend_info.clamp = 1;
-      frame->frame_info.layer_info.blend_info.alpha = 0;
-      // TODO(veluca): this could in principle be implemented.
-      if (last_base_was_none &&
-          (total_rect.x0() != 0 || total_rect.y0() != 0 ||
-           total_rect.xsize() != canvas.color.xsize ||
-           total_rect.ysize() != canvas.color.ysize || !replace)) {
-        return JXL_FAILURE(
-            "GIF with dispose-to-0 is not supported for non-full or "
-            "blended frames");
+  // Update the canvas by creating a copy first.
+  JXL_ASSIGN_OR_RETURN(
+      PackedImage new_canvas_image,
+      PackedImage::Create(canvas_->xsize, canvas_->ysize, canvas_->format));
+  memcpy(new_canvas_image.pixels(), canvas_->pixels(),
+         new_canvas_image.pixels_size);
+  for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
+    // Assumes format.align == 0. row points to the beginning of the y row in
+    // the image_rect.
+    PackedRgba* row = static_cast<PackedRgba*>(new_canvas_image.pixels()) +
+                      (y + image_rect.y0()) * new_canvas_image.xsize +
+                      image_rect.x0();
+    for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
+      const GifByteType byte = image.RasterBits[byte_index];
+      if (byte >= color_map->ColorCount) {
+        return JXL_FAILURE("GIF color is out of bounds");
       }
-      switch (gcb.DisposalMode) {
-        case DISPOSE_DO_NOT:
-        case DISPOSE_BACKGROUND:
-          frame->frame_info.layer_info.save_as_reference = 1u;
-          last_base_was_none = false;
-          break;
-        case DISPOSE_PREVIOUS:
-          frame->frame_info.layer_info.save_as_reference = 0u;
-          break;
-        default:
-          frame->frame_info.layer_info.save_as_reference = 0u;
-          last_base_was_none = true;
+
+      if (byte == gcb.TransparentColor) continue;
+      GifColorType color = color_map->Colors[byte];
+      row[x].r = color.Red;
+      row[x].g = color.Green;
+      row[x].b = color.Blue;
+      row[x].a = 255;
+    }
+  }
+  const PackedImage& sub_frame_image = frame->color;
+  if (replace) {
+    // Copy from the new canvas image to the subframe
+    for (size_t y = 0; y < total_rect.ysize(); ++y) {
+      const PackedRgba* row_in =
+          static_cast<const PackedRgba*>(new_canvas_image.pixels()) +
+          (y + total_rect.y0()) * new_canvas_image.xsize + total_rect.x0();
+      PackedRgb* row_out = static_cast<PackedRgb*>(sub_frame_image.pixels()) +
+                           y * sub_frame_image.xsize;
+      for (size_t x = 0; x < sub_frame_image.xsize; ++x) {
+        row_out[x].r = row_in[x].r;
+        row_out[x].g = row_in[x].g;
+        row_out[x].b = row_in[x].b;
+        JXL_RETURN_IF_ERROR(set_pixel_alpha(x, y, row_in[x].a));
       }
     }
-
-    // Update the canvas by creating a copy first.
-    JXL_ASSIGN_OR_RETURN(
-        PackedImage new_canvas_image,
-        PackedImage::Create(canvas.color.xsize, canvas.color.ysize,
-                            canvas.color.format));
-    memcpy(new_canvas_image.pixels(), canvas.color.pixels(),
-           new_canvas_image.pixels_size);
+  } else {
     for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
-      // Assumes format.align == 0. row points to the beginning of the y row in
-      // the image_rect.
-      PackedRgba* row = static_cast<PackedRgba*>(new_canvas_image.pixels()) +
-                        (y + image_rect.y0()) * new_canvas_image.xsize +
-                        image_rect.x0();
+      // Assumes format.align == 0
+      PackedRgb* row = static_cast<PackedRgb*>(sub_frame_image.pixels()) +
+                       y * sub_frame_image.xsize;
       for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
         const GifByteType byte = image.RasterBits[byte_index];
-        if (byte >= color_map->ColorCount) {
+        if (byte > color_map->ColorCount) {
           return JXL_FAILURE("GIF color is out of bounds");
         }
-
-        if (byte == gcb.TransparentColor) continue;
+        if (byte == gcb.TransparentColor) {
+          row[x].r = 0;
+          row[x].g = 0;
+          row[x].b = 0;
+          JXL_RETURN_IF_ERROR(set_pixel_alpha(x, y, 0));
+          continue;
+        }
         GifColorType color = color_map->Colors[byte];
         row[x].r = color.Red;
         row[x].g = color.Green;
         row[x].b = color.Blue;
-        row[x].a = 255;
+        JXL_RETURN_IF_ERROR(set_pixel_alpha(x, y, 255));
       }
     }
-    const PackedImage& sub_frame_image = frame->color;
-    if (replace) {
-      // Copy from the new canvas image to the subframe
-      for (size_t y = 0; y < total_rect.ysize(); ++y) {
-        const PackedRgba* row_in =
-            static_cast<const PackedRgba*>(new_canvas_image.pixels()) +
-            (y + total_rect.y0()) * new_canvas_image.xsize + total_rect.x0();
-        PackedRgb* row_out = static_cast<PackedRgb*>(sub_frame_image.pixels()) +
-                             y * sub_frame_image.xsize;
-        for (size_t x = 0; x < sub_frame_image.xsize; ++x) {
-          row_out[x].r = row_in[x].r;
-          row_out[x].g = row_in[x].g;
-          row_out[x].b = row_in[x].b;
-          JXL_RETURN_IF_ERROR(set_pixel_alpha(x, y, row_in[x].a));
-        }
-      }
-    } else {
-      for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
-        // Assumes format.align == 0
-        PackedRgb* row = static_cast<PackedRgb*>(sub_frame_image.pixels()) +
-                         y * sub_frame_image.xsize;
-        for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
-          const GifByteType byte = image.RasterBits[byte_index];
-          if (byte > color_map->ColorCount) {
-            return JXL_FAILURE("GIF color is out of bounds");
-          }
-          if (byte == gcb.TransparentColor) {
-            row[x].r = 0;
-            row[x].g = 0;
-            row[x].b = 0;
-            JXL_RETURN_IF_ERROR(set_pixel_alpha(x, y, 0));
-            continue;
-          }
-          GifColorType color = color_map->Colors[byte];
-          row[x].r = color.Red;
-          row[x].g = color.Green;
-          row[x].b = color.Blue;
-          JXL_RETURN_IF_ERROR(set_pixel_alpha(x, y, 255));
-        }
-      }
-    }
-
-    if (!frame->extra_channels.empty()) {
-      ppf->info.alpha_bits = 8;
-    }
-
-    switch (gcb.DisposalMode) {
-      case DISPOSE_DO_NOT:
-        canvas.color = std::move(new_canvas_image);
-        break;
+  }
 
-      case DISPOSE_BACKGROUND:
-        std::fill_n(static_cast<PackedRgba*>(canvas.color.pixels()),
-                    canvas.color.xsize * canvas.color.ysize, background_rgba);
-        previous_rect_if_restore_to_background = image_rect;
-        break;
+  // If any frame has an alpha-channel, every frame will need to have one.
+  JXL_ENSURE(needs_alpha_ || frame->extra_channels.empty());
+  if (needs_alpha_) {
+    JXL_RETURN_IF_ERROR(ensure_have_alpha(frame));
+  }
 
-      case DISPOSE_PREVIOUS:
-        break;
+  switch (gcb.DisposalMode) {
+    case DISPOSE_DO_NOT:
+      *canvas_ = std::move(new_canvas_image);
+      break;
 
-      case DISPOSAL_UNSPECIFIED:
-      default:
-        std::fill_n(static_cast<PackedRgba*>(canvas.color.pixels()),
-                    canvas.color.xsize * canvas.color.ysize, background_rgba);
-    }
-  }
-  // Finally, if any frame has an alpha-channel, every frame will need
-  // to have an alpha-channel.
-  bool seen_alpha = false;
-  for (const PackedFrame& frame : ppf->frames) {
-    if (!frame.extra_channels.empty()) {
-      seen_alpha = true;
+    case DISPOSE_PREVIOUS:
       break;
-    }
+
+    case DISPOSE_BACKGROUND:
+    case DISPOSAL_UNSPECIFIED:
+    default:
+      std::fill_n(static_cast<PackedRgba*>(canvas_->pixels()),
+                  canvas_->xsize * canvas_->ysize, background_rgba_);
   }
-  if (seen_alpha) {
-    for (PackedFrame& frame : ppf->frames) {
-      JXL_RETURN_IF_ERROR(ensure_have_alpha(&frame));
-    }
+  *result = std::move(frame_holder);
+  return true;
+}
+
+}  // namespace
+#endif
+
+bool CanDecodeGIF() {
+#if JPEGXL_ENABLE_GIF
+  return true;
+#else
+  return false;
+#endif
+}
+
+Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
+                      PackedPixelFile* ppf,
+                      const SizeConstraints* constraints) {
+#if JPEGXL_ENABLE_GIF
+  GIFFrameSource source;
+  JXL_RETURN_IF_ERROR(source.Init(bytes, color_hints, ppf, constraints));
+  ppf->frames.clear();
+  ppf->frames.reserve(source.num_frames());
+  for (;;) {
+    std::unique_ptr<PackedFrame> frame;
+    JXL_RETURN_IF_ERROR(source.NextFrame(&frame));
+    if (!frame) break;
+    ppf->frames.emplace_back(std::move(*frame));
   }
   return true;
 #else
@@ -428,5 +497,20 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
 #endif
 }
 
+Status DecodeImageGIFFrames(Span<const uint8_t> bytes,
+                            const ColorHints& color_hints,
+                            PackedPixelFile* ppf,
+                            const SizeConstraints* constraints) {
+#if JPEGXL_ENABLE_GIF
+  std::unique_ptr<GIFFrameSource> source = jxl::make_unique<GIFFrameSource>();
+  JXL_RETURN_IF_ERROR(source->Init(bytes, color_hints, ppf, constraints));
+  ppf->frames.clear();
+  ppf->frame_source = std::move(source);
+  return true;
+#else
+  return false;
+#endif
+}
+
 }  // namespace extras
 }  // namespace jxl
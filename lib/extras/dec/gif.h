@@ -29,6 +29,15 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints = nullptr);
 
+// Like DecodeImageGIF, but only reads the metadata and sets
+// ppf->frame_source, which composites the frames as they are requested, so
+// that they can be encoded while the next ones are composited. `bytes` must
+// outlive ppf->frame_source.
+Status DecodeImageGIFFrames(Span<const uint8_t> bytes,
+                            const ColorHints& color_hints,
+                            PackedPixelFile* ppf,
+                            const SizeConstraints* constraints = nullptr);
+
 }  // namespace extras
 }  // namespace jxl
 
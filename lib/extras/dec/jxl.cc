@@ -15,11 +15,16 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "lib/extras/common.h"
 #include "lib/extras/dec/color_description.h"
+#include "lib/extras/packed_image.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/exif.h"
 #include "lib/jxl/base/printf_macros.h"
@@ -115,6 +120,63 @@ void SetBitDepthFromDataType(JxlDataType data_type, uint32_t* bits_per_sample,
   }
 }
 
+// Puts the pixels of the image out callback, which come from several threads
+// as the groups are rendered, back in row order for a PackedRowSink. Only the
+// rows from the first incomplete one to the last one touched are kept.
+class RowReorderer {
+ public:
+  RowReorderer(PackedRowSink* sink, size_t xsize, size_t ysize,
+               size_t pixel_stride)
+      : sink_(sink),
+        xsize_(xsize),
+        ysize_(ysize),
+        pixel_stride_(pixel_stride) {}
+
+  void AddPixels(size_t x, size_t y, size_t num_pixels, const void* pixels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!status_) return;
+    if (y < next_row_ || y >= ysize_ || x + num_pixels > xsize_) {
+      status_ = JXL_FAILURE("Unexpected pixels at %" PRIuS ", %" PRIuS, x, y);
+      return;
+    }
+    const size_t index = y - next_row_;
+    if (rows_.size() <= index) rows_.resize(index + 1);
+    Row& row = rows_[index];
+    if (row.pixels.empty()) row.pixels.resize(xsize_ * pixel_stride_);
+    memcpy(row.pixels.data() + x * pixel_stride_, pixels,
+           num_pixels * pixel_stride_);
+    row.num_pixels += num_pixels;
+    while (!rows_.empty() && rows_.front().num_pixels == xsize_) {
+      status_ = sink_->AddRow(rows_.front().pixels.data());
+      if (!status_) return;
+      rows_.pop_front();
+      ++next_row_;
+    }
+  }
+
+  // Only valid once the decoder is done with the frame.
+  Status status() const {
+    JXL_RETURN_IF_ERROR(status_);
+    if (next_row_ != ysize_) return JXL_FAILURE("Missing rows");
+    return true;
+  }
+
+ private:
+  struct Row {
+    std::vector<uint8_t> pixels;
+    size_t num_pixels = 0;
+  };
+
+  PackedRowSink* sink_;
+  const size_t xsize_;
+  const size_t ysize_;
+  const size_t pixel_stride_;
+  std::mutex mutex_;
+  Status status_ = true;
+  size_t next_row_ = 0;
+  std::deque<Row> rows_;
+};
+
 template <typename T>
 void UpdateBitDepth(JxlBitDepth bit_depth, JxlDataType data_type, T* info) {
   if (bit_depth.type == JXL_BIT_DEPTH_FROM_PIXEL_FORMAT) {
@@ -228,6 +290,8 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
     return false;
   }
   uint32_t progression_index = 0;
+  // Set while the frame goes to dparams.row_sink.
+  std::unique_ptr<RowReorderer> rows;
   bool codestream_done = jpeg_bytes == nullptr && accepted_formats.empty();
   BoxProcessor boxes(dec);
   for (;;) {
@@ -418,6 +482,24 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         }
       }
     } else if (status == JXL_DEC_FRAME) {
+      if (dparams.row_sink != nullptr && ppf->frames.empty() && !rows &&
+          ppf->extra_channels_info.empty() && !dparams.allow_partial_input &&
+          dparams.use_image_callback && !(events & JXL_DEC_FRAME_PROGRESSION)) {
+        JxlFrameHeader frame_info;
+        if (JXL_DEC_SUCCESS != JxlDecoderGetFrameHeader(dec, &frame_info)) {
+          fprintf(stderr, "JxlDecoderGetFrameHeader failed\n");
+          return false;
+        }
+        if (frame_info.is_last) {
+          const size_t pixel_stride =
+              format.num_channels *
+              jxl::extras::PackedImage::BitsPerChannel(format.data_type) / 8;
+          rows = jxl::make_unique<RowReorderer>(
+              dparams.row_sink, ppf->info.xsize, ppf->info.ysize,
+              pixel_stride);
+          continue;
+        }
+      }
       auto frame_or = jxl::extras::PackedFrame::Create(ppf->info.xsize,
                                                        ppf->info.ysize, format);
       JXL_ASSIGN_OR_QUIT(jxl::extras::PackedFrame frame,
@@ -490,6 +572,35 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         fprintf(stderr, "JxlDecoderImageOutBufferSize failed\n");
         return false;
       }
+      UpdateBitDepth(dparams.output_bitdepth, format.data_type, &ppf->info);
+      bool have_alpha = (format.num_channels == 2 || format.num_channels == 4);
+      if (have_alpha) {
+        // Interleaved alpha channels has the same bit depth as color channels.
+        ppf->info.alpha_bits = ppf->info.bits_per_sample;
+        ppf->info.alpha_exponent_bits = ppf->info.exponent_bits_per_sample;
+      }
+      if (rows) {
+        if (!dparams.row_sink->Start(*ppf, format)) {
+          fprintf(stderr, "Failed to start the row output\n");
+          return false;
+        }
+        auto callback = [](void* opaque, size_t x, size_t y, size_t num_pixels,
+                           const void* pixels) {
+          static_cast<RowReorderer*>(opaque)->AddPixels(x, y, num_pixels,
+                                                        pixels);
+        };
+        if (JXL_DEC_SUCCESS != JxlDecoderSetImageOutCallback(
+                                   dec, &format, callback, rows.get())) {
+          fprintf(stderr, "JxlDecoderSetImageOutCallback failed\n");
+          return false;
+        }
+        if (JXL_DEC_SUCCESS !=
+            JxlDecoderSetImageOutBitDepth(dec, &dparams.output_bitdepth)) {
+          fprintf(stderr, "JxlDecoderSetImageOutBitDepth failed\n");
+          return false;
+        }
+        continue;
+      }
       jxl::extras::PackedFrame& frame = ppf->frames.back();
       if (buffer_size != frame.color.pixels_size) {
         fprintf(stderr, "Invalid out buffer size %" PRIuS " %" PRIuS "\n",
@@ -525,13 +636,6 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         fprintf(stderr, "JxlDecoderSetImageOutBitDepth failed\n");
         return false;
       }
-      UpdateBitDepth(dparams.output_bitdepth, format.data_type, &ppf->info);
-      bool have_alpha = (format.num_channels == 2 || format.num_channels == 4);
-      if (have_alpha) {
-        // Interleaved alpha channels has the same bit depth as color channels.
-        ppf->info.alpha_bits = ppf->info.bits_per_sample;
-        ppf->info.alpha_exponent_bits = ppf->info.exponent_bits_per_sample;
-      }
       JxlPixelFormat ec_format = format;
       ec_format.num_channels = 1;
       for (auto& eci : ppf->extra_channels_info) {
@@ -569,7 +673,8 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
     } else if (status == JXL_DEC_PREVIEW_IMAGE) {
       // Nothing to do.
     } else if (status == JXL_DEC_FULL_IMAGE) {
-      if (jpeg_bytes != nullptr || ppf->frames.back().frame_info.is_last) {
+      if (jpeg_bytes != nullptr || rows ||
+          ppf->frames.back().frame_info.is_last) {
         codestream_done = true;
       }
     } else {
@@ -601,6 +706,16 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
               ppf->metadata.exif.size());
     }
   }
+  if (rows) {
+    if (!rows->status()) {
+      fprintf(stderr, "Failed to output the rows\n");
+      return false;
+    }
+    if (!dparams.row_sink->Finish(*ppf)) {
+      fprintf(stderr, "Failed to finish the row output\n");
+      return false;
+    }
+  }
   if (jpeg_bytes != nullptr) {
     if (!can_reconstruct_jpeg) return false;
     size_t used_jpeg_output =
@@ -61,6 +61,12 @@ struct JXLDecompressParams {
 
   // Controls the effective bit depth of the output pixels.
   JxlBitDepth output_bitdepth = {JXL_BIT_DEPTH_FROM_PIXEL_FORMAT, 0, 0};
+
+  // If set, a single frame image without extra channels is passed to it row by
+  // row while it is decoded, and `ppf` gets no frames. Other images (and all
+  // images if partial input, progressive detail or no image callback was
+  // requested) are decoded to `ppf` as usual.
+  PackedRowSink* row_sink = nullptr;
 };
 
 bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
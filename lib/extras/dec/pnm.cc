@@ -7,15 +7,22 @@
 
 #include <jxl/encode.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include "lib/extras/size_constraints.h"
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/c_callback_support.h"
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 
@@ -321,6 +328,100 @@ class Parser {
 
 }  // namespace
 
+// Bytes of the header that are looked at.
+constexpr size_t kMaxHeaderSize = 10 * 1024;
+// Bytes per read from inputs that can not be memory mapped.
+constexpr size_t kReadSize = 4 << 20;
+// The streaming encoder asks for the rows of a DC group (2048 rows and an
+// 8-row border on each side) at a time; keeping two of them lets reordered
+// requests of neighbouring groups be served without reading again.
+constexpr size_t kBandRows = 2 * (2048 + 16);
+
+// The pixel data of an input that can not be memory mapped, e.g. a pipe, read
+// front to back in large pieces while only a band of rows is kept. Earlier
+// rows are read again if the input can seek.
+struct ChunkedPNMDecoder::RowStream {
+  ~RowStream() {
+    if (file != nullptr) fclose(file);
+  }
+
+  // Reads the start of the input, which holds the header.
+  Status Open(const char* path) {
+    file = fopen(path, "rb");
+    if (file == nullptr) return JXL_FAILURE("Cannot open file %s", path);
+    band.resize(kMaxHeaderSize);
+    band.resize(fread(band.data(), 1, band.size(), file));
+    return true;
+  }
+
+  // Drops the header from `band`, which then starts with the pixel data.
+  void SetDataStart(size_t data_start, size_t row_bytes) {
+    band.erase(band.begin(), band.begin() + data_start);
+    header_size = data_start;
+    row_size = row_bytes;
+  }
+
+  // Returns a copy of the rectangle, so that the band may move before it is
+  // released; nullptr on error.
+  const void* GetRect(size_t xpos, size_t ypos, size_t xsize, size_t ysize,
+                      size_t bytes_per_pixel, size_t* row_offset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const size_t begin = ypos * row_size;
+    const size_t end = (ypos + ysize) * row_size;
+    if (begin < band_begin) {
+      if (fseek(file, static_cast<long>(header_size + begin),  // NOLINT
+                SEEK_SET) != 0) {
+        JXL_DEBUG_ABORT("Rows were dropped from a non-seekable input");
+        return nullptr;
+      }
+      band.clear();
+      band_begin = begin;
+    }
+    const size_t keep_from =
+        row_size * std::min(ypos, ypos + ysize > kBandRows
+                                      ? ypos + ysize - kBandRows
+                                      : 0);
+    while (band_begin + band.size() < end) {
+      DropBefore(keep_from);
+      size_t offset = band.size();
+      band.resize(offset + kReadSize);
+      size_t num_read = fread(band.data() + offset, 1, kReadSize, file);
+      band.resize(offset + num_read);
+      if (num_read == 0) {
+        JXL_DEBUG_ABORT("PNM file too small");
+        return nullptr;
+      }
+    }
+    DropBefore(keep_from);
+    *row_offset = xsize * bytes_per_pixel;
+    uint8_t* rect = new uint8_t[ysize * *row_offset];
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(rect + y * *row_offset,
+             band.data() + begin - band_begin + y * row_size +
+                 xpos * bytes_per_pixel,
+             *row_offset);
+    }
+    return rect;
+  }
+
+  void DropBefore(size_t offset) {
+    if (offset <= band_begin) return;
+    size_t num_dropped = std::min(offset - band_begin, band.size());
+    band.erase(band.begin(), band.begin() + num_dropped);
+    band_begin += num_dropped;
+  }
+
+  FILE* file = nullptr;
+  size_t header_size = 0;
+  size_t row_size = 0;
+
+  std::mutex mutex;
+  // Holds the pixel data bytes [band_begin, band_begin + band.size()), which
+  // always end at the read position of `file`.
+  size_t band_begin = 0;
+  std::vector<uint8_t> band;
+};
+
 struct PNMChunkedInputFrame {
   JxlChunkedFrameInputSource operator()() {
     return JxlChunkedFrameInputSource{
@@ -337,15 +438,34 @@ struct PNMChunkedInputFrame {
     *pixel_format = format;
   }
 
+  // Mapped PGM and PPM rows are returned without copying them.
   const void* GetColorChannelDataAt(size_t xpos, size_t ypos, size_t xsize,
                                     size_t ysize, size_t* row_offset) {
+    const HeaderPNM& header = dec->header_;
     const size_t bytes_per_channel =
-        DivCeil(dec->header_.bits_per_sample, jxl::kBitsPerByte);
-    const size_t num_channels = dec->header_.is_gray ? 1 : 3;
+        DivCeil(header.bits_per_sample, jxl::kBitsPerByte);
+    const size_t num_channels = header.is_gray ? 1 : 3;
     const size_t bytes_per_pixel = num_channels * bytes_per_channel;
-    *row_offset = dec->header_.xsize * bytes_per_pixel;
-    const size_t offset = ypos * *row_offset + xpos * bytes_per_pixel;
-    return dec->pnm_.data() + offset + dec->data_start_;
+    if (dec->rows_) {
+      return dec->rows_->GetRect(xpos, ypos, xsize, ysize, bytes_per_pixel,
+                                 row_offset);
+    }
+    const size_t row_size = header.xsize * bytes_per_pixel;
+    const uint8_t* data = dec->pnm_.data() + dec->data_start_;
+    if (!header.floating_point) {
+      *row_offset = row_size;
+      return data + ypos * row_size + xpos * bytes_per_pixel;
+    }
+    // PFM rows are stored bottom to top.
+    *row_offset = xsize * bytes_per_pixel;
+    uint8_t* rect = new uint8_t[ysize * *row_offset];
+    for (size_t y = 0; y < ysize; ++y) {
+      memcpy(rect + y * *row_offset,
+             data + (header.ysize - 1 - ypos - y) * row_size +
+                 xpos * bytes_per_pixel,
+             *row_offset);
+    }
+    return rect;
   }
 
   void GetExtraChannelPixelFormat(size_t ec_index,
@@ -364,7 +484,11 @@ struct PNMChunkedInputFrame {
     return nullptr;
   }
 
-  void ReleaseCurrentData(const void* buffer) {}
+  void ReleaseCurrentData(const void* buffer) {
+    if (dec->rows_ || dec->header_.floating_point) {
+      delete[] static_cast<const uint8_t*>(buffer);
+    }
+  }
 
   JxlPixelFormat format;
   const ChunkedPNMDecoder* dec;
@@ -372,11 +496,18 @@ struct PNMChunkedInputFrame {
 
 StatusOr<ChunkedPNMDecoder> ChunkedPNMDecoder::Init(const char* path) {
   ChunkedPNMDecoder dec;
-  JXL_ASSIGN_OR_RETURN(dec.pnm_, MemoryMappedFile::Init(path));
-  size_t size = dec.pnm_.size();
-  if (size < 2) return JXL_FAILURE("Invalid ppm");
-  size_t hdr_buf = std::min<size_t>(size, 10 * 1024);
-  Span<const uint8_t> span(dec.pnm_.data(), hdr_buf);
+  Span<const uint8_t> span;
+  StatusOr<MemoryMappedFile> mapped = MemoryMappedFile::Init(path);
+  if (mapped.ok()) {
+    dec.pnm_ = std::move(mapped).value_();
+    span = Span<const uint8_t>(dec.pnm_.data(),
+                               std::min(dec.pnm_.size(), kMaxHeaderSize));
+  } else {
+    dec.rows_ = jxl::make_unique<RowStream>();
+    JXL_RETURN_IF_ERROR(dec.rows_->Open(path));
+    span = Span<const uint8_t>(dec.rows_->band.data(), dec.rows_->band.size());
+  }
+  if (span.size() < 2) return JXL_FAILURE("Invalid ppm");
   Parser parser(span);
   HeaderPNM& header = dec.header_;
   const uint8_t* pos = nullptr;
@@ -385,11 +516,12 @@ StatusOr<ChunkedPNMDecoder> ChunkedPNMDecoder::Init(const char* path) {
   }
   dec.data_start_ = pos - span.data();
 
-  if (header.bits_per_sample == 0 || header.bits_per_sample > 16) {
+  if (header.bits_per_sample == 0 ||
+      (header.bits_per_sample > 16 && !header.floating_point)) {
     return JXL_FAILURE("Invalid bits_per_sample");
   }
-  if (header.has_alpha || !header.ec_types.empty() || header.floating_point) {
-    return JXL_FAILURE("Only PGM and PPM inputs are supported");
+  if (header.has_alpha || !header.ec_types.empty()) {
+    return JXL_FAILURE("Only PGM, PPM and PFM inputs are supported");
   }
 
   const size_t bytes_per_channel =
@@ -397,7 +529,13 @@ StatusOr<ChunkedPNMDecoder> ChunkedPNMDecoder::Init(const char* path) {
   const size_t num_channels = dec.header_.is_gray ? 1 : 3;
   const size_t bytes_per_pixel = num_channels * bytes_per_channel;
   size_t row_size = dec.header_.xsize * bytes_per_pixel;
-  if (size < header.ysize * row_size + dec.data_start_) {
+  if (dec.rows_) {
+    if (header.floating_point) {
+      // The encoder asks for the last rows of the input first.
+      return JXL_FAILURE("PFM input must be a regular file");
+    }
+    dec.rows_->SetDataStart(dec.data_start_, row_size);
+  } else if (dec.pnm_.size() < header.ysize * row_size + dec.data_start_) {
     return JXL_FAILURE("PNM file too small");
   }
   return dec;
@@ -413,16 +551,23 @@ jxl::Status ChunkedPNMDecoder::InitializePPF(const ColorHints& color_hints,
 
   ppf->info.xsize = header_.xsize;
   ppf->info.ysize = header_.ysize;
-  ppf->info.bits_per_sample = header_.bits_per_sample;
-  ppf->info.exponent_bits_per_sample = 0;
+  if (header_.floating_point) {
+    ppf->info.bits_per_sample = 32;
+    ppf->info.exponent_bits_per_sample = 8;
+  } else {
+    ppf->info.bits_per_sample = header_.bits_per_sample;
+    ppf->info.exponent_bits_per_sample = 0;
+  }
   ppf->info.orientation = JXL_ORIENT_IDENTITY;
   ppf->info.alpha_bits = 0;
   ppf->info.alpha_exponent_bits = 0;
   ppf->info.num_color_channels = (header_.is_gray ? 1 : 3);
   ppf->info.num_extra_channels = 0;
 
-  const JxlDataType data_type =
-      header_.bits_per_sample > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
+  JxlDataType data_type = JXL_TYPE_FLOAT;
+  if (!header_.floating_point) {
+    data_type = header_.bits_per_sample > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
+  }
   const JxlPixelFormat format{
       /*num_channels=*/ppf->info.num_color_channels,
       /*data_type=*/data_type,
@@ -437,6 +582,12 @@ jxl::Status ChunkedPNMDecoder::InitializePPF(const ColorHints& color_hints,
   return true;
 }
 
+ChunkedPNMDecoder::ChunkedPNMDecoder() = default;
+ChunkedPNMDecoder::~ChunkedPNMDecoder() = default;
+ChunkedPNMDecoder::ChunkedPNMDecoder(ChunkedPNMDecoder&&) noexcept = default;
+ChunkedPNMDecoder& ChunkedPNMDecoder::operator=(ChunkedPNMDecoder&&) noexcept =
+    default;
+
 Status DecodeImagePNM(const Span<const uint8_t> bytes,
                       const ColorHints& color_hints, PackedPixelFile* ppf,
                       const SizeConstraints* constraints) {
@@ -11,6 +11,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <memory>
+#include <vector>
+
 // TODO(janwas): workaround for incorrect Win64 codegen (cause unknown)
 #include <hwy/highway.h>
 
@@ -43,6 +46,9 @@ struct HeaderPNM {
   std::vector<JxlExtraChannelType> ec_types;  // PAM
 };
 
+// Gives the encoder the rows of a PGM, PPM or PFM file straight from its
+// memory mapping. Inputs that can not be mapped, e.g. pipes, are read in large
+// pieces instead, keeping only a band of rows in memory.
 class ChunkedPNMDecoder {
  public:
   static StatusOr<ChunkedPNMDecoder> Init(const char* file_path);
@@ -50,10 +56,19 @@ class ChunkedPNMDecoder {
   jxl::Status InitializePPF(const ColorHints& color_hints,
                             PackedPixelFile* ppf);
 
+  ChunkedPNMDecoder();                                         // NOLINT
+  ~ChunkedPNMDecoder();                                        // NOLINT
+  ChunkedPNMDecoder(ChunkedPNMDecoder&&) noexcept;             // NOLINT
+  ChunkedPNMDecoder& operator=(ChunkedPNMDecoder&&) noexcept;  // NOLINT
+
  private:
+  struct RowStream;
+
   HeaderPNM header_ = {};
   size_t data_start_ = 0;
   MemoryMappedFile pnm_;
+  // Only set if the input is not memory mapped.
+  std::unique_ptr<RowStream> rows_;
 
   friend struct PNMChunkedInputFrame;
 };
@@ -37,7 +37,10 @@
  */
 
 #include <cstring>
+#include <functional>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/extras/exif.h"
@@ -91,6 +94,9 @@ class APNGEncoder : public Encoder {
     return true;
   }
 
+  std::unique_ptr<PackedRowSink> CreateRowSink(
+      std::function<Status(const uint8_t*, size_t)> write) const override;
+
  private:
   Status EncodePackedPixelFileToAPNG(const PackedPixelFile& ppf,
                                      ThreadPool* pool,
@@ -280,6 +286,180 @@ void MaybeAddCLLi(const JxlColorEncoding& c_enc, const float intensity_target,
   png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
 }
 
+void AddColorChunks(const PackedPixelFile& ppf, png_structp png_ptr,
+                    png_infop info_ptr) {
+  if (!MaybeAddSRGB(ppf.color_encoding, png_ptr, info_ptr)) {
+    MaybeAddCICP(ppf.color_encoding, png_ptr, info_ptr);
+    if (!ppf.icc.empty()) {
+      png_set_benign_errors(png_ptr, 1);
+      png_set_iCCP(png_ptr, info_ptr, "1", 0, ppf.icc.data(), ppf.icc.size());
+    }
+    MaybeAddCHRM(ppf.color_encoding, png_ptr, info_ptr);
+    MaybeAddGAMA(ppf.color_encoding, png_ptr, info_ptr);
+  }
+  MaybeAddCLLi(ppf.color_encoding, ppf.info.intensity_target, png_ptr,
+               info_ptr);
+}
+
+// The text chunks are written by png_write_info or, if they were added after
+// it, by png_write_end.
+Status AddTextChunks(const PackedMetadata& metadata, png_structp png_ptr,
+                     png_infop info_ptr) {
+  std::vector<std::string> textstrings;
+  JXL_RETURN_IF_ERROR(BlobsWriterPNG::Encode(metadata, &textstrings));
+  for (size_t kk = 0; kk + 1 < textstrings.size(); kk += 2) {
+    png_text text;
+    text.key = const_cast<png_charp>(textstrings[kk].c_str());
+    text.text = const_cast<png_charp>(textstrings[kk + 1].c_str());
+    text.compression = PNG_TEXT_COMPRESSION_zTXt;
+    png_set_text(png_ptr, info_ptr, &text, 1);
+  }
+  return true;
+}
+
+// Converts `num_samples` samples to the 8 or 16 bit big endian PNG samples.
+void ConvertToPNGSamples(const JxlPixelFormat& format,
+                         uint32_t bits_per_sample, const uint8_t* in,
+                         size_t num_samples, uint8_t* out) {
+  if (format.data_type == JXL_TYPE_UINT8) {
+    if (bits_per_sample < 8) {
+      float mul = 255.0 / ((1u << bits_per_sample) - 1);
+      for (size_t i = 0; i < num_samples; ++i) {
+        out[i] = static_cast<uint8_t>(std::lroundf(in[i] * mul));
+      }
+    } else {
+      memcpy(out, in, num_samples);
+    }
+  } else if (format.data_type == JXL_TYPE_UINT16) {
+    if (bits_per_sample < 16 || format.endianness != JXL_BIG_ENDIAN) {
+      float mul = 65535.0 / ((1u << bits_per_sample) - 1);
+      const uint8_t* p_in = in;
+      uint8_t* p_out = out;
+      for (size_t i = 0; i < num_samples; ++i, p_in += 2, p_out += 2) {
+        uint32_t val = (format.endianness == JXL_BIG_ENDIAN ? LoadBE16(p_in)
+                                                            : LoadLE16(p_in));
+        StoreBE16(static_cast<uint32_t>(std::lroundf(val * mul)), p_out);
+      }
+    } else {
+      memcpy(out, in, 2 * num_samples);
+    }
+  } else if (format.data_type == JXL_TYPE_FLOAT) {
+    constexpr float kMul = 65535.0;
+    const uint8_t* p_in = in;
+    uint8_t* p_out = out;
+    for (size_t i = 0; i < num_samples;
+         ++i, p_in += sizeof(float), p_out += 2) {
+      float val =
+          Clamp1(format.endianness == JXL_BIG_ENDIAN ? LoadBEFloat(p_in)
+                 : format.endianness == JXL_LITTLE_ENDIAN
+                     ? LoadLEFloat(p_in)
+                     : *reinterpret_cast<const float*>(p_in),
+                 0.f, 1.f);
+      StoreBE16(static_cast<uint32_t>(std::lroundf(val * kMul)), p_out);
+    }
+  }
+}
+
+// Writes a PNG without animation with png_write_row as the rows come. The
+// metadata that is only known at Finish goes to text chunks after the image
+// data.
+class APNGRowSink : public PackedRowSink {
+ public:
+  explicit APNGRowSink(std::function<Status(const uint8_t*, size_t)> write)
+      : write_(std::move(write)) {}
+
+  ~APNGRowSink() override {
+    if (png_ptr_ != nullptr) png_destroy_write_struct(&png_ptr_, &info_ptr_);
+  }
+
+  Status Start(const PackedPixelFile& ppf,
+               const JxlPixelFormat& format) override {
+    JXL_RETURN_IF_ERROR(Encoder::VerifyBasicInfo(ppf.info));
+    JXL_RETURN_IF_ERROR(PackedImage::ValidateDataType(format.data_type));
+    JXL_RETURN_IF_ERROR(Encoder::VerifyBitDepth(
+        format.data_type, ppf.info.bits_per_sample,
+        ppf.info.exponent_bits_per_sample));
+    if (format.data_type == JXL_TYPE_FLOAT16) {
+      return JXL_FAILURE("Unsupported pixel format for PNG output");
+    }
+    const bool has_alpha = ppf.info.alpha_bits != 0;
+    const bool is_gray = ppf.info.num_color_channels == 1;
+    JXL_ENSURE(format.num_channels ==
+               ppf.info.num_color_channels + (has_alpha ? 1 : 0));
+    format_ = format;
+    bits_per_sample_ = ppf.info.bits_per_sample;
+    num_samples_ = ppf.info.xsize * format.num_channels;
+    const size_t out_bytes_per_sample =
+        PackedImage::BitsPerChannel(format.data_type) > 8 ? 2 : 1;
+    row_.resize(num_samples_ * out_bytes_per_sample);
+
+    png_ptr_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                       nullptr);
+    if (!png_ptr_) return JXL_FAILURE("Could not init png encoder");
+    info_ptr_ = png_create_info_struct(png_ptr_);
+    if (!info_ptr_) return JXL_FAILURE("Could not init png info struct");
+    png_set_compression_level(png_ptr_, 1);
+    png_set_write_fn(png_ptr_, this, Write, nullptr);
+    png_set_flush(png_ptr_, 0);
+
+    png_byte color_type = (is_gray ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB);
+    if (has_alpha) color_type |= PNG_COLOR_MASK_ALPHA;
+    png_set_IHDR(png_ptr_, info_ptr_, ppf.info.xsize, ppf.info.ysize,
+                 out_bytes_per_sample * 8, color_type, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    AddColorChunks(ppf, png_ptr_, info_ptr_);
+    JXL_RETURN_IF_ERROR(AddTextChunks(ppf.metadata, png_ptr_, info_ptr_));
+    had_exif_ = !ppf.metadata.exif.empty();
+    had_iptc_ = !ppf.metadata.iptc.empty();
+    had_xmp_ = !ppf.metadata.xmp.empty();
+    png_write_info(png_ptr_, info_ptr_);
+    return write_status_;
+  }
+
+  Status AddRow(const uint8_t* row) override {
+    ConvertToPNGSamples(format_, bits_per_sample_, row, num_samples_,
+                        row_.data());
+    png_write_row(png_ptr_, row_.data());
+    return write_status_;
+  }
+
+  Status Finish(const PackedPixelFile& ppf) override {
+    PackedMetadata late;
+    if (!had_exif_) late.exif = ppf.metadata.exif;
+    if (!had_iptc_) late.iptc = ppf.metadata.iptc;
+    if (!had_xmp_) late.xmp = ppf.metadata.xmp;
+    JXL_RETURN_IF_ERROR(AddTextChunks(late, png_ptr_, info_ptr_));
+    png_write_end(png_ptr_, info_ptr_);
+    return write_status_;
+  }
+
+ private:
+  static void Write(png_structp png_ptr, png_bytep data, png_size_t length) {
+    APNGRowSink* self = static_cast<APNGRowSink*>(png_get_io_ptr(png_ptr));
+    if (self->write_status_) {
+      self->write_status_ = self->write_(data, length);
+    }
+  }
+
+  std::function<Status(const uint8_t*, size_t)> write_;
+  Status write_status_ = true;
+  png_structp png_ptr_ = nullptr;
+  png_infop info_ptr_ = nullptr;
+  JxlPixelFormat format_;
+  uint32_t bits_per_sample_ = 0;
+  size_t num_samples_ = 0;
+  std::vector<uint8_t> row_;
+  // Which metadata was already written at Start.
+  bool had_exif_ = false;
+  bool had_iptc_ = false;
+  bool had_xmp_ = false;
+};
+
+std::unique_ptr<PackedRowSink> APNGEncoder::CreateRowSink(
+    std::function<Status(const uint8_t*, size_t)> write) const {
+  return jxl::make_unique<APNGRowSink>(std::move(write));
+}
+
 Status APNGEncoder::EncodePackedPixelFileToAPNG(
     const PackedPixelFile& ppf, ThreadPool* pool, std::vector<uint8_t>* bytes,
     bool encode_extra_channels, size_t extra_channel_index) const {
@@ -333,43 +513,7 @@ Status APNGEncoder::EncodePackedPixelFileToAPNG(
     size_t out_size = ysize * out_stride;
     std::vector<uint8_t> out(out_size);
 
-    if (format.data_type == JXL_TYPE_UINT8) {
-      if (bits_per_sample < 8) {
-        float mul = 255.0 / ((1u << bits_per_sample) - 1);
-        for (size_t i = 0; i < num_samples; ++i) {
-          out[i] = static_cast<uint8_t>(std::lroundf(in[i] * mul));
-        }
-      } else {
-        memcpy(out.data(), in, out_size);
-      }
-    } else if (format.data_type == JXL_TYPE_UINT16) {
-      if (bits_per_sample < 16 || format.endianness != JXL_BIG_ENDIAN) {
-        float mul = 65535.0 / ((1u << bits_per_sample) - 1);
-        const uint8_t* p_in = in;
-        uint8_t* p_out = out.data();
-        for (size_t i = 0; i < num_samples; ++i, p_in += 2, p_out += 2) {
-          uint32_t val = (format.endianness == JXL_BIG_ENDIAN ? LoadBE16(p_in)
-                                                              : LoadLE16(p_in));
-          StoreBE16(static_cast<uint32_t>(std::lroundf(val * mul)), p_out);
-        }
-      } else {
-        memcpy(out.data(), in, out_size);
-      }
-    } else if (format.data_type == JXL_TYPE_FLOAT) {
-      constexpr float kMul = 65535.0;
-      const uint8_t* p_in = in;
-      uint8_t* p_out = out.data();
-      for (size_t i = 0; i < num_samples;
-           ++i, p_in += sizeof(float), p_out += 2) {
-        float val =
-            Clamp1(format.endianness == JXL_BIG_ENDIAN ? LoadBEFloat(p_in)
-                   : format.endianness == JXL_LITTLE_ENDIAN
-                       ? LoadLEFloat(p_in)
-                       : *reinterpret_cast<const float*>(p_in),
-                   0.f, 1.f);
-        StoreBE16(static_cast<uint32_t>(std::lroundf(val * kMul)), p_out);
-      }
-    }
+    ConvertToPNGSamples(format, bits_per_sample, in, num_samples, out.data());
     png_structp png_ptr;
     png_infop info_ptr;
 
@@ -396,29 +540,8 @@ Status APNGEncoder::EncodePackedPixelFileToAPNG(
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
                  PNG_FILTER_TYPE_BASE);
     if (count == 0 && !encode_extra_channels) {
-      if (!MaybeAddSRGB(ppf.color_encoding, png_ptr, info_ptr)) {
-        MaybeAddCICP(ppf.color_encoding, png_ptr, info_ptr);
-        if (!ppf.icc.empty()) {
-          png_set_benign_errors(png_ptr, 1);
-          png_set_iCCP(png_ptr, info_ptr, "1", 0, ppf.icc.data(),
-                       ppf.icc.size());
-        }
-        MaybeAddCHRM(ppf.color_encoding, png_ptr, info_ptr);
-        MaybeAddGAMA(ppf.color_encoding, png_ptr, info_ptr);
-      }
-      MaybeAddCLLi(ppf.color_encoding, ppf.info.intensity_target, png_ptr,
-                   info_ptr);
-
-      std::vector<std::string> textstrings;
-      JXL_RETURN_IF_ERROR(BlobsWriterPNG::Encode(ppf.metadata, &textstrings));
-      for (size_t kk = 0; kk + 1 < textstrings.size(); kk += 2) {
-        png_text text;
-        text.key = const_cast<png_charp>(textstrings[kk].c_str());
-        text.text = const_cast<png_charp>(textstrings[kk + 1].c_str());
-        text.compression = PNG_TEXT_COMPRESSION_zTXt;
-        png_set_text(png_ptr, info_ptr, &text, 1);
-      }
-
+      AddColorChunks(ppf, png_ptr, info_ptr);
+      JXL_RETURN_IF_ERROR(AddTextChunks(ppf.metadata, png_ptr, info_ptr));
       png_write_info(png_ptr, info_ptr);
     } else {
       // fake writing a header, otherwise libpng gets confused
@@ -12,6 +12,7 @@
 #include <jxl/types.h>
 
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -58,6 +59,14 @@ class Encoder {
   virtual Status Encode(const PackedPixelFile& ppf, EncodedImage* encoded_image,
                         ThreadPool* pool) const = 0;
 
+  // Returns a sink that encodes a single frame image as its rows come and
+  // passes the encoded bytes to `write` in order, or nullptr if this format
+  // can only be written from the whole image. Extra channels are not written.
+  virtual std::unique_ptr<PackedRowSink> CreateRowSink(
+      std::function<Status(const uint8_t*, size_t)> write) const {
+    return nullptr;
+  }
+
   void SetOption(std::string name, std::string value) {
     options_[std::move(name)] = std::move(value);
   }
@@ -6,13 +6,17 @@
 #include "lib/extras/enc/exr.h"
 
 #if JPEGXL_ENABLE_EXR
+#include <ImfChannelList.h>
 #include <ImfChromaticitiesAttribute.h>
+#include <ImfFrameBuffer.h>
 #include <ImfIO.h>
+#include <ImfOutputFile.h>
 #include <ImfRgbaFile.h>
 #include <ImfStandardAttributes.h>
 #endif
 #include <jxl/codestream_header.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "lib/extras/packed_image.h"
@@ -76,6 +80,31 @@ float LoadLEFloat(const uint8_t* p) {
   return result;
 }
 
+// Writes half-float pixels in native byte order straight from `image`,
+// through a frame buffer of strided slices into it, without any copy.
+Status WriteHalfPixels(const PackedImage& image, bool has_alpha,
+                       OpenEXR::Header header, std::vector<uint8_t>* bytes) {
+  const size_t num_channels = 3 + (has_alpha ? 1 : 0);
+  const char* const kChannelNames[] = {"R", "G", "B", "A"};
+  for (size_t c = 0; c < num_channels; ++c) {
+    header.channels().insert(kChannelNames[c], OpenEXR::Channel(OpenEXR::HALF));
+  }
+  InMemoryOStream os(bytes);
+  OpenEXR::OutputFile output(os, header);
+  OpenEXR::FrameBuffer frame_buffer;
+  for (size_t c = 0; c < num_channels; ++c) {
+    frame_buffer.insert(
+        kChannelNames[c],
+        OpenEXR::Slice(OpenEXR::HALF,
+                       reinterpret_cast<char*>(image.pixels(0, 0, c)),
+                       /*xStride=*/image.pixel_stride(),
+                       /*yStride=*/image.stride));
+  }
+  output.setFrameBuffer(frame_buffer);
+  output.writePixels(image.ysize);
+  return true;
+}
+
 Status EncodeImageEXR(const PackedImage& image, const JxlBasicInfo& info,
                       const JxlColorEncoding& c_enc, ThreadPool* pool,
                       std::vector<uint8_t>* bytes) {
@@ -95,12 +124,18 @@ Status EncodeImageEXR(const PackedImage& image, const JxlBasicInfo& info,
   const size_t num_channels = 3 + (has_alpha ? 1 : 0);
   const JxlPixelFormat format = image.format;
 
-  if (format.data_type != JXL_TYPE_FLOAT) {
+  if (format.data_type != JXL_TYPE_FLOAT &&
+      format.data_type != JXL_TYPE_FLOAT16) {
     return JXL_FAILURE("Unsupported pixel format for OpenEXR output");
   }
+  if (format.data_type == JXL_TYPE_FLOAT16 &&
+      (SwapEndianness(format.endianness) ||
+       (has_alpha && !alpha_is_premultiplied))) {
+    return JXL_FAILURE("Unsupported half-float pixel format for OpenEXR");
+  }
 
   const uint8_t* in = reinterpret_cast<const uint8_t*>(image.pixels());
-  size_t in_stride = num_channels * 4 * xsize;
+  const size_t in_stride = image.stride;
 
   OpenEXR::Header header(xsize, ysize);
   OpenEXR::Chromaticities chromaticities;
@@ -115,6 +150,10 @@ Status EncodeImageEXR(const PackedImage& image, const JxlBasicInfo& info,
   OpenEXR::addChromaticities(header, chromaticities);
   OpenEXR::addWhiteLuminance(header, info.intensity_target);
 
+  if (format.data_type == JXL_TYPE_FLOAT16) {
+    return WriteHalfPixels(image, has_alpha, header, bytes);
+  }
+
   auto loadFloat =
       format.endianness == JXL_BIG_ENDIAN ? LoadBEFloat : LoadLEFloat;
   auto loadAlpha =
@@ -126,9 +165,10 @@ Status EncodeImageEXR(const PackedImage& image, const JxlBasicInfo& info,
     InMemoryOStream os(bytes);
     OpenEXR::RgbaOutputFile output(
         os, header, has_alpha ? OpenEXR::WRITE_RGBA : OpenEXR::WRITE_RGB);
-    // How many rows to write at once. Again, the OpenEXR documentation
-    // recommends writing the whole image in one call.
-    const int y_chunk_size = ysize;
+    // How many rows to convert and write at once. A multiple of the 16 rows
+    // that are compressed together, so that only the chunk is copied to
+    // half-floats instead of the whole image.
+    const size_t y_chunk_size = std::min<size_t>(ysize, 256);
     std::vector<OpenEXR::Rgba> output_rows(xsize * y_chunk_size);
 
     for (size_t start_y = 0; start_y < ysize; start_y += y_chunk_size) {
@@ -137,7 +177,7 @@ Status EncodeImageEXR(const PackedImage& image, const JxlBasicInfo& info,
       output.setFrameBuffer(output_rows.data() - start_y * xsize,
                             /*xStride=*/1, /*yStride=*/xsize);
       for (size_t y = start_y; y <= end_y; ++y) {
-        const uint8_t* in_row = &in[(y - start_y) * in_stride];
+        const uint8_t* in_row = &in[y * in_stride];
         OpenEXR::Rgba* const JXL_RESTRICT row_data =
             &output_rows[(y - start_y) * xsize];
         for (size_t x = 0; x < xsize; ++x) {
@@ -164,6 +204,14 @@ Status EncodeImageEXR(const PackedImage& image, const JxlBasicInfo& info,
 class EXREncoder : public Encoder {
   std::vector<JxlPixelFormat> AcceptedFormats() const override {
     std::vector<JxlPixelFormat> formats;
+    // Half floats are what is written, so decoding to them lets the pixels be
+    // written in place. Only without alpha, which is premultiplied here.
+    for (const uint32_t num_channels : {1, 3}) {
+      formats.push_back(JxlPixelFormat{/*num_channels=*/num_channels,
+                                       /*data_type=*/JXL_TYPE_FLOAT16,
+                                       /*endianness=*/JXL_NATIVE_ENDIAN,
+                                       /*align=*/0});
+    }
     for (const uint32_t num_channels : {1, 2, 3, 4}) {
       for (const JxlDataType data_type : {JXL_TYPE_FLOAT}) {
         for (JxlEndianness endianness : {JXL_BIG_ENDIAN, JXL_LITTLE_ENDIAN}) {
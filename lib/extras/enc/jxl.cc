@@ -11,13 +11,23 @@
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "lib/extras/packed_image.h"
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/exif.h"
+#include "lib/jxl/base/status.h"
 
 namespace jxl {
 namespace extras {
@@ -94,10 +104,11 @@ bool SetupFrame(JxlEncoder* enc, JxlEncoderFrameSettings* settings,
   return true;
 }
 
-bool ReadCompressedOutput(JxlEncoder* enc, std::vector<uint8_t>* compressed) {
-  compressed->clear();
-  compressed->resize(4096);
-  uint8_t* next_out = compressed->data();
+// Appends the output produced so far to `compressed`.
+bool AppendCompressedOutput(JxlEncoder* enc,
+                            std::vector<uint8_t>* compressed) {
+  compressed->resize(compressed->size() + 4096);
+  uint8_t* next_out = compressed->data() + compressed->size() - 4096;
   size_t avail_out = compressed->size() - (next_out - compressed->data());
   JxlEncoderStatus result = JXL_ENC_NEED_MORE_OUTPUT;
   while (result == JXL_ENC_NEED_MORE_OUTPUT) {
@@ -117,6 +128,218 @@ bool ReadCompressedOutput(JxlEncoder* enc, std::vector<uint8_t>* compressed) {
   return true;
 }
 
+bool ReadCompressedOutput(JxlEncoder* enc, std::vector<uint8_t>* compressed) {
+  compressed->clear();
+  return AppendCompressedOutput(enc, compressed);
+}
+
+namespace {
+
+constexpr size_t kMaxPrefetchedFrames = 2;
+
+// Takes the frames of a PackedFrameSource on a separate thread, so that the
+// next frames are decoded while the current one is encoded.
+class FramePrefetcher {
+ public:
+  explicit FramePrefetcher(PackedFrameSource* source)
+      : source_(source), thread_(&FramePrefetcher::Run, this) {}
+
+  ~FramePrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Sets `frame` to nullptr after the last frame or after an error.
+  Status Next(std::unique_ptr<PackedFrame>* frame) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !queue_.empty() || done_; });
+    if (queue_.empty()) {
+      frame->reset();
+      return status_;
+    }
+    *frame = std::move(queue_.front());
+    queue_.pop_front();
+    cv_.notify_all();
+    return true;
+  }
+
+ private:
+  void Run() {
+    for (;;) {
+      std::unique_ptr<PackedFrame> frame;
+      Status status = source_->NextFrame(&frame);
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!status || !frame) {
+        status_ = status;
+        done_ = true;
+        cv_.notify_all();
+        return;
+      }
+      queue_.push_back(std::move(frame));
+      cv_.notify_all();
+      cv_.wait(lock, [this] {
+        return queue_.size() < kMaxPrefetchedFrames || stop_;
+      });
+      if (stop_) return;
+    }
+  }
+
+  PackedFrameSource* source_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<PackedFrame>> queue_;
+  bool done_ = false;
+  bool stop_ = false;
+  Status status_ = true;
+  // Last, so that the thread starts after everything else is initialized.
+  std::thread thread_;
+};
+
+// Half-open bounds of the pixels in which two frames differ.
+struct ChangedRect {
+  size_t x0 = std::numeric_limits<size_t>::max();
+  size_t y0 = std::numeric_limits<size_t>::max();
+  size_t x1 = 0;
+  size_t y1 = 0;
+
+  bool empty() const { return x1 <= x0; }
+};
+
+bool SameLayout(const PackedImage& a, const PackedImage& b) {
+  return a.xsize == b.xsize && a.ysize == b.ysize && a.stride == b.stride &&
+         a.format.num_channels == b.format.num_channels &&
+         a.format.data_type == b.format.data_type &&
+         a.format.endianness == b.format.endianness;
+}
+
+void AddChangedPixels(const PackedImage& image, const PackedImage& reference,
+                      ChangedRect* rect) {
+  const size_t pixel_stride = image.pixel_stride();
+  for (size_t y = 0; y < image.ysize; ++y) {
+    const uint8_t* row = image.const_pixels(y, 0, 0);
+    const uint8_t* ref = reference.const_pixels(y, 0, 0);
+    if (memcmp(row, ref, image.xsize * pixel_stride) == 0) continue;
+    size_t x0 = 0;
+    while (memcmp(row + x0 * pixel_stride, ref + x0 * pixel_stride,
+                  pixel_stride) == 0) {
+      ++x0;
+    }
+    size_t x1 = image.xsize;
+    while (memcmp(row + (x1 - 1) * pixel_stride, ref + (x1 - 1) * pixel_stride,
+                  pixel_stride) == 0) {
+      --x1;
+    }
+    rect->x0 = std::min(rect->x0, x0);
+    rect->x1 = std::max(rect->x1, x1);
+    rect->y0 = std::min(rect->y0, y);
+    rect->y1 = y + 1;
+  }
+}
+
+StatusOr<PackedImage> CropImage(const PackedImage& image,
+                                const ChangedRect& rect) {
+  JXL_ASSIGN_OR_RETURN(PackedImage crop,
+                       PackedImage::Create(rect.x1 - rect.x0,
+                                           rect.y1 - rect.y0, image.format));
+  for (size_t y = 0; y < crop.ysize; ++y) {
+    memcpy(crop.pixels(y, 0, 0), image.const_pixels(rect.y0 + y, rect.x0, 0),
+           crop.xsize * image.pixel_stride());
+  }
+  return crop;
+}
+
+// Encodes the full-canvas frames of an animation that replace the canvas as
+// the sub-rectangle in which they differ from the frame in reference slot 1,
+// and blends them onto that frame. Only the frames that this class saw being
+// saved to slot 1 are compared against.
+class FrameCropper {
+ public:
+  FrameCropper(const JXLCompressParams& params, const PackedPixelFile& ppf)
+      : enabled_(params.crop_unchanged_frames && ppf.info.have_animation &&
+                 params.already_downsampled == 1),
+        xsize_(ppf.info.xsize),
+        ysize_(ppf.info.ysize) {}
+
+  // Sets `out` to the frame to encode in place of `frame`, either `frame`
+  // itself or a cropped copy that is valid until the next call. Unless passed
+  // to Retain(), `frame` must outlive the cropper.
+  Status Process(const PackedFrame& frame, const PackedFrame** out) {
+    *out = &frame;
+    const JxlLayerInfo& layer_info = frame.frame_info.layer_info;
+    const bool replaces_canvas =
+        !layer_info.have_crop &&
+        layer_info.blend_info.blendmode == JXL_BLEND_REPLACE &&
+        frame.color.xsize == xsize_ && frame.color.ysize == ysize_;
+    const PackedFrame* reference = reference_;
+    if (layer_info.save_as_reference == 1) {
+      reference_ = replaces_canvas ? &frame : nullptr;
+    }
+    if (!enabled_ || !replaces_canvas || reference == nullptr ||
+        !SameLayout(frame.color, reference->color) ||
+        frame.extra_channels.size() != reference->extra_channels.size()) {
+      return true;
+    }
+    ChangedRect rect;
+    AddChangedPixels(frame.color, reference->color, &rect);
+    for (size_t i = 0; i < frame.extra_channels.size(); ++i) {
+      if (!SameLayout(frame.extra_channels[i], reference->extra_channels[i])) {
+        return true;
+      }
+      AddChangedPixels(frame.extra_channels[i], reference->extra_channels[i],
+                       &rect);
+    }
+    if (rect.empty()) {
+      // A frame can not be empty, so a single unchanged pixel is encoded.
+      rect.x0 = rect.y0 = 0;
+      rect.x1 = rect.y1 = 1;
+    }
+    if (rect.x1 - rect.x0 == xsize_ && rect.y1 - rect.y0 == ysize_) {
+      return true;
+    }
+    JXL_ASSIGN_OR_RETURN(PackedImage color, CropImage(frame.color, rect));
+    cropped_ = jxl::make_unique<PackedFrame>(std::move(color));
+    for (const PackedImage& ec : frame.extra_channels) {
+      JXL_ASSIGN_OR_RETURN(PackedImage ec_crop, CropImage(ec, rect));
+      cropped_->extra_channels.emplace_back(std::move(ec_crop));
+    }
+    cropped_->name = frame.name;
+    cropped_->frame_info = frame.frame_info;
+    JxlLayerInfo& cropped_info = cropped_->frame_info.layer_info;
+    cropped_info.have_crop = JXL_TRUE;
+    cropped_info.crop_x0 = static_cast<int32_t>(rect.x0);
+    cropped_info.crop_y0 = static_cast<int32_t>(rect.y0);
+    cropped_info.xsize = cropped_->color.xsize;
+    cropped_info.ysize = cropped_->color.ysize;
+    cropped_info.blend_info.source = 1;
+    *out = cropped_.get();
+    return true;
+  }
+
+  // Takes ownership of a processed frame that is not kept alive by the
+  // caller, and frees it once it is no longer needed as a reference.
+  void Retain(std::unique_ptr<PackedFrame> frame) {
+    if (frame.get() == reference_) {
+      owned_reference_ = std::move(frame);
+    } else if (owned_reference_.get() != reference_) {
+      owned_reference_.reset();
+    }
+  }
+
+ private:
+  const bool enabled_;
+  const size_t xsize_;
+  const size_t ysize_;
+  const PackedFrame* reference_ = nullptr;
+  std::unique_ptr<PackedFrame> owned_reference_;
+  std::unique_ptr<PackedFrame> cropped_;
+};
+
+}  // namespace
+
 bool EncodeImageJXL(const JXLCompressParams& params, const PackedPixelFile& ppf,
                     const std::vector<uint8_t>* jpeg_bytes,
                     std::vector<uint8_t>* compressed) {
@@ -325,8 +548,15 @@ bool EncodeImageJXL(const JXLCompressParams& params, const PackedPixelFile& ppf,
       JxlEncoderCloseBoxes(enc);
     }
 
+    FrameCropper cropper(params, ppf);
     for (size_t num_frame = 0; num_frame < ppf.frames.size(); ++num_frame) {
-      const jxl::extras::PackedFrame& pframe = ppf.frames[num_frame];
+      const jxl::extras::PackedFrame* cropped_frame;
+      if (!cropper.Process(ppf.frames[num_frame], &cropped_frame)) {
+        fprintf(stderr, "Failed to crop frame %d.\n",
+                static_cast<int>(num_frame));
+        return false;
+      }
+      const jxl::extras::PackedFrame& pframe = *cropped_frame;
       const jxl::extras::PackedImage& pimage = pframe.color;
       JxlPixelFormat ppixelformat = pimage.format;
       size_t num_interleaved_alpha =
@@ -370,6 +600,70 @@ bool EncodeImageJXL(const JXLCompressParams& params, const PackedPixelFile& ppf,
         return false;
       }
     }
+    if (ppf.frame_source) {
+      if (!ppf.frame_source->Rewind()) {
+        fprintf(stderr, "Failed to rewind the frame source.\n");
+        return false;
+      }
+      // The encoder copies each frame, so to keep both memory use bounded
+      // and the decoder busy, every frame is encoded right after it is
+      // added, while the prefetcher decodes the next ones.
+      const size_t num_frames = ppf.frame_source->num_frames();
+      FramePrefetcher prefetcher(ppf.frame_source.get());
+      FrameCropper cropper(params, ppf);
+      compressed->clear();
+      for (size_t num_frame = 0; num_frame < num_frames; ++num_frame) {
+        std::unique_ptr<PackedFrame> decoded_frame;
+        if (!prefetcher.Next(&decoded_frame) || !decoded_frame) {
+          fprintf(stderr, "Failed to decode frame %d.\n",
+                  static_cast<int>(num_frame));
+          return false;
+        }
+        const PackedFrame* pframe;
+        if (!cropper.Process(*decoded_frame, &pframe)) {
+          fprintf(stderr, "Failed to crop frame %d.\n",
+                  static_cast<int>(num_frame));
+          return false;
+        }
+        JxlPixelFormat ppixelformat = pframe->color.format;
+        size_t num_interleaved_alpha =
+            (ppixelformat.num_channels - ppf.info.num_color_channels);
+        if (!SetupFrame(enc, settings, pframe->frame_info, params, ppf,
+                        num_frame, num_alpha_channels, num_interleaved_alpha,
+                        option_idx)) {
+          return false;
+        }
+        if (JXL_ENC_SUCCESS !=
+            JxlEncoderAddImageFrame(settings, &ppixelformat,
+                                    pframe->color.pixels(),
+                                    pframe->color.pixels_size)) {
+          fprintf(stderr, "JxlEncoderAddImageFrame() failed.\n");
+          return false;
+        }
+        for (size_t i = 0; i < pframe->extra_channels.size(); ++i) {
+          const PackedImage& ec = pframe->extra_channels[i];
+          if (JXL_ENC_SUCCESS != JxlEncoderSetExtraChannelBuffer(
+                                     settings, &ppixelformat, ec.pixels(),
+                                     ec.stride * ec.ysize,
+                                     num_interleaved_alpha + i)) {
+            fprintf(stderr, "JxlEncoderSetExtraChannelBuffer() failed.\n");
+            return false;
+          }
+        }
+        cropper.Retain(std::move(decoded_frame));
+        // The encoder marks a frame as the last one only if the frames are
+        // closed when it encodes it.
+        if (num_frame + 1 == num_frames) JxlEncoderCloseFrames(enc);
+        if (params.HasOutputProcessor()) {
+          if (JXL_ENC_SUCCESS != JxlEncoderFlushInput(enc)) {
+            fprintf(stderr, "JxlEncoderFlushInput() failed.\n");
+            return false;
+          }
+        } else if (!AppendCompressedOutput(enc, compressed)) {
+          return false;
+        }
+      }
+    }
   }
   JxlEncoderCloseInput(enc);
   if (params.HasOutputProcessor()) {
@@ -377,6 +671,8 @@ bool EncodeImageJXL(const JXLCompressParams& params, const PackedPixelFile& ppf,
       fprintf(stderr, "JxlEncoderAddChunkedFrame() failed.\n");
       return false;
     }
+  } else if (ppf.frame_source) {
+    if (!AppendCompressedOutput(enc, compressed)) return false;
   } else if (!ReadCompressedOutput(enc, compressed)) {
     return false;
   }
@@ -55,6 +55,11 @@ struct JXLCompressParams {
   // Whether to create brob boxes.
   bool compress_boxes = true;
 
+  // If set to true, the full-canvas frames of an animation are encoded as the
+  // sub-rectangle in which they differ from the last frame saved to reference
+  // slot 1.
+  bool crop_unchanged_frames = false;
+
   // Upper bound on the intensity level present in the image in nits (zero means
   // that the library chooses a default).
   float intensity_target = 0;
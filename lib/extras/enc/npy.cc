@@ -7,6 +7,7 @@
 
 #include <jxl/types.h>
 
+#include <cstring>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -14,6 +15,8 @@
 
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/status.h"
 
 namespace jxl {
 namespace extras {
@@ -247,22 +250,37 @@ bool WriteFrameToNPYArray(size_t xsize, size_t ysize, const PackedFrame& frame,
       return false;
     }
   }
-  // interleave the samples from color and extra channels
+  const uint8_t* color_pixels =
+      reinterpret_cast<const uint8_t*>(color.pixels());
+  const size_t color_row_size = xsize * color.pixel_stride();
+  size_t pixel_size = color.pixel_stride();
+  for (const auto& ec : frame.extra_channels) {
+    pixel_size += ec.pixel_stride();
+  }
+  const size_t pos = out->size();
+  out->resize(pos + ysize * xsize * pixel_size);
+  uint8_t* JXL_RESTRICT out_pixels = out->data() + pos;
   for (size_t y = 0; y < ysize; ++y) {
+    JXL_ENSURE(y * color.stride + color_row_size <= color.pixels_size);
+    const uint8_t* color_row = color_pixels + y * color.stride;
+    if (frame.extra_channels.empty()) {
+      // The samples are already in the order of the array.
+      memcpy(out_pixels, color_row, color_row_size);
+      out_pixels += color_row_size;
+      continue;
+    }
+    for (const auto& ec : frame.extra_channels) {
+      JXL_ENSURE(y * ec.stride + xsize * ec.pixel_stride() <= ec.pixels_size);
+    }
+    // interleave the samples from color and extra channels
     for (size_t x = 0; x < xsize; ++x) {
-      {
-        size_t sample_size = color.pixel_stride();
-        size_t offset = y * color.stride + x * sample_size;
-        uint8_t* pixels = reinterpret_cast<uint8_t*>(color.pixels());
-        JXL_ENSURE(offset + sample_size <= color.pixels_size);
-        Append(out, pixels + offset, sample_size);
-      }
+      memcpy(out_pixels, color_row + x * color.pixel_stride(),
+             color.pixel_stride());
+      out_pixels += color.pixel_stride();
       for (const auto& ec : frame.extra_channels) {
-        size_t sample_size = ec.pixel_stride();
-        size_t offset = y * ec.stride + x * sample_size;
-        uint8_t* pixels = reinterpret_cast<uint8_t*>(ec.pixels());
-        JXL_ENSURE(offset + sample_size <= ec.pixels_size);
-        Append(out, pixels + offset, sample_size);
+        const size_t sample_size = ec.pixel_stride();
+        memcpy(out_pixels, ec.const_pixels(y, x, 0), sample_size);
+        out_pixels += sample_size;
       }
     }
   }
@@ -8,8 +8,10 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/extras/packed_image.h"
@@ -23,6 +25,64 @@ namespace {
 
 constexpr size_t kMaxHeaderSize = 2000;
 
+// PGM (one channel) or PPM (three channels) header, up to kMaxHeaderSize.
+Status EncodePNMHeader(size_t num_channels, size_t xsize, size_t ysize,
+                       size_t bits_per_sample, char* header,
+                       size_t* header_size) {
+  uint32_t maxval = (1u << bits_per_sample) - 1;
+  char type = num_channels == 1 ? '5' : '6';
+  *header_size =
+      snprintf(header, kMaxHeaderSize, "P%c\n%" PRIuS " %" PRIuS "\n%u\n", type,
+               xsize, ysize, maxval);
+  JXL_RETURN_IF_ERROR(*header_size < kMaxHeaderSize);
+  return true;
+}
+
+// The samples of PGM and PPM are already in the order of the rows, so they are
+// written as they come, after the header.
+class PNMRowSink : public PackedRowSink {
+ public:
+  explicit PNMRowSink(std::function<Status(const uint8_t*, size_t)> write)
+      : write_(std::move(write)) {}
+
+  Status Start(const PackedPixelFile& ppf,
+               const JxlPixelFormat& format) override {
+    JXL_RETURN_IF_ERROR(Encoder::VerifyBasicInfo(ppf.info));
+    if (format.num_channels != 1 && format.num_channels != 3) {
+      return JXL_FAILURE("Invalid number of channels for PNM output");
+    }
+    if (format.data_type != JXL_TYPE_UINT8 &&
+        (format.data_type != JXL_TYPE_UINT16 ||
+         format.endianness != JXL_BIG_ENDIAN)) {
+      return JXL_FAILURE("Unsupported pixel format for PNM output");
+    }
+    JXL_RETURN_IF_ERROR(Encoder::VerifyBitDepth(
+        format.data_type, ppf.info.bits_per_sample,
+        ppf.info.exponent_bits_per_sample));
+    if (!ppf.metadata.exif.empty() || !ppf.metadata.iptc.empty() ||
+        !ppf.metadata.jumbf.empty() || !ppf.metadata.xmp.empty()) {
+      JXL_WARNING("PNM encoder ignoring metadata - use a different codec");
+    }
+    row_size_ = ppf.info.xsize * format.num_channels *
+                PackedImage::BitsPerChannel(format.data_type) / 8;
+    char header[kMaxHeaderSize];
+    size_t header_size;
+    JXL_RETURN_IF_ERROR(EncodePNMHeader(format.num_channels, ppf.info.xsize,
+                                        ppf.info.ysize,
+                                        ppf.info.bits_per_sample, header,
+                                        &header_size));
+    return write_(reinterpret_cast<const uint8_t*>(header), header_size);
+  }
+
+  Status AddRow(const uint8_t* row) override { return write_(row, row_size_); }
+
+  Status Finish(const PackedPixelFile& ppf) override { return true; }
+
+ private:
+  std::function<Status(const uint8_t*, size_t)> write_;
+  size_t row_size_ = 0;
+};
+
 class BasePNMEncoder : public Encoder {
  public:
   Status Encode(const PackedPixelFile& ppf, EncodedImage* encoded_image,
@@ -81,16 +141,19 @@ class PNMEncoder : public BasePNMEncoder {
     return EncodeImage(image, bits_per_sample, bytes);
   }
 
+  std::unique_ptr<PackedRowSink> CreateRowSink(
+      std::function<Status(const uint8_t*, size_t)> write) const override {
+    return jxl::make_unique<PNMRowSink>(std::move(write));
+  }
+
  private:
   static Status EncodeImage(const PackedImage& image, size_t bits_per_sample,
                             std::vector<uint8_t>* bytes) {
-    uint32_t maxval = (1u << bits_per_sample) - 1;
-    char type = image.format.num_channels == 1 ? '5' : '6';
     char header[kMaxHeaderSize];
-    size_t header_size =
-        snprintf(header, kMaxHeaderSize, "P%c\n%" PRIuS " %" PRIuS "\n%u\n",
-                 type, image.xsize, image.ysize, maxval);
-    JXL_RETURN_IF_ERROR(header_size < kMaxHeaderSize);
+    size_t header_size;
+    JXL_RETURN_IF_ERROR(EncodePNMHeader(image.format.num_channels, image.xsize,
+                                        image.ysize, bits_per_sample, header,
+                                        &header_size));
     bytes->resize(header_size + image.pixels_size);
     memcpy(bytes->data(), header, header_size);
     memcpy(bytes->data() + header_size,
@@ -0,0 +1,227 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/extras/gain_map_render.h"
+
+#include <jxl/cms.h>
+#include <jxl/gain_map.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "lib/extras/codec.h"
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_bundle.h"
+
+namespace jxl {
+
+namespace {
+
+// The fields of the ISO 21496-1 metadata, with the fractions evaluated.
+// Headrooms and gains are in stops (log2).
+struct GainMapMetadata {
+  size_t num_channels;
+  bool use_base_color_space;
+  float base_headroom;
+  float alternate_headroom;
+  float gain_map_min[3];
+  float gain_map_max[3];
+  float gamma[3];
+  float base_offset[3];
+  float alternate_offset[3];
+};
+
+Status ParseGainMapMetadata(const uint8_t* data, size_t size,
+                            GainMapMetadata* metadata) {
+  size_t pos = 0;
+  const auto read_u8 = [&](uint32_t* value) -> Status {
+    if (pos + 1 > size) return JXL_FAILURE("Truncated gain map metadata");
+    *value = data[pos];
+    pos += 1;
+    return true;
+  };
+  const auto read_u16 = [&](uint32_t* value) -> Status {
+    if (pos + 2 > size) return JXL_FAILURE("Truncated gain map metadata");
+    *value = LoadBE16(data + pos);
+    pos += 2;
+    return true;
+  };
+  const auto read_u32 = [&](uint32_t* value) -> Status {
+    if (pos + 4 > size) return JXL_FAILURE("Truncated gain map metadata");
+    *value = LoadBE32(data + pos);
+    pos += 4;
+    return true;
+  };
+  uint32_t minimum_version;
+  uint32_t writer_version;
+  uint32_t flags;
+  JXL_RETURN_IF_ERROR(read_u16(&minimum_version));
+  JXL_RETURN_IF_ERROR(read_u16(&writer_version));
+  (void)writer_version;
+  if (minimum_version != 0) {
+    return JXL_FAILURE("Unsupported gain map metadata version %u",
+                       minimum_version);
+  }
+  JXL_RETURN_IF_ERROR(read_u8(&flags));
+  metadata->num_channels = (flags & 0x80) ? 3 : 1;
+  metadata->use_base_color_space = (flags & 0x40) != 0;
+  const bool common_denominator = (flags & 0x08) != 0;
+
+  uint32_t denominator = 0;
+  if (common_denominator) JXL_RETURN_IF_ERROR(read_u32(&denominator));
+  // Reads a numerator, and a denominator unless it is the common one.
+  const auto read_fraction = [&](bool is_signed, float* value) -> Status {
+    uint32_t numerator;
+    JXL_RETURN_IF_ERROR(read_u32(&numerator));
+    uint32_t fraction_denominator = denominator;
+    if (!common_denominator) {
+      JXL_RETURN_IF_ERROR(read_u32(&fraction_denominator));
+    }
+    if (fraction_denominator == 0) {
+      return JXL_FAILURE("Zero denominator in gain map metadata");
+    }
+    const double n = is_signed ? static_cast<int32_t>(numerator) : numerator;
+    *value = static_cast<float>(n / fraction_denominator);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(read_fraction(false, &metadata->base_headroom));
+  JXL_RETURN_IF_ERROR(read_fraction(false, &metadata->alternate_headroom));
+  for (size_t c = 0; c < metadata->num_channels; ++c) {
+    JXL_RETURN_IF_ERROR(read_fraction(true, &metadata->gain_map_min[c]));
+    JXL_RETURN_IF_ERROR(read_fraction(true, &metadata->gain_map_max[c]));
+    JXL_RETURN_IF_ERROR(read_fraction(false, &metadata->gamma[c]));
+    JXL_RETURN_IF_ERROR(read_fraction(true, &metadata->base_offset[c]));
+    JXL_RETURN_IF_ERROR(read_fraction(true, &metadata->alternate_offset[c]));
+    if (metadata->gamma[c] <= 0) {
+      return JXL_FAILURE("Invalid gain map gamma");
+    }
+  }
+  return true;
+}
+
+// Position of output sample `i` between two input samples, for resampling
+// `in_size` samples to `out_size` with aligned centers.
+void ResamplingPosition(size_t i, size_t in_size, size_t out_size,
+                        size_t* first, size_t* second, float* frac) {
+  const float pos = std::max(
+      0.f, (i + 0.5f) * static_cast<float>(in_size) / out_size - 0.5f);
+  *first = std::min(static_cast<size_t>(pos), in_size - 1);
+  *second = std::min(*first + 1, in_size - 1);
+  *frac = pos - *first;
+}
+
+}  // namespace
+
+Status ApplyGainMap(float display_headroom, float sdr_white_nits,
+                    CodecInOut* io, ThreadPool* pool) {
+  const std::vector<uint8_t>& jhgm = io->blobs.jhgm;
+  if (jhgm.empty()) return JXL_FAILURE("No gain map");
+  JxlGainMapBundle bundle;
+  size_t bytes_read;
+  if (!JxlGainMapReadBundle(&bundle, jhgm.data(), jhgm.size(), &bytes_read)) {
+    return JXL_FAILURE("Invalid gain map bundle");
+  }
+  GainMapMetadata metadata;
+  JXL_RETURN_IF_ERROR(ParseGainMapMetadata(
+      bundle.gain_map_metadata, bundle.gain_map_metadata_size, &metadata));
+
+  // How much of the gain to apply, 0 for the base image and 1 for the
+  // alternate one.
+  float weight = 0;
+  if (metadata.alternate_headroom != metadata.base_headroom) {
+    weight = Clamp1((display_headroom - metadata.base_headroom) /
+                        (metadata.alternate_headroom - metadata.base_headroom),
+                    0.f, 1.f);
+  }
+
+  // Decode the gain map at its own resolution and compute the weighted log2
+  // gain there, so that only the interpolation and exp2 are done for each
+  // pixel of the image.
+  CodecInOut gain_map{io->memory_manager};
+  JXL_RETURN_IF_ERROR(SetFromBytes(Bytes(bundle.gain_map, bundle.gain_map_size),
+                                   &gain_map, pool));
+  const Image3F& gain_map_pixels = *gain_map.Main().color();
+  const size_t gain_xsize = gain_map_pixels.xsize();
+  const size_t gain_ysize = gain_map_pixels.ysize();
+  JXL_ASSIGN_OR_RETURN(
+      Image3F log_gain,
+      Image3F::Create(io->memory_manager, gain_xsize, gain_ysize));
+  for (size_t c = 0; c < 3; ++c) {
+    const size_t mc = std::min(c, metadata.num_channels - 1);
+    const float gain_min = metadata.gain_map_min[mc];
+    const float gain_range = metadata.gain_map_max[mc] - gain_min;
+    const float inv_gamma = 1.f / metadata.gamma[mc];
+    for (size_t y = 0; y < gain_ysize; ++y) {
+      const float* JXL_RESTRICT row_in = gain_map_pixels.ConstPlaneRow(c, y);
+      float* JXL_RESTRICT row_out = log_gain.PlaneRow(c, y);
+      for (size_t x = 0; x < gain_xsize; ++x) {
+        float g = Clamp1(row_in[x], 0.f, 1.f);
+        if (inv_gamma != 1.f) g = std::pow(g, inv_gamma);
+        row_out[x] = weight * (gain_min + gain_range * g);
+      }
+    }
+  }
+
+  // The gain is applied in linear light, in the base color space unless the
+  // metadata asks for the alternate one.
+  ColorEncoding c_linear = io->metadata.m.color_encoding;
+  if (!metadata.use_base_color_space && bundle.has_color_encoding) {
+    JXL_RETURN_IF_ERROR(c_linear.FromExternal(bundle.color_encoding));
+  }
+  c_linear.Tf().SetTransferFunction(TransferFunction::kLinear);
+  JXL_RETURN_IF_ERROR(c_linear.CreateICC());
+
+  const float scale = std::exp2(-display_headroom);
+  for (ImageBundle& ib : io->frames) {
+    JXL_RETURN_IF_ERROR(ib.TransformTo(c_linear, *JxlGetDefaultCms(), pool));
+    const size_t xsize = ib.xsize();
+    const size_t ysize = ib.ysize();
+    std::vector<size_t> x0(xsize);
+    std::vector<size_t> x1(xsize);
+    std::vector<float> fx(xsize);
+    for (size_t x = 0; x < xsize; ++x) {
+      ResamplingPosition(x, gain_xsize, xsize, &x0[x], &x1[x], &fx[x]);
+    }
+    Image3F* color = ib.color();
+    const auto process_row = [&](const uint32_t y,
+                                 size_t /* thread */) -> Status {
+      size_t y0;
+      size_t y1;
+      float fy;
+      ResamplingPosition(y, gain_ysize, ysize, &y0, &y1, &fy);
+      for (size_t c = 0; c < 3; ++c) {
+        const size_t mc = std::min(c, metadata.num_channels - 1);
+        const float base_offset = metadata.base_offset[mc];
+        const float alternate_offset = metadata.alternate_offset[mc];
+        const float* JXL_RESTRICT gain_row0 = log_gain.ConstPlaneRow(c, y0);
+        const float* JXL_RESTRICT gain_row1 = log_gain.ConstPlaneRow(c, y1);
+        float* JXL_RESTRICT row = color->PlaneRow(c, y);
+        for (size_t x = 0; x < xsize; ++x) {
+          const float top =
+              gain_row0[x0[x]] + fx[x] * (gain_row0[x1[x]] - gain_row0[x0[x]]);
+          const float bottom =
+              gain_row1[x0[x]] + fx[x] * (gain_row1[x1[x]] - gain_row1[x0[x]]);
+          const float gain = std::exp2(top + fy * (bottom - top));
+          row[x] = ((row[x] + base_offset) * gain - alternate_offset) * scale;
+        }
+      }
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize, ThreadPool::NoInit,
+                                  process_row, "ApplyGainMap"));
+  }
+  io->metadata.m.color_encoding = c_linear;
+  io->metadata.m.SetIntensityTarget(sdr_white_nits / scale);
+  return true;
+}
+
+}  // namespace jxl
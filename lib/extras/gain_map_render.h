@@ -0,0 +1,30 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_EXTRAS_GAIN_MAP_RENDER_H_
+#define LIB_EXTRAS_GAIN_MAP_RENDER_H_
+
+// Renders images with a gain map (jhgm box) for a given display.
+
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/codec_in_out.h"
+
+namespace jxl {
+
+// Applies the gain map in io->blobs.jhgm to all the frames of `io`, for a
+// display whose peak is `display_headroom` stops above SDR white, following
+// ISO 21496-1. The gain map is decoded at its own resolution and upsampled in
+// its log domain while it is applied, in a single pass over the base image.
+//
+// The result is in the linear version of the color space of the base image,
+// normalized to the peak of the display, and the intensity target is set to
+// `sdr_white_nits` * 2^display_headroom. Fails if there is no gain map.
+Status ApplyGainMap(float display_headroom, float sdr_white_nits,
+                    CodecInOut* io, ThreadPool* pool = nullptr);
+
+}  // namespace jxl
+
+#endif  // LIB_EXTRAS_GAIN_MAP_RENDER_H_
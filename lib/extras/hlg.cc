@@ -8,39 +8,55 @@
 #include <jxl/cms.h>
 
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/extras/hlg.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/cms/tone_mapping-inl.h"
+
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
+namespace HWY_NAMESPACE {
 
-float GetHlgGamma(const float peak_luminance, const float surround_luminance) {
-  return 1.2f * std::pow(1.111f, std::log2(peak_luminance / 1000.f)) *
-         std::pow(0.98f, std::log2(surround_luminance / 5.f));
-}
+static constexpr Vector3 rec2020_luminances{0.2627f, 0.6780f, 0.0593f};
+
+Status HlgOOTFFrame(ImageBundle* const ib, const float gamma,
+                    ThreadPool* const pool) {
+  HWY_FULL(float) df;
+  using V = decltype(Zero(df));
 
-Status HlgOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
   ColorEncoding linear_rec2020;
   linear_rec2020.SetColorSpace(ColorSpace::kRGB);
   JXL_RETURN_IF_ERROR(linear_rec2020.SetPrimariesType(Primaries::k2100));
   JXL_RETURN_IF_ERROR(linear_rec2020.SetWhitePointType(WhitePoint::kD65));
   linear_rec2020.Tf().SetTransferFunction(TransferFunction::kLinear);
-  JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
-  JXL_RETURN_IF_ERROR(
-      ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
-
-  const auto process_row = [&](const int y, const int thread) -> Status {
-    float* const JXL_RESTRICT rows[3] = {ib->color()->PlaneRow(0, y),
-                                         ib->color()->PlaneRow(1, y),
-                                         ib->color()->PlaneRow(2, y)};
-    for (size_t x = 0; x < ib->xsize(); ++x) {
-      float& red = rows[0][x];
-      float& green = rows[1][x];
-      float& blue = rows[2][x];
-      const float luminance = 0.2627f * red + 0.6780f * green + 0.0593f * blue;
-      const float ratio = std::pow(luminance, gamma - 1);
-      if (std::isfinite(ratio)) {
-        red *= ratio;
-        green *= ratio;
-        blue *= ratio;
-      }
+  // The image is usually already in linear Rec. 2020 when this follows tone
+  // mapping, in which case there is no need for another pass over it.
+  if (!ib->c_current().SameColorEncoding(linear_rec2020)) {
+    JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
+    JXL_RETURN_IF_ERROR(
+        ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
+  }
+
+  const HlgOOTF ootf = HlgOOTF::WithGamma(gamma, rec2020_luminances);
+
+  const auto process_row = [&](const uint32_t y,
+                               size_t /* thread */) -> Status {
+    float* const JXL_RESTRICT row_r = ib->color()->PlaneRow(0, y);
+    float* const JXL_RESTRICT row_g = ib->color()->PlaneRow(1, y);
+    float* const JXL_RESTRICT row_b = ib->color()->PlaneRow(2, y);
+    for (size_t x = 0; x < ib->xsize(); x += Lanes(df)) {
+      V red = Load(df, row_r + x);
+      V green = Load(df, row_g + x);
+      V blue = Load(df, row_b + x);
+      ootf.Apply(&red, &green, &blue);
+      Store(red, df, row_r + x);
+      Store(green, df, row_g + x);
+      Store(blue, df, row_b + x);
     }
     return true;
   };
@@ -50,8 +66,30 @@ Status HlgOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
   return true;
 }
 
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+namespace {
+HWY_EXPORT(HlgOOTFFrame);
+}  // namespace
+
+float GetHlgGamma(const float peak_luminance, const float surround_luminance) {
+  return 1.2f * std::pow(1.111f, std::log2(peak_luminance / 1000.f)) *
+         std::pow(0.98f, std::log2(surround_luminance / 5.f));
+}
+
+Status HlgOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
+  return HWY_DYNAMIC_DISPATCH(HlgOOTFFrame)(ib, gamma, pool);
+}
+
 Status HlgInverseOOTF(ImageBundle* ib, const float gamma, ThreadPool* pool) {
   return HlgOOTF(ib, 1.f / gamma, pool);
 }
 
 }  // namespace jxl
+#endif
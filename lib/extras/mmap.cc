@@ -31,6 +31,7 @@ struct MemoryMappedFileImpl {
 
     f->ptr = mmap(nullptr, f->mmap_len, PROT_READ, MAP_SHARED, f->fd, 0);
     if (f->ptr == MAP_FAILED) {
+      f->ptr = nullptr;
       return JXL_FAILURE("mmap failure");
     }
     return f;
@@ -39,6 +40,13 @@ struct MemoryMappedFileImpl {
   const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(ptr); }
   size_t size() const { return mmap_len; }
 
+  void AdviseSequential() const {
+#if defined(MADV_SEQUENTIAL)
+    // Only a hint, failure is harmless.
+    (void)madvise(ptr, mmap_len, MADV_SEQUENTIAL);
+#endif
+  }
+
   ~MemoryMappedFileImpl() {
     if (fd != -1) {
       close(fd);
@@ -103,6 +111,9 @@ struct MemoryMappedFileImpl {
   const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(ptr); }
   size_t size() const { return fsize.QuadPart; }
 
+  // Already requested with FILE_FLAG_SEQUENTIAL_SCAN.
+  void AdviseSequential() const {}
+
   HandleUniquePtr handle;
   HandleUniquePtr handle_mapping;
   LARGE_INTEGER fsize;
@@ -123,6 +134,7 @@ struct MemoryMappedFileImpl {
 
   const uint8_t* data() const { return nullptr; }
   size_t size() const { return 0; }
+  void AdviseSequential() const {}
 };
 
 }  // namespace jxl
@@ -146,4 +158,5 @@ MemoryMappedFile& MemoryMappedFile::operator=(MemoryMappedFile&&) noexcept =
 
 const uint8_t* MemoryMappedFile::data() const { return impl_->data(); }
 size_t MemoryMappedFile::size() const { return impl_->size(); }
+void MemoryMappedFile::AdviseSequential() const { impl_->AdviseSequential(); }
 }  // namespace jxl
@@ -18,6 +18,10 @@ class MemoryMappedFile {
   static StatusOr<MemoryMappedFile> Init(const char* path);
   const uint8_t* data() const;
   size_t size() const;
+  // Hints that the file will be read (about) from start to end, so that the
+  // system reads ahead aggressively and may drop the pages that were read.
+  // No-op where not supported.
+  void AdviseSequential() const;
   MemoryMappedFile();                                        // NOLINT
   ~MemoryMappedFile();                                       // NOLINT
   MemoryMappedFile(MemoryMappedFile&&) noexcept;             // NOLINT
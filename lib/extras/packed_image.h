@@ -243,6 +243,22 @@ class ChunkedPackedFrame {
   std::function<JxlChunkedFrameInputSource()> get_input_source_;
 };
 
+// Produces the frames of an animation one at a time, so that a frame can be
+// encoded while the next one is still being decoded.
+class PackedFrameSource {
+ public:
+  virtual ~PackedFrameSource() = default;
+
+  virtual size_t num_frames() const = 0;
+
+  // Starts again from the first frame.
+  virtual Status Rewind() = 0;
+
+  // The next frame, or nullptr after the last one. May be called from another
+  // thread than the one that created the source, but never concurrently.
+  virtual Status NextFrame(std::unique_ptr<PackedFrame>* frame) = 0;
+};
+
 // Optional metadata associated with a file
 class PackedMetadata {
  public:
@@ -291,17 +307,39 @@ class PackedPixelFile {
   std::unique_ptr<PackedFrame> preview_frame;
   std::vector<PackedFrame> frames;
   mutable std::vector<ChunkedPackedFrame> chunked_frames;
+  // If set, the frames come from here instead of `frames`.
+  std::unique_ptr<PackedFrameSource> frame_source;
 
   PackedMetadata metadata;
   PackedPixelFile() { JxlEncoderInitBasicInfo(&info); };
 
   size_t num_frames() const {
+    if (frame_source) return frame_source->num_frames();
     return chunked_frames.empty() ? frames.size() : chunked_frames.size();
   }
   size_t xsize() const { return info.xsize; }
   size_t ysize() const { return info.ysize; }
 };
 
+// Receives the rows of a single-frame image from top to bottom, so that they
+// can be written out as they are decoded instead of after the whole frame.
+class PackedRowSink {
+ public:
+  virtual ~PackedRowSink() = default;
+
+  // Called before the first row. `ppf` has the metadata but no frames, the
+  // rows will be in `format`.
+  virtual Status Start(const PackedPixelFile& ppf,
+                       const JxlPixelFormat& format) = 0;
+
+  // The next row, xsize pixels in `format` without any padding.
+  virtual Status AddRow(const uint8_t* row) = 0;
+
+  // Called after the last row. `ppf` may have more metadata than at Start,
+  // e.g. the boxes that come after the codestream.
+  virtual Status Finish(const PackedPixelFile& ppf) = 0;
+};
+
 }  // namespace extras
 }  // namespace jxl
 
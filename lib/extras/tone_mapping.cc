@@ -35,9 +35,11 @@ Status ToneMapFrame(const std::pair<float, float> display_nits,
   JXL_RETURN_IF_ERROR(linear_rec2020.SetPrimariesType(Primaries::k2100));
   JXL_RETURN_IF_ERROR(linear_rec2020.SetWhitePointType(WhitePoint::kD65));
   linear_rec2020.Tf().SetTransferFunction(TransferFunction::kLinear);
-  JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
-  JXL_RETURN_IF_ERROR(
-      ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
+  if (!ib->c_current().SameColorEncoding(linear_rec2020)) {
+    JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
+    JXL_RETURN_IF_ERROR(
+        ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
+  }
 
   Rec2408ToneMapper<decltype(df)> tone_mapper(
       {ib->metadata()->tone_mapping.min_nits,
@@ -75,9 +77,11 @@ Status GamutMapFrame(ImageBundle* const ib, float preserve_saturation,
   JXL_RETURN_IF_ERROR(linear_rec2020.SetPrimariesType(Primaries::k2100));
   JXL_RETURN_IF_ERROR(linear_rec2020.SetWhitePointType(WhitePoint::kD65));
   linear_rec2020.Tf().SetTransferFunction(TransferFunction::kLinear);
-  JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
-  JXL_RETURN_IF_ERROR(
-      ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
+  if (!ib->c_current().SameColorEncoding(linear_rec2020)) {
+    JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
+    JXL_RETURN_IF_ERROR(
+        ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
+  }
 
   const auto process_row = [&](const uint32_t y, size_t /* thread*/) -> Status {
     float* const JXL_RESTRICT row_r = ib->color()->PlaneRow(0, y);
@@ -17,6 +17,18 @@ extern "C" {
 
 JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCms();
 
+/** Returns the default CMS, except that transforms that it cannot do with a
+ * matrix are baked into a lut_size^3 grid, which is then interpolated instead
+ * of running the CMS for each pixel. Larger grids are more accurate but take
+ * longer to compute (once for each pair of profiles) and use more memory;
+ * 33 is a common choice, and 65 is close to exact for 8-bit outputs. Pixels
+ * outside of [0, 1] still go through the CMS.
+ *
+ * @param lut_size number of grid points per channel, from 2 to 65.
+ * @return nullptr if lut_size is out of range.
+ */
+JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCmsWithLut(size_t lut_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -106,6 +106,21 @@ JXL_EXPORT JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager);
  */
 JXL_EXPORT void JxlDecoderReset(JxlDecoder* dec);
 
+/**
+ * Re-initializes a @ref JxlDecoder instance like @ref JxlDecoderReset, but
+ * keeps the internal buffers that were allocated for decoding the previous
+ * image. They are reused when decoding the next image if it has the same
+ * dimensions, which avoids allocating and freeing them again when a service
+ * decodes many images of similar size with the same decoder. Buffers that do
+ * not fit the next image are reallocated.
+ *
+ * The kept memory is released by @ref JxlDecoderReset and @ref
+ * JxlDecoderDestroy. @ref JxlDecoderRewind also keeps these buffers.
+ *
+ * @param dec instance to be re-initialized.
+ */
+JXL_EXPORT void JxlDecoderResetKeepAllocations(JxlDecoder* dec);
+
 /**
  * Deinitializes and frees @ref JxlDecoder instance.
  *
@@ -326,6 +341,78 @@ typedef enum {
   JXL_DEC_BOX_COMPLETE = 0x10000,
 } JxlDecoderStatus;
 
+/**
+ * Makes the decoder serve its allocations from blocks of @p block_size bytes
+ * obtained from its memory manager, instead of calling it for every buffer.
+ * This reduces the number of calls to the memory manager and the
+ * fragmentation of its heap when decoding many images. A block is returned to
+ * the memory manager once all the buffers in it are freed, e.g. by @ref
+ * JxlDecoderReset, and all of them by @ref JxlDecoderDestroy. Buffers larger
+ * than a quarter of @p block_size get a block of their own.
+ *
+ * Must be called before starting to decode. The setting is kept by @ref
+ * JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @param block_size size of the blocks in bytes, must be positive
+ * @return ::JXL_DEC_SUCCESS if the arena was set up, ::JXL_DEC_ERROR if
+ *   @p block_size is 0, if decoding has started or if an arena is already set.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMemoryArena(JxlDecoder* dec,
+                                                     size_t block_size);
+
+/**
+ * Asks the operating system to back the buffers of at least @p threshold bytes
+ * that the decoder allocates with transparent huge pages, which reduces the
+ * TLB misses when processing large images. Only has an effect where supported
+ * (Linux with transparent huge pages in "madvise" or "always" mode), and only
+ * for the parts of the buffers that cover whole 2 MiB pages.
+ *
+ * Must be called before starting to decode; later calls change the threshold.
+ * The setting is kept by @ref JxlDecoderReset. If set before @ref
+ * JxlDecoderSetMemoryArena, it applies to the blocks of the arena.
+ *
+ * @param dec decoder object
+ * @param threshold minimum size of the buffers in bytes, or 0 to disable
+ * @return ::JXL_DEC_SUCCESS if the threshold was set, ::JXL_DEC_ERROR if
+ *   decoding has started.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetHugePageThreshold(JxlDecoder* dec,
+                                                           size_t threshold);
+
+/**
+ * Limits the memory that the decoder allocates from its memory manager to
+ * @p limit_bytes in use at once, and starts tracking its peak usage, see @ref
+ * JxlDecoderGetPeakMemoryUsage. Decoding fails with ::JXL_DEC_ERROR when an
+ * allocation would exceed the limit. The decoder already renders frames group
+ * by group, without full-frame intermediate buffers; providing the output
+ * with @ref JxlDecoderSetImageOutCallback rather than a buffer keeps the
+ * usage lower still.
+ *
+ * Must be called before starting to decode; later calls only change the
+ * limit. The setting is kept by @ref JxlDecoderReset. If set before @ref
+ * JxlDecoderSetMemoryArena, the limit applies to the blocks of the arena.
+ *
+ * @param dec decoder object
+ * @param limit_bytes maximum number of bytes in use, or 0 to only track usage
+ * @return ::JXL_DEC_SUCCESS if the limit was set, ::JXL_DEC_ERROR if decoding
+ *   has started and no limit was set before.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec,
+                                                     uint64_t limit_bytes);
+
+/**
+ * Outputs the largest number of bytes that the decoder had allocated at once
+ * since @ref JxlDecoderSetMemoryLimit was called.
+ *
+ * @param dec decoder object
+ * @param peak_bytes output for the number of bytes
+ * @return ::JXL_DEC_SUCCESS, or ::JXL_DEC_ERROR if @ref
+ *   JxlDecoderSetMemoryLimit was not called.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetPeakMemoryUsage(const JxlDecoder* dec,
+                                                         uint64_t* peak_bytes);
+
 /** Types of progressive detail.
  * Setting a progressive detail with value N implies all progressive details
  * with smaller or equal value. Currently only the following level of
@@ -380,14 +467,24 @@ typedef enum {
  * The difference to @ref JxlDecoderReset is that some state is kept, namely
  * settings set by a call to
  *  - @ref JxlDecoderSetCoalescing,
+ *  - @ref JxlDecoderSetCropRegion,
+ *  - @ref JxlDecoderSetDownsampling,
  *  - @ref JxlDecoderSetDesiredIntensityTarget,
  *  - @ref JxlDecoderSetDecompressBoxes,
  *  - @ref JxlDecoderSetKeepOrientation,
  *  - @ref JxlDecoderSetUnpremultiplyAlpha,
+ *  - @ref JxlDecoderSetPremultiplyAlpha,
  *  - @ref JxlDecoderSetParallelRunner,
  *  - @ref JxlDecoderSetRenderSpotcolors, and
  *  - @ref JxlDecoderSubscribeEvents.
  *
+ * The decoder does not keep the pixels of frames it already output, so
+ * looping playback decodes every frame again after a rewind. Applications
+ * that can spare the memory should keep the (coalesced) frames they want to
+ * replay themselves, and when a loop reaches the first frame missing from
+ * their cache, rewind and call @ref JxlDecoderSkipFrames to get there: only
+ * the frames that the missing one depends on are decoded then.
+ *
  * @param dec decoder object
  */
 JXL_EXPORT void JxlDecoderRewind(JxlDecoder* dec);
@@ -407,6 +504,11 @@ JXL_EXPORT void JxlDecoderRewind(JxlDecoder* dec);
  * to the file format but are not rendered as part of an animation, or are not
  * the final still frame of a still image, are not counted.
  *
+ * If a "jxli" frame index box was seen before the frames being skipped, and
+ * coalescing is enabled, none of the frames before the last indexed frame up
+ * to the one skipped to are decoded. Indexed frames are keyframes: neither
+ * they nor the frames after them depend on the frames before them.
+ *
  * @param dec decoder object
  * @param amount the amount of frames to skip
  */
@@ -430,6 +532,13 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSkipCurrentFrame(JxlDecoder* dec);
  * Set the parallel runner for multithreading. May only be set before starting
  * decoding.
  *
+ * The runner is used within each frame: groups are entropy decoded and
+ * rendered, including the conversion to the output format and the calls of
+ * the image out callback, in parallel. Frames themselves are decoded one
+ * after another, since the runner only offers blocking parallel-for calls and
+ * a frame can depend on the previous ones; the decoder does not start
+ * decoding the next frame before the current one was output.
+ *
  * @param dec decoder object
  * @param parallel_runner function pointer to runner for multithreading. It may
  *     be NULL to use the default, single-threaded, runner. A multithreaded
@@ -527,6 +636,25 @@ JxlDecoderSetKeepOrientation(JxlDecoder* dec, JXL_BOOL skip_reorientation);
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetUnpremultiplyAlpha(JxlDecoder* dec, JXL_BOOL unpremul_alpha);
 
+/**
+ * Enables or disables premultiplying unassociated alpha channels. If
+ * premul_alpha is set to ::JXL_TRUE, then for an unassociated alpha channel,
+ * the color channels of an output with alpha are multiplied by the alpha
+ * channel while the pixels are written, so that compositors expecting
+ * premultiplied colors do not need a separate pass. This function has no
+ * effect if the image does not have an unassociated alpha channel.
+ *
+ * By default, this option is disabled, and the returned pixel data "as is".
+ *
+ * This function must be called at the beginning, before decoding is performed.
+ *
+ * @param dec decoder object
+ * @param premul_alpha JXL_TRUE to enable, JXL_FALSE to disable.
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus
+JxlDecoderSetPremultiplyAlpha(JxlDecoder* dec, JXL_BOOL premul_alpha);
+
 /** Enables or disables rendering spot colors. By default, spot colors
  * are rendered, which is OK for viewing the decoded image. If render_spotcolors
  * is ::JXL_FALSE, then spot colors are not rendered, and have to be
@@ -556,6 +684,110 @@ JxlDecoderSetRenderSpotcolors(JxlDecoder* dec, JXL_BOOL render_spotcolors);
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec,
                                                     JXL_BOOL coalescing);
 
+/** Restricts the decoded image to a rectangular region of interest. When set,
+ * the image out buffer, image out callback and extra channel buffers only
+ * receive the pixels of the given rectangle, and the buffer sizes returned by
+ * @ref JxlDecoderImageOutBufferSize and @ref JxlDecoderExtraChannelBufferSize
+ * are those of the rectangle. The pixel at (x0, y0) of the image is the first
+ * pixel of the output.
+ *
+ * The coordinates are those of the image as stored in the codestream, that is
+ * before the orientation is undone; they match the output coordinates if @ref
+ * JxlDecoderSetKeepOrientation is enabled or the image has no orientation. If
+ * the orientation is undone, it is applied to the cropped region.
+ *
+ * When the frame allows it, the decoder uses the table of contents to skip
+ * the groups that do not contribute to the region, so that decoding a small
+ * region of a large image is only proportional to the size of the region. The
+ * bytes of skipped groups need not be provided with @ref JxlDecoderSetInput.
+ *
+ * The region is ignored for the preview frame, and only applies when
+ * coalescing is enabled (see @ref JxlDecoderSetCoalescing). A region with
+ * xsize or ysize 0 disables cropping, which is the default.
+ *
+ * This function must be called before an image out buffer or callback is set.
+ *
+ * @param dec decoder object
+ * @param x0 horizontal position of the top-left corner of the region.
+ * @param y0 vertical position of the top-left corner of the region.
+ * @param xsize width of the region.
+ * @param ysize height of the region.
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR if called at the
+ *     wrong time or if the region is outside of the image.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec,
+                                                    uint32_t x0, uint32_t y0,
+                                                    uint32_t xsize,
+                                                    uint32_t ysize);
+
+/** Makes the decoder output the image at a reduced resolution, for example to
+ * produce thumbnails. The output dimensions are the image dimensions divided by
+ * @p factor, rounded up, and the buffer sizes returned by @ref
+ * JxlDecoderImageOutBufferSize and @ref JxlDecoderExtraChannelBufferSize are
+ * those of the downsampled image.
+ *
+ * With a factor of 8, frames that allow it are rendered from their DC
+ * coefficients only: no AC coefficients are decoded, and the input bytes of
+ * the AC sections need not be provided with @ref JxlDecoderSetInput. This is
+ * the case for VarDCT frames without extra channels, patches or splines. Other
+ * frames, and other factors, are decoded at full resolution and subsampled
+ * when written to the output.
+ *
+ * The downsampling is ignored for the preview frame, and only applies when
+ * coalescing is enabled (see @ref JxlDecoderSetCoalescing). It cannot be
+ * combined with @ref JxlDecoderSetCropRegion.
+ *
+ * This function must be called before an image out buffer or callback is set.
+ *
+ * @param dec decoder object
+ * @param factor 1 (the default, full resolution), 2, 4 or 8.
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR if called at the
+ *     wrong time or with an unsupported factor.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec,
+                                                      uint32_t factor);
+
+/** A range of bytes of the input file, container boxes included.
+ */
+typedef struct {
+  /** Position of the first byte, from the start of the file. */
+  uint64_t offset;
+  /** Number of bytes. */
+  uint64_t size;
+} JxlInputRange;
+
+/**
+ * Returns the byte ranges of the input that the decoder still needs in order
+ * to reach the next ::JXL_DEC_FRAME_PROGRESSION or ::JXL_DEC_FULL_IMAGE event
+ * of the current frame, so that a client fetching the file with range requests
+ * can fetch them in parallel. Adjacent ranges are merged, and they are sorted
+ * by offset. Sections of the frame that are not needed for the crop region
+ * (see @ref JxlDecoderSetCropRegion), the downsampling (see @ref
+ * JxlDecoderSetDownsampling) or the next progression step are left out.
+ *
+ * The decoder never reads the bytes of the current frame outside of these
+ * ranges, but still expects the input to be contiguous: when passing the bytes
+ * after the first range to @ref JxlDecoderSetInput, the bytes between the
+ * ranges may have any value.
+ *
+ * Can only be called while decoding the pixels of a frame, that is after
+ * ::JXL_DEC_NEED_IMAGE_OUT_BUFFER, ::JXL_DEC_FRAME_PROGRESSION or a
+ * ::JXL_DEC_NEED_MORE_INPUT within the frame, and only if the rest of the
+ * frame is in the current codestream box.
+ *
+ * @param dec decoder object
+ * @param ranges array of @p max_ranges ranges to fill in, may be NULL if @p
+ *     max_ranges is 0.
+ * @param max_ranges size of the @p ranges array.
+ * @param num_ranges receives the number of ranges needed, which may be more
+ *     than @p max_ranges.
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR if called at the
+ *     wrong time or if the rest of the frame spans several codestream boxes.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetNeededInputRanges(
+    const JxlDecoder* dec, JxlInputRange* ranges, size_t max_ranges,
+    size_t* num_ranges);
+
 /**
  * Decodes JPEG XL file using the available bytes. Requires input has been
  * set with @ref JxlDecoderSetInput. After @ref JxlDecoderProcessInput, input
@@ -903,6 +1135,62 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetCms(JxlDecoder* dec,
 // TODO(firsching): add a function JxlDecoderSetDefaultCms() for setting a
 // default in case libjxl is build with a CMS.
 
+/**
+ * Parameters to convert XYB samples to linear RGB outside of the decoder, for
+ * example in a shader. They are returned by @ref
+ * JxlDecoderGetOpsinInverseParams.
+ *
+ * A sample (X, Y, B) of a ::JXL_COLOR_SPACE_XYB output is first unscaled:
+ *
+ *     Y = Y' / scaled_xyb_scale[1] - scaled_xyb_offset[1]
+ *     X = X' / scaled_xyb_scale[0] - scaled_xyb_offset[0]
+ *     B = B' / scaled_xyb_scale[2] - scaled_xyb_offset[2] + Y
+ *
+ * and then converted with
+ *
+ *     mixed[0] = (Y + X - opsin_biases_cbrt[0])^3 + opsin_biases[0]
+ *     mixed[1] = (Y - X - opsin_biases_cbrt[1])^3 + opsin_biases[1]
+ *     mixed[2] = (B - opsin_biases_cbrt[2])^3 + opsin_biases[2]
+ *     rgb[i] = sum over j of inverse_matrix[3 * i + j] * mixed[j]
+ *
+ * The result is linear RGB with 1.0 at the intensity target of the image, in
+ * the primaries of the output color profile, or sRGB primaries if that
+ * profile is ::JXL_COLOR_SPACE_XYB.
+ */
+typedef struct {
+  /** Row-major matrix from mixed LMS to linear RGB. */
+  float inverse_matrix[9];
+  /** Negated opsin absorbance biases. */
+  float opsin_biases[3];
+  /** Cube roots of opsin_biases. */
+  float opsin_biases_cbrt[3];
+  /** Offsets of the scaled XYB output. */
+  float scaled_xyb_offset[3];
+  /** Scales of the scaled XYB output. */
+  float scaled_xyb_scale[3];
+} JxlOpsinInverseParams;
+
+/**
+ * Gets the parameters to convert the XYB output of the decoder to linear RGB
+ * outside of the decoder. Setting a ::JXL_COLOR_SPACE_XYB output color
+ * profile with @ref JxlDecoderSetOutputColorProfile and a
+ * ::JXL_TYPE_FLOAT16 or ::JXL_TYPE_FLOAT output format skips all the color
+ * conversions of the decoder after the XYB stage, which can then be done
+ * with these parameters.
+ *
+ * Can only be called after the ::JXL_DEC_COLOR_ENCODING event occurred, and
+ * only for images that are XYB encoded, i.e. with @c uses_original_profile
+ * false in the basic info.
+ *
+ * @param dec decoder object
+ * @param params output parameters
+ * @return ::JXL_DEC_SUCCESS on success, ::JXL_DEC_NEED_MORE_INPUT if the
+ *     headers are not available yet, ::JXL_DEC_ERROR if the image is not XYB
+ *     encoded.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetOpsinInverseParams(
+    const JxlDecoder* dec, JxlOpsinInverseParams* params);
+
 /**
  * Returns the minimum size in bytes of the preview image output pixel buffer
  * for the given format. This is the buffer for @ref
@@ -1018,6 +1306,44 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderImageOutBufferSize(
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutBuffer(
     JxlDecoder* dec, const JxlPixelFormat* format, void* buffer, size_t size);
 
+/**
+ * Output buffer of one channel for @ref JxlDecoderSetImageOutPlanarBuffers.
+ */
+typedef struct {
+  /** Buffer receiving the samples of the channel, owned by the caller. */
+  void* buffer;
+  /** Size of the buffer in bytes. */
+  size_t size;
+  /** Distance in bytes between the starts of two consecutive rows. */
+  size_t stride;
+} JxlImageOutPlane;
+
+/**
+ * Sets planar buffers to write the full resolution image to, one buffer per
+ * channel, instead of the single interleaved buffer of @ref
+ * JxlDecoderSetImageOutBuffer. It can be called whenever @ref
+ * JxlDecoderSetImageOutBuffer can, and applies only for the current frame.
+ *
+ * @p planes must point to @c format->num_channels entries, one for each
+ * channel in the order they would have in an interleaved buffer (gray or red,
+ * green, blue, followed by alpha). Each plane receives the samples of its
+ * channel with the data type and endianness of @p format; the @c align field
+ * of @p format is ignored and the row stride of each plane is given by its
+ * @c stride instead, which must be at least the width of the image times the
+ * size of one sample. The buffers are owned by the caller.
+ *
+ * @param dec decoder object
+ * @param format format of the pixels. Object owned by user and its contents
+ *     are copied internally.
+ * @param planes the output buffer of each channel. Object owned by user and
+ *     its contents are copied internally.
+ * @return ::JXL_DEC_SUCCESS on success, ::JXL_DEC_ERROR on error, such as a
+ *     stride or size too small.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutPlanarBuffers(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    const JxlImageOutPlane* planes);
+
 /**
  * Function type for @ref JxlDecoderSetImageOutCallback.
  *
@@ -1406,6 +1732,43 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetBoxSizeRaw(const JxlDecoder* dec,
 JXL_EXPORT JxlDecoderStatus JxlDecoderGetBoxSizeContents(const JxlDecoder* dec,
                                                          uint64_t* size);
 
+/**
+ * The header of a box of a JPEG XL container file, as parsed by @ref
+ * JxlParseBoxHeader.
+ */
+typedef struct {
+  /** Type of the box, such as "Exif", "xml ", "jumb" or "brob". */
+  JxlBoxType type;
+  /** Size of the box header in bytes, 8 or 16. */
+  uint64_t header_size;
+  /** Size of the box including its header in bytes, or 0 if the box extends
+   * to the end of the file.
+   */
+  uint64_t box_size;
+} JxlBoxHeaderInfo;
+
+/**
+ * Parses the header of a box of a JPEG XL container file, without a decoder
+ * and without reading the contents of the box. This allows building a table
+ * of the boxes of a large file by reading only their headers: starting at
+ * offset 0 of a file for which @ref JxlSignatureCheck returns
+ * ::JXL_SIG_CONTAINER, the next box begins @p info->box_size bytes after the
+ * current one. The contents of a box, for example "Exif" metadata, are then
+ * the @p info->box_size - @p info->header_size bytes after its header. For a
+ * "brob" box, the first 4 bytes of the contents are the type of the
+ * compressed box.
+ *
+ * @param buf bytes of the file starting at the header of the box.
+ * @param len size of @p buf; 16 bytes are always enough.
+ * @param info receives the header of the box.
+ * @return ::JXL_DEC_SUCCESS if the header was parsed,
+ *     ::JXL_DEC_NEED_MORE_INPUT if @p len is too small, in which case @p
+ *     info->header_size is a lower bound of the bytes needed,
+ *     ::JXL_DEC_ERROR if the box header is invalid.
+ */
+JXL_EXPORT JxlDecoderStatus JxlParseBoxHeader(const uint8_t* buf, size_t len,
+                                              JxlBoxHeaderInfo* info);
+
 /**
  * Configures at which progressive steps in frame decoding these @ref
  * JXL_DEC_FRAME_PROGRESSION event occurs. The default value for the level
@@ -1463,6 +1826,98 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec);
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetImageOutBitDepth(JxlDecoder* dec, const JxlBitDepth* bit_depth);
 
+/**
+ * Opaque structure that holds the decoder statistics.
+ *
+ * Allocated and initialized with @ref JxlDecoderStatsCreate().
+ * Cleaned up and deallocated with @ref JxlDecoderStatsDestroy().
+ */
+typedef struct JxlDecoderStatsStruct JxlDecoderStats;
+
+/**
+ * Creates an instance of JxlDecoderStats and initializes it.
+ *
+ * @return pointer to initialized @ref JxlDecoderStats instance
+ */
+JXL_EXPORT JxlDecoderStats* JxlDecoderStatsCreate(void);
+
+/**
+ * Deinitializes and frees JxlDecoderStats instance.
+ *
+ * @param stats instance to be cleaned up and deallocated. No-op if stats is
+ * null pointer.
+ */
+JXL_EXPORT void JxlDecoderStatsDestroy(JxlDecoderStats* stats);
+
+/**
+ * Sets the given stats object for measuring where the decoder spends its time.
+ * The time spent and the bytes touched by each decoding step and by each stage
+ * that renders the pixels are added to @p stats for every frame started after
+ * this call. Collecting statistics has a small cost when enabled, and none
+ * otherwise.
+ *
+ * The stats object must outlive its use by the decoder; pass NULL to stop
+ * collecting. The setting is reset by @ref JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @param stats object that can be used to query the gathered stats (created
+ *   by @ref JxlDecoderStatsCreate), or NULL
+ * @return ::JXL_DEC_SUCCESS
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderCollectStats(JxlDecoder* dec,
+                                                   JxlDecoderStats* stats);
+
+/** One entry of @ref JxlDecoderStats.
+ */
+typedef struct {
+  /** Name of the decoding step, e.g. "DecodeACGroup", or of the render stage,
+   * e.g. "EPF1". Owned by the stats object.
+   */
+  const char* name;
+  /** Total wall time spent, summed over all the threads. The time of a
+   * decoding step includes that of the stages that it runs, e.g. when a group
+   * is complete and its pixels are rendered.
+   */
+  uint64_t nanoseconds;
+  /** For decoding steps, the number of compressed bytes they were given. For
+   * render stages, an estimate of the bytes of pixel data read and written.
+   */
+  uint64_t bytes;
+  /** Number of times the step ran, or the stage processed a row.
+   */
+  uint64_t calls;
+} JxlDecoderStatsEntry;
+
+/** Returns the number of entries in the given stats object.
+ *
+ * Must not be called while the decoder collecting into @p stats is running.
+ *
+ * @param stats object that was passed to @ref JxlDecoderCollectStats
+ * @return the number of entries
+ */
+JXL_EXPORT size_t JxlDecoderStatsNumEntries(const JxlDecoderStats* stats);
+
+/** Returns one entry of the given stats object.
+ *
+ * Must not be called while the decoder collecting into @p stats is running.
+ *
+ * @param stats object that was passed to @ref JxlDecoderCollectStats
+ * @param index index of the entry, less than @ref JxlDecoderStatsNumEntries
+ * @param entry the entry is written here
+ * @return ::JXL_DEC_SUCCESS on success, ::JXL_DEC_ERROR if @p index is out of
+ *     range.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderStatsGetEntry(
+    const JxlDecoderStats* stats, size_t index, JxlDecoderStatsEntry* entry);
+
+/** Updates the values of the given stats object with that of an other.
+ *
+ * @param stats object whose values will be updated (added together)
+ * @param other stats object whose values will be merged with stats
+ */
+JXL_EXPORT void JxlDecoderStatsMerge(JxlDecoderStats* stats,
+                                     const JxlDecoderStats* other);
+
 #ifdef __cplusplus
 }
 #endif
@@ -134,6 +134,12 @@ typedef enum {
   /** Sets the decoding speed tier for the provided options. Minimum is 0
    * (slowest to decode, best quality/density), and maximum is 4 (fastest to
    * decode, at the cost of some quality/density). Default is 0.
+   * From 2, lossy modular trees do not use the weighted predictor; at 4, all
+   * entropy coded streams use prefix codes and, unless overridden, Gaborish
+   * and EPF are off. Whether a frame stayed on the decoder fast paths can be
+   * checked with ::JXL_ENC_STAT_NUM_WP_TREE_NODES,
+   * ::JXL_ENC_STAT_NUM_ANS_HISTOGRAMS and
+   * ::JXL_ENC_STAT_NUM_LOOP_FILTERED_FRAMES.
    */
   JXL_ENC_FRAME_SETTING_DECODING_SPEED = 1,
 
@@ -209,7 +215,10 @@ typedef enum {
 
   /** Determines the order in which 256x256 regions are stored in the codestream
    * for progressive rendering. Use -1 for the encoder
-   * default, 0 for scanline order, 1 for center-first order.
+   * default, 0 for scanline order, 1 for center-first order, 2 for tiled
+   * order. Tiled order stores the regions of each 2048x2048 tile together, in
+   * scanline order within the tile, so that a decoder that receives the
+   * codestream incrementally decodes adjacent regions together.
    */
   JXL_ENC_FRAME_SETTING_GROUP_ORDER = 13,
 
@@ -393,6 +402,86 @@ typedef enum {
    */
   JXL_ENC_FRAME_SETTING_DISABLE_PERCEPTUAL_HEURISTICS = 39,
 
+  /** Approximate maximum memory, in MiB, used to store the pixel samples that
+   * the MA tree is learned from in modular mode. When it is reached, the
+   * pixels are sampled with a lower probability, as if lowering @ref
+   * JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT, so that the memory
+   * does not grow with the image size. Use -1 for the default (no limit), or a
+   * value in [1..1048576].
+   */
+  JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_MEMORY = 40,
+
+  /** Target butteraugli score of the frame. The encoder searches for the
+   * coarsest global quantization scale at which the maximum butteraugli
+   * distance of the decoded frame does not exceed this value, starting from
+   * the frame distance. Only the quantization is redone between the steps of
+   * the search; the color conversion, block sizes and other heuristics are
+   * kept. Applies to lossy VarDCT frames in XYB, and is ignored when
+   * streaming. Use 0 or -1 for the default (no search), or a positive
+   * value. Use JxlEncoderFrameSettingsSetFloatOption to set this option.
+   */
+  JXL_ENC_FRAME_SETTING_TARGET_BUTTERAUGLI_SCORE = 41,
+
+  /** Prunes the search for larger VarDCT block sizes in areas where many of
+   * the 8x8 blocks are best coded with smaller transforms, trading density
+   * for encoding speed. 0 = no pruning, 100 = most pruning, -1 = default (no
+   * pruning). Affects efforts 5 and up, most strongly from effort 6, where
+   * also shifted block positions are searched. Use
+   * JxlEncoderFrameSettingsSetFloatOption to set this option.
+   */
+  JXL_ENC_FRAME_SETTING_AC_STRATEGY_PRUNING_PERCENT = 42,
+
+  /** Reads the pixels of the frames added with these settings directly from
+   * the caller's buffers, or through the callbacks of the @ref
+   * JxlChunkedFrameInputSource, while the frame is encoded, instead of first
+   * copying them. This saves a full copy of the input of frames that are not
+   * encoded in a streaming way. The caller must then keep the buffers given to
+   * @ref JxlEncoderAddImageFrame and @ref JxlEncoderSetExtraChannelBuffer,
+   * or the input source given to @ref JxlEncoderAddChunkedFrame, valid and
+   * unchanged until @ref JxlEncoderProcessOutput or @ref JxlEncoderFlushInput
+   * has written the frame, or the encoder is reset or destroyed. A strided
+   * buffer can be passed without copy as an input source whose callbacks
+   * return pointers into it with its row stride. Use -1 for the default
+   * (copy), 0 to copy or 1 to not copy.
+   */
+  JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT = 43,
+
+  /** In lossless modular mode, at the efforts that try several reversible
+   * color transforms per group, estimates the cost of each candidate on one
+   * out of every N rows of the group instead of on all of them. Larger values
+   * are faster but may pick a slightly worse transform. Use -1 for the
+   * default (4 up to effort 8, 1 above), or a value in [1..64].
+   */
+  JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING = 44,
+
+  /** Entropy codes all the tokens of the frame (AC coefficients, modular
+   * streams and trees, patches, splines and coefficient orders) with prefix
+   * codes instead of ANS. Prefix codes decode faster but usually cost a few
+   * percent of size. Use -1 for the default (encoder chooses), 0 to let the
+   * encoder choose or 1 to always use prefix codes.
+   */
+  JXL_ENC_FRAME_SETTING_PREFIX_CODES = 45,
+
+  /** Time budget for encoding each frame, in milliseconds. Once the budget is
+   * used up, the iterative refinements of the higher efforts (butteraugli
+   * iterations, searches for a target score, trying several lossless
+   * configurations at effort 11) stop and keep the best result found so far,
+   * so the frame is still encoded completely and validly, but the time spent
+   * in the steps that always run is not bounded. The output then depends on
+   * the speed of the machine. Use -1 for the default (no budget), or a value
+   * in [0..2^31-1].
+   */
+  JXL_ENC_FRAME_SETTING_TIME_BUDGET = 46,
+
+  /** At the efforts that iterate the quantization with butteraugli (8 and
+   * above), computes all but the last of these comparisons at full resolution
+   * only, skipping the comparison at half resolution, which makes each of
+   * them about a fifth cheaper. The last comparison, which decides the final
+   * quantization, uses the full metric. Use -1 for the default (off), 0 to
+   * disable or 1 to enable.
+   */
+  JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI = 47,
+
   /** Enum value not to be used as an option. This value is added to force the
    * C compiler to have the enum to take a known size.
    */
@@ -423,6 +512,51 @@ JXL_EXPORT JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager);
  */
 JXL_EXPORT void JxlEncoderReset(JxlEncoder* enc);
 
+/**
+ * Re-initializes a @ref JxlEncoder instance like @ref JxlEncoderReset, but
+ * keeps its settings, so that a service transcoding many small images with
+ * one encoder does not have to set them up again for each image. The kept
+ * settings are those of:
+ *  - @ref JxlEncoderSetParallelRunner,
+ *  - @ref JxlEncoderFrameSettingsCreate: the frame settings stay valid with
+ *    all their options and can be used for the next image,
+ *  - @ref JxlEncoderUseContainer, @ref JxlEncoderUseBoxes,
+ *    @ref JxlEncoderStoreJPEGMetadata and @ref JxlEncoderSetCodestreamLevel,
+ *  - @ref JxlEncoderSetCms and @ref JxlEncoderAllowExpertOptions,
+ *  - @ref JxlEncoderReuseColorTransform, together with the converted frame it
+ *    keeps.
+ * The basic info, color encoding, queued frames and boxes and the output
+ * processor are reset, as with @ref JxlEncoderReset. The per-block images,
+ * DCT coefficients and token buffers of the last frame are kept as well, and
+ * reused by the next frame if it has the same dimensions, unless @ref
+ * JxlEncoderSetMemoryLimit set a limit. They are released by @ref
+ * JxlEncoderReset and @ref JxlEncoderDestroy.
+ *
+ * @param enc instance to be re-initialized.
+ */
+JXL_EXPORT void JxlEncoderResetKeepSettings(JxlEncoder* enc);
+
+/**
+ * Makes the encoder keep the last frame that it converted to the XYB color
+ * space, before and after the conversion, so that a frame with the same pixels
+ * encoded next is copied from it instead of being converted again. This is
+ * meant for encoding one image at several distances: after each codestream,
+ * call @ref JxlEncoderResetKeepSettings, change the distance with @ref
+ * JxlEncoderSetFrameDistance and add the same frame again. The output does not
+ * change, since a frame with other pixels is converted as usual and replaces
+ * the kept one.
+ *
+ * Only the lossy frames encoded in the XYB color space, without a black
+ * channel and not in a streaming way, are kept. Keeping a frame takes about
+ * 24 bytes per pixel, 36 at the slowest efforts, which is freed by @ref
+ * JxlEncoderReset or by disabling the setting.
+ *
+ * @param enc encoder object.
+ * @param reuse whether to keep the converted frame.
+ */
+JXL_EXPORT void JxlEncoderReuseColorTransform(JxlEncoder* enc,
+                                              JXL_BOOL reuse);
+
 /**
  * Deinitializes and frees a @ref JxlEncoder instance.
  *
@@ -430,6 +564,80 @@ JXL_EXPORT void JxlEncoderReset(JxlEncoder* enc);
  */
 JXL_EXPORT void JxlEncoderDestroy(JxlEncoder* enc);
 
+/**
+ * Makes the encoder serve its allocations from blocks of @p block_size bytes
+ * obtained from its memory manager, instead of calling it for every buffer.
+ * This reduces the number of calls to the memory manager and the
+ * fragmentation of its heap when encoding many images. A block is returned to
+ * the memory manager once all the buffers in it are freed, and all of them by
+ * @ref JxlEncoderDestroy. Buffers larger than a quarter of @p block_size get a
+ * block of their own.
+ *
+ * Must be called before any output is written. The setting is kept by @ref
+ * JxlEncoderReset.
+ *
+ * @param enc encoder object
+ * @param block_size size of the blocks in bytes, must be positive
+ * @return ::JXL_ENC_SUCCESS if the arena was set up, ::JXL_ENC_ERROR if
+ *   @p block_size is 0, if output was written or if an arena is already set.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderSetMemoryArena(JxlEncoder* enc,
+                                                     size_t block_size);
+
+/**
+ * Asks the operating system to back the buffers of at least @p threshold bytes
+ * that the encoder allocates with transparent huge pages, which reduces the
+ * TLB misses when processing large images. Only has an effect where supported
+ * (Linux with transparent huge pages in "madvise" or "always" mode), and only
+ * for the parts of the buffers that cover whole 2 MiB pages.
+ *
+ * Must be called before any output is written; later calls change the
+ * threshold. The setting is kept by @ref JxlEncoderReset. If set before @ref
+ * JxlEncoderSetMemoryArena, it applies to the blocks of the arena.
+ *
+ * @param enc encoder object
+ * @param threshold minimum size of the buffers in bytes, or 0 to disable
+ * @return ::JXL_ENC_SUCCESS if the threshold was set, ::JXL_ENC_ERROR if
+ *   output was written.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderSetHugePageThreshold(JxlEncoder* enc,
+                                                           size_t threshold);
+
+/**
+ * Limits the memory that the encoder allocates from its memory manager to
+ * @p limit_bytes in use at once, and starts tracking its peak usage, see @ref
+ * JxlEncoderGetPeakMemoryUsage. Encoding fails when an allocation would exceed
+ * the limit. To stay within it, the encoder bounds the memory used to learn
+ * MA trees to a fraction of the limit, unless
+ * ::JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_MEMORY is set, and with the
+ * default ::JXL_ENC_FRAME_SETTING_BUFFERING, it encodes large frames in a
+ * streaming way whenever their full-frame buffers would take more than half of
+ * the limit and the frame settings allow it.
+ *
+ * Must be called before any output is written; later calls only change the
+ * limit. The setting is kept by @ref JxlEncoderReset. If set before @ref
+ * JxlEncoderSetMemoryArena, the limit applies to the blocks of the arena.
+ *
+ * @param enc encoder object
+ * @param limit_bytes maximum number of bytes in use, or 0 to only track usage
+ * @return ::JXL_ENC_SUCCESS if the limit was set, ::JXL_ENC_ERROR if output
+ *   was written and no limit was set before.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderSetMemoryLimit(JxlEncoder* enc,
+                                                     uint64_t limit_bytes);
+
+/**
+ * Outputs the largest number of bytes that the encoder had allocated at once
+ * since @ref JxlEncoderSetMemoryLimit was called.
+ *
+ * @param enc encoder object
+ * @param peak_bytes output for the number of bytes
+ * @return ::JXL_ENC_SUCCESS, or ::JXL_ENC_ERROR if @ref
+ *   JxlEncoderSetMemoryLimit was not called.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderGetPeakMemoryUsage(const JxlEncoder* enc,
+                                                         uint64_t* peak_bytes);
+
 /**
  * Sets the color management system (CMS) that will be used for color conversion
  * (if applicable) during encoding. May only be set before starting encoding. If
@@ -594,6 +802,56 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetFrameName(
 JXL_EXPORT JxlEncoderStatus JxlEncoderSetFrameBitDepth(
     JxlEncoderFrameSettings* frame_settings, const JxlBitDepth* bit_depth);
 
+/**
+ * Sets the MA tree to use for the modular frames encoded with these frame
+ * settings, instead of learning it from the image. Learning the tree is the
+ * slowest part of lossless encoding, so reusing the tree of a previous encode
+ * of similar content, as returned by @ref JxlEncoderGetModularTree, makes
+ * encoding much faster, usually for a small compression loss.
+ *
+ * The tree is used by all the frames encoded with these settings, except with
+ * streaming input or output (see @ref JXL_ENC_FRAME_SETTING_BUFFERING). For
+ * VarDCT frames, it is the tree of the DC and of the extra channels.
+ *
+ * @param frame_settings set of options and metadata for this frame. Also
+ * includes reference to the encoder object.
+ * @param tree the serialized tree. Owned by the caller and copied internally.
+ * @param size size of the tree in bytes, or 0 to learn the tree again.
+ * @return ::JXL_ENC_SUCCESS on success, ::JXL_ENC_ERROR if the tree is invalid
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderFrameSettingsSetModularTree(
+    JxlEncoderFrameSettings* frame_settings, const uint8_t* tree, size_t size);
+
+/**
+ * Outputs the size in bytes of the global MA tree of the last encoded frame
+ * that had one, serialized for @ref JxlEncoderFrameSettingsSetModularTree.
+ * Without streaming input or output, this is the case of lossy frames, of
+ * lossless frames encoded at effort 10 and above (lower efforts learn a tree
+ * per group instead), and of frames encoded with @ref
+ * JxlEncoderFrameSettingsSetModularTree.
+ *
+ * @param enc encoder object.
+ * @param size output for the size of the tree.
+ * @return ::JXL_ENC_SUCCESS on success, ::JXL_ENC_ERROR if no frame encoded so
+ * far had a global tree.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderGetModularTreeSize(JxlEncoder* enc,
+                                                         size_t* size);
+
+/**
+ * Outputs the global MA tree of the last encoded frame that had one, see @ref
+ * JxlEncoderGetModularTreeSize.
+ *
+ * @param enc encoder object.
+ * @param tree buffer to copy the tree into.
+ * @param size size of the buffer, must be that given by @ref
+ * JxlEncoderGetModularTreeSize.
+ * @return ::JXL_ENC_SUCCESS on success, ::JXL_ENC_ERROR on error.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderGetModularTree(JxlEncoder* enc,
+                                                     uint8_t* tree,
+                                                     size_t size);
+
 /**
  * Sets the buffer to read JPEG encoded bytes from for the next frame to encode.
  *
@@ -798,6 +1056,13 @@ struct JxlEncoderOutputProcessor {
  * encoder will handle buffering, writing, seeking (if supported), and
  * setting a finalized position during the encoding process.
  *
+ * If `seek` is provided and a frame is encoded in streaming mode (see
+ * ::JXL_ENC_FRAME_SETTING_BUFFERING), the encoder leaves room for the frame
+ * header and table of contents, writes the sections of each group as soon as
+ * they are encoded, and seeks back to fill in the table of contents once the
+ * frame is complete. Without `seek`, the encoder keeps the encoded frame in
+ * memory until it can be written in order.
+ *
  * This should not be used when using @ref JxlEncoderProcessOutput.
  *
  * @param enc encoder object.
@@ -72,6 +72,11 @@ typedef enum {
   JXL_ENC_STAT_NUM_DCT32X64_BLOCKS,
   JXL_ENC_STAT_NUM_DCT64_BLOCKS,
   JXL_ENC_STAT_NUM_BUTTERAUGLI_ITERS,
+  /* Uses of decoder features that have no fast path; see
+   * ::JXL_ENC_FRAME_SETTING_DECODING_SPEED. */
+  JXL_ENC_STAT_NUM_WP_TREE_NODES,
+  JXL_ENC_STAT_NUM_ANS_HISTOGRAMS,
+  JXL_ENC_STAT_NUM_LOOP_FILTERED_FRAMES,
   JXL_ENC_NUM_STATS,
 } JxlEncoderStatsKey;
 
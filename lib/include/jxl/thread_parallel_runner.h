@@ -14,8 +14,10 @@
  * multithreading when using the JPEG XL library. This uses std::thread
  * internally and related synchronization functions. The number of threads
  * created is fixed at construction time and the threads are re-used for every
- * ThreadParallelRunner::Runner call. Only one concurrent
- * JxlThreadParallelRunner call per instance is allowed at a time.
+ * ThreadParallelRunner::Runner call. JxlThreadParallelRunner may be called
+ * concurrently on one instance, e.g. by several decoders and encoders sharing
+ * it, and from within the tasks of another call; the worker threads are shared
+ * between the pending calls.
  *
  * This is a scalable, lower-overhead thread pool runner, especially suitable
  * for data-parallel computations in the fork-join model, where clients need to
@@ -62,6 +64,37 @@ JXL_THREADS_EXPORT void JxlThreadParallelRunnerDestroy(void* runner_opaque);
  */
 JXL_THREADS_EXPORT size_t JxlThreadParallelRunnerDefaultNumWorkerThreads(void);
 
+/** Pins the worker threads of a runner created by
+ * @ref JxlThreadParallelRunnerCreate to CPUs, e.g. to the CPUs of one NUMA
+ * node, so that the buffers they touch stay local. Worker `i` is pinned to
+ * `cpus[i % num_cpus]`. The threads calling @ref JxlThreadParallelRunner also
+ * run tasks and are not pinned. Must not be called from within a task.
+ *
+ * @param runner_opaque the runner.
+ * @param cpus the CPU numbers, as used by the operating system.
+ * @param num_cpus the number of elements of @p cpus.
+ * @return ::JXL_PARALLEL_RET_SUCCESS if all the workers were pinned, or
+ * ::JXL_PARALLEL_RET_RUNNER_ERROR if @p num_cpus is zero, a CPU is invalid or
+ * pinning threads is not supported on this platform.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunnerSetAffinity(
+    void* runner_opaque, const size_t* cpus, size_t num_cpus);
+
+/** Lets the idle worker threads of a runner created by
+ * @ref JxlThreadParallelRunnerCreate spin for up to @p spin_us microseconds,
+ * waiting for new tasks, before they block. This lowers the latency of many
+ * consecutive short calls, as made for small images, at the cost of CPU time
+ * while waiting. The default is 0: the workers block right away. May be called
+ * at any time.
+ *
+ * @param runner_opaque the runner.
+ * @param spin_us the maximum time to spin, in microseconds.
+ * @return ::JXL_PARALLEL_RET_SUCCESS, or ::JXL_PARALLEL_RET_RUNNER_ERROR if
+ * @p runner_opaque is NULL.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunnerSetSpinTime(
+    void* runner_opaque, uint32_t spin_us);
+
 #ifdef __cplusplus
 }
 #endif
@@ -158,13 +158,8 @@ V FastPow2f(const DF df, V x) {
   return Div(num, den);
 }
 
-inline float FastPow2f(float f) {
-  HWY_CAPPED(float, 1) D;
-  return GetLane(FastPow2f(D, Set(D, f)));
-}
-
 // The following functions modulate an exponent (out_val) and return the updated
-// value. Their descriptor is limited to 8 lanes for 8x8 blocks.
+// value. Each lane holds the exponent of a different block.
 
 template <class D, class V>
 V ComputeMask(const D d, const V out_val) {
@@ -257,9 +252,10 @@ V SimpleGamma(const D d, V v) {
 }
 */
 
-template <class D, class V>
-V GammaModulation(const D d, const size_t x, const size_t y,
-                  const RowBuffer<float>& input, const V out_val) {
+// Returns the mean ratio of derivatives of the 8x8 block at (x, y).
+template <class D>
+float GammaRatio(const D d, const size_t x, const size_t y,
+                 const RowBuffer<float>& input) {
   static const float kBias = 0.16f / kInputScaling;
   static const float kScale = kInputScaling / 64.0f;
   auto overall_ratio = Zero(d);
@@ -275,7 +271,11 @@ V GammaModulation(const D d, const size_t x, const size_t y,
       overall_ratio = Add(overall_ratio, ratio_g);
     }
   }
-  overall_ratio = Mul(SumOfLanes(d, overall_ratio), scale);
+  return GetLane(Mul(SumOfLanes(d, overall_ratio), scale));
+}
+
+template <class D, class V>
+V GammaModulation(const D d, const V overall_ratio, const V out_val) {
   // ideally -1.0, but likely optimal correction adds some entropy, so slightly
   // less than that.
   // ln(2) constant folded in because we want std::log but have FastLog2f.
@@ -283,18 +283,17 @@ V GammaModulation(const D d, const size_t x, const size_t y,
   return MulAdd(kGamma, FastLog2f(d, overall_ratio), out_val);
 }
 
-// Change precision in 8x8 blocks that have high frequency content.
-template <class D, class V>
-V HfModulation(const D d, const size_t x, const size_t y,
-               const RowBuffer<float>& input, const V out_val) {
+// Returns the sum of absolute differences with right and below of the 8x8
+// block at (x, y).
+template <class D>
+float HfSum(const D d, const size_t x, const size_t y,
+            const RowBuffer<float>& input) {
   // Zero out the invalid differences for the rightmost value per row.
   const Rebind<uint32_t, D> du;
   HWY_ALIGN constexpr uint32_t kMaskRight[8] = {~0u, ~0u, ~0u, ~0u,
                                                 ~0u, ~0u, ~0u, 0};
 
-  auto sum = Zero(d);  // sum of absolute differences with right and below
-  static const float kSumCoeff = -2.0052193233688884f * kInputScaling / 112.0;
-  auto sumcoeff = Set(d, kSumCoeff);
+  auto sum = Zero(d);
 
   const float* const JXL_RESTRICT block_start = input.Row(y) + x;
   for (size_t dy = 0; dy < 8; ++dy) {
@@ -312,10 +311,37 @@ V HfModulation(const D d, const size_t x, const size_t y,
     }
   }
 
-  sum = SumOfLanes(d, sum);
-  return MulAdd(sum, sumcoeff, out_val);
+  return GetLane(SumOfLanes(d, sum));
 }
 
+// Change precision in 8x8 blocks that have high frequency content.
+template <class D, class V>
+V HfModulation(const D d, const V sum, const V out_val) {
+  static const float kSumCoeff = -2.0052193233688884f * kInputScaling / 112.0;
+  return MulAdd(sum, Set(d, kSumCoeff), out_val);
+}
+
+// Computes the final quantization field values of Lanes(d) consecutive blocks
+// from their masking, high frequency sum and gamma ratio.
+template <class D>
+void ModulateBlocks(const D d, const float* hf_sum, const float* gamma_ratio,
+                    const float mul, const float add, float* row_out) {
+  auto out_val = LoadU(d, row_out);
+  out_val = ComputeMask(d, out_val);
+  out_val = HfModulation(d, LoadU(d, hf_sum), out_val);
+  out_val = GammaModulation(d, LoadU(d, gamma_ratio), out_val);
+  // We want multiplicative quantization field, so everything
+  // until this point has been modulating the exponent.
+  const auto qf = MulAdd(FastPow2f(d, Mul(out_val, Set(d, 1.442695041f))),
+                         Set(d, mul), Set(d, add));
+  // The quantization field is stored as the adaptive quantization strength.
+  const auto strength = Sub(Div(Set(d, 0.6f), qf), Set(d, 1.0f));
+  StoreU(ZeroIfNegative(strength), d, row_out);
+}
+
+// Number of blocks whose modulations are computed in one vectorized pass.
+constexpr size_t kModulationChunk = 256;
+
 void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
                          const size_t yb0, const size_t yblen,
                          RowBuffer<float>* aq_map) {
@@ -333,20 +359,34 @@ void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
   }
   const float mul = kAcQuant * dampen;
   const float add = (1.0f - dampen) * base_level;
+  const HWY_CAPPED(float, 8) d8;
+  const HWY_FULL(float) df;
+  const HWY_CAPPED(float, 1) d1;
+  HWY_ALIGN float hf_sum[kModulationChunk];
+  HWY_ALIGN float gamma_ratio[kModulationChunk];
+  const size_t xsize_blocks = aq_map->xsize();
   for (size_t iy = 0; iy < yblen; iy++) {
     const size_t yb = yb0 + iy;
     const size_t y = yb * 8;
     float* const JXL_RESTRICT row_out = aq_map->Row(yb);
-    const HWY_CAPPED(float, 8) df;
-    for (size_t ix = 0; ix < aq_map->xsize(); ix++) {
-      size_t x = ix * 8;
-      auto out_val = Set(df, row_out[ix]);
-      out_val = ComputeMask(df, out_val);
-      out_val = HfModulation(df, x, y, input, out_val);
-      out_val = GammaModulation(df, x, y, input, out_val);
-      // We want multiplicative quantization field, so everything
-      // until this point has been modulating the exponent.
-      row_out[ix] = FastPow2f(GetLane(out_val) * 1.442695041f) * mul + add;
+    // The pixel sums are reduced per block, the rest of the computation is
+    // done across the blocks of the row.
+    for (size_t bx0 = 0; bx0 < xsize_blocks; bx0 += kModulationChunk) {
+      const size_t len = std::min(kModulationChunk, xsize_blocks - bx0);
+      for (size_t i = 0; i < len; ++i) {
+        const size_t x = (bx0 + i) * 8;
+        hf_sum[i] = HfSum(d8, x, y, input);
+        gamma_ratio[i] = GammaRatio(d8, x, y, input);
+      }
+      size_t i = 0;
+      for (; i + Lanes(df) <= len; i += Lanes(df)) {
+        ModulateBlocks(df, hf_sum + i, gamma_ratio + i, mul, add,
+                       row_out + bx0 + i);
+      }
+      for (; i < len; ++i) {
+        ModulateBlocks(d1, hf_sum + i, gamma_ratio + i, mul, add,
+                       row_out + bx0 + i);
+      }
     }
   }
 }
@@ -506,6 +546,11 @@ namespace {
 
 constexpr int kPreErosionBorder = 1;
 
+bool DeferAdaptiveQuantModulations(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  return m->runner != nullptr && m->psnr_target == 0;
+}
+
 }  // namespace
 
 void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
@@ -515,7 +560,6 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   }
   int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
   jpeg_component_info* y_comp = &cinfo->comp_info[y_channel];
-  int y_quant_01 = cinfo->quant_tbl_ptrs[y_comp->quant_tbl_no]->quantval[1];
   if (m->next_iMCU_row == 0) {
     m->input_buffer[y_channel].CopyRow(-1, 0, 1);
   }
@@ -549,15 +593,21 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   }
   HWY_DYNAMIC_DISPATCH(FuzzyErosion)
   (m->pre_erosion, yb0, yblen, &m->fuzzy_erosion_tmp, &m->quant_field);
-  HWY_DYNAMIC_DISPATCH(PerBlockModulations)
-  (y_quant_01, input, yb0, yblen, &m->quant_field);
-  for (int y = 0; y < cinfo->max_v_samp_factor; ++y) {
-    float* row = m->quant_field.Row(yb0 + y);
-    for (size_t x = 0; x < xsize_blocks; ++x) {
-      row[x] = std::max(0.0f, (0.6f / row[x]) - 1.0f);
-    }
+  if (!DeferAdaptiveQuantModulations(cinfo)) {
+    ApplyAdaptiveQuantModulations(cinfo, m->next_iMCU_row);
   }
 }
 
+void ApplyAdaptiveQuantModulations(j_compress_ptr cinfo, size_t iMCU_row) {
+  jpeg_comp_master* m = cinfo->master;
+  int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
+  jpeg_component_info* y_comp = &cinfo->comp_info[y_channel];
+  int y_quant_01 = cinfo->quant_tbl_ptrs[y_comp->quant_tbl_no]->quantval[1];
+  const size_t yb0 = iMCU_row * cinfo->max_v_samp_factor;
+  const size_t yblen = cinfo->max_v_samp_factor;
+  HWY_DYNAMIC_DISPATCH(PerBlockModulations)
+  (y_quant_01, m->input_buffer[y_channel], yb0, yblen, &m->quant_field);
+}
+
 }  // namespace jpegli
 #endif  // HWY_ONCE
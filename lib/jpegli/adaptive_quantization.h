@@ -6,12 +6,22 @@
 #ifndef LIB_JPEGLI_ADAPTIVE_QUANTIZATION_H_
 #define LIB_JPEGLI_ADAPTIVE_QUANTIZATION_H_
 
+#include <stddef.h>
+
 #include "lib/jpegli/common.h"
 
 namespace jpegli {
 
+// Computes the adaptive quantization field of the next iMCU row. With a
+// parallel runner and no PSNR target, the per-block modulations are left to
+// ApplyAdaptiveQuantModulations(), which can then run concurrently for the
+// iMCU rows of a batch.
 void ComputeAdaptiveQuantField(j_compress_ptr cinfo);
 
+// Finishes the adaptive quantization field of the given iMCU row, it may be
+// called concurrently for different rows.
+void ApplyAdaptiveQuantModulations(j_compress_ptr cinfo, size_t iMCU_row);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ADAPTIVE_QUANTIZATION_H_
@@ -38,6 +38,10 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
                 JpegBitWriter* JXL_RESTRICT bw);
 void WriteScanData(j_compress_ptr cinfo, int scan_index);
 
+// Writes the tokens of the sequential scan computed so far, without finishing
+// the scan.
+void WriteSequentialTokens(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_BITSTREAM_H_
@@ -8,6 +8,7 @@
 #include <cmath>
 #include <limits>
 #include <unordered_map>
+#include <vector>
 
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
@@ -187,20 +188,11 @@ void AddToRGBPalette(const uint8_t* red, const uint8_t* green,
   }
 }
 
-struct RGBPixelHasher {
-  // A quick but good-enough hash to get 24 bits of RGB into the lower 12 bits.
-  size_t operator()(uint32_t a) const { return (a ^ (a >> 12)) * 0x9e3779b9; }
-};
-
 struct WangHasher {
-  // Thomas Wang's Hash.  Nearly perfect and still quite fast.  Above (for
-  // pixels) we use a simpler hash because the number of hash calls is
-  // proportional to the number of pixels and that hash dominates; we want the
-  // cost to be minimal and we start with a large table.  We can use a better
-  // hash for the histogram since the number of hash calls is proportional to
-  // the number of unique colors in the image, which is hopefully much smaller.
-  // Note that the difference is slight; e.g. replacing RGBPixelHasher with
-  // WangHasher only slows things down by 5% on an Opteron.
+  // Thomas Wang's Hash.  Nearly perfect and still quite fast.  The number of
+  // hash calls for the histogram is proportional to the number of unique
+  // colors in the image, which is hopefully much smaller than the number of
+  // pixels.
   size_t operator()(uint32_t a) const {
     a = (a ^ 61) ^ (a >> 16);
     a = a + (a << 3);
@@ -215,34 +207,24 @@ struct WangHasher {
 // image. To do this we map the 24 bit RGB representation of the colors
 // to a unique integer index assigned to the different colors in order of
 // appearance in the image.  Return the number of unique colors found.
-// The colors are pre-quantized to 3 * 6 bits precision.
+// The colors are pre-quantized to 3 * 6 bits precision, so the index is a
+// direct table of all the 2^18 quantized colors.
 int BuildRGBColorIndex(const uint8_t* const image, int const num_pixels,
                        int* const count, uint8_t* const red,
                        uint8_t* const green, uint8_t* const blue) {
-  // Impossible because rgb are in the low 24 bits, and the upper 8 bits is 0.
-  const uint32_t impossible_pixel_value = 0x10000000;
-  std::unordered_map<uint32_t, int, RGBPixelHasher> index_map(1 << 12);
-  std::unordered_map<uint32_t, int, RGBPixelHasher>::iterator index_map_lookup;
+  std::vector<int> index_map(1 << 18, -1);
   const uint8_t* imagep = &image[0];
-  uint32_t prev_pixel = impossible_pixel_value;
-  int index = 0;
   int n = 0;
   for (int i = 0; i < num_pixels; ++i) {
-    uint8_t r = ((*imagep++) & 0xfc) + 2;
-    uint8_t g = ((*imagep++) & 0xfc) + 2;
-    uint8_t b = ((*imagep++) & 0xfc) + 2;
-    uint32_t pixel = (b << 16) | (g << 8) | r;
-    if (pixel != prev_pixel) {
-      prev_pixel = pixel;
-      index_map_lookup = index_map.find(pixel);
-      if (index_map_lookup != index_map.end()) {
-        index = index_map_lookup->second;
-      } else {
-        index_map[pixel] = index = n++;
-        red[index] = r;
-        green[index] = g;
-        blue[index] = b;
-      }
+    uint32_t r = (*imagep++) >> 2;
+    uint32_t g = (*imagep++) >> 2;
+    uint32_t b = (*imagep++) >> 2;
+    int& index = index_map[(b << 12) | (g << 6) | r];
+    if (index < 0) {
+      index = n++;
+      red[index] = (r << 2) + 2;
+      green[index] = (g << 2) + 2;
+      blue[index] = (b << 2) + 2;
     }
     ++count[index];
   }
@@ -434,6 +416,9 @@ void FindCandidatesForCell(j_decompress_ptr cinfo, int ncomp, const int cell[],
 
 }  // namespace
 
+// Number of entries of the palette index cache of quant modes 2 and 3.
+constexpr size_t kColorIndexCacheSize = 1 << 12;
+
 void CreateInverseColorMap(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   int ncomp = cinfo->out_color_components;
@@ -455,6 +440,7 @@ void CreateInverseColorMap(j_decompress_ptr cinfo) {
     }
     ++next_cell[c];
   }
+  m->color_index_cache_.assign(kColorIndexCacheSize, 0);
   m->regenerate_inverse_colormap_ = false;
 }
 
@@ -467,6 +453,20 @@ int LookupColorIndex(j_decompress_ptr cinfo, const JSAMPLE* pixel) {
       index += m->colormap_lut_[c * 256 + pixel[c]];
     }
   } else {
+    // Neighbouring pixels often have the same color, so the result of the
+    // candidate search below is cached for RGB and grayscale output.
+    uint64_t* cache_entry = nullptr;
+    uint64_t key = 0;
+    if (num_channels <= 3 && !m->color_index_cache_.empty()) {
+      for (int c = 0; c < num_channels; ++c) {
+        key |= static_cast<uint64_t>(pixel[c]) << (8 * c);
+      }
+      uint32_t hash = static_cast<uint32_t>(key * 0x9e3779b9u) >> 20;
+      cache_entry = &m->color_index_cache_[hash];
+      if ((*cache_entry >> 8) == key + 1) {
+        return *cache_entry & 0xff;
+      }
+    }
     size_t cell_idx = 0;
     size_t stride = 1;
     for (int c = num_channels - 1; c >= 0; --c) {
@@ -487,6 +487,7 @@ int LookupColorIndex(j_decompress_ptr cinfo, const JSAMPLE* pixel) {
         index = i;
       }
     }
+    if (cache_entry) *cache_entry = ((key + 1) << 8) | index;
   }
   JPEGLI_CHECK(index < cinfo->actual_number_of_colors);
   return index;
@@ -1058,3 +1058,10 @@ void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
       JPEGLI_ERROR("Unsupported endianness %d", endianness);
   }
 }
+
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque) {
+  cinfo->master->runner_ = runner;
+  cinfo->master->runner_opaque_ = runner_opaque;
+}
@@ -20,6 +20,8 @@
 #ifndef LIB_JPEGLI_DECODE_H_
 #define LIB_JPEGLI_DECODE_H_
 
+#include <jxl/parallel_runner.h>
+
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -100,6 +102,13 @@ void jpegli_new_colormap(j_decompress_ptr cinfo);
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness);
 
+// Sets the parallel runner used to compute the inverse DCT and the color
+// transform of the output rows, the output is the same as without it. Huffman
+// decoding stays on the calling thread. Passing a NULL runner unsets it.
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void *runner_opaque);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
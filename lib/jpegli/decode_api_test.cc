@@ -497,6 +497,39 @@ TEST(DecodeAPITest, ReuseCinfoSameMemSource) {
   if (buffer) free(buffer);
 }
 
+TEST(DecodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    config.jparams.restart_interval = 3;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    for (JpegIOMode output_mode : {PIXELS, RAW_DATA}) {
+      DecompressParams dparams;
+      dparams.output_mode = output_mode;
+      TestImage output0;
+      TestImage output1;
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                           &output0);
+        jpegli_set_decompress_parallel_runner(&cinfo, TestParallelRunner,
+                                              nullptr);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                           &output1);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+      EXPECT_EQ(output0.pixels, output1.pixels);
+      EXPECT_EQ(output0.raw_data, output1.raw_data);
+    }
+  }
+}
+
 TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
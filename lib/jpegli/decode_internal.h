@@ -6,6 +6,7 @@
 #ifndef LIB_JPEGLI_DECODE_INTERNAL_H_
 #define LIB_JPEGLI_DECODE_INTERNAL_H_
 
+#include <jxl/parallel_runner.h>
 #include <sys/types.h>
 
 #include <cstdint>
@@ -103,6 +104,9 @@ struct jpeg_decomp_master {
   JpegliDataType output_data_type_ = JPEGLI_TYPE_UINT8;
   size_t xoffset_;
   bool swap_endianness_ = false;
+  // Runs the inverse DCT and the color transform if not null.
+  JxlParallelRunner runner_ = nullptr;
+  void* runner_opaque_ = nullptr;
   bool need_context_rows_;
   bool regenerate_inverse_colormap_;
   bool apply_smoothing;
@@ -121,6 +125,12 @@ struct jpeg_decomp_master {
 
   void (*color_transform)(float* row[jpegli::kMaxComponents], size_t len);
 
+  // If not null, does the color transform and writes the 8-bit output of a
+  // row instead of color_transform and WriteToOutput.
+  void (*fused_output_)(float* JXL_RESTRICT rows[3], size_t x0, size_t len,
+                        uint8_t* JXL_RESTRICT output,
+                        uint8_t* JXL_RESTRICT scratch_space);
+
   float* idct_scratch_;
   float* upsample_scratch_;
   uint8_t* output_scratch_;
@@ -134,6 +144,9 @@ struct jpeg_decomp_master {
   uint8_t* pixels_;
   JSAMPARRAY scanlines_;
   std::vector<std::vector<uint8_t>> candidate_lists_;
+  // Direct-mapped cache of the palette indices of recently seen RGB pixels in
+  // quant modes 2 and 3, each entry is (pixel + 1) << 8 | index, or 0.
+  std::vector<uint64_t> color_index_cache_;
   float* dither_[jpegli::kMaxComponents];
   float* error_row_[2 * jpegli::kMaxComponents];
   size_t dither_size_;
@@ -391,6 +391,11 @@ bool IsStreamingSupported(j_compress_ptr cinfo) {
   if (cinfo->master->psnr_target > 0) {
     return false;
   }
+  // With a parallel runner the iMCU rows are processed in batches, and the
+  // bitstream is written at the end.
+  if (cinfo->master->runner != nullptr) {
+    return false;
+  }
   return true;
 }
 
@@ -413,7 +418,13 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   size_t iMCU_height = DCTSIZE * cinfo->max_v_samp_factor;
   size_t total_iMCU_cols = DivCeil(cinfo->image_width, iMCU_width);
   size_t xsize_full = total_iMCU_cols * iMCU_width;
-  size_t ysize_full = 3 * iMCU_height;
+  // The input of a batch of iMCU rows is kept until its coefficients are
+  // computed, in addition to the context rows.
+  size_t num_buffered_iMCU_rows = 3;
+  if (m->runner != nullptr) {
+    num_buffered_iMCU_rows += kParallelBatchiMCURows;
+  }
+  size_t ysize_full = num_buffered_iMCU_rows * iMCU_height;
   if (!cinfo->raw_data_in) {
     int num_all_components =
         std::max(cinfo->input_components, cinfo->num_components);
@@ -424,7 +435,7 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
     size_t xsize = total_iMCU_cols * comp->h_samp_factor * DCTSIZE;
-    size_t ysize = 3 * comp->v_samp_factor * DCTSIZE;
+    size_t ysize = num_buffered_iMCU_rows * comp->v_samp_factor * DCTSIZE;
     if (cinfo->raw_data_in) {
       m->input_buffer[c].Allocate(cinfo, ysize, xsize);
     }
@@ -439,6 +450,13 @@ void AllocateBuffers(j_compress_ptr cinfo) {
       m->raw_data[c]->Allocate(cinfo, ysize, xsize);
     }
     m->quant_mul[c] = Allocate<float>(cinfo, DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    if (m->runner != nullptr) {
+      m->batch_dc[c] = Allocate<float>(
+          cinfo,
+          2 * kParallelBatchiMCURows * comp->v_samp_factor *
+              comp->width_in_blocks,
+          JPOOL_IMAGE);
+    }
   }
   m->dct_buffer = Allocate<float>(cinfo, 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
@@ -467,6 +485,8 @@ void AllocateBuffers(j_compress_ptr cinfo) {
     size_t qf_height = cinfo->max_v_samp_factor;
     if (m->psnr_target > 0) {
       qf_height *= cinfo->total_iMCU_rows;
+    } else if (m->runner != nullptr) {
+      qf_height *= kParallelBatchiMCURows;
     }
     m->quant_field.Allocate(cinfo, qf_height, xsize_blocks);
   } else {
@@ -525,6 +545,8 @@ void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
   WriteFileHeader(cinfo);
   JpegBitWriterInit(cinfo);
   m->next_iMCU_row = 0;
+  m->batch_iMCU_row = 0;
+  m->huffman_codes_done = false;
   m->last_restart_interval = 0;
   m->next_dht_index = 0;
 }
@@ -587,22 +609,42 @@ void PadInputBuffer(j_compress_ptr cinfo, float* row[kMaxComponents]) {
 }
 
 void ProcessiMCURow(j_compress_ptr cinfo) {
-  JPEGLI_CHECK(cinfo->master->next_iMCU_row < cinfo->total_iMCU_rows);
+  jpeg_comp_master* m = cinfo->master;
+  JPEGLI_CHECK(m->next_iMCU_row < cinfo->total_iMCU_rows);
   if (!cinfo->raw_data_in) {
     ApplyInputSmoothing(cinfo);
     DownsampleInputBuffer(cinfo);
   }
   ComputeAdaptiveQuantField(cinfo);
-  if (IsStreamingSupported(cinfo)) {
-    if (cinfo->optimize_coding) {
+  const bool streaming = IsStreamingSupported(cinfo);
+  if (streaming) {
+    if (cinfo->optimize_coding && !m->huffman_codes_done) {
       ComputeTokensForiMCURow(cinfo);
     } else {
       WriteiMCURow(cinfo);
     }
-  } else {
+  } else if (m->runner == nullptr) {
     ComputeCoefficientsForiMCURow(cinfo);
   }
-  ++cinfo->master->next_iMCU_row;
+  ++m->next_iMCU_row;
+  if (streaming && cinfo->optimize_coding && !m->huffman_codes_done &&
+      m->next_iMCU_row == m->huffman_sample_rows &&
+      m->next_iMCU_row < cinfo->total_iMCU_rows) {
+    // Writes the sampled rows, the rest of the image is written as it comes.
+    OptimizeHuffmanCodes(cinfo, /*all_symbols=*/true);
+    InitEntropyCoder(cinfo);
+    WriteFrameHeader(cinfo);
+    WriteScanHeader(cinfo, 0);
+    WriteSequentialTokens(cinfo);
+    m->huffman_codes_done = true;
+  }
+  if (m->runner != nullptr &&
+      (m->next_iMCU_row == m->batch_iMCU_row + kParallelBatchiMCURows ||
+       m->next_iMCU_row == cinfo->total_iMCU_rows)) {
+    ComputeCoefficientsForiMCURows(cinfo, m->batch_iMCU_row,
+                                   m->next_iMCU_row - m->batch_iMCU_row);
+    m->batch_iMCU_row = m->next_iMCU_row;
+  }
 }
 
 void ProcessiMCURows(j_compress_ptr cinfo) {
@@ -687,6 +729,9 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
   cinfo->master->data_type = JPEGLI_TYPE_UINT8;
   cinfo->master->endianness = JPEGLI_NATIVE_ENDIAN;
   cinfo->master->coeff_buffers = nullptr;
+  cinfo->master->runner = nullptr;
+  cinfo->master->runner_opaque = nullptr;
+  cinfo->master->huffman_sample_rows = 0;
 }
 
 void jpegli_set_xyb_mode(j_compress_ptr cinfo) {
@@ -930,6 +975,21 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level) {
   cinfo->master->progressive_level = level;
 }
 
+void jpegli_set_huffman_sample_rows(j_compress_ptr cinfo, int num_iMCU_rows) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (num_iMCU_rows < 0) {
+    JPEGLI_ERROR("Invalid number of Huffman sample rows %d", num_iMCU_rows);
+  }
+  cinfo->master->huffman_sample_rows = num_iMCU_rows;
+}
+
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -1234,14 +1294,16 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
 
   const bool tokens_done = jpegli::IsStreamingSupported(cinfo);
   const bool bitstream_done =
-      tokens_done && !FROM_JXL_BOOL(cinfo->optimize_coding);
+      tokens_done &&
+      (!FROM_JXL_BOOL(cinfo->optimize_coding) || m->huffman_codes_done);
 
   if (!tokens_done) {
     jpegli::TokenizeJpeg(cinfo);
   }
 
-  if (cinfo->optimize_coding || cinfo->progressive_mode) {
-    jpegli::OptimizeHuffmanCodes(cinfo);
+  if ((cinfo->optimize_coding || cinfo->progressive_mode) &&
+      !m->huffman_codes_done) {
+    jpegli::OptimizeHuffmanCodes(cinfo, /*all_symbols=*/false);
     jpegli::InitEntropyCoder(cinfo);
   }
 
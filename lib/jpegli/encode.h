@@ -20,6 +20,8 @@
 #ifndef LIB_JPEGLI_ENCODE_H_
 #define LIB_JPEGLI_ENCODE_H_
 
+#include <jxl/parallel_runner.h>
+
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -152,6 +154,25 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 // AC coefficients. Must be called before jpegli_set_defaults().
 void jpegli_use_standard_quant_tables(j_compress_ptr cinfo);
 
+// Makes the Huffman code optimization of sequential JPEGs (optimize_coding
+// without progressive mode) use only the first num_iMCU_rows iMCU rows of the
+// image. These rows are written as soon as the codes are built, and the rest
+// of the image is written while it is compressed, instead of keeping the
+// tokens of the whole image in memory until jpegli_finish_compress(). The codes
+// can represent any symbol, at the cost of a slightly larger output. Zero, the
+// default, uses the whole image. Must be called before
+// jpegli_start_compress().
+void jpegli_set_huffman_sample_rows(j_compress_ptr cinfo, int num_iMCU_rows);
+
+// Sets a parallel runner, e.g. JxlThreadParallelRunner, that the encoder uses
+// to compute the DCT and the quantization of batches of iMCU rows
+// concurrently. The entropy coded data is then written by
+// jpegli_finish_compress(), as in progressive mode. The output is the same as
+// without a parallel runner, which can be unset by passing NULL. Must be called
+// before jpegli_start_compress().
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
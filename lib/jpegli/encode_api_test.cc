@@ -183,6 +183,35 @@ TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   }
 }
 
+TEST(EncodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (const TestConfig& config : all_configs) {
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    std::vector<uint8_t> compressed0;
+    std::vector<uint8_t> compressed1;
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      compressed0.assign(buffer, buffer + buffer_size);
+      jpegli_set_parallel_runner(&cinfo, TestParallelRunner, nullptr);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      compressed1.assign(buffer, buffer + buffer_size);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    if (buffer) free(buffer);
+    ASSERT_EQ(compressed0.size(), compressed1.size());
+    EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                        compressed0.size()));
+  }
+}
+
 TEST(EncodeAPITest, ReuseCinfoChangeParams) {
   TestImage input;
   TestImage output;
@@ -377,6 +406,17 @@ std::vector<TestConfig> GenerateTests() {
       }
     }
   }
+  for (int sample_rows : {1, 3}) {
+    TestConfig config;
+    config.jparams.progressive_mode = 0;
+    config.jparams.optimize_coding = 1;
+    config.jparams.huffman_sample_rows = sample_rows;
+    config.jparams.h_sampling = {1, 1, 1};
+    config.jparams.v_sampling = {1, 1, 1};
+    config.max_bpp = 1.55;
+    config.max_dist = 1.95;
+    all_tests.push_back(config);
+  }
   {
     TestConfig config;
     config.jparams.quality = 100;
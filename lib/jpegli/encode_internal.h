@@ -21,6 +21,10 @@ constexpr int kICCMarker = JPEG_APP0 + 2;
 
 constexpr int kDefaultProgressiveLevel = 0;
 
+// Number of iMCU rows whose coefficients are computed concurrently when a
+// parallel runner is set.
+constexpr size_t kParallelBatchiMCURows = 16;
+
 typedef int16_t coeff_t;
 
 struct HuffmanCodeTable {
@@ -132,6 +136,16 @@ struct jpeg_comp_master {
   size_t total_num_tokens;
   jpegli::RefToken* next_refinement_token;
   uint8_t* next_refinement_bit;
+  JxlParallelRunner runner;
+  void* runner_opaque;
+  // First iMCU row of the batch whose coefficients are not computed yet, and
+  // DC values and thresholds of its blocks, see ComputeCoefficientBlockAC.
+  size_t batch_iMCU_row;
+  float* batch_dc[jpegli::kMaxComponents];
+  // Number of iMCU rows whose tokens are used to build the Huffman codes of a
+  // streamed sequential scan, 0 for all of them.
+  size_t huffman_sample_rows;
+  bool huffman_codes_done;
   float psnr_target;
   float psnr_tolerance;
   float min_distance;
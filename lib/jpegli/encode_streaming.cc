@@ -5,14 +5,17 @@
 
 #include "lib/jpegli/encode_streaming.h"
 
+#include <algorithm>
 #include <cmath>
 
+#include "lib/jpegli/adaptive_quantization.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/bitstream.h"
 #include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/data_parallel.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/encode_streaming.cc"
@@ -135,8 +138,13 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
         ++m->cur_token_array;
         ta = &m->token_arrays[m->cur_token_array];
       }
+      // Only the sampled rows are tokenized.
+      int token_rows = ysize_mcus;
+      if (m->huffman_sample_rows > 0) {
+        token_rows = std::min<int>(token_rows, m->huffman_sample_rows);
+      }
       m->num_tokens =
-          EstimateNumTokens(cinfo, mcu_y, ysize_mcus, m->total_num_tokens,
+          EstimateNumTokens(cinfo, mcu_y, token_rows, m->total_num_tokens,
                             max_tokens_per_mcu_row);
       ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
       m->next_token = ta->tokens;
@@ -149,7 +157,7 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   }
   const float* qf = nullptr;
   if (adaptive_quant) {
-    qf = m->quant_field.Row(0);
+    qf = m->quant_field.Row(mcu_y * cinfo->max_v_samp_factor);
   }
   HuffmanCodeTable* dc_code = nullptr;
   HuffmanCodeTable* ac_code = nullptr;
@@ -224,6 +232,106 @@ void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
   ProcessiMCURow<kStreamingModeCoefficients>(cinfo);
 }
 
+// Same as num_rows calls of ComputeCoefficientsForiMCURow(). The rows are
+// transformed and quantized concurrently, together with the last step of their
+// adaptive quantization field, then the DC coefficients, which
+// depend on the previous block of the component, are resolved in order.
+void ComputeCoefficientsForiMCURows(j_compress_ptr cinfo, size_t first_row,
+                                    size_t num_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  JPEGLI_CHECK(num_rows <= kParallelBatchiMCURows);
+  int xsize_mcus = DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
+  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
+  JBLOCKARRAY blocks[kMaxComponents][kParallelBatchiMCURows];
+  for (size_t i = 0; i < num_rows; ++i) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      int by0 = (first_row + i) * comp->v_samp_factor;
+      int block_rows_left = comp->height_in_blocks - by0;
+      int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+      blocks[c][i] = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], by0,
+          max_block_rows, true);
+    }
+  }
+  const size_t qf_stride = m->quant_field.stride();
+
+  const auto compute_row = [&](const uint32_t i, size_t /* thread */) {
+    HWY_ALIGN float dct_buffer[2 * DCTSIZE2];
+    HWY_ALIGN int32_t block[DCTSIZE2];
+    const size_t mcu_y = first_row + i;
+    if (adaptive_quant) {
+      ApplyAdaptiveQuantModulations(cinfo, mcu_y);
+    }
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      const float* qmc = m->quant_mul[c];
+      const size_t stride = m->raw_data[c]->stride();
+      const float* imcu_start =
+          m->raw_data[c]->Row(mcu_y * comp->v_samp_factor * DCTSIZE);
+      const float* qf = nullptr;
+      if (adaptive_quant) {
+        qf = m->quant_field.Row(mcu_y * cinfo->max_v_samp_factor);
+      }
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        size_t by = mcu_y * comp->v_samp_factor + iy;
+        if (by >= comp->height_in_blocks) break;
+        float* dc_row = m->batch_dc[c] +
+                        2 * (i * comp->v_samp_factor + iy) *
+                            comp->width_in_blocks;
+        for (size_t bx = 0; bx < comp->width_in_blocks; ++bx) {
+          float aq_strength = 0.0f;
+          if (adaptive_quant) {
+            aq_strength = qf[iy * qf_stride + bx * m->h_factor[c]];
+          }
+          const float* pixels = imcu_start + (iy * stride + bx) * DCTSIZE;
+          ComputeCoefficientBlockAC(pixels, stride, qmc, aq_strength,
+                                    m->zero_bias_offset[c],
+                                    m->zero_bias_mul[c], dct_buffer, block,
+                                    &dc_row[2 * bx], &dc_row[2 * bx + 1]);
+          JCOEF* cblock = &blocks[c][i][iy][bx][0];
+          for (int k = 0; k < DCTSIZE2; ++k) {
+            cblock[k] = block[kJPEGNaturalOrder[k]];
+          }
+        }
+      }
+    }
+    return true;
+  };
+  jxl::ThreadPool pool(m->runner, m->runner_opaque);
+  if (!jxl::RunOnPool(&pool, 0, num_rows, jxl::ThreadPool::NoInit,
+                      compute_row, "ComputeCoefficients")) {
+    JPEGLI_ERROR("Parallel runner failed.");
+  }
+
+  // Resolves the DC coefficients in the order of the blocks in the scan.
+  coeff_t* JXL_RESTRICT last_dc_coeff = m->last_dc_coeff;
+  for (size_t i = 0; i < num_rows; ++i) {
+    const size_t mcu_y = first_row + i;
+    for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+      for (int c = 0; c < cinfo->num_components; ++c) {
+        jpeg_component_info* comp = &cinfo->comp_info[c];
+        for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+          for (int ix = 0; ix < comp->h_samp_factor; ++ix) {
+            size_t by = mcu_y * comp->v_samp_factor + iy;
+            size_t bx = mcu_x * comp->h_samp_factor + ix;
+            if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
+              continue;
+            }
+            const float* dc = m->batch_dc[c] +
+                              2 * ((i * comp->v_samp_factor + iy) *
+                                       comp->width_in_blocks +
+                                   bx);
+            const int32_t dc_coeff = QuantizeDC(dc[0], dc[1], last_dc_coeff[c]);
+            blocks[c][i][iy][bx][0] = dc_coeff;
+            last_dc_coeff[c] = dc_coeff;
+          }
+        }
+      }
+    }
+  }
+}
+
 void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
   ProcessiMCURow<kStreamingModeTokens>(cinfo);
 }
@@ -240,6 +348,7 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jpegli {
 HWY_EXPORT(ComputeCoefficientsForiMCURow);
+HWY_EXPORT(ComputeCoefficientsForiMCURows);
 HWY_EXPORT(ComputeTokensForiMCURow);
 HWY_EXPORT(WriteiMCURow);
 
@@ -247,6 +356,12 @@ void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
   HWY_DYNAMIC_DISPATCH(ComputeCoefficientsForiMCURow)(cinfo);
 }
 
+void ComputeCoefficientsForiMCURows(j_compress_ptr cinfo, size_t first_row,
+                                    size_t num_rows) {
+  HWY_DYNAMIC_DISPATCH(ComputeCoefficientsForiMCURows)
+  (cinfo, first_row, num_rows);
+}
+
 void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
   HWY_DYNAMIC_DISPATCH(ComputeTokensForiMCURow)(cinfo);
 }
@@ -6,12 +6,20 @@
 #ifndef LIB_JPEGLI_ENCODE_STREAMING_H_
 #define LIB_JPEGLI_ENCODE_STREAMING_H_
 
+#include <stddef.h>
+
 #include "lib/jpegli/encode_internal.h"
 
 namespace jpegli {
 
 void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo);
 
+// Computes the coefficients of the iMCU rows [first_row, first_row + num_rows)
+// on the parallel runner of the encoder. The input of these rows must still be
+// in the row buffers.
+void ComputeCoefficientsForiMCURows(j_compress_ptr cinfo, size_t first_row,
+                                    size_t num_rows);
+
 void ComputeTokensForiMCURow(j_compress_ptr cinfo);
 
 void WriteiMCURow(j_compress_ptr cinfo);
@@ -5,6 +5,7 @@
 
 #include "lib/jpegli/entropy_coding.h"
 
+#include <algorithm>
 #include <vector>
 
 #include "lib/jpegli/encode_internal.h"
@@ -531,6 +532,29 @@ void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
   }
 }
 
+// Gives a nonzero count to every DC and AC symbol of a sequential scan with up
+// to 15 bit coefficients.
+void AddAllSymbols(j_compress_ptr cinfo, Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  const auto add_symbol = [](Histogram* histo, int symbol) {
+    histo->count[symbol] = std::max(histo->count[symbol], 1);
+  };
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    for (int nbits = 0; nbits < 16; ++nbits) {
+      add_symbol(&histograms[c], nbits);
+    }
+  }
+  for (size_t i = 4; i < m->num_contexts; ++i) {
+    add_symbol(&histograms[i], 0x00);  // EOB
+    add_symbol(&histograms[i], 0xf0);  // ZRL
+    for (int run = 0; run < 16; ++run) {
+      for (int nbits = 1; nbits < 16; ++nbits) {
+        add_symbol(&histograms[i], (run << 4) | nbits);
+      }
+    }
+  }
+}
+
 struct JpegClusteredHistograms {
   std::vector<Histogram> histograms;
   std::vector<uint32_t> histogram_indexes;
@@ -710,11 +734,14 @@ void CopyHuffmanTables(j_compress_ptr cinfo) {
   }
 }
 
-void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
+void OptimizeHuffmanCodes(j_compress_ptr cinfo, bool all_symbols) {
   jpeg_comp_master* m = cinfo->master;
   // Build DC and AC histograms.
   std::vector<Histogram> histograms(m->num_contexts);
   BuildHistograms(cinfo, histograms.data());
+  if (all_symbols) {
+    AddAllSymbols(cinfo, histograms.data());
+  }
 
   // Cluster DC histograms.
   JpegClusteredHistograms dc_clusters;
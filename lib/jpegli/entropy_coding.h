@@ -19,7 +19,9 @@ void TokenizeJpeg(j_compress_ptr cinfo);
 
 void CopyHuffmanTables(j_compress_ptr cinfo);
 
-void OptimizeHuffmanCodes(j_compress_ptr cinfo);
+// If all_symbols is true, the Huffman codes can represent all the symbols of a
+// sequential scan, not only those of the tokens so far.
+void OptimizeHuffmanCodes(j_compress_ptr cinfo, bool all_symbols);
 
 void InitEntropyCoder(j_compress_ptr cinfo);
 
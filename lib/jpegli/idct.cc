@@ -626,51 +626,136 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
-  if (dctsize == 1) {
-    *output = *block0;
-  } else if (dctsize == 2 || dctsize == 4) {
-    float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
-    ComputeScaledIDCT(block0, block1, block2, 8);
-    if (dctsize == 4) {
-      for (size_t iy = 0; iy < 4; ++iy) {
-        for (size_t ix = 0; ix < 4; ++ix) {
-          float* block = &block2[16 * iy + 2 * ix];
-          output[iy * output_stride + ix] =
-              0.25f * (block[0] + block[1] + block[8] + block[9]);
-        }
-      }
-    } else {
-      for (size_t iy = 0; iy < 2; ++iy) {
-        for (size_t ix = 0; ix < 2; ++ix) {
-          float* block = &block2[32 * iy + 4 * ix];
-          output[iy * output_stride + ix] =
-              0.0625f *
-              (block[0] + block[1] + block[2] + block[3] + block[8] + block[9] +
-               block[10] + block[11] + block[16] + block[17] + block[18] +
-               block[19] + block[24] + block[25] + block[26] + block[27]);
-        }
-      }
+  float dctin[DCTSIZE];
+  float dctout[DCTSIZE * 2];
+  size_t insize = std::min<size_t>(dctsize, DCTSIZE);
+  for (size_t ix = 0; ix < insize; ++ix) {
+    for (size_t iy = 0; iy < insize; ++iy) {
+      dctin[iy] = block0[iy * DCTSIZE + ix];
     }
-  } else {
-    float dctin[DCTSIZE];
-    float dctout[DCTSIZE * 2];
-    size_t insize = std::min<size_t>(dctsize, DCTSIZE);
-    for (size_t ix = 0; ix < insize; ++ix) {
-      for (size_t iy = 0; iy < insize; ++iy) {
-        dctin[iy] = block0[iy * DCTSIZE + ix];
-      }
-      Compute1dIDCT(dctin, dctout, dctsize);
-      for (size_t iy = 0; iy < dctsize; ++iy) {
-        block1[iy * dctsize + ix] = dctout[iy];
+    Compute1dIDCT(dctin, dctout, dctsize);
+    for (size_t iy = 0; iy < dctsize; ++iy) {
+      block1[iy * dctsize + ix] = dctout[iy];
+    }
+  }
+  for (size_t iy = 0; iy < dctsize; ++iy) {
+    Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
+                  dctsize);
+  }
+}
+
+// Averages of the 8-point IDCT basis functions over 8 / N consecutive
+// samples, i.e. row i of the N x 8 matrix maps the coefficients of an 8-point
+// IDCT directly to the box-filtered 1/(8 / N) scaled output. Generated by the
+// following snippet:
+// def b(k, j): return 1 if k == 0 else
+//   math.sqrt(2) * math.cos((2 * j + 1) * k * math.pi / 16)
+// for i in range(N):
+//   print([sum(b(k, 8 // N * i + t) for t in range(8 // N)) / (8 // N)
+//          for k in range(8)])
+template <size_t N>
+struct ReducedIDCTMatrix;
+
+template <>
+struct ReducedIDCTMatrix<4> {
+  static constexpr float kMatrix[32] = {
+      1.000000000000,  1.281457723871,  0.923879532511,  0.449988111568,
+      0.000000000000,  -0.300672443468, -0.382683432365, -0.254897789552,
+      1.000000000000,  0.530797168835,  -0.923879532511, -1.086367401855,
+      0.000000000000,  0.725887490851,  0.382683432365,  -0.105582121451,
+      1.000000000000,  -0.530797168835, -0.923879532511, 1.086367401855,
+      0.000000000000,  -0.725887490851, 0.382683432365,  0.105582121451,
+      1.000000000000,  -1.281457723871, 0.923879532511,  -0.449988111568,
+      0.000000000000,  0.300672443468,  -0.382683432365, 0.254897789552,
+  };
+};
+
+template <>
+struct ReducedIDCTMatrix<2> {
+  static constexpr float kMatrix[16] = {
+      1.000000000000, 0.906127446353,  0.000000000000, -0.318189645143,
+      0.000000000000, 0.212607523692,  0.000000000000, -0.180239955502,
+      1.000000000000, -0.906127446353, 0.000000000000, 0.318189645143,
+      0.000000000000, -0.212607523692, 0.000000000000, 0.180239955502,
+  };
+};
+
+#if JXL_CXX_LANG < JXL_CXX_17
+constexpr float ReducedIDCTMatrix<4>::kMatrix[];
+constexpr float ReducedIDCTMatrix<2>::kMatrix[];
+#endif
+
+// Computes the N x N downscaled output of the 8x8 block directly from its
+// coefficients, this is the same as the 8x8 IDCT followed by averaging the
+// (8 / N) x (8 / N) pixel boxes, but needs only a fraction of the operations.
+template <size_t N>
+void ReducedIDCT(const float* JXL_RESTRICT block, float* JXL_RESTRICT tmp,
+                 float* JXL_RESTRICT output, size_t output_stride) {
+  const float* JXL_RESTRICT matrix = ReducedIDCTMatrix<N>::kMatrix;
+  // Vertical pass, from 8 to N rows.
+  for (size_t iy = 0; iy < N; ++iy) {
+    for (size_t ix = 0; ix < 8; ix += Lanes(d8)) {
+      auto sum = Zero(d8);
+      for (size_t k = 0; k < 8; ++k) {
+        sum = MulAdd(Set(d8, matrix[iy * 8 + k]),
+                     Load(d8, block + k * 8 + ix), sum);
       }
+      Store(sum, d8, tmp + iy * 8 + ix);
     }
-    for (size_t iy = 0; iy < dctsize; ++iy) {
-      Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
-                    dctsize);
+  }
+  // Horizontal pass, from 8 to N columns.
+  for (size_t iy = 0; iy < N; ++iy) {
+    for (size_t ix = 0; ix < N; ++ix) {
+      float sum = 0.0f;
+      for (size_t k = 0; k < 8; ++k) {
+        sum += matrix[ix * 8 + k] * tmp[iy * 8 + k];
+      }
+      output[iy * output_stride + ix] = sum;
     }
   }
 }
 
+void InverseTransformBlock4x4(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  DequantBlock(qblock, dequant, biases, block0);
+  ReducedIDCT<4>(block0, block1, output, output_stride);
+}
+
+void InverseTransformBlock2x2(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  DequantBlock(qblock, dequant, biases, block0);
+  ReducedIDCT<2>(block0, block1, output, output_stride);
+}
+
+// The 1x1 output is the dequantized DC coefficient, the same computation as in
+// DequantBlock, but only for the first coefficient.
+void InverseTransformBlock1x1(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  const float quant = qblock[0];
+  if (quant == 0.0f) {
+    *output = 0.0f;
+    return;
+  }
+  const float bias = quant < 0.0f ? -biases[0] : biases[0];
+  *output = (quant - bias) * dequant[0];
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -680,6 +765,9 @@ HWY_AFTER_NAMESPACE();
 namespace jpegli {
 
 HWY_EXPORT(InverseTransformBlock8x8);
+HWY_EXPORT(InverseTransformBlock4x4);
+HWY_EXPORT(InverseTransformBlock2x2);
+HWY_EXPORT(InverseTransformBlock1x1);
 HWY_EXPORT(InverseTransformBlockGeneric);
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
@@ -691,6 +779,12 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
     }
     if (dct_size == DCTSIZE) {
       m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8);
+    } else if (dct_size == 4) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock4x4);
+    } else if (dct_size == 2) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock2x2);
+    } else if (dct_size == 1) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock1x1);
     } else {
       m->inverse_transform[c] =
           HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
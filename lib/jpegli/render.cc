@@ -5,6 +5,7 @@
 
 #include "lib/jpegli/render.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <cstddef>
@@ -20,6 +21,7 @@
 #include "lib/jpegli/upsample.h"
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 
 #ifdef MEMORY_SANITIZER
 #define JXL_MEMORY_SANITIZER 1
@@ -53,6 +55,7 @@ using hwy::HWY_NAMESPACE::Clamp;
 using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
 using hwy::HWY_NAMESPACE::NearestInt;
 using hwy::HWY_NAMESPACE::Or;
 using hwy::HWY_NAMESPACE::Rebind;
@@ -87,6 +90,21 @@ void DecenterRow(float* row, size_t xsize) {
   }
 }
 
+// Undoes the centering of a row of inverse DCT output and stores it as 8-bit
+// samples, directly into `output`. `len` must be a multiple of DCTSIZE.
+void WriteRawRow8(const float* JXL_RESTRICT row, size_t len,
+                  uint8_t* JXL_RESTRICT output) {
+  const HWY_CAPPED(float, 8) d;
+  const Rebind<uint8_t, decltype(d)> du;
+  const auto zero = Zero(d);
+  const auto mul = Set(d, 255.0f);
+  const auto c128 = Set(d, 128.0f / 255);
+  for (size_t x = 0; x < len; x += Lanes(d)) {
+    auto v = Clamp(zero, Mul(Add(Load(d, row + x), c128), mul), mul);
+    StoreU(DemoteTo(du, NearestInt(v)), du, output + x);
+  }
+}
+
 void DitherRow(j_decompress_ptr cinfo, float* row, int c, size_t y,
                size_t xsize) {
   jpeg_decomp_master* m = cinfo->master;
@@ -176,6 +194,76 @@ void StoreFloatRow(float* JXL_RESTRICT input[3], size_t x0, size_t len,
   }
 }
 
+// Same as YCbCrToExtRGB (see color_transform.cc) followed by DecenterRow and
+// StoreUnsignedRow with 8-bit output, for one vector of pixels.
+template <int kRed, class DF>
+void YCbCrToExtRGB8(DF d, const float* JXL_RESTRICT row_y,
+                    const float* JXL_RESTRICT row_cb,
+                    const float* JXL_RESTRICT row_cr,
+                    uint8_t* JXL_RESTRICT out) {
+  const Rebind<uint8_t, DF> du;
+  const auto crcr = Set(d, 1.402f);
+  const auto cgcb = Set(d, -0.114f * 1.772f / 0.587f);
+  const auto cgcr = Set(d, -0.299f * 1.402f / 0.587f);
+  const auto cbcb = Set(d, 1.772f);
+  const auto c128 = Set(d, 128.0f / 255);
+  const auto zero = Zero(d);
+  const auto mul = Set(d, 255.0f);
+  const auto y_vec = LoadU(d, row_y);
+  const auto cb_vec = LoadU(d, row_cb);
+  const auto cr_vec = LoadU(d, row_cr);
+  const auto r_vec = Add(MulAdd(crcr, cr_vec, y_vec), c128);
+  const auto g_vec =
+      Add(MulAdd(cgcr, cr_vec, MulAdd(cgcb, cb_vec, y_vec)), c128);
+  const auto b_vec = Add(MulAdd(cbcb, cb_vec, y_vec), c128);
+  const auto r = DemoteTo(du, NearestInt(Clamp(zero, Mul(r_vec, mul), mul)));
+  const auto g = DemoteTo(du, NearestInt(Clamp(zero, Mul(g_vec, mul), mul)));
+  const auto b = DemoteTo(du, NearestInt(Clamp(zero, Mul(b_vec, mul), mul)));
+  if (kRed == 0) {
+    StoreInterleaved3(r, g, b, du, out);
+  } else {
+    StoreInterleaved3(b, g, r, du, out);
+  }
+}
+
+// Color transform and 8-bit output of a row without the intermediate float
+// rows. Only the last partial vector goes through the scratch space.
+template <int kRed>
+void YCbCrToExtRGB8Row(float* JXL_RESTRICT rows[3], size_t x0, size_t len,
+                       uint8_t* JXL_RESTRICT output,
+                       uint8_t* JXL_RESTRICT scratch_space) {
+  const HWY_CAPPED(float, 8) d;
+  const float* JXL_RESTRICT row_y = rows[0] + x0;
+  const float* JXL_RESTRICT row_cb = rows[1] + x0;
+  const float* JXL_RESTRICT row_cr = rows[2] + x0;
+#if JXL_MEMORY_SANITIZER
+  const size_t padding = hwy::RoundUpTo(len, Lanes(d)) - len;
+  for (size_t c = 0; c < 3; ++c) {
+    __msan_unpoison(rows[c] + x0 + len, sizeof(rows[c][0]) * padding);
+  }
+#endif
+  size_t i = 0;
+  for (; i + Lanes(d) <= len; i += Lanes(d)) {
+    YCbCrToExtRGB8<kRed>(d, row_y + i, row_cb + i, row_cr + i, &output[3 * i]);
+  }
+  if (i < len) {
+    YCbCrToExtRGB8<kRed>(d, row_y + i, row_cb + i, row_cr + i, scratch_space);
+    memcpy(&output[3 * i], scratch_space, 3 * (len - i));
+  }
+}
+
+void YCbCrToRGB8Row(float* JXL_RESTRICT rows[3], size_t x0, size_t len,
+                    uint8_t* JXL_RESTRICT output,
+                    uint8_t* JXL_RESTRICT scratch_space) {
+  YCbCrToExtRGB8Row<0>(rows, x0, len, output, scratch_space);
+}
+
+void YCbCrToBGR8Row(float* JXL_RESTRICT rows[3], size_t x0, size_t len,
+                    uint8_t* JXL_RESTRICT output,
+                    uint8_t* JXL_RESTRICT scratch_space) {
+  YCbCrToExtRGB8Row<2>(rows, x0, len, output, scratch_space);
+}
+
 static constexpr float kFSWeightMR = 7.0f / 16.0f;
 static constexpr float kFSWeightBL = 3.0f / 16.0f;
 static constexpr float kFSWeightBM = 5.0f / 16.0f;
@@ -286,6 +374,9 @@ namespace jpegli {
 HWY_EXPORT(GatherBlockStats);
 HWY_EXPORT(WriteToOutput);
 HWY_EXPORT(DecenterRow);
+HWY_EXPORT(WriteRawRow8);
+HWY_EXPORT(YCbCrToRGB8Row);
+HWY_EXPORT(YCbCrToBGR8Row);
 
 void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
                       const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
@@ -304,6 +395,11 @@ void DecenterRow(float* row, size_t xsize) {
   HWY_DYNAMIC_DISPATCH(DecenterRow)(row, xsize);
 }
 
+void WriteRawRow8(const float* JXL_RESTRICT row, size_t len,
+                  uint8_t* JXL_RESTRICT output) {
+  HWY_DYNAMIC_DISPATCH(WriteRawRow8)(row, len, output);
+}
+
 bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci) {
   const auto& compinfo = cinfo->comp_info[ci];
   return (compinfo.h_samp_factor == cinfo->max_h_samp_factor &&
@@ -387,9 +483,8 @@ bool do_smoothing(j_decompress_ptr cinfo) {
 }
 
 void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
-                   size_t bx, int iy) {
+                   size_t bx, int iy, int16_t* scratch) {
   const size_t imcu_row = cinfo->output_iMCU_row;
-  int16_t* scratch = cinfo->master->smoothing_scratch_;
   std::vector<int> Q_VAL(SAVED_COEFS);
   int* coef_bits;
 
@@ -546,6 +641,34 @@ void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
   }
 }
 
+// Selects a kernel doing the color transform and the 8-bit output in one pass
+// for the most common output formats, the parallel color transform is used
+// instead if there is a parallel runner.
+void ChooseFusedOutput(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->fused_output_ = nullptr;
+  if (cinfo->jpeg_color_space != JCS_YCbCr || cinfo->num_components != 3 ||
+      cinfo->out_color_components != 3 || cinfo->quantize_colors ||
+      m->output_data_type_ != JPEGLI_TYPE_UINT8 || m->runner_ != nullptr) {
+    return;
+  }
+  switch (cinfo->out_color_space) {
+    case JCS_RGB:
+      m->fused_output_ = HWY_DYNAMIC_DISPATCH(YCbCrToRGB8Row);
+      break;
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_RGB:
+      m->fused_output_ = HWY_DYNAMIC_DISPATCH(YCbCrToRGB8Row);
+      break;
+    case JCS_EXT_BGR:
+      m->fused_output_ = HWY_DYNAMIC_DISPATCH(YCbCrToBGR8Row);
+      break;
+#endif
+    default:
+      break;
+  }
+}
+
 void PrepareForOutput(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   bool smoothing = do_smoothing(cinfo);
@@ -568,6 +691,79 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   }
   JPEGLI_CHECK(ChooseInverseTransform(cinfo));
   ChooseColorTransform(cinfo);
+  ChooseFusedOutput(cinfo);
+}
+
+// Number of blocks and of pixels processed by one task when there is a
+// parallel runner.
+constexpr size_t kBlocksPerTask = 64;
+constexpr size_t kPixelsPerTask = 1024;
+
+void InverseTransformBlocks(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int c,
+                            int iy, size_t bx0, size_t bx1,
+                            float* JXL_RESTRICT idct_scratch,
+                            int16_t* JXL_RESTRICT smoothing_scratch) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t k0 = c * DCTSIZE2;
+  const size_t by = cinfo->output_iMCU_row * cinfo->comp_info[c].v_samp_factor;
+  const size_t dctsize = m->scaled_dct_size[c];
+  RowBuffer<float>* raw_out = &m->raw_output_[c];
+  int16_t* JXL_RESTRICT row_in = &blocks[iy][0][0];
+  float* JXL_RESTRICT row_out = raw_out->Row((by + iy) * dctsize);
+  for (size_t bx = bx0; bx < bx1; ++bx) {
+    if (m->apply_smoothing) {
+      PredictSmooth(cinfo, blocks, c, bx, iy, smoothing_scratch);
+      (*m->inverse_transform[c])(smoothing_scratch, &m->dequant_[k0],
+                                 &m->biases_[k0], idct_scratch,
+                                 &row_out[bx * dctsize], raw_out->stride(),
+                                 dctsize);
+    } else {
+      (*m->inverse_transform[c])(&row_in[bx * DCTSIZE2], &m->dequant_[k0],
+                                 &m->biases_[k0], idct_scratch,
+                                 &row_out[bx * dctsize], raw_out->stride(),
+                                 dctsize);
+    }
+  }
+}
+
+// Runs the inverse DCT of all the blocks of the current iMCU row on the
+// parallel runner, in tasks of at most kBlocksPerTask blocks of a block row.
+void InverseTransformiMCURowParallel(j_decompress_ptr cinfo,
+                                     JBLOCKARRAY blocks[kMaxComponents]) {
+  jpeg_decomp_master* m = cinfo->master;
+  struct Task {
+    int c;
+    int iy;
+    size_t bx0;
+    size_t bx1;
+  };
+  std::vector<Task> tasks;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const auto& compinfo = cinfo->comp_info[c];
+    size_t block_row = cinfo->output_iMCU_row * compinfo.v_samp_factor;
+    for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
+      if (block_row + iy >= compinfo.height_in_blocks) break;
+      for (size_t bx = 0; bx < compinfo.width_in_blocks;
+           bx += kBlocksPerTask) {
+        size_t bx1 = std::min<size_t>(bx + kBlocksPerTask,
+                                      compinfo.width_in_blocks);
+        tasks.push_back({c, iy, bx, bx1});
+      }
+    }
+  }
+  const auto process_task = [&](const uint32_t i, size_t /* thread */) {
+    HWY_ALIGN_MAX float idct_scratch[5 * DCTSIZE2];
+    HWY_ALIGN_MAX int16_t smoothing_scratch[DCTSIZE2];
+    const Task& task = tasks[i];
+    InverseTransformBlocks(cinfo, blocks[task.c], task.c, task.iy, task.bx0,
+                           task.bx1, idct_scratch, smoothing_scratch);
+    return true;
+  };
+  jxl::ThreadPool pool(m->runner_, m->runner_opaque_);
+  if (!jxl::RunOnPool(&pool, 0, tasks.size(), jxl::ThreadPool::NoInit,
+                      process_task, "InverseTransform")) {
+    JPEGLI_ERROR("Parallel runner failed.");
+  }
 }
 
 void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
@@ -607,51 +803,121 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
                                       &m->biases_[k0]);
       }
     }
-    RowBuffer<float>* raw_out = &m->raw_output_[c];
+    if (m->runner_ != nullptr) continue;
     for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
-      size_t by = block_row + iy;
-      if (by >= compinfo.height_in_blocks) {
-        continue;
-      }
-      size_t dctsize = m->scaled_dct_size[c];
-      int16_t* JXL_RESTRICT row_in = &blocks[c][iy][0][0];
-      float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
-      for (size_t bx = 0; bx < compinfo.width_in_blocks; ++bx) {
-        if (m->apply_smoothing) {
-          PredictSmooth(cinfo, blocks[c], c, bx, iy);
-          (*m->inverse_transform[c])(m->smoothing_scratch_, &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        } else {
-          (*m->inverse_transform[c])(&row_in[bx * DCTSIZE2], &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        }
-      }
-      if (m->streaming_mode_) {
-        memset(row_in, 0, compinfo.width_in_blocks * sizeof(JBLOCK));
+      if (block_row + iy >= compinfo.height_in_blocks) break;
+      InverseTransformBlocks(cinfo, blocks[c], c, iy, 0,
+                             compinfo.width_in_blocks, m->idct_scratch_,
+                             m->smoothing_scratch_);
+    }
+  }
+  if (m->runner_ != nullptr) {
+    InverseTransformiMCURowParallel(cinfo, blocks);
+  }
+  if (m->streaming_mode_) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const auto& compinfo = cinfo->comp_info[c];
+      size_t block_row = imcu_row * compinfo.v_samp_factor;
+      for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
+        if (block_row + iy >= compinfo.height_in_blocks) break;
+        memset(&blocks[c][iy][0][0], 0,
+               compinfo.width_in_blocks * sizeof(JBLOCK));
       }
     }
   }
 }
 
+// Applies the color transform to the rows [ybegin, yend) of the render output
+// and undoes the centering of their sample values around zero.
+void ColorTransformRows(j_decompress_ptr cinfo, size_t ybegin, size_t yend,
+                        size_t output_width) {
+  jpeg_decomp_master* m = cinfo->master;
+  int num_all_components =
+      std::max(cinfo->out_color_components, cinfo->num_components);
+  const auto transform = [&](size_t yix, size_t x0, size_t len) {
+    float* rows[kMaxComponents];
+    for (int c = 0; c < num_all_components; ++c) {
+      rows[c] = m->render_output_[c].Row(yix) + x0;
+    }
+    (*m->color_transform)(rows, len);
+    for (int c = 0; c < cinfo->out_color_components; ++c) {
+      DecenterRow(rows[c], len);
+    }
+  };
+  if (m->runner_ == nullptr) {
+    for (size_t yix = ybegin; yix < yend; ++yix) {
+      transform(yix, 0, output_width);
+    }
+    return;
+  }
+  const size_t tasks_per_row = DivCeil(output_width, kPixelsPerTask);
+  const auto process_task = [&](const uint32_t i, size_t /* thread */) {
+    size_t yix = ybegin + i / tasks_per_row;
+    size_t x0 = (i % tasks_per_row) * kPixelsPerTask;
+    transform(yix, x0, std::min(kPixelsPerTask, output_width - x0));
+    return true;
+  };
+  jxl::ThreadPool pool(m->runner_, m->runner_opaque_);
+  if (!jxl::RunOnPool(&pool, 0, (yend - ybegin) * tasks_per_row,
+                      jxl::ThreadPool::NoInit, process_task,
+                      "ColorTransform")) {
+    JPEGLI_ERROR("Parallel runner failed.");
+  }
+}
+
 void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
   jpegli::DecodeCurrentiMCURow(cinfo);
   jpeg_decomp_master* m = cinfo->master;
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    const auto& compinfo = cinfo->comp_info[c];
-    size_t comp_width = compinfo.width_in_blocks * DCTSIZE;
-    size_t comp_height = compinfo.height_in_blocks * DCTSIZE;
-    size_t comp_nrows = compinfo.v_samp_factor * DCTSIZE;
-    size_t y0 = cinfo->output_iMCU_row * compinfo.v_samp_factor * DCTSIZE;
-    size_t y1 = std::min(y0 + comp_nrows, comp_height);
-    for (size_t y = y0; y < y1; ++y) {
-      float* rows[1] = {m->raw_output_[c].Row(y)};
-      uint8_t* output = data[c][y - y0];
-      DecenterRow(rows[0], comp_width);
-      WriteToOutput(cinfo, rows, 0, comp_width, 1, output);
+  if (m->output_data_type_ == JPEGLI_TYPE_UINT8) {
+    // The rows of the component planes are whole blocks wide, so the samples
+    // are stored straight into the output rows, without the scratch row.
+    struct RowTask {
+      int c;
+      size_t y;
+    };
+    std::vector<RowTask> tasks;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const auto& compinfo = cinfo->comp_info[c];
+      size_t comp_height = compinfo.height_in_blocks * DCTSIZE;
+      size_t comp_nrows = compinfo.v_samp_factor * DCTSIZE;
+      size_t y0 = cinfo->output_iMCU_row * comp_nrows;
+      size_t y1 = std::min(y0 + comp_nrows, comp_height);
+      for (size_t y = y0; y < y1; ++y) {
+        tasks.push_back({c, y});
+      }
+    }
+    const auto write_row = [&](const uint32_t i, size_t /* thread */) {
+      const RowTask& task = tasks[i];
+      const auto& compinfo = cinfo->comp_info[task.c];
+      size_t y0 = cinfo->output_iMCU_row * compinfo.v_samp_factor * DCTSIZE;
+      WriteRawRow8(m->raw_output_[task.c].Row(task.y),
+                   compinfo.width_in_blocks * DCTSIZE,
+                   data[task.c][task.y - y0]);
+      return true;
+    };
+    if (m->runner_ == nullptr) {
+      for (size_t i = 0; i < tasks.size(); ++i) write_row(i, 0);
+    } else {
+      jxl::ThreadPool pool(m->runner_, m->runner_opaque_);
+      if (!jxl::RunOnPool(&pool, 0, tasks.size(), jxl::ThreadPool::NoInit,
+                          write_row, "RawOutput")) {
+        JPEGLI_ERROR("Parallel runner failed.");
+      }
+    }
+  } else {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const auto& compinfo = cinfo->comp_info[c];
+      size_t comp_width = compinfo.width_in_blocks * DCTSIZE;
+      size_t comp_height = compinfo.height_in_blocks * DCTSIZE;
+      size_t comp_nrows = compinfo.v_samp_factor * DCTSIZE;
+      size_t y0 = cinfo->output_iMCU_row * compinfo.v_samp_factor * DCTSIZE;
+      size_t y1 = std::min(y0 + comp_nrows, comp_height);
+      for (size_t y = y0; y < y1; ++y) {
+        float* rows[1] = {m->raw_output_[c].Row(y)};
+        uint8_t* output = data[c][y - y0];
+        DecenterRow(rows[0], comp_width);
+        WriteToOutput(cinfo, rows, 0, comp_width, 1, output);
+      }
     }
   }
   ++cinfo->output_iMCU_row;
@@ -725,23 +991,25 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
           }
         }
       }
-      for (int yix = 0; yix < vfactor; ++yix) {
-        if (y + yix < ybegin || y + yix >= yend) continue;
+      size_t yix0 = std::max(y, ybegin) - y;
+      size_t yix1 = std::min(y + vfactor, yend) - y;
+      if (m->fused_output_ == nullptr) {
+        ColorTransformRows(cinfo, yix0, yix1, output_width);
+      }
+      for (size_t yix = yix0; yix < yix1; ++yix) {
         float* rows[kMaxComponents];
-        int num_all_components =
-            std::max(cinfo->out_color_components, cinfo->num_components);
-        for (int c = 0; c < num_all_components; ++c) {
-          rows[c] = m->render_output_[c].Row(yix);
-        }
-        (*m->color_transform)(rows, output_width);
         for (int c = 0; c < cinfo->out_color_components; ++c) {
-          // Undo the centering of the sample values around zero.
-          DecenterRow(rows[c], output_width);
+          rows[c] = m->render_output_[c].Row(yix);
         }
         if (scanlines) {
           uint8_t* output = scanlines[*num_output_rows];
-          WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
-                        cinfo->out_color_components, output);
+          if (m->fused_output_ != nullptr) {
+            (*m->fused_output_)(rows, m->xoffset_, cinfo->output_width,
+                                output, m->output_scratch_);
+          } else {
+            WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
+                          cinfo->out_color_components, output);
+          }
         }
         JPEGLI_CHECK(cinfo->output_scanline == y + yix);
         ++cinfo->output_scanline;
@@ -100,6 +100,7 @@ struct CompressParams {
   int restart_in_rows = 0;
   int smoothing_factor = 0;
   int optimize_coding = -1;
+  int huffman_sample_rows = 0;
   bool use_flat_dc_luma_code = false;
   bool omit_standard_tables = false;
   bool xyb_mode = false;
@@ -5,11 +5,13 @@
 
 #include "lib/jpegli/test_utils.h"
 
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
 #include "lib/jpegli/decode.h"
 #include "lib/jpegli/encode.h"
@@ -300,6 +302,9 @@ std::ostream& operator<<(std::ostream& os, const CompressParams& jparams) {
   if (jparams.restart_in_rows > 0) {
     os << "RR" << jparams.restart_in_rows;
   }
+  if (jparams.huffman_sample_rows > 0) {
+    os << "HS" << jparams.huffman_sample_rows;
+  }
   if (jparams.xyb_mode) {
     os << "XYB";
   } else if (jparams.libjpeg_mode) {
@@ -635,6 +640,7 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   } else if (jparams.optimize_coding == 0) {
     cinfo->optimize_coding = FALSE;
   }
+  jpegli_set_huffman_sample_rows(cinfo, jparams.huffman_sample_rows);
   cinfo->raw_data_in = TO_JXL_BOOL(!input.raw_data.empty());
   if (jparams.optimize_coding == 0 && jparams.use_flat_dc_luma_code) {
     JHUFF_TBL* tbl = cinfo->dc_huff_tbl_ptrs[0];
@@ -759,6 +765,27 @@ bool EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   return success;
 }
 
+// Runs the tasks on a few short-lived threads.
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegli_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range,
+                                      uint32_t end_range) {
+  constexpr size_t kNumThreads = 4;
+  if (init(jpegli_opaque, kNumThreads) != 0) return -1;
+  std::atomic<uint32_t> next{start_range};
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread < kNumThreads; ++thread) {
+    threads.emplace_back([&, thread]() {
+      for (uint32_t i = next++; i < end_range; i = next++) {
+        func(jpegli_opaque, i, thread);
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  return 0;
+}
+
 int NumTestScanScripts() { return kNumTestScripts; }
 
 void DumpImage(const TestImage& image, const std::string& fn) {
@@ -6,6 +6,8 @@
 #ifndef LIB_JPEGLI_TEST_UTILS_H_
 #define LIB_JPEGLI_TEST_UTILS_H_
 
+#include <jxl/parallel_runner.h>
+
 #include <cstddef>
 #include <cstdint>
 #include <string>
@@ -104,6 +106,12 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
 bool EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
                       std::vector<uint8_t>* compressed);
 
+// Parallel runner for the tests that do not link against jxl_threads.
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegli_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range, uint32_t end_range);
+
 double DistanceRms(const TestImage& input, const TestImage& output,
                    size_t start_line, size_t num_lines,
                    double* max_diff = nullptr);
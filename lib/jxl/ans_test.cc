@@ -5,6 +5,7 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <vector>
@@ -297,5 +298,93 @@ TEST(ANSTest, TestCheckpointingPrefixLZ77) {
   TestCheckpointing(/*ans=*/false, /*lz77=*/true);
 }
 
+void TestBatchDecoding(HistogramParams::LZ77Method lz77_method) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  std::vector<std::vector<Token>> input_values(1);
+  Rng rng(0);
+  for (size_t i = 0; i < 200; i++) {
+    // Alternate long runs, short repeating patterns and noise.
+    const uint32_t value = rng.UniformU(0, 16);
+    const size_t length = rng.UniformU(1, 3000);
+    for (size_t j = 0; j < length; j++) {
+      switch (i % 3) {
+        case 0:
+          input_values[0].emplace_back(0, value);
+          break;
+        case 1:
+          input_values[0].emplace_back(0, value + j % 3);
+          break;
+        default:
+          input_values[0].emplace_back(0, rng.UniformU(0, 256));
+      }
+    }
+  }
+
+  std::vector<uint8_t> context_map;
+  EntropyEncodingData codes;
+  HistogramParams params;
+  params.lz77_method = lz77_method;
+
+  BitWriter writer{memory_manager};
+  {
+    auto input_values_copy = input_values;
+    JXL_TEST_ASSIGN_OR_DIE(
+        size_t cost, BuildAndEncodeHistograms(
+                         memory_manager, params, 1, input_values_copy, &codes,
+                         &context_map, &writer, LayerType::Header, nullptr));
+    (void)cost;
+    ASSERT_TRUE(WriteTokens(input_values_copy[0], codes, context_map, 0,
+                            &writer, LayerType::Header, nullptr));
+    writer.ZeroPadToByte();
+  }
+
+  BitReader br(writer.GetSpan());
+  Status status = true;
+  {
+    BitReaderScopedCloser bc(br, status);
+
+    std::vector<uint8_t> dec_context_map;
+    ANSCode decoded_codes;
+    ASSERT_TRUE(DecodeHistograms(memory_manager, &br, 1, &decoded_codes,
+                                 &dec_context_map));
+    JXL_TEST_ASSIGN_OR_DIE(ANSSymbolReader reader,
+                           ANSSymbolReader::Create(&decoded_codes, &br));
+    const bool uses_lz77 = reader.UsesLZ77();
+    EXPECT_EQ(lz77_method != HistogramParams::LZ77Method::kNone, uses_lz77);
+
+    // Batches of varying sizes, so that they start and end in the middle of
+    // LZ77 copies.
+    std::vector<uint32_t> decoded(1000);
+    for (size_t i = 0; i < input_values[0].size();) {
+      const size_t count =
+          std::min<size_t>(rng.UniformU(1, 1000), input_values[0].size() - i);
+      if (uses_lz77) {
+        reader.ReadHybridUintClusteredBatch</*uses_lz77=*/true>(
+            dec_context_map[0], &br, decoded.data(), count);
+      } else {
+        reader.ReadHybridUintClusteredBatch</*uses_lz77=*/false>(
+            dec_context_map[0], &br, decoded.data(), count);
+      }
+      for (size_t j = 0; j < count; j++, i++) {
+        ASSERT_EQ(input_values[0][i].value, decoded[j]) << "i = " << i;
+      }
+    }
+    ASSERT_TRUE(reader.CheckANSFinalState());
+  }
+  EXPECT_TRUE(status);
+}
+
+TEST(ANSTest, TestBatchDecoding) {
+  TestBatchDecoding(HistogramParams::LZ77Method::kNone);
+}
+
+TEST(ANSTest, TestBatchDecodingRLE) {
+  TestBatchDecoding(HistogramParams::LZ77Method::kRLE);
+}
+
+TEST(ANSTest, TestBatchDecodingLZ77) {
+  TestBatchDecoding(HistogramParams::LZ77Method::kLZ77);
+}
+
 }  // namespace
 }  // namespace jxl
@@ -17,6 +17,7 @@
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #if JXL_COMPILER_MSVC
 // suppress warnings about the const & applied to function types
 #pragma warning(disable : 4180)
@@ -49,7 +50,8 @@ class ThreadPool {
              const DataFunc& data_func, const char* caller) {
     JXL_ENSURE(begin <= end);
     if (begin == end) return true;
-    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func);
+    JXL_TRACE_EVENT(caller);
+    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func, caller);
     // The runner_ uses the C convention and returns 0 in case of error, so we
     // convert it to a Status.
     if (!runner_) {
@@ -85,8 +87,15 @@ class ThreadPool {
   template <class InitFunc, class DataFunc>
   class RunCallState final {
    public:
-    RunCallState(const InitFunc& init_func, const DataFunc& data_func)
-        : init_func_(init_func), data_func_(data_func) {}
+    RunCallState(const InitFunc& init_func, const DataFunc& data_func,
+                 const char* caller)
+        : init_func_(init_func), data_func_(data_func) {
+#if JXL_ENABLE_TRACE_EVENTS
+      caller_ = caller;
+#else
+      (void)caller;
+#endif
+    }
 
     // JxlParallelRunInit interface.
     static int CallInitFunc(void* jpegxl_opaque, size_t num_threads) {
@@ -107,6 +116,9 @@ class ThreadPool {
       auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
       if (self->has_error_) return;
+#if JXL_ENABLE_TRACE_EVENTS
+      JXL_TRACE_EVENT(self->caller_);
+#endif
       if (!self->data_func_(value, thread_id)) {
         self->has_error_ = true;
       }
@@ -117,6 +129,10 @@ class ThreadPool {
    private:
     const InitFunc& init_func_;
     const DataFunc& data_func_;
+#if JXL_ENABLE_TRACE_EVENTS
+    // Name of the tasks in trace events.
+    const char* caller_;
+#endif
     std::atomic<bool> has_error_{false};
   };
 
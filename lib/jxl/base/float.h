@@ -7,6 +7,7 @@
 #define LIB_JXL_BASE_FLOAT_H_
 
 #include <jxl/types.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -40,6 +41,31 @@ static JXL_INLINE float LoadFloat16(uint16_t bits16) {
   memcpy(&result, &bits32, 4);
   return result;
 }
+
+// Inverse of LoadFloat16, rounding to nearest even.
+static JXL_INLINE uint16_t StoreFloat16(float value) {
+  uint32_t bits32;
+  memcpy(&bits32, &value, 4);
+  const uint32_t sign = (bits32 >> 16) & 0x8000;
+  const uint32_t abs_bits = bits32 & 0x7FFFFFFF;
+  uint32_t bits16;
+  if (abs_bits > 0x7F800000) {
+    bits16 = 0x7E00;  // NaN
+  } else if (abs_bits >= 0x477FF000) {
+    // Everything from 65520 up rounds to infinity.
+    bits16 = 0x7C00;
+  } else if (abs_bits < 0x38800000) {
+    // Subnormal or zero: the mantissa is the value in units of 2^-24.
+    float abs_value;
+    memcpy(&abs_value, &abs_bits, 4);
+    bits16 = static_cast<uint32_t>(nearbyintf(abs_value * 16777216.0f));
+  } else {
+    // Normalized: drop 13 mantissa bits with rounding and rebias the exponent.
+    const uint32_t rounded = abs_bits + 0xFFF + ((abs_bits >> 13) & 1);
+    bits16 = (rounded - 0x38000000) >> 13;
+  }
+  return static_cast<uint16_t>(sign | bits16);
+}
 }  // namespace detail
 
 template <typename SaveFloatAtFn>
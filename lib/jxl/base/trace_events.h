@@ -0,0 +1,165 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_BASE_TRACE_EVENTS_H_
+#define LIB_JXL_BASE_TRACE_EVENTS_H_
+
+// Optional spans of the work of each thread, written in the Chrome trace event
+// format that chrome://tracing and Perfetto open. Compiled out unless
+// JXL_ENABLE_TRACE_EVENTS is 1, and then recorded only between
+// SetTraceEventsEnabled(true) and (false). The spans are process-wide, so
+// encoders and decoders that run at the same time share one trace.
+//
+// Header-only, so that it can be used everywhere data_parallel.h is.
+
+#ifndef JXL_ENABLE_TRACE_EVENTS
+#define JXL_ENABLE_TRACE_EVENTS 0
+#endif
+
+#if JXL_ENABLE_TRACE_EVENTS
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/common.h"
+
+namespace jxl {
+namespace trace_events {
+
+struct Event {
+  // Must outlive the trace, e.g. a string literal.
+  const char* name;
+  int64_t begin_ns;
+  int64_t end_ns;
+};
+
+// Events of one thread; only that thread adds to it.
+struct ThreadBuffer {
+  uint32_t tid;
+  std::mutex mutex;
+  std::vector<Event> events;
+};
+
+class Recorder {
+ public:
+  static Recorder* Get() {
+    // Never destroyed, threads may still record at exit.
+    static Recorder* recorder = new Recorder();
+    return recorder;
+  }
+
+  std::atomic<bool> enabled{false};
+
+  int64_t NowNs() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - origin_)
+        .count();
+  }
+
+  ThreadBuffer* LocalBuffer() {
+    thread_local ThreadBuffer* buffer = NewBuffer();
+    return buffer;
+  }
+
+  // Chrome trace JSON of the events since the last call.
+  std::string TakeJson() {
+    std::string json = "{\"traceEvents\":[";
+    bool first = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<ThreadBuffer>& buffer : buffers_) {
+      std::vector<Event> events;
+      {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        events.swap(buffer->events);
+      }
+      for (const Event& event : events) {
+        char line[256];
+        // The name is a literal from this library, no need to escape it.
+        snprintf(line, sizeof(line),
+                 "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32
+                 ",\"ts\":%.3f,\"dur\":%.3f}",
+                 first ? "" : ",", event.name, buffer->tid,
+                 event.begin_ns * 1e-3, (event.end_ns - event.begin_ns) * 1e-3);
+        json += line;
+        first = false;
+      }
+    }
+    json += "\n]}\n";
+    return json;
+  }
+
+ private:
+  Recorder() : origin_(std::chrono::steady_clock::now()) {}
+
+  ThreadBuffer* NewBuffer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.emplace_back(new ThreadBuffer());
+    buffers_.back()->tid = static_cast<uint32_t>(buffers_.size());
+    return buffers_.back().get();
+  }
+
+  const std::chrono::steady_clock::time_point origin_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+class Span {
+ public:
+  explicit Span(const char* name) : name_(name) {
+    Recorder* recorder = Recorder::Get();
+    if (recorder->enabled.load(std::memory_order_relaxed)) {
+      begin_ns_ = recorder->NowNs();
+    }
+  }
+  ~Span() {
+    if (begin_ns_ < 0) return;
+    Recorder* recorder = Recorder::Get();
+    const int64_t end_ns = recorder->NowNs();
+    ThreadBuffer* buffer = recorder->LocalBuffer();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->events.push_back({name_, begin_ns_, end_ns});
+  }
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+ private:
+  const char* name_;
+  int64_t begin_ns_ = -1;
+};
+
+}  // namespace trace_events
+
+static inline void SetTraceEventsEnabled(bool enabled) {
+  trace_events::Recorder::Get()->enabled.store(enabled,
+                                               std::memory_order_relaxed);
+}
+
+// Returns the recorded spans as Chrome trace JSON and clears them.
+static inline std::string TakeTraceEventsJson() {
+  return trace_events::Recorder::Get()->TakeJson();
+}
+
+}  // namespace jxl
+
+// Records the lifetime of the enclosing scope as a span named `name`.
+#define JXL_TRACE_EVENT(name) \
+  ::jxl::trace_events::Span JXL_JOIN(trace_event_, __LINE__)(name)
+
+#else  // JXL_ENABLE_TRACE_EVENTS
+
+#define JXL_TRACE_EVENT(name) \
+  do {                        \
+  } while (0)
+
+#endif  // JXL_ENABLE_TRACE_EVENTS
+
+#endif  // LIB_JXL_BASE_TRACE_EVENTS_H_
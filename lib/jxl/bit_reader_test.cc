@@ -47,6 +47,23 @@ TEST(BitReaderTest, ExtendsWithZeroes) {
   }
 }
 
+TEST(BitReaderTest, ReadsPastEndWithReadableTail) {
+  std::vector<uint8_t> data(64);
+  for (size_t i = 0; i < data.size(); i++) data[i] = i;
+  for (size_t n_bytes = 0; n_bytes < 32; n_bytes++) {
+    BitReader br(Bytes(data.data(), n_bytes), data.size() - n_bytes);
+    EXPECT_EQ(n_bytes, br.TotalBytes());
+    for (size_t i = 0; i < n_bytes; i++) {
+      ASSERT_EQ(br.ReadFixedBits<8>(), i) << "n_bytes=" << n_bytes;
+    }
+    EXPECT_TRUE(br.AllReadsWithinBounds());
+    // Reading one more byte must be reported, even if it was loaded.
+    br.ReadFixedBits<8>();
+    EXPECT_FALSE(br.AllReadsWithinBounds());
+    EXPECT_TRUE(br.Close());
+  }
+}
+
 struct Symbol {
   uint32_t num_bits;
   uint32_t value;
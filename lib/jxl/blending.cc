@@ -5,8 +5,7 @@
 
 #include "lib/jxl/blending.h"
 
-#include <jxl/memory_manager.h>
-
+#include <algorithm>
 #include <cstddef>
 #include <cstring>
 #include <vector>
@@ -15,7 +14,6 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_patch_dictionary.h"
 #include "lib/jxl/frame_header.h"
-#include "lib/jxl/image.h"
 #include "lib/jxl/image_metadata.h"
 
 namespace jxl {
@@ -39,21 +37,28 @@ bool NeedsBlending(const FrameHeader& frame_header) {
   return true;
 }
 
-Status PerformBlending(
-    JxlMemoryManager* memory_manager, const float* const* bg,
-    const float* const* fg, float* const* out, size_t x0, size_t xsize,
-    const PatchBlending& color_blending, const PatchBlending* ec_blending,
-    const std::vector<ExtraChannelInfo>& extra_channel_info) {
-  bool has_alpha = false;
+namespace {
+
+// Rows of the scratch buffer of PerformBlending(), one of kBlendingChunkSize
+// floats for each channel.
+class BlendingChunk {
+ public:
+  explicit BlendingChunk(float* JXL_RESTRICT scratch) : scratch_(scratch) {}
+  float* Row(size_t c) const { return scratch_ + c * kBlendingChunkSize; }
+
+ private:
+  float* JXL_RESTRICT scratch_;
+};
+
+// Blends at most kBlendingChunkSize pixels into `tmp`, then copies them to
+// `out`, which may be `bg` or `fg`.
+void BlendChunk(const float* const* bg, const float* const* fg,
+                float* const* out, size_t x0, size_t xsize, bool has_alpha,
+                const PatchBlending& color_blending,
+                const PatchBlending* ec_blending,
+                const std::vector<ExtraChannelInfo>& extra_channel_info,
+                const BlendingChunk& tmp) {
   size_t num_ec = extra_channel_info.size();
-  for (size_t i = 0; i < num_ec; i++) {
-    if (extra_channel_info[i].type == jxl::ExtraChannel::kAlpha) {
-      has_alpha = true;
-      break;
-    }
-  }
-  JXL_ASSIGN_OR_RETURN(ImageF tmp,
-                       ImageF::Create(memory_manager, xsize, 3 + num_ec));
   // Blend extra channels first so that we use the pre-blending alpha.
   for (size_t i = 0; i < num_ec; i++) {
     switch (ec_blending[i].mode) {
@@ -186,6 +191,30 @@ Status PerformBlending(
   for (size_t i = 0; i < 3 + num_ec; i++) {
     if (xsize != 0) memcpy(out[i] + x0, tmp.Row(i), xsize * sizeof(**out));
   }
+}
+
+}  // namespace
+
+Status PerformBlending(const float* const* bg, const float* const* fg,
+                       float* const* out, size_t x0, size_t xsize,
+                       const PatchBlending& color_blending,
+                       const PatchBlending* ec_blending,
+                       const std::vector<ExtraChannelInfo>& extra_channel_info,
+                       float* JXL_RESTRICT scratch) {
+  JXL_ENSURE(scratch != nullptr);
+  bool has_alpha = false;
+  size_t num_ec = extra_channel_info.size();
+  for (size_t i = 0; i < num_ec; i++) {
+    if (extra_channel_info[i].type == jxl::ExtraChannel::kAlpha) {
+      has_alpha = true;
+      break;
+    }
+  }
+  const BlendingChunk tmp(scratch);
+  for (size_t x = 0; x < xsize; x += kBlendingChunkSize) {
+    BlendChunk(bg, fg, out, x0 + x, std::min(kBlendingChunkSize, xsize - x),
+               has_alpha, color_blending, ec_blending, extra_channel_info, tmp);
+  }
   return true;
 }
 
@@ -6,11 +6,10 @@
 #ifndef LIB_JXL_BLENDING_H_
 #define LIB_JXL_BLENDING_H_
 
-#include <jxl/memory_manager.h>
-
 #include <cstddef>
 #include <vector>
 
+#include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_patch_dictionary.h"
 #include "lib/jxl/frame_header.h"
@@ -20,11 +19,19 @@ namespace jxl {
 
 bool NeedsBlending(const FrameHeader& frame_header);
 
-Status PerformBlending(JxlMemoryManager* memory_manager, const float* const* bg,
-                       const float* const* fg, float* const* out, size_t x0,
-                       size_t xsize, const PatchBlending& color_blending,
+// Number of pixels that PerformBlending() blends at a time.
+constexpr size_t kBlendingChunkSize = 256;
+
+// Blends `xsize` pixels of `fg` over `bg`, starting at `x0`, into `out`, which
+// may be `bg` or `fg`. `scratch` must hold kBlendingChunkSize floats for each
+// channel; callers keep one per thread, so that blending a row does not
+// allocate.
+Status PerformBlending(const float* const* bg, const float* const* fg,
+                       float* const* out, size_t x0, size_t xsize,
+                       const PatchBlending& color_blending,
                        const PatchBlending* ec_blending,
-                       const std::vector<ExtraChannelInfo>& extra_channel_info);
+                       const std::vector<ExtraChannelInfo>& extra_channel_info,
+                       float* JXL_RESTRICT scratch);
 
 }  // namespace jxl
 
@@ -39,6 +39,8 @@
 #define HWY_TARGET_INCLUDE "lib/jxl/butteraugli/butteraugli.cc"
 #include <hwy/foreach_target.h>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/fast_math-inl.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
@@ -84,7 +86,8 @@ std::vector<float> ComputeKernel(float sigma) {
 }
 
 void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
-                          const size_t x, float* BUTTERAUGLI_RESTRICT row_out) {
+                          const size_t x, const size_t y0, const size_t y1,
+                          float* BUTTERAUGLI_RESTRICT row_out) {
   const size_t offset = kernel.size() / 2;
   int minx = x < offset ? 0 : x - offset;
   int maxx = std::min<int>(in.xsize() - 1, x + offset);
@@ -93,7 +96,7 @@ void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
     weight += kernel[j - x + offset];
   }
   float scale = 1.0f / weight;
-  for (size_t y = 0; y < in.ysize(); ++y) {
+  for (size_t y = y0; y < y1; ++y) {
     const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
     float sum = 0.0f;
     for (int j = minx; j <= maxx; ++j) {
@@ -106,7 +109,8 @@ void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
 // Computes a horizontal convolution and transposes the result.
 Status ConvolutionWithTranspose(const ImageF& in,
                                 const std::vector<float>& kernel,
-                                ImageF* BUTTERAUGLI_RESTRICT out) {
+                                ImageF* BUTTERAUGLI_RESTRICT out,
+                                ThreadPool* pool) {
   JXL_ENSURE(out->xsize() == in.ysize());
   JXL_ENSURE(out->ysize() == in.xsize());
   const size_t len = kernel.size();
@@ -123,100 +127,116 @@ Status ConvolutionWithTranspose(const ImageF& in,
     scaled_kernel[i] = kernel[i] * scale_no_border;
   }
 
-  // middle
-  switch (len) {
-    case 7: {
-      const float sk0 = scaled_kernel[0];
-      const float sk1 = scaled_kernel[1];
-      const float sk2 = scaled_kernel[2];
-      const float sk3 = scaled_kernel[3];
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          const float sum0 = (row_in[0] + row_in[6]) * sk0;
-          const float sum1 = (row_in[1] + row_in[5]) * sk1;
-          const float sum2 = (row_in[2] + row_in[4]) * sk2;
-          const float sum = (row_in[3]) * sk3 + sum0 + sum1 + sum2;
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum;
+  // Each task convolves a band of input rows, i.e. writes a band of columns
+  // of the output, so the result does not depend on the number of threads.
+  constexpr size_t kRowsPerTask = 64;
+  const size_t num_tasks = DivCeil(in.ysize(), kRowsPerTask);
+  const auto convolve_rows = [&](const uint32_t task,
+                                 size_t /*thread*/) -> Status {
+    const size_t y0 = task * kRowsPerTask;
+    const size_t y1 = std::min(in.ysize(), y0 + kRowsPerTask);
+    // middle
+    switch (len) {
+      case 7: {
+        const float sk0 = scaled_kernel[0];
+        const float sk1 = scaled_kernel[1];
+        const float sk2 = scaled_kernel[2];
+        const float sk3 = scaled_kernel[3];
+        for (size_t y = y0; y < y1; ++y) {
+          const float* BUTTERAUGLI_RESTRICT row_in =
+              in.Row(y) + border1 - offset;
+          for (size_t x = border1; x < border2; ++x, ++row_in) {
+            const float sum0 = (row_in[0] + row_in[6]) * sk0;
+            const float sum1 = (row_in[1] + row_in[5]) * sk1;
+            const float sum2 = (row_in[2] + row_in[4]) * sk2;
+            const float sum = (row_in[3]) * sk3 + sum0 + sum1 + sum2;
+            float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
+            row_out[y] = sum;
+          }
         }
-      }
-    } break;
-    case 13: {
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          float sum0 = (row_in[0] + row_in[12]) * scaled_kernel[0];
-          float sum1 = (row_in[1] + row_in[11]) * scaled_kernel[1];
-          float sum2 = (row_in[2] + row_in[10]) * scaled_kernel[2];
-          float sum3 = (row_in[3] + row_in[9]) * scaled_kernel[3];
-          sum0 += (row_in[4] + row_in[8]) * scaled_kernel[4];
-          sum1 += (row_in[5] + row_in[7]) * scaled_kernel[5];
-          const float sum = (row_in[6]) * scaled_kernel[6];
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
+      } break;
+      case 13: {
+        for (size_t y = y0; y < y1; ++y) {
+          const float* BUTTERAUGLI_RESTRICT row_in =
+              in.Row(y) + border1 - offset;
+          for (size_t x = border1; x < border2; ++x, ++row_in) {
+            float sum0 = (row_in[0] + row_in[12]) * scaled_kernel[0];
+            float sum1 = (row_in[1] + row_in[11]) * scaled_kernel[1];
+            float sum2 = (row_in[2] + row_in[10]) * scaled_kernel[2];
+            float sum3 = (row_in[3] + row_in[9]) * scaled_kernel[3];
+            sum0 += (row_in[4] + row_in[8]) * scaled_kernel[4];
+            sum1 += (row_in[5] + row_in[7]) * scaled_kernel[5];
+            const float sum = (row_in[6]) * scaled_kernel[6];
+            float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
+            row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
+          }
         }
+        break;
       }
-      break;
-    }
-    case 15: {
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          float sum0 = (row_in[0] + row_in[14]) * scaled_kernel[0];
-          float sum1 = (row_in[1] + row_in[13]) * scaled_kernel[1];
-          float sum2 = (row_in[2] + row_in[12]) * scaled_kernel[2];
-          float sum3 = (row_in[3] + row_in[11]) * scaled_kernel[3];
-          sum0 += (row_in[4] + row_in[10]) * scaled_kernel[4];
-          sum1 += (row_in[5] + row_in[9]) * scaled_kernel[5];
-          sum2 += (row_in[6] + row_in[8]) * scaled_kernel[6];
-          const float sum = (row_in[7]) * scaled_kernel[7];
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
+      case 15: {
+        for (size_t y = y0; y < y1; ++y) {
+          const float* BUTTERAUGLI_RESTRICT row_in =
+              in.Row(y) + border1 - offset;
+          for (size_t x = border1; x < border2; ++x, ++row_in) {
+            float sum0 = (row_in[0] + row_in[14]) * scaled_kernel[0];
+            float sum1 = (row_in[1] + row_in[13]) * scaled_kernel[1];
+            float sum2 = (row_in[2] + row_in[12]) * scaled_kernel[2];
+            float sum3 = (row_in[3] + row_in[11]) * scaled_kernel[3];
+            sum0 += (row_in[4] + row_in[10]) * scaled_kernel[4];
+            sum1 += (row_in[5] + row_in[9]) * scaled_kernel[5];
+            sum2 += (row_in[6] + row_in[8]) * scaled_kernel[6];
+            const float sum = (row_in[7]) * scaled_kernel[7];
+            float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
+            row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
+          }
         }
+        break;
       }
-      break;
-    }
-    case 33: {
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          float sum0 = (row_in[0] + row_in[32]) * scaled_kernel[0];
-          float sum1 = (row_in[1] + row_in[31]) * scaled_kernel[1];
-          float sum2 = (row_in[2] + row_in[30]) * scaled_kernel[2];
-          float sum3 = (row_in[3] + row_in[29]) * scaled_kernel[3];
-          sum0 += (row_in[4] + row_in[28]) * scaled_kernel[4];
-          sum1 += (row_in[5] + row_in[27]) * scaled_kernel[5];
-          sum2 += (row_in[6] + row_in[26]) * scaled_kernel[6];
-          sum3 += (row_in[7] + row_in[25]) * scaled_kernel[7];
-          sum0 += (row_in[8] + row_in[24]) * scaled_kernel[8];
-          sum1 += (row_in[9] + row_in[23]) * scaled_kernel[9];
-          sum2 += (row_in[10] + row_in[22]) * scaled_kernel[10];
-          sum3 += (row_in[11] + row_in[21]) * scaled_kernel[11];
-          sum0 += (row_in[12] + row_in[20]) * scaled_kernel[12];
-          sum1 += (row_in[13] + row_in[19]) * scaled_kernel[13];
-          sum2 += (row_in[14] + row_in[18]) * scaled_kernel[14];
-          sum3 += (row_in[15] + row_in[17]) * scaled_kernel[15];
-          const float sum = (row_in[16]) * scaled_kernel[16];
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
+      case 33: {
+        for (size_t y = y0; y < y1; ++y) {
+          const float* BUTTERAUGLI_RESTRICT row_in =
+              in.Row(y) + border1 - offset;
+          for (size_t x = border1; x < border2; ++x, ++row_in) {
+            float sum0 = (row_in[0] + row_in[32]) * scaled_kernel[0];
+            float sum1 = (row_in[1] + row_in[31]) * scaled_kernel[1];
+            float sum2 = (row_in[2] + row_in[30]) * scaled_kernel[2];
+            float sum3 = (row_in[3] + row_in[29]) * scaled_kernel[3];
+            sum0 += (row_in[4] + row_in[28]) * scaled_kernel[4];
+            sum1 += (row_in[5] + row_in[27]) * scaled_kernel[5];
+            sum2 += (row_in[6] + row_in[26]) * scaled_kernel[6];
+            sum3 += (row_in[7] + row_in[25]) * scaled_kernel[7];
+            sum0 += (row_in[8] + row_in[24]) * scaled_kernel[8];
+            sum1 += (row_in[9] + row_in[23]) * scaled_kernel[9];
+            sum2 += (row_in[10] + row_in[22]) * scaled_kernel[10];
+            sum3 += (row_in[11] + row_in[21]) * scaled_kernel[11];
+            sum0 += (row_in[12] + row_in[20]) * scaled_kernel[12];
+            sum1 += (row_in[13] + row_in[19]) * scaled_kernel[13];
+            sum2 += (row_in[14] + row_in[18]) * scaled_kernel[14];
+            sum3 += (row_in[15] + row_in[17]) * scaled_kernel[15];
+            const float sum = (row_in[16]) * scaled_kernel[16];
+            float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
+            row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
+          }
         }
+        break;
       }
-      break;
+      default:
+        return JXL_UNREACHABLE("kernel size %d not implemented",
+                               static_cast<int>(len));
+    }
+    // left border
+    for (size_t x = 0; x < border1; ++x) {
+      ConvolveBorderColumn(in, kernel, x, y0, y1, out->Row(x));
     }
-    default:
-      return JXL_UNREACHABLE("kernel size %d not implemented",
-                             static_cast<int>(len));
-  }
-  // left border
-  for (size_t x = 0; x < border1; ++x) {
-    ConvolveBorderColumn(in, kernel, x, out->Row(x));
-  }
 
-  // right border
-  for (size_t x = border2; x < in.xsize(); ++x) {
-    ConvolveBorderColumn(in, kernel, x, out->Row(x));
-  }
+    // right border
+    for (size_t x = border2; x < in.xsize(); ++x) {
+      ConvolveBorderColumn(in, kernel, x, y0, y1, out->Row(x));
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_tasks, ThreadPool::NoInit,
+                                convolve_rows, "ButteraugliConvolve"));
   return true;
 }
 
@@ -231,7 +251,7 @@ Status ConvolutionWithTranspose(const ImageF& in,
 // optionally use gauss_blur followed by fixup of the borders for large images,
 // or fall back to the previous truncated FIR followed by a transpose.
 Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
-            BlurTemp* temp, ImageF* out) {
+            BlurTemp* temp, ImageF* out, ThreadPool* pool) {
   std::vector<float> kernel = ComputeKernel(sigma);
   // Separable5 does an in-place convolution, so this fast path is not safe if
   // in aliases out.
@@ -248,15 +268,14 @@ Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
         {HWY_REP4(w0), HWY_REP4(w1), HWY_REP4(w2)},
         {HWY_REP4(w0), HWY_REP4(w1), HWY_REP4(w2)},
     };
-    JXL_RETURN_IF_ERROR(
-        Separable5(in, Rect(in), weights, /*pool=*/nullptr, out));
+    JXL_RETURN_IF_ERROR(Separable5(in, Rect(in), weights, pool, out));
     return true;
   }
 
   ImageF* temp_t;
   JXL_RETURN_IF_ERROR(temp->GetTransposed(in, &temp_t));
-  JXL_RETURN_IF_ERROR(ConvolutionWithTranspose(in, kernel, temp_t));
-  JXL_RETURN_IF_ERROR(ConvolutionWithTranspose(*temp_t, kernel, out));
+  JXL_RETURN_IF_ERROR(ConvolutionWithTranspose(in, kernel, temp_t, pool));
+  JXL_RETURN_IF_ERROR(ConvolutionWithTranspose(*temp_t, kernel, out, pool));
   return true;
 }
 
@@ -399,12 +418,13 @@ void Subtract(const ImageF& a, const ImageF& b, ImageF* c) {
 }
 
 Status SeparateLFAndMF(const ButteraugliParams& params, const Image3F& xyb,
-                       Image3F* lf, Image3F* mf, BlurTemp* blur_temp) {
+                       Image3F* lf, Image3F* mf, BlurTemp* blur_temp,
+                       ThreadPool* pool) {
   static const double kSigmaLf = 7.15593339443;
   for (int i = 0; i < 3; ++i) {
     // Extract lf ...
     JXL_RETURN_IF_ERROR(
-        Blur(xyb.Plane(i), kSigmaLf, params, blur_temp, &lf->Plane(i)));
+        Blur(xyb.Plane(i), kSigmaLf, params, blur_temp, &lf->Plane(i), pool));
     // ... and keep everything else in mf.
     Subtract(xyb.Plane(i), lf->Plane(i), &mf->Plane(i));
   }
@@ -413,7 +433,7 @@ Status SeparateLFAndMF(const ButteraugliParams& params, const Image3F& xyb,
 }
 
 Status SeparateMFAndHF(const ButteraugliParams& params, Image3F* mf, ImageF* hf,
-                       BlurTemp* blur_temp) {
+                       BlurTemp* blur_temp, ThreadPool* pool) {
   const HWY_FULL(float) d;
   static const double kSigmaHf = 3.22489901262;
   const size_t xsize = mf->xsize();
@@ -424,7 +444,7 @@ Status SeparateMFAndHF(const ButteraugliParams& params, Image3F* mf, ImageF* hf,
   for (int i = 0; i < 3; ++i) {
     if (i == 2) {
       JXL_RETURN_IF_ERROR(
-          Blur(mf->Plane(i), kSigmaHf, params, blur_temp, &mf->Plane(i)));
+          Blur(mf->Plane(i), kSigmaHf, params, blur_temp, &mf->Plane(i), pool));
       break;
     }
     for (size_t y = 0; y < ysize; ++y) {
@@ -435,7 +455,7 @@ Status SeparateMFAndHF(const ButteraugliParams& params, Image3F* mf, ImageF* hf,
       }
     }
     JXL_RETURN_IF_ERROR(
-        Blur(mf->Plane(i), kSigmaHf, params, blur_temp, &mf->Plane(i)));
+        Blur(mf->Plane(i), kSigmaHf, params, blur_temp, &mf->Plane(i), pool));
     static const double kRemoveMfRange = 0.29;
     static const double kAddMfRange = 0.1;
     if (i == 0) {
@@ -471,7 +491,7 @@ Status SeparateMFAndHF(const ButteraugliParams& params, Image3F* mf, ImageF* hf,
 }
 
 Status SeparateHFAndUHF(const ButteraugliParams& params, ImageF* hf,
-                        ImageF* uhf, BlurTemp* blur_temp) {
+                        ImageF* uhf, BlurTemp* blur_temp, ThreadPool* pool) {
   const HWY_FULL(float) d;
   const size_t xsize = hf[0].xsize();
   const size_t ysize = hf[0].ysize();
@@ -488,7 +508,8 @@ Status SeparateHFAndUHF(const ButteraugliParams& params, ImageF* hf,
         row_uhf[x] = row_hf[x];
       }
     }
-    JXL_RETURN_IF_ERROR(Blur(hf[i], kSigmaUhf, params, blur_temp, &hf[i]));
+    JXL_RETURN_IF_ERROR(
+        Blur(hf[i], kSigmaUhf, params, blur_temp, &hf[i], pool));
     static const double kRemoveHfRange = 1.5;
     static const double kAddHfRange = 0.132;
     static const double kRemoveUhfRange = 0.04;
@@ -541,16 +562,19 @@ void DeallocateHFAndUHF(ImageF* hf, ImageF* uhf) {
 
 Status SeparateFrequencies(size_t xsize, size_t ysize,
                            const ButteraugliParams& params, BlurTemp* blur_temp,
-                           const Image3F& xyb, PsychoImage& ps) {
+                           const Image3F& xyb, PsychoImage& ps,
+                           ThreadPool* pool) {
   JxlMemoryManager* memory_manager = xyb.memory_manager();
   JXL_ASSIGN_OR_RETURN(
       ps.lf, Image3F::Create(memory_manager, xyb.xsize(), xyb.ysize()));
   JXL_ASSIGN_OR_RETURN(
       ps.mf, Image3F::Create(memory_manager, xyb.xsize(), xyb.ysize()));
-  JXL_RETURN_IF_ERROR(SeparateLFAndMF(params, xyb, &ps.lf, &ps.mf, blur_temp));
-  JXL_RETURN_IF_ERROR(SeparateMFAndHF(params, &ps.mf, &ps.hf[0], blur_temp));
   JXL_RETURN_IF_ERROR(
-      SeparateHFAndUHF(params, &ps.hf[0], &ps.uhf[0], blur_temp));
+      SeparateLFAndMF(params, xyb, &ps.lf, &ps.mf, blur_temp, pool));
+  JXL_RETURN_IF_ERROR(
+      SeparateMFAndHF(params, &ps.mf, &ps.hf[0], blur_temp, pool));
+  JXL_RETURN_IF_ERROR(
+      SeparateHFAndUHF(params, &ps.hf[0], &ps.uhf[0], blur_temp, pool));
   return true;
 }
 
@@ -987,7 +1011,8 @@ static Status MaltaDiffMapT(const Tag tag, const ImageF& lum0,
                             const double w_0lt1, const double norm1,
                             const double len, const double mulli,
                             ImageF* HWY_RESTRICT diffs,
-                            ImageF* HWY_RESTRICT block_diff_ac) {
+                            ImageF* HWY_RESTRICT block_diff_ac,
+                            ThreadPool* pool) {
   JXL_ENSURE(SameSize(lum0, lum1) && SameSize(lum0, *diffs));
   const size_t xsize_ = lum0.xsize();
   const size_t ysize_ = lum0.ysize();
@@ -1000,7 +1025,10 @@ static Status MaltaDiffMapT(const Tag tag, const ImageF& lum0,
   const float norm2_0gt1 = w_pre0gt1 * norm1;
   const float norm2_0lt1 = w_pre0lt1 * norm1;
 
-  for (size_t y = 0; y < ysize_; ++y) {
+  // Every row of diffs is computed before the filter reads it, and each row
+  // of block_diff_ac is only updated by one task.
+  const auto compute_diffs = [&](const uint32_t y,
+                                 size_t /*thread*/) -> Status {
     const float* HWY_RESTRICT row0 = lum0.ConstRow(y);
     const float* HWY_RESTRICT row1 = lum1.ConstRow(y);
     float* HWY_RESTRICT row_diffs = diffs->Row(y);
@@ -1037,25 +1065,28 @@ static Status MaltaDiffMapT(const Tag tag, const ImageF& lum0,
         }
       }
     }
-  }
-
-  size_t y0 = 0;
-  // Top
-  for (; y0 < 4; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    for (size_t x0 = 0; x0 < xsize_; ++x0) {
-      row_diff[x0] += PaddedMaltaUnit<Tag>(*diffs, x0, y0);
-    }
-  }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize_, ThreadPool::NoInit,
+                                compute_diffs, "ButteraugliMaltaDiffs"));
 
   const HWY_FULL(float) df;
   const size_t aligned_x = std::max(static_cast<size_t>(4), Lanes(df));
   const intptr_t stride = diffs->PixelsPerRow();
 
-  // Middle
-  for (; y0 < ysize_ - 4; ++y0) {
-    const float* BUTTERAUGLI_RESTRICT row_in = diffs->ConstRow(y0);
+  const auto filter_row = [&](const uint32_t y0,
+                              size_t /*thread*/) -> Status {
     float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
+    // Top and bottom
+    if (y0 < 4 || y0 >= ysize_ - 4) {
+      for (size_t x0 = 0; x0 < xsize_; ++x0) {
+        row_diff[x0] += PaddedMaltaUnit<Tag>(*diffs, x0, y0);
+      }
+      return true;
+    }
+
+    // Middle
+    const float* BUTTERAUGLI_RESTRICT row_in = diffs->ConstRow(y0);
     size_t x0 = 0;
     for (; x0 < aligned_x; ++x0) {
       row_diff[x0] += PaddedMaltaUnit<Tag>(*diffs, x0, y0);
@@ -1069,15 +1100,10 @@ static Status MaltaDiffMapT(const Tag tag, const ImageF& lum0,
     for (; x0 < xsize_; ++x0) {
       row_diff[x0] += PaddedMaltaUnit<Tag>(*diffs, x0, y0);
     }
-  }
-
-  // Bottom
-  for (; y0 < ysize_; ++y0) {
-    float* BUTTERAUGLI_RESTRICT row_diff = block_diff_ac->Row(y0);
-    for (size_t x0 = 0; x0 < xsize_; ++x0) {
-      row_diff[x0] += PaddedMaltaUnit<Tag>(*diffs, x0, y0);
-    }
-  }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize_, ThreadPool::NoInit,
+                                filter_row, "ButteraugliMalta"));
   return true;
 }
 
@@ -1085,22 +1111,24 @@ static Status MaltaDiffMapT(const Tag tag, const ImageF& lum0,
 Status MaltaDiffMap(const ImageF& lum0, const ImageF& lum1, const double w_0gt1,
                     const double w_0lt1, const double norm1,
                     ImageF* HWY_RESTRICT diffs,
-                    ImageF* HWY_RESTRICT block_diff_ac) {
+                    ImageF* HWY_RESTRICT block_diff_ac, ThreadPool* pool) {
   const double len = 3.75;
   static const double mulli = 0.39905817637;
   JXL_RETURN_IF_ERROR(MaltaDiffMapT(MaltaTag(), lum0, lum1, w_0gt1, w_0lt1,
-                                    norm1, len, mulli, diffs, block_diff_ac));
+                                    norm1, len, mulli, diffs, block_diff_ac,
+                                    pool));
   return true;
 }
 
 Status MaltaDiffMapLF(const ImageF& lum0, const ImageF& lum1,
                       const double w_0gt1, const double w_0lt1,
                       const double norm1, ImageF* HWY_RESTRICT diffs,
-                      ImageF* HWY_RESTRICT block_diff_ac) {
+                      ImageF* HWY_RESTRICT block_diff_ac, ThreadPool* pool) {
   const double len = 3.75;
   static const double mulli = 0.611612573796;
   JXL_RETURN_IF_ERROR(MaltaDiffMapT(MaltaTagLF(), lum0, lum1, w_0gt1, w_0lt1,
-                                    norm1, len, mulli, diffs, block_diff_ac));
+                                    norm1, len, mulli, diffs, block_diff_ac,
+                                    pool));
   return true;
 }
 
@@ -1219,7 +1247,7 @@ void FuzzyErosion(const ImageF& from, ImageF* to) {
 Status Mask(const ImageF& mask0, const ImageF& mask1,
             const ButteraugliParams& params, BlurTemp* blur_temp,
             ImageF* BUTTERAUGLI_RESTRICT mask,
-            ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
+            ImageF* BUTTERAUGLI_RESTRICT diff_ac, ThreadPool* pool) {
   const size_t xsize = mask0.xsize();
   const size_t ysize = mask0.ysize();
   JxlMemoryManager* memory_manager = mask0.memory_manager();
@@ -1237,9 +1265,9 @@ Status Mask(const ImageF& mask0, const ImageF& mask1,
                        ImageF::Create(memory_manager, xsize, ysize));
   DiffPrecompute(mask0, kMul, kBias, &diff0);
   DiffPrecompute(mask1, kMul, kBias, &diff1);
-  JXL_RETURN_IF_ERROR(Blur(diff0, kRadius, params, blur_temp, &blurred0));
+  JXL_RETURN_IF_ERROR(Blur(diff0, kRadius, params, blur_temp, &blurred0, pool));
   FuzzyErosion(blurred0, &diff0);
-  JXL_RETURN_IF_ERROR(Blur(diff1, kRadius, params, blur_temp, &blurred1));
+  JXL_RETURN_IF_ERROR(Blur(diff1, kRadius, params, blur_temp, &blurred1, pool));
   for (size_t y = 0; y < ysize; ++y) {
     for (size_t x = 0; x < xsize; ++x) {
       mask->Row(y)[x] = diff0.Row(y)[x];
@@ -1258,7 +1286,7 @@ Status MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
                        const size_t xsize, const size_t ysize,
                        const ButteraugliParams& params, BlurTemp* blur_temp,
                        ImageF* BUTTERAUGLI_RESTRICT mask,
-                       ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
+                       ImageF* BUTTERAUGLI_RESTRICT diff_ac, ThreadPool* pool) {
   JxlMemoryManager* memory_manager = pi0.hf[0].memory_manager();
   JXL_ASSIGN_OR_RETURN(ImageF mask0,
                        ImageF::Create(memory_manager, xsize, ysize));
@@ -1266,7 +1294,8 @@ Status MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
                        ImageF::Create(memory_manager, xsize, ysize));
   CombineChannelsForMasking(&pi0.hf[0], &pi0.uhf[0], &mask0);
   CombineChannelsForMasking(&pi1.hf[0], &pi1.uhf[0], &mask1);
-  JXL_RETURN_IF_ERROR(Mask(mask0, mask1, params, blur_temp, mask, diff_ac));
+  JXL_RETURN_IF_ERROR(
+      Mask(mask0, mask1, params, blur_temp, mask, diff_ac, pool));
   return true;
 }
 
@@ -1471,15 +1500,16 @@ BUTTERAUGLI_INLINE void OpsinAbsorbance(const DF df, const V& in0, const V& in1,
 
 // `blurred` is a temporary image used inside this function and not returned.
 Status OpsinDynamicsImage(const Image3F& rgb, const ButteraugliParams& params,
-                          Image3F* blurred, BlurTemp* blur_temp, Image3F* xyb) {
+                          Image3F* blurred, BlurTemp* blur_temp, Image3F* xyb,
+                          ThreadPool* pool) {
   JXL_ENSURE(blurred != nullptr);
   const double kSigma = 1.2;
   JXL_RETURN_IF_ERROR(
-      Blur(rgb.Plane(0), kSigma, params, blur_temp, &blurred->Plane(0)));
+      Blur(rgb.Plane(0), kSigma, params, blur_temp, &blurred->Plane(0), pool));
   JXL_RETURN_IF_ERROR(
-      Blur(rgb.Plane(1), kSigma, params, blur_temp, &blurred->Plane(1)));
+      Blur(rgb.Plane(1), kSigma, params, blur_temp, &blurred->Plane(1), pool));
   JXL_RETURN_IF_ERROR(
-      Blur(rgb.Plane(2), kSigma, params, blur_temp, &blurred->Plane(2)));
+      Blur(rgb.Plane(2), kSigma, params, blur_temp, &blurred->Plane(2), pool));
   const HWY_FULL(float) df;
   const auto intensity_target_multiplier = Set(df, params.intensity_target);
   for (size_t y = 0; y < rgb.ysize(); ++y) {
@@ -1546,7 +1576,7 @@ Status OpsinDynamicsImage(const Image3F& rgb, const ButteraugliParams& params,
 
 Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
                                  const ButteraugliParams& params,
-                                 ImageF& diffmap) {
+                                 ImageF& diffmap, ThreadPool* pool) {
   // image0 and image1 are in linear sRGB color space
   const size_t xsize = image0.xsize();
   const size_t ysize = image0.ysize();
@@ -1557,9 +1587,9 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
     JXL_ASSIGN_OR_RETURN(Image3F temp,
                          Image3F::Create(memory_manager, xsize, ysize));
     JXL_RETURN_IF_ERROR(
-        OpsinDynamicsImage(image0, params, &temp, &blur_temp, &image0));
+        OpsinDynamicsImage(image0, params, &temp, &blur_temp, &image0, pool));
     JXL_RETURN_IF_ERROR(
-        OpsinDynamicsImage(image1, params, &temp, &blur_temp, &image1));
+        OpsinDynamicsImage(image1, params, &temp, &blur_temp, &image1, pool));
   }
   // image0 and image1 are in XYB color space
   JXL_ASSIGN_OR_RETURN(ImageF block_diff_dc,
@@ -1573,9 +1603,9 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
     JXL_ASSIGN_OR_RETURN(Image3F lf1,
                          Image3F::Create(memory_manager, xsize, ysize));
     JXL_RETURN_IF_ERROR(
-        SeparateLFAndMF(params, image0, &lf0, &image0, &blur_temp));
+        SeparateLFAndMF(params, image0, &lf0, &image0, &blur_temp, pool));
     JXL_RETURN_IF_ERROR(
-        SeparateLFAndMF(params, image1, &lf1, &image1, &blur_temp));
+        SeparateLFAndMF(params, image1, &lf1, &image1, &blur_temp, pool));
     for (size_t c = 0; c < 3; ++c) {
       L2Diff(lf0.Plane(c), lf1.Plane(c), wmul[6 + c], &block_diff_dc);
     }
@@ -1583,8 +1613,10 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
   // image0 and image1 are MF residuals (before blurring) in XYB color space
   ImageF hf0[2];
   ImageF hf1[2];
-  JXL_RETURN_IF_ERROR(SeparateMFAndHF(params, &image0, &hf0[0], &blur_temp));
-  JXL_RETURN_IF_ERROR(SeparateMFAndHF(params, &image1, &hf1[0], &blur_temp));
+  JXL_RETURN_IF_ERROR(
+      SeparateMFAndHF(params, &image0, &hf0[0], &blur_temp, pool));
+  JXL_RETURN_IF_ERROR(
+      SeparateMFAndHF(params, &image1, &hf1[0], &blur_temp, pool));
   // image0 and image1 are MF-images in XYB color space
 
   JXL_ASSIGN_OR_RETURN(ImageF block_diff_ac,
@@ -1596,10 +1628,10 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
                          ImageF::Create(memory_manager, xsize, ysize));
     JXL_RETURN_IF_ERROR(MaltaDiffMapLF(image0.Plane(1), image1.Plane(1),
                                        wMfMalta, wMfMalta, norm1Mf, &diffs,
-                                       &block_diff_ac));
+                                       &block_diff_ac, pool));
     JXL_RETURN_IF_ERROR(MaltaDiffMapLF(image0.Plane(0), image1.Plane(0),
                                        wMfMaltaX, wMfMaltaX, norm1MfX, &diffs,
-                                       &block_diff_ac));
+                                       &block_diff_ac, pool));
   }
   for (size_t c = 0; c < 3; ++c) {
     L2Diff(image0.Plane(c), image1.Plane(c), wmul[3 + c], &block_diff_ac);
@@ -1611,8 +1643,10 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
 
   ImageF uhf0[2];
   ImageF uhf1[2];
-  JXL_RETURN_IF_ERROR(SeparateHFAndUHF(params, &hf0[0], &uhf0[0], &blur_temp));
-  JXL_RETURN_IF_ERROR(SeparateHFAndUHF(params, &hf1[0], &uhf1[0], &blur_temp));
+  JXL_RETURN_IF_ERROR(
+      SeparateHFAndUHF(params, &hf0[0], &uhf0[0], &blur_temp, pool));
+  JXL_RETURN_IF_ERROR(
+      SeparateHFAndUHF(params, &hf1[0], &uhf1[0], &blur_temp, pool));
 
   // continue accumulating ac diff image from HF and UHF images
   const float hf_asymmetry = params.hf_asymmetry;
@@ -1621,16 +1655,18 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
                          ImageF::Create(memory_manager, xsize, ysize));
     JXL_RETURN_IF_ERROR(MaltaDiffMap(uhf0[1], uhf1[1], wUhfMalta * hf_asymmetry,
                                      wUhfMalta / hf_asymmetry, norm1Uhf, &diffs,
-                                     &block_diff_ac));
+                                     &block_diff_ac, pool));
     JXL_RETURN_IF_ERROR(MaltaDiffMap(
         uhf0[0], uhf1[0], wUhfMaltaX * hf_asymmetry, wUhfMaltaX / hf_asymmetry,
-        norm1UhfX, &diffs, &block_diff_ac));
+        norm1UhfX, &diffs, &block_diff_ac, pool));
     JXL_RETURN_IF_ERROR(MaltaDiffMapLF(
         hf0[1], hf1[1], wHfMalta * std::sqrt(hf_asymmetry),
-        wHfMalta / std::sqrt(hf_asymmetry), norm1Hf, &diffs, &block_diff_ac));
+        wHfMalta / std::sqrt(hf_asymmetry), norm1Hf, &diffs, &block_diff_ac,
+        pool));
     JXL_RETURN_IF_ERROR(MaltaDiffMapLF(
         hf0[0], hf1[0], wHfMaltaX * std::sqrt(hf_asymmetry),
-        wHfMaltaX / std::sqrt(hf_asymmetry), norm1HfX, &diffs, &block_diff_ac));
+        wHfMaltaX / std::sqrt(hf_asymmetry), norm1HfX, &diffs, &block_diff_ac,
+        pool));
   }
   for (size_t c = 0; c < 2; ++c) {
     L2DiffAsymmetric(hf0[c], hf1[c], wmul[c] * hf_asymmetry,
@@ -1650,7 +1686,7 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
     DeallocateHFAndUHF(&hf1[0], &uhf1[0]);
     DeallocateHFAndUHF(&hf0[0], &uhf0[0]);
     JXL_RETURN_IF_ERROR(
-        Mask(mask0, mask1, params, &blur_temp, &mask, &block_diff_ac));
+        Mask(mask0, mask1, params, &blur_temp, &mask, &block_diff_ac, pool));
   }
 
   // compute final diffmap from mask image and ac and dc diff images
@@ -1782,20 +1818,47 @@ static void AddSupersampled2x(const ImageF& src, float w, ImageF& dest) {
   }
 }
 
-Image3F* ButteraugliComparator::Temp() const {
-  bool was_in_use = temp_in_use_.test_and_set(std::memory_order_acq_rel);
-  if (was_in_use) return nullptr;
-  return &temp_;
-}
+// Temporary storage of a comparator for the duration of one step.
+class ButteraugliComparator::ScopedTemp {
+ public:
+  explicit ScopedTemp(const ButteraugliComparator* comparator)
+      : comparator_(comparator),
+        acquired_(!comparator->temp_in_use_.test_and_set(
+            std::memory_order_acq_rel)) {}
+  ~ScopedTemp() {
+    if (acquired_) comparator_->temp_in_use_.clear(std::memory_order_release);
+  }
 
-void ButteraugliComparator::ReleaseTemp() const { temp_in_use_.clear(); }
+  ScopedTemp(const ScopedTemp&) = delete;
+  ScopedTemp& operator=(const ScopedTemp&) = delete;
+
+  StatusOr<Image3F*> Image(JxlMemoryManager* memory_manager) {
+    if (acquired_) return &comparator_->temp_;
+    if (image_.xsize() == 0) {
+      JXL_ASSIGN_OR_RETURN(image_,
+                           Image3F::Create(memory_manager, comparator_->xsize_,
+                                           comparator_->ysize_));
+    }
+    return &image_;
+  }
+
+  BlurTemp* blur_temp() {
+    return acquired_ ? &comparator_->blur_temp_ : &blur_temp_;
+  }
+
+ private:
+  const ButteraugliComparator* comparator_;
+  const bool acquired_;
+  Image3F image_;
+  BlurTemp blur_temp_;
+};
 
 ButteraugliComparator::ButteraugliComparator(size_t xsize, size_t ysize,
                                              const ButteraugliParams& params)
     : xsize_(xsize), ysize_(ysize), params_(params) {}
 
 StatusOr<std::unique_ptr<ButteraugliComparator>> ButteraugliComparator::Make(
-    const Image3F& rgb0, const ButteraugliParams& params) {
+    const Image3F& rgb0, const ButteraugliParams& params, ThreadPool* pool) {
   size_t xsize = rgb0.xsize();
   size_t ysize = rgb0.ysize();
   JxlMemoryManager* memory_manager = rgb0.memory_manager();
@@ -1811,28 +1874,45 @@ StatusOr<std::unique_ptr<ButteraugliComparator>> ButteraugliComparator::Make(
 
   JXL_ASSIGN_OR_RETURN(Image3F xyb0,
                        Image3F::Create(memory_manager, xsize, ysize));
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
-      rgb0, params, result->Temp(), &result->blur_temp_, &xyb0));
-  result->ReleaseTemp();
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(
-      xsize, ysize, params, &result->blur_temp_, xyb0, result->pi0_));
+  {
+    ScopedTemp temp(result.get());
+    JXL_ASSIGN_OR_RETURN(Image3F * blurred, temp.Image(memory_manager));
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
+        rgb0, params, blurred, temp.blur_temp(), &xyb0, pool));
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(
+        xsize, ysize, params, temp.blur_temp(), xyb0, result->pi0_, pool));
+  }
 
   // Awful recursive construction of samples of different resolution.
   // This is an after-thought and possibly somewhat parallel in
   // functionality with the PsychoImage multi-resolution approach.
   JXL_ASSIGN_OR_RETURN(Image3F subsampledRgb0, SubSample2x(rgb0));
-  JXL_ASSIGN_OR_RETURN(result->sub_,
-                       ButteraugliComparator::Make(subsampledRgb0, params));
+  JXL_ASSIGN_OR_RETURN(
+      result->sub_, ButteraugliComparator::Make(subsampledRgb0, params, pool));
   return result;
 }
 
 Status ButteraugliComparator::Mask(ImageF* BUTTERAUGLI_RESTRICT mask) const {
+  ScopedTemp temp(this);
   return HWY_DYNAMIC_DISPATCH(MaskPsychoImage)(
-      pi0_, pi0_, xsize_, ysize_, params_, &blur_temp_, mask, nullptr);
+      pi0_, pi0_, xsize_, ysize_, params_, temp.blur_temp(), mask, nullptr,
+      nullptr);
+}
+
+Status ButteraugliComparator::Diffmap(const Image3F& rgb1, ImageF& result,
+                                      ThreadPool* pool) const {
+  return Diffmap(rgb1, /*with_half_resolution=*/true, result, pool);
+}
+
+Status ButteraugliComparator::DiffmapApproximate(const Image3F& rgb1,
+                                                 ImageF& result,
+                                                 ThreadPool* pool) const {
+  return Diffmap(rgb1, /*with_half_resolution=*/false, result, pool);
 }
 
 Status ButteraugliComparator::Diffmap(const Image3F& rgb1,
-                                      ImageF& result) const {
+                                      bool with_half_resolution,
+                                      ImageF& result, ThreadPool* pool) const {
   JxlMemoryManager* memory_manager = rgb1.memory_manager();
   if (xsize_ < 8 || ysize_ < 8) {
     ZeroFillImage(&result);
@@ -1840,11 +1920,14 @@ Status ButteraugliComparator::Diffmap(const Image3F& rgb1,
   }
   JXL_ASSIGN_OR_RETURN(Image3F xyb1,
                        Image3F::Create(memory_manager, xsize_, ysize_));
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
-      rgb1, params_, Temp(), &blur_temp_, &xyb1));
-  ReleaseTemp();
-  JXL_RETURN_IF_ERROR(DiffmapOpsinDynamicsImage(xyb1, result));
-  if (sub_) {
+  {
+    ScopedTemp temp(this);
+    JXL_ASSIGN_OR_RETURN(Image3F * blurred, temp.Image(memory_manager));
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
+        rgb1, params_, blurred, temp.blur_temp(), &xyb1, pool));
+  }
+  JXL_RETURN_IF_ERROR(DiffmapOpsinDynamicsImage(xyb1, result, pool));
+  if (sub_ && with_half_resolution) {
     if (sub_->xsize_ < 8 || sub_->ysize_ < 8) {
       return true;
     }
@@ -1852,28 +1935,36 @@ Status ButteraugliComparator::Diffmap(const Image3F& rgb1,
         Image3F sub_xyb,
         Image3F::Create(memory_manager, sub_->xsize_, sub_->ysize_));
     JXL_ASSIGN_OR_RETURN(Image3F subsampledRgb1, SubSample2x(rgb1));
-    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
-        subsampledRgb1, params_, sub_->Temp(), &sub_->blur_temp_, &sub_xyb));
-    sub_->ReleaseTemp();
+    {
+      ScopedTemp temp(sub_.get());
+      JXL_ASSIGN_OR_RETURN(Image3F * blurred, temp.Image(memory_manager));
+      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
+          subsampledRgb1, params_, blurred, temp.blur_temp(), &sub_xyb,
+          pool));
+    }
     ImageF subresult;
-    JXL_RETURN_IF_ERROR(sub_->DiffmapOpsinDynamicsImage(sub_xyb, subresult));
+    JXL_RETURN_IF_ERROR(
+        sub_->DiffmapOpsinDynamicsImage(sub_xyb, subresult, pool));
     AddSupersampled2x(subresult, 0.5, result);
   }
   return true;
 }
 
-Status ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
-                                                        ImageF& result) const {
+Status ButteraugliComparator::DiffmapOpsinDynamicsImage(
+    const Image3F& xyb1, ImageF& result, ThreadPool* pool) const {
   JxlMemoryManager* memory_manager = xyb1.memory_manager();
   if (xsize_ < 8 || ysize_ < 8) {
     ZeroFillImage(&result);
     return true;
   }
   PsychoImage pi1;
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(
-      xsize_, ysize_, params_, &blur_temp_, xyb1, pi1));
+  {
+    ScopedTemp temp(this);
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(
+        xsize_, ysize_, params_, temp.blur_temp(), xyb1, pi1, pool));
+  }
   JXL_ASSIGN_OR_RETURN(result, ImageF::Create(memory_manager, xsize_, ysize_));
-  return DiffmapPsychoImage(pi1, result);
+  return DiffmapPsychoImage(pi1, result, pool);
 }
 
 namespace {
@@ -1881,23 +1972,26 @@ namespace {
 Status MaltaDiffMap(const ImageF& lum0, const ImageF& lum1, const double w_0gt1,
                     const double w_0lt1, const double norm1,
                     ImageF* HWY_RESTRICT diffs,
-                    Image3F* HWY_RESTRICT block_diff_ac, size_t c) {
-  return HWY_DYNAMIC_DISPATCH(MaltaDiffMap)(lum0, lum1, w_0gt1, w_0lt1, norm1,
-                                            diffs, &block_diff_ac->Plane(c));
+                    Image3F* HWY_RESTRICT block_diff_ac, size_t c,
+                    ThreadPool* pool) {
+  return HWY_DYNAMIC_DISPATCH(MaltaDiffMap)(
+      lum0, lum1, w_0gt1, w_0lt1, norm1, diffs, &block_diff_ac->Plane(c), pool);
 }
 
 Status MaltaDiffMapLF(const ImageF& lum0, const ImageF& lum1,
                       const double w_0gt1, const double w_0lt1,
                       const double norm1, ImageF* HWY_RESTRICT diffs,
-                      Image3F* HWY_RESTRICT block_diff_ac, size_t c) {
-  return HWY_DYNAMIC_DISPATCH(MaltaDiffMapLF)(lum0, lum1, w_0gt1, w_0lt1, norm1,
-                                              diffs, &block_diff_ac->Plane(c));
+                      Image3F* HWY_RESTRICT block_diff_ac, size_t c,
+                      ThreadPool* pool) {
+  return HWY_DYNAMIC_DISPATCH(MaltaDiffMapLF)(
+      lum0, lum1, w_0gt1, w_0lt1, norm1, diffs, &block_diff_ac->Plane(c), pool);
 }
 
 }  // namespace
 
 Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
-                                                 ImageF& diffmap) const {
+                                                 ImageF& diffmap,
+                                                 ThreadPool* pool) const {
   JxlMemoryManager* memory_manager = diffmap.memory_manager();
   if (xsize_ < 8 || ysize_ < 8) {
     ZeroFillImage(&diffmap);
@@ -1914,23 +2008,25 @@ Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
   ZeroFillImage(&block_diff_ac);
   JXL_RETURN_IF_ERROR(MaltaDiffMap(
       pi0_.uhf[1], pi1.uhf[1], wUhfMalta * hf_asymmetry_,
-      wUhfMalta / hf_asymmetry_, norm1Uhf, &diffs, &block_diff_ac, 1));
+      wUhfMalta / hf_asymmetry_, norm1Uhf, &diffs, &block_diff_ac, 1, pool));
   JXL_RETURN_IF_ERROR(MaltaDiffMap(
       pi0_.uhf[0], pi1.uhf[0], wUhfMaltaX * hf_asymmetry_,
-      wUhfMaltaX / hf_asymmetry_, norm1UhfX, &diffs, &block_diff_ac, 0));
+      wUhfMaltaX / hf_asymmetry_, norm1UhfX, &diffs, &block_diff_ac, 0, pool));
   JXL_RETURN_IF_ERROR(MaltaDiffMapLF(
       pi0_.hf[1], pi1.hf[1], wHfMalta * std::sqrt(hf_asymmetry_),
-      wHfMalta / std::sqrt(hf_asymmetry_), norm1Hf, &diffs, &block_diff_ac, 1));
+      wHfMalta / std::sqrt(hf_asymmetry_), norm1Hf, &diffs, &block_diff_ac, 1,
+      pool));
   JXL_RETURN_IF_ERROR(MaltaDiffMapLF(pi0_.hf[0], pi1.hf[0],
                                      wHfMaltaX * std::sqrt(hf_asymmetry_),
                                      wHfMaltaX / std::sqrt(hf_asymmetry_),
-                                     norm1HfX, &diffs, &block_diff_ac, 0));
+                                     norm1HfX, &diffs, &block_diff_ac, 0,
+                                     pool));
   JXL_RETURN_IF_ERROR(MaltaDiffMapLF(pi0_.mf.Plane(1), pi1.mf.Plane(1),
                                      wMfMalta, wMfMalta, norm1Mf, &diffs,
-                                     &block_diff_ac, 1));
+                                     &block_diff_ac, 1, pool));
   JXL_RETURN_IF_ERROR(MaltaDiffMapLF(pi0_.mf.Plane(0), pi1.mf.Plane(0),
                                      wMfMaltaX, wMfMaltaX, norm1MfX, &diffs,
-                                     &block_diff_ac, 0));
+                                     &block_diff_ac, 0, pool));
 
   JXL_ASSIGN_OR_RETURN(Image3F block_diff_dc,
                        Image3F::Create(memory_manager, xsize_, ysize_));
@@ -1947,9 +2043,12 @@ Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
   }
 
   ImageF mask;
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(MaskPsychoImage)(
-      pi0_, pi1, xsize_, ysize_, params_, &blur_temp_, &mask,
-      &block_diff_ac.Plane(1)));
+  {
+    ScopedTemp temp(this);
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(MaskPsychoImage)(
+        pi0_, pi1, xsize_, ysize_, params_, temp.blur_temp(), &mask,
+        &block_diff_ac.Plane(1), pool));
+  }
 
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(CombineChannelsToDiffmap)(
       mask, block_diff_dc, block_diff_ac, xmul_, &diffmap));
@@ -1978,7 +2077,8 @@ Status ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
 
 template <size_t kMax>
 bool ButteraugliDiffmapSmall(const Image3F& rgb0, const Image3F& rgb1,
-                             const ButteraugliParams& params, ImageF& diffmap) {
+                             const ButteraugliParams& params, ImageF& diffmap,
+                             ThreadPool* pool) {
   const size_t xsize = rgb0.xsize();
   const size_t ysize = rgb0.ysize();
   JxlMemoryManager* memory_manager = rgb0.memory_manager();
@@ -2005,7 +2105,8 @@ bool ButteraugliDiffmapSmall(const Image3F& rgb0, const Image3F& rgb1,
     }
   }
   ImageF diffmap_scaled;
-  const bool ok = ButteraugliDiffmap(scaled0, scaled1, params, diffmap_scaled);
+  const bool ok =
+      ButteraugliDiffmap(scaled0, scaled1, params, diffmap_scaled, pool);
   JXL_ASSIGN_OR_RETURN(diffmap, ImageF::Create(memory_manager, xsize, ysize));
   for (size_t y = 0; y < ysize; ++y) {
     for (size_t x = 0; x < xsize; ++x) {
@@ -2016,7 +2117,8 @@ bool ButteraugliDiffmapSmall(const Image3F& rgb0, const Image3F& rgb1,
 }
 
 Status ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
-                          const ButteraugliParams& params, ImageF& diffmap) {
+                          const ButteraugliParams& params, ImageF& diffmap,
+                          ThreadPool* pool) {
   const size_t xsize = rgb0.xsize();
   const size_t ysize = rgb0.ysize();
   if (xsize < 1 || ysize < 1) {
@@ -2027,11 +2129,11 @@ Status ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
   }
   static const int kMax = 8;
   if (xsize < kMax || ysize < kMax) {
-    return ButteraugliDiffmapSmall<kMax>(rgb0, rgb1, params, diffmap);
+    return ButteraugliDiffmapSmall<kMax>(rgb0, rgb1, params, diffmap, pool);
   }
   JXL_ASSIGN_OR_RETURN(std::unique_ptr<ButteraugliComparator> butteraugli,
-                       ButteraugliComparator::Make(rgb0, params));
-  JXL_RETURN_IF_ERROR(butteraugli->Diffmap(rgb1, diffmap));
+                       ButteraugliComparator::Make(rgb0, params, pool));
+  JXL_RETURN_IF_ERROR(butteraugli->Diffmap(rgb1, diffmap, pool));
   return true;
 }
 
@@ -2046,8 +2148,8 @@ bool ButteraugliInterface(const Image3F& rgb0, const Image3F& rgb1,
 
 bool ButteraugliInterface(const Image3F& rgb0, const Image3F& rgb1,
                           const ButteraugliParams& params, ImageF& diffmap,
-                          double& diffvalue) {
-  if (!ButteraugliDiffmap(rgb0, rgb1, params, diffmap)) {
+                          double& diffvalue, ThreadPool* pool) {
+  if (!ButteraugliDiffmap(rgb0, rgb1, params, diffmap, pool)) {
     return false;
   }
   diffvalue = ButteraugliScoreFromDiffmap(diffmap, &params);
@@ -2056,7 +2158,8 @@ bool ButteraugliInterface(const Image3F& rgb0, const Image3F& rgb1,
 
 Status ButteraugliInterfaceInPlace(Image3F&& rgb0, Image3F&& rgb1,
                                    const ButteraugliParams& params,
-                                   ImageF& diffmap, double& diffvalue) {
+                                   ImageF& diffmap, double& diffvalue,
+                                   ThreadPool* pool) {
   const size_t xsize = rgb0.xsize();
   const size_t ysize = rgb0.ysize();
   if (xsize < 1 || ysize < 1) {
@@ -2067,7 +2170,7 @@ Status ButteraugliInterfaceInPlace(Image3F&& rgb0, Image3F&& rgb1,
   }
   static const int kMax = 8;
   if (xsize < kMax || ysize < kMax) {
-    bool ok = ButteraugliDiffmapSmall<kMax>(rgb0, rgb1, params, diffmap);
+    bool ok = ButteraugliDiffmapSmall<kMax>(rgb0, rgb1, params, diffmap, pool);
     diffvalue = ButteraugliScoreFromDiffmap(diffmap, &params);
     return ok;
   }
@@ -2076,10 +2179,10 @@ Status ButteraugliInterfaceInPlace(Image3F&& rgb0, Image3F&& rgb1,
     JXL_ASSIGN_OR_RETURN(Image3F rgb0_sub, SubSample2x(rgb0));
     JXL_ASSIGN_OR_RETURN(Image3F rgb1_sub, SubSample2x(rgb1));
     JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ButteraugliDiffmapInPlace)(
-        rgb0_sub, rgb1_sub, params, subdiffmap));
+        rgb0_sub, rgb1_sub, params, subdiffmap, pool));
   }
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ButteraugliDiffmapInPlace)(
-      rgb0, rgb1, params, diffmap));
+      rgb0, rgb1, params, diffmap, pool));
   if (xsize >= 15 && ysize >= 15) {
     AddSupersampled2x(subdiffmap, 0.5, diffmap);
   }
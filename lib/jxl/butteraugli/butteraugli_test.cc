@@ -11,10 +11,13 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <utility>
+#include <vector>
 
 #include "lib/extras/metrics.h"
 #include "lib/extras/packed_image.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_external_image.h"
@@ -112,5 +115,109 @@ TEST(ButteraugliInPlaceTest, LargeImage) {
   EXPECT_NEAR(distp, distp2, 1e-7);
 }
 
+TEST(ButteraugliComparatorTest, ConcurrentDiffmaps) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 256;
+  const size_t ysize = 192;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  ButteraugliParams butteraugli_params;
+  JXL_TEST_ASSIGN_OR_DIE(
+      std::unique_ptr<ButteraugliComparator> comparator,
+      ButteraugliComparator::Make(rgb0, butteraugli_params));
+
+  constexpr size_t kNumCandidates = 8;
+  std::vector<Image3F> candidates;
+  std::vector<double> expected;
+  for (size_t i = 0; i < kNumCandidates; ++i) {
+    JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                           Image3F::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+    AddUniformNoise(&rgb1, 0.005f * (i + 1), 7777 + i);
+    ImageF diffmap;
+    ASSERT_TRUE(comparator->Diffmap(rgb1, diffmap));
+    expected.push_back(ButteraugliScoreFromDiffmap(diffmap));
+    candidates.push_back(std::move(rgb1));
+  }
+
+  test::ThreadPoolForTests pool(4);
+  std::vector<double> scores(kNumCandidates);
+  const auto compare = [&](const uint32_t i, size_t /*thread*/) -> Status {
+    ImageF diffmap;
+    JXL_RETURN_IF_ERROR(comparator->Diffmap(candidates[i], diffmap));
+    scores[i] = ButteraugliScoreFromDiffmap(diffmap);
+    return true;
+  };
+  ASSERT_TRUE(RunOnPool(pool.get(), 0, kNumCandidates, ThreadPool::NoInit,
+                        compare, "Compare"));
+  for (size_t i = 0; i < kNumCandidates; ++i) {
+    EXPECT_EQ(expected[i], scores[i]);
+  }
+}
+
+TEST(ButteraugliComparatorTest, ApproximateDiffmap) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 256;
+  const size_t ysize = 192;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  ButteraugliParams butteraugli_params;
+  JXL_TEST_ASSIGN_OR_DIE(
+      std::unique_ptr<ButteraugliComparator> comparator,
+      ButteraugliComparator::Make(rgb0, butteraugli_params));
+
+  double prev_approximate = 0.0;
+  for (size_t i = 0; i < 4; ++i) {
+    JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                           Image3F::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+    AddUniformNoise(&rgb1, 0.01f * (i + 1), 7777 + i);
+    ImageF diffmap;
+    ASSERT_TRUE(comparator->Diffmap(rgb1, diffmap));
+    const double full = ButteraugliScoreFromDiffmap(diffmap);
+    ASSERT_TRUE(comparator->DiffmapApproximate(rgb1, diffmap));
+    const double approximate = ButteraugliScoreFromDiffmap(diffmap);
+    // Close to the full metric, and still ordering the distortions.
+    EXPECT_NEAR(full, approximate, 0.25 * full);
+    EXPECT_GT(approximate, prev_approximate);
+    prev_approximate = approximate;
+  }
+}
+
+TEST(ButteraugliComparatorTest, ThreadedDiffmap) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 300;
+  const size_t ysize = 200;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+  AddUniformNoise(&rgb1, 0.02f, 7777);
+
+  ButteraugliParams butteraugli_params;
+  ImageF expected;
+  ASSERT_TRUE(ButteraugliDiffmap(rgb0, rgb1, butteraugli_params, expected));
+  test::ThreadPoolForTests pool(4);
+  ImageF diffmap;
+  ASSERT_TRUE(ButteraugliDiffmap(rgb0, rgb1, butteraugli_params, diffmap,
+                                 pool.get()));
+  // The threads only split the work, so the result must be bit-exact.
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      ASSERT_EQ(expected.ConstRow(y)[x], diffmap.ConstRow(y)[x]);
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
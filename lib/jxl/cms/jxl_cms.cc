@@ -17,7 +17,9 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <list>
 #include <memory>
+#include <mutex>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/cms/jxl_cms.cc"
@@ -28,6 +30,7 @@
 #include "lib/jxl/base/matrix_ops.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #include "lib/jxl/cms/jxl_cms_internal.h"
 #include "lib/jxl/cms/transfer_functions-inl.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -51,12 +54,16 @@ namespace {
 
 using ::jxl::cms::ColorEncoding;
 
-struct JxlCms {
+// The part of the state that only depends on the two ICC profiles. It is
+// immutable once created, and shared by all the JxlCms with the same
+// profiles (see TransformCache).
+struct JxlCmsTransform {
 #if JPEGXL_ENABLE_SKCMS
+  // The profiles point into these.
   IccBytes icc_src, icc_dst;
   skcms_ICCProfile profile_src, profile_dst;
 #else
-  void* lcms_transform;
+  void* lcms_transform = nullptr;
 #endif
 
   // These fields are used when the HLG OOTF or inverse OOTF must be applied.
@@ -68,19 +75,121 @@ struct JxlCms {
   size_t channels_src;
   size_t channels_dst;
 
+  bool skip_lcms = false;
+  ExtraTF preprocess = ExtraTF::kNone;
+  ExtraTF postprocess = ExtraTF::kNone;
+
+  // Set if, after preprocess, the conversion is a 3x3 matrix (row-major) on
+  // linear RGB, which is then applied instead of the CMS.
+  bool use_matrix = false;
+  std::array<float, 9> matrix;
+
+  // If lut_size is not 0, rows of 3-channel input within [0, 1] are
+  // converted by tetrahedral interpolation in a lut_size^3 grid of results of
+  // the CMS, instead of by the CMS itself. The lut has one plane for each of
+  // the lut_channels outputs, with blue varying the fastest.
+  size_t lut_size = 0;
+  size_t lut_channels = 0;
+  std::vector<float> lut;
+};
+
+// Options of the default CMS, given as its init_data.
+struct CmsOptions {
+  // Size of the grid of the 3D LUT, 0 to always use the CMS.
+  size_t lut_size;
+};
+
+struct JxlCms {
+  std::shared_ptr<const JxlCmsTransform> transform;
+
   std::vector<float> src_storage;
   std::vector<float*> buf_src;
   std::vector<float> dst_storage;
   std::vector<float*> buf_dst;
 
   float intensity_target;
-  bool skip_lcms = false;
-  ExtraTF preprocess = ExtraTF::kNone;
-  ExtraTF postprocess = ExtraTF::kNone;
 };
 
 Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
                     bool forward);
+
+// Runs the CMS on interleaved pixels, after preprocess, with the channel
+// layout that it expects.
+Status RunCms(const JxlCmsTransform& xf, const float* xform_src,
+              float* buf_dst, size_t xsize) {
+#if JPEGXL_ENABLE_SKCMS
+  JXL_ENSURE(
+      skcms_Transform(xform_src,
+                      (xf.channels_src == 4 ? skcms_PixelFormat_RGBA_ffff
+                                            : skcms_PixelFormat_RGB_fff),
+                      skcms_AlphaFormat_Opaque, &xf.profile_src, buf_dst,
+                      skcms_PixelFormat_RGB_fff, skcms_AlphaFormat_Opaque,
+                      &xf.profile_dst, xsize));
+#else   // JPEGXL_ENABLE_SKCMS
+  cmsDoTransform(xf.lcms_transform, xform_src, buf_dst,
+                 static_cast<cmsUInt32Number>(xsize));
+#endif  // JPEGXL_ENABLE_SKCMS
+  return true;
+}
+
+// Tetrahedral interpolation of the pixel (r, g, b), in [0, 1], in xf.lut.
+void InterpolateLutPixel(const JxlCmsTransform& xf, float r, float g, float b,
+                         float* out) {
+  const size_t n = xf.lut_size;
+  const size_t plane = n * n * n;
+  const float scale = n - 1;
+  const float pos[3] = {r * scale, g * scale, b * scale};
+  const size_t strides[3] = {n * n, n, 1};
+  size_t base = 0;
+  float frac[3];
+  for (size_t c = 0; c < 3; ++c) {
+    const size_t i = std::min(static_cast<size_t>(pos[c]), n - 2);
+    base += i * strides[c];
+    frac[c] = pos[c] - i;
+  }
+  // Visit the axes by decreasing fraction: the pixel is in the tetrahedron
+  // with the corners base, +max axis, +max and mid axes, and +all axes.
+  size_t order[3] = {0, 1, 2};
+  if (frac[order[0]] < frac[order[1]]) std::swap(order[0], order[1]);
+  if (frac[order[1]] < frac[order[2]]) std::swap(order[1], order[2]);
+  if (frac[order[0]] < frac[order[1]]) std::swap(order[0], order[1]);
+  const size_t v1 = base + strides[order[0]];
+  const size_t v2 = v1 + strides[order[1]];
+  const size_t v3 = v2 + strides[order[2]];
+  for (size_t c = 0; c < xf.lut_channels; ++c) {
+    const float* lut = xf.lut.data() + c * plane;
+    out[c] = lut[base] + frac[order[0]] * (lut[v1] - lut[base]) +
+             frac[order[1]] * (lut[v2] - lut[v1]) +
+             frac[order[2]] * (lut[v3] - lut[v2]);
+  }
+}
+
+// Fills xf->lut by running the CMS on a lut_size^3 grid.
+Status BakeLut(size_t lut_size, JxlCmsTransform* xf) {
+  const size_t n = lut_size;
+  const size_t plane = n * n * n;
+  xf->lut_size = n;
+  xf->lut.resize(plane * xf->lut_channels);
+  std::vector<float> src(3 * n);
+  std::vector<float> dst(xf->lut_channels * n);
+  for (size_t r = 0; r < n; ++r) {
+    for (size_t g = 0; g < n; ++g) {
+      for (size_t b = 0; b < n; ++b) {
+        src[3 * b] = static_cast<float>(r) / (n - 1);
+        src[3 * b + 1] = static_cast<float>(g) / (n - 1);
+        src[3 * b + 2] = static_cast<float>(b) / (n - 1);
+      }
+      JXL_RETURN_IF_ERROR(RunCms(*xf, src.data(), dst.data(), n));
+      for (size_t c = 0; c < xf->lut_channels; ++c) {
+        float* row = xf->lut.data() + c * plane + (r * n + g) * n;
+        for (size_t b = 0; b < n; ++b) {
+          row[b] = dst[b * xf->lut_channels + c];
+        }
+      }
+    }
+  }
+  return true;
+}
 }  // namespace
 }  // namespace jxl
 
@@ -97,7 +206,7 @@ const size_t kX = 0;  // pixel index, multiplied by 3 for RGB
 // xform_src = UndoGammaCompression(buf_src).
 Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
                        size_t buf_size) {
-  switch (t->preprocess) {
+  switch (t->transform->preprocess) {
     case ExtraTF::kNone:
       JXL_ENSURE(false);  // unreachable
       break;
@@ -123,7 +232,7 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
         xform_src[i] = static_cast<float>(
             TF_HLG_Base::DisplayFromEncoded(static_cast<double>(buf_src[i])));
       }
-      if (t->apply_hlg_ootf) {
+      if (t->transform->apply_hlg_ootf) {
         JXL_RETURN_IF_ERROR(
             ApplyHlgOotf(t, xform_src, buf_size, /*forward=*/true));
       }
@@ -153,7 +262,7 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
 
 // Applies gamma compression in-place.
 Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
-  switch (t->postprocess) {
+  switch (t->transform->postprocess) {
     case ExtraTF::kNone:
       JXL_DEBUG_ABORT("Unreachable");
       break;
@@ -172,7 +281,7 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
       break;
     }
     case ExtraTF::kHLG:
-      if (t->apply_hlg_ootf) {
+      if (t->transform->apply_hlg_ootf) {
         JXL_RETURN_IF_ERROR(
             ApplyHlgOotf(t, buf_dst, buf_size, /*forward=*/false));
       }
@@ -201,22 +310,128 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
   return true;
 }
 
+// buf_dst = matrix * xform_src, on interleaved RGB. May be in-place.
+void ApplyMatrix(const std::array<float, 9>& matrix, const float* xform_src,
+                 float* buf_dst, size_t xsize) {
+  HWY_FULL(float) df;
+  using V = hwy::HWY_NAMESPACE::Vec<decltype(df)>;
+  std::array<V, 9> m;
+  for (size_t i = 0; i < 9; ++i) m[i] = Set(df, matrix[i]);
+  size_t x = 0;
+  for (; x + Lanes(df) <= xsize; x += Lanes(df)) {
+    V r, g, b;
+    LoadInterleaved3(df, xform_src + 3 * x, r, g, b);
+    const V out_r = MulAdd(m[2], b, MulAdd(m[1], g, Mul(m[0], r)));
+    const V out_g = MulAdd(m[5], b, MulAdd(m[4], g, Mul(m[3], r)));
+    const V out_b = MulAdd(m[8], b, MulAdd(m[7], g, Mul(m[6], r)));
+    StoreInterleaved3(out_r, out_g, out_b, df, buf_dst + 3 * x);
+  }
+  for (; x < xsize; ++x) {
+    const float r = xform_src[3 * x];
+    const float g = xform_src[3 * x + 1];
+    const float b = xform_src[3 * x + 2];
+    for (size_t c = 0; c < 3; ++c) {
+      buf_dst[3 * x + c] =
+          matrix[3 * c] * r + matrix[3 * c + 1] * g + matrix[3 * c + 2] * b;
+    }
+  }
+}
+
+// Same as InterpolateLutPixel, for a row of interleaved RGB pixels in [0, 1].
+// May be in-place if xf.lut_channels is 3.
+void InterpolateLut(const JxlCmsTransform& xf, const float* xform_src,
+                    float* buf_dst, size_t xsize) {
+  HWY_FULL(float) df;
+  const hwy::HWY_NAMESPACE::RebindToSigned<decltype(df)> di;
+  using V = hwy::HWY_NAMESPACE::Vec<decltype(df)>;
+  using VI = hwy::HWY_NAMESPACE::Vec<decltype(di)>;
+  const int32_t n = xf.lut_size;
+  const size_t plane = xf.lut_size * xf.lut_size * xf.lut_size;
+  const V scale = Set(df, n - 1);
+  const VI max_index = Set(di, n - 2);
+  const VI stride_r = Set(di, n * n);
+  const VI stride_g = Set(di, n);
+  const VI stride_b = Set(di, 1);
+  HWY_ALIGN float out[3][hwy::HWY_NAMESPACE::MaxLanes(df)];
+  size_t x = 0;
+  for (; x + Lanes(df) <= xsize; x += Lanes(df)) {
+    V r, g, b;
+    LoadInterleaved3(df, xform_src + 3 * x, r, g, b);
+    const V pos_r = Mul(r, scale);
+    const V pos_g = Mul(g, scale);
+    const V pos_b = Mul(b, scale);
+    const VI i_r = Min(ConvertTo(di, pos_r), max_index);
+    const VI i_g = Min(ConvertTo(di, pos_g), max_index);
+    const VI i_b = Min(ConvertTo(di, pos_b), max_index);
+    const V f_r = Sub(pos_r, ConvertTo(df, i_r));
+    const V f_g = Sub(pos_g, ConvertTo(df, i_g));
+    const V f_b = Sub(pos_b, ConvertTo(df, i_b));
+    const VI base = Add(Mul(i_r, stride_r), Add(Mul(i_g, stride_g), i_b));
+    // Stride of the axis with the largest and smallest fraction.
+    const auto r_ge_g = RebindMask(di, Ge(f_r, f_g));
+    const auto g_ge_b = RebindMask(di, Ge(f_g, f_b));
+    const auto r_ge_b = RebindMask(di, Ge(f_r, f_b));
+    const VI stride_max =
+        IfThenElse(And(r_ge_g, r_ge_b), stride_r,
+                   IfThenElse(g_ge_b, stride_g, stride_b));
+    const VI stride_min =
+        IfThenElse(And(r_ge_b, g_ge_b), stride_b,
+                   IfThenElse(r_ge_g, stride_g, stride_r));
+    const VI v1 = Add(base, stride_max);
+    const VI v3 = Add(base, Add(stride_r, Add(stride_g, stride_b)));
+    const VI v2 = Sub(v3, stride_min);
+    const V f_max = Max(f_r, Max(f_g, f_b));
+    const V f_min = Min(f_r, Min(f_g, f_b));
+    const V f_mid = Sub(Add(f_r, Add(f_g, f_b)), Add(f_max, f_min));
+    for (size_t c = 0; c < xf.lut_channels; ++c) {
+      const float* lut = xf.lut.data() + c * plane;
+      const V c0 = GatherIndex(df, lut, base);
+      const V c1 = GatherIndex(df, lut, v1);
+      const V c2 = GatherIndex(df, lut, v2);
+      const V c3 = GatherIndex(df, lut, v3);
+      const V result =
+          MulAdd(f_min, Sub(c3, c2),
+                 MulAdd(f_mid, Sub(c2, c1), MulAdd(f_max, Sub(c1, c0), c0)));
+      Store(result, df, out[c]);
+    }
+    if (xf.lut_channels == 3) {
+      StoreInterleaved3(Load(df, out[0]), Load(df, out[1]), Load(df, out[2]),
+                        df, buf_dst + 3 * x);
+    } else {
+      for (size_t i = 0; i < Lanes(df); ++i) {
+        for (size_t c = 0; c < xf.lut_channels; ++c) {
+          buf_dst[(x + i) * xf.lut_channels + c] = out[c][i];
+        }
+      }
+    }
+  }
+  for (; x < xsize; ++x) {
+    float pixel[3];
+    InterpolateLutPixel(xf, xform_src[3 * x], xform_src[3 * x + 1],
+                        xform_src[3 * x + 2], pixel);
+    for (size_t c = 0; c < xf.lut_channels; ++c) {
+      buf_dst[x * xf.lut_channels + c] = pixel[c];
+    }
+  }
+}
+
 Status DoColorSpaceTransform(void* cms_data, const size_t thread,
                              const float* buf_src, float* buf_dst,
                              size_t xsize) {
   // No lock needed.
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
+  const JxlCmsTransform& xf = *t->transform;
 
   const float* xform_src = buf_src;  // Read-only.
-  if (t->preprocess != ExtraTF::kNone) {
+  if (xf.preprocess != ExtraTF::kNone) {
     float* mutable_xform_src = t->buf_src[thread];  // Writable buffer.
     JXL_RETURN_IF_ERROR(BeforeTransform(t, buf_src, mutable_xform_src,
-                                        xsize * t->channels_src));
+                                        xsize * xf.channels_src));
     xform_src = mutable_xform_src;
   }
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_src == 1 && !t->skip_lcms) {
+  if (xf.channels_src == 1 && !xf.skip_lcms) {
     // Expand from 1 to 3 channels, starting from the end in case
     // xform_src == t->buf_src[thread].
     float* mutable_xform_src = t->buf_src[thread];
@@ -228,7 +443,7 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
     xform_src = mutable_xform_src;
   }
 #else
-  if (t->channels_src == 4 && !t->skip_lcms) {
+  if (xf.channels_src == 4 && !xf.skip_lcms) {
     // LCMS does CMYK in a weird way: 0 = white, 100 = max ink
     float* mutable_xform_src = t->buf_src[thread];
     for (size_t x = 0; x < xsize * 4; ++x) {
@@ -245,32 +460,28 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   const float in2 = xform_src[3 * kX + 2];
 #endif
 
-  if (t->skip_lcms) {
+  if (xf.skip_lcms) {
     if (buf_dst != xform_src) {
-      memcpy(buf_dst, xform_src, xsize * t->channels_src * sizeof(*buf_dst));
+      memcpy(buf_dst, xform_src, xsize * xf.channels_src * sizeof(*buf_dst));
     }  // else: in-place, no need to copy
+  } else if (xf.use_matrix) {
+    ApplyMatrix(xf.matrix, xform_src, buf_dst, xsize);
+  } else if (xf.lut_size != 0 &&
+             std::all_of(xform_src, xform_src + 3 * xsize,
+                         [](float v) { return v >= 0.f && v <= 1.f; })) {
+    // Out of range values would be clamped by the LUT.
+    InterpolateLut(xf, xform_src, buf_dst, xsize);
   } else {
-#if JPEGXL_ENABLE_SKCMS
-    JXL_ENSURE(
-        skcms_Transform(xform_src,
-                        (t->channels_src == 4 ? skcms_PixelFormat_RGBA_ffff
-                                              : skcms_PixelFormat_RGB_fff),
-                        skcms_AlphaFormat_Opaque, &t->profile_src, buf_dst,
-                        skcms_PixelFormat_RGB_fff, skcms_AlphaFormat_Opaque,
-                        &t->profile_dst, xsize));
-#else   // JPEGXL_ENABLE_SKCMS
-    cmsDoTransform(t->lcms_transform, xform_src, buf_dst,
-                   static_cast<cmsUInt32Number>(xsize));
-#endif  // JPEGXL_ENABLE_SKCMS
+    JXL_RETURN_IF_ERROR(RunCms(xf, xform_src, buf_dst, xsize));
   }
 #if JXL_CMS_VERBOSE >= 2
   printf("xform skip%d: %.4f %.4f %.4f (%p) -> (%p) %.4f %.4f %.4f\n",
-         t->skip_lcms, in0, in1, in2, xform_src, buf_dst, buf_dst[3 * kX],
+         xf.skip_lcms, in0, in1, in2, xform_src, buf_dst, buf_dst[3 * kX],
          buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_dst == 1 && !t->skip_lcms) {
+  if (xf.channels_dst == 1 && !xf.skip_lcms) {
     // Contract back from 3 to 1 channel, this time forward.
     float* grayscale_buf_dst = t->buf_dst[thread];
     for (size_t x = 0; x < xsize; ++x) {
@@ -280,8 +491,8 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   }
 #endif
 
-  if (t->postprocess != ExtraTF::kNone) {
-    JXL_RETURN_IF_ERROR(AfterTransform(t, buf_dst, xsize * t->channels_dst));
+  if (xf.postprocess != ExtraTF::kNone) {
+    JXL_RETURN_IF_ERROR(AfterTransform(t, buf_dst, xsize * xf.channels_dst));
   }
   return true;
 }
@@ -298,6 +509,7 @@ namespace {
 HWY_EXPORT(DoColorSpaceTransform);
 int DoColorSpaceTransform(void* t, size_t thread, const float* buf_src,
                           float* buf_dst, size_t xsize) {
+  JXL_TRACE_EVENT("CmsRun");
   return HWY_DYNAMIC_DISPATCH(DoColorSpaceTransform)(t, thread, buf_src,
                                                      buf_dst, xsize);
 }
@@ -854,8 +1066,48 @@ Status GetPrimariesLuminances(const ColorEncoding& encoding,
   return true;
 }
 
+// Whether conversions from or to `c` are a 3x3 matrix on linear RGB, once the
+// transfer function is handled with ExtraTF. This is the case for most display
+// profiles (matrix/TRC), for which lcms and skcms would compute the same.
+bool IsMatrixShaper(const ColorEncoding& c) {
+  return c.have_fields && c.color_space == ColorSpace::kRGB && !c.cmyk &&
+         c.rendering_intent != RenderingIntent::kAbsolute &&
+         (c.tf.IsLinear() || c.tf.IsSRGB() || c.tf.IsPQ() || c.tf.IsHLG());
+}
+
+// Matrix from linear RGB to XYZ, adapted to D50 like in ICC profiles.
+Status RGBToXYZD50(const ColorEncoding& c, Matrix3x3& matrix) {
+  PrimariesCIExy p;
+  JXL_RETURN_IF_ERROR(c.GetPrimaries(p));
+  const CIExy wp = c.GetWhitePoint();
+  return PrimariesToXYZD50(p.r.x, p.r.y, p.g.x, p.g.y, p.b.x, p.b.y, wp.x,
+                           wp.y, matrix);
+}
+
+// Matrix from linear `c_src` to linear `c_dst`, through XYZ D50.
+Status MatrixBetween(const ColorEncoding& c_src, const ColorEncoding& c_dst,
+                     std::array<float, 9>& matrix) {
+  Matrix3x3 src_to_xyz;
+  Matrix3x3 dst_to_xyz;
+  JXL_RETURN_IF_ERROR(RGBToXYZD50(c_src, src_to_xyz));
+  JXL_RETURN_IF_ERROR(RGBToXYZD50(c_dst, dst_to_xyz));
+  JXL_RETURN_IF_ERROR(Inv3x3Matrix(dst_to_xyz));
+  Matrix3x3 product;
+  Mul3x3Matrix(dst_to_xyz, src_to_xyz, product);
+  for (size_t y = 0; y < 3; ++y) {
+    for (size_t x = 0; x < 3; ++x) {
+      matrix[3 * y + x] = product[y][x];
+      if (!std::isfinite(matrix[3 * y + x])) {
+        return JXL_FAILURE("Invalid primaries");
+      }
+    }
+  }
+  return true;
+}
+
 Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
                     bool forward) {
+  const JxlCmsTransform& xf = *t->transform;
   if (295 <= t->intensity_target && t->intensity_target <= 305) {
     // The gamma is approximately 1 so this can essentially be skipped.
     return true;
@@ -863,7 +1115,7 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
   float gamma = 1.2f * std::pow(1.111f, std::log2(t->intensity_target * 1e-3f));
   if (!forward) gamma = 1.f / gamma;
 
-  switch (t->hlg_ootf_num_channels) {
+  switch (xf.hlg_ootf_num_channels) {
     case 1:
       for (size_t x = 0; x < xsize; ++x) {
         buf[x] = std::pow(buf[x], gamma);
@@ -872,9 +1124,9 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
 
     case 3:
       for (size_t x = 0; x < xsize; x += 3) {
-        const float luminance = buf[x] * t->hlg_ootf_luminances[0] +
-                                buf[x + 1] * t->hlg_ootf_luminances[1] +
-                                buf[x + 2] * t->hlg_ootf_luminances[2];
+        const float luminance = buf[x] * xf.hlg_ootf_luminances[0] +
+                                buf[x + 1] * xf.hlg_ootf_luminances[1] +
+                                buf[x + 2] * xf.hlg_ootf_luminances[2];
         const float ratio = std::pow(luminance, gamma - 1);
         if (std::isfinite(ratio)) {
           buf[x] *= ratio;
@@ -903,7 +1155,7 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
 
     default:
       return JXL_FAILURE("HLG OOTF not implemented for %" PRIuS " channels",
-                         t->hlg_ootf_num_channels);
+                         xf.hlg_ootf_num_channels);
   }
   return true;
 }
@@ -1081,12 +1333,102 @@ namespace {
 void JxlCmsDestroy(void* cms_data) {
   if (cms_data == nullptr) return;
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
+  delete t;
+}
+
+void DestroyTransform(JxlCmsTransform* t) {
 #if !JPEGXL_ENABLE_SKCMS
   TransformDeleter()(t->lcms_transform);
 #endif
   delete t;
 }
 
+// Process-wide cache of the most recently used transforms: creating one parses
+// both profiles (twice) and, with lcms, precomputes the transform, which costs
+// much more than the rest of JxlCmsInit. Applications typically convert
+// between few profiles, e.g. from those of cameras to the one of the display.
+class TransformCache {
+ public:
+  static TransformCache* Get() {
+    // Never destroyed, so that it can be used until the end of the process.
+    static TransformCache* cache = new TransformCache();
+    return cache;
+  }
+
+  std::shared_ptr<const JxlCmsTransform> Find(const JxlColorProfile& input,
+                                              const JxlColorProfile& output,
+                                              size_t lut_size) {
+    const uint64_t hash = Hash(input, output, lut_size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->hash == hash && Matches(*it, input, output, lut_size)) {
+        entries_.splice(entries_.begin(), entries_, it);
+        return entries_.front().transform;
+      }
+    }
+    return nullptr;
+  }
+
+  void Insert(const JxlColorProfile& input, const JxlColorProfile& output,
+              size_t lut_size,
+              std::shared_ptr<const JxlCmsTransform> transform) {
+    Entry entry;
+    entry.hash = Hash(input, output, lut_size);
+    entry.lut_size = lut_size;
+    entry.icc_src.assign(input.icc.data, input.icc.data + input.icc.size);
+    entry.icc_dst.assign(output.icc.data, output.icc.data + output.icc.size);
+    entry.transform = std::move(transform);
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Another thread may have inserted the same profiles in the meantime.
+    entries_.remove_if([&](const Entry& other) {
+      return other.hash == entry.hash &&
+             Matches(other, input, output, lut_size);
+    });
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > kCapacity) entries_.pop_back();
+  }
+
+ private:
+  // The rendering intent is part of the ICC profiles, so the key is just their
+  // bytes and the size of the LUT, if any.
+  struct Entry {
+    uint64_t hash;
+    size_t lut_size;
+    IccBytes icc_src;
+    IccBytes icc_dst;
+    std::shared_ptr<const JxlCmsTransform> transform;
+  };
+
+  static constexpr size_t kCapacity = 16;
+
+  // FNV-1a of both profiles and the LUT size.
+  static uint64_t Hash(const JxlColorProfile& input,
+                       const JxlColorProfile& output, size_t lut_size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const JxlColorProfile* profile : {&input, &output}) {
+      for (size_t i = 0; i < profile->icc.size; ++i) {
+        hash = (hash ^ profile->icc.data[i]) * 0x100000001b3ull;
+      }
+      hash = (hash ^ profile->icc.size) * 0x100000001b3ull;
+    }
+    return (hash ^ lut_size) * 0x100000001b3ull;
+  }
+
+  static bool Matches(const Entry& entry, const JxlColorProfile& input,
+                      const JxlColorProfile& output, size_t lut_size) {
+    return entry.lut_size == lut_size &&
+           entry.icc_src.size() == input.icc.size &&
+           entry.icc_dst.size() == output.icc.size &&
+           std::equal(entry.icc_src.begin(), entry.icc_src.end(),
+                      input.icc.data) &&
+           std::equal(entry.icc_dst.begin(), entry.icc_dst.end(),
+                      output.icc.data);
+  }
+
+  std::mutex mutex_;
+  std::list<Entry> entries_;  // Most recently used first.
+};
+
 void AllocateBuffer(size_t length, size_t num_threads,
                     std::vector<float>* storage, std::vector<float*>* view) {
   constexpr size_t kAlign = 128 / sizeof(float);
@@ -1102,25 +1444,13 @@ void AllocateBuffer(size_t length, size_t num_threads,
   }
 }
 
-void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
-                 const JxlColorProfile* input, const JxlColorProfile* output,
-                 float intensity_target) {
-  if (init_data == nullptr) {
-    JXL_NOTIFY_ERROR("JxlCmsInit: init_data is nullptr");
-    return nullptr;
-  }
-  const auto* cms = static_cast<const JxlCmsInterface*>(init_data);
-  auto t = jxl::make_unique<JxlCms>();
+// Returns nullptr on error.
+std::shared_ptr<const JxlCmsTransform> CreateTransform(
+    const JxlCmsInterface* cms, const JxlColorProfile* input,
+    const JxlColorProfile* output, size_t lut_size) {
+  std::shared_ptr<JxlCmsTransform> t(new JxlCmsTransform(), DestroyTransform);
   IccBytes icc_src;
   IccBytes icc_dst;
-  if (input->icc.size == 0) {
-    JXL_NOTIFY_ERROR("JxlCmsInit: empty input ICC");
-    return nullptr;
-  }
-  if (output->icc.size == 0) {
-    JXL_NOTIFY_ERROR("JxlCmsInit: empty OUTPUT ICC");
-    return nullptr;
-  }
   icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
   ColorEncoding c_src;
   if (!c_src.SetFieldsFromICC(std::move(icc_src), *cms)) {
@@ -1138,11 +1468,14 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (!DecodeProfile(input->icc.data, input->icc.size, &t->profile_src)) {
+  // The transform outlives the profiles given to JxlCmsInit.
+  t->icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
+  t->icc_dst.assign(output->icc.data, output->icc.data + output->icc.size);
+  if (!DecodeProfile(t->icc_src.data(), t->icc_src.size(), &t->profile_src)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse input ICC");
     return nullptr;
   }
-  if (!DecodeProfile(output->icc.data, output->icc.size, &t->profile_dst)) {
+  if (!DecodeProfile(t->icc_dst.data(), t->icc_dst.size(), &t->profile_dst)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse output ICC");
     return nullptr;
   }
@@ -1180,12 +1513,14 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   }
 
   // Special-case SRGB <=> linear if the primaries / white point are the same,
-  // or any conversion where PQ or HLG is involved:
+  // or if the rest is a matrix, or any conversion where PQ or HLG is involved:
   bool src_linear = c_src.tf.IsLinear();
   const bool dst_linear = c_dst.tf.IsLinear();
+  const bool matrix_shapers = IsMatrixShaper(c_src) && IsMatrixShaper(c_dst);
 
   if (c_src.tf.IsPQ() || c_src.tf.IsHLG() ||
-      (c_src.tf.IsSRGB() && dst_linear && c_src.SameColorSpace(c_dst))) {
+      (c_src.tf.IsSRGB() &&
+       ((dst_linear && c_src.SameColorSpace(c_dst)) || matrix_shapers))) {
     // Construct new profile as if the data were already/still linear.
     ColorEncoding c_linear_src = c_src;
     c_linear_src.tf.SetTransferFunction(TransferFunction::kLinear);
@@ -1227,7 +1562,8 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   }
 
   if (c_dst.tf.IsPQ() || c_dst.tf.IsHLG() ||
-      (c_dst.tf.IsSRGB() && src_linear && c_src.SameColorSpace(c_dst))) {
+      (c_dst.tf.IsSRGB() &&
+       ((src_linear && c_src.SameColorSpace(c_dst)) || matrix_shapers))) {
     ColorEncoding c_linear_dst = c_dst;
     c_linear_dst.tf.SetTransferFunction(TransferFunction::kLinear);
 #if JPEGXL_ENABLE_SKCMS
@@ -1271,6 +1607,12 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
     printf("Same intermediary linear profiles, skipping CMS\n");
 #endif
     t->skip_lcms = true;
+  } else if (matrix_shapers && c_src.tf.IsLinear() && c_dst.tf.IsLinear() &&
+             MatrixBetween(c_src, c_dst, t->matrix)) {
+#if JXL_CMS_VERBOSE
+    printf("Matrix between linear profiles, skipping CMS\n");
+#endif
+    t->use_matrix = true;
   }
 
 #if JPEGXL_ENABLE_SKCMS
@@ -1286,8 +1628,7 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   const size_t channels_src = (c_src.cmyk ? 4 : c_src.Channels());
   const size_t channels_dst = c_dst.Channels();
 #if JXL_CMS_VERBOSE
-  printf("Channels: %" PRIuS "; Threads: %" PRIuS "\n", channels_src,
-         num_threads);
+  printf("Channels: %" PRIuS " -> %" PRIuS "\n", channels_src, channels_dst);
 #endif
 
 #if !JPEGXL_ENABLE_SKCMS
@@ -1299,15 +1640,65 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   // cmsDoTransform() thread-safe.
   const uint32_t flags = cmsFLAGS_NOCACHE | cmsFLAGS_BLACKPOINTCOMPENSATION |
                          cmsFLAGS_HIGHRESPRECALC;
-  t->lcms_transform =
-      cmsCreateTransformTHR(context, profile_src.get(), type_src,
-                            profile_dst.get(), type_dst, intent, flags);
-  if (t->lcms_transform == nullptr) {
+  if (!t->use_matrix) {
+    t->lcms_transform =
+        cmsCreateTransformTHR(context, profile_src.get(), type_src,
+                              profile_dst.get(), type_dst, intent, flags);
+  }
+  if (!t->use_matrix && t->lcms_transform == nullptr) {
     JXL_NOTIFY_ERROR("Failed to create transform");
     return nullptr;
   }
 #endif  // !JPEGXL_ENABLE_SKCMS
 
+  t->channels_src = channels_src;
+  t->channels_dst = channels_dst;
+
+  // Transforms that do not need the CMS are cheaper than the LUT. Gray has a
+  // single input, and CMYK would need a 4D LUT.
+  if (lut_size != 0 && channels_src == 3 && !t->skip_lcms && !t->use_matrix) {
+#if JPEGXL_ENABLE_SKCMS
+    t->lut_channels = 3;
+#else
+    t->lut_channels = channels_dst;
+#endif
+    if (!BakeLut(lut_size, t.get())) {
+      JXL_NOTIFY_ERROR("Failed to compute the LUT");
+      return nullptr;
+    }
+  }
+  return t;
+}
+
+void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
+                 const JxlColorProfile* input, const JxlColorProfile* output,
+                 float intensity_target) {
+  JXL_TRACE_EVENT("CmsInit");
+  if (init_data == nullptr) {
+    JXL_NOTIFY_ERROR("JxlCmsInit: init_data is nullptr");
+    return nullptr;
+  }
+  const auto* options = static_cast<const CmsOptions*>(init_data);
+  const JxlCmsInterface* cms = JxlGetDefaultCms();
+  if (input->icc.size == 0) {
+    JXL_NOTIFY_ERROR("JxlCmsInit: empty input ICC");
+    return nullptr;
+  }
+  if (output->icc.size == 0) {
+    JXL_NOTIFY_ERROR("JxlCmsInit: empty OUTPUT ICC");
+    return nullptr;
+  }
+  auto t = jxl::make_unique<JxlCms>();
+  TransformCache* cache = TransformCache::Get();
+  t->transform = cache->Find(*input, *output, options->lut_size);
+  if (t->transform == nullptr) {
+    t->transform = CreateTransform(cms, input, output, options->lut_size);
+    if (t->transform == nullptr) return nullptr;
+    cache->Insert(*input, *output, options->lut_size, t->transform);
+  }
+  const size_t channels_src = t->transform->channels_src;
+  const size_t channels_dst = t->transform->channels_dst;
+
   // Ideally LCMS would convert directly from External to Image3. However,
   // cmsDoTransformLineStride only accepts 32-bit BytesPerPlaneIn, whereas our
   // planes can be more than 4 GiB apart. Hence, transform inputs/outputs must
@@ -1316,8 +1707,6 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   // buffers. To avoid separate allocations, we use the rows of an image.
   // Because LCMS apparently also cannot handle <= 16 bit inputs and 32-bit
   // outputs (or vice versa), we use floating point input/output.
-  t->channels_src = channels_src;
-  t->channels_dst = channels_dst;
 #if !JPEGXL_ENABLE_SKCMS
   size_t actual_channels_src = channels_src;
   size_t actual_channels_dst = channels_dst;
@@ -1350,10 +1739,11 @@ float* JxlCmsGetDstBuf(void* cms_data, size_t thread) {
 extern "C" {
 
 JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCms() {
+  static constexpr CmsOptions kOptions = {/*lut_size=*/0};
   static constexpr JxlCmsInterface kInterface = {
       /*set_fields_data=*/nullptr,
       /*set_fields_from_icc=*/&JxlCmsSetFieldsFromICC,
-      /*init_data=*/const_cast<void*>(static_cast<const void*>(&kInterface)),
+      /*init_data=*/const_cast<void*>(static_cast<const void*>(&kOptions)),
       /*init=*/&JxlCmsInit,
       /*get_src_buf=*/&JxlCmsGetSrcBuf,
       /*get_dst_buf=*/&JxlCmsGetDstBuf,
@@ -1362,6 +1752,28 @@ JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCms() {
   return &kInterface;
 }
 
+JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCmsWithLut(
+    size_t lut_size) {
+  constexpr size_t kMinLutSize = 2;
+  constexpr size_t kMaxLutSize = 65;
+  if (lut_size < kMinLutSize || lut_size > kMaxLutSize) return nullptr;
+  struct LutCms {
+    CmsOptions options;
+    JxlCmsInterface cms;
+  };
+  // Never destroyed, like the interface of JxlGetDefaultCms.
+  static const LutCms* lut_cms = []() {
+    LutCms* all = new LutCms[kMaxLutSize + 1];
+    for (size_t i = kMinLutSize; i <= kMaxLutSize; ++i) {
+      all[i].options.lut_size = i;
+      all[i].cms = *JxlGetDefaultCms();
+      all[i].cms.init_data = &all[i].options;
+    }
+    return all;
+  }();
+  return &lut_cms[lut_size].cms;
+}
+
 }  // extern "C"
 
 }  // namespace jxl
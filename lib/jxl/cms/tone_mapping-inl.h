@@ -10,7 +10,10 @@
 #define LIB_JXL_CMS_TONE_MAPPING_INL_H_
 #endif
 
+#include <cstddef>
+#include <cstdint>
 #include <hwy/highway.h>
+#include <utility>
 
 #include "lib/jxl/cms/tone_mapping.h"
 #include "lib/jxl/cms/transfer_functions-inl.h"
@@ -95,6 +98,61 @@ class Rec2408ToneMapper : Rec2408ToneMapperBase {
   const TF_PQ tf_pq_ = TF_PQ(/*display_intensity_target=*/1.0);
 };
 
+// Same as Rec2408ToneMapper, but with the tone curve precomputed in a table
+// of kTableSize luminances, which replaces the two PQ conversions and the
+// spline by a square root and a linear interpolation. The table is indexed by
+// the square root of the relative luminance, which spends more entries in the
+// dark and knee regions where the curve bends the most. Luminances above the
+// source peak all map to the end of the curve.
+template <typename D>
+class Rec2408ToneMapperLut : Rec2408ToneMapperBase {
+ private:
+  using V = hwy::HWY_NAMESPACE::Vec<D>;
+
+ public:
+  Rec2408ToneMapperLut(std::pair<float, float> source_range,
+                       std::pair<float, float> target_range,
+                       const Vector3& primaries_luminances)
+      : Rec2408ToneMapperBase(std::move(source_range), std::move(target_range),
+                              primaries_luminances) {
+    for (size_t i = 0; i < kTableSize; ++i) {
+      const float index = static_cast<float>(i) / (kTableSize - 1);
+      table_[i] = MapLuminance(source_range_.second * index * index);
+    }
+  }
+
+  void ToneMap(V* red, V* green, V* blue) const {
+    const hwy::HWY_NAMESPACE::RebindToSigned<D> di;
+    const V relative_luminance = MulAdd(
+        Set(df_, red_Y_), *red,
+        MulAdd(Set(df_, green_Y_), *green, Mul(Set(df_, blue_Y_), *blue)));
+    const V luminance = Mul(Set(df_, source_range_.second), relative_luminance);
+    const V pos = Mul(Sqrt(Clamp(relative_luminance, Zero(df_), Set(df_, 1.f))),
+                      Set(df_, static_cast<float>(kTableSize - 1)));
+    const auto index = Min(ConvertTo(di, pos),
+                           Set(di, static_cast<int32_t>(kTableSize - 2)));
+    const V frac = Sub(pos, ConvertTo(df_, index));
+    const V lo = GatherIndex(df_, table_, index);
+    const V hi = GatherIndex(df_, table_ + 1, index);
+    const V new_luminance = MulAdd(frac, Sub(hi, lo), lo);
+    const V min_luminance = Set(df_, 1e-6f);
+    const auto use_cap = Le(luminance, min_luminance);
+    const V ratio = Div(new_luminance, Max(luminance, min_luminance));
+    const V cap = Mul(new_luminance, Set(df_, inv_target_peak_));
+    const V multiplier = Mul(ratio, Set(df_, normalizer_));
+    for (V* const val : {red, green, blue}) {
+      *val = IfThenElse(use_cap, cap, Mul(*val, multiplier));
+    }
+  }
+
+ private:
+  // 8 KiB, with errors of a few 1e-5 of the target peak.
+  static constexpr size_t kTableSize = 2048;
+
+  D df_;
+  float table_[kTableSize];
+};
+
 class HlgOOTF : HlgOOTF_Base {
  public:
   using HlgOOTF_Base::HlgOOTF_Base;
@@ -106,6 +164,10 @@ class HlgOOTF : HlgOOTF_Base {
                    primaries_luminances);
   }
 
+  static HlgOOTF WithGamma(float gamma, const Vector3& primaries_luminances) {
+    return HlgOOTF(gamma, primaries_luminances);
+  }
+
   static HlgOOTF ToSceneLight(float display_luminance,
                               const Vector3& primaries_luminances) {
     return HlgOOTF(
@@ -34,6 +34,20 @@ class Rec2408ToneMapperBase {
     const float luminance =
         source_range_.second *
         (red_Y_ * rgb[0] + green_Y_ * rgb[1] + blue_Y_ * rgb[2]);
+    const float new_luminance = MapLuminance(luminance);
+    const float min_luminance = 1e-6f;
+    const bool use_cap = (luminance <= min_luminance);
+    const float ratio = new_luminance / std::max(luminance, min_luminance);
+    const float cap = new_luminance * inv_target_peak_;
+    const float multiplier = ratio * normalizer_;
+    for (size_t idx : {0, 1, 2}) {
+      rgb[idx] = use_cap ? cap : rgb[idx] * multiplier;
+    }
+  }
+
+ protected:
+  // Returns the tone mapped luminance, in nits.
+  float MapLuminance(const float luminance) const {
     const float normalized_pq =
         std::min(1.f, (InvEOTF(luminance) - pq_mastering_min_) *
                           inv_pq_mastering_range_);
@@ -45,18 +59,9 @@ class Rec2408ToneMapperBase {
     const float e4 = e3 * pq_mastering_range_ + pq_mastering_min_;
     const float d4 =
         TF_PQ_Base::DisplayFromEncoded(/*display_intensity_target=*/1.0, e4);
-    const float new_luminance = Clamp1(d4, 0.f, target_range_.second);
-    const float min_luminance = 1e-6f;
-    const bool use_cap = (luminance <= min_luminance);
-    const float ratio = new_luminance / std::max(luminance, min_luminance);
-    const float cap = new_luminance * inv_target_peak_;
-    const float multiplier = ratio * normalizer_;
-    for (size_t idx : {0, 1, 2}) {
-      rgb[idx] = use_cap ? cap : rgb[idx] * multiplier;
-    }
+    return Clamp1(d4, 0.f, target_range_.second);
   }
 
- protected:
   static float InvEOTF(const float luminance) {
     return TF_PQ_Base::EncodedFromDisplay(/*display_intensity_target=*/1.0,
                                           luminance);
@@ -60,6 +60,43 @@ HWY_NOINLINE void TestRec2408ToneMap() {
   printf("max abs err %e\n", static_cast<double>(max_abs_err));
 }
 
+HWY_NOINLINE void TestRec2408ToneMapLut() {
+  constexpr size_t kNumMappers = 1 << 6;
+  constexpr size_t kNumTrials = 1 << 14;
+  Rng rng(1);
+  float max_abs_err = 0;
+  HWY_FULL(float) d;
+  for (size_t i = 0; i < kNumMappers; i++) {
+    float src = rng.UniformF(1000.0f, 10000.0f);
+    float tgt = rng.UniformF(80.0f, 300.0f);
+    Vector3 luminances{rng.UniformF(0.2f, 0.4f), rng.UniformF(0.2f, 0.4f),
+                       rng.UniformF(0.2f, 0.4f)};
+    Rec2408ToneMapperLut<decltype(d)> tone_mapper({0.0f, src}, {0.0f, tgt},
+                                                  luminances);
+    Rec2408ToneMapperBase tone_mapper_base({0.0f, src}, {0.0f, tgt},
+                                           luminances);
+    for (size_t j = 0; j < kNumTrials; j++) {
+      // Also cover the dark part of the curve, which gets most of the entries.
+      const float max_value = (j % 2 == 0) ? 1.0f : 1e-3f;
+      Color rgb{rng.UniformF(0.0f, max_value), rng.UniformF(0.0f, max_value),
+                rng.UniformF(0.0f, max_value)};
+      auto r = Set(d, rgb[0]);
+      auto g = Set(d, rgb[1]);
+      auto b = Set(d, rgb[2]);
+      tone_mapper.ToneMap(&r, &g, &b);
+      tone_mapper_base.ToneMap(rgb);
+      const float abs_err_r = std::abs(rgb[0] - GetLane(r));
+      const float abs_err_g = std::abs(rgb[1] - GetLane(g));
+      const float abs_err_b = std::abs(rgb[2] - GetLane(b));
+      EXPECT_LT(abs_err_r, 1e-4);
+      EXPECT_LT(abs_err_g, 1e-4);
+      EXPECT_LT(abs_err_b, 1e-4);
+      max_abs_err = std::max({max_abs_err, abs_err_r, abs_err_g, abs_err_b});
+    }
+  }
+  printf("max abs err %e\n", static_cast<double>(max_abs_err));
+}
+
 HWY_NOINLINE void TestHlgOotfApply() {
   constexpr size_t kNumTrials = 1 << 23;
   Rng rng(1);
@@ -142,6 +179,7 @@ class ToneMappingTargetTest : public hwy::TestWithParamTarget {};
 HWY_TARGET_INSTANTIATE_TEST_SUITE_P(ToneMappingTargetTest);
 
 HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestRec2408ToneMap);
+HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestRec2408ToneMapLut);
 HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestHlgOotfApply);
 HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestGamutMap);
 
@@ -9,6 +9,8 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <mutex>
 #include <vector>
 
 #include "lib/jxl/ac_strategy.h"
@@ -30,6 +32,23 @@ uint32_t CoeffOrderContext(uint32_t val) {
   return std::min(token, kPermutationContexts - 1);
 }
 
+const coeff_order_t* NaturalCoeffOrder(uint8_t ord) {
+  static std::once_flag computed[kNumOrders];
+  static std::vector<coeff_order_t> natural_orders[kNumOrders];
+  JXL_DASSERT(ord < kNumOrders);
+  std::call_once(computed[ord], [ord]() {
+    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
+      if (kStrategyOrder[o] != ord) continue;
+      AcStrategy acs = AcStrategy::FromRawStrategy(o);
+      natural_orders[ord].resize(kDCTBlockSize * acs.covered_blocks_x() *
+                                 acs.covered_blocks_y());
+      acs.ComputeNaturalCoeffOrder(natural_orders[ord].data());
+      break;
+    }
+  });
+  return natural_orders[ord].data();
+}
+
 namespace {
 Status ReadPermutation(size_t skip, size_t size, coeff_order_t* order,
                        BitReader* br, ANSSymbolReader* reader,
@@ -80,7 +99,7 @@ namespace {
 
 Status DecodeCoeffOrder(AcStrategy acs, coeff_order_t* order, BitReader* br,
                         ANSSymbolReader* reader,
-                        std::vector<coeff_order_t>& natural_order,
+                        const coeff_order_t* natural_order,
                         const std::vector<uint8_t>& context_map) {
   const size_t llf = acs.covered_blocks_x() * acs.covered_blocks_y();
   const size_t size = kDCTBlockSize * llf;
@@ -103,7 +122,6 @@ Status DecodeCoeffOrders(JxlMemoryManager* memory_manager, uint16_t used_orders,
   std::vector<uint8_t> context_map;
   ANSCode code;
   ANSSymbolReader reader;
-  std::vector<coeff_order_t> natural_order;
   // Bitstream does not have histograms if no coefficient order is used.
   if (used_orders != 0) {
     JXL_RETURN_IF_ERROR(DecodeHistograms(
@@ -125,16 +143,16 @@ Status DecodeCoeffOrders(JxlMemoryManager* memory_manager, uint16_t used_orders,
     const size_t llf = acs.covered_blocks_x() * acs.covered_blocks_y();
     const size_t size = kDCTBlockSize * llf;
 
+    const coeff_order_t* natural_order = nullptr;
     if (used || (used_orders & (1 << ord))) {
-      if (natural_order.size() < size) natural_order.resize(size);
-      acs.ComputeNaturalCoeffOrder(natural_order.data());
+      natural_order = NaturalCoeffOrder(ord);
     }
 
     if ((used_orders & (1 << ord)) == 0) {
       // No need to set the default order if no ACS uses this order.
       if (used) {
         for (size_t c = 0; c < 3; c++) {
-          memcpy(&order[CoeffOrderOffset(ord, c)], natural_order.data(),
+          memcpy(&order[CoeffOrderOffset(ord, c)], natural_order,
                  size * sizeof(*order));
         }
       }
@@ -50,6 +50,11 @@ constexpr JXL_MAYBE_UNUSED uint32_t kPermutationContexts = 8;
 
 uint32_t CoeffOrderContext(uint32_t val);
 
+// Returns the natural coefficient order of the AC strategies of order bucket
+// `ord`. The orders are computed once per process, on first use of each
+// bucket, and shared read-only between all decoders and encoders.
+const coeff_order_t* NaturalCoeffOrder(uint8_t ord);
+
 Status DecodeCoeffOrders(JxlMemoryManager* memory_manager, uint16_t used_orders,
                          uint32_t used_acs, coeff_order_t* order,
                          BitReader* br);
@@ -5,7 +5,14 @@
 
 #include "lib/jxl/color_encoding_internal.h"
 
+#include <jxl/color_encoding.h>
+
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/status.h"
@@ -16,6 +23,97 @@
 
 namespace jxl {
 
+namespace {
+
+// Process-wide cache of the most recently created ICC profiles. Every image
+// whose color space is signalled with enums needs one to be synthesized when
+// it is decoded, and most of them use one of a few standard color spaces, e.g.
+// sRGB or Display P3. Encoders usually receive these same profiles back, for
+// which the fields are then known without parsing them with the CMS.
+class ProfileCache {
+ public:
+  static ProfileCache* Get() {
+    // Never destroyed, so that it can be used until the end of the process.
+    static ProfileCache* cache = new ProfileCache();
+    return cache;
+  }
+
+  bool FindProfile(const JxlColorEncoding& c, IccBytes* icc) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (SameEncoding(it->encoding, c)) {
+        entries_.splice(entries_.begin(), entries_, it);
+        *icc = entries_.front().icc;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool FindEncoding(const IccBytes& icc, JxlColorEncoding* c) {
+    const uint64_t hash = Hash(icc);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->hash == hash && it->icc == icc) {
+        entries_.splice(entries_.begin(), entries_, it);
+        *c = entries_.front().encoding;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Insert(const JxlColorEncoding& c, const IccBytes& icc) {
+    Entry entry;
+    entry.encoding = c;
+    entry.hash = Hash(icc);
+    entry.icc = icc;
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Another thread may have inserted the same encoding in the meantime.
+    entries_.remove_if(
+        [&](const Entry& other) { return SameEncoding(other.encoding, c); });
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > kCapacity) entries_.pop_back();
+  }
+
+ private:
+  struct Entry {
+    JxlColorEncoding encoding;
+    uint64_t hash;
+    IccBytes icc;
+  };
+
+  static constexpr size_t kCapacity = 16;
+
+  // FNV-1a of the profile.
+  static uint64_t Hash(const IccBytes& icc) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint8_t byte : icc) hash = (hash ^ byte) * 0x100000001b3ull;
+    return (hash ^ icc.size()) * 0x100000001b3ull;
+  }
+
+  static bool SameEncoding(const JxlColorEncoding& a,
+                           const JxlColorEncoding& b) {
+    return a.color_space == b.color_space && a.white_point == b.white_point &&
+           a.white_point_xy[0] == b.white_point_xy[0] &&
+           a.white_point_xy[1] == b.white_point_xy[1] &&
+           a.primaries == b.primaries &&
+           a.primaries_red_xy[0] == b.primaries_red_xy[0] &&
+           a.primaries_red_xy[1] == b.primaries_red_xy[1] &&
+           a.primaries_green_xy[0] == b.primaries_green_xy[0] &&
+           a.primaries_green_xy[1] == b.primaries_green_xy[1] &&
+           a.primaries_blue_xy[0] == b.primaries_blue_xy[0] &&
+           a.primaries_blue_xy[1] == b.primaries_blue_xy[1] &&
+           a.transfer_function == b.transfer_function && a.gamma == b.gamma &&
+           a.rendering_intent == b.rendering_intent;
+  }
+
+  std::mutex mutex_;
+  std::list<Entry> entries_;  // Most recently used first.
+};
+
+}  // namespace
+
 bool CustomTransferFunction::SetImplicit() {
   if (nonserialized_color_space == ColorSpace::kXYB) {
     JXL_RETURN_IF_ERROR(storage_.SetGamma(1.0 / 3));
@@ -73,10 +171,44 @@ Status ColorEncoding::SetPrimariesType(const Primaries& p) {
   return true;
 }
 
+Status ColorEncoding::CreateICC() {
+  storage_.icc.clear();
+  const JxlColorEncoding external = ToExternal();
+  ProfileCache* cache = ProfileCache::Get();
+  if (cache->FindProfile(external, &storage_.icc)) return true;
+  if (!MaybeCreateProfile(external, &storage_.icc)) {
+    storage_.icc.clear();
+    return JXL_FAILURE("Failed to create ICC profile");
+  }
+  cache->Insert(external, storage_.icc);
+  return true;
+}
+
+Status ColorEncoding::SetICC(IccBytes&& icc, const JxlCmsInterface* cms) {
+  JXL_ENSURE(cms != nullptr);
+  JXL_ENSURE(!icc.empty());
+  JxlColorEncoding external;
+  if (ProfileCache::Get()->FindEncoding(icc, &external)) {
+    // Same as SetFieldsFromICC, the profile was created from `external`.
+    storage_.icc.clear();
+    storage_.cmyk = false;
+    want_icc_ = storage_.FromExternal(external);
+    if (want_icc_) storage_.icc = std::move(icc);
+    return want_icc_;
+  }
+  want_icc_ = storage_.SetFieldsFromICC(std::move(icc), *cms);
+  return want_icc_;
+}
+
 void ColorEncoding::DecideIfWantICC(const JxlCmsInterface& cms) {
   if (storage_.icc.empty()) return;
 
   JxlColorEncoding c;
+  // Profiles created from fields can be represented by them.
+  if (ProfileCache::Get()->FindEncoding(storage_.icc, &c)) {
+    want_icc_ = false;
+    return;
+  }
   JXL_BOOL cmyk;
   if (!cms.set_fields_from_icc(cms.set_fields_data, storage_.icc.data(),
                                storage_.icc.size(), &c, &cmyk)) {
@@ -128,16 +128,9 @@ struct ColorEncoding : public Fields {
   static const ColorEncoding& LinearSRGB(bool is_gray = false);
 
   // Returns true if an ICC profile was successfully created from fields.
-  // Must be called after modifying fields. Defined in color_management.cc.
-  Status CreateICC() {
-    storage_.icc.clear();
-    const JxlColorEncoding external = ToExternal();
-    if (!MaybeCreateProfile(external, &storage_.icc)) {
-      storage_.icc.clear();
-      return JXL_FAILURE("Failed to create ICC profile");
-    }
-    return true;
-  }
+  // Must be called after modifying fields.
+  // The profiles of the most recently used encodings are cached.
+  Status CreateICC();
 
   // Returns non-empty and valid ICC profile, unless:
   // - WantICC() == true and SetICC() was not yet called;
@@ -147,12 +140,9 @@ struct ColorEncoding : public Fields {
   // Returns true if `icc` is assigned and decoded successfully. If so,
   // subsequent WantICC() will return true until DecideIfWantICC() changes it.
   // Returning false indicates data has been lost.
-  Status SetICC(IccBytes&& icc, const JxlCmsInterface* cms) {
-    JXL_ENSURE(cms != nullptr);
-    JXL_ENSURE(!icc.empty());
-    want_icc_ = storage_.SetFieldsFromICC(std::move(icc), *cms);
-    return want_icc_;
-  }
+  // Profiles previously returned by CreateICC() are recognized without
+  // parsing them.
+  Status SetICC(IccBytes&& icc, const JxlCmsInterface* cms);
 
   // Sets the raw ICC profile bytes, without parsing the ICC, and without
   // updating the direct fields such as white point, primaries and color
@@ -170,9 +170,16 @@ TEST_P(ColorManagementTest, VerifyAllProfiles) {
   // Can create profile.
   ASSERT_TRUE(actual.CreateICC());
 
-  // Can set an equivalent ColorEncoding from the generated ICC profile.
+  // Can set an equivalent ColorEncoding from the generated ICC profile. It is
+  // parsed by the CMS, SetICC would recognize it as created by CreateICC.
+  const JxlCmsInterface& cms = *JxlGetDefaultCms();
+  JxlColorEncoding parsed;
+  JXL_BOOL cmyk;
+  ASSERT_TRUE(cms.set_fields_from_icc(cms.set_fields_data, actual.ICC().data(),
+                                      actual.ICC().size(), &parsed, &cmyk));
+  ASSERT_FALSE(cmyk);
   ColorEncoding expected;
-  ASSERT_TRUE(expected.SetICC(IccBytes(actual.ICC()), JxlGetDefaultCms()));
+  ASSERT_TRUE(expected.FromExternal(parsed));
 
   EXPECT_EQ(actual.GetRenderingIntent(), expected.GetRenderingIntent())
       << "different rendering intent: " << ToString(actual.GetRenderingIntent())
@@ -204,6 +211,25 @@ TEST_P(ColorManagementTest, VerifyAllProfiles) {
   VerifyPixelRoundTrip(actual);
 }
 
+TEST_P(ColorManagementTest, CachedProfiles) {
+  ColorEncoding c = ColorEncodingFromDescriptor(GetParam());
+  ASSERT_TRUE(c.CreateICC());
+  // Created again from the cache.
+  ColorEncoding same = ColorEncodingFromDescriptor(GetParam());
+  ASSERT_TRUE(same.CreateICC());
+  EXPECT_EQ(c.ICC(), same.ICC());
+
+  // The profile is recognized without parsing it, and does not need to be
+  // stored in the codestream.
+  ColorEncoding from_icc;
+  ASSERT_TRUE(from_icc.SetICC(IccBytes(c.ICC()), JxlGetDefaultCms()));
+  EXPECT_TRUE(from_icc.WantICC());
+  EXPECT_TRUE(from_icc.SameColorEncoding(c));
+  EXPECT_EQ(from_icc.ICC(), c.ICC());
+  from_icc.DecideIfWantICC(*JxlGetDefaultCms());
+  EXPECT_FALSE(from_icc.WantICC());
+}
+
 #define EXPECT_CIEXY_NEAR(A, E, T)                                       \
   {                                                                      \
     CIExy _actual = (A);                                                 \
@@ -272,6 +298,112 @@ TEST_F(ColorManagementTest, D2700ToSRGB) {
   EXPECT_ARRAY_NEAR(sRGB_values, sRGB_expected, 1e-3);
 }
 
+// The second transform reuses the cached state of the first one, which must
+// not depend on the profiles or the transform that created it.
+TEST_F(ColorManagementTest, CachedTransformOutlivesProfiles) {
+  const std::vector<uint8_t> icc_data =
+      jxl::test::ReadTestData("jxl/color_management/sRGB-D2700.icc");
+  const Color sRGB_D2700_values{0.863, 0.737, 0.490};
+  const Color sRGB_expected{0.914, 0.745, 0.601};
+  for (size_t i = 0; i < 2; ++i) {
+    IccBytes icc;
+    Bytes(icc_data).AppendTo(icc);
+    ColorEncoding sRGB_D2700;
+    ASSERT_TRUE(sRGB_D2700.SetICC(std::move(icc), JxlGetDefaultCms()));
+    ColorSpaceTransform transform(*JxlGetDefaultCms());
+    ASSERT_TRUE(transform.Init(sRGB_D2700, ColorEncoding::SRGB(),
+                               kDefaultIntensityTarget, 16, 2));
+    for (size_t thread = 0; thread < 2; ++thread) {
+      Color sRGB_values;
+      ASSERT_TRUE(transform.Run(thread, sRGB_D2700_values.data(),
+                                sRGB_values.data(), 1));
+      EXPECT_ARRAY_NEAR(sRGB_values, sRGB_expected, 1e-3);
+    }
+  }
+}
+
+TEST_F(ColorManagementTest, MatrixShaperP3ToSRGB) {
+  ColorEncoding linear_p3;
+  linear_p3.SetColorSpace(ColorSpace::kRGB);
+  ASSERT_TRUE(linear_p3.SetWhitePointType(WhitePoint::kD65));
+  ASSERT_TRUE(linear_p3.SetPrimariesType(Primaries::kP3));
+  linear_p3.Tf().SetTransferFunction(TransferFunction::kLinear);
+  ASSERT_TRUE(linear_p3.CreateICC());
+  ColorSpaceTransform to_linear_srgb(*JxlGetDefaultCms());
+  ASSERT_TRUE(to_linear_srgb.Init(linear_p3, ColorEncoding::LinearSRGB(),
+                                  kDefaultIntensityTarget, 1, 1));
+  Color p3_red{1., 0., 0.};
+  Color srgb_red;
+  ASSERT_TRUE(to_linear_srgb.Run(0, p3_red.data(), srgb_red.data(), 1));
+  Color srgb_red_expected{1.2249, -0.0421, -0.0196};
+  EXPECT_ARRAY_NEAR(srgb_red, srgb_red_expected, 1e-3);
+
+  // Roundtrip with the sRGB transfer function, on a row longer than a vector
+  // and not a multiple of its length.
+  ColorEncoding p3 = linear_p3;
+  p3.Tf().SetTransferFunction(TransferFunction::kSRGB);
+  ASSERT_TRUE(p3.CreateICC());
+  constexpr size_t kXSize = 37;
+  ColorSpaceTransform to_p3(*JxlGetDefaultCms());
+  ColorSpaceTransform from_p3(*JxlGetDefaultCms());
+  ASSERT_TRUE(to_p3.Init(ColorEncoding::SRGB(), p3, kDefaultIntensityTarget,
+                         kXSize, 1));
+  ASSERT_TRUE(from_p3.Init(p3, ColorEncoding::SRGB(), kDefaultIntensityTarget,
+                           kXSize, 1));
+  std::vector<float> srgb(kXSize * 3);
+  for (size_t i = 0; i < srgb.size(); ++i) {
+    srgb[i] = ((i * 7) % 11) / 10.f;
+  }
+  std::vector<float> in_p3(kXSize * 3);
+  std::vector<float> roundtrip(kXSize * 3);
+  ASSERT_TRUE(to_p3.Run(0, srgb.data(), in_p3.data(), kXSize));
+  ASSERT_TRUE(from_p3.Run(0, in_p3.data(), roundtrip.data(), kXSize));
+  for (size_t i = 0; i < srgb.size(); ++i) {
+    EXPECT_NEAR(srgb[i], roundtrip[i], 1e-4) << i;
+  }
+}
+
+TEST_F(ColorManagementTest, LutMatchesCms) {
+  // A gamma is not converted with a matrix, so this goes through the CMS.
+  ColorEncoding p3_gamma;
+  p3_gamma.SetColorSpace(ColorSpace::kRGB);
+  ASSERT_TRUE(p3_gamma.SetWhitePointType(WhitePoint::kD65));
+  ASSERT_TRUE(p3_gamma.SetPrimariesType(Primaries::kP3));
+  ASSERT_TRUE(p3_gamma.Tf().SetGamma(1 / 2.2));
+  ASSERT_TRUE(p3_gamma.CreateICC());
+  EXPECT_EQ(nullptr, JxlGetDefaultCmsWithLut(1));
+  EXPECT_EQ(nullptr, JxlGetDefaultCmsWithLut(66));
+  const JxlCmsInterface* lut_cms = JxlGetDefaultCmsWithLut(33);
+  ASSERT_NE(nullptr, lut_cms);
+
+  constexpr size_t kXSize = 37;
+  ColorSpaceTransform exact(*JxlGetDefaultCms());
+  ColorSpaceTransform interpolated(*lut_cms);
+  ASSERT_TRUE(exact.Init(p3_gamma, ColorEncoding::SRGB(),
+                         kDefaultIntensityTarget, kXSize, 1));
+  ASSERT_TRUE(interpolated.Init(p3_gamma, ColorEncoding::SRGB(),
+                                kDefaultIntensityTarget, kXSize, 1));
+  std::vector<float> in(kXSize * 3);
+  for (size_t i = 0; i < in.size(); ++i) {
+    in[i] = ((i * 7) % 11) / 10.f;
+  }
+  std::vector<float> expected(kXSize * 3);
+  std::vector<float> actual(kXSize * 3);
+  ASSERT_TRUE(exact.Run(0, in.data(), expected.data(), kXSize));
+  ASSERT_TRUE(interpolated.Run(0, in.data(), actual.data(), kXSize));
+  for (size_t i = 0; i < in.size(); ++i) {
+    EXPECT_NEAR(expected[i], actual[i], 2e-3) << i;
+  }
+
+  // Rows with out of range values are not clamped to the grid.
+  in[0] = 1.5f;
+  ASSERT_TRUE(exact.Run(0, in.data(), expected.data(), kXSize));
+  ASSERT_TRUE(interpolated.Run(0, in.data(), actual.data(), kXSize));
+  for (size_t i = 0; i < in.size(); ++i) {
+    EXPECT_NEAR(expected[i], actual[i], 1e-6) << i;
+  }
+}
+
 TEST_F(ColorManagementTest, P3HlgTo2020Hlg) {
   ColorEncoding p3_hlg;
   p3_hlg.SetColorSpace(ColorSpace::kRGB);
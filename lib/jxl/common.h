@@ -14,6 +14,14 @@
 #define JXL_HIGH_PRECISION 1
 #endif
 
+// Experimental: if set, the low-memory render pipeline stores the borders
+// shared by adjacent groups as float16. This halves the memory and bandwidth
+// they use, but rounds the samples near group boundaries, so the output is not
+// conformant.
+#ifndef JXL_HALF_PRECISION_BORDERS
+#define JXL_HALF_PRECISION_BORDERS 0
+#endif
+
 // Macro that defines whether support for decoding JXL files to JPEG is enabled.
 #ifndef JPEGXL_ENABLE_TRANSCODE_JPEG
 #define JPEGXL_ENABLE_TRANSCODE_JPEG 1
@@ -57,10 +65,10 @@ enum class SpeedTier {
   // Turns off most encoder features. Does context clustering.
   // Modular: uses fixed tree with Weighted predictor.
   kFalcon = 7,
-  // Currently fastest possible setting for VarDCT.
+  // Turns off the remaining VarDCT encoder features.
   // Modular: uses fixed tree with Gradient predictor.
   kThunder = 8,
-  // VarDCT: same as kThunder.
+  // VarDCT: like kThunder, with fixed Gradient DC tree and prefix codes only.
   // Modular: no tree, Gradient predictor, fast histograms
   kLightning = 9
 };
@@ -10,11 +10,15 @@
 #define LIB_JXL_CONVOLVE_INL_H_
 #endif
 
+#include <algorithm>
+#include <cstdint>
 #include <hwy/highway.h>
 
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/convolve.h"
 #include "lib/jxl/image_ops.h"
 
 HWY_BEFORE_NAMESPACE();
@@ -179,8 +183,8 @@ class ConvolveT {
 
   // "Image" is ImageF or Image3F.
   template <class Image, class Weights>
-  static void Run(const Image& in, const Rect& rect, const Weights& weights,
-                  ThreadPool* pool, Image* out) {
+  static Status Run(const Image& in, const Rect& rect, const Weights& weights,
+                    ThreadPool* pool, Image* out) {
     JXL_DASSERT(SameSize(rect, *out));
     JXL_DASSERT(rect.xsize() >= MinWidth());
 
@@ -236,61 +240,74 @@ class ConvolveT {
   }
 
   template <size_t kSizeModN, class Weights>
-  static JXL_INLINE void RunInteriorRows(const ImageF& in, const Rect& rect,
-                                         const int64_t ybegin,
-                                         const int64_t yend,
-                                         const Weights& weights,
-                                         ThreadPool* pool, ImageF* out) {
+  static JXL_INLINE Status RunInteriorRows(const ImageF& in, const Rect& rect,
+                                           const int64_t ybegin,
+                                           const int64_t yend,
+                                           const Weights& weights,
+                                           ThreadPool* pool, ImageF* out) {
     const int64_t stride = in.PixelsPerRow();
-    const auto process_row = [&](const uint32_t y, size_t /*thread*/) HWY_ATTR {
-      RunRow<kSizeModN>(rect.ConstRow(in, y), rect.xsize(), stride,
-                        WrapRowUnchanged(), weights, out->Row(y));
+    const int64_t rows_per_task = kConvolveRowsPerTask;
+    const auto process_rows = [&](const uint32_t task,
+                                  size_t /*thread*/) HWY_ATTR {
+      const int64_t y0 = ybegin + task * rows_per_task;
+      const int64_t y1 = std::min(y0 + rows_per_task, yend);
+      for (int64_t y = y0; y < y1; ++y) {
+        RunRow<kSizeModN>(rect.ConstRow(in, y), rect.xsize(), stride,
+                          WrapRowUnchanged(), weights, out->Row(y));
+      }
       return true;
     };
-    Status status = RunOnPool(pool, ybegin, yend, ThreadPool::NoInit,
-                              process_row, "Convolve");
-    (void)status;
-    JXL_DASSERT(status);
+    const uint32_t num_tasks =
+        static_cast<uint32_t>(DivCeil(yend - ybegin, rows_per_task));
+    return RunOnPool(pool, 0, num_tasks, ThreadPool::NoInit, process_rows,
+                     "Convolve");
   }
 
   // Image3F.
   template <size_t kSizeModN, class Weights>
-  static JXL_INLINE void RunInteriorRows(const Image3F& in, const Rect& rect,
-                                         const int64_t ybegin,
-                                         const int64_t yend,
-                                         const Weights& weights,
-                                         ThreadPool* pool, Image3F* out) {
+  static JXL_INLINE Status RunInteriorRows(const Image3F& in, const Rect& rect,
+                                           const int64_t ybegin,
+                                           const int64_t yend,
+                                           const Weights& weights,
+                                           ThreadPool* pool, Image3F* out) {
     const int64_t stride = in.PixelsPerRow();
-    const auto process_row = [&](const uint32_t y, size_t /*thread*/) HWY_ATTR {
-      for (size_t c = 0; c < 3; ++c) {
-        RunRow<kSizeModN>(rect.ConstPlaneRow(in, c, y), rect.xsize(), stride,
-                          WrapRowUnchanged(), weights, out->PlaneRow(c, y));
+    const int64_t rows_per_task = kConvolveRowsPerTask;
+    const auto process_rows = [&](const uint32_t task,
+                                  size_t /*thread*/) HWY_ATTR {
+      const int64_t y0 = ybegin + task * rows_per_task;
+      const int64_t y1 = std::min(y0 + rows_per_task, yend);
+      for (int64_t y = y0; y < y1; ++y) {
+        for (size_t c = 0; c < 3; ++c) {
+          RunRow<kSizeModN>(rect.ConstPlaneRow(in, c, y), rect.xsize(), stride,
+                            WrapRowUnchanged(), weights, out->PlaneRow(c, y));
+        }
       }
       return true;
     };
-    Status status = RunOnPool(pool, ybegin, yend, ThreadPool::NoInit,
-                              process_row, "Convolve3");
-    (void)status;
-    JXL_DASSERT(status);
+    const uint32_t num_tasks =
+        static_cast<uint32_t>(DivCeil(yend - ybegin, rows_per_task));
+    return RunOnPool(pool, 0, num_tasks, ThreadPool::NoInit, process_rows,
+                     "Convolve3");
   }
 
   template <size_t kSizeModN, class Image, class Weights>
-  static JXL_INLINE void RunRows(const Image& in, const Rect& rect,
-                                 const Weights& weights, ThreadPool* pool,
-                                 Image* out) {
+  static JXL_INLINE Status RunRows(const Image& in, const Rect& rect,
+                                   const Weights& weights, ThreadPool* pool,
+                                   Image* out) {
     const int64_t ysize = rect.ysize();
     RunBorderRows<kSizeModN>(in, rect, 0,
                              std::min(static_cast<int64_t>(kRadius), ysize),
                              weights, out);
     if (ysize > 2 * static_cast<int64_t>(kRadius)) {
-      RunInteriorRows<kSizeModN>(in, rect, static_cast<int64_t>(kRadius),
-                                 ysize - static_cast<int64_t>(kRadius), weights,
-                                 pool, out);
+      JXL_RETURN_IF_ERROR(RunInteriorRows<kSizeModN>(
+          in, rect, static_cast<int64_t>(kRadius),
+          ysize - static_cast<int64_t>(kRadius), weights, pool, out));
     }
     if (ysize > static_cast<int64_t>(kRadius)) {
       RunBorderRows<kSizeModN>(in, rect, ysize - static_cast<int64_t>(kRadius),
                                ysize, weights, out);
     }
+    return true;
   }
 };
 
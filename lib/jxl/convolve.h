@@ -24,6 +24,11 @@ namespace jxl {
 // Requires xsize >= kConvolveLanes + kConvolveMaxRadius.
 static constexpr size_t kConvolveMaxRadius = 3;
 
+// Number of consecutive output rows computed by one task of the multithreaded
+// convolutions. The input rows they share then stay in the cache of the thread
+// that runs the task, and the per-task overhead of the pool is amortized.
+static constexpr size_t kConvolveRowsPerTask = 16;
+
 // Weights must already be normalized.
 
 struct WeightsSymmetric3 {
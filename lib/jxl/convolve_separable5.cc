@@ -241,7 +241,7 @@ Status Separable5(const ImageF& in, const Rect& rect,
     JXL_ENSURE(SameSize(rect, *out));
     JXL_ENSURE(rect.xsize() >= Conv::MinWidth());
 
-    Conv::Run(in, rect, weights, pool, out);
+    JXL_RETURN_IF_ERROR(Conv::Run(in, rect, weights, pool, out));
     return true;
   }
 
@@ -175,7 +175,7 @@ Status Symmetric3(const ImageF& in, const Rect& rect,
   if (rect.xsize() >= Conv::MinWidth()) {
     JXL_ENSURE(SameSize(rect, *out));
     JXL_ENSURE(rect.xsize() >= Conv::MinWidth());
-    Conv::Run(in, rect, weights, pool, out);
+    JXL_RETURN_IF_ERROR(Conv::Run(in, rect, weights, pool, out));
     return true;
   }
 
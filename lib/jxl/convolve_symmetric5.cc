@@ -148,23 +148,28 @@ Status Symmetric5(const ImageF& in, const Rect& in_rect,
   JXL_ENSURE(in_rect.xsize() == out_rect.xsize());
   JXL_ENSURE(in_rect.ysize() == out_rect.ysize());
   const size_t ysize = in_rect.ysize();
-  const auto process_row = [&](const uint32_t task,
-                               size_t /*thread*/) -> Status {
-    const int64_t riy = task;
-    const int64_t iy = in_rect.y0() + riy;
-
-    if (iy < 2 || iy >= static_cast<ssize_t>(in.ysize()) - 2) {
-      Symmetric5Row<WrapMirror>(in, in_rect, iy, weights,
-                                out_rect.Row(out, riy));
-    } else {
-      Symmetric5Row<WrapUnchanged>(in, in_rect, iy, weights,
-                                   out_rect.Row(out, riy));
+  const auto process_rows = [&](const uint32_t task,
+                                size_t /*thread*/) -> Status {
+    const size_t ry0 = task * kConvolveRowsPerTask;
+    const size_t ry1 = std::min<size_t>(ry0 + kConvolveRowsPerTask, ysize);
+    for (size_t ry = ry0; ry < ry1; ++ry) {
+      const int64_t riy = ry;
+      const int64_t iy = in_rect.y0() + riy;
+
+      if (iy < 2 || iy >= static_cast<ssize_t>(in.ysize()) - 2) {
+        Symmetric5Row<WrapMirror>(in, in_rect, iy, weights,
+                                  out_rect.Row(out, riy));
+      } else {
+        Symmetric5Row<WrapUnchanged>(in, in_rect, iy, weights,
+                                     out_rect.Row(out, riy));
+      }
     }
     return true;
   };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(ysize),
-                                ThreadPool::NoInit, process_row,
-                                "Symmetric5x5Convolution"));
+  const uint32_t num_tasks =
+      static_cast<uint32_t>(DivCeil(ysize, kConvolveRowsPerTask));
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_tasks, ThreadPool::NoInit,
+                                process_rows, "Symmetric5x5Convolution"));
   return true;
 }
 
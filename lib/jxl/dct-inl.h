@@ -30,6 +30,7 @@ using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
 using hwy::HWY_NAMESPACE::NegMulAdd;
 using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Vec;
 
 template <size_t SZ>
 struct FVImpl {
@@ -204,6 +205,78 @@ struct IDCT1DImpl<2, SZ> {
   }
 };
 
+// 8-point IDCT of the vectors in0..in7, with the same operations, in the same
+// order, as the generic IDCT1DImpl below would do, but with all intermediate
+// values kept in registers. Stores the 8 output vectors at `to`.
+template <class DF>
+JXL_INLINE void IDCT8Vectors(DF d, Vec<DF> in0, Vec<DF> in1, Vec<DF> in2,
+                             Vec<DF> in3, Vec<DF> in4, Vec<DF> in5,
+                             Vec<DF> in6, Vec<DF> in7, float* to,
+                             size_t to_stride) {
+  const auto sqrt2 = Set(d, kSqrt2);
+  const auto w4_0 = Set(d, WcMultipliers<4>::kMultipliers[0]);
+  const auto w4_1 = Set(d, WcMultipliers<4>::kMultipliers[1]);
+
+  // 4-point IDCT of the even coefficients.
+  const auto ea0 = Add(in0, in4);
+  const auto ea1 = Sub(in0, in4);
+  const auto eb0 = Mul(in2, sqrt2);
+  const auto eb1 = Add(in6, in2);
+  const auto ec0 = Add(eb0, eb1);
+  const auto ec1 = Sub(eb0, eb1);
+  const auto e0 = MulAdd(w4_0, ec0, ea0);
+  const auto e3 = NegMulAdd(w4_0, ec0, ea0);
+  const auto e1 = MulAdd(w4_1, ec1, ea1);
+  const auto e2 = NegMulAdd(w4_1, ec1, ea1);
+
+  // BTranspose, then 4-point IDCT of the odd coefficients.
+  const auto b0 = Mul(in1, sqrt2);
+  const auto b1 = Add(in3, in1);
+  const auto b2 = Add(in5, in3);
+  const auto b3 = Add(in7, in5);
+  const auto oa0 = Add(b0, b2);
+  const auto oa1 = Sub(b0, b2);
+  const auto ob0 = Mul(b1, sqrt2);
+  const auto ob1 = Add(b3, b1);
+  const auto oc0 = Add(ob0, ob1);
+  const auto oc1 = Sub(ob0, ob1);
+  const auto o0 = MulAdd(w4_0, oc0, oa0);
+  const auto o3 = NegMulAdd(w4_0, oc0, oa0);
+  const auto o1 = MulAdd(w4_1, oc1, oa1);
+  const auto o2 = NegMulAdd(w4_1, oc1, oa1);
+
+  const auto w8_0 = Set(d, WcMultipliers<8>::kMultipliers[0]);
+  const auto w8_1 = Set(d, WcMultipliers<8>::kMultipliers[1]);
+  const auto w8_2 = Set(d, WcMultipliers<8>::kMultipliers[2]);
+  const auto w8_3 = Set(d, WcMultipliers<8>::kMultipliers[3]);
+  StoreU(MulAdd(w8_0, o0, e0), d, to);
+  StoreU(MulAdd(w8_1, o1, e1), d, to + 1 * to_stride);
+  StoreU(MulAdd(w8_2, o2, e2), d, to + 2 * to_stride);
+  StoreU(MulAdd(w8_3, o3, e3), d, to + 3 * to_stride);
+  StoreU(NegMulAdd(w8_3, o3, e3), d, to + 4 * to_stride);
+  StoreU(NegMulAdd(w8_2, o2, e2), d, to + 5 * to_stride);
+  StoreU(NegMulAdd(w8_1, o1, e1), d, to + 6 * to_stride);
+  StoreU(NegMulAdd(w8_0, o0, e0), d, to + 7 * to_stride);
+}
+
+// Larger IDCTs recurse down to this one, which does not use `tmp`.
+template <size_t SZ>
+struct IDCT1DImpl<8, SZ> {
+  JXL_INLINE void operator()(const float* from, size_t from_stride, float* to,
+                             size_t to_stride, float* JXL_RESTRICT /* tmp */) {
+    JXL_DASSERT(from_stride >= SZ);
+    JXL_DASSERT(to_stride >= SZ);
+    const FV<SZ> d;
+    IDCT8Vectors(d, LoadU(d, from), LoadU(d, from + 1 * from_stride),
+                 LoadU(d, from + 2 * from_stride),
+                 LoadU(d, from + 3 * from_stride),
+                 LoadU(d, from + 4 * from_stride),
+                 LoadU(d, from + 5 * from_stride),
+                 LoadU(d, from + 6 * from_stride),
+                 LoadU(d, from + 7 * from_stride), to, to_stride);
+  }
+};
+
 template <size_t N, size_t SZ>
 struct IDCT1DImpl {
   void operator()(const float* from, size_t from_stride, float* to,
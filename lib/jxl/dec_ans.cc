@@ -392,6 +392,7 @@ ANSSymbolReader::ANSSymbolReader(const ANSCode* code,
       huffman_data_(code->huffman_data.data()),
       use_prefix_code_(code->use_prefix_code),
       configs(code->uint_config.data()),
+      num_configs_(code->uint_config.size()),
       lz77_window_storage_(std::move(lz77_window_storage)) {
   if (!use_prefix_code_) {
     state_ = static_cast<uint32_t>(br->ReadFixedBits<32>());
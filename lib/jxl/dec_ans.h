@@ -157,6 +157,24 @@ struct ANSCode {
   void UpdateMaxNumBits(size_t ctx, size_t symbol);
 };
 
+// Tags selecting the HybridUintConfig used by ANSSymbolReader: either the one
+// of each context, or one known at compile time, for decoding loops that are
+// specialized on the configuration used by all the contexts of a stream.
+struct DynamicHybridUintConfig {};
+template <uint32_t kSplitExponent, uint32_t kMsbInToken, uint32_t kLsbInToken>
+struct FixedHybridUintConfig {
+  static bool Matches(const HybridUintConfig& config) {
+    return config.split_exponent == kSplitExponent &&
+           config.msb_in_token == kMsbInToken &&
+           config.lsb_in_token == kLsbInToken;
+  }
+};
+// The default configuration, used by all the contexts unless the encoder
+// searches for better ones.
+using HybridUint420Config = FixedHybridUintConfig<4, 2, 0>;
+// The configuration of HybridUintMethod::k000.
+using HybridUint000Config = FixedHybridUintConfig<0, 0, 0>;
+
 class ANSSymbolReader {
  public:
   // Invalid symbol reader, to be overwritten.
@@ -165,6 +183,11 @@ class ANSSymbolReader {
                                           BitReader* JXL_RESTRICT br,
                                           size_t distance_multiplier = 0);
 
+  // Every symbol depends on the state left by the previous one, and the
+  // codestream has a single ANS state per entropy coded stream, so this is one
+  // serial dependency chain. Splitting it requires a change of the format;
+  // within it, the best we can do is to keep the chain short: the next table
+  // entry is prefetched and the renormalization is branchless.
   JXL_INLINE size_t ReadSymbolANSWithoutRefill(const size_t histo_idx,
                                                BitReader* JXL_RESTRICT br) {
     const uint32_t res = state_ & (ANS_TAB_SIZE - 1u);
@@ -223,10 +246,28 @@ class ANSSymbolReader {
   template <typename BitReader>
   static JXL_INLINE uint32_t ReadHybridUintConfig(
       const HybridUintConfig& config, size_t token, BitReader* br) {
-    size_t split_token = config.split_token;
-    size_t msb_in_token = config.msb_in_token;
-    size_t lsb_in_token = config.lsb_in_token;
-    size_t split_exponent = config.split_exponent;
+    return ReadHybridUintBits(config.split_token, config.split_exponent,
+                              config.msb_in_token, config.lsb_in_token, token,
+                              br);
+  }
+  template <uint32_t kSplitExponent, uint32_t kMsbInToken,
+            uint32_t kLsbInToken, typename BitReader>
+  static JXL_INLINE uint32_t ReadHybridUintConfig(
+      FixedHybridUintConfig<kSplitExponent, kMsbInToken, kLsbInToken>
+      /* config */,
+      size_t token, BitReader* br) {
+    return ReadHybridUintBits(1 << kSplitExponent, kSplitExponent, kMsbInToken,
+                              kLsbInToken, token, br);
+  }
+
+ private:
+  // Constant-folded when called with a FixedHybridUintConfig.
+  template <typename BitReader>
+  static JXL_INLINE uint32_t ReadHybridUintBits(size_t split_token,
+                                                size_t split_exponent,
+                                                size_t msb_in_token,
+                                                size_t lsb_in_token,
+                                                size_t token, BitReader* br) {
     // Fast-track version of hybrid integer decoding.
     if (token < split_token) return token;
     uint32_t nbits = split_exponent - (msb_in_token + lsb_in_token) +
@@ -254,6 +295,34 @@ class ANSSymbolReader {
     return static_cast<uint32_t>(ret);
   }
 
+  const HybridUintConfig& ConfigFor(DynamicHybridUintConfig /* tag */,
+                                    size_t ctx) const {
+    return configs[ctx];
+  }
+  template <uint32_t kSplitExponent, uint32_t kMsbInToken, uint32_t kLsbInToken>
+  static FixedHybridUintConfig<kSplitExponent, kMsbInToken, kLsbInToken>
+  ConfigFor(
+      FixedHybridUintConfig<kSplitExponent, kMsbInToken, kLsbInToken> config,
+      size_t /* ctx */) {
+    return config;
+  }
+
+ public:
+  // Whether the *clustered* context `ctx` uses UintConfig.
+  template <typename UintConfig>
+  bool ContextUses(size_t ctx) const {
+    return UintConfig::Matches(configs[ctx]);
+  }
+  // Whether all the contexts, except the LZ77 distance one, use UintConfig.
+  template <typename UintConfig>
+  bool AllContextsUse() const {
+    for (size_t i = 0; i < num_configs_; i++) {
+      if (lz77_window_ && i == lz77_ctx_) continue;
+      if (!UintConfig::Matches(configs[i])) return false;
+    }
+    return true;
+  }
+
   // Takes a *clustered* idx. Can only use if HuffRleOnly() is true.
   JXL_INLINE void ReadHybridUintClusteredHuffRleOnly(size_t ctx,
                                                      BitReader* JXL_RESTRICT br,
@@ -280,10 +349,12 @@ class ANSSymbolReader {
     if (configs[lz77_ctx_].split_token > 1) return false;
     return true;
   }
-  bool UsesLZ77() { return lz77_window_ != nullptr; }
+  bool UsesLZ77() const { return lz77_window_ != nullptr; }
 
-  // Takes a *clustered* idx. Inlined, for use in hot paths.
-  template <bool uses_lz77>
+  // Takes a *clustered* idx. Inlined, for use in hot paths. The values are
+  // decoded with UintConfig if it is a FixedHybridUintConfig, which must then
+  // be the configuration of `ctx`.
+  template <bool uses_lz77, typename UintConfig = DynamicHybridUintConfig>
   JXL_INLINE size_t ReadHybridUintClusteredInlined(size_t ctx,
                                                    BitReader* JXL_RESTRICT br) {
     if (uses_lz77) {
@@ -336,35 +407,53 @@ class ANSSymbolReader {
         return ret;
       }
     }
-    size_t ret = ReadHybridUintConfig(configs[ctx], token, br);
+    size_t ret = ReadHybridUintConfig(ConfigFor(UintConfig(), ctx), token, br);
     if (uses_lz77 && lz77_window_)
       lz77_window_[(num_decoded_++) & kWindowMask] = ret;
     return ret;
   }
 
   // same but not inlined
-  template <bool uses_lz77>
+  template <bool uses_lz77, typename UintConfig = DynamicHybridUintConfig>
   size_t ReadHybridUintClustered(size_t ctx, BitReader* JXL_RESTRICT br) {
-    return ReadHybridUintClusteredInlined<uses_lz77>(ctx, br);
+    return ReadHybridUintClusteredInlined<uses_lz77, UintConfig>(ctx, br);
   }
 
   // inlined only in the no-lz77 case
-  template <bool uses_lz77>
+  template <bool uses_lz77, typename UintConfig = DynamicHybridUintConfig>
   JXL_INLINE size_t
   ReadHybridUintClusteredMaybeInlined(size_t ctx, BitReader* JXL_RESTRICT br) {
     if (uses_lz77) {
-      return ReadHybridUintClustered<uses_lz77>(ctx, br);
+      return ReadHybridUintClustered<uses_lz77, UintConfig>(ctx, br);
     } else {
-      return ReadHybridUintClusteredInlined<uses_lz77>(ctx, br);
+      return ReadHybridUintClusteredInlined<uses_lz77, UintConfig>(ctx, br);
     }
   }
 
-  // inlined, for use in hot paths
+  // Takes a *clustered* idx. Reads `count` values into `out`, the same as
+  // calling ReadHybridUintClusteredInlined `count` times, but LZ77 copies are
+  // written out in bulk, and runs (copies at distance 1) as a fill.
   template <bool uses_lz77>
+  void ReadHybridUintClusteredBatch(size_t ctx, BitReader* JXL_RESTRICT br,
+                                    uint32_t* JXL_RESTRICT out, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+      if (uses_lz77 && num_to_copy_ > 0) {
+        const size_t n = std::min<size_t>(num_to_copy_, count - i);
+        CopyFromWindow(out + i, n);
+        i += n;
+        continue;
+      }
+      out[i++] = ReadHybridUintClusteredInlined<uses_lz77>(ctx, br);
+    }
+  }
+
+  // inlined, for use in hot paths
+  template <bool uses_lz77, typename UintConfig = DynamicHybridUintConfig>
   JXL_INLINE size_t
   ReadHybridUintInlined(size_t ctx, BitReader* JXL_RESTRICT br,
                         const std::vector<uint8_t>& context_map) {
-    return ReadHybridUintClustered<uses_lz77>(context_map[ctx], br);
+    return ReadHybridUintClustered<uses_lz77, UintConfig>(context_map[ctx], br);
   }
 
   // not inlined, for use in non-hot paths
@@ -450,11 +539,35 @@ class ANSSymbolReader {
                   size_t distance_multiplier,
                   AlignedMemory&& lz77_window_storage);
 
+  // Continues the current LZ77 copy for `n` <= num_to_copy_ values.
+  void CopyFromWindow(uint32_t* JXL_RESTRICT out, size_t n) {
+    if (num_decoded_ - copy_pos_ == 1) {
+      const uint32_t value = lz77_window_[copy_pos_ & kWindowMask];
+      std::fill(out, out + n, value);
+      // Only the last kWindowSize values can still be referenced.
+      const size_t num_window = std::min(n, kWindowSize);
+      const size_t start = (num_decoded_ + n - num_window) & kWindowMask;
+      const size_t first = std::min(num_window, kWindowSize - start);
+      std::fill(lz77_window_ + start, lz77_window_ + start + first, value);
+      std::fill(lz77_window_, lz77_window_ + num_window - first, value);
+      copy_pos_ += static_cast<uint32_t>(n);
+      num_decoded_ += static_cast<uint32_t>(n);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        const uint32_t value = lz77_window_[(copy_pos_++) & kWindowMask];
+        lz77_window_[(num_decoded_++) & kWindowMask] = value;
+        out[i] = value;
+      }
+    }
+    num_to_copy_ -= static_cast<uint32_t>(n);
+  }
+
   const AliasTable::Entry* JXL_RESTRICT alias_tables_;  // not owned
   const HuffmanDecodingData* huffman_data_;
   bool use_prefix_code_;
   uint32_t state_ = ANS_SIGNATURE << 16u;
   const HybridUintConfig* JXL_RESTRICT configs;
+  size_t num_configs_ = 0;
   uint32_t log_alpha_size_{};
   uint32_t log_entry_size_{};
   uint32_t entry_size_minus_1_{};
@@ -0,0 +1,106 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/memory_manager.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_ans.h"
+#include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_ans_params.h"
+#include "lib/jxl/enc_aux_out.h"
+#include "lib/jxl/enc_bit_writer.h"
+#include "tools/no_memory_manager.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+constexpr size_t kNumContexts = 8;
+constexpr size_t kNumTokens = 1 << 18;
+
+// Mostly small residuals with occasional large ones, as in modular images;
+// the same tokens for every run.
+std::vector<Token> MakeTokens() {
+  Rng rng(0);
+  const Rng::GeometricDistribution dist = Rng::MakeGeometric(0.2f);
+  std::vector<Token> tokens;
+  tokens.reserve(kNumTokens);
+  for (size_t i = 0; i < kNumTokens; ++i) {
+    const uint32_t context = rng.UniformU(0, kNumContexts);
+    uint32_t value = rng.Geometric(dist);
+    if (rng.Bernoulli(0.02f)) value = rng.UniformU(0, 1 << 16);
+    tokens.emplace_back(context, value);
+  }
+  return tokens;
+}
+
+// Reads the tokens of MakeTokens, encoded with ANS or with prefix codes.
+void BM_ANSSymbolReader(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  const bool use_prefix_code = state.range(0) != 0;
+
+  std::vector<std::vector<Token>> tokens = {MakeTokens()};
+  HistogramParams params;
+  params.force_huffman = use_prefix_code;
+  BitWriter writer{memory_manager};
+  EntropyEncodingData codes;
+  std::vector<uint8_t> context_map;
+  JXL_ASSIGN_OR_QUIT(
+      size_t cost,
+      BuildAndEncodeHistograms(memory_manager, params, kNumContexts, tokens,
+                               &codes, &context_map, &writer,
+                               LayerType::Header, nullptr),
+      "Failed to encode histograms.");
+  (void)cost;
+  BM_CHECK(WriteTokens(tokens[0], codes, context_map, 0, &writer,
+                       LayerType::Header, nullptr));
+  BM_CHECK(writer.WithMaxBits(8, LayerType::Header, nullptr, [&] {
+    writer.ZeroPadToByte();
+    return true;
+  }));
+  const Span<const uint8_t> encoded = writer.GetSpan();
+
+  for (auto _ : state) {
+    (void)_;
+    BitReader br(encoded);
+    std::vector<uint8_t> dec_context_map;
+    ANSCode decoded_codes;
+    BM_CHECK(DecodeHistograms(memory_manager, &br, kNumContexts,
+                              &decoded_codes, &dec_context_map));
+    JXL_ASSIGN_OR_QUIT(ANSSymbolReader reader,
+                       ANSSymbolReader::Create(&decoded_codes, &br),
+                       "Failed to create symbol reader.");
+    uint32_t sum = 0;
+    for (const Token& token : tokens[0]) {
+      sum += reader.ReadHybridUint(token.context, &br, dec_context_map);
+    }
+    benchmark::DoNotOptimize(sum);
+    BM_CHECK(reader.CheckANSFinalState());
+    BM_CHECK(br.Close());
+  }
+
+  state.SetItemsProcessed(kNumTokens * state.iterations());
+  state.SetBytesProcessed(encoded.size() * state.iterations());
+}
+
+BENCHMARK(BM_ANSSymbolReader)->ArgName("prefix")->DenseRange(0, 1);
+
+}  // namespace
+}  // namespace jxl
@@ -36,6 +36,7 @@ class BitReader {
         bits_in_buf_(0),
         next_byte_{nullptr},
         end_minus_8_{nullptr},
+        load_end_minus_8_{nullptr},
         first_byte_(nullptr) {}
   BitReader(const BitReader&) = delete;
 
@@ -47,6 +48,24 @@ class BitReader {
         next_byte_(bytes.data()),
         // Assumes first_byte_ >= 8.
         end_minus_8_(bytes.data() - 8 + bytes.size()),
+        load_end_minus_8_(end_minus_8_),
+        first_byte_(bytes.data()) {
+    Refill();
+  }
+
+  // Same as above, for `bytes` that are followed in memory by at least
+  // `readable_bytes_after` more readable bytes, e.g. the next sections of the
+  // same codestream. Refills then keep using 8-byte loads up to the end of
+  // `bytes` instead of switching to BoundsCheckedRefill for its last 8 bytes.
+  // Reading past the end of `bytes` is still reported by AllReadsWithinBounds
+  // and Close, but the bits read there are the following bytes, not zeros.
+  template <class ArrayLike>
+  BitReader(const ArrayLike& bytes, size_t readable_bytes_after)
+      : buf_(0),
+        bits_in_buf_(0),
+        next_byte_(bytes.data()),
+        end_minus_8_(bytes.data() - 8 + bytes.size()),
+        load_end_minus_8_(end_minus_8_ + readable_bytes_after),
         first_byte_(bytes.data()) {
     Refill();
   }
@@ -68,6 +87,7 @@ class BitReader {
     bits_in_buf_ = other.bits_in_buf_;
     next_byte_ = other.next_byte_;
     end_minus_8_ = other.end_minus_8_;
+    load_end_minus_8_ = other.load_end_minus_8_;
     first_byte_ = other.first_byte_;
     overread_bytes_ = other.overread_bytes_;
     close_called_ = other.close_called_;
@@ -82,7 +102,7 @@ class BitReader {
   // Based on variant 4 (plus bounds-checking), see
   // fgiesen.wordpress.com/2018/02/20/reading-bits-in-far-too-many-ways-part-2/
   JXL_INLINE void Refill() {
-    if (JXL_UNLIKELY(next_byte_ > end_minus_8_)) {
+    if (JXL_UNLIKELY(next_byte_ > load_end_minus_8_)) {
       BoundsCheckedRefill();
     } else {
       // It's safe to load 64 bits; insert valid (possibly nonzero) bits above
@@ -180,8 +200,12 @@ class BitReader {
     // Skip whole bytes
     const size_t whole_bytes = skip / kBitsPerByte;
     skip %= kBitsPerByte;
-    if (JXL_UNLIKELY(whole_bytes >
-                     static_cast<size_t>(end_minus_8_ + 8 - next_byte_))) {
+    // Refills may have loaded bytes past the end, see the second constructor.
+    const size_t bytes_left =
+        next_byte_ < end_minus_8_ + 8
+            ? static_cast<size_t>(end_minus_8_ + 8 - next_byte_)
+            : 0;
+    if (JXL_UNLIKELY(whole_bytes > bytes_left)) {
       // This is already an overflow condition (skipping past the end of the bit
       // stream). However if we increase next_byte_ too much we risk overflowing
       // that value and potentially making it valid again (next_byte_ < end).
@@ -284,7 +308,9 @@ class BitReader {
   uint64_t buf_;
   size_t bits_in_buf_;  // [0, 64)
   const uint8_t* JXL_RESTRICT next_byte_;
-  const uint8_t* end_minus_8_;  // for refill bounds check
+  const uint8_t* end_minus_8_;  // for bounds checks
+  // For refill bounds check; beyond end_minus_8_ if more bytes are readable.
+  const uint8_t* load_end_minus_8_;
   const uint8_t* first_byte_;   // for GetSpan
 
   // Number of bytes past the end that were loaded into the buf_. These bytes
@@ -10,6 +10,7 @@
 #include <algorithm>
 
 #include "lib/jxl/ac_strategy.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/blending.h"
 #include "lib/jxl/coeff_order.h"
@@ -35,7 +36,7 @@
 namespace jxl {
 
 Status GroupDecCache::InitOnce(JxlMemoryManager* memory_manager,
-                               size_t num_passes, size_t used_acs) {
+                               size_t num_passes) {
   for (size_t i = 0; i < num_passes; i++) {
     if (num_nzeroes[i].xsize() == 0) {
       // Allocate enough for a whole group - partial groups on the
@@ -47,39 +48,42 @@ Status GroupDecCache::InitOnce(JxlMemoryManager* memory_manager,
                                            kGroupDimInBlocks));
     }
   }
-  size_t max_block_area = 0;
+  return true;
+}
 
-  for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
-    AcStrategy acs = AcStrategy::FromRawStrategy(o);
-    if ((used_acs & (1 << o)) == 0) continue;
-    size_t area =
-        acs.covered_blocks_x() * acs.covered_blocks_y() * kDCTBlockSize;
-    max_block_area = std::max(area, max_block_area);
-  }
+Status GroupDecCache::GrowFloatBlocks(JxlMemoryManager* memory_manager,
+                                      size_t block_area) {
+  JXL_ENSURE(block_area <= AcStrategy::kMaxCoeffArea);
+  // We need 3x float blocks for dequantized coefficients and 1x for scratch
+  // space for transforms.
+  JXL_ASSIGN_OR_RETURN(
+      float_memory_,
+      AlignedMemory::Create(memory_manager, block_area * 7 * sizeof(float)));
+  float_block_area_ = block_area;
+  dec_group_block = float_memory_.address<float>();
+  scratch_space = dec_group_block + block_area * 3;
+  return true;
+}
 
-  if (max_block_area > max_block_area_) {
-    max_block_area_ = max_block_area;
-    // We need 3x float blocks for dequantized coefficients and 1x for scratch
-    // space for transforms.
+Status GroupDecCache::GrowQuantizedBlocks(JxlMemoryManager* memory_manager,
+                                          size_t block_area, ACType ac_type) {
+  JXL_ENSURE(block_area <= AcStrategy::kMaxCoeffArea);
+  // We need 3x int32 or int16 blocks for quantized coefficients.
+  if (ac_type == ACType::k16) {
     JXL_ASSIGN_OR_RETURN(
-        float_memory_,
+        int16_memory_,
         AlignedMemory::Create(memory_manager,
-                              max_block_area_ * 7 * sizeof(float)));
-    // We need 3x int32 or int16 blocks for quantized coefficients.
+                              block_area * 3 * sizeof(int16_t)));
+    int16_block_area_ = block_area;
+    dec_group_qblock16 = int16_memory_.address<int16_t>();
+  } else {
     JXL_ASSIGN_OR_RETURN(
         int32_memory_,
         AlignedMemory::Create(memory_manager,
-                              max_block_area_ * 3 * sizeof(int32_t)));
-    JXL_ASSIGN_OR_RETURN(
-        int16_memory_,
-        AlignedMemory::Create(memory_manager,
-                              max_block_area_ * 3 * sizeof(int16_t)));
+                              block_area * 3 * sizeof(int32_t)));
+    int32_block_area_ = block_area;
+    dec_group_qblock = int32_memory_.address<int32_t>();
   }
-
-  dec_group_block = float_memory_.address<float>();
-  scratch_space = dec_group_block + max_block_area_ * 3;
-  dec_group_qblock = int32_memory_.address<int32_t>();
-  dec_group_qblock16 = int16_memory_.address<int16_t>();
   return true;
 }
 
@@ -115,6 +119,20 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
     frame_storage_for_referencing = ImageBundle(memory_manager, metadata);
   }
 
+  if (render_dc_only) {
+    // The frame decoder only renders DC for frames that need none of the
+    // stages working at full resolution (see FrameDecoder::SetDownsampling).
+    JXL_ENSURE(frame_header.chroma_subsampling.Is444());
+    JXL_ENSURE(frame_header.upsampling == 1);
+    JXL_ENSURE(num_c == 3);
+    JXL_ENSURE(!frame_header.CanBeReferenced());
+    JXL_ENSURE(!(frame_header.flags &
+                 (FrameHeader::kPatches | FrameHeader::kSplines)));
+    JXL_ENSURE(!fast_xyb_srgb8_conversion);
+    render_noise = false;
+    num_tmp_c = 0;
+  }
+
   RenderPipeline::Builder builder(memory_manager, num_c + num_tmp_c);
 
   if (options.use_slow_render_pipeline) {
@@ -134,24 +152,74 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
     }
   }
 
-  if (frame_header.loop_filter.gab) {
-    JXL_RETURN_IF_ERROR(
-        builder.AddStage(GetGaborishStage(frame_header.loop_filter)));
+  // Unless some stage needs the linear values, convert from XYB to sRGB in
+  // the output stage while writing the pixels.
+  const bool fuse_xyb_output =
+      !fast_xyb_srgb8_conversion && fuse_xyb_srgb_output &&
+      frame_header.color_transform == ColorTransform::kXYB &&
+      (main_output.callback.IsPresent() || main_output.buffer) &&
+      !(options.coalescing && NeedsBlending(frame_header)) &&
+      !(options.coalescing && frame_header.CanBeReferenced() &&
+        !frame_header.save_before_color_transform) &&
+      !(options.render_spotcolors &&
+        metadata->Find(ExtraChannel::kSpotColor)) &&
+      !GetToneMappingStage(output_encoding_info);
+
+  // If nothing else touches the color channels between the last loop filter
+  // and the XYB to linear conversion, the filter does the conversion on the
+  // rows it just produced instead of leaving it to a separate XYB stage. The
+  // simple pipeline keeps the unfused chain as a reference.
+  const LoopFilter& lf = frame_header.loop_filter;
+  const bool fuse_xyb_into_filters =
+      !options.use_slow_render_pipeline && !render_dc_only &&
+      !fast_xyb_srgb8_conversion && !fuse_xyb_output &&
+      (lf.gab || lf.epf_iters > 0) &&
+      frame_header.color_transform == ColorTransform::kXYB &&
+      output_encoding_info.color_encoding.GetColorSpace() != ColorSpace::kXYB &&
+      !(frame_header.flags & (FrameHeader::kPatches | FrameHeader::kSplines)) &&
+      frame_header.upsampling == 1 && !render_noise &&
+      frame_header.dc_level == 0 &&
+      !(frame_header.CanBeReferenced() &&
+        frame_header.save_before_color_transform);
+  const OpsinParams* filter_xyb_params =
+      fuse_xyb_into_filters ? &output_encoding_info.opsin_params : nullptr;
+
+  if (lf.gab && !render_dc_only) {
+    JXL_RETURN_IF_ERROR(builder.AddStage(GetGaborishStage(
+        lf, lf.epf_iters == 0 ? filter_xyb_params : nullptr)));
   }
 
-  {
-    const LoopFilter& lf = frame_header.loop_filter;
+  if (!render_dc_only) {
     if (lf.epf_iters >= 3) {
       JXL_RETURN_IF_ERROR(
           builder.AddStage(GetEPFStage(lf, sigma, EpfStage::Zero)));
     }
     if (lf.epf_iters >= 1) {
-      JXL_RETURN_IF_ERROR(
-          builder.AddStage(GetEPFStage(lf, sigma, EpfStage::One)));
+      JXL_RETURN_IF_ERROR(builder.AddStage(
+          GetEPFStage(lf, sigma, EpfStage::One,
+                      lf.epf_iters == 1 ? filter_xyb_params : nullptr)));
     }
     if (lf.epf_iters >= 2) {
-      JXL_RETURN_IF_ERROR(
-          builder.AddStage(GetEPFStage(lf, sigma, EpfStage::Two)));
+      JXL_RETURN_IF_ERROR(builder.AddStage(
+          GetEPFStage(lf, sigma, EpfStage::Two, filter_xyb_params)));
+    }
+  }
+
+  // Extra channels that no later stage consumes are not upsampled, so that
+  // the pipeline ignores them and the decoder can skip filling them in.
+  const size_t num_ec = num_c - 3;
+  std::vector<uint8_t> ec_needed(num_ec, 1);
+  if ((main_output.callback.IsPresent() || main_output.buffer) &&
+      !frame_header.CanBeReferenced() &&
+      !(options.coalescing && NeedsBlending(frame_header)) &&
+      frame_header.dc_level == 0) {
+    for (size_t ec = 0; ec < num_ec; ec++) {
+      const ExtraChannelInfo& eci = metadata->extra_channel_info[ec];
+      ec_needed[ec] =
+          eci.type == ExtraChannel::kAlpha ||
+          (options.render_spotcolors && eci.type == ExtraChannel::kSpotColor) ||
+          (ec < extra_output.size() &&
+           (extra_output[ec].callback.IsPresent() || extra_output[ec].buffer));
     }
   }
 
@@ -167,7 +235,7 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
   if (!late_ec_upsample) {
     for (size_t ec = 0; ec < frame_header.extra_channel_upsampling.size();
          ec++) {
-      if (frame_header.extra_channel_upsampling[ec] != 1) {
+      if (frame_header.extra_channel_upsampling[ec] != 1 && ec_needed[ec]) {
         JXL_RETURN_IF_ERROR(builder.AddStage(GetUpsamplingStage(
             frame_header.nonserialized_metadata->transform_data, 3 + ec,
             CeilLog2Nonzero(frame_header.extra_channel_upsampling[ec]))));
@@ -190,6 +258,7 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
         3 +
         (late_ec_upsample ? frame_header.extra_channel_upsampling.size() : 0);
     for (size_t c = 0; c < nb_channels; c++) {
+      if (c >= 3 && !ec_needed[c - 3]) continue;
       JXL_RETURN_IF_ERROR(builder.AddStage(GetUpsamplingStage(
           frame_header.nonserialized_metadata->transform_data, c,
           CeilLog2Nonzero(frame_header.upsampling))));
@@ -236,8 +305,14 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
 #endif
   } else {
     bool linear = false;
+    bool fuse_linear_output = false;
     if (frame_header.color_transform == ColorTransform::kYCbCr) {
       JXL_RETURN_IF_ERROR(builder.AddStage(GetYCbCrStage()));
+    } else if (fuse_xyb_output) {
+      // Done by the output stage.
+    } else if (fuse_xyb_into_filters) {
+      // Done by the last loop filter stage.
+      linear = true;
     } else if (frame_header.color_transform == ColorTransform::kXYB) {
       JXL_RETURN_IF_ERROR(builder.AddStage(GetXYBStage(output_encoding_info)));
       if (output_encoding_info.color_encoding.GetColorSpace() !=
@@ -318,8 +393,16 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
         // - mixing_color_and_grey: cms stage can't handle that
         // TODO(firsching): remove "mixing_color_and_grey" condition after
         // adding support for greyscale to cms stage.
-        JXL_RETURN_IF_ERROR(
-            builder.AddStage(GetFromLinearStage(output_encoding_info)));
+        if (fuse_srgb_output && !mixing_color_and_grey &&
+            (main_output.callback.IsPresent() || main_output.buffer)) {
+          // The output stage quantizes to sRGB in the same pass.
+          fuse_linear_output = true;
+        } else if (output_encoding_info.color_encoding.Tf().IsLinear()) {
+          // The values are already in the output encoding.
+        } else {
+          JXL_RETURN_IF_ERROR(
+              builder.AddStage(GetFromLinearStage(output_encoding_info)));
+        }
       } else {
         if (!output_encoding_info.linear_color_encoding.CreateICC()) {
           return JXL_FAILURE("Failed to create ICC");
@@ -335,15 +418,21 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
 
     if (main_output.callback.IsPresent() || main_output.buffer) {
       JXL_RETURN_IF_ERROR(builder.AddStage(GetWriteToOutputStage(
-          main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-          undo_orientation, extra_output, memory_manager)));
+          main_output, Rect(output_x0, output_y0, width, height),
+          output_downsampling, has_alpha, unpremul_alpha, premul_alpha,
+          alpha_c, undo_orientation, extra_output,
+          fuse_xyb_output ? &output_encoding_info.opsin_params : nullptr,
+          fuse_linear_output, memory_manager)));
     } else {
       JXL_RETURN_IF_ERROR(builder.AddStage(
           GetWriteToImageBundleStage(decoded, output_encoding_info)));
     }
   }
-  JXL_ASSIGN_OR_RETURN(render_pipeline,
-                       std::move(builder).Finalize(shared->frame_dim));
+  JXL_ASSIGN_OR_RETURN(
+      render_pipeline,
+      std::move(builder).Finalize(render_dc_only ? dc_frame_dim
+                                                 : shared->frame_dim));
+  render_pipeline->SetStats(stats);
   return render_pipeline->IsInitialized();
 }
 
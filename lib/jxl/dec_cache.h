@@ -12,9 +12,11 @@
 
 #include <atomic>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/common.h"  // kMaxNumPasses
@@ -24,6 +26,7 @@
 #include "lib/jxl/common.h"
 #include "lib/jxl/dct_util.h"
 #include "lib/jxl/dec_ans.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/frame_header.h"
@@ -67,6 +70,14 @@ struct PixelCallback {
   void* init_opaque = nullptr;
 };
 
+// Buffer for one channel of planar image output.
+struct ImageOutputPlane {
+  void* buffer;
+  size_t buffer_size;
+  // Length of a row of buffer in bytes.
+  size_t stride;
+};
+
 struct ImageOutput {
   // Pixel format of the output pixels, used for buffer and callback output.
   JxlPixelFormat format;
@@ -79,6 +90,9 @@ struct ImageOutput {
   size_t buffer_size;
   // Length of a row of image_buffer in bytes (based on oriented width).
   size_t stride;
+  // If not empty, each channel of `format` is written to its own plane, and
+  // `buffer`, `buffer_size` and `stride` are not used.
+  std::vector<ImageOutputPlane> planes;
 };
 
 // Per-frame decoder state. All the images here should be accessed through a
@@ -109,16 +123,43 @@ struct PassesDecoderState {
   // Image dimensions before applying undo_orientation.
   size_t width;
   size_t height;
+  // Position in the image of the first pixel written to the output; non-zero
+  // only when decoding a crop region.
+  size_t output_x0;
+  size_t output_y0;
+  // Only every output_downsampling-th pixel in each direction is written to
+  // the output.
+  size_t output_downsampling;
+  // If true, the render pipeline works on the DC image of the frame, which is
+  // written to the output as is, i.e. at 1/8 of the frame resolution.
+  bool render_dc_only;
+  FrameDimensions dc_frame_dim;
   ImageOutput main_output;
   std::vector<ImageOutput> extra_output;
 
+  // Statistics the decoding steps and render pipeline stages are accounted
+  // to, if any. Kept across frames.
+  DecoderStats* stats = nullptr;
+
   // Whether to use int16 float-XYB-to-uint8-srgb conversion.
   bool fast_xyb_srgb8_conversion;
 
+  // Whether the output stage converts from XYB to 8 or 16 bit sRGB itself,
+  // instead of separate XYB and sRGB stages.
+  bool fuse_xyb_srgb_output;
+
+  // Whether the output stage may convert linear values to 8 or 16 bit sRGB
+  // itself, instead of a separate FromLinear stage.
+  bool fuse_srgb_output;
+
   // If true, the RGBA output will be unpremultiplied before writing to the
   // output.
   bool unpremul_alpha;
 
+  // If true, the RGB channels of an RGBA output with unassociated alpha will be
+  // premultiplied before writing to the output.
+  bool premul_alpha;
+
   // The render pipeline will apply this orientation to bring the image to the
   // intended display orientation.
   Orientation undo_orientation;
@@ -163,34 +204,59 @@ struct PassesDecoderState {
 
     main_output.callback = PixelCallback();
     main_output.buffer = nullptr;
+    main_output.planes.clear();
     extra_output.clear();
+    output_x0 = 0;
+    output_y0 = 0;
+    output_downsampling = 1;
+    render_dc_only = false;
 
     fast_xyb_srgb8_conversion = false;
+    fuse_xyb_srgb_output = false;
+    fuse_srgb_output = false;
     unpremul_alpha = false;
+    premul_alpha = false;
     undo_orientation = Orientation::kIdentity;
 
     used_acs = 0;
 
     upsampler8x = GetUpsamplingStage(shared->metadata->transform_data, 0, 3);
     if (frame_header.loop_filter.epf_iters > 0) {
-      JXL_ASSIGN_OR_RETURN(
-          sigma,
-          ImageF::Create(memory_manager,
-                         shared->frame_dim.xsize_blocks + 2 * kSigmaPadding,
-                         shared->frame_dim.ysize_blocks + 2 * kSigmaPadding));
+      const size_t sigma_xsize =
+          shared->frame_dim.xsize_blocks + 2 * kSigmaPadding;
+      const size_t sigma_ysize =
+          shared->frame_dim.ysize_blocks + 2 * kSigmaPadding;
+      if (sigma.xsize() != sigma_xsize || sigma.ysize() != sigma_ysize) {
+        JXL_ASSIGN_OR_RETURN(
+            sigma, ImageF::Create(memory_manager, sigma_xsize, sigma_ysize));
+      }
     }
     return true;
   }
 
   // Initialize the decoder state after all of DC is decoded.
   Status InitForAC(size_t num_passes, ThreadPool* pool);
+
+  // Takes over the image storage of `other`, a state that is no longer used,
+  // so that it can be reused if the next frames have the same dimensions.
+  void ReuseStorage(PassesDecoderState* other) {
+    shared_storage.ac_strategy = std::move(other->shared_storage.ac_strategy);
+    shared_storage.raw_quant_field =
+        std::move(other->shared_storage.raw_quant_field);
+    shared_storage.epf_sharpness =
+        std::move(other->shared_storage.epf_sharpness);
+    shared_storage.quant_dc = std::move(other->shared_storage.quant_dc);
+    shared_storage.dc_storage = std::move(other->shared_storage.dc_storage);
+    shared_storage.coeff_orders =
+        std::move(other->shared_storage.coeff_orders);
+    sigma = std::move(other->sigma);
+  }
 };
 
 // Temp images required for decoding a single group. Reduces memory allocations
 // for large images because we only initialize min(#threads, #groups) instances.
 struct HWY_ALIGN_MAX GroupDecCache {
-  Status InitOnce(JxlMemoryManager* memory_manager, size_t num_passes,
-                  size_t used_acs);
+  Status InitOnce(JxlMemoryManager* memory_manager, size_t num_passes);
 
   Status InitDCBufferOnce(JxlMemoryManager* memory_manager) {
     if (dc_buffer.xsize() == 0) {
@@ -203,16 +269,38 @@ struct HWY_ALIGN_MAX GroupDecCache {
     return true;
   }
 
+  // The block buffers below are grown on demand, for each varblock, so that a
+  // thread only holds buffers for the largest transform that it decoded
+  // itself. Frames with a few large varblocks (up to DCT256) thus do not cost
+  // that much memory in every thread.
+
+  // Makes dec_group_block and scratch_space large enough for a varblock of
+  // `block_area` coefficients.
+  Status EnsureFloatBlocks(JxlMemoryManager* memory_manager,
+                           size_t block_area) {
+    if (JXL_LIKELY(block_area <= float_block_area_)) return true;
+    return GrowFloatBlocks(memory_manager, block_area);
+  }
+
+  // Same for dec_group_qblock16 or dec_group_qblock, depending on `ac_type`.
+  Status EnsureQuantizedBlocks(JxlMemoryManager* memory_manager,
+                               size_t block_area, ACType ac_type) {
+    const size_t capacity = ac_type == ACType::k16 ? int16_block_area_
+                                                   : int32_block_area_;
+    if (JXL_LIKELY(block_area <= capacity)) return true;
+    return GrowQuantizedBlocks(memory_manager, block_area, ac_type);
+  }
+
   // Scratch space used by DecGroupImpl().
-  float* dec_group_block;
-  int32_t* dec_group_qblock;
-  int16_t* dec_group_qblock16;
+  float* dec_group_block = nullptr;
+  int32_t* dec_group_qblock = nullptr;
+  int16_t* dec_group_qblock16 = nullptr;
 
   // For TransformToPixels.
-  float* scratch_space;
+  float* scratch_space = nullptr;
   // Note that scratch_space is never used at the same time as dec_group_qblock.
-  // Moreover, only one of dec_group_qblock16 is ever used.
-  // TODO(veluca): figure out if we can save allocations.
+  // Moreover, only the one of dec_group_qblock16 and dec_group_qblock that
+  // matches the AC type is ever used, and allocated.
 
   // AC decoding
   Image3I num_nzeroes[kMaxNumPasses];
@@ -221,10 +309,17 @@ struct HWY_ALIGN_MAX GroupDecCache {
   ImageF dc_buffer;
 
  private:
+  Status GrowFloatBlocks(JxlMemoryManager* memory_manager, size_t block_area);
+  Status GrowQuantizedBlocks(JxlMemoryManager* memory_manager,
+                             size_t block_area, ACType ac_type);
+
   AlignedMemory float_memory_;
   AlignedMemory int32_memory_;
   AlignedMemory int16_memory_;
-  size_t max_block_area_ = 0;
+  // Number of coefficients per channel that the buffers above can hold.
+  size_t float_block_area_ = 0;
+  size_t int32_block_area_ = 0;
+  size_t int16_block_area_ = 0;
 };
 
 }  // namespace jxl
@@ -10,11 +10,11 @@
 
 #include <algorithm>
 #include <cstring>
-#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image.h"
+#include "lib/jxl/simd_util.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/dec_external_image.cc"
@@ -36,50 +36,172 @@ namespace HWY_NAMESPACE {
 using hwy::HWY_NAMESPACE::Clamp;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::NearestInt;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::TFromD;
+using hwy::HWY_NAMESPACE::VFromD;
 
-// TODO(jon): check if this can be replaced by a FloatToU16 function
-void FloatToU32(const float* in, uint32_t* out, size_t num, float mul,
-                size_t bits_per_sample) {
-  const HWY_FULL(float) d;
-  const hwy::HWY_NAMESPACE::Rebind<uint32_t, decltype(d)> du;
+using DF = HWY_FULL(float);
 
-  // Unpoison accessing partially-uninitialized vectors with memory sanitizer.
-  // This is because we run NearestInt() on the vector, which triggers MSAN even
-  // it is safe to do so since the values are not mixed between lanes.
-  const size_t num_round_up = RoundUpTo(num, Lanes(d));
-  msan::UnpoisonMemory(in + num, sizeof(in[0]) * (num_round_up - num));
-
-  const auto one = Set(d, 1.0f);
-  const auto scale = Set(d, mul);
-  for (size_t x = 0; x < num; x += Lanes(d)) {
-    auto v = Load(d, in + x);
+template <class D>
+VFromD<D> SwapBytes16(D /*d*/, VFromD<D> v) {
+  return Or(ShiftLeft<8>(v), ShiftRight<8>(v));
+}
+
+// Converters of a vector of floats to the output samples of the vector type
+// of D, which has as many lanes as DF.
+
+// Samples in [0, 1] to integers in [0, mul].
+struct ToU8 {
+  using D = Rebind<uint8_t, DF>;
+  VFromD<D> operator()(const float* in) const {
+    const DF df;
     // Clamp turns NaN to 'min'.
-    v = Clamp(v, Zero(d), one);
-    auto i = NearestInt(Mul(v, scale));
-    Store(BitCast(du, i), du, out + x);
+    const auto v = Clamp(Load(df, in), Zero(df), Set(df, 1.0f));
+    return DemoteTo(D(), NearestInt(Mul(v, Set(df, mul))));
   }
+  float mul;
+};
+
+struct ToU16 {
+  using D = Rebind<uint16_t, DF>;
+  VFromD<D> operator()(const float* in) const {
+    const DF df;
+    const D d;
+    const auto v = Clamp(Load(df, in), Zero(df), Set(df, 1.0f));
+    const auto u = DemoteTo(d, NearestInt(Mul(v, Set(df, mul))));
+    return swap_endianness ? SwapBytes16(d, u) : u;
+  }
+  float mul;
+  bool swap_endianness;
+};
+
+struct ToF16 {
+  using D = Rebind<uint16_t, DF>;
+  VFromD<D> operator()(const float* in) const {
+    const DF df;
+    const D d;
+    const Rebind<hwy::float16_t, DF> df16;
+    const auto u = BitCast(d, DemoteTo(df16, Load(df, in)));
+    return swap_endianness ? SwapBytes16(d, u) : u;
+  }
+  bool swap_endianness;
+};
+
+// Floats in native byte order.
+struct ToF32 {
+  using D = DF;
+  VFromD<D> operator()(const float* in) const { return Load(DF(), in); }
+};
+
+// Stores the converted vectors of pixels starting at `x` of each row,
+// interleaved.
+template <class Convert, typename T>
+void StorePixels(hwy::SizeTag<1> /*channels*/, const Convert& convert,
+                 const float* JXL_RESTRICT* rows, size_t x, T* out) {
+  StoreU(convert(rows[0] + x), typename Convert::D(), out);
+}
 
-  // Poison back the output.
-  msan::PoisonMemory(out + num, sizeof(out[0]) * (num_round_up - num));
+template <class Convert, typename T>
+void StorePixels(hwy::SizeTag<2> /*channels*/, const Convert& convert,
+                 const float* JXL_RESTRICT* rows, size_t x, T* out) {
+  StoreInterleaved2(convert(rows[0] + x), convert(rows[1] + x),
+                    typename Convert::D(), out);
 }
 
-void FloatToF16(const float* in, hwy::float16_t* out, size_t num) {
-  const HWY_FULL(float) d;
-  const hwy::HWY_NAMESPACE::Rebind<hwy::float16_t, decltype(d)> du;
+template <class Convert, typename T>
+void StorePixels(hwy::SizeTag<3> /*channels*/, const Convert& convert,
+                 const float* JXL_RESTRICT* rows, size_t x, T* out) {
+  StoreInterleaved3(convert(rows[0] + x), convert(rows[1] + x),
+                    convert(rows[2] + x), typename Convert::D(), out);
+}
+
+template <class Convert, typename T>
+void StorePixels(hwy::SizeTag<4> /*channels*/, const Convert& convert,
+                 const float* JXL_RESTRICT* rows, size_t x, T* out) {
+  StoreInterleaved4(convert(rows[0] + x), convert(rows[1] + x),
+                    convert(rows[2] + x), convert(rows[3] + x),
+                    typename Convert::D(), out);
+}
 
+// Converts and interleaves one row of kChannels channels. The output has no
+// padding, so the last partial vector of pixels goes through `scratch`, which
+// has room for kChannels * MaxVectorSize() bytes.
+template <size_t kChannels, class Convert>
+void ConvertInterleavedRow(const Convert& convert,
+                           const float* JXL_RESTRICT* rows, size_t xsize,
+                           uint8_t* scratch, uint8_t* JXL_RESTRICT out) {
+  using T = TFromD<typename Convert::D>;
+  const size_t N = Lanes(DF());
   // Unpoison accessing partially-uninitialized vectors with memory sanitizer.
-  // This is because we run DemoteTo() on the vector which triggers msan.
-  const size_t num_round_up = RoundUpTo(num, Lanes(d));
-  msan::UnpoisonMemory(in + num, sizeof(in[0]) * (num_round_up - num));
-
-  for (size_t x = 0; x < num; x += Lanes(d)) {
-    auto v = Load(d, in + x);
-    auto v16 = DemoteTo(du, v);
-    Store(v16, du, out + x);
+  // This is because we run NearestInt() or DemoteTo() on the vector, which
+  // triggers MSAN even it is safe to do so since the values are not mixed
+  // between lanes.
+  const size_t xsize_round_up = RoundUpTo(xsize, N);
+  for (size_t c = 0; c < kChannels; ++c) {
+    msan::UnpoisonMemory(rows[c] + xsize,
+                         sizeof(rows[c][0]) * (xsize_round_up - xsize));
+  }
+  T* out_samples = reinterpret_cast<T*>(out);
+  size_t x = 0;
+  for (; x + N <= xsize; x += N) {
+    StorePixels(hwy::SizeTag<kChannels>(), convert, rows, x,
+                out_samples + x * kChannels);
+  }
+  if (x < xsize) {
+    T* tail = reinterpret_cast<T*>(scratch);
+    StorePixels(hwy::SizeTag<kChannels>(), convert, rows, x, tail);
+    memcpy(out_samples + x * kChannels, tail,
+           (xsize - x) * kChannels * sizeof(T));
+  }
+}
+
+template <class Convert>
+void ConvertInterleaved(const Convert& convert,
+                        const float* JXL_RESTRICT* rows, size_t num_channels,
+                        size_t xsize, uint8_t* scratch,
+                        uint8_t* JXL_RESTRICT out) {
+  switch (num_channels) {
+    case 1:
+      ConvertInterleavedRow<1>(convert, rows, xsize, scratch, out);
+      break;
+    case 2:
+      ConvertInterleavedRow<2>(convert, rows, xsize, scratch, out);
+      break;
+    case 3:
+      ConvertInterleavedRow<3>(convert, rows, xsize, scratch, out);
+      break;
+    default:
+      ConvertInterleavedRow<4>(convert, rows, xsize, scratch, out);
+      break;
+  }
+}
+
+// Rows of samples in [0, 1] to interleaved unsigned integers with
+// bits_per_sample bits, in one byte if it is at most 8, otherwise in two.
+void RowToUint(const float* JXL_RESTRICT* rows, size_t num_channels,
+               size_t xsize, size_t bits_per_sample, bool swap_endianness,
+               uint8_t* scratch, uint8_t* JXL_RESTRICT out) {
+  const float mul = (1ull << bits_per_sample) - 1;
+  if (bits_per_sample <= 8) {
+    ConvertInterleaved(ToU8{mul}, rows, num_channels, xsize, scratch, out);
+  } else {
+    ConvertInterleaved(ToU16{mul, swap_endianness}, rows, num_channels, xsize,
+                       scratch, out);
   }
+}
 
-  // Poison back the output.
-  msan::PoisonMemory(out + num, sizeof(out[0]) * (num_round_up - num));
+void RowToF16(const float* JXL_RESTRICT* rows, size_t num_channels,
+              size_t xsize, bool swap_endianness, uint8_t* scratch,
+              uint8_t* JXL_RESTRICT out) {
+  ConvertInterleaved(ToF16{swap_endianness}, rows, num_channels, xsize,
+                     scratch, out);
+}
+
+void RowToF32(const float* JXL_RESTRICT* rows, size_t num_channels,
+              size_t xsize, uint8_t* scratch, uint8_t* JXL_RESTRICT out) {
+  ConvertInterleaved(ToF32(), rows, num_channels, xsize, scratch, out);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -221,24 +343,12 @@ Status UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
 }
 }  // namespace
 
-HWY_EXPORT(FloatToU32);
-HWY_EXPORT(FloatToF16);
+HWY_EXPORT(RowToUint);
+HWY_EXPORT(RowToF16);
+HWY_EXPORT(RowToF32);
 
 namespace {
 
-using StoreFuncType = void(uint32_t value, uint8_t* dest);
-template <StoreFuncType StoreFunc>
-void StoreUintRow(uint32_t* JXL_RESTRICT* rows_u32, size_t num_channels,
-                  size_t xsize, size_t bytes_per_sample,
-                  uint8_t* JXL_RESTRICT out) {
-  for (size_t x = 0; x < xsize; ++x) {
-    for (size_t c = 0; c < num_channels; c++) {
-      StoreFunc(rows_u32[c][x],
-                out + (num_channels * x + c) * bytes_per_sample);
-    }
-  }
-}
-
 template <void(StoreFunc)(float, uint8_t*)>
 void StoreFloatRow(const float* JXL_RESTRICT* rows_in, size_t num_channels,
                    size_t xsize, uint8_t* JXL_RESTRICT out) {
@@ -249,8 +359,6 @@ void StoreFloatRow(const float* JXL_RESTRICT* rows_in, size_t num_channels,
   }
 }
 
-void JXL_INLINE Store8(uint32_t value, uint8_t* dest) { *dest = value & 0xff; }
-
 }  // namespace
 
 Status ConvertChannelsToExternal(const ImageF* in_channels[],
@@ -334,135 +442,54 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
     }
   }
 
-  if (float_out) {
-    if (bits_per_sample == 16) {
-      bool swap_endianness = little_endian != IsLittleEndian();
-      Plane<hwy::float16_t> f16_cache;
-      const auto init_cache = [&](size_t num_threads) -> Status {
-        JXL_ASSIGN_OR_RETURN(
-            f16_cache, Plane<hwy::float16_t>::Create(
-                           memory_manager, xsize, num_channels * num_threads));
-        JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
-        return true;
-      };
-      const auto process_row = [&](const uint32_t task,
-                                   const size_t thread) -> Status {
-        const int64_t y = task;
-        const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-        for (size_t c = 0; c < num_channels; c++) {
-          row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-        }
-        hwy::float16_t* JXL_RESTRICT row_f16[kConvertMaxChannels];
-        for (size_t c = 0; c < num_channels; c++) {
-          row_f16[c] = f16_cache.Row(c + thread * num_channels);
-          HWY_DYNAMIC_DISPATCH(FloatToF16)
-          (row_in[c], row_f16[c], xsize);
-        }
-        uint8_t* row_out =
-            out_callback.IsPresent()
-                ? row_out_callback[thread].data()
-                : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-        // interleave the one scanline
-        hwy::float16_t* row_f16_out =
-            reinterpret_cast<hwy::float16_t*>(row_out);
-        for (size_t x = 0; x < xsize; x++) {
-          for (size_t c = 0; c < num_channels; c++) {
-            row_f16_out[x * num_channels + c] = row_f16[c][x];
-          }
-        }
-        if (swap_endianness) {
-          size_t size = xsize * num_channels * 2;
-          for (size_t i = 0; i < size; i += 2) {
-            std::swap(row_out[i + 0], row_out[i + 1]);
-          }
-        }
-        if (out_callback.IsPresent()) {
-          out_callback.run(out_run_opaque.get(), thread, 0, y, xsize, row_out);
-        }
-        return true;
-      };
-      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(ysize),
-                                    init_cache, process_row, "ConvertF16"));
-    } else if (bits_per_sample == 32) {
-      const auto init_cache = [&](size_t num_threads) -> Status {
-        JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
-        return true;
-      };
-      const auto process_row = [&](const uint32_t task,
-                                   const size_t thread) -> Status {
-        const int64_t y = task;
-        uint8_t* row_out =
-            out_callback.IsPresent()
-                ? row_out_callback[thread].data()
-                : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-        const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-        for (size_t c = 0; c < num_channels; c++) {
-          row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-        }
-        if (little_endian) {
-          StoreFloatRow<StoreLEFloat>(row_in, num_channels, xsize, row_out);
-        } else {
-          StoreFloatRow<StoreBEFloat>(row_in, num_channels, xsize, row_out);
-        }
-        if (out_callback.IsPresent()) {
-          out_callback.run(out_run_opaque.get(), thread, 0, y, xsize, row_out);
-        }
-        return true;
-      };
-      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(ysize),
-                                    init_cache, process_row, "ConvertFloat"));
+  const bool swap_endianness = little_endian != IsLittleEndian();
+  if (float_out && bits_per_sample != 16 && bits_per_sample != 32) {
+    return JXL_FAILURE("float other than 16-bit and 32-bit not supported");
+  }
+
+  // Per-thread room for the last partial vector of pixels of a row.
+  const size_t scratch_size = kConvertMaxChannels * MaxVectorSize();
+  std::vector<uint8_t> scratch;
+  const auto init_cache = [&](size_t num_threads) -> Status {
+    scratch.resize(scratch_size * num_threads);
+    JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
+    return true;
+  };
+  const auto process_row = [&](const uint32_t task,
+                               const size_t thread) -> Status {
+    const int64_t y = task;
+    uint8_t* row_out =
+        out_callback.IsPresent()
+            ? row_out_callback[thread].data()
+            : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
+    const float* JXL_RESTRICT row_in[kConvertMaxChannels];
+    for (size_t c = 0; c < num_channels; c++) {
+      row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
+    }
+    uint8_t* row_scratch = scratch.data() + thread * scratch_size;
+    if (!float_out) {
+      HWY_DYNAMIC_DISPATCH(RowToUint)
+      (row_in, num_channels, xsize, bits_per_sample, swap_endianness,
+       row_scratch, row_out);
+    } else if (bits_per_sample == 16) {
+      HWY_DYNAMIC_DISPATCH(RowToF16)
+      (row_in, num_channels, xsize, swap_endianness, row_scratch, row_out);
+    } else if (!swap_endianness) {
+      HWY_DYNAMIC_DISPATCH(RowToF32)
+      (row_in, num_channels, xsize, row_scratch, row_out);
+    } else if (little_endian) {
+      StoreFloatRow<StoreLEFloat>(row_in, num_channels, xsize, row_out);
     } else {
-      return JXL_FAILURE("float other than 16-bit and 32-bit not supported");
+      StoreFloatRow<StoreBEFloat>(row_in, num_channels, xsize, row_out);
     }
-  } else {
-    // Multiplier to convert from floating point 0-1 range to the integer
-    // range.
-    float mul = (1ull << bits_per_sample) - 1;
-    Plane<uint32_t> u32_cache;
-    const auto init_cache = [&](size_t num_threads) -> Status {
-      JXL_ASSIGN_OR_RETURN(u32_cache,
-                           Plane<uint32_t>::Create(memory_manager, xsize,
-                                                   num_channels * num_threads));
-      JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
-      return true;
-    };
-    const auto process_row = [&](const uint32_t task,
-                                 const size_t thread) -> Status {
-      const int64_t y = task;
-      uint8_t* row_out =
-          out_callback.IsPresent()
-              ? row_out_callback[thread].data()
-              : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-      const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-      for (size_t c = 0; c < num_channels; c++) {
-        row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-      }
-      uint32_t* JXL_RESTRICT row_u32[kConvertMaxChannels];
-      for (size_t c = 0; c < num_channels; c++) {
-        row_u32[c] = u32_cache.Row(c + thread * num_channels);
-        // row_u32[] is a per-thread temporary row storage, this isn't
-        // intended to be initialized on a previous run.
-        msan::PoisonMemory(row_u32[c], xsize * sizeof(row_u32[c][0]));
-        HWY_DYNAMIC_DISPATCH(FloatToU32)
-        (row_in[c], row_u32[c], xsize, mul, bits_per_sample);
-      }
-      if (bits_per_sample <= 8) {
-        StoreUintRow<Store8>(row_u32, num_channels, xsize, 1, row_out);
-      } else {
-        if (little_endian) {
-          StoreUintRow<StoreLE16>(row_u32, num_channels, xsize, 2, row_out);
-        } else {
-          StoreUintRow<StoreBE16>(row_u32, num_channels, xsize, 2, row_out);
-        }
-      }
-      if (out_callback.IsPresent()) {
-        out_callback.run(out_run_opaque.get(), thread, 0, y, xsize, row_out);
-      }
-      return true;
-    };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(ysize),
-                                  init_cache, process_row, "ConvertUint"));
-  }
+    if (out_callback.IsPresent()) {
+      out_callback.run(out_run_opaque.get(), thread, 0, y, xsize, row_out);
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(ysize),
+                                init_cache, process_row,
+                                "ConvertToExternal"));
   return true;
 }
 
@@ -25,6 +25,8 @@
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
+#include "lib/jxl/blending.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
@@ -54,6 +56,7 @@
 #include "lib/jxl/render_pipeline/render_pipeline.h"
 #include "lib/jxl/splines.h"
 #include "lib/jxl/toc.h"
+#include "lib/jxl/trace.h"
 
 namespace jxl {
 
@@ -82,6 +85,7 @@ Status DecodeFrame(PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
                    FrameHeader* frame_header, ImageBundle* decoded,
                    const CodecMetadata& metadata,
                    bool use_slow_rendering_pipeline) {
+  JXL_TRACE_EVENT("DecodeFrame");
   FrameDecoder frame_decoder(dec_state, metadata, pool,
                              use_slow_rendering_pipeline);
 
@@ -108,7 +112,8 @@ Status DecodeFrame(PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
     size_t index = 0;
     for (auto toc_entry : frame_decoder.Toc()) {
       JXL_RETURN_IF_ERROR(pos + toc_entry.size <= avail_in);
-      auto br = make_unique<BitReader>(Bytes(next_in + pos, toc_entry.size));
+      auto br = make_unique<BitReader>(Bytes(next_in + pos, toc_entry.size),
+                                       avail_in - pos - toc_entry.size);
       section_info.emplace_back(
           FrameDecoder::SectionInfo{br.get(), toc_entry.id, index++});
       section_closers.emplace_back(
@@ -145,6 +150,16 @@ Status FrameDecoder::InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
   frame_dim_ = frame_header_.ToFrameDimensions();
   JXL_DEBUG_V(2, "FrameHeader: %s", frame_header_.DebugString().c_str());
 
+  if (DecoderStats* stats = dec_state_->stats) {
+    dc_group_stats_ = stats->Get("DecodeDCGroup");
+    ac_group_stats_ = stats->Get("DecodeACGroup");
+    vardct_group_stats_ = stats->Get("DecodeVarDCTGroup");
+    modular_group_stats_ = stats->Get("DecodeModularGroup");
+  } else {
+    dc_group_stats_ = ac_group_stats_ = nullptr;
+    vardct_group_stats_ = modular_group_stats_ = nullptr;
+  }
+
   const size_t num_passes = frame_header_.passes.num_passes;
   const size_t num_groups = frame_dim_.num_groups;
 
@@ -252,17 +267,136 @@ Status FrameDecoder::InitFrameOutput() {
   decoded_ac_global_ = false;
   is_finalized_ = false;
   finalized_dc_ = false;
+  pipeline_prepared_ = false;
   num_sections_done_ = 0;
   decoded_dc_groups_.clear();
   decoded_dc_groups_.resize(frame_dim_.num_dc_groups);
   decoded_passes_per_ac_group_.clear();
   decoded_passes_per_ac_group_.resize(frame_dim_.num_groups, 0);
+  flushed_passes_per_ac_group_.assign(frame_dim_.num_groups, 0);
+  flushed_with_ac_global_ = false;
   processed_section_.clear();
   processed_section_.resize(toc_.size());
   allocated_ = false;
+  has_crop_ = false;
+  crop_needed_groups_.clear();
+  skipped_section_.clear();
   return true;
 }
 
+void FrameDecoder::SetCropRegion(const Rect& crop) {
+  has_crop_ = true;
+  dec_state_->output_x0 = crop.x0();
+  dec_state_->output_y0 = crop.y0();
+  crop_needed_groups_.clear();
+  skipped_section_.clear();
+  // Groups can only be skipped if the output is the only consumer of the
+  // decoded pixels, and if frame coordinates match image coordinates.
+  if (decoded_->IsJPEG() || frame_header_.CanBeReferenced() ||
+      frame_header_.custom_size_or_origin || frame_dim_.num_groups == 1 ||
+      (frame_header_.frame_type != FrameType::kRegularFrame &&
+       frame_header_.frame_type != FrameType::kSkipProgressive)) {
+    return;
+  }
+  // The groups adjacent to the crop region are also needed, since the stages
+  // of the render pipeline read pixels across group borders.
+  const size_t group_dim = frame_dim_.group_dim * frame_header_.upsampling;
+  const size_t gx0 = std::max<size_t>(crop.x0() / group_dim, 1) - 1;
+  const size_t gy0 = std::max<size_t>(crop.y0() / group_dim, 1) - 1;
+  const size_t gx1 =
+      std::min(frame_dim_.xsize_groups, DivCeil(crop.x1(), group_dim) + 1);
+  const size_t gy1 =
+      std::min(frame_dim_.ysize_groups, DivCeil(crop.y1(), group_dim) + 1);
+  crop_needed_groups_.resize(frame_dim_.num_groups, 0);
+  for (size_t gy = gy0; gy < gy1; ++gy) {
+    for (size_t gx = gx0; gx < gx1; ++gx) {
+      crop_needed_groups_[gy * frame_dim_.xsize_groups + gx] = 1;
+    }
+  }
+
+  // Whole sections can be skipped ahead of time only if it is already known
+  // that no modular image spans the whole frame, which is the case for VarDCT
+  // frames without extra channels. Otherwise the AC groups are skipped in
+  // ProcessSections once the global modular info is known.
+  if (frame_header_.encoding != FrameEncoding::kVarDCT ||
+      frame_header_.nonserialized_metadata->m.num_extra_channels != 0 ||
+      (frame_header_.flags & FrameHeader::kUseDcFrame)) {
+    return;
+  }
+  const size_t num_passes = frame_header_.passes.num_passes;
+  const size_t ac_global_index = frame_dim_.num_dc_groups + 1;
+  std::vector<uint8_t> needed_dc_groups(frame_dim_.num_dc_groups, 0);
+  for (size_t g = 0; g < frame_dim_.num_groups; ++g) {
+    if (!crop_needed_groups_[g]) continue;
+    size_t gx = g % frame_dim_.xsize_groups;
+    size_t gy = g / frame_dim_.xsize_groups;
+    size_t dcx = gx * frame_dim_.group_dim / frame_dim_.dc_group_dim;
+    size_t dcy = gy * frame_dim_.group_dim / frame_dim_.dc_group_dim;
+    needed_dc_groups[dcy * frame_dim_.xsize_dc_groups + dcx] = 1;
+  }
+  skipped_section_.resize(toc_.size(), 0);
+  for (size_t d = 0; d < frame_dim_.num_dc_groups; ++d) {
+    if (needed_dc_groups[d]) continue;
+    decoded_dc_groups_[d] = JXL_TRUE;
+    skipped_section_[1 + d] = 1;
+  }
+  for (size_t g = 0; g < frame_dim_.num_groups; ++g) {
+    if (crop_needed_groups_[g]) continue;
+    decoded_passes_per_ac_group_[g] = num_passes;
+    for (size_t p = 0; p < num_passes; ++p) {
+      skipped_section_[ac_global_index + 1 + p * frame_dim_.num_groups + g] = 1;
+    }
+  }
+  for (size_t id = 0; id < skipped_section_.size(); ++id) {
+    if (!skipped_section_[id]) continue;
+    processed_section_[id] = JXL_TRUE;
+    num_sections_done_++;
+  }
+  // Adaptive DC smoothing and EPF read the DC and sigma images across DC group
+  // borders, so the parts belonging to skipped DC groups must be initialized.
+  ZeroFillImage(&dec_state_->shared_storage.dc_storage);
+  if (frame_header_.loop_filter.epf_iters > 0) {
+    ZeroFillImage(&dec_state_->sigma);
+  }
+}
+
+void FrameDecoder::SetDownsampling(size_t factor) {
+  dec_state_->output_downsampling = factor;
+  if (factor != 8 || decoded_->IsJPEG() ||
+      frame_header_.encoding != FrameEncoding::kVarDCT ||
+      frame_header_.CanBeReferenced() || NeedsBlending(frame_header_) ||
+      frame_header_.custom_size_or_origin || frame_header_.upsampling != 1 ||
+      !frame_header_.chroma_subsampling.Is444() ||
+      frame_header_.nonserialized_metadata->m.num_extra_channels != 0 ||
+      (frame_header_.flags & (FrameHeader::kPatches | FrameHeader::kSplines |
+                              FrameHeader::kUseDcFrame)) ||
+      (frame_header_.frame_type != FrameType::kRegularFrame &&
+       frame_header_.frame_type != FrameType::kSkipProgressive) ||
+      toc_.size() == 1) {
+    return;
+  }
+  // Each DC group becomes one group of the render pipeline.
+  dec_state_->output_downsampling = 1;
+  dec_state_->render_dc_only = true;
+  dec_state_->dc_frame_dim.Set(
+      DivCeil(frame_dim_.xsize, kBlockDim),
+      DivCeil(frame_dim_.ysize, kBlockDim), frame_header_.group_size_shift,
+      /*max_hshift=*/0, /*max_vshift=*/0, /*modular_mode=*/true,
+      /*upsampling=*/1);
+  // None of the AC sections is needed.
+  const size_t ac_global_index = frame_dim_.num_dc_groups + 1;
+  skipped_section_.resize(toc_.size(), 0);
+  for (size_t id = ac_global_index; id < toc_.size(); ++id) {
+    if (skipped_section_[id]) continue;
+    skipped_section_[id] = 1;
+    processed_section_[id] = JXL_TRUE;
+    num_sections_done_++;
+  }
+  for (size_t g = 0; g < frame_dim_.num_groups; ++g) {
+    decoded_passes_per_ac_group_[g] = frame_header_.passes.num_passes;
+  }
+}
+
 Status FrameDecoder::ProcessDCGlobal(BitReader* br) {
   PassesSharedState& shared = dec_state_->shared_storage;
   JxlMemoryManager* memory_manager = shared.memory_manager;
@@ -304,15 +438,30 @@ Status FrameDecoder::ProcessDCGlobal(BitReader* br) {
         dec_state_->shared->cmap.base()));
   }
   Status dec_status = modular_frame_decoder_.DecodeGlobalInfo(
-      br, frame_header_, /*allow_truncated_group=*/false);
+      br, frame_header_, pool_, /*allow_truncated_group=*/false);
   if (dec_status.IsFatalError()) return dec_status;
   if (dec_status) {
     decoded_dc_global_ = true;
+    ReleaseOverwrittenReference();
   }
   return dec_status;
 }
 
+void FrameDecoder::ReleaseOverwrittenReference() {
+  if (!frame_header_.CanBeReferenced()) return;
+  const size_t slot = frame_header_.save_as_reference;
+  if (ReferencedSlots() & (1 << slot)) return;
+  // Nothing in this frame reads the reference frame it is going to replace,
+  // so it is freed before the new one is rendered rather than after; that way
+  // both are never held at once.
+  auto& info = dec_state_->shared_storage.reference_frames[slot];
+  *info.frame = ImageBundle(dec_state_->memory_manager());
+  info.ib_is_in_xyb = false;
+}
+
 Status FrameDecoder::ProcessDCGroup(size_t dc_group_id, BitReader* br) {
+  JXL_TRACE_SCOPE(kDecodeGroups);
+  ScopedStatsTimer timer(dc_group_stats_, br->TotalBytes());
   const size_t gx = dc_group_id % frame_dim_.xsize_dc_groups;
   const size_t gy = dc_group_id / frame_dim_.xsize_dc_groups;
   const LoopFilter& lf = frame_header_.loop_filter;
@@ -338,6 +487,19 @@ Status FrameDecoder::ProcessDCGroup(size_t dc_group_id, BitReader* br) {
   return true;
 }
 
+Status FrameDecoder::PrepareRenderPipeline() {
+  PassesDecoderState::PipelineOptions pipeline_options;
+  pipeline_options.use_slow_render_pipeline = use_slow_rendering_pipeline_;
+  pipeline_options.coalescing = coalescing_;
+  pipeline_options.render_spotcolors = render_spotcolors_;
+  pipeline_options.render_noise = true;
+  JXL_RETURN_IF_ERROR(dec_state_->PreparePipeline(
+      frame_header_, &frame_header_.nonserialized_metadata->m, decoded_,
+      pipeline_options));
+  pipeline_prepared_ = true;
+  return true;
+}
+
 Status FrameDecoder::FinalizeDC() {
   // Do Adaptive DC smoothing if enabled. This *must* happen between all the
   // ProcessDCGroup and ProcessACGroup.
@@ -354,6 +516,35 @@ Status FrameDecoder::FinalizeDC() {
   return true;
 }
 
+Status FrameDecoder::RenderDC() {
+  JXL_ENSURE(finalized_dc_);
+  const FrameDimensions& dc_frame_dim = dec_state_->dc_frame_dim;
+  JXL_ENSURE(dc_frame_dim.num_groups == frame_dim_.num_dc_groups);
+  const auto prepare_storage = [this](size_t num_threads) -> Status {
+    JXL_RETURN_IF_ERROR(
+        PrepareStorage(num_threads, dec_state_->dc_frame_dim.num_groups));
+    return true;
+  };
+  const auto render_group = [this](const uint32_t g, size_t thread) -> Status {
+    RenderPipelineInput input = dec_state_->render_pipeline->GetInputBuffers(
+        g, GetStorageLocation(thread, g));
+    const Rect dc_rect = frame_dim_.DCGroupRect(g);
+    for (size_t c = 0; c < 3; c++) {
+      const auto& buffer = input.GetBuffer(c);
+      const Rect dst_rect(buffer.second.x0(), buffer.second.y0(),
+                          dc_rect.xsize(), dc_rect.ysize());
+      JXL_ENSURE(dst_rect.IsInside(*buffer.first));
+      JXL_RETURN_IF_ERROR(CopyImageTo(dc_rect, dec_state_->shared->dc->Plane(c),
+                                      dst_rect, buffer.first));
+    }
+    JXL_RETURN_IF_ERROR(input.Done());
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, dc_frame_dim.num_groups,
+                                prepare_storage, render_group, "RenderDC"));
+  return true;
+}
+
 Status FrameDecoder::AllocateOutput() {
   if (allocated_) return true;
   modular_frame_decoder_.MaybeDropFullImage();
@@ -410,10 +601,9 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
           std::max(max_num_bits_ac, dec_state_->code[i].max_num_bits);
     }
     max_num_bits_ac += CeilLog2Nonzero(frame_header_.passes.num_passes);
-    // 16-bit buffer for decoding to JPEG are not implemented.
     // TODO(veluca): figure out the exact limit - 16 should still work with
     // 16-bit buffers, but we are excluding it for safety.
-    bool use_16_bit = max_num_bits_ac < 16 && !decoded_->IsJPEG();
+    bool use_16_bit = max_num_bits_ac < 16;
     bool store = frame_header_.passes.num_passes > 1;
     size_t xs = store ? kGroupDim * kGroupDim : 0;
     size_t ys = store ? frame_dim_.num_groups : 0;
@@ -479,6 +669,7 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
                                     BitReader* JXL_RESTRICT* br,
                                     size_t num_passes, size_t thread,
                                     bool force_draw, bool dc_only) {
+  JXL_TRACE_SCOPE(kDecodeGroups);
   size_t group_dim = frame_dim_.group_dim;
   const size_t gx = ac_group_id % frame_dim_.xsize_groups;
   const size_t gy = ac_group_id / frame_dim_.xsize_groups;
@@ -491,6 +682,12 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
               ac_group_id, gx, gy, group_dim,
               decoded_passes_per_ac_group_[ac_group_id], num_passes);
 
+  size_t compressed_bytes = 0;
+  for (size_t i = 0; i < num_passes; i++) {
+    compressed_bytes += br[i]->TotalBytes();
+  }
+  ScopedStatsTimer timer(ac_group_stats_, compressed_bytes);
+
   RenderPipelineInput render_pipeline_input =
       dec_state_->render_pipeline->GetInputBuffers(ac_group_id, thread);
 
@@ -498,7 +695,8 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
 
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
     JXL_RETURN_IF_ERROR(group_dec_caches_[thread].InitOnce(
-        memory_manager, frame_header_.passes.num_passes, dec_state_->used_acs));
+        memory_manager, frame_header_.passes.num_passes));
+    ScopedStatsTimer vardct_timer(vardct_group_stats_, compressed_bytes);
     JXL_RETURN_IF_ERROR(DecodeGroup(
         frame_header_, br, num_passes, ac_group_id, dec_state_,
         &group_dec_caches_[thread], thread, render_pipeline_input,
@@ -523,6 +721,8 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
       JXL_DEBUG_V(2, "Bit reader position: %" PRIuS " / %" PRIuS,
                   br[i - pass0]->TotalBitsConsumed(),
                   br[i - pass0]->TotalBytes() * kBitsPerByte);
+      ScopedStatsTimer modular_timer(modular_group_stats_,
+                                     br[i - pass0]->TotalBytes());
       JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeGroup(
           frame_header_, mrect, br[i - pass0], minShift, maxShift,
           ModularStreamId::ModularAC(ac_group_id, i),
@@ -568,6 +768,7 @@ void FrameDecoder::MarkSections(const SectionInfo* sections, size_t num,
 Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
                                      SectionStatus* section_status) {
   if (num == 0) return true;  // Nothing to process
+  JXL_TRACE_EVENT("ProcessSections");
   std::fill(section_status, section_status + num, SectionStatus::kSkipped);
   size_t dc_global_sec = num;
   size_t ac_global_sec = num;
@@ -640,31 +841,41 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
   }
 
   if (decoded_dc_global_) {
+    // If this call completes the DC, the render pipeline is built as one more
+    // task next to the DC groups, rather than serially after all of them.
+    bool completes_dc = !finalized_dc_ && !pipeline_prepared_;
+    for (size_t i = 0; completes_dc && i < dc_group_sec.size(); i++) {
+      if (!decoded_dc_groups_[i] && dc_group_sec[i] == num) {
+        completes_dc = false;
+      }
+    }
+    const size_t num_dc_groups = dc_group_sec.size();
     const auto process_section = [this, &dc_group_sec, &num, &sections,
-                                  &section_status](size_t i,
-                                                   size_t thread) -> Status {
+                                  &section_status, num_dc_groups](
+                                     size_t i, size_t thread) -> Status {
+      if (i == num_dc_groups) return PrepareRenderPipeline();
       if (dc_group_sec[i] != num) {
         JXL_RETURN_IF_ERROR(ProcessDCGroup(i, sections[dc_group_sec[i]].br));
         section_status[dc_group_sec[i]] = SectionStatus::kDone;
       }
       return true;
     };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, dc_group_sec.size(),
+    JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0,
+                                  num_dc_groups + (completes_dc ? 1 : 0),
                                   ThreadPool::NoInit, process_section,
                                   "DecodeDCGroup"));
   }
 
   if (!HasDcGroupToDecode() && !finalized_dc_) {
-    PassesDecoderState::PipelineOptions pipeline_options;
-    pipeline_options.use_slow_render_pipeline = use_slow_rendering_pipeline_;
-    pipeline_options.coalescing = coalescing_;
-    pipeline_options.render_spotcolors = render_spotcolors_;
-    pipeline_options.render_noise = true;
-    JXL_RETURN_IF_ERROR(dec_state_->PreparePipeline(
-        frame_header_, &frame_header_.nonserialized_metadata->m, decoded_,
-        pipeline_options));
+    if (!pipeline_prepared_) {
+      JXL_RETURN_IF_ERROR(PrepareRenderPipeline());
+    }
     JXL_RETURN_IF_ERROR(FinalizeDC());
     JXL_RETURN_IF_ERROR(AllocateOutput());
+    if (dec_state_->render_dc_only) {
+      JXL_RETURN_IF_ERROR(RenderDC());
+      return true;
+    }
     if (progressive_detail_ >= JxlProgressiveDetail::kDC) {
       MarkSections(sections, num, section_status);
       return true;
@@ -708,6 +919,15 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
       }
       (void)num;
       size_t first_pass = decoded_passes_per_ac_group_[g];
+      if (SkipACGroup(g)) {
+        // Outside of the crop region: consume the sections without decoding.
+        for (size_t i = 0; i < desired_num_ac_passes[g]; i++) {
+          section_status[ac_group_sec[g][first_pass + i]] =
+              SectionStatus::kDone;
+        }
+        decoded_passes_per_ac_group_[g] += desired_num_ac_passes[g];
+        return true;
+      }
       BitReader* JXL_RESTRICT readers[kMaxNumPasses];
       for (size_t i = 0; i < desired_num_ac_passes[g]; i++) {
         JXL_ENSURE(ac_group_sec[g][first_pass + i] != num);
@@ -724,6 +944,7 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
     JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, ac_group_sec.size(),
                                   prepare_storage, process_group,
                                   "DecodeGroup"));
+    JXL_RETURN_IF_ERROR(RenderDeferred());
   }
 
   MarkSections(sections, num, section_status);
@@ -756,10 +977,23 @@ Status FrameDecoder::Flush() {
   uint32_t completely_decoded_ac_pass = *std::min_element(
       decoded_passes_per_ac_group_.begin(), decoded_passes_per_ac_group_.end());
   if (completely_decoded_ac_pass < frame_header_.passes.num_passes) {
-    // We don't have all AC yet: force a draw of all the missing areas.
-    // Mark all sections as not complete.
+    // We don't have all AC yet: force a draw of the missing areas. Groups that
+    // did not receive new passes since the previous Flush() are still up to
+    // date in the output and are not drawn again.
+    if (flushed_with_ac_global_ != decoded_ac_global_) {
+      std::fill(flushed_passes_per_ac_group_.begin(),
+                flushed_passes_per_ac_group_.end(), 0);
+      flushed_with_ac_global_ = decoded_ac_global_;
+    }
+    const auto needs_draw = [this](const size_t g) {
+      return decoded_passes_per_ac_group_[g] <
+                 frame_header_.passes.num_passes &&
+             flushed_passes_per_ac_group_[g] !=
+                 decoded_passes_per_ac_group_[g] + 1;
+    };
+    // Mark the sections to draw as not complete.
     for (size_t i = 0; i < decoded_passes_per_ac_group_.size(); i++) {
-      if (decoded_passes_per_ac_group_[i] < frame_header_.passes.num_passes) {
+      if (needs_draw(i)) {
         dec_state_->render_pipeline->ClearDone(i);
       }
     }
@@ -768,21 +1002,23 @@ Status FrameDecoder::Flush() {
           PrepareStorage(num_threads, decoded_passes_per_ac_group_.size()));
       return true;
     };
-    const auto process_group = [this](const uint32_t g,
-                                      size_t thread) -> Status {
-      if (decoded_passes_per_ac_group_[g] == frame_header_.passes.num_passes) {
-        // This group was drawn already, nothing to do.
+    const auto process_group = [this, &needs_draw](const uint32_t g,
+                                                   size_t thread) -> Status {
+      if (!needs_draw(g) || SkipACGroup(g)) {
+        // This group was drawn already or is not needed, nothing to do.
         return true;
       }
       BitReader* JXL_RESTRICT readers[kMaxNumPasses] = {};
       JXL_RETURN_IF_ERROR(ProcessACGroup(
           g, readers, /*num_passes=*/0, GetStorageLocation(thread, g),
           /*force_draw=*/true, /*dc_only=*/!decoded_ac_global_));
+      flushed_passes_per_ac_group_[g] = decoded_passes_per_ac_group_[g] + 1;
       return true;
     };
     JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, decoded_passes_per_ac_group_.size(),
                                   prepare_storage, process_group,
                                   "ForceDrawGroup"));
+    JXL_RETURN_IF_ERROR(RenderDeferred());
   }
 
   // undo global modular transforms and copy int pixel buffers to float ones
@@ -819,7 +1055,10 @@ int FrameDecoder::References() const {
     return 0;
   }
   if (!HasEverything()) return 0;
+  return ReferencedSlots();
+}
 
+int FrameDecoder::ReferencedSlots() const {
   int result = 0;
 
   // Blending
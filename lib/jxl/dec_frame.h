@@ -19,11 +19,13 @@
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/dec_modular.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
@@ -52,6 +54,12 @@ class FrameDecoder {
         modular_frame_decoder_(dec_state_->memory_manager()),
         use_slow_rendering_pipeline_(use_slow_rendering_pipeline) {}
 
+  // Takes over the per-thread scratch storage of `other`, a frame decoder that
+  // is no longer used, to avoid allocating it again for this frame.
+  void ReuseStorage(FrameDecoder* other) {
+    group_dec_caches_ = std::move(other->group_dec_caches_);
+  }
+
   void SetRenderSpotcolors(bool rsc) { render_spotcolors_ = rsc; }
   void SetCoalescing(bool c) { coalescing_ = c; }
 
@@ -63,6 +71,37 @@ class FrameDecoder {
   // image buffer.
   Status InitFrameOutput();
 
+  // Restricts the output to `crop`, given in image coordinates before undoing
+  // the orientation. If the frame cannot be referenced by other frames, the
+  // groups that do not contribute to the pixels of `crop` are not decoded.
+  // Must be called after InitFrameOutput and before ProcessSections.
+  void SetCropRegion(const Rect& crop);
+
+  // Makes the output 1/`factor` of the image resolution in each direction;
+  // `factor` is one of 2, 4 or 8. For VarDCT frames that are not referenced
+  // by other frames and do not use patches, splines or extra channels,
+  // downsampling by 8 renders the DC image directly and skips all AC
+  // sections; otherwise the frame is decoded at full resolution and only one
+  // pixel out of `factor` x `factor` is written to the output.
+  // Must be called after InitFrameOutput and before ProcessSections.
+  void SetDownsampling(size_t factor);
+
+  // Returns true if the section with the given id will not be decoded because
+  // it does not intersect the crop region or is not needed for the requested
+  // downsampling; such sections need not be passed to ProcessSections.
+  bool IsSectionSkipped(size_t id) const {
+    return id < skipped_section_.size() && skipped_section_[id];
+  }
+
+  // Returns true if the section with the given id is needed to complete the
+  // first `num_passes` passes of the frame; the global and DC sections are
+  // needed by all of them.
+  bool IsSectionInPasses(size_t id, size_t num_passes) const {
+    const size_t ac_global_index = frame_dim_.num_dc_groups + 1;
+    if (toc_.size() == 1 || id <= ac_global_index) return true;
+    return (id - ac_global_index - 1) / frame_dim_.num_groups < num_passes;
+  }
+
   struct SectionInfo {
     BitReader* JXL_RESTRICT br;
     // Logical index of the section, regardless of any permutation that may be
@@ -192,7 +231,8 @@ class FrameDecoder {
   void SetImageOutput(const PixelCallback& pixel_callback, void* image_buffer,
                       size_t image_buffer_size, size_t xsize, size_t ysize,
                       JxlPixelFormat format, size_t bits_per_sample,
-                      bool unpremul_alpha, bool undo_orientation) const {
+                      bool unpremul_alpha, bool premul_alpha,
+                      bool undo_orientation) const {
     dec_state_->width = xsize;
     dec_state_->height = ysize;
     dec_state_->main_output.format = format;
@@ -201,11 +241,15 @@ class FrameDecoder {
     dec_state_->main_output.buffer = image_buffer;
     dec_state_->main_output.buffer_size = image_buffer_size;
     dec_state_->main_output.stride = GetStride(xsize, format);
+    dec_state_->main_output.planes.clear();
     const jxl::ExtraChannelInfo* alpha =
         decoded_->metadata()->Find(jxl::ExtraChannel::kAlpha);
     if (alpha && alpha->alpha_associated && unpremul_alpha) {
       dec_state_->unpremul_alpha = true;
     }
+    if (alpha && !alpha->alpha_associated && premul_alpha) {
+      dec_state_->premul_alpha = true;
+    }
     if (undo_orientation) {
       dec_state_->undo_orientation = decoded_->metadata()->GetOrientation();
       if (static_cast<int>(dec_state_->undo_orientation) > 4) {
@@ -216,9 +260,10 @@ class FrameDecoder {
 #if !JXL_HIGH_PRECISION
     if (dec_state_->main_output.buffer &&
         (format.data_type == JXL_TYPE_UINT8) && (format.num_channels >= 3) &&
-        !dec_state_->unpremul_alpha &&
+        !dec_state_->unpremul_alpha && !dec_state_->premul_alpha &&
         (dec_state_->undo_orientation == Orientation::kIdentity) &&
-        decoded_->metadata()->xyb_encoded &&
+        !has_crop_ && dec_state_->output_downsampling == 1 &&
+        !dec_state_->render_dc_only && decoded_->metadata()->xyb_encoded &&
         dec_state_->output_encoding_info.color_encoding.IsSRGB() &&
         dec_state_->output_encoding_info.all_default_opsin &&
         (dec_state_->output_encoding_info.desired_intensity_target ==
@@ -227,6 +272,33 @@ class FrameDecoder {
       dec_state_->fast_xyb_srgb8_conversion = true;
     }
 #endif
+    const OutputEncodingInfo& output_info = dec_state_->output_encoding_info;
+    if (!dec_state_->fast_xyb_srgb8_conversion &&
+        (format.data_type == JXL_TYPE_UINT8 ||
+         format.data_type == JXL_TYPE_UINT16) &&
+        (format.num_channels >= 3) && !dec_state_->unpremul_alpha &&
+        !dec_state_->premul_alpha && decoded_->metadata()->xyb_encoded &&
+        output_info.color_encoding.IsSRGB() &&
+        (output_info.color_encoding_is_original || !output_info.cms_set) &&
+        frame_header_.color_transform == ColorTransform::kXYB) {
+      dec_state_->fuse_xyb_srgb_output = true;
+    }
+    if ((format.data_type == JXL_TYPE_UINT8 ||
+         format.data_type == JXL_TYPE_UINT16) &&
+        (format.num_channels >= 3) && !dec_state_->unpremul_alpha &&
+        !dec_state_->premul_alpha && output_info.color_encoding.IsSRGB() &&
+        (output_info.color_encoding_is_original || !output_info.cms_set)) {
+      dec_state_->fuse_srgb_output = true;
+    }
+  }
+
+  // Writes the channels of the main output to separate planes rather than to
+  // the interleaved image buffer. Must be called after SetImageOutput.
+  void SetImageOutputPlanes(std::vector<ImageOutputPlane> planes) {
+    dec_state_->main_output.planes = std::move(planes);
+    dec_state_->fast_xyb_srgb8_conversion = false;
+    dec_state_->fuse_xyb_srgb_output = false;
+    dec_state_->fuse_srgb_output = false;
   }
 
   void AddExtraChannelOutput(void* buffer, size_t buffer_size, size_t xsize,
@@ -243,7 +315,17 @@ class FrameDecoder {
  private:
   Status ProcessDCGlobal(BitReader* br);
   Status ProcessDCGroup(size_t dc_group_id, BitReader* br);
+  // Frees the reference frame slot this frame is saved to, if the frame does
+  // not read it. Requires DC global to be decoded.
+  void ReleaseOverwrittenReference();
+  // Same as References(), but only requires DC global to be decoded.
+  int ReferencedSlots() const;
+  // Builds the render pipeline. It only depends on DC global, so it can run
+  // concurrently with ProcessDCGroup.
+  Status PrepareRenderPipeline();
   Status FinalizeDC();
+  // Renders the DC image to the output, when downsampling by 8.
+  Status RenderDC();
   Status AllocateOutput();
   Status ProcessACGlobal(BitReader* br);
   Status ProcessACGroup(size_t ac_group_id, BitReader* JXL_RESTRICT* br,
@@ -268,12 +350,29 @@ class FrameDecoder {
         (modular_frame_decoder_.UsesFullImage() &&
          (frame_header_.encoding == FrameEncoding::kVarDCT || use_noise));
     if (dec_state_->render_pipeline) {
+      bool render_in_stripes = RenderInStripes();
+      dec_state_->render_pipeline->SetDeferRendering(render_in_stripes);
       JXL_RETURN_IF_ERROR(dec_state_->render_pipeline->PrepareForThreads(
-          storage_size, use_group_ids));
+          storage_size, use_group_ids || render_in_stripes));
     }
     return true;
   }
 
+  // Returns true if the frame has too few groups to keep the threads busy
+  // while rendering group by group, in which case the groups are rendered
+  // after decoding, in parallel stripes.
+  bool RenderInStripes() const {
+    constexpr size_t kMaxGroupsForStripes = 8;
+    return pool_ != nullptr && frame_dim_.num_groups < kMaxGroupsForStripes &&
+           !dec_state_->render_dc_only &&
+           !modular_frame_decoder_.UsesFullImage() && !decoded_->IsJPEG();
+  }
+
+  Status RenderDeferred() {
+    if (!dec_state_->render_pipeline) return true;
+    return dec_state_->render_pipeline->RenderDeferred(pool_);
+  }
+
   size_t GetStorageLocation(size_t thread, size_t task) const {
     if (use_task_id_) return task;
     return thread;
@@ -294,6 +393,13 @@ class FrameDecoder {
     return stride;
   }
 
+  // Returns true if the AC group is outside of the area needed for the crop
+  // region and does not need to be decoded.
+  bool SkipACGroup(size_t ac_group_id) const {
+    return !crop_needed_groups_.empty() && !crop_needed_groups_[ac_group_id] &&
+           !modular_frame_decoder_.UsesFullImage();
+  }
+
   bool HasDcGroupToDecode() const {
     return std::any_of(decoded_dc_groups_.cbegin(), decoded_dc_groups_.cend(),
                        [](uint8_t ready) { return ready == 0; });
@@ -311,13 +417,27 @@ class FrameDecoder {
   bool render_spotcolors_ = true;
   bool coalescing_ = true;
 
+  // Whether SetCropRegion was called for this frame.
+  bool has_crop_ = false;
+  // For each AC group, whether it is needed to render the crop region; empty
+  // if all groups are needed.
+  std::vector<uint8_t> crop_needed_groups_;
+  // Sections that are known not to be needed before decoding starts.
+  std::vector<uint8_t> skipped_section_;
+
   std::vector<uint8_t> processed_section_;
   std::vector<uint8_t> decoded_passes_per_ac_group_;
+  // For each AC group, one more than the number of passes it had when Flush()
+  // last drew it, or 0 if it was not drawn since it last received new passes.
+  std::vector<uint8_t> flushed_passes_per_ac_group_;
+  // Whether AC global was decoded at the time of the last Flush().
+  bool flushed_with_ac_global_;
   std::vector<uint8_t> decoded_dc_groups_;
   bool decoded_dc_global_;
   bool decoded_ac_global_;
   bool HasEverything() const;
   bool finalized_dc_ = true;
+  bool pipeline_prepared_ = false;
   size_t num_sections_done_ = 0;
   bool is_finalized_ = true;
   bool allocated_ = false;
@@ -331,6 +451,13 @@ class FrameDecoder {
   // Testing setting: whether or not to use the slow rendering pipeline.
   bool use_slow_rendering_pipeline_;
 
+  // Statistics entries of the decoding steps; null unless statistics are
+  // collected.
+  DecoderStats::Entry* dc_group_stats_ = nullptr;
+  DecoderStats::Entry* ac_group_stats_ = nullptr;
+  DecoderStats::Entry* vardct_group_stats_ = nullptr;
+  DecoderStats::Entry* modular_group_stats_ = nullptr;
+
   JxlProgressiveDetail progressive_detail_ = kFrames;
   // Number of completed passes where section decoding should pause.
   // Used for progressive details at least kLastPasses.
@@ -165,6 +165,57 @@ void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
   }
 }
 
+// Dequantization, CfL and IDCT of channel `c` of a DCT8 varblock. Each vector
+// of coefficients goes from the quantized block through the first IDCT pass
+// without being stored in between; X and B recompute the dequantized Y
+// coefficients they need instead of reading them back.
+template <ACType ac_type>
+void DequantAndIDCTDCT8(size_t c, float scaled_dequant_y,
+                        float scaled_dequant_c, float cc_ratio, float dc,
+                        const float* JXL_RESTRICT dequant_matrices,
+                        const float* JXL_RESTRICT biases, ACPtr qblock[3],
+                        float* JXL_RESTRICT pixels, size_t pixels_stride,
+                        float* JXL_RESTRICT block,
+                        float* JXL_RESTRICT scratch) {
+  const HWY_CAPPED(float, kBlockDim) d8;
+  const Rebind<int32_t, decltype(d8)> di8;
+  const Rebind<int16_t, decltype(d8)> di16_8;
+
+  const auto dequant = [&](size_t cc, float scaled_dequant, size_t k) {
+    Vec<decltype(di8)> quantized;
+    if (ac_type == ACType::k16) {
+      quantized = PromoteTo(di8, LoadU(di16_8, qblock[cc].ptr16 + k));
+    } else {
+      quantized = LoadU(di8, qblock[cc].ptr32 + k);
+    }
+    const auto mul = Mul(LoadU(d8, dequant_matrices + cc * kDCTBlockSize + k),
+                         Set(d8, scaled_dequant));
+    return Mul(AdjustQuantBias(di8, cc, quantized, biases), mul);
+  };
+  const auto cc_mul = Set(d8, cc_ratio);
+  const auto row = [&](size_t k) {
+    if (c == 1) return dequant(1, scaled_dequant_y, k);
+    return MulAdd(cc_mul, dequant(1, scaled_dequant_y, k),
+                  dequant(c, scaled_dequant_c, k));
+  };
+
+  for (size_t i = 0; i < kBlockDim; i += Lanes(d8)) {
+    auto row0 = row(i);
+    if (i == 0) {
+      // The lowest frequency of a DCT8 is its DC.
+      row0 = IfThenElse(FirstN(d8, 1), Set(d8, dc), row0);
+    }
+    IDCT8Vectors(d8, row0, row(1 * kBlockDim + i), row(2 * kBlockDim + i),
+                 row(3 * kBlockDim + i), row(4 * kBlockDim + i),
+                 row(5 * kBlockDim + i), row(6 * kBlockDim + i),
+                 row(7 * kBlockDim + i), block + i, kBlockDim);
+  }
+  // Rest of ComputeScaledIDCT<8, 8>.
+  Transpose<8, 8>::Run(DCTFrom(block, kBlockDim), DCTTo(scratch, kBlockDim));
+  IDCT1D<8, 8>()(DCTFrom(scratch, kBlockDim), DCTTo(pixels, pixels_stride),
+                 scratch + kDCTBlockSize);
+}
+
 Status DecodeGroupImpl(const FrameHeader& frame_header,
                        GetBlock* JXL_RESTRICT get_block,
                        GroupDecCache* JXL_RESTRICT group_dec_cache,
@@ -173,6 +224,7 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
                        RenderPipelineInput& render_pipeline_input,
                        jpeg::JPEGData* jpeg_data, DrawMode draw) {
   // TODO(veluca): investigate cache usage in this function.
+  JxlMemoryManager* memory_manager = dec_state->memory_manager();
   const Rect block_rect =
       dec_state->shared->frame_dim.BlockGroupRect(group_idx);
   const AcStrategyImage& ac_strategy = dec_state->shared->ac_strategy;
@@ -199,6 +251,13 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
   ACType ac_type = dec_state->coefficients->Type();
   auto dequant_block = ac_type == ACType::k16 ? DequantBlock<ACType::k16>
                                               : DequantBlock<ACType::k32>;
+  auto dequant_and_idct_dct8 = ac_type == ACType::k16
+                                   ? DequantAndIDCTDCT8<ACType::k16>
+                                   : DequantAndIDCTDCT8<ACType::k32>;
+  // Frames with only DCT8 varblocks (e.g. recompressed JPEGs) skip the
+  // dispatch on the varblock strategy when drawing.
+  const bool dct8_only =
+      dec_state->used_acs == (1u << static_cast<uint32_t>(AcStrategyType::DCT));
   // Whether or not coefficients should be stored for future usage, and/or read
   // from past usage.
   bool accumulate = !dec_state->coefficients->IsEmpty();
@@ -297,8 +356,11 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
     for (size_t tx = 0; tx < DivCeil(xsize_blocks, kColorTileDimInBlocks);
          tx++) {
       size_t abs_tx = tx + block_rect.x0() / kColorTileDimInBlocks;
-      auto x_cc_mul = Set(d, color_correlation.YtoXRatio(row_cmap[0][abs_tx]));
-      auto b_cc_mul = Set(d, color_correlation.YtoBRatio(row_cmap[2][abs_tx]));
+      const float cc_ratio[3] = {
+          color_correlation.YtoXRatio(row_cmap[0][abs_tx]), 0.0f,
+          color_correlation.YtoBRatio(row_cmap[2][abs_tx])};
+      auto x_cc_mul = Set(d, cc_ratio[0]);
+      auto b_cc_mul = Set(d, cc_ratio[2]);
       // Increment bx by llf_x because those iterations would otherwise
       // immediately continue (!IsFirstBlock). Reduces mispredictions.
       for (; bx < xsize_blocks && bx < (tx + 1) * kColorTileDimInBlocks;) {
@@ -325,6 +387,8 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
           // No point in reading from bitstream without accumulating and not
           // drawing.
           JXL_ENSURE(draw == kDraw);
+          JXL_RETURN_IF_ERROR(group_dec_cache->EnsureQuantizedBlocks(
+              memory_manager, size, ac_type));
           if (ac_type == ACType::k16) {
             memset(group_dec_cache->dec_group_qblock16, 0,
                    size * 3 * sizeof(int16_t));
@@ -354,6 +418,7 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
           }
 
           HWY_ALIGN int32_t transposed_dct_y[64];
+          HWY_ALIGN int32_t jpeg_block[64];
           for (size_t c : {1, 0, 2}) {
             // Propagate only Y for grayscale.
             if (jpeg_is_gray && c != 1) {
@@ -365,7 +430,14 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
             int16_t* JXL_RESTRICT jpeg_pos =
                 jpeg_row[c] + sbx[c] * kDCTBlockSize;
             // JPEG XL is transposed, JPEG is not.
-            auto* transposed_dct = qblock[c].ptr32;
+            int32_t* JXL_RESTRICT transposed_dct = qblock[c].ptr32;
+            if (ac_type == ACType::k16) {
+              transposed_dct = jpeg_block;
+              for (size_t i = 0; i < 64; i += Lanes(di)) {
+                Store(PromoteTo(di, Load(di16, qblock[c].ptr16 + i)), di,
+                      transposed_dct + i);
+              }
+            }
             Transpose8x8InPlace(transposed_dct);
             // No CfL - no need to store the y block converted to integers.
             if (!cs.Is444() ||
@@ -412,7 +484,32 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
               return JXL_FAILURE("JPEG DCT coefficients out of range");
             }
           }
+        } else if (dct8_only) {
+          JXL_RETURN_IF_ERROR(group_dec_cache->EnsureFloatBlocks(
+              memory_manager, kDCTBlockSize));
+          const float scaled_dequant_s = inv_global_scale / row_quant[bx];
+          const float scaled_dequant[3] = {
+              scaled_dequant_s * dec_state->x_dm_multiplier, scaled_dequant_s,
+              scaled_dequant_s * dec_state->b_dm_multiplier};
+          const float* dequant_matrices =
+              dec_state->shared->quantizer.DequantMatrix(AcStrategyType::DCT,
+                                                         0);
+          for (size_t c : {1, 0, 2}) {
+            if ((sbx[c] << hshift[c] != bx) || (sby[c] << vshift[c] != by)) {
+              continue;
+            }
+            float* JXL_RESTRICT idct_pos = idct_row[c] + sbx[c] * kBlockDim;
+            dequant_and_idct_dct8(
+                c, scaled_dequant_s, scaled_dequant[c], cc_ratio[c],
+                dc_rows[c][sbx[c]], dequant_matrices,
+                dec_state->output_encoding_info.opsin_params.quant_biases,
+                qblock, idct_pos, idct_stride[c],
+                group_dec_cache->dec_group_block,
+                group_dec_cache->scratch_space);
+          }
         } else {
+          JXL_RETURN_IF_ERROR(
+              group_dec_cache->EnsureFloatBlocks(memory_manager, size));
           HWY_ALIGN float* const block = group_dec_cache->dec_group_block;
           // Dequantize and add predictions.
           dequant_block(
@@ -451,7 +548,7 @@ namespace jxl {
 namespace {
 // Decode quantized AC coefficients of DCT blocks.
 // LLF components in the output block will not be modified.
-template <ACType ac_type, bool uses_lz77>
+template <ACType ac_type, bool uses_lz77, typename UintConfig>
 Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
                         int32_t* JXL_RESTRICT row_nzeros,
                         const int32_t* JXL_RESTRICT row_nzeros_top,
@@ -479,7 +576,8 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
       block_ctx_map.NonZeroContext(predicted_nzeros, block_ctx) + ctx_offset;
 
   size_t nzeros =
-      decoder->ReadHybridUintInlined<uses_lz77>(nzero_ctx, br, context_map);
+      decoder->ReadHybridUintInlined<uses_lz77, UintConfig>(nzero_ctx, br,
+                                                            context_map);
   if (nzeros > size - covered_blocks) {
     return JXL_FAILURE("Invalid AC: nzeros %" PRIuS " too large for %" PRIuS
                        " 8x8 blocks",
@@ -501,7 +599,8 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
         histo_offset + ZeroDensityContext(nzeros, k, covered_blocks,
                                           log2_covered_blocks, prev);
     const size_t u_coeff =
-        decoder->ReadHybridUintInlined<uses_lz77>(ctx, br, context_map);
+        decoder->ReadHybridUintInlined<uses_lz77, UintConfig>(ctx, br,
+                                                              context_map);
     // Hand-rolled version of UnpackSigned, shifting before the conversion to
     // signed integer to avoid undefined behavior of shifting negative numbers.
     const size_t magnitude = u_coeff >> 1;
@@ -526,6 +625,23 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
   return true;
 }
 
+using DecodeACVarBlockFn =
+    decltype(&DecodeACVarBlock<ACType::k32, false, DynamicHybridUintConfig>);
+
+// Selects the DecodeACVarBlock for the entropy code of `decoder`, specialized
+// on its hybrid uint configuration when all of its contexts share the default
+// one, as is the case unless the encoder searched for better ones.
+template <ACType ac_type>
+DecodeACVarBlockFn SelectDecodeACVarBlock(const ANSSymbolReader& decoder) {
+  const bool uses_lz77 = decoder.UsesLZ77();
+  if (decoder.AllContextsUse<HybridUint420Config>()) {
+    return uses_lz77 ? DecodeACVarBlock<ac_type, true, HybridUint420Config>
+                     : DecodeACVarBlock<ac_type, false, HybridUint420Config>;
+  }
+  return uses_lz77 ? DecodeACVarBlock<ac_type, true, DynamicHybridUintConfig>
+                   : DecodeACVarBlock<ac_type, false, DynamicHybridUintConfig>;
+}
+
 // Structs used by DecodeGroupImpl to get a quantized block.
 // GetBlockFromBitstream uses ANS decoding (and thus keeps track of row
 // pointers in row_nzeros), GetBlockFromEncoder simply reads the coefficient
@@ -559,12 +675,9 @@ struct GetBlockFromBitstream : public GetBlock {
       }
 
       for (size_t pass = 0; JXL_UNLIKELY(pass < num_passes); pass++) {
-        auto decode_ac_varblock =
-            decoders[pass].UsesLZ77()
-                ? (ac_type == ACType::k16 ? DecodeACVarBlock<ACType::k16, 1>
-                                          : DecodeACVarBlock<ACType::k32, 1>)
-                : (ac_type == ACType::k16 ? DecodeACVarBlock<ACType::k16, 0>
-                                          : DecodeACVarBlock<ACType::k32, 0>);
+        const DecodeACVarBlockFn decode_ac_varblock =
+            ac_type == ACType::k16 ? decode_ac_varblock16[pass]
+                                   : decode_ac_varblock32[pass];
         JXL_RETURN_IF_ERROR(decode_ac_varblock(
             ctx_offset[pass], log2_covered_blocks, row_nzeros[pass][c],
             row_nzeros_top[pass][c], nzeros_stride, c, sbx, sby, bx, acs,
@@ -613,6 +726,10 @@ struct GetBlockFromBitstream : public GetBlock {
           decoders[pass],
           ANSSymbolReader::Create(&dec_state->code[pass + first_pass],
                                   readers[pass]));
+      decode_ac_varblock16[pass] =
+          SelectDecodeACVarBlock<ACType::k16>(decoders[pass]);
+      decode_ac_varblock32[pass] =
+          SelectDecodeACVarBlock<ACType::k32>(decoders[pass]);
     }
     nzeros_stride = group_dec_cache->num_nzeroes[0].PixelsPerRow();
     for (size_t i = 0; i < num_passes; i++) {
@@ -628,6 +745,8 @@ struct GetBlockFromBitstream : public GetBlock {
   size_t coeff_order_size;
   const std::vector<uint8_t>* JXL_RESTRICT context_map;
   ANSSymbolReader decoders[kMaxNumPasses];
+  DecodeACVarBlockFn decode_ac_varblock16[kMaxNumPasses];
+  DecodeACVarBlockFn decode_ac_varblock32[kMaxNumPasses];
   BitReader* JXL_RESTRICT* JXL_RESTRICT readers;
   size_t num_passes;
   size_t ctx_offset[kMaxNumPasses];
@@ -815,10 +934,8 @@ Status DecodeGroupForRoundtrip(const FrameHeader& frame_header,
   JXL_ASSIGN_OR_RETURN(
       GetBlockFromEncoder get_block,
       GetBlockFromEncoder::Create(ac, group_idx, frame_header.passes.shift));
-  JXL_RETURN_IF_ERROR(group_dec_cache->InitOnce(
-      memory_manager,
-      /*num_passes=*/0,
-      /*used_acs=*/(1u << AcStrategy::kNumValidStrategies) - 1));
+  JXL_RETURN_IF_ERROR(
+      group_dec_cache->InitOnce(memory_manager, /*num_passes=*/0));
 
   return HWY_DYNAMIC_DISPATCH(DecodeGroupImpl)(
       frame_header, &get_block, group_dec_cache, dec_state, thread, group_idx,
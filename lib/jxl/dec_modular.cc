@@ -35,6 +35,8 @@ namespace HWY_NAMESPACE {
 using hwy::HWY_NAMESPACE::Add;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
 
 void MultiplySum(const size_t xsize,
                  const pixel_type* const JXL_RESTRICT row_in,
@@ -80,6 +82,30 @@ void SingleFromSingle(const size_t xsize,
     Store(out, df, row_out + x);
   }
 }
+
+// Inverse YCoCg (RCT type 6) followed by SingleFromSingle for each channel.
+void RgbFromYCoCg(const size_t xsize,
+                  const pixel_type* const JXL_RESTRICT row_y,
+                  const pixel_type* const JXL_RESTRICT row_co,
+                  const pixel_type* const JXL_RESTRICT row_cg,
+                  const float factor, float* JXL_RESTRICT out_r,
+                  float* JXL_RESTRICT out_g, float* JXL_RESTRICT out_b) {
+  const HWY_FULL(float) df;
+  const Rebind<pixel_type, HWY_FULL(float)> di;  // assumes pixel_type <= float
+
+  const auto factor_v = Set(df, factor);
+  for (size_t x = 0; x < xsize; x += Lanes(di)) {
+    const auto co = Load(di, row_co + x);
+    const auto cg = Load(di, row_cg + x);
+    const auto tmp = Sub(Load(di, row_y + x), ShiftRight<1>(cg));
+    const auto g = Add(cg, tmp);
+    const auto b = Sub(tmp, ShiftRight<1>(co));
+    const auto r = Add(b, co);
+    Store(Mul(ConvertTo(df, r), factor_v), df, out_r + x);
+    Store(Mul(ConvertTo(df, g), factor_v), df, out_g + x);
+    Store(Mul(ConvertTo(df, b), factor_v), df, out_b + x);
+  }
+}
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -90,6 +116,7 @@ namespace jxl {
 HWY_EXPORT(MultiplySum);       // Local function
 HWY_EXPORT(RgbFromSingle);     // Local function
 HWY_EXPORT(SingleFromSingle);  // Local function
+HWY_EXPORT(RgbFromYCoCg);      // Local function
 
 // Slow conversion using double precision multiplication, only
 // needed when the bit depth is too high for single precision
@@ -178,6 +205,7 @@ std::string ModularStreamId::DebugString() const {
 
 Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
                                              const FrameHeader& frame_header,
+                                             jxl::ThreadPool* pool,
                                              bool allow_truncated_group) {
   JxlMemoryManager* memory_manager = this->memory_manager();
   bool decode_color = frame_header.encoding == FrameEncoding::kModular;
@@ -220,7 +248,13 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
   JXL_ASSIGN_OR_RETURN(
       Image gi,
       Image::Create(memory_manager, frame_dim.xsize, frame_dim.ysize,
-                    metadata.bit_depth.bits_per_sample, nb_chans + nb_extra));
+                    metadata.bit_depth.bits_per_sample, 0));
+  // Channels are only allocated once their final size is known, and those that
+  // are too large to be decoded here only if the full image is kept, see below.
+  for (size_t c = 0; c < nb_chans + nb_extra; c++) {
+    gi.channel.emplace_back(Channel::CreateUnallocated(
+        memory_manager, frame_dim.xsize, frame_dim.ysize));
+  }
 
   all_same_shift = true;
   if (frame_header.color_transform == ColorTransform::kYCbCr) {
@@ -231,7 +265,8 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
           DivCeil(frame_dim.xsize, 1 << gi.channel[c].hshift);
       size_t ysize_shifted =
           DivCeil(frame_dim.ysize, 1 << gi.channel[c].vshift);
-      JXL_RETURN_IF_ERROR(gi.channel[c].shrink(xsize_shifted, ysize_shifted));
+      gi.channel[c].w = xsize_shifted;
+      gi.channel[c].h = ysize_shifted;
       if (gi.channel[c].hshift != gi.channel[0].hshift ||
           gi.channel[c].vshift != gi.channel[0].vshift)
         all_same_shift = false;
@@ -240,9 +275,8 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
 
   for (size_t ec = 0, c = nb_chans; ec < nb_extra; ec++, c++) {
     size_t ecups = frame_header.extra_channel_upsampling[ec];
-    JXL_RETURN_IF_ERROR(
-        gi.channel[c].shrink(DivCeil(frame_dim.xsize_upsampled, ecups),
-                             DivCeil(frame_dim.ysize_upsampled, ecups)));
+    gi.channel[c].w = DivCeil(frame_dim.xsize_upsampled, ecups);
+    gi.channel[c].h = DivCeil(frame_dim.ysize_upsampled, ecups);
     gi.channel[c].hshift = gi.channel[c].vshift =
         CeilLog2Nonzero(ecups) - CeilLog2Nonzero(frame_header.upsampling);
     if (gi.channel[c].hshift != gi.channel[0].hshift ||
@@ -250,11 +284,18 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
       all_same_shift = false;
   }
 
+  for (Channel& ch : gi.channel) {
+    if (ch.w <= frame_dim.group_dim && ch.h <= frame_dim.group_dim) {
+      JXL_RETURN_IF_ERROR(ch.shrink());
+    }
+  }
+
   JXL_DEBUG_V(6, "DecodeGlobalInfo: full_image (w/o transforms) %s",
               gi.DebugString().c_str());
   ModularOptions options;
   options.max_chan_size = frame_dim.group_dim;
   options.group_dim = frame_dim.group_dim;
+  options.pool = pool;
   Status dec_status = ModularGenericDecompress(
       reader, gi, &global_header, ModularStreamId::Global().ID(frame_dim),
       &options,
@@ -284,11 +325,26 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
   full_image = std::move(gi);
   JXL_DEBUG_V(6, "DecodeGlobalInfo: full_image (with transforms) %s",
               full_image.DebugString().c_str());
+  // If the full image is going to be dropped, the groups are rendered directly
+  // and memory use does not grow with the frame area. Only the channels that
+  // the DC groups decode before that are needed then.
+  const bool drop_full_image = CanDropFullImage();
+  for (Channel& ch : full_image.channel) {
+    if (drop_full_image && std::min(ch.hshift, ch.vshift) < 3) continue;
+    if (ch.plane.xsize() == ch.w && ch.plane.ysize() == ch.h) continue;
+    JXL_RETURN_IF_ERROR(ch.shrink());
+    // Like the channels of a truncated global section, see ModularDecode.
+    if (!dec_status) ZeroFillImage(&ch.plane);
+  }
   return dec_status;
 }
 
+bool ModularFrameDecoder::CanDropFullImage() const {
+  return full_image.transform.empty() && !have_something && all_same_shift;
+}
+
 void ModularFrameDecoder::MaybeDropFullImage() {
-  if (full_image.transform.empty() && !have_something && all_same_shift) {
+  if (CanDropFullImage()) {
     use_full_image = false;
     JXL_DEBUG_V(6, "Dropping full image");
     for (auto& ch : full_image.channel) {
@@ -367,12 +423,21 @@ Status ModularFrameDecoder::DecodeGroup(
   // Undo global transforms that have been pushed to the group level
   if (!use_full_image) {
     JXL_ENSURE(render_pipeline_input);
-    for (const auto& t : global_transform) {
-      JXL_RETURN_IF_ERROR(t.Inverse(gi, global_header.wp_header));
+    // The inverse YCoCg of lossless images, as written by the fast lossless
+    // encoder, is done while converting the samples to float.
+    const bool fused_ycocg = global_transform.size() == 1 &&
+                             CanFuseInverseYCoCg(frame_header,
+                                                 global_transform[0]);
+    if (fused_ycocg) {
+      JXL_RETURN_IF_ERROR(CheckEqualChannels(gi, 0, 2));
+    } else {
+      for (const auto& t : global_transform) {
+        JXL_RETURN_IF_ERROR(t.Inverse(gi, global_header.wp_header));
+      }
     }
     JXL_RETURN_IF_ERROR(ModularImageToDecodedRect(
         frame_header, gi, dec_state, nullptr, *render_pipeline_input,
-        Rect(0, 0, gi.w, gi.h)));
+        Rect(0, 0, gi.w, gi.h), fused_ycocg));
     return true;
   }
   int gic = 0;
@@ -531,10 +596,21 @@ Status ModularFrameDecoder::DecodeAcMetadata(const FrameHeader& frame_header,
   return true;
 }
 
+bool ModularFrameDecoder::CanFuseInverseYCoCg(const FrameHeader& frame_header,
+                                              const Transform& t) const {
+  const auto* metadata = frame_header.nonserialized_metadata;
+  return t.id == TransformId::kRCT && t.begin_c == 0 && t.rct_type == 6 &&
+         do_color && full_image.nb_meta_channels == 0 &&
+         frame_header.color_transform == ColorTransform::kNone &&
+         !metadata->m.color_encoding.IsGray() &&
+         !metadata->m.bit_depth.floating_point_sample &&
+         full_image.bitdepth < 23;
+}
+
 Status ModularFrameDecoder::ModularImageToDecodedRect(
     const FrameHeader& frame_header, Image& gi, PassesDecoderState* dec_state,
     jxl::ThreadPool* pool, RenderPipelineInput& render_pipeline_input,
-    Rect modular_rect) const {
+    Rect modular_rect, bool inverse_ycocg) const {
   const auto* metadata = frame_header.nonserialized_metadata;
   JXL_ENSURE(gi.transform.empty());
 
@@ -544,7 +620,33 @@ Status ModularFrameDecoder::ModularImageToDecodedRect(
   };
 
   size_t c = 0;
-  if (do_color) {
+  if (inverse_ycocg) {
+    JXL_ENSURE(gi.channel.size() >= 3);
+    const Channel& ch_in = gi.channel[0];
+    JXL_ENSURE(ch_in.hshift == 0 && ch_in.vshift == 0);
+    Rect r = render_pipeline_input.GetBuffer(0).second;
+    Rect mr = modular_rect.Crop(ch_in.plane);
+    if (r.ysize() != mr.ysize() || r.xsize() != mr.xsize()) {
+      return JXL_FAILURE("Dimension mismatch: trying to fit a %" PRIuS
+                         "x%" PRIuS
+                         " modular channel into "
+                         "a %" PRIuS "x%" PRIuS " rect",
+                         mr.xsize(), mr.ysize(), r.xsize(), r.ysize());
+    }
+    const float factor = 1.0 / ((1u << full_image.bitdepth) - 1);
+    const auto process_row = [&](const uint32_t task,
+                                 size_t /* thread */) -> Status {
+      const size_t y = task;
+      HWY_DYNAMIC_DISPATCH(RgbFromYCoCg)
+      (r.xsize(), mr.Row(&gi.channel[0].plane, y),
+       mr.Row(&gi.channel[1].plane, y), mr.Row(&gi.channel[2].plane, y),
+       factor, get_row(0, y), get_row(1, y), get_row(2, y));
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, r.ysize(), ThreadPool::NoInit,
+                                  process_row, "ModularYCoCgToFloat"));
+    c = 3;
+  } else if (do_color) {
     const bool rgb_from_gray =
         metadata->m.color_encoding.IsGray() &&
         frame_header.color_transform == ColorTransform::kNone;
@@ -688,6 +790,9 @@ Status ModularFrameDecoder::ModularImageToDecodedRect(
                          "a %" PRIuS "x%" PRIuS " rect",
                          mr.xsize(), mr.ysize(), r.xsize(), r.ysize());
     }
+    // Nothing reads extra channels that are not requested by the output,
+    // blending, spot colors or referencing.
+    if (!render_pipeline_input.IsChannelUsed(3 + ec)) continue;
     for (size_t y = 0; y < r.ysize(); ++y) {
       float* const JXL_RESTRICT row_out = r.Row(buffer.first, y);
       const pixel_type* const JXL_RESTRICT row_in = mr.Row(&ch_in.plane, y);
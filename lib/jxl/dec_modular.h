@@ -97,7 +97,7 @@ class ModularFrameDecoder {
       : memory_manager_(memory_manager), full_image(memory_manager) {}
   void Init(const FrameDimensions& frame_dim) { this->frame_dim = frame_dim; }
   Status DecodeGlobalInfo(BitReader* reader, const FrameHeader& frame_header,
-                          bool allow_truncated_group);
+                          jxl::ThreadPool* pool, bool allow_truncated_group);
   Status DecodeGroup(const FrameHeader& frame_header, const Rect& rect,
                      BitReader* reader, int minShift, int maxShift,
                      const ModularStreamId& stream, bool zerofill,
@@ -130,11 +130,20 @@ class ModularFrameDecoder {
   JxlMemoryManager* memory_manager() const { return memory_manager_; }
 
  private:
+  // With `inverse_ycocg`, the first three channels of `gi` are in YCoCg and
+  // still need the inverse RCT, see CanFuseInverseYCoCg.
   Status ModularImageToDecodedRect(const FrameHeader& frame_header, Image& gi,
                                    PassesDecoderState* dec_state,
                                    jxl::ThreadPool* pool,
                                    RenderPipelineInput& render_pipeline_input,
-                                   Rect modular_rect) const;
+                                   Rect modular_rect,
+                                   bool inverse_ycocg = false) const;
+  // Whether the transform `t`, moved to the groups, can be undone by
+  // ModularImageToDecodedRect.
+  bool CanFuseInverseYCoCg(const FrameHeader& frame_header,
+                           const Transform& t) const;
+  // Whether the groups can be rendered without going through full_image.
+  bool CanDropFullImage() const;
   JxlMemoryManager* memory_manager_;
   Image full_image;
   std::vector<Transform> global_transform;
@@ -14,6 +14,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/blending.h"
@@ -195,6 +196,7 @@ void PatchDictionary::ComputePatchTree() {
   num_patches_.clear();
   sorted_patches_y0_.clear();
   sorted_patches_y1_.clear();
+  ComputePatchBins();
   if (positions_.empty()) {
     return;
   }
@@ -312,15 +314,107 @@ std::vector<size_t> PatchDictionary::GetPatchesForRow(size_t y) const {
   return result;
 }
 
+void PatchDictionary::ComputePatchBins() {
+  xsize_bins_ = ysize_bins_ = 0;
+  bin_start_.clear();
+  bin_patches_.clear();
+  if (positions_.empty()) return;
+  // Range of bins [bx0, bx1] x [by0, by1] covered by a patch.
+  const auto bin_range = [this](const PatchPosition& pos, size_t* bx0,
+                                size_t* bx1, size_t* by0, size_t* by1) {
+    const PatchReferencePosition& ref_pos = ref_positions_[pos.ref_pos_idx];
+    *bx0 = pos.x / kPatchBinXSize;
+    *bx1 = (pos.x + ref_pos.xsize - 1) / kPatchBinXSize;
+    *by0 = pos.y / kPatchBinYSize;
+    *by1 = (pos.y + ref_pos.ysize - 1) / kPatchBinYSize;
+  };
+  // Only use the grid if it does not take much more memory than the patches
+  // themselves, e.g. for the many small glyphs of a screenshot.
+  constexpr size_t kMaxBinsPerPatch = 4;
+  const size_t max_entries = kMaxBinsPerPatch * positions_.size();
+  size_t xsize_bins = 0;
+  size_t ysize_bins = 0;
+  size_t num_entries = 0;
+  for (const PatchPosition& pos : positions_) {
+    size_t bx0, bx1, by0, by1;
+    bin_range(pos, &bx0, &bx1, &by0, &by1);
+    xsize_bins = std::max(xsize_bins, bx1 + 1);
+    ysize_bins = std::max(ysize_bins, by1 + 1);
+    num_entries += (bx1 - bx0 + 1) * (by1 - by0 + 1);
+    if (num_entries > max_entries) return;
+  }
+  if (xsize_bins * ysize_bins > max_entries) return;
+  xsize_bins_ = xsize_bins;
+  ysize_bins_ = ysize_bins;
+  bin_start_.assign(xsize_bins_ * ysize_bins_ + 1, 0);
+  for (const PatchPosition& pos : positions_) {
+    size_t bx0, bx1, by0, by1;
+    bin_range(pos, &bx0, &bx1, &by0, &by1);
+    for (size_t by = by0; by <= by1; ++by) {
+      for (size_t bx = bx0; bx <= bx1; ++bx) {
+        bin_start_[by * xsize_bins_ + bx + 1]++;
+      }
+    }
+  }
+  for (size_t bin = 0; bin + 1 < bin_start_.size(); ++bin) {
+    bin_start_[bin + 1] += bin_start_[bin];
+  }
+  bin_patches_.resize(num_entries);
+  std::vector<size_t> next(bin_start_.begin(), bin_start_.end() - 1);
+  for (size_t i = 0; i < positions_.size(); ++i) {
+    size_t bx0, bx1, by0, by1;
+    bin_range(positions_[i], &bx0, &bx1, &by0, &by1);
+    for (size_t by = by0; by <= by1; ++by) {
+      for (size_t bx = bx0; bx <= bx1; ++bx) {
+        bin_patches_[next[by * xsize_bins_ + bx]++] = i;
+      }
+    }
+  }
+}
+
+void PatchDictionary::GetPatchesForSegment(size_t y, size_t x0, size_t xsize,
+                                           std::vector<size_t>* result) const {
+  if (bin_start_.empty()) {
+    *result = GetPatchesForRow(y);
+    return;
+  }
+  result->clear();
+  const size_t by = y / kPatchBinYSize;
+  if (xsize == 0 || by >= ysize_bins_) return;
+  const size_t bx0 = x0 / kPatchBinXSize;
+  const size_t bx1 =
+      std::min((x0 + xsize - 1) / kPatchBinXSize, xsize_bins_ - 1);
+  for (size_t bx = bx0; bx <= bx1; ++bx) {
+    const size_t bin = by * xsize_bins_ + bx;
+    for (size_t i = bin_start_[bin]; i < bin_start_[bin + 1]; ++i) {
+      const size_t pos_idx = bin_patches_[i];
+      const PatchPosition& pos = positions_[pos_idx];
+      if (y < pos.y || y >= pos.y + ref_positions_[pos.ref_pos_idx].ysize) {
+        continue;
+      }
+      // Patches that span several bins of the segment are listed once, for
+      // the first of them.
+      if (bx != std::max(pos.x / kPatchBinXSize, bx0)) continue;
+      result->push_back(pos_idx);
+    }
+  }
+  // As in GetPatchesForRow, keep the order of the patches, which matters for
+  // overlapping patches with blend modes other than kAdd.
+  if (bx1 > bx0) std::sort(result->begin(), result->end());
+}
+
 // Adds patches to a segment of `xsize` pixels, starting at `inout`, assumed
 // to be located at position (x0, y) in the frame.
 Status PatchDictionary::AddOneRow(
     float* const* inout, size_t y, size_t x0, size_t xsize,
-    const std::vector<ExtraChannelInfo>& extra_channel_info) const {
+    const std::vector<ExtraChannelInfo>& extra_channel_info,
+    float* JXL_RESTRICT scratch) const {
   size_t num_ec = extra_channel_info.size();
   JXL_ENSURE(num_ec + 1 <= blendings_stride_);
   std::vector<const float*> fg_ptrs(3 + num_ec);
-  for (size_t pos_idx : GetPatchesForRow(y)) {
+  std::vector<size_t> patches;
+  GetPatchesForSegment(y, x0, xsize, &patches);
+  for (size_t pos_idx : patches) {
     const size_t blending_idx = pos_idx * blendings_stride_;
     const PatchPosition& pos = positions_[pos_idx];
     const PatchReferencePosition& ref_pos = ref_positions_[pos.ref_pos_idx];
@@ -347,9 +441,9 @@ Status PatchDictionary::AddOneRow(
           ref_pos.x0 + x0 - bx;
     }
     JXL_RETURN_IF_ERROR(PerformBlending(
-        memory_manager_, inout, fg_ptrs.data(), inout, patch_x0 - x0,
-        patch_x1 - patch_x0, blendings_[blending_idx],
-        blendings_.data() + blending_idx + 1, extra_channel_info));
+        inout, fg_ptrs.data(), inout, patch_x0 - x0, patch_x1 - patch_x0,
+        blendings_[blending_idx], blendings_.data() + blending_idx + 1,
+        extra_channel_info, scratch));
   }
   return true;
 }
@@ -19,6 +19,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/image_bundle.h"
@@ -113,6 +114,8 @@ class PatchDictionary {
 
   bool HasAny() const { return !positions_.empty(); }
 
+  JxlMemoryManager* memory_manager() const { return memory_manager_; }
+
   Status Decode(JxlMemoryManager* memory_manager, BitReader* br, size_t xsize,
                 size_t ysize, size_t num_extra_channels,
                 bool* uses_extra_channels);
@@ -123,10 +126,11 @@ class PatchDictionary {
   }
 
   // Adds patches to a segment of `xsize` pixels, starting at `inout`, assumed
-  // to be located at position (x0, y) in the frame.
-  Status AddOneRow(
-      float* const* inout, size_t y, size_t x0, size_t xsize,
-      const std::vector<ExtraChannelInfo>& extra_channel_info) const;
+  // to be located at position (x0, y) in the frame. `scratch` is the blending
+  // scratch buffer of the calling thread, see PerformBlending().
+  Status AddOneRow(float* const* inout, size_t y, size_t x0, size_t xsize,
+                   const std::vector<ExtraChannelInfo>& extra_channel_info,
+                   float* JXL_RESTRICT scratch) const;
 
   // Returns dependencies of this patch dictionary on reference frame ids as a
   // bit mask: bits 0-3 indicate reference frame 0-3.
@@ -160,7 +164,23 @@ class PatchDictionary {
   std::vector<std::pair<size_t, size_t>> sorted_patches_y0_;
   std::vector<std::pair<size_t, size_t>> sorted_patches_y1_;
 
+  // Grid of kPatchBinXSize x kPatchBinYSize bins, used to find the patches
+  // of a row segment when there are many small patches. The patches that
+  // overlap bin b are bin_patches_[bin_start_[b], bin_start_[b + 1]), in
+  // increasing order. Empty if the interval tree is used instead.
+  static constexpr size_t kPatchBinXSize = 128;
+  static constexpr size_t kPatchBinYSize = 16;
+  size_t xsize_bins_ = 0;
+  size_t ysize_bins_ = 0;
+  std::vector<size_t> bin_start_;
+  std::vector<size_t> bin_patches_;
+
   void ComputePatchTree();
+  void ComputePatchBins();
+  // Patches that may overlap the `xsize` pixels starting at (x0, y), in
+  // increasing order.
+  void GetPatchesForSegment(size_t y, size_t x0, size_t xsize,
+                            std::vector<size_t>* result) const;
 };
 
 }  // namespace jxl
@@ -0,0 +1,103 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_DEC_STATS_H_
+#define LIB_JXL_DEC_STATS_H_
+
+// Opt-in profiling of the decoder, see JxlDecoderCollectStats.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+
+namespace jxl {
+
+// Time spent and bytes touched by the parts of the decoder, accumulated over
+// all the frames decoded while the statistics are collected. There is one
+// entry per decoding step (e.g. "DecodeACGroup") and per render pipeline stage,
+// named after the stage. The time of a step includes that of the entries run
+// from it, e.g. the stages that render a group once it is decoded.
+class DecoderStats {
+ public:
+  struct Entry {
+    explicit Entry(std::string name) : name(std::move(name)) {}
+
+    // May be called concurrently from multiple threads.
+    void Add(uint64_t ns, uint64_t num_bytes) {
+      nanoseconds.fetch_add(ns, std::memory_order_relaxed);
+      bytes.fetch_add(num_bytes, std::memory_order_relaxed);
+      calls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const std::string name;
+    std::atomic<uint64_t> nanoseconds{0};
+    // Compressed bytes read for decoding steps, estimated bytes of pixel data
+    // read and written for render pipeline stages.
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> calls{0};
+  };
+
+  // Returns the entry called `name`, adding it if needed. Entries are only
+  // added while setting up a frame, so this must not be called concurrently
+  // with itself or with the accessors below.
+  Entry* Get(const char* name) {
+    for (Entry& entry : entries_) {
+      if (entry.name == name) return &entry;
+    }
+    entries_.emplace_back(name);
+    return &entries_.back();
+  }
+
+  // Adds the counters of `other` to the entries with the same name.
+  void Merge(const DecoderStats& other) {
+    for (const Entry& entry : other.entries_) {
+      Entry* merged = Get(entry.name.c_str());
+      merged->nanoseconds += entry.nanoseconds.load();
+      merged->bytes += entry.bytes.load();
+      merged->calls += entry.calls.load();
+    }
+  }
+
+  size_t size() const { return entries_.size(); }
+  const Entry& operator[](size_t i) const { return entries_[i]; }
+
+ private:
+  // A deque, so that pointers to the entries stay valid when adding more.
+  std::deque<Entry> entries_;
+};
+
+// Adds the time between its construction and its destruction to `entry`,
+// unless it is null.
+class ScopedStatsTimer {
+ public:
+  explicit ScopedStatsTimer(DecoderStats::Entry* entry, uint64_t bytes = 0)
+      : entry_(entry), bytes_(bytes) {
+    if (entry_) start_ = Clock::now();
+  }
+  ~ScopedStatsTimer() {
+    if (!entry_) return;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start_);
+    entry_->Add(elapsed.count(), bytes_);
+  }
+
+  ScopedStatsTimer(const ScopedStatsTimer&) = delete;
+  ScopedStatsTimer& operator=(const ScopedStatsTimer&) = delete;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  DecoderStats::Entry* entry_;
+  uint64_t bytes_;
+  Clock::time_point start_;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_DEC_STATS_H_
@@ -0,0 +1,82 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/ac_strategy.h"
+#include "lib/jxl/frame_dimensions.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/dec_transforms_gbench.cc"
+#include <hwy/aligned_allocator.h>
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/dec_transforms-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+namespace {
+
+// Inverse transform of one varblock of the type given by the benchmark
+// argument, as done by DecGroupImpl() after dequantization.
+HWY_NOINLINE void BM_TransformToPixels(benchmark::State& state) {
+  const AcStrategyType type = static_cast<AcStrategyType>(state.range());
+  const AcStrategy acs = AcStrategy::FromRawStrategy(type);
+  const size_t xsize = acs.covered_blocks_x() * kBlockDim;
+  const size_t ysize = acs.covered_blocks_y() * kBlockDim;
+  const size_t area = xsize * ysize;
+  auto input = hwy::AllocateAligned<float>(area);
+  auto coefficients = hwy::AllocateAligned<float>(area);
+  auto pixels = hwy::AllocateAligned<float>(area);
+  auto scratch_space = hwy::AllocateAligned<float>(4 * area);
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < area; ++i) {
+    seed = seed * 1103515245 + 12345;
+    input[i] = static_cast<float>(seed >> 16) / 65536.0f - 0.5f;
+  }
+  for (auto _ : state) {
+    // The transform overwrites its input.
+    memcpy(coefficients.get(), input.get(), area * sizeof(float));
+    TransformToPixels(type, coefficients.get(), pixels.get(), xsize,
+                      scratch_space.get());
+    benchmark::DoNotOptimize(pixels[0]);
+  }
+  /* pixels per second */
+  state.SetItemsProcessed(area * state.iterations());
+}
+
+}  // namespace
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+namespace {
+
+HWY_EXPORT(BM_TransformToPixels);
+
+void BM_TransformToPixels(benchmark::State& state) {
+  HWY_DYNAMIC_DISPATCH(BM_TransformToPixels)(state);
+}
+
+BENCHMARK(BM_TransformToPixels)
+    ->ArgName("type")
+    ->Arg(static_cast<int64_t>(AcStrategyType::DCT))
+    ->Arg(static_cast<int64_t>(AcStrategyType::DCT8X16))
+    ->Arg(static_cast<int64_t>(AcStrategyType::DCT16X16))
+    ->Arg(static_cast<int64_t>(AcStrategyType::DCT16X32))
+    ->Arg(static_cast<int64_t>(AcStrategyType::DCT32X32))
+    ->Arg(static_cast<int64_t>(AcStrategyType::DCT64X64));
+
+}  // namespace
+}  // namespace jxl
+#endif
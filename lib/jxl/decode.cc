@@ -9,7 +9,10 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <limits>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -17,8 +20,10 @@
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/cms/opsin_params.h"
 #include "lib/jxl/padded_bytes.h"
 
 // JPEGXL_ENABLE_BOXES, JPEGXL_ENABLE_TRANSCODE_JPEG
@@ -28,6 +33,7 @@
 #include "lib/jxl/box_content_decoder.h"
 #endif
 #include "lib/jxl/dec_frame.h"
+#include "lib/jxl/dec_stats.h"
 #if JPEGXL_ENABLE_TRANSCODE_JPEG
 #include "lib/jxl/decode_to_jpeg.h"
 #endif
@@ -200,6 +206,7 @@ enum class BoxStage : uint32_t {
   kCodestream,  // Handling codestream box contents, or non-container stream
   kPartialCodestream,  // Handling the extra header of partial codestream box
   kJpegRecon,          // Handling jpeg reconstruction box
+  kFrameIndex,         // Handling frame index box
 };
 
 enum class JpegReconStage : uint32_t {
@@ -340,14 +347,90 @@ typedef struct JxlDecoderFrameIndexBoxStruct {
     e.Fi = Fi;
     entries.push_back(e);
   }
+
+  // Index of the last indexed frame at or before `frame`, counted as in
+  // JxlDecoderSkipFrames, or 0 if there is no index.
+  size_t LastKeyframe(size_t frame) const {
+    size_t keyframe = 0;
+    size_t index = 0;
+    for (const JxlDecoderFrameIndexBoxEntry& e : entries) {
+      if (index > frame) break;
+      keyframe = index;
+      index += e.Fi;
+    }
+    return keyframe;
+  }
 } JxlDecoderFrameIndexBox;
 
+namespace {
+
+// Larger frame index boxes are skipped rather than kept in memory to be
+// parsed.
+constexpr size_t kMaxFrameIndexBoxSize = 1 << 22;
+
+bool ReadFrameIndexVarInt(const std::vector<uint8_t>& in, size_t* pos,
+                          uint64_t* value) {
+  *value = 0;
+  for (size_t shift = 0; shift < 63; shift += 7) {
+    if (*pos >= in.size()) return false;
+    const uint8_t byte = in[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 127) << shift;
+    if (!(byte & 128)) return true;
+  }
+  return false;
+}
+
+// Parses the contents of a jxli box, as written by the encoder.
+bool ParseFrameIndexBox(const std::vector<uint8_t>& in,
+                        JxlDecoderFrameIndexBox* index) {
+  *index = JxlDecoderFrameIndexBox();
+  size_t pos = 0;
+  uint64_t num_frames;
+  if (!ReadFrameIndexVarInt(in, &pos, &num_frames)) return false;
+  if (in.size() < pos + 8) return false;
+  index->TNUM = LoadBE32(in.data() + pos);
+  index->TDEN = LoadBE32(in.data() + pos + 4);
+  pos += 8;
+  // Each entry takes at least 3 bytes.
+  if (num_frames > (in.size() - pos) / 3) return false;
+  for (uint64_t i = 0; i < num_frames; ++i) {
+    uint64_t OFFi;
+    uint64_t Ti;
+    uint64_t Fi;
+    if (!ReadFrameIndexVarInt(in, &pos, &OFFi) ||
+        !ReadFrameIndexVarInt(in, &pos, &Ti) ||
+        !ReadFrameIndexVarInt(in, &pos, &Fi)) {
+      return false;
+    }
+    constexpr uint64_t kMaxValue = std::numeric_limits<uint32_t>::max();
+    if (Ti > kMaxValue || Fi > kMaxValue) return false;
+    index->AddFrame(OFFi, Ti, Fi);
+  }
+  return true;
+}
+
+}  // namespace
+
 }  // namespace jxl
 
+struct JxlDecoderStatsStruct {
+  jxl::DecoderStats stats;
+};
+
 // NOLINTNEXTLINE(clang-analyzer-optin.performance.Padding)
 struct JxlDecoderStruct {
   JxlDecoderStruct() = default;
 
+  // Set by JxlDecoderSetHugePageThreshold, JxlDecoderSetMemoryLimit and
+  // JxlDecoderSetMemoryArena, each wrapping the memory_manager in use at that
+  // time. Declared first so that they outlive all the allocations made from
+  // them, and the arena last since the others may be its backing memory
+  // manager.
+  std::unique_ptr<jxl::HugePageAdvisor> huge_pages;
+  std::unique_ptr<jxl::MemoryTracker> memory_tracker;
+  std::unique_ptr<jxl::MemoryArena> arena;
+  // As passed to JxlDecoderCreate.
+  JxlMemoryManager user_memory_manager;
   JxlMemoryManager memory_manager;
   std::unique_ptr<jxl::ThreadPool> thread_pool;
 
@@ -367,7 +450,10 @@ struct JxlDecoderStruct {
   bool got_all_headers;     // Codestream metadata headers.
   bool post_headers;        // Already decoding pixels.
   std::unique_ptr<jxl::ICCReader> icc_reader;
+  // Frames listed in the jxli box, if one was seen. Kept by JxlDecoderRewind.
   jxl::JxlDecoderFrameIndexBox frame_index_box;
+  // Contents of the jxli box seen so far, while it is being read.
+  std::vector<uint8_t> frame_index_bytes;
   // This means either we actually got the preview image, or determined we
   // cannot get it or there is none.
   bool got_preview_image;
@@ -409,9 +495,20 @@ struct JxlDecoderStruct {
   // Settings
   bool keep_orientation;
   bool unpremul_alpha;
+  bool premul_alpha;
   bool render_spotcolors;
   bool coalescing;
   float desired_intensity_target;
+  // Region of interest set with JxlDecoderSetCropRegion, crop_xsize == 0 if
+  // the full image is wanted.
+  uint32_t crop_x0;
+  uint32_t crop_y0;
+  uint32_t crop_xsize;
+  uint32_t crop_ysize;
+  // Set with JxlDecoderSetDownsampling, 1 for full resolution.
+  uint32_t output_downsampling;
+  // Set with JxlDecoderCollectStats, null if no statistics are collected.
+  JxlDecoderStats* stats;
 
   // Bitfield, for which informative events (JXL_DEC_BASIC_INFO, etc...) the
   // decoder returns a status. By default, do not return for any of the events,
@@ -448,6 +545,8 @@ struct JxlDecoderStruct {
   SimpleImageOutCallback simple_image_out_callback;
 
   size_t image_out_size;
+  // Set with JxlDecoderSetImageOutPlanarBuffers, empty for interleaved output.
+  std::vector<jxl::ImageOutputPlane> image_out_planes;
 
   JxlPixelFormat image_out_format;
   JxlBitDepth image_out_bit_depth;
@@ -464,6 +563,10 @@ struct JxlDecoderStruct {
 
   std::unique_ptr<jxl::PassesDecoderState> passes_state;
   std::unique_ptr<jxl::FrameDecoder> frame_dec;
+  // State of the previous image, kept by JxlDecoderRewind and
+  // JxlDecoderResetKeepAllocations so that its buffers can be reused.
+  std::unique_ptr<jxl::PassesDecoderState> spare_passes_state;
+  std::unique_ptr<jxl::FrameDecoder> spare_frame_dec;
   size_t next_section;
   std::vector<char> section_processed;
 
@@ -482,6 +585,9 @@ struct JxlDecoderStruct {
   bool is_last_total;
   // How many frames to skip.
   size_t skip_frames;
+  // Indexed frame that the frame being skipped to is decoded from: none of the
+  // frames before it need to be decoded. 0 if there is none.
+  size_t skip_to_keyframe;
   // Skipping the current frame. May be false if skip_frames was just set to
   // a positive value while already processing a current frame, then
   // skipping_frame will be enabled only for the next frame.
@@ -721,14 +827,19 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->image_out_destroy_callback = nullptr;
   dec->image_out_init_opaque = nullptr;
   dec->image_out_size = 0;
+  dec->image_out_planes.clear();
   dec->image_out_bit_depth.type = JXL_BIT_DEPTH_FROM_PIXEL_FORMAT;
   dec->extra_channel_output.clear();
   dec->next_in = nullptr;
   dec->avail_in = 0;
   dec->input_closed = false;
 
-  dec->passes_state.reset();
-  dec->frame_dec.reset();
+  if (dec->passes_state) {
+    dec->spare_passes_state = std::move(dec->passes_state);
+  }
+  if (dec->frame_dec) {
+    dec->spare_frame_dec = std::move(dec->frame_dec);
+  }
   dec->next_section = 0;
   dec->section_processed.clear();
 
@@ -747,28 +858,57 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->is_last_of_still = false;
   dec->is_last_total = false;
   dec->skip_frames = 0;
+  dec->skip_to_keyframe = 0;
   dec->skipping_frame = false;
+  dec->frame_index_bytes.clear();
   dec->internal_frames = 0;
   dec->external_frames = 0;
 }
 
 void JxlDecoderReset(JxlDecoder* dec) {
+  JxlDecoderResetKeepAllocations(dec);
+  dec->spare_passes_state.reset();
+  dec->spare_frame_dec.reset();
+}
+
+void JxlDecoderResetKeepAllocations(JxlDecoder* dec) {
   JxlDecoderRewindDecodingState(dec);
 
   dec->thread_pool.reset();
   dec->keep_orientation = false;
   dec->unpremul_alpha = false;
+  dec->premul_alpha = false;
   dec->render_spotcolors = true;
   dec->coalescing = true;
   dec->desired_intensity_target = 0;
+  dec->crop_x0 = 0;
+  dec->crop_y0 = 0;
+  dec->crop_xsize = 0;
+  dec->crop_ysize = 0;
+  dec->output_downsampling = 1;
+  dec->stats = nullptr;
   dec->orig_events_wanted = 0;
   dec->events_wanted = 0;
   dec->frame_refs.clear();
   dec->frame_external_to_internal.clear();
   dec->frame_required.clear();
+  dec->frame_index_box = jxl::JxlDecoderFrameIndexBox();
   dec->decompress_boxes = false;
 }
 
+namespace {
+// Creates the decoder state for a new image, reusing the buffers of the
+// previous one if there is one.
+void CreatePassesState(JxlDecoder* dec) {
+  dec->passes_state =
+      jxl::make_unique<jxl::PassesDecoderState>(&dec->memory_manager);
+  if (dec->spare_passes_state) {
+    dec->passes_state->ReuseStorage(dec->spare_passes_state.get());
+    dec->spare_passes_state.reset();
+  }
+}
+}  // namespace
+
 JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
   JxlMemoryManager local_memory_manager;
   if (!jxl::MemoryManagerInit(&local_memory_manager, memory_manager))
@@ -780,6 +920,7 @@ JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
   // Placement new constructor on allocated memory
   JxlDecoder* dec = new (alloc) JxlDecoder();
   dec->memory_manager = local_memory_manager;
+  dec->user_memory_manager = local_memory_manager;
 
   JxlDecoderReset(dec);
 
@@ -788,7 +929,8 @@ JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
 
 void JxlDecoderDestroy(JxlDecoder* dec) {
   if (dec) {
-    JxlMemoryManager local_memory_manager = dec->memory_manager;
+    // The decoder itself was allocated before any arena or tracker.
+    JxlMemoryManager local_memory_manager = dec->user_memory_manager;
     // Call destructor directly since custom free function is used.
     dec->~JxlDecoder();
     jxl::MemoryManagerFree(&local_memory_manager, dec);
@@ -808,6 +950,7 @@ void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount) {
   dec->skip_frames += amount;
 
   dec->frame_required.clear();
+  dec->skip_to_keyframe = 0;
   size_t next_frame = dec->external_frames + dec->skip_frames;
 
   // A frame that has been seen before a rewind
@@ -825,8 +968,16 @@ void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount) {
           JXL_DEBUG_ABORT("Unreachable");
         }
       }
+      return;
     }
   }
+
+  // Otherwise, decoding can still start from the last indexed frame before
+  // it, since the frame index only lists keyframes. The index counts the
+  // frames shown with coalescing.
+  if (dec->coalescing) {
+    dec->skip_to_keyframe = dec->frame_index_box.LastKeyframe(next_frame);
+  }
 }
 
 JxlDecoderStatus JxlDecoderSkipCurrentFrame(JxlDecoder* dec) {
@@ -838,6 +989,7 @@ JxlDecoderStatus JxlDecoderSkipCurrentFrame(JxlDecoder* dec) {
   dec->AdvanceCodestream(dec->remaining_frame_size);
   if (dec->is_last_of_still) {
     dec->image_out_buffer_set = false;
+    dec->image_out_planes.clear();
   }
   return JXL_DEC_SUCCESS;
 }
@@ -871,6 +1023,60 @@ JxlDecoderStatus JxlDecoderSubscribeEvents(JxlDecoder* dec, int events_wanted) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetMemoryArena(JxlDecoder* dec,
+                                          size_t block_size) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set the memory arena before starting");
+  }
+  if (dec->arena) return JXL_API_ERROR("Memory arena already set");
+  if (block_size == 0) return JXL_API_ERROR("Invalid arena block size");
+  dec->arena = jxl::make_unique<jxl::MemoryArena>(dec->memory_manager,
+                                                  block_size);
+  // Buffers allocated before remain valid: freeing them through the arena
+  // forwards them to the original memory manager.
+  dec->memory_manager = dec->arena->memory_manager();
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetHugePageThreshold(JxlDecoder* dec,
+                                                size_t threshold) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set the huge page threshold before starting");
+  }
+  if (dec->huge_pages) {
+    dec->huge_pages->set_threshold(threshold);
+    return JXL_DEC_SUCCESS;
+  }
+  dec->huge_pages =
+      jxl::make_unique<jxl::HugePageAdvisor>(dec->memory_manager, threshold);
+  dec->memory_manager = dec->huge_pages->memory_manager();
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec,
+                                          uint64_t limit_bytes) {
+  if (dec->memory_tracker) {
+    dec->memory_tracker->set_limit(limit_bytes);
+    return JXL_DEC_SUCCESS;
+  }
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set the memory limit before starting");
+  }
+  dec->memory_tracker =
+      jxl::make_unique<jxl::MemoryTracker>(dec->memory_manager, limit_bytes);
+  dec->memory_manager = dec->memory_tracker->memory_manager();
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetPeakMemoryUsage(const JxlDecoder* dec,
+                                              uint64_t* peak_bytes) {
+  if (!dec->memory_tracker) {
+    return JXL_API_ERROR("JxlDecoderSetMemoryLimit was not called");
+  }
+  *peak_bytes = dec->memory_tracker->peak_bytes();
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderSetKeepOrientation(JxlDecoder* dec,
                                               JXL_BOOL skip_reorientation) {
   if (dec->stage != DecoderStage::kInited) {
@@ -889,6 +1095,15 @@ JxlDecoderStatus JxlDecoderSetUnpremultiplyAlpha(JxlDecoder* dec,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetPremultiplyAlpha(JxlDecoder* dec,
+                                               JXL_BOOL premul_alpha) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set premul_alpha option before starting");
+  }
+  dec->premul_alpha = FROM_JXL_BOOL(premul_alpha);
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderSetRenderSpotcolors(JxlDecoder* dec,
                                                JXL_BOOL render_spotcolors) {
   if (dec->stage != DecoderStage::kInited) {
@@ -906,7 +1121,140 @@ JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec, JXL_BOOL coalescing) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec, uint32_t x0,
+                                         uint32_t y0, uint32_t xsize,
+                                         uint32_t ysize) {
+  if (dec->image_out_buffer_set) {
+    return JXL_API_ERROR(
+        "Must set crop region before setting the image out buffer");
+  }
+  if (xsize == 0 || ysize == 0) {
+    xsize = ysize = x0 = y0 = 0;
+  } else if (dec->output_downsampling != 1) {
+    return JXL_API_ERROR("Crop region cannot be combined with downsampling");
+  } else if (dec->got_basic_info &&
+             (OutOfBounds(x0, xsize, dec->metadata.size.xsize()) ||
+              OutOfBounds(y0, ysize, dec->metadata.size.ysize()))) {
+    return JXL_API_ERROR("Crop region is outside of the image");
+  }
+  dec->crop_x0 = x0;
+  dec->crop_y0 = y0;
+  dec->crop_xsize = xsize;
+  dec->crop_ysize = ysize;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetDownsampling(JxlDecoder* dec, uint32_t factor) {
+  if (dec->image_out_buffer_set) {
+    return JXL_API_ERROR(
+        "Must set downsampling before setting the image out buffer");
+  }
+  if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+    return JXL_API_ERROR("Invalid downsampling factor");
+  }
+  if (factor != 1 && dec->crop_xsize != 0) {
+    return JXL_API_ERROR("Downsampling cannot be combined with a crop region");
+  }
+  dec->output_downsampling = factor;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderGetNeededInputRanges(const JxlDecoder* dec,
+                                                JxlInputRange* ranges,
+                                                size_t max_ranges,
+                                                size_t* num_ranges) {
+  if (dec->frame_stage != FrameStage::kFull || !dec->frame_dec) {
+    return JXL_API_ERROR("No frame pixels are being decoded");
+  }
+  if (max_ranges > 0 && ranges == nullptr) {
+    return JXL_API_ERROR("No ranges array given");
+  }
+  // File position of the codestream data that starts at codestream_pos, which
+  // is that of the next section not yet processed.
+  uint64_t copy_end = dec->file_pos + dec->codestream_unconsumed;
+  if (copy_end < dec->box_contents_begin + dec->codestream_copy.size()) {
+    return JXL_API_ERROR("The frame spans several codestream boxes");
+  }
+  uint64_t pos = copy_end - dec->codestream_copy.size() + dec->codestream_pos;
+  if (!dec->box_contents_unbounded &&
+      pos + dec->remaining_frame_size > dec->box_contents_end) {
+    return JXL_API_ERROR("The frame spans several codestream boxes");
+  }
+  // Passes needed for the next progression event.
+  size_t num_passes = dec->frame_dec->NextNumPassesToPause();
+  if (dec->frame_prog_detail >= JxlProgressiveDetail::kDC &&
+      !dec->dc_frame_progression_done) {
+    num_passes = 0;
+  }
+  const auto& toc = dec->frame_dec->Toc();
+  *num_ranges = 0;
+  uint64_t range_end = 0;
+  for (size_t i = dec->next_section; i < toc.size(); ++i) {
+    const uint64_t begin = pos;
+    pos += toc[i].size;
+    if (dec->section_processed[i] || toc[i].size == 0 ||
+        !dec->frame_dec->IsSectionInPasses(toc[i].id, num_passes)) {
+      continue;
+    }
+    if (*num_ranges > 0 && begin == range_end) {
+      if (*num_ranges <= max_ranges) ranges[*num_ranges - 1].size += toc[i].size;
+    } else {
+      if (*num_ranges < max_ranges) ranges[*num_ranges] = {begin, toc[i].size};
+      ++*num_ranges;
+    }
+    range_end = pos;
+  }
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStats* JxlDecoderStatsCreate() { return new JxlDecoderStats(); }
+
+void JxlDecoderStatsDestroy(JxlDecoderStats* stats) { delete stats; }
+
+JxlDecoderStatus JxlDecoderCollectStats(JxlDecoder* dec,
+                                        JxlDecoderStats* stats) {
+  dec->stats = stats;
+  return JXL_DEC_SUCCESS;
+}
+
+size_t JxlDecoderStatsNumEntries(const JxlDecoderStats* stats) {
+  if (!stats) return 0;
+  return stats->stats.size();
+}
+
+JxlDecoderStatus JxlDecoderStatsGetEntry(const JxlDecoderStats* stats,
+                                         size_t index,
+                                         JxlDecoderStatsEntry* entry) {
+  if (!stats || index >= stats->stats.size()) {
+    return JXL_API_ERROR("Invalid statistics entry index");
+  }
+  const jxl::DecoderStats::Entry& e = stats->stats[index];
+  entry->name = e.name.c_str();
+  entry->nanoseconds = e.nanoseconds.load(std::memory_order_relaxed);
+  entry->bytes = e.bytes.load(std::memory_order_relaxed);
+  entry->calls = e.calls.load(std::memory_order_relaxed);
+  return JXL_DEC_SUCCESS;
+}
+
+void JxlDecoderStatsMerge(JxlDecoderStats* stats,
+                          const JxlDecoderStats* other) {
+  if (!stats || !other) return;
+  stats->stats.Merge(other->stats);
+}
+
 namespace {
+// Whether the crop region applies to the current frame.
+bool UseCropRegion(const JxlDecoder* dec) {
+  return dec->crop_xsize != 0 && dec->coalescing &&
+         !dec->frame_header->nonserialized_is_preview;
+}
+
+// Whether the downsampling factor applies to the current frame.
+bool UseDownsampling(const JxlDecoder* dec) {
+  return dec->output_downsampling != 1 && dec->coalescing &&
+         !dec->frame_header->nonserialized_is_preview;
+}
+
 // helper function to get the dimensions of the current image buffer
 void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
   if (dec->frame_header->nonserialized_is_preview) {
@@ -914,8 +1262,22 @@ void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
     ysize = dec->metadata.oriented_preview_ysize(dec->keep_orientation);
     return;
   }
+  if (UseCropRegion(dec)) {
+    xsize = dec->crop_xsize;
+    ysize = dec->crop_ysize;
+    if (!dec->keep_orientation &&
+        static_cast<int>(dec->metadata.m.GetOrientation()) > 4) {
+      std::swap(xsize, ysize);
+    }
+    return;
+  }
   xsize = dec->metadata.oriented_xsize(dec->keep_orientation);
   ysize = dec->metadata.oriented_ysize(dec->keep_orientation);
+  if (UseDownsampling(dec)) {
+    xsize = jxl::DivCeil(xsize, dec->output_downsampling);
+    ysize = jxl::DivCeil(ysize, dec->output_downsampling);
+    return;
+  }
   if (!dec->coalescing) {
     const auto frame_dim = dec->frame_header->ToFrameDimensions();
     xsize = frame_dim.xsize_upsampled;
@@ -936,18 +1298,23 @@ namespace {
 template <class T>
 JxlDecoderStatus ReadBundle(JxlDecoder* dec, Span<const uint8_t> data,
                             BitReader* reader, T* JXL_RESTRICT t) {
-  // Use a copy of the bit reader because CanRead advances bits.
+  // Read with a copy of the bit reader, so that `reader` is only advanced if
+  // the whole bundle is available. The bundle is visited only once: the read
+  // reports separately whether it ran out of bytes.
   BitReader reader2(data);
-  reader2.SkipBits(reader->TotalBitsConsumed());
-  bool can_read = Bundle::CanRead(&reader2, t);
+  const size_t start_bits = reader->TotalBitsConsumed();
+  reader2.SkipBits(start_bits);
+  Status status = Bundle::Read(&reader2, t);
+  const size_t end_bits = reader2.TotalBitsConsumed();
   JXL_API_RETURN_IF_ERROR(reader2.Close());
 
-  if (!can_read) {
+  if (status.code() == StatusCode::kNotEnoughBytes) {
     return dec->RequestMoreInput();
   }
-  if (!Bundle::Read(reader, t)) {
+  if (!status) {
     return JXL_DEC_ERROR;
   }
+  reader->SkipBits(end_bits - start_bits);
   return JXL_DEC_SUCCESS;
 }
 
@@ -1064,8 +1431,7 @@ JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec) {
   dec->codestream_bits_ahead = 0;
 
   if (!dec->passes_state) {
-    dec->passes_state =
-        jxl::make_unique<jxl::PassesDecoderState>(&dec->memory_manager);
+    CreatePassesState(dec);
   }
 
   JXL_API_RETURN_IF_ERROR(
@@ -1096,7 +1462,8 @@ JxlDecoderStatus JxlDecoderProcessSections(JxlDecoder* dec) {
     if (OutOfBounds(pos, size, span.size())) {
       break;
     }
-    auto* br = new jxl::BitReader(jxl::Bytes(span.data() + pos, size));
+    auto* br = new jxl::BitReader(jxl::Bytes(span.data() + pos, size),
+                                  span.size() - pos - size);
     section_info.emplace_back(jxl::FrameDecoder::SectionInfo{br, id, i});
     section_status.emplace_back();
     pos += size;
@@ -1228,9 +1595,16 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       if (!dec->jpeg_decoder.SetImageBundleJpegData(dec->ib.get()))
         return JXL_DEC_ERROR;
 #endif
+      std::unique_ptr<FrameDecoder> previous_frame_dec =
+          dec->frame_dec ? std::move(dec->frame_dec)
+                         : std::move(dec->spare_frame_dec);
       dec->frame_dec = jxl::make_unique<FrameDecoder>(
           dec->passes_state.get(), dec->metadata, dec->thread_pool.get(),
           /*use_slow_rendering_pipeline=*/false);
+      dec->passes_state->stats = dec->stats ? &dec->stats->stats : nullptr;
+      if (previous_frame_dec) {
+        dec->frame_dec->ReuseStorage(previous_frame_dec.get());
+      }
       dec->frame_header = jxl::make_unique<FrameHeader>(&dec->metadata);
       Span<const uint8_t> span;
       JXL_API_RETURN_IF_ERROR(dec->GetCodestreamInput(&span));
@@ -1323,6 +1697,13 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
             !dec->frame_required[internal_frame_index]) {
           referenceable = false;
         }
+        // Neither the keyframe nor the frames after it depend on the frames
+        // before it, including the ones that are only referenced.
+        if (external_frame_index < dec->skip_to_keyframe ||
+            (external_frame_index == dec->skip_to_keyframe &&
+             dec->skip_to_keyframe > 0 && !dec->is_last_of_still)) {
+          referenceable = false;
+        }
         if (!referenceable) {
           // Skip all decoding for this frame, since the user is skipping this
           // frame and no future frames can reference it.
@@ -1359,6 +1740,30 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       dec->section_processed.clear();
       dec->section_processed.resize(dec->frame_dec->Toc().size(), 0);
 
+      if (!dec->preview_frame && UseCropRegion(dec) &&
+          (dec->events_wanted & JXL_DEC_FULL_IMAGE)) {
+        if (OutOfBounds(dec->crop_x0, dec->crop_xsize,
+                        dec->metadata.size.xsize()) ||
+            OutOfBounds(dec->crop_y0, dec->crop_ysize,
+                        dec->metadata.size.ysize())) {
+          return JXL_API_ERROR("Crop region is outside of the image");
+        }
+        dec->frame_dec->SetCropRegion(Rect(dec->crop_x0, dec->crop_y0,
+                                           dec->crop_xsize, dec->crop_ysize));
+      }
+      if (!dec->preview_frame && UseDownsampling(dec) &&
+          (dec->events_wanted & JXL_DEC_FULL_IMAGE)) {
+        dec->frame_dec->SetDownsampling(dec->output_downsampling);
+      }
+      // Sections that are not needed for the crop region or downsampling are
+      // never decoded, so the input containing them can be skipped.
+      const auto& toc = dec->frame_dec->Toc();
+      for (size_t i = 0; i < toc.size(); ++i) {
+        if (dec->frame_dec->IsSectionSkipped(toc[i].id)) {
+          dec->section_processed[i] = 1;
+        }
+      }
+
       // If we don't need pixels, we can skip actually decoding the frames.
       if (dec->preview_frame || (dec->events_wanted & JXL_DEC_FULL_IMAGE)) {
         dec->frame_stage = FrameStage::kFull;
@@ -1401,7 +1806,11 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
                 dec->image_out_destroy_callback, dec->image_out_init_opaque},
             reinterpret_cast<uint8_t*>(dec->image_out_buffer),
             dec->image_out_size, xsize, ysize, dec->image_out_format,
-            bits_per_sample, dec->unpremul_alpha, !dec->keep_orientation);
+            bits_per_sample, dec->unpremul_alpha, dec->premul_alpha,
+            !dec->keep_orientation);
+        if (!dec->image_out_planes.empty()) {
+          dec->frame_dec->SetImageOutputPlanes(dec->image_out_planes);
+        }
         for (size_t i = 0; i < dec->extra_channel_output.size(); ++i) {
           const auto& extra = dec->extra_channel_output[i];
           size_t ec_bits_per_sample =
@@ -1470,6 +1879,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
 #endif
       if (dec->preview_frame || dec->is_last_of_still) {
         dec->image_out_buffer_set = false;
+        dec->image_out_planes.clear();
         dec->extra_channel_output.clear();
       }
     }
@@ -1594,6 +2004,13 @@ static JxlDecoderStatus ParseBoxHeader(const uint8_t* in, size_t size,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlParseBoxHeader(const uint8_t* buf, size_t len,
+                                   JxlBoxHeaderInfo* info) {
+  if (!buf || !info) return JXL_API_ERROR("Invalid arguments");
+  return ParseBoxHeader(buf, len, 0, 0, info->type, &info->box_size,
+                        &info->header_size);
+}
+
 // This includes handling the codestream if it is not a box-based jxl file.
 static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
   // Box handling loop
@@ -1688,7 +2105,8 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
     if (dec->recon_output_jpeg == JpegReconStage::kOutputting &&
         !dec->JbrdNeedMoreBoxes()) {
       JxlDecoderStatus status =
-          dec->jpeg_decoder.WriteOutput(*dec->ib->jpeg_data);
+          dec->jpeg_decoder.WriteOutput(*dec->ib->jpeg_data,
+                                        dec->thread_pool.get());
       if (status != JXL_DEC_SUCCESS) return status;
       dec->recon_output_jpeg = JpegReconStage::kNone;
       dec->ib.reset();
@@ -1847,6 +2265,11 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
         }
         dec->box_stage = BoxStage::kJpegRecon;
 #endif
+      } else if (memcmp(dec->box_type, "jxli", 4) == 0 &&
+                 !dec->box_contents_unbounded &&
+                 dec->box_contents_size <= jxl::kMaxFrameIndexBoxSize) {
+        dec->frame_index_bytes.clear();
+        dec->box_stage = BoxStage::kFrameIndex;
       } else {
         dec->box_stage = BoxStage::kSkip;
       }
@@ -1968,6 +2391,19 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
         return recon_result;
       }
 #endif
+    } else if (dec->box_stage == BoxStage::kFrameIndex) {
+      size_t remaining = dec->box_contents_end - dec->file_pos;
+      size_t amount = std::min(remaining, dec->avail_in);
+      dec->frame_index_bytes.insert(dec->frame_index_bytes.end(), dec->next_in,
+                                    dec->next_in + amount);
+      dec->AdvanceInput(amount);
+      if (amount < remaining) return JXL_DEC_NEED_MORE_INPUT;
+      if (!jxl::ParseFrameIndexBox(dec->frame_index_bytes,
+                                   &dec->frame_index_box)) {
+        return JXL_INPUT_ERROR("invalid frame index box");
+      }
+      dec->frame_index_bytes.clear();
+      dec->box_stage = BoxStage::kHeader;
     } else if (dec->box_stage == BoxStage::kSkip) {
       if (dec->box_contents_unbounded) {
         if (dec->input_closed) {
@@ -2330,14 +2766,36 @@ JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetCms(JxlDecoder* dec,
                                              const JxlCmsInterface cms) {
   if (!dec->passes_state) {
-    dec->passes_state =
-        jxl::make_unique<jxl::PassesDecoderState>(&dec->memory_manager);
+    CreatePassesState(dec);
   }
   dec->passes_state->output_encoding_info.color_management_system = cms;
   dec->passes_state->output_encoding_info.cms_set = true;
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderGetOpsinInverseParams(
+    const JxlDecoder* dec, JxlOpsinInverseParams* params) {
+  if (!dec->got_all_headers) return JXL_DEC_NEED_MORE_INPUT;
+  if (!dec->metadata.m.xyb_encoded) {
+    return JXL_API_ERROR("The image is not XYB encoded");
+  }
+  const jxl::OpsinParams& opsin_params =
+      dec->passes_state->output_encoding_info.opsin_params;
+  for (size_t i = 0; i < 9; ++i) {
+    // Each coefficient is broadcast to 4 lanes.
+    params->inverse_matrix[i] = opsin_params.inverse_opsin_matrix[i * 4];
+  }
+  for (size_t c = 0; c < 3; ++c) {
+    params->opsin_biases[c] = opsin_params.opsin_biases[c];
+    params->opsin_biases_cbrt[c] = opsin_params.opsin_biases_cbrt[c];
+    params->scaled_xyb_offset[c] =
+        static_cast<float>(jxl::cms::kScaledXYBOffset[c]);
+    params->scaled_xyb_scale[c] =
+        static_cast<float>(jxl::cms::kScaledXYBScale[c]);
+  }
+  return JXL_DEC_SUCCESS;
+}
+
 static JxlDecoderStatus GetMinSize(const JxlDecoder* dec,
                                    const JxlPixelFormat* format,
                                    size_t num_channels, size_t* min_size,
@@ -2396,6 +2854,7 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetPreviewOutBuffer(
   dec->image_out_buffer_set = true;
   dec->image_out_buffer = buffer;
   dec->image_out_size = size;
+  dec->image_out_planes.clear();
   dec->image_out_format = *format;
 
   return JXL_DEC_SUCCESS;
@@ -2437,6 +2896,54 @@ JxlDecoderStatus JxlDecoderSetImageOutBuffer(JxlDecoder* dec,
   dec->image_out_buffer_set = true;
   dec->image_out_buffer = buffer;
   dec->image_out_size = size;
+  dec->image_out_planes.clear();
+  dec->image_out_format = *format;
+
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetImageOutPlanarBuffers(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    const JxlImageOutPlane* planes) {
+  if (!dec->got_basic_info || !(dec->orig_events_wanted & JXL_DEC_FULL_IMAGE)) {
+    return JXL_API_ERROR("No image out buffer needed at this time");
+  }
+  if (dec->image_out_buffer_set && !!dec->image_out_run_callback) {
+    return JXL_API_ERROR(
+        "Cannot change from image out callback to image out buffer");
+  }
+  if (format->num_channels < 3 &&
+      !dec->image_metadata.color_encoding.IsGray()) {
+    return JXL_API_ERROR("Number of channels is too low for color output");
+  }
+  size_t bits;
+  JxlDecoderStatus status = PrepareSizeCheck(dec, format, &bits);
+  if (status != JXL_DEC_SUCCESS) return status;
+  size_t xsize;
+  size_t ysize;
+  GetCurrentDimensions(dec, xsize, ysize);
+  size_t row_size = jxl::DivCeil(xsize * bits, jxl::kBitsPerByte);
+
+  std::vector<jxl::ImageOutputPlane> image_out_planes(format->num_channels);
+  for (size_t c = 0; c < format->num_channels; ++c) {
+    const JxlImageOutPlane& plane = planes[c];
+    if (plane.buffer == nullptr) {
+      return JXL_API_ERROR("Missing planar output buffer");
+    }
+    if (plane.stride < row_size ||
+        plane.size < plane.stride * (ysize - 1) + row_size) {
+      return JXL_API_ERROR("Planar output buffer is too small");
+    }
+    image_out_planes[c].buffer = plane.buffer;
+    image_out_planes[c].buffer_size = plane.size;
+    image_out_planes[c].stride = plane.stride;
+  }
+
+  dec->image_out_buffer_set = true;
+  // Only used to know that the main output is a buffer and not a callback.
+  dec->image_out_buffer = planes[0].buffer;
+  dec->image_out_size = planes[0].size;
+  dec->image_out_planes = std::move(image_out_planes);
   dec->image_out_format = *format;
 
   return JXL_DEC_SUCCESS;
@@ -2530,6 +3037,7 @@ JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
   if (status != JXL_DEC_SUCCESS) return status;
 
   dec->image_out_buffer_set = true;
+  dec->image_out_planes.clear();
   dec->image_out_init_callback = init_callback;
   dec->image_out_run_callback = run_callback;
   dec->image_out_destroy_callback = destroy_callback;
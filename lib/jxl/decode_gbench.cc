@@ -0,0 +1,204 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Decoding of fixed test images, encoded once with the settings that select
+// each of the main decoding paths: the modular fast tracks, the VarDCT
+// transform sizes, the render pipeline stages and the JPEG reconstruction.
+
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
+#include <jxl/encode.h>
+#include <jxl/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/jxl.h"
+#include "lib/extras/enc/jxl.h"
+#include "lib/extras/packed_image.h"
+#include "lib/jxl/base/span.h"
+#include "tools/file_io.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+constexpr char kPNG[] = "jxl/flower/flower.png";
+constexpr char kJPEG[] = "jxl/flower/flower.png.im_q85_420.jpg";
+
+struct DecodeCase {
+  const char* name;
+  const char* input;
+  // Lossless if 0.
+  float distance;
+  std::vector<std::pair<JxlEncoderFrameSettingId, int64_t>> options;
+  bool float_output;
+};
+
+const std::vector<DecodeCase>& DecodeCases() {
+  static const std::vector<DecodeCase>* cases = new std::vector<DecodeCase>{
+      // Modular: effort 1 to 3 use fixed trees (fast lossless, gradient and
+      // weighted predictor only); the predictor choices use learned trees
+      // whose leaves all have the same predictor.
+      {"modular_e1", kPNG, 0, {{JXL_ENC_FRAME_SETTING_EFFORT, 1}}, false},
+      {"modular_e2", kPNG, 0, {{JXL_ENC_FRAME_SETTING_EFFORT, 2}}, false},
+      {"modular_e3", kPNG, 0, {{JXL_ENC_FRAME_SETTING_EFFORT, 3}}, false},
+      {"modular_zero",
+       kPNG,
+       0,
+       {{JXL_ENC_FRAME_SETTING_EFFORT, 4},
+        {JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, 0}},
+       false},
+      {"modular_gradient",
+       kPNG,
+       0,
+       {{JXL_ENC_FRAME_SETTING_EFFORT, 4},
+        {JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, 5}},
+       false},
+      {"modular_weighted",
+       kPNG,
+       0,
+       {{JXL_ENC_FRAME_SETTING_EFFORT, 4},
+        {JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, 6}},
+       false},
+      {"modular_lossy", kPNG, 1, {{JXL_ENC_FRAME_SETTING_MODULAR, 1}}, false},
+      // VarDCT: the mix of transform sizes shifts to larger ones with the
+      // distance.
+      {"vardct_d0.5", kPNG, 0.5, {}, false},
+      {"vardct_d1", kPNG, 1, {}, false},
+      {"vardct_d3", kPNG, 3, {}, false},
+      {"vardct_d8", kPNG, 8, {}, false},
+      // Render pipeline stages, compared to vardct_d1.
+      {"vardct_no_filters",
+       kPNG,
+       1,
+       {{JXL_ENC_FRAME_SETTING_EPF, 0}, {JXL_ENC_FRAME_SETTING_GABORISH, 0}},
+       false},
+      {"vardct_epf3", kPNG, 1, {{JXL_ENC_FRAME_SETTING_EPF, 3}}, false},
+      {"vardct_upsampling2",
+       kPNG,
+       1,
+       {{JXL_ENC_FRAME_SETTING_RESAMPLING, 2}},
+       false},
+      {"vardct_float", kPNG, 1, {}, true},
+      // Reconstruction of the original JPEG file.
+      {"jpeg", kJPEG, 0, {}, false},
+  };
+  return *cases;
+}
+
+bool IsJPEGCase(const DecodeCase& c) { return c.input == kJPEG; }
+
+// Encoded once per case, the benchmarks reuse them.
+bool GetEncoded(size_t index, std::vector<uint8_t>* encoded) {
+  static std::map<size_t, std::vector<uint8_t>>* cache =
+      new std::map<size_t, std::vector<uint8_t>>();
+  auto it = cache->find(index);
+  if (it != cache->end()) {
+    *encoded = it->second;
+    return true;
+  }
+  const DecodeCase& c = DecodeCases()[index];
+  std::vector<uint8_t> input;
+  if (!jpegxl::tools::ReadFile(std::string(TEST_DATA_PATH "/") + c.input,
+                               &input)) {
+    return false;
+  }
+  extras::JXLCompressParams params;
+  params.distance = c.distance;
+  for (const auto& option : c.options) {
+    params.AddOption(option.first, option.second);
+  }
+  extras::PackedPixelFile ppf;
+  if (IsJPEGCase(c)) {
+    if (!extras::EncodeImageJXL(params, ppf, &input, encoded)) return false;
+  } else {
+    if (!extras::DecodeBytes(Bytes(input), extras::ColorHints(), &ppf)) {
+      return false;
+    }
+    if (!extras::EncodeImageJXL(params, ppf, nullptr, encoded)) return false;
+  }
+  (*cache)[index] = *encoded;
+  return true;
+}
+
+void BM_Decode(benchmark::State& state) {
+  const size_t index = state.range(0);
+  const DecodeCase& c = DecodeCases()[index];
+  state.SetLabel(c.name);
+  std::vector<uint8_t> encoded;
+  BM_CHECK(GetEncoded(index, &encoded));
+
+  // Single-threaded, so that the results do not depend on the machine.
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats.push_back(
+      {3, c.float_output ? JXL_TYPE_FLOAT : JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN,
+       0});
+  size_t num_pixels = 0;
+  for (auto _ : state) {
+    (void)_;
+    extras::PackedPixelFile ppf;
+    std::vector<uint8_t> jpeg_bytes;
+    size_t decoded_bytes;
+    BM_CHECK(extras::DecodeImageJXL(encoded.data(), encoded.size(), dparams,
+                                    &decoded_bytes, &ppf,
+                                    IsJPEGCase(c) ? &jpeg_bytes : nullptr));
+    BM_CHECK(!IsJPEGCase(c) || !jpeg_bytes.empty());
+    num_pixels = ppf.info.xsize * ppf.info.ysize;
+  }
+
+  // Pixels per second.
+  state.SetItemsProcessed(num_pixels * state.iterations());
+  state.SetBytesProcessed(encoded.size() * state.iterations());
+}
+
+BENCHMARK(BM_Decode)
+    ->DenseRange(0, DecodeCases().size() - 1)
+    ->Unit(benchmark::kMillisecond);
+
+// Only the basic info, as requested by metadata-only users; the decoder is
+// reused, as a server would do.
+void BM_DecodeBasicInfo(benchmark::State& state) {
+  size_t index = 0;
+  while (std::string(DecodeCases()[index].name) != "vardct_d1") ++index;
+  std::vector<uint8_t> encoded;
+  BM_CHECK(GetEncoded(index, &encoded));
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  for (auto _ : state) {
+    (void)_;
+    JxlDecoderReset(dec.get());
+    BM_CHECK(JXL_DEC_SUCCESS ==
+             JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO));
+    BM_CHECK(JXL_DEC_SUCCESS ==
+             JxlDecoderSetInput(dec.get(), encoded.data(), encoded.size()));
+    BM_CHECK(JXL_DEC_BASIC_INFO == JxlDecoderProcessInput(dec.get()));
+    JxlBasicInfo info;
+    BM_CHECK(JXL_DEC_SUCCESS == JxlDecoderGetBasicInfo(dec.get(), &info));
+    benchmark::DoNotOptimize(info.xsize);
+  }
+
+  // Headers per second.
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_DecodeBasicInfo);
+
+}  // namespace
+}  // namespace jxl
@@ -19,6 +19,7 @@
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -1619,6 +1620,44 @@ TEST(DecodeTest, PixelTestWithICCProfileLossless) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, PremultiplyAlphaTest) {
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+
+  size_t xsize = 123;
+  size_t ysize = 77;
+  size_t num_pixels = xsize * ysize;
+  // Big endian uint16 RGBA, with unassociated alpha.
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::TestCodestreamParams params;
+  params.cparams.SetLossless();
+  params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+
+  JxlPixelFormat format = {4, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetPremultiplyAlpha(dec, JXL_TRUE));
+  std::vector<uint8_t> pixels2 = jxl::DecodeWithAPI(
+      dec, jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(num_pixels * 4 * sizeof(float), pixels2.size());
+  const float* out = reinterpret_cast<const float*>(pixels2.data());
+  const auto orig = [&](size_t i, size_t c) {
+    const uint8_t* p = pixels.data() + (i * 4 + c) * 2;
+    return (p[0] * 256 + p[1]) / 65535.0f;
+  };
+  for (size_t i = 0; i < num_pixels; ++i) {
+    const float alpha = orig(i, 3);
+    ASSERT_NEAR(alpha, out[i * 4 + 3], 1e-5f);
+    for (size_t c = 0; c < 3; ++c) {
+      ASSERT_NEAR(orig(i, c) * alpha, out[i * 4 + c], 1e-5f);
+    }
+  }
+
+  JxlDecoderDestroy(dec);
+}
+
 TEST(DecodeTest, PixelTestWithICCProfileLossy) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   JxlDecoder* dec = JxlDecoderCreate(nullptr);
@@ -2080,6 +2119,79 @@ TEST(DecodeTest, PixelTestOpaqueSrgbLossy) {
   }
 }
 
+TEST(DecodeTest, XYBOutputWithOpsinInverseParams) {
+  size_t xsize = 123;
+  size_t ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3,
+      jxl::TestCodestreamParams());
+
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  JxlOpsinInverseParams params;
+  const auto decode = [&](JxlColorSpace color_space) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(
+                  dec.get(), JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    EXPECT_EQ(JXL_DEC_COLOR_ENCODING, JxlDecoderProcessInput(dec.get()));
+    JxlColorEncoding color_encoding =
+        jxl::ColorEncoding::LinearSRGB(/*is_gray=*/false).ToExternal();
+    color_encoding.color_space = color_space;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetPreferredColorProfile(dec.get(), &color_encoding));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetOpsinInverseParams(dec.get(), &params));
+    std::vector<float> out(xsize * ysize * 3);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, out.data(),
+                                          out.size() * sizeof(float)));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    return out;
+  };
+  std::vector<float> linear = decode(JXL_COLOR_SPACE_RGB);
+  std::vector<float> xyb = decode(JXL_COLOR_SPACE_XYB);
+  for (size_t i = 0; i < xsize * ysize; ++i) {
+    const float* p = &xyb[3 * i];
+    float y = p[1] / params.scaled_xyb_scale[1] - params.scaled_xyb_offset[1];
+    float x = p[0] / params.scaled_xyb_scale[0] - params.scaled_xyb_offset[0];
+    float b =
+        p[2] / params.scaled_xyb_scale[2] - params.scaled_xyb_offset[2] + y;
+    float gamma[3] = {y + x, y - x, b};
+    float mixed[3];
+    for (size_t c = 0; c < 3; ++c) {
+      float g = gamma[c] - params.opsin_biases_cbrt[c];
+      mixed[c] = g * g * g + params.opsin_biases[c];
+    }
+    for (size_t c = 0; c < 3; ++c) {
+      float rgb = 0;
+      for (size_t j = 0; j < 3; ++j) {
+        rgb += params.inverse_matrix[3 * c + j] * mixed[j];
+      }
+      EXPECT_NEAR(rgb, linear[3 * i + c], 1e-4);
+    }
+  }
+
+  // Not available for images that are not XYB encoded.
+  jxl::TestCodestreamParams lossless;
+  lossless.cparams.SetLossless();
+  compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, lossless);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_COLOR_ENCODING));
+  EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT,
+            JxlDecoderGetOpsinInverseParams(dec.get(), &params));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  EXPECT_EQ(JXL_DEC_COLOR_ENCODING, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderGetOpsinInverseParams(dec.get(), &params));
+}
+
 // Opaque image with noise enabled, decoded to RGB8 and RGBA8.
 TEST(DecodeTest, PixelTestOpaqueSrgbLossyNoise) {
   for (unsigned channels = 3; channels <= 4; channels++) {
@@ -2594,6 +2706,596 @@ TEST(DecodeTest, AlignTest) {
   }
 }
 
+TEST(DecodeTest, ResetKeepAllocationsTest) {
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  // Same size twice to reuse the buffers, then a different size.
+  const std::pair<size_t, size_t> sizes[] = {{300, 200}, {300, 200}, {90, 70}};
+  for (size_t i = 0; i < 3; ++i) {
+    size_t xsize = sizes[i].first;
+    size_t ysize = sizes[i].second;
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::TestCodestreamParams params;
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+    jxl::Span<const uint8_t> span =
+        jxl::Bytes(compressed.data(), compressed.size());
+
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        span, format, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    JxlDecoderResetKeepAllocations(dec.get());
+    std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+        dec.get(), span, format, /*use_callback=*/false,
+        /*set_buffer_early=*/false, /*use_resizable_runner=*/false,
+        /*require_boxes=*/false, /*expect_success=*/true);
+    EXPECT_EQ(expected, decoded) << "image " << i;
+  }
+}
+
+TEST(DecodeTest, MemoryArenaTest) {
+  struct CalledCounters {
+    int allocs = 0;
+    int frees = 0;
+  };
+  JxlMemoryManager mm;
+  mm.alloc = [](void* opaque, size_t size) {
+    reinterpret_cast<CalledCounters*>(opaque)->allocs++;
+    return malloc(size);
+  };
+  mm.free = [](void* opaque, void* address) {
+    if (address) reinterpret_cast<CalledCounters*>(opaque)->frees++;
+    free(address);
+  };
+
+  size_t xsize = 300;
+  size_t ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  jxl::Span<const uint8_t> span =
+      jxl::Bytes(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  CalledCounters plain_counters;
+  mm.opaque = &plain_counters;
+  JxlDecoderPtr plain_dec = JxlDecoderMake(&mm);
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      plain_dec.get(), span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false,
+      /*require_boxes=*/false, /*expect_success=*/true);
+  plain_dec.reset();
+
+  CalledCounters arena_counters;
+  mm.opaque = &arena_counters;
+  JxlDecoderPtr dec = JxlDecoderMake(&mm);
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetMemoryArena(dec.get(), 0));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryArena(dec.get(), 1 << 20));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetMemoryArena(dec.get(), 1 << 20));
+  std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+      dec.get(), span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false,
+      /*require_boxes=*/false, /*expect_success=*/true);
+  EXPECT_EQ(expected, decoded);
+  dec.reset();
+
+  EXPECT_LT(arena_counters.allocs, plain_counters.allocs);
+  // Everything is returned to the memory manager.
+  EXPECT_EQ(arena_counters.allocs, arena_counters.frees);
+}
+
+TEST(DecodeTest, HugePageThresholdTest) {
+  size_t xsize = 300;
+  size_t ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  jxl::Span<const uint8_t> span =
+      jxl::Bytes(compressed.data(), compressed.size());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  JxlDecoderPtr plain_dec = JxlDecoderMake(nullptr);
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      plain_dec.get(), span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false,
+      /*require_boxes=*/false, /*expect_success=*/true);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  // Advise every allocation, to exercise the path even on small images.
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetHugePageThreshold(dec.get(), 1));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryArena(dec.get(), 1 << 22));
+  std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+      dec.get(), span, format, /*use_callback=*/false,
+      /*set_buffer_early=*/false, /*use_resizable_runner=*/false,
+      /*require_boxes=*/false, /*expect_success=*/true);
+  EXPECT_EQ(expected, decoded);
+  // Decoding has started.
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetHugePageThreshold(dec.get(), 0));
+}
+
+TEST(DecodeTest, MemoryLimitTest) {
+  size_t xsize = 300;
+  size_t ysize = 200;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  // Decodes with the given limit, returns the final status and the peak usage.
+  const auto decode = [&](uint64_t limit, uint64_t* peak_bytes) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderGetPeakMemoryUsage(dec.get(), peak_bytes));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec.get(), limit));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    std::vector<uint8_t> decoded(xsize * ysize * 6);
+    JxlDecoderStatus status;
+    for (;;) {
+      status = JxlDecoderProcessInput(dec.get());
+      if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS,
+                  JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                              decoded.data(), decoded.size()));
+      } else if (status != JXL_DEC_FULL_IMAGE) {
+        break;
+      }
+    }
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetPeakMemoryUsage(dec.get(), peak_bytes));
+    return status;
+  };
+
+  // Only track the usage.
+  uint64_t peak_bytes = 0;
+  EXPECT_EQ(JXL_DEC_SUCCESS, decode(0, &peak_bytes));
+  EXPECT_LT(0u, peak_bytes);
+
+  uint64_t limited_peak_bytes = 0;
+  EXPECT_EQ(JXL_DEC_SUCCESS, decode(peak_bytes, &limited_peak_bytes));
+  EXPECT_EQ(peak_bytes, limited_peak_bytes);
+  EXPECT_EQ(JXL_DEC_ERROR, decode(peak_bytes / 2, &limited_peak_bytes));
+  EXPECT_LE(limited_peak_bytes, peak_bytes / 2);
+}
+
+TEST(DecodeTest, FusedXYBToSRGBOutputTest) {
+  size_t xsize = 300;
+  size_t ysize = 150;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+  jxl::Span<const uint8_t> span =
+      jxl::Bytes(compressed.data(), compressed.size());
+
+  for (uint32_t num_channels : {3, 4}) {
+    // Float output goes through the separate XYB and sRGB stages, 16 bit
+    // output converts from XYB in the output stage; both must agree exactly.
+    JxlPixelFormat format_float = {num_channels, JXL_TYPE_FLOAT,
+                                   JXL_NATIVE_ENDIAN, 0};
+    JxlPixelFormat format_16 = {num_channels, JXL_TYPE_UINT16,
+                                JXL_NATIVE_ENDIAN, 0};
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        span, format_float, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+        span, format_16, /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    size_t num_samples = xsize * ysize * num_channels;
+    ASSERT_EQ(num_samples * sizeof(float), expected.size());
+    ASSERT_EQ(num_samples * sizeof(uint16_t), decoded.size());
+    for (size_t i = 0; i < num_samples; ++i) {
+      float f;
+      uint16_t v;
+      memcpy(&f, &expected[i * sizeof(float)], sizeof(float));
+      memcpy(&v, &decoded[i * sizeof(uint16_t)], sizeof(uint16_t));
+      float scaled = std::min(std::max(f * 65535.0f, 0.0f), 65535.0f);
+      ASSERT_EQ(static_cast<uint16_t>(std::nearbyint(scaled)), v)
+          << "sample " << i;
+    }
+  }
+}
+
+TEST(DecodeTest, PlanarOutputTest) {
+  size_t xsize = 123;
+  size_t ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+
+  for (JxlDataType data_type : {JXL_TYPE_UINT16, JXL_TYPE_FLOAT}) {
+    JxlPixelFormat format = {4, data_type, JXL_LITTLE_ENDIAN, 0};
+    size_t bytes_per_sample = data_type == JXL_TYPE_FLOAT ? 4 : 2;
+    std::vector<uint8_t> interleaved = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    ASSERT_EQ(xsize * ysize * 4 * bytes_per_sample, interleaved.size());
+
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER,
+              JxlDecoderProcessInput(dec.get()));
+    // Padded rows, to check that the stride is respected.
+    size_t stride = xsize * bytes_per_sample + 16;
+    std::vector<std::vector<uint8_t>> buffers(
+        4, std::vector<uint8_t>(stride * ysize));
+    JxlImageOutPlane planes[4];
+    for (size_t c = 0; c < 4; ++c) {
+      planes[c] = {buffers[c].data(), buffers[c].size(), stride};
+    }
+    // Strides shorter than a row are rejected.
+    planes[1].stride = xsize * bytes_per_sample - 1;
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderSetImageOutPlanarBuffers(dec.get(), &format, planes));
+    planes[1].stride = stride;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutPlanarBuffers(dec.get(), &format, planes));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        for (size_t c = 0; c < 4; ++c) {
+          size_t i = ((y * xsize + x) * 4 + c) * bytes_per_sample;
+          size_t j = y * stride + x * bytes_per_sample;
+          ASSERT_EQ(0, memcmp(&interleaved[i], &buffers[c][j],
+                              bytes_per_sample))
+              << "x=" << x << " y=" << y << " c=" << c;
+        }
+      }
+    }
+  }
+}
+
+TEST(DecodeTest, CollectStatsTest) {
+  size_t xsize = 300;
+  size_t ysize = 150;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+
+  JxlDecoderStats* stats = JxlDecoderStatsCreate();
+  JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> output(xsize * ysize * 4);
+  // Decode twice, the statistics are accumulated.
+  for (size_t i = 0; i < 2; ++i) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderCollectStats(dec.get(), stats));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER,
+              JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, output.data(),
+                                          output.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+  }
+
+  auto find_entry = [](const JxlDecoderStats* stats, const std::string& name,
+                       JxlDecoderStatsEntry* entry) {
+    for (size_t i = 0; i < JxlDecoderStatsNumEntries(stats); ++i) {
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderStatsGetEntry(stats, i, entry));
+      if (entry->name == name) return true;
+    }
+    return false;
+  };
+  JxlDecoderStatsEntry groups;
+  ASSERT_TRUE(find_entry(stats, "DecodeACGroup", &groups));
+  // Two groups for each of the two decodes.
+  EXPECT_GE(groups.calls, 4u);
+  EXPECT_GT(groups.nanoseconds, 0u);
+  EXPECT_GT(groups.bytes, 0u);
+  EXPECT_LT(groups.bytes, 2 * compressed.size());
+  JxlDecoderStatsEntry write;
+  ASSERT_TRUE(find_entry(stats, "WritePixelCB", &write));
+  // Every row of each group is written once, reading 4 float channels.
+  EXPECT_GE(write.calls, 2 * ysize);
+  EXPECT_EQ(write.bytes, 2 * ysize * xsize * 4 * sizeof(float));
+
+  JxlDecoderStatsEntry entry;
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderStatsGetEntry(stats, JxlDecoderStatsNumEntries(stats),
+                                    &entry));
+
+  JxlDecoderStats* merged = JxlDecoderStatsCreate();
+  JxlDecoderStatsMerge(merged, stats);
+  JxlDecoderStatsMerge(merged, stats);
+  ASSERT_TRUE(find_entry(merged, "DecodeACGroup", &entry));
+  EXPECT_EQ(entry.calls, 2 * groups.calls);
+  EXPECT_EQ(entry.nanoseconds, 2 * groups.nanoseconds);
+  JxlDecoderStatsDestroy(merged);
+  JxlDecoderStatsDestroy(stats);
+}
+
+TEST(DecodeTest, LosslessPeakMemoryTest) {
+  // Several group rows, so that a full-frame image would stand out.
+  size_t xsize = 1024;
+  size_t ysize = 1024;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  params.cparams.SetLossless();
+  params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+  // No global palettes, which need the full image.
+  params.cparams.palette_colors = 0;
+  params.cparams.channel_colors_pre_transform_percent = 0;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+
+  // Keeps track of the bytes allocated by the decoder.
+  struct Usage {
+    size_t current = 0;
+    size_t peak = 0;
+  } usage;
+  constexpr size_t kHeader = 64;  // Keeps the alignment of malloc.
+  JxlMemoryManager mm;
+  mm.opaque = &usage;
+  mm.alloc = [](void* opaque, size_t size) -> void* {
+    Usage* usage = reinterpret_cast<Usage*>(opaque);
+    uint8_t* block = static_cast<uint8_t*>(malloc(size + kHeader));
+    if (block == nullptr) return nullptr;
+    memcpy(block, &size, sizeof(size));
+    usage->current += size;
+    usage->peak = std::max(usage->peak, usage->current);
+    return block + kHeader;
+  };
+  mm.free = [](void* opaque, void* address) {
+    if (address == nullptr) return;
+    uint8_t* block = static_cast<uint8_t*>(address) - kHeader;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+    reinterpret_cast<Usage*>(opaque)->current -= size;
+    free(block);
+  };
+
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> output(xsize * ysize * 6);
+  {
+    JxlDecoderPtr dec = JxlDecoderMake(&mm);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER,
+              JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, output.data(),
+                                          output.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+  }
+  EXPECT_EQ(0u, usage.current);
+  // Less than a single full-frame plane of modular samples.
+  EXPECT_LT(usage.peak, xsize * ysize * sizeof(int32_t));
+}
+
+TEST(DecodeTest, CropRegionTest) {
+  // Large enough for several groups in each direction, so that the crop
+  // region only needs some of them.
+  size_t xsize = 1100;
+  size_t ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(xsize * ysize * 3 * sizeof(float), full.size());
+
+  const size_t crop_x0 = 700;
+  const size_t crop_y0 = 20;
+  const size_t crop_xsize = 150;
+  const size_t crop_ysize = 100;
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetCropRegion(dec.get(), crop_x0, crop_y0, crop_xsize,
+                                    crop_ysize));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+  ASSERT_EQ(crop_xsize * crop_ysize * 3 * sizeof(float), buffer_size);
+  std::vector<uint8_t> cropped(buffer_size);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, cropped.data(),
+                                        cropped.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+  const float* full_f = reinterpret_cast<const float*>(full.data());
+  const float* cropped_f = reinterpret_cast<const float*>(cropped.data());
+  for (size_t y = 0; y < crop_ysize; ++y) {
+    for (size_t x = 0; x < crop_xsize * 3; ++x) {
+      ASSERT_NEAR(full_f[((crop_y0 + y) * xsize + crop_x0) * 3 + x],
+                  cropped_f[y * crop_xsize * 3 + x], 1e-4)
+          << "x: " << x << " y: " << y;
+    }
+  }
+}
+
+// Only the input ranges reported for the crop region are needed: the other
+// bytes of the frame are overwritten and the crop is still decoded correctly.
+TEST(DecodeTest, CropRegionNeededInputRangesTest) {
+  size_t xsize = 1100;
+  size_t ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(xsize * ysize * 3 * sizeof(float), full.size());
+
+  const size_t crop_x0 = 700;
+  const size_t crop_y0 = 20;
+  const size_t crop_xsize = 150;
+  const size_t crop_ysize = 100;
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetCropRegion(dec.get(), crop_x0, crop_y0, crop_xsize,
+                                    crop_ysize));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+
+  size_t num_ranges;
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetNeededInputRanges(
+                                 dec.get(), nullptr, 0, &num_ranges));
+  ASSERT_GT(num_ranges, 0u);
+  std::vector<JxlInputRange> ranges(num_ranges);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderGetNeededInputRanges(dec.get(), ranges.data(),
+                                           ranges.size(), &num_ranges));
+  ASSERT_EQ(ranges.size(), num_ranges);
+
+  // Keep only the needed ranges of the rest of the input.
+  const size_t remaining = JxlDecoderReleaseInput(dec.get());
+  const size_t frame_begin = compressed.size() - remaining;
+  std::vector<uint8_t> fetched(compressed.size(), 0);
+  size_t fetched_bytes = 0;
+  for (const JxlInputRange& range : ranges) {
+    ASSERT_GE(range.offset, frame_begin);
+    ASSERT_LE(range.offset + range.size, compressed.size());
+    std::copy(compressed.begin() + range.offset,
+              compressed.begin() + range.offset + range.size,
+              fetched.begin() + range.offset);
+    fetched_bytes += range.size;
+  }
+  EXPECT_LT(fetched_bytes, remaining);
+
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+  std::vector<uint8_t> cropped(buffer_size);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, cropped.data(),
+                                        cropped.size()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec.get(), fetched.data() + frame_begin,
+                               remaining));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+
+  const float* full_f = reinterpret_cast<const float*>(full.data());
+  const float* cropped_f = reinterpret_cast<const float*>(cropped.data());
+  for (size_t y = 0; y < crop_ysize; ++y) {
+    for (size_t x = 0; x < crop_xsize * 3; ++x) {
+      ASSERT_NEAR(full_f[((crop_y0 + y) * xsize + crop_x0) * 3 + x],
+                  cropped_f[y * crop_xsize * 3 + x], 1e-4)
+          << "x: " << x << " y: " << y;
+    }
+  }
+}
+
+TEST(DecodeTest, DownsamplingTest) {
+  size_t xsize = 1100;
+  size_t ysize = 600;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+
+  std::vector<uint8_t> full = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(xsize * ysize * 3 * sizeof(float), full.size());
+  const float* full_f = reinterpret_cast<const float*>(full.data());
+
+  for (uint32_t factor : {2, 4, 8}) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDownsampling(dec.get(), factor));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    const size_t out_xsize = jxl::DivCeil(xsize, factor);
+    const size_t out_ysize = jxl::DivCeil(ysize, factor);
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+    ASSERT_EQ(out_xsize * out_ysize * 3 * sizeof(float), buffer_size);
+    std::vector<uint8_t> downsampled(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                          downsampled.data(),
+                                          downsampled.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+    const float* out_f = reinterpret_cast<const float*>(downsampled.data());
+    if (factor != 8) {
+      // Decoded at full resolution and subsampled.
+      for (size_t y = 0; y < out_ysize; ++y) {
+        for (size_t x = 0; x < out_xsize; ++x) {
+          for (size_t c = 0; c < 3; ++c) {
+            ASSERT_NEAR(full_f[(y * factor * xsize + x * factor) * 3 + c],
+                        out_f[(y * out_xsize + x) * 3 + c], 1e-6)
+                << "factor: " << factor << " x: " << x << " y: " << y;
+          }
+        }
+      }
+      continue;
+    }
+    // Rendered from DC: compare with the average of each 8x8 block.
+    double total_error = 0;
+    for (size_t y = 0; y < out_ysize; ++y) {
+      for (size_t x = 0; x < out_xsize; ++x) {
+        for (size_t c = 0; c < 3; ++c) {
+          double sum = 0;
+          size_t num = 0;
+          for (size_t iy = y * 8; iy < std::min(ysize, y * 8 + 8); ++iy) {
+            for (size_t ix = x * 8; ix < std::min(xsize, x * 8 + 8); ++ix) {
+              sum += full_f[(iy * xsize + ix) * 3 + c];
+              num++;
+            }
+          }
+          float value = out_f[(y * out_xsize + x) * 3 + c];
+          total_error += std::abs(sum / num - value);
+        }
+      }
+    }
+    EXPECT_LT(total_error / (out_xsize * out_ysize * 3), 0.03);
+  }
+}
+
 TEST(DecodeTest, AnimationTest) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   size_t xsize = 123;
@@ -3159,6 +3861,85 @@ TEST(DecodeTest, SkipFrameTest) {
   JxlDecoderDestroy(dec);
 }
 
+// A frame index box before the codestream lets the decoder skip all the frames
+// before the last keyframe, even the ones that could be referenced.
+TEST(DecodeTest, SkipFrameWithFrameIndexTest) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  size_t xsize = 90;
+  size_t ysize = 120;
+  constexpr size_t num_frames = 16;
+  std::vector<uint8_t> frames[num_frames];
+  for (size_t i = 0; i < num_frames; i++) {
+    frames[i] = jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+  }
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::CodecInOut io{memory_manager};
+  ASSERT_TRUE(io.SetSize(xsize, ysize));
+  io.metadata.m.SetUintSamples(16);
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.have_animation = true;
+  io.frames.clear();
+  io.frames.reserve(num_frames);
+  for (size_t i = 0; i < num_frames; ++i) {
+    jxl::ImageBundle bundle(memory_manager, &io.metadata.m);
+    bundle.use_for_next_frame = true;
+    EXPECT_TRUE(ConvertFromExternal(
+        jxl::Bytes(frames[i].data(), frames[i].size()), xsize, ysize,
+        jxl::ColorEncoding::SRGB(/*is_gray=*/false),
+        /*bits_per_sample=*/16, format,
+        /*pool=*/nullptr, &bundle));
+    bundle.duration = 1;
+    io.frames.push_back(std::move(bundle));
+  }
+
+  jxl::CompressParams cparams;
+  cparams.SetLossless();  // Lossless to verify pixels exactly after roundtrip.
+  cparams.speed_tier = jxl::SpeedTier::kThunder;
+  std::vector<uint8_t> codestream;
+  EXPECT_TRUE(jxl::test::EncodeFile(cparams, &io, &codestream));
+
+  // Frames 0, 4 and 8 are indexed. The offsets are not used by the decoder.
+  const std::vector<uint8_t> frame_index = {
+      3, 0, 0, 0, 1, 0, 0, 0x03, 0xe8, 0, 0, 4, 0, 0, 4, 0, 0, 8};
+  std::vector<uint8_t> compressed;
+  jxl::Bytes(jxl::kContainerHeader).AppendTo(compressed);
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxli"), frame_index.size(), false,
+                       &compressed);
+  jxl::Bytes(frame_index).AppendTo(compressed);
+  jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), 0, true, &compressed);
+  jxl::Bytes(codestream).AppendTo(compressed);
+
+  for (size_t target : {2, 4, 9, 15}) {
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO |
+                                                 JXL_DEC_FRAME |
+                                                 JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderImageOutBufferSize(dec, &format, &buffer_size));
+
+    JxlDecoderSkipFrames(dec, target);
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec));
+    JxlFrameHeader frame_header;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec, &frame_header));
+    EXPECT_EQ(target + 1 == num_frames, frame_header.is_last);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    std::vector<uint8_t> pixels(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, pixels.data(), pixels.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(0u, jxl::test::ComparePixels(frames[target].data(),
+                                           pixels.data(), xsize, ysize, format,
+                                           format));
+    JxlDecoderDestroy(dec);
+  }
+}
+
 TEST(DecodeTest, SkipFrameWithBlendingTest) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   size_t xsize = 90;
@@ -4447,6 +5228,75 @@ TEST(DecodeTest, FlushTest) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, FlushTestIncremental) {
+  size_t xsize = 333;
+  size_t ysize = 300;
+  uint32_t num_channels = 3;
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+  jxl::TestCodestreamParams params;
+  jxl::PassDefinition passes[] = {{2, 0, 4}, {4, 0, 2}, {8, 0, 1}};
+  jxl::ProgressiveMode progressive_mode{passes};
+  params.cparams.custom_progressive_mode = &progressive_mode;
+  std::vector<uint8_t> data =
+      jxl::CreateTestJXLCodestream(jxl::Bytes(pixels.data(), pixels.size()),
+                                   xsize, ysize, num_channels, params);
+  JxlPixelFormat format = {num_channels, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  // Decodes up to `end` with `dec`, which has consumed the input up to
+  // `*consumed`, and flushes the image into `out`.
+  const auto decode_to = [&](JxlDecoder* dec, size_t* consumed, size_t end,
+                             std::vector<uint8_t>* out) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, data.data() + *consumed,
+                                                  end - *consumed));
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    while (status != JXL_DEC_NEED_MORE_INPUT) {
+      if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                       dec, &format, out->data(), out->size()));
+      } else {
+        EXPECT_TRUE(status == JXL_DEC_BASIC_INFO || status == JXL_DEC_FRAME);
+      }
+      status = JxlDecoderProcessInput(dec);
+    }
+    *consumed = end - JxlDecoderReleaseInput(dec);
+    return JxlDecoderFlushImage(dec) == JXL_DEC_SUCCESS;
+  };
+
+  // Flushing after each chunk only redraws the groups that got new passes,
+  // and must give the same image as a single flush at the same point.
+  std::vector<uint8_t> incremental(pixels.size());
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec, JXL_DEC_BASIC_INFO | JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  size_t consumed = 0;
+  size_t num_flushes = 0;
+  constexpr size_t kNumChunks = 16;
+  for (size_t i = 1; i < kNumChunks; ++i) {
+    size_t end = data.size() * i / kNumChunks;
+    if (!decode_to(dec, &consumed, end, &incremental)) continue;
+    // A second flush without new input must not change anything.
+    std::vector<uint8_t> before = incremental;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderFlushImage(dec));
+    EXPECT_EQ(before, incremental);
+    ++num_flushes;
+
+    std::vector<uint8_t> single(pixels.size());
+    JxlDecoder* single_dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(single_dec, JXL_DEC_BASIC_INFO |
+                                                        JXL_DEC_FRAME |
+                                                        JXL_DEC_FULL_IMAGE));
+    size_t single_consumed = 0;
+    EXPECT_TRUE(decode_to(single_dec, &single_consumed, end, &single));
+    EXPECT_EQ(single, incremental);
+    JxlDecoderDestroy(single_dec);
+  }
+  EXPECT_GT(num_flushes, 1u);
+  JxlDecoderDestroy(dec);
+}
+
 TEST(DecodeTest, FlushTestImageOutCallback) {
   // Size large enough for multiple groups, required to have progressive
   // stages
@@ -5125,6 +5975,37 @@ TEST(DecodeTest, ExtendedBoxSizeTest) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, ParseBoxHeaderTest) {
+  const std::string jxl_path = "jxl/boxes/square-extended-size-container.jxl";
+  const std::vector<uint8_t> orig = jxl::test::ReadTestData(jxl_path);
+  ASSERT_EQ(JXL_SIG_CONTAINER, JxlSignatureCheck(orig.data(), orig.size()));
+
+  std::vector<std::string> expected_box_types = {"JXL ", "ftyp", "jxlc"};
+  std::vector<uint64_t> expected_box_sizes = {12, 20, 72};
+  std::vector<uint64_t> expected_header_sizes = {8, 8, 16};
+  JxlBoxHeaderInfo info;
+  size_t pos = 0;
+  for (size_t i = 0; i < expected_box_types.size(); i++) {
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlParseBoxHeader(orig.data() + pos, orig.size() - pos, &info));
+    EXPECT_TRUE(BoxTypeEquals(expected_box_types[i], info.type));
+    EXPECT_EQ(expected_box_sizes[i], info.box_size);
+    EXPECT_EQ(expected_header_sizes[i], info.header_size);
+    pos += info.box_size;
+    ASSERT_LE(pos, orig.size());
+  }
+
+  // Only the first 8 bytes of the extended box header.
+  const size_t jxlc_pos = 12 + 20;
+  EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT,
+            JxlParseBoxHeader(orig.data() + jxlc_pos, 8, &info));
+  EXPECT_EQ(16, info.header_size);
+
+  // A box smaller than its own header.
+  const uint8_t invalid[8] = {0, 0, 0, 4, 'E', 'x', 'i', 'f'};
+  EXPECT_EQ(JXL_DEC_ERROR, JxlParseBoxHeader(invalid, sizeof(invalid), &info));
+}
+
 JXL_BOXES_TEST(DecodeTest, BoxTest) {
   size_t xsize = 1;
   size_t ysize = 1;
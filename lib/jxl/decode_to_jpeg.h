@@ -20,6 +20,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/image_bundle.h"
@@ -117,7 +118,10 @@ class JxlToJpegDecoder {
     return true;
   }
 
-  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& jpeg_data) {
+  // Writes the JPEG bytes to the output buffer, using `pool` (if not null) to
+  // Huffman code the scans in parallel where possible.
+  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& jpeg_data,
+                               ThreadPool* pool) {
     // Copy JPEG bytestream if desired.
     uint8_t* tmp_next_out = next_out_;
     size_t tmp_avail_size = avail_size_;
@@ -129,7 +133,7 @@ class JxlToJpegDecoder {
       tmp_avail_size -= to_write;
       return to_write;
     };
-    Status write_result = jpeg::WriteJpeg(jpeg_data, write);
+    Status write_result = jpeg::WriteJpeg(jpeg_data, write, pool);
     if (!write_result) {
       if (tmp_avail_size == 0) {
         return JXL_DEC_JPEG_NEED_MORE_OUTPUT;
@@ -208,7 +212,8 @@ class JxlToJpegDecoder {
     return JXL_DEC_ERROR;
   }
 
-  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& /* jpeg_data */) {
+  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& /* jpeg_data */,
+                               ThreadPool* /* pool */) {
     return JXL_DEC_SUCCESS;
   }
 };
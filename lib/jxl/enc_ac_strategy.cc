@@ -33,6 +33,7 @@
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/enc_transforms-inl.h"
 #include "lib/jxl/simd_util.h"
+#include "lib/jxl/trace.h"
 
 // Some of the floating point constants in this file and in other
 // files in the libjxl project have been obtained using the
@@ -847,6 +848,9 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
   static const float k8x8mul2 = 1.0;
   static const float k8x8base = 1.4;
   const float mul8x8 = k8x8mul2 + k8x8mul1 / (butteraugli_target + k8x8base);
+  // Blocks for which a transform smaller than 8x8 was the best; larger
+  // transforms rarely win over areas with many of them.
+  uint8_t detailed[64] = {};
   for (size_t iy = 0; iy < rect.ysize(); iy++) {
     for (size_t ix = 0; ix < rect.xsize(); ix++) {
       float entropy = 0.0;
@@ -857,8 +861,33 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
           scratch_space, quantized, &entropy, best_of_8x8s));
       JXL_RETURN_IF_ERROR(ac_strategy->Set(bx + ix, by + iy, best_of_8x8s));
       entropy_estimate[iy * 8 + ix] = entropy * mul8x8;
+      detailed[iy * 8 + ix] = best_of_8x8s != AcStrategyType::DCT;
     }
   }
+  // With ac_strategy_pruning, squares where more than the allowed fraction
+  // of the blocks are detailed are not tried as larger transforms, and 64x64
+  // squares only when a 32x16 or larger transform was chosen within them.
+  const bool prune = cparams.ac_strategy_pruning > 0;
+  const float max_detailed_fraction = 1.0f - cparams.ac_strategy_pruning;
+  const auto skip_square = [&](size_t cx, size_t cy, size_t blocks) {
+    size_t num_detailed = 0;
+    for (size_t iy = 0; iy < blocks; ++iy) {
+      for (size_t ix = 0; ix < blocks; ++ix) {
+        num_detailed += detailed[(cy + iy) * 8 + cx + ix];
+      }
+    }
+    return num_detailed > max_detailed_fraction * blocks * blocks;
+  };
+  const auto has_32x16_or_larger = [&]() {
+    for (size_t iy = 0; iy < rect.ysize(); ++iy) {
+      AcStrategyRow row = ac_strategy->ConstRow(by + iy);
+      for (size_t ix = 0; ix < rect.xsize(); ++ix) {
+        AcStrategy acs = row[bx + ix];
+        if (acs.covered_blocks_x() * acs.covered_blocks_y() >= 8) return true;
+      }
+    }
+    return false;
+  };
   // Merge when a larger transform is better than the previously
   // searched best combination of 8x8 transforms.
   struct MergeTry {
@@ -931,7 +960,8 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
           if (cparams.decoding_speed_tier < 4 &&
               tx.type == AcStrategyType::DCT32X64) {
             // We handle both DCT8X16 and DCT16X8 at the same time.
-            if ((cy | cx) % 8 == 0) {
+            if ((cy | cx) % 8 == 0 && !skip_square(cx, cy, 8) &&
+                (!prune || has_32x16_or_larger())) {
               JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
                   8, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
                   tx.entropy_mul, entropy_mul64X64, entropy_estimate, block,
@@ -955,7 +985,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
         if (cy + 3 < rect.ysize() && cx + 3 < rect.xsize()) {
           if (tx.type == AcStrategyType::DCT16X32) {
             // We handle both DCT8X16 and DCT16X8 at the same time.
-            if ((cy | cx) % 4 == 0) {
+            if ((cy | cx) % 4 == 0 && !skip_square(cx, cy, 4)) {
               JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
                   4, enable_32x32, bx, by, cx, cy, config, cmap_factors,
                   ac_strategy, tx.entropy_mul, entropy_mul32X32,
@@ -1017,7 +1047,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
   // 16X8, 8X16 and 16X16s between the non-2-aligned blocks.
   for (size_t cy = 0; cy + 1 < rect.ysize(); ++cy) {
     for (size_t cx = 0; cx + 1 < rect.xsize(); ++cx) {
-      if ((cy | cx) % 2 != 0) {
+      if ((cy | cx) % 2 != 0 && !skip_square(cx, cy, 2)) {
         JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
             2, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
             entropy_mul16X8, entropy_mul16X16, entropy_estimate, block,
@@ -1032,6 +1062,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
       if ((cy | cx) % 4 == 0) {
         continue;  // Already tried with loop above (DCT16X32 case).
       }
+      if (skip_square(cx, cy, 4)) continue;
       JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
           4, enable_32x32, bx, by, cx, cy, config, cmap_factors, ac_strategy,
           entropy_mul16X32, entropy_mul32X32, entropy_estimate, block,
@@ -1123,6 +1154,7 @@ Status AcStrategyHeuristics::ProcessRect(const Rect& rect,
                                          const ColorCorrelationMap& cmap,
                                          AcStrategyImage* ac_strategy,
                                          size_t thread) {
+  JXL_TRACE_SCOPE(kAcStrategy);
   // In Falcon mode, use DCT8 everywhere and uniform quantization.
   if (cparams.speed_tier >= SpeedTier::kCheetah) {
     ac_strategy->FillDCT8(rect);
@@ -47,6 +47,7 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/quant_weights.h"
+#include "lib/jxl/trace.h"
 
 // Set JXL_DEBUG_ADAPTIVE_QUANTIZATION to 1 to enable debugging.
 #ifndef JXL_DEBUG_ADAPTIVE_QUANTIZATION
@@ -856,9 +857,7 @@ StatusOr<ImageBundle> RoundtripImage(const FrameHeader& frame_header,
   dec_state->shared = &enc_state->shared;
   JXL_ENSURE(opsin.ysize() % kBlockDim == 0);
 
-  const size_t xsize_groups = DivCeil(opsin.xsize(), kGroupDim);
-  const size_t ysize_groups = DivCeil(opsin.ysize(), kGroupDim);
-  const size_t num_groups = xsize_groups * ysize_groups;
+  const size_t num_groups = enc_state->shared.frame_dim.num_groups;
 
   size_t num_special_frames = enc_state->special_frames.size();
   size_t num_passes = enc_state->progressive_splitter.GetNumPasses();
@@ -995,9 +994,19 @@ Status FindBestQuantization(const FrameHeader& frame_header,
     }
     JXL_RETURN_IF_ERROR(quantizer.SetQuantField(initial_quant_dc, quant_field,
                                                 &raw_quant_field));
+    // The distance map of the last quant field does not affect the result, it
+    // is only computed for the debug output.
+    if ((i == iters || cparams.PastDeadline()) &&
+        !JXL_DEBUG_ADAPTIVE_QUANTIZATION) {
+      break;
+    }
     JXL_ASSIGN_OR_RETURN(
         ImageBundle dec_linear,
         RoundtripImage(frame_header, opsin, enc_state, cms, pool));
+    // The last distance map that adjusts the quant field is always computed
+    // with the full metric.
+    comparator.SetApproximate(cparams.approximate_butteraugli &&
+                              i + 1 < iters);
     float score;
     ImageF diffmap;
     JXL_RETURN_IF_ERROR(comparator.CompareWith(dec_linear, &diffmap, &score));
@@ -1065,10 +1074,12 @@ Status FindBestQuantization(const FrameHeader& frame_header,
       }
     }
     if (cur_pow == 0.0) {
+      bool changed = false;
       for (size_t y = 0; y < quant_field.ysize(); ++y) {
         const float* const JXL_RESTRICT row_dist = tile_distmap.Row(y);
         float* const JXL_RESTRICT row_q = quant_field.Row(y);
         for (size_t x = 0; x < quant_field.xsize(); ++x) {
+          const float prev = row_q[x];
           const float diff = row_dist[x] / original_butteraugli;
           if (diff > 1.0f) {
             float old = row_q[x];
@@ -1083,8 +1094,16 @@ Status FindBestQuantization(const FrameHeader& frame_header,
           }
           if (row_q[x] > qf_higher) row_q[x] = qf_higher;
           if (row_q[x] < qf_lower) row_q[x] = qf_lower;
+          changed |= row_q[x] != prev;
         }
       }
+      // Once the initial clamping round is over, an iteration without
+      // changes would repeat with the same quant field, so all the tiles
+      // converged.
+      if (!changed && i >= kOriginalComparisonRound &&
+          !JXL_DEBUG_ADAPTIVE_QUANTIZATION) {
+        break;
+      }
     } else {
       for (size_t y = 0; y < quant_field.ysize(); ++y) {
         const float* const JXL_RESTRICT row_dist = tile_distmap.Row(y);
@@ -1137,6 +1156,7 @@ Status FindBestQuantizationMaxError(const FrameHeader& frame_header,
                                 1.0f / enc_state->cparams.max_error[2]};
 
   for (int i = 0; i < kMaxButteraugliIters + 1; ++i) {
+    if (i > 0 && cparams.PastDeadline()) break;
     JXL_RETURN_IF_ERROR(quantizer.SetQuantField(initial_quant_dc, quant_field,
                                                 &raw_quant_field));
     if (JXL_DEBUG_ADAPTIVE_QUANTIZATION && aux_out) {
@@ -1194,6 +1214,80 @@ Status FindBestQuantizationMaxError(const FrameHeader& frame_header,
   return true;
 }
 
+constexpr int kMaxTargetScoreIters = 6;
+
+// Scales the whole quant field, and the DC quantization with it, to the
+// coarsest scale at which the butteraugli distance of the roundtrip is at most
+// cparams.target_butteraugli_score. Every probe only quantizes and decodes
+// again; the XYB image, the AC strategy and the shape of the quant field are
+// those found for the frame distance.
+Status FindQuantScaleForTargetScore(const FrameHeader& frame_header,
+                                    const Image3F& linear,
+                                    const Image3F& opsin, ImageF& quant_field,
+                                    PassesEncoderState* enc_state,
+                                    const JxlCmsInterface& cms,
+                                    ThreadPool* pool, AuxOut* aux_out) {
+  const CompressParams& cparams = enc_state->cparams;
+  Quantizer& quantizer = enc_state->shared.quantizer;
+  ImageI& raw_quant_field = enc_state->shared.raw_quant_field;
+  JxlMemoryManager* memory_manager = enc_state->memory_manager();
+
+  const float target = cparams.target_butteraugli_score;
+  const float initial_quant_dc = InitialQuantDC(cparams.butteraugli_distance);
+  ButteraugliParams params;
+  params.intensity_target = 80.f;
+  JxlButteraugliComparator comparator(params, cms, pool);
+  JXL_RETURN_IF_ERROR(comparator.SetLinearReferenceImage(linear));
+
+  JXL_ASSIGN_OR_RETURN(
+      ImageF scaled_field,
+      ImageF::Create(memory_manager, quant_field.xsize(), quant_field.ysize()));
+  const auto set_scale = [&](const float scale) -> Status {
+    for (size_t y = 0; y < quant_field.ysize(); ++y) {
+      const float* const JXL_RESTRICT row_in = quant_field.ConstRow(y);
+      float* const JXL_RESTRICT row_out = scaled_field.Row(y);
+      for (size_t x = 0; x < quant_field.xsize(); ++x) {
+        row_out[x] = row_in[x] * scale;
+      }
+    }
+    return quantizer.SetQuantField(std::min(initial_quant_dc * scale, 50.f),
+                                   scaled_field, &raw_quant_field);
+  };
+
+  // Larger scales quantize more finely, which lowers the distance. Keep the
+  // smallest scale known to meet the target and the largest known to miss it.
+  float scale = 1.0f;
+  float good_scale = 0.0f;
+  float bad_scale = 0.0f;
+  for (int i = 0; i < kMaxTargetScoreIters; ++i) {
+    if (i > 0 && cparams.PastDeadline()) break;
+    JXL_RETURN_IF_ERROR(set_scale(scale));
+    JXL_ASSIGN_OR_RETURN(
+        ImageBundle dec_linear,
+        RoundtripImage(frame_header, opsin, enc_state, cms, pool));
+    float score;
+    JXL_RETURN_IF_ERROR(comparator.CompareWith(dec_linear, nullptr, &score));
+    if (aux_out != nullptr) ++aux_out->num_butteraugli_iters;
+    if (score <= target) {
+      if (good_scale == 0.0f || scale < good_scale) good_scale = scale;
+    } else {
+      bad_scale = std::max(bad_scale, scale);
+    }
+    if (good_scale != 0.0f && bad_scale != 0.0f) {
+      if (good_scale < bad_scale * 1.02f) break;
+      scale = std::sqrt(good_scale * bad_scale);
+    } else {
+      // Until the target is bracketed, assume that the distance is inversely
+      // proportional to the scale.
+      scale *= Clamp1(score / target, 0.25f, 4.0f);
+    }
+  }
+  if (good_scale == 0.0f) good_scale = bad_scale;
+  ScaleImage(good_scale, &quant_field);
+  return quantizer.SetQuantField(std::min(initial_quant_dc * good_scale, 50.f),
+                                 quant_field, &raw_quant_field);
+}
+
 }  // namespace
 
 Status AdjustQuantField(const AcStrategyImage& ac_strategy, const Rect& rect,
@@ -1266,6 +1360,7 @@ StatusOr<ImageF> InitialQuantField(const float butteraugli_target,
                                    const Image3F& opsin, const Rect& rect,
                                    ThreadPool* pool, float rescale,
                                    ImageF* mask, ImageF* mask1x1) {
+  JXL_TRACE_SCOPE(kAdaptiveQuantization);
   const float quant_ac = kAcQuant / butteraugli_target;
   return HWY_DYNAMIC_DISPATCH(AdaptiveQuantizationMap)(
       butteraugli_target, opsin, rect, quant_ac * rescale, pool, mask, mask1x1);
@@ -1276,6 +1371,7 @@ Status FindBestQuantizer(const FrameHeader& frame_header, const Image3F* linear,
                          PassesEncoderState* enc_state,
                          const JxlCmsInterface& cms, ThreadPool* pool,
                          AuxOut* aux_out, double rescale) {
+  JXL_TRACE_SCOPE(kAdaptiveQuantization);
   const CompressParams& cparams = enc_state->cparams;
   if (cparams.max_error_mode) {
     JXL_RETURN_IF_ERROR(FindBestQuantizationMaxError(
@@ -1286,6 +1382,13 @@ Status FindBestQuantizer(const FrameHeader& frame_header, const Image3F* linear,
                                              quant_field, enc_state, cms, pool,
                                              aux_out));
   }
+  if (linear && cparams.target_butteraugli_score > 0 &&
+      !cparams.max_error_mode) {
+    JXL_RETURN_IF_ERROR(FindQuantScaleForTargetScore(frame_header, *linear,
+                                                     opsin, quant_field,
+                                                     enc_state, cms, pool,
+                                                     aux_out));
+  }
   return true;
 }
 
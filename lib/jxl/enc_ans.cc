@@ -29,6 +29,7 @@
 #include "lib/jxl/enc_huffman.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/fields.h"
+#include "lib/jxl/trace.h"
 
 namespace jxl {
 
@@ -1729,8 +1730,13 @@ size_t WriteTokens(const std::vector<Token>& tokens,
                    const EntropyEncodingData& codes,
                    const std::vector<uint8_t>& context_map,
                    size_t context_offset, BitWriter* writer) {
+  JXL_TRACE_SCOPE(kWriteTokens);
   size_t num_extra_bits = 0;
   if (codes.use_prefix_code) {
+    // Codes of consecutive tokens are gathered in a 64-bit accumulator and
+    // passed to the BitWriter up to kMaxBitsPerCall bits at a time.
+    uint64_t allbits = 0;
+    size_t numallbits = 0;
     for (const auto& token : tokens) {
       uint32_t tok, nbits, bits;
       size_t histo = context_map[context_offset + token.context];
@@ -1745,9 +1751,16 @@ size_t WriteTokens(const std::vector<Token>& tokens,
       uint64_t data = codes.encoding_info[histo][tok].bits;
       data |= static_cast<uint64_t>(bits)
               << codes.encoding_info[histo][tok].depth;
-      writer->Write(codes.encoding_info[histo][tok].depth + nbits, data);
+      const size_t data_nbits = codes.encoding_info[histo][tok].depth + nbits;
+      if (numallbits + data_nbits > BitWriter::kMaxBitsPerCall) {
+        writer->Write(numallbits, allbits);
+        numallbits = allbits = 0;
+      }
+      allbits |= data << numallbits;
+      numallbits += data_nbits;
       num_extra_bits += nbits;
     }
+    writer->Write(numallbits, allbits);
     return num_extra_bits;
   }
   std::vector<uint64_t> out;
@@ -1840,6 +1853,11 @@ HistogramParams HistogramParams::ForModular(
     const std::vector<uint8_t>& extra_dc_precision, bool streaming_mode) {
   HistogramParams params;
   params.streaming_mode = streaming_mode;
+  // Prefix codes are cheaper to build and write than ANS, which matters more
+  // than their density at the fastest effort.
+  params.force_huffman = cparams.speed_tier >= SpeedTier::kLightning ||
+                         cparams.decoding_speed_tier >= 4 ||
+                         cparams.force_prefix_codes;
   if (cparams.speed_tier > SpeedTier::kKitten) {
     params.clustering = HistogramParams::ClusteringType::kFast;
     params.ans_histogram_strategy =
@@ -82,6 +82,9 @@ void AuxOut::Assimilate(const AuxOut& victim) {
   num_dct32x64_blocks += victim.num_dct32x64_blocks;
   num_dct64_blocks += victim.num_dct64_blocks;
   num_butteraugli_iters += victim.num_butteraugli_iters;
+  num_wp_tree_nodes += victim.num_wp_tree_nodes;
+  num_ans_histograms += victim.num_ans_histograms;
+  num_loop_filtered_frames += victim.num_loop_filtered_frames;
 }
 
 void AuxOut::Print(size_t num_inputs) const {
@@ -104,6 +104,15 @@ struct AuxOut {
   size_t num_dct64_blocks = 0;
 
   int num_butteraugli_iters = 0;
+
+  // Features that keep the decoder off its fast paths.
+  // Global MA tree nodes that split on or predict with the weighted predictor.
+  size_t num_wp_tree_nodes = 0;
+  // Clustered histograms of the AC and global modular tokens that are coded
+  // with ANS rather than prefix codes.
+  size_t num_ans_histograms = 0;
+  // Frames that enable Gaborish or the edge-preserving filter.
+  size_t num_loop_filtered_frames = 0;
 };
 }  // namespace jxl
 
@@ -9,7 +9,6 @@
 
 #include <cstring>  // memcpy
 
-#include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_aux_out.h"
@@ -167,38 +166,4 @@ Status BitWriter::AppendByteAligned(
   return true;
 }
 
-// Example: let's assume that 3 bits (Rs below) have been written already:
-// BYTE+0       BYTE+1       BYTE+2
-// 0000 0RRR    ???? ????    ???? ????
-//
-// Now, we could write up to 5 bits by just shifting them left by 3 bits and
-// OR'ing to BYTE-0.
-//
-// For n > 5 bits, we write the lowest 5 bits as above, then write the next
-// lowest bits into BYTE+1 starting from its lower bits and so on.
-void BitWriter::Write(size_t n_bits, uint64_t bits) {
-  JXL_DASSERT((bits >> n_bits) == 0);
-  JXL_DASSERT(n_bits <= kMaxBitsPerCall);
-  size_t bytes_written = bits_written_ / kBitsPerByte;
-  uint8_t* p = &storage_[bytes_written];
-  const size_t bits_in_first_byte = bits_written_ % kBitsPerByte;
-  bits <<= bits_in_first_byte;
-#if JXL_BYTE_ORDER_LITTLE
-  uint64_t v = *p;
-  // Last (partial) or next byte to write must be zero-initialized!
-  // PaddedBytes initializes the first, and Write/Append maintain this.
-  JXL_DASSERT(v >> bits_in_first_byte == 0);
-  v |= bits;
-  memcpy(p, &v, sizeof(v));  // Write bytes: possibly more than n_bits/8
-#else
-  *p++ |= static_cast<uint8_t>(bits & 0xFF);
-  for (size_t bits_left_to_write = n_bits + bits_in_first_byte;
-       bits_left_to_write >= 9; bits_left_to_write -= 8) {
-    bits >>= 8;
-    *p++ = static_cast<uint8_t>(bits & 0xFF);
-  }
-  *p = 0;
-#endif
-  bits_written_ += n_bits;
-}
 }  // namespace jxl
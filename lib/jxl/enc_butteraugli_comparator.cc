@@ -5,14 +5,18 @@
 
 #include "lib/jxl/enc_butteraugli_comparator.h"
 
+#include <vector>
+
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_image_bundle.h"
 
 namespace jxl {
 
 JxlButteraugliComparator::JxlButteraugliComparator(
-    const ButteraugliParams& params, const JxlCmsInterface& cms)
-    : params_(params), cms_(cms) {}
+    const ButteraugliParams& params, const JxlCmsInterface& cms,
+    ThreadPool* pool)
+    : params_(params), cms_(cms), pool_(pool) {}
 
 Status JxlButteraugliComparator::SetReferenceImage(const ImageBundle& ref) {
   const ImageBundle* ref_linear_srgb;
@@ -23,8 +27,9 @@ Status JxlButteraugliComparator::SetReferenceImage(const ImageBundle& ref) {
                          /*pool=*/nullptr, &store, &ref_linear_srgb)) {
     return false;
   }
-  JXL_ASSIGN_OR_RETURN(comparator_, ButteraugliComparator::Make(
-                                        ref_linear_srgb->color(), params_));
+  JXL_ASSIGN_OR_RETURN(comparator_,
+                       ButteraugliComparator::Make(ref_linear_srgb->color(),
+                                                   params_, pool_));
   xsize_ = ref.xsize();
   ysize_ = ref.ysize();
   return true;
@@ -33,7 +38,7 @@ Status JxlButteraugliComparator::SetReferenceImage(const ImageBundle& ref) {
 Status JxlButteraugliComparator::SetLinearReferenceImage(
     const Image3F& linear) {
   JXL_ASSIGN_OR_RETURN(comparator_,
-                       ButteraugliComparator::Make(linear, params_));
+                       ButteraugliComparator::Make(linear, params_, pool_));
   xsize_ = linear.xsize();
   ysize_ = linear.ysize();
   return true;
@@ -41,6 +46,30 @@ Status JxlButteraugliComparator::SetLinearReferenceImage(
 
 Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
                                              ImageF* diffmap, float* score) {
+  return Compare(actual, diffmap, score, pool_);
+}
+
+Status JxlButteraugliComparator::CompareWithAll(
+    const std::vector<const ImageBundle*>& actual, ThreadPool* pool,
+    std::vector<float>* scores, std::vector<ImageF>* diffmaps) const {
+  scores->assign(actual.size(), 0.0f);
+  if (diffmaps != nullptr) {
+    diffmaps->clear();
+    diffmaps->resize(actual.size());
+  }
+  // The candidates already run in parallel, so the comparisons themselves
+  // must not use a pool.
+  const auto compare = [&](const uint32_t i, size_t /*thread*/) -> Status {
+    return Compare(*actual[i], diffmaps ? &(*diffmaps)[i] : nullptr,
+                   &(*scores)[i], /*pool=*/nullptr);
+  };
+  return RunOnPool(pool, 0, actual.size(), ThreadPool::NoInit, compare,
+                   "ButteraugliCompare");
+}
+
+Status JxlButteraugliComparator::Compare(const ImageBundle& actual,
+                                         ImageF* diffmap, float* score,
+                                         ThreadPool* pool) const {
   if (!comparator_) {
     return JXL_FAILURE("Must set reference image first");
   }
@@ -60,8 +89,13 @@ Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
 
   JXL_ASSIGN_OR_RETURN(ImageF temp_diffmap,
                        ImageF::Create(memory_manager, xsize_, ysize_));
-  JXL_RETURN_IF_ERROR(
-      comparator_->Diffmap(actual_linear_srgb->color(), temp_diffmap));
+  if (approximate_) {
+    JXL_RETURN_IF_ERROR(comparator_->DiffmapApproximate(
+        actual_linear_srgb->color(), temp_diffmap, pool));
+  } else {
+    JXL_RETURN_IF_ERROR(
+        comparator_->Diffmap(actual_linear_srgb->color(), temp_diffmap, pool));
+  }
 
   if (score != nullptr) {
     *score = ButteraugliScoreFromDiffmap(temp_diffmap, &params_);
@@ -10,7 +10,9 @@
 #include <stddef.h>
 
 #include <memory>
+#include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/enc_comparator.h"
@@ -21,8 +23,11 @@ namespace jxl {
 
 class JxlButteraugliComparator : public Comparator {
  public:
+  // If `pool` is not null, SetReferenceImage and CompareWith split their work
+  // over it; the result is the same as without a pool.
   explicit JxlButteraugliComparator(const ButteraugliParams& params,
-                                    const JxlCmsInterface& cms);
+                                    const JxlCmsInterface& cms,
+                                    ThreadPool* pool = nullptr);
 
   Status SetReferenceImage(const ImageBundle& ref) override;
   Status SetLinearReferenceImage(const Image3F& linear);
@@ -30,15 +35,32 @@ class JxlButteraugliComparator : public Comparator {
   Status CompareWith(const ImageBundle& actual, ImageF* diffmap,
                      float* score) override;
 
+  // Compares each of `actual` with the reference image, in parallel on
+  // `pool`. The reference image is only decomposed once, when it is set, so
+  // this is cheaper than a ComputeScore per candidate. Alpha is ignored.
+  // `diffmaps` may be nullptr.
+  Status CompareWithAll(const std::vector<const ImageBundle*>& actual,
+                        ThreadPool* pool, std::vector<float>* scores,
+                        std::vector<ImageF>* diffmaps = nullptr) const;
+
   float GoodQualityScore() const override;
   float BadQualityScore() const override;
 
+  // If true, the following comparisons use
+  // ButteraugliComparator::DiffmapApproximate.
+  void SetApproximate(bool approximate) { approximate_ = approximate; }
+
  private:
+  Status Compare(const ImageBundle& actual, ImageF* diffmap, float* score,
+                 ThreadPool* pool) const;
+
   ButteraugliParams params_;
   JxlCmsInterface cms_;
+  ThreadPool* pool_;
   std::unique_ptr<ButteraugliComparator> comparator_;
   size_t xsize_ = 0;
   size_t ysize_ = 0;
+  bool approximate_ = false;
 };
 
 }  // namespace jxl
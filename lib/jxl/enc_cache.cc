@@ -66,6 +66,12 @@ Status InitializePassesEncoder(const FrameHeader& frame_header,
   enc_state->x_qm_multiplier = std::pow(1.25f, frame_header.x_qm_scale - 2.0f);
   enc_state->b_qm_multiplier = std::pow(1.25f, frame_header.b_qm_scale - 2.0f);
 
+  // Coefficients taken over from a previous frame only fit the same number of
+  // groups.
+  if (!enc_state->coeffs.empty() &&
+      enc_state->coeffs[0]->ysize() != shared.frame_dim.num_groups) {
+    enc_state->coeffs.clear();
+  }
   if (enc_state->coeffs.size() < frame_header.passes.num_passes) {
     enc_state->coeffs.reserve(frame_header.passes.num_passes);
     for (size_t i = enc_state->coeffs.size();
@@ -113,6 +119,9 @@ Status InitializePassesEncoder(const FrameHeader& frame_header,
     cparams.ec_resampling = 1;
     // The DC frame will have alpha=0. Don't erase its contents.
     cparams.keep_invisible = Override::kOn;
+    // The MA tree of the main frame does not apply to the DC frame.
+    cparams.custom_fixed_tree.clear();
+    cparams.learned_tree = nullptr;
     JXL_ENSURE(cparams.progressive_dc > 0);
     cparams.progressive_dc--;
     // Use kVarDCT in max_error_mode for intermediate progressive DC,
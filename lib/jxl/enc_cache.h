@@ -12,6 +12,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
@@ -74,6 +75,23 @@ struct PassesEncoderState {
   ImageF initial_quant_masking1x1;
 
   JxlMemoryManager* memory_manager() const { return shared.memory_manager; }
+
+  // Takes over the buffers of `other`, a state that is no longer used, so that
+  // they can be reused if the next frame has the same dimensions. The token
+  // vectors are emptied but keep their capacity.
+  void ReuseStorage(PassesEncoderState* other) {
+    shared.ac_strategy = std::move(other->shared.ac_strategy);
+    shared.raw_quant_field = std::move(other->shared.raw_quant_field);
+    shared.epf_sharpness = std::move(other->shared.epf_sharpness);
+    shared.quant_dc = std::move(other->shared.quant_dc);
+    shared.dc_storage = std::move(other->shared.dc_storage);
+    coeffs = std::move(other->coeffs);
+    passes.resize(other->passes.size());
+    for (size_t i = 0; i < passes.size(); ++i) {
+      passes[i].ac_tokens = std::move(other->passes[i].ac_tokens);
+      for (std::vector<Token>& tokens : passes[i].ac_tokens) tokens.clear();
+    }
+  }
 };
 
 // Initialize per-frame information.
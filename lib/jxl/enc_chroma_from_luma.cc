@@ -44,13 +44,12 @@ static HWY_FULL(float) df;
 struct CFLFunction {
   static constexpr float kCoeff = 1.f / 3;
   static constexpr float kThres = 100.0f;
-  static constexpr float kInvColorFactor = 1.0f / kDefaultColorFactor;
-  CFLFunction(const float* values_m, const float* values_s, size_t num,
-              float base, float distance_mul)
-      : values_m(values_m),
-        values_s(values_s),
+  // The color residual of coefficient i is values_a[i] * x + values_b[i].
+  CFLFunction(const float* values_a, const float* values_b, size_t num,
+              float distance_mul)
+      : values_a(values_a),
+        values_b(values_b),
         num(num),
-        base(base),
         distance_mul(distance_mul) {
     JXL_DASSERT(num % Lanes(df) == 0);
   }
@@ -62,12 +61,10 @@ struct CFLFunction {
     float first_derivative_peps = 2 * distance_mul * num * (x + eps);
     float first_derivative_meps = 2 * distance_mul * num * (x - eps);
 
-    const auto inv_color_factor = Set(df, kInvColorFactor);
     const auto thres = Set(df, kThres);
     const auto coeffx2 = Set(df, kCoeff * 2.0f);
     const auto one = Set(df, 1.0f);
     const auto zero = Set(df, 0.0f);
-    const auto base_v = Set(df, base);
     const auto x_v = Set(df, x);
     const auto xpe_v = Set(df, x + eps);
     const auto xme_v = Set(df, x - eps);
@@ -77,9 +74,8 @@ struct CFLFunction {
 
     for (size_t i = 0; i < num; i += Lanes(df)) {
       // color residual = ax + b
-      const auto a = Mul(inv_color_factor, Load(df, values_m + i));
-      const auto b =
-          Sub(Mul(base_v, Load(df, values_m + i)), Load(df, values_s + i));
+      const auto a = Load(df, values_a + i);
+      const auto b = Load(df, values_b + i);
       const auto v = MulAdd(a, x_v, b);
       const auto vpe = MulAdd(a, xpe_v, b);
       const auto vme = MulAdd(a, xme_v, b);
@@ -105,32 +101,41 @@ struct CFLFunction {
     return first_derivative + GetLane(SumOfLanes(df, fd_v));
   }
 
-  const float* JXL_RESTRICT values_m;
-  const float* JXL_RESTRICT values_s;
+  const float* JXL_RESTRICT values_a;
+  const float* JXL_RESTRICT values_b;
   size_t num;
-  float base;
   float distance_mul;
 };
 
 // Chroma-from-luma search, values_m will have luma -- and values_s chroma.
-int32_t FindBestMultiplier(const float* values_m, const float* values_s,
-                           size_t num, float base, float distance_mul,
-                           bool fast) {
+// Both are overwritten.
+int32_t FindBestMultiplier(float* values_m, float* values_s, size_t num,
+                           float base, float distance_mul, bool fast) {
   if (num == 0) {
     return 0;
   }
+  // The color residual is ax + b, where a and b do not depend on x: compute
+  // them once instead of in every iteration of the search.
+  {
+    static constexpr float kInvColorFactor = 1.0f / kDefaultColorFactor;
+    const auto inv_color_factor = Set(df, kInvColorFactor);
+    const auto base_v = Set(df, base);
+    for (size_t i = 0; i < num; i += Lanes(df)) {
+      const auto m = Load(df, values_m + i);
+      const auto s = Load(df, values_s + i);
+      Store(Mul(inv_color_factor, m), df, values_m + i);
+      Store(Sub(Mul(base_v, m), s), df, values_s + i);
+    }
+  }
+  const float* values_a = values_m;
+  const float* values_b = values_s;
   float x;
   if (fast) {
-    static constexpr float kInvColorFactor = 1.0f / kDefaultColorFactor;
     auto ca = Zero(df);
     auto cb = Zero(df);
-    const auto inv_color_factor = Set(df, kInvColorFactor);
-    const auto base_v = Set(df, base);
     for (size_t i = 0; i < num; i += Lanes(df)) {
-      // color residual = ax + b
-      const auto a = Mul(inv_color_factor, Load(df, values_m + i));
-      const auto b =
-          Sub(Mul(base_v, Load(df, values_m + i)), Load(df, values_s + i));
+      const auto a = Load(df, values_a + i);
+      const auto b = Load(df, values_b + i);
       ca = MulAdd(a, a, ca);
       cb = MulAdd(a, b, cb);
     }
@@ -140,7 +145,7 @@ int32_t FindBestMultiplier(const float* values_m, const float* values_s,
   } else {
     constexpr float eps = 100;
     constexpr float kClamp = 20.0f;
-    CFLFunction fn(values_m, values_s, num, base, distance_mul);
+    CFLFunction fn(values_a, values_b, num, distance_mul);
     x = 0;
     // Up to 20 Newton iterations, with approximate derivatives.
     // Derivatives are approximate due to the high amount of noise in the exact
@@ -14,6 +14,7 @@
 #include <tuple>
 
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/trace.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/enc_cluster.cc"
@@ -151,16 +152,31 @@ Status FastClusterHistograms(const std::vector<Histogram>& in,
   }
 
   constexpr float kMinDistanceForDistinct = 48.0f;
+  // Histograms that can still become a new cluster, in increasing order.
+  // Distances only decrease, so a histogram closer than
+  // kMinDistanceForDistinct to some cluster can never be picked again and is
+  // not compared against the later clusters. This keeps the search close to
+  // linear in the number of contexts when many of them are similar.
+  std::vector<uint32_t> candidates;
+  candidates.reserve(in.size());
+  for (size_t i = 0; i < in.size(); i++) {
+    if (dists[i] != 0.0f) candidates.push_back(i);
+  }
   while (out->size() < max_histograms) {
     (*histogram_symbols)[largest_idx] = out->size();
     out->push_back(in[largest_idx]);
     dists[largest_idx] = 0.0f;
     largest_idx = 0;
-    for (size_t i = 0; i < in.size(); i++) {
+    size_t num_candidates = 0;
+    for (uint32_t i : candidates) {
       if (dists[i] == 0.0f) continue;
       dists[i] = std::min(HistogramDistance(in[i], out->back()), dists[i]);
       if (dists[i] > dists[largest_idx]) largest_idx = i;
+      if (dists[i] >= kMinDistanceForDistinct) {
+        candidates[num_candidates++] = i;
+      }
     }
+    candidates.resize(num_candidates);
     if (dists[largest_idx] < kMinDistanceForDistinct) break;
   }
 
@@ -241,6 +257,7 @@ Status ClusterHistograms(const HistogramParams& params,
                          const std::vector<Histogram>& in,
                          size_t max_histograms, std::vector<Histogram>* out,
                          std::vector<uint32_t>* histogram_symbols) {
+  JXL_TRACE_SCOPE(kClusterHistograms);
   size_t prev_histograms = out->size();
   max_histograms = std::min(max_histograms, params.max_histograms);
   max_histograms = std::min(max_histograms, in.size());
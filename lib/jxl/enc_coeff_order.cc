@@ -28,9 +28,12 @@
 
 #include <cmath>
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/ac_strategy.h"
+#include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
@@ -78,7 +81,7 @@ Status ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
                          const FrameDimensions& frame_dim,
                          uint32_t& all_used_orders, uint32_t prev_used_acs,
                          uint32_t current_used_acs,
-                         uint32_t current_used_orders,
+                         uint32_t current_used_orders, ThreadPool* pool,
                          coeff_order_t* JXL_RESTRICT order) {
   JxlMemoryManager* memory_manager = ac_strategy.memory_manager();
   std::vector<int32_t> num_zeros(kCoeffOrderMaxSize);
@@ -108,16 +111,29 @@ Status ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
       s[1] = s1;
       return (bits >> 32) <= threshold;
     };
+    // The samples are drawn from one sequence in group order, so sampling
+    // counts on a single thread. Otherwise, every thread counts its groups
+    // separately and the counts are added up afterwards.
+    const bool sample_blocks = block_fraction < 1.0;
+    // Only the orders that may be customized are counted; in particular, the
+    // large transforms always use the natural order.
+    const size_t counted_size =
+        CoeffOrderOffset(FloorLog2Nonzero(current_used_orders) + 1, 0);
+    std::vector<std::vector<int32_t>> thread_num_zeros;
+    std::vector<uint32_t> thread_counted_orders;
+    const auto init = [&](size_t num_threads) -> Status {
+      thread_num_zeros.resize(num_threads);
+      for (auto& zeros : thread_num_zeros) zeros.assign(counted_size, 0);
+      thread_counted_orders.assign(num_threads, 0);
+      return true;
+    };
 
     // Count number of zero coefficients, separately for each DCT band.
     // TODO(veluca): precompute when doing DCT.
-    for (size_t group_index = 0; group_index < frame_dim.num_groups;
-         group_index++) {
-      const size_t gx = group_index % frame_dim.xsize_groups;
-      const size_t gy = group_index / frame_dim.xsize_groups;
-      const Rect rect(gx * kGroupDimInBlocks, gy * kGroupDimInBlocks,
-                      kGroupDimInBlocks, kGroupDimInBlocks,
-                      frame_dim.xsize_blocks, frame_dim.ysize_blocks);
+    const auto count_zeros = [&](const uint32_t group_index,
+                                 size_t thread) -> Status {
+      int32_t* JXL_RESTRICT zeros = thread_num_zeros[thread].data();
+      const Rect rect = frame_dim.BlockGroupRect(group_index);
       ConstACPtr rows[3];
       ACType type = acs.Type();
       for (size_t c = 0; c < 3; c++) {
@@ -131,47 +147,70 @@ Status ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
         for (size_t bx = 0; bx < rect.xsize(); ++bx) {
           AcStrategy acs = acs_row[bx];
           if (!acs.IsFirstBlock()) continue;
-          if (!use_sample()) continue;
           size_t size = kDCTBlockSize << acs.log2_covered_blocks();
+          const uint8_t ord = kStrategyOrder[acs.RawStrategy()];
+          if ((sample_blocks && !use_sample()) ||
+              !((1u << ord) & current_used_orders)) {
+            ac_offset += size;
+            continue;
+          }
+          thread_counted_orders[thread] |= 1u << ord;
           for (size_t c = 0; c < 3; ++c) {
-            const size_t order_offset =
-                CoeffOrderOffset(kStrategyOrder[acs.RawStrategy()], c);
+            const size_t order_offset = CoeffOrderOffset(ord, c);
             if (type == ACType::k16) {
               for (size_t k = 0; k < size; k++) {
                 bool is_zero = rows[c].ptr16[ac_offset + k] == 0;
-                num_zeros[order_offset + k] += is_zero ? 1 : 0;
+                zeros[order_offset + k] += is_zero ? 1 : 0;
               }
             } else {
               for (size_t k = 0; k < size; k++) {
                 bool is_zero = rows[c].ptr32[ac_offset + k] == 0;
-                num_zeros[order_offset + k] += is_zero ? 1 : 0;
-              }
-            }
-            // Ensure LLFs are first in the order.
-            size_t cx = acs.covered_blocks_x();
-            size_t cy = acs.covered_blocks_y();
-            CoefficientLayout(&cy, &cx);
-            for (size_t iy = 0; iy < cy; iy++) {
-              for (size_t ix = 0; ix < cx; ix++) {
-                num_zeros[order_offset + iy * kBlockDim * cx + ix] = -1;
+                zeros[order_offset + k] += is_zero ? 1 : 0;
               }
             }
           }
           ac_offset += size;
         }
       }
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(sample_blocks ? nullptr : pool, 0,
+                                  frame_dim.num_groups, init, count_zeros,
+                                  "CountZeroCoeffs"));
+    uint32_t counted_orders = 0;
+    for (size_t t = 0; t < thread_num_zeros.size(); ++t) {
+      const int32_t* JXL_RESTRICT zeros = thread_num_zeros[t].data();
+      for (size_t i = 0; i < counted_size; ++i) {
+        num_zeros[i] += zeros[i];
+      }
+      counted_orders |= thread_counted_orders[t];
+    }
+
+    // Ensure LLFs are first in the order.
+    for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
+      uint8_t ord = kStrategyOrder[o];
+      if (!((1u << ord) & counted_orders)) continue;
+      AcStrategy acs = AcStrategy::FromRawStrategy(o);
+      size_t cx = acs.covered_blocks_x();
+      size_t cy = acs.covered_blocks_y();
+      CoefficientLayout(&cy, &cx);
+      for (size_t c = 0; c < 3; ++c) {
+        const size_t order_offset = CoeffOrderOffset(ord, c);
+        for (size_t iy = 0; iy < cy; iy++) {
+          for (size_t ix = 0; ix < cx; ix++) {
+            num_zeros[order_offset + iy * kBlockDim * cx + ix] = -1;
+          }
+        }
+      }
     }
   }
   struct PosAndCount {
     uint32_t pos;
     uint32_t count;
   };
-  size_t mem_bytes = AcStrategy::kMaxCoeffArea * sizeof(PosAndCount);
-  JXL_ASSIGN_OR_RETURN(auto mem,
-                       AlignedMemory::Create(memory_manager, mem_bytes));
-
-  std::vector<coeff_order_t> natural_order_buffer;
 
+  // Each channel of each order to sort is a separate task.
+  std::vector<std::pair<uint8_t, uint8_t>> sorts;
   uint16_t computed = 0;
   for (uint8_t o = 0; o < AcStrategy::kNumValidStrategies; ++o) {
     uint8_t ord = kStrategyOrder[o];
@@ -187,8 +226,7 @@ Status ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
     if ((1 << ord) & prev_used_acs) continue;
     if ((1 << ord) & all_used_orders) continue;
 
-    if (natural_order_buffer.size() < sz) natural_order_buffer.resize(sz);
-    acs.ComputeNaturalCoeffOrder(natural_order_buffer.data());
+    const coeff_order_t* natural_order = NaturalCoeffOrder(ord);
 
     // Ensure natural coefficient order is not permuted if the order is
     // not transmitted.
@@ -196,42 +234,72 @@ Status ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
       for (size_t c = 0; c < 3; c++) {
         size_t offset = CoeffOrderOffset(ord, c);
         JXL_ENSURE(CoeffOrderOffset(ord, c + 1) - offset == sz);
-        memcpy(&order[offset], natural_order_buffer.data(),
-               sz * sizeof(*order));
+        memcpy(&order[offset], natural_order, sz * sizeof(*order));
       }
       continue;
     }
 
-    bool is_nondefault = false;
     for (uint8_t c = 0; c < 3; c++) {
-      // Apply zig-zag order.
-      PosAndCount* pos_and_val = mem.address<PosAndCount>();
-      size_t offset = CoeffOrderOffset(ord, c);
-      JXL_ENSURE(CoeffOrderOffset(ord, c + 1) - offset == sz);
-      float inv_sqrt_sz = 1.0f / std::sqrt(sz);
-      for (size_t i = 0; i < sz; ++i) {
-        size_t pos = natural_order_buffer[i];
-        pos_and_val[i].pos = pos;
-        // We don't care for the exact number -> quantize number of zeros,
-        // to get less permuted order.
-        pos_and_val[i].count = num_zeros[offset + pos] * inv_sqrt_sz + 0.1f;
-      }
+      JXL_ENSURE(CoeffOrderOffset(ord, c + 1) - CoeffOrderOffset(ord, c) ==
+                 sz);
+      sorts.emplace_back(ord, c);
+    }
+  }
 
-      // Stable-sort -> elements with same number of zeros will preserve their
-      // order.
-      auto comparator = [](const PosAndCount& a, const PosAndCount& b) -> bool {
-        return a.count < b.count;
-      };
-      std::stable_sort(pos_and_val, pos_and_val + sz, comparator);
-
-      // Grab indices.
-      for (size_t i = 0; i < sz; ++i) {
-        order[offset + i] = pos_and_val[i].pos;
-        is_nondefault |= natural_order_buffer[i] != pos_and_val[i].pos;
-      }
+  std::vector<AlignedMemory> thread_mem;
+  std::vector<uint8_t> is_nondefault(sorts.size());
+  const auto init_mem = [&](size_t num_threads) -> Status {
+    size_t mem_bytes = AcStrategy::kMaxCoeffArea * sizeof(PosAndCount);
+    thread_mem.resize(num_threads);
+    for (auto& mem : thread_mem) {
+      JXL_ASSIGN_OR_RETURN(mem,
+                           AlignedMemory::Create(memory_manager, mem_bytes));
     }
-    if (!is_nondefault) {
-      current_used_orders &= ~(1 << ord);
+    return true;
+  };
+  const auto sort_order = [&](const uint32_t task, size_t thread) -> Status {
+    const uint8_t ord = sorts[task].first;
+    const uint8_t c = sorts[task].second;
+    const coeff_order_t* natural_order = NaturalCoeffOrder(ord);
+    const size_t offset = CoeffOrderOffset(ord, c);
+    const size_t sz = CoeffOrderOffset(ord, c + 1) - offset;
+    // Apply zig-zag order.
+    PosAndCount* pos_and_val = thread_mem[thread].address<PosAndCount>();
+    float inv_sqrt_sz = 1.0f / std::sqrt(sz);
+    for (size_t i = 0; i < sz; ++i) {
+      size_t pos = natural_order[i];
+      pos_and_val[i].pos = pos;
+      // We don't care for the exact number -> quantize number of zeros,
+      // to get less permuted order.
+      pos_and_val[i].count = num_zeros[offset + pos] * inv_sqrt_sz + 0.1f;
+    }
+
+    // Stable-sort -> elements with same number of zeros will preserve their
+    // order.
+    auto comparator = [](const PosAndCount& a, const PosAndCount& b) -> bool {
+      return a.count < b.count;
+    };
+    std::stable_sort(pos_and_val, pos_and_val + sz, comparator);
+
+    // Grab indices.
+    bool nondefault = false;
+    for (size_t i = 0; i < sz; ++i) {
+      order[offset + i] = pos_and_val[i].pos;
+      nondefault |= natural_order[i] != pos_and_val[i].pos;
+    }
+    is_nondefault[task] = nondefault ? 1 : 0;
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(sorts.size()),
+                                init_mem, sort_order, "SortCoeffOrders"));
+
+  uint32_t nondefault_orders = 0;
+  for (size_t i = 0; i < sorts.size(); ++i) {
+    if (is_nondefault[i]) nondefault_orders |= 1u << sorts[i].first;
+  }
+  for (const auto& sort : sorts) {
+    if (!((1u << sort.first) & nondefault_orders)) {
+      current_used_orders &= ~(1u << sort.first);
     }
   }
   all_used_orders |= current_used_orders;
@@ -296,6 +364,7 @@ Status EncodeCoeffOrder(const coeff_order_t* JXL_RESTRICT order, AcStrategy acs,
 Status EncodeCoeffOrders(uint16_t used_orders,
                          const coeff_order_t* JXL_RESTRICT order,
                          BitWriter* writer, LayerType layer,
+                         const HistogramParams& histogram_params,
                          AuxOut* JXL_RESTRICT aux_out) {
   JxlMemoryManager* memory_manager = writer->memory_manager();
   size_t mem_bytes = AcStrategy::kMaxCoeffArea * sizeof(coeff_order_t);
@@ -326,7 +395,7 @@ Status EncodeCoeffOrders(uint16_t used_orders,
     EntropyEncodingData codes;
     JXL_ASSIGN_OR_RETURN(
         size_t cost,
-        BuildAndEncodeHistograms(memory_manager, HistogramParams(),
+        BuildAndEncodeHistograms(memory_manager, histogram_params,
                                  kPermutationContexts, tokens, &codes,
                                  &context_map, writer, layer, aux_out));
     (void)cost;
@@ -11,11 +11,13 @@
 #include <utility>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/coeff_order_fwd.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dct_util.h"
+#include "lib/jxl/enc_ans_params.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/frame_dimensions.h"
 
@@ -38,12 +40,13 @@ Status ComputeCoeffOrder(SpeedTier speed, const ACImage& acs,
                          const FrameDimensions& frame_dim,
                          uint32_t& all_used_orders, uint32_t prev_used_acs,
                          uint32_t current_used_acs,
-                         uint32_t current_used_orders,
+                         uint32_t current_used_orders, ThreadPool* pool,
                          coeff_order_t* JXL_RESTRICT order);
 
 Status EncodeCoeffOrders(uint16_t used_orders,
                          const coeff_order_t* JXL_RESTRICT order,
                          BitWriter* writer, LayerType layer,
+                         const HistogramParams& histogram_params,
                          AuxOut* JXL_RESTRICT aux_out);
 
 // Encoding/decoding of a single permutation. `size`: number of elements in the
@@ -12,6 +12,7 @@
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <utility>
 #include <vector>
 
@@ -296,15 +297,32 @@ StatusOr<std::vector<ConnectedComponent>> FindCC(const ImageF& energy,
                                                  const Rect& rect, double t_low,
                                                  double t_high,
                                                  uint32_t maxWindow,
-                                                 double minScore) {
+                                                 double minScore,
+                                                 ThreadPool* pool) {
   const int kExtraRect = 4;
   JxlMemoryManager* memory_manager = energy.memory_manager();
   JXL_ASSIGN_OR_RETURN(
       ImageF img,
       ImageF::Create(memory_manager, energy.xsize(), energy.ysize()));
-  JXL_RETURN_IF_ERROR(CopyImageTo(energy, &img));
+  // Extracting components only ever lowers values, so rows without seeds in
+  // the energy image never get any; the serial search below skips them.
+  std::vector<uint8_t> has_seed(rect.ysize());
+  const auto copy_row = [&](const uint32_t y, size_t /*thread*/) -> Status {
+    memcpy(img.Row(y), energy.ConstRow(y), energy.xsize() * sizeof(float));
+    if (y < rect.y0() || y >= rect.y0() + rect.ysize()) return true;
+    const float* JXL_RESTRICT row = energy.ConstRow(y) + rect.x0();
+    bool seed = false;
+    for (size_t x = 0; x < rect.xsize(); x++) {
+      seed |= row[x] > t_high;
+    }
+    has_seed[y - rect.y0()] = seed ? 1 : 0;
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, energy.ysize(), ThreadPool::NoInit,
+                                copy_row, "FindDotSeeds"));
   std::vector<ConnectedComponent> ans;
   for (size_t y = 0; y < rect.ysize(); y++) {
+    if (!has_seed[y]) continue;
     float* JXL_RESTRICT row = rect.Row(&img, y);
     for (size_t x = 0; x < rect.xsize(); x++) {
       if (row[x] > t_high) {
@@ -558,7 +576,7 @@ StatusOr<std::vector<PatchInfo>> DetectGaussianEllipses(
   JXL_ASSIGN_OR_RETURN(ImageF energy, ComputeEnergyImage(opsin, &smooth, pool));
   JXL_ASSIGN_OR_RETURN(std::vector<ConnectedComponent> components,
                        FindCC(energy, rect, params.t_low, params.t_high,
-                              params.maxWinSize, params.minScore));
+                              params.maxWinSize, params.minScore, pool));
   size_t numCC =
       std::min(params.maxCC, (components.size() * params.percCC) / 100);
   if (components.size() > numCC) {
@@ -569,9 +587,22 @@ StatusOr<std::vector<PatchInfo>> DetectGaussianEllipses(
         });
     components.erase(components.begin() + numCC, components.end());
   }
-  for (const auto& cc : components) {
-    JXL_ASSIGN_OR_RETURN(GaussianEllipse ellipse,
-                         FitGaussian(cc, rect, opsin, smooth));
+  // The components are fitted independently; the dots are then selected in the
+  // order of the components.
+  std::vector<GaussianEllipse> ellipses(components.size());
+  const auto fit_component = [&](const uint32_t i,
+                                 size_t /*thread*/) -> Status {
+    JXL_ASSIGN_OR_RETURN(ellipses[i],
+                         FitGaussian(components[i], rect, opsin, smooth));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0,
+                                static_cast<uint32_t>(components.size()),
+                                ThreadPool::NoInit, fit_component,
+                                "FitGaussian"));
+  for (size_t i = 0; i < components.size(); ++i) {
+    const ConnectedComponent& cc = components[i];
+    const GaussianEllipse& ellipse = ellipses[i];
     if (ellipse.x < 0.0 ||
         std::ceil(ellipse.x) >= static_cast<double>(rect.xsize()) ||
         ellipse.y < 0.0 ||
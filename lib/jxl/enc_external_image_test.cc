@@ -9,10 +9,15 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
+#include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/dec_external_image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/test_memory_manager.h"
@@ -78,5 +83,89 @@ TEST(ExternalImageTest, AlphaPremultiplied) {
                                   ColorEncoding::SRGB(), &ib));
 }
 
+// The interleaved formats survive a conversion to the planar floats and back,
+// with widths that do not fill the last vector.
+TEST(ExternalImageTest, RoundTrip) {
+  struct Format {
+    JxlDataType data_type;
+    size_t bits_per_sample;
+    JxlEndianness endianness;
+  };
+  const Format formats[] = {
+      {JXL_TYPE_UINT8, 8, JXL_NATIVE_ENDIAN},
+      {JXL_TYPE_UINT8, 5, JXL_NATIVE_ENDIAN},
+      {JXL_TYPE_UINT16, 16, JXL_BIG_ENDIAN},
+      {JXL_TYPE_UINT16, 12, JXL_LITTLE_ENDIAN},
+      {JXL_TYPE_FLOAT16, 16, JXL_BIG_ENDIAN},
+      {JXL_TYPE_FLOAT16, 16, JXL_LITTLE_ENDIAN},
+      {JXL_TYPE_FLOAT, 32, JXL_BIG_ENDIAN},
+      {JXL_TYPE_FLOAT, 32, JXL_LITTLE_ENDIAN},
+  };
+  Rng rng(0);
+  for (const Format& f : formats) {
+    for (uint32_t num_channels = 1; num_channels <= 4; ++num_channels) {
+      for (size_t xsize : {1, 7, 33}) {
+        const size_t ysize = 3;
+        JxlPixelFormat format = {num_channels, f.data_type, f.endianness, 0};
+        const size_t bytes_per_sample = f.data_type == JXL_TYPE_UINT8 ? 1
+                                        : f.data_type == JXL_TYPE_FLOAT ? 4
+                                                                        : 2;
+        std::vector<uint8_t> pixels(xsize * ysize * num_channels *
+                                    bytes_per_sample);
+        for (size_t i = 0; i < pixels.size(); i += bytes_per_sample) {
+          if (f.data_type == JXL_TYPE_FLOAT) {
+            // Values in [0, 1), so that no NaN is generated.
+            const float v = rng.UniformF(0.0f, 1.0f);
+            uint32_t bits;
+            memcpy(&bits, &v, 4);
+            if (f.endianness == JXL_BIG_ENDIAN) {
+              StoreBE32(bits, &pixels[i]);
+            } else {
+              StoreLE32(bits, &pixels[i]);
+            }
+          } else if (f.data_type == JXL_TYPE_FLOAT16) {
+            // Positive half floats below 1.0.
+            const uint32_t bits = rng.UniformU(0, 0x3C00);
+            if (f.endianness == JXL_BIG_ENDIAN) {
+              StoreBE16(bits, &pixels[i]);
+            } else {
+              StoreLE16(bits, &pixels[i]);
+            }
+          } else {
+            const uint32_t v = rng.UniformU(0, 1u << f.bits_per_sample);
+            if (bytes_per_sample == 1) {
+              pixels[i] = v;
+            } else if (f.endianness == JXL_BIG_ENDIAN) {
+              StoreBE16(v, &pixels[i]);
+            } else {
+              StoreLE16(v, &pixels[i]);
+            }
+          }
+        }
+        ImageMetadata im;
+        if (num_channels == 2 || num_channels == 4) {
+          im.SetAlphaBits(f.bits_per_sample);
+        }
+        ImageBundle ib(jxl::test::MemoryManager(), &im);
+        const bool is_gray = num_channels < 3;
+        ASSERT_TRUE(ConvertFromExternal(Bytes(pixels), xsize, ysize,
+                                        ColorEncoding::SRGB(is_gray),
+                                        f.bits_per_sample, format, nullptr,
+                                        &ib));
+        const bool float_out = f.data_type == JXL_TYPE_FLOAT ||
+                               f.data_type == JXL_TYPE_FLOAT16;
+        std::vector<uint8_t> out(pixels.size());
+        ASSERT_TRUE(ConvertToExternal(
+            ib, f.bits_per_sample, float_out, num_channels, f.endianness,
+            /*stride_out=*/xsize * num_channels * bytes_per_sample, nullptr,
+            out.data(), out.size(), /*out_callback=*/{},
+            Orientation::kIdentity));
+        EXPECT_EQ(pixels, out) << "data_type " << f.data_type << " channels "
+                               << num_channels << " xsize " << xsize;
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
@@ -23,6 +23,8 @@
 using ssize_t = intptr_t;
 #endif
 #else  // FJXL_STANDALONE
+#include <hwy/targets.h>
+
 #include "lib/jxl/encode_internal.h"
 #endif  // FJXL_STANDALONE
 
@@ -118,7 +120,30 @@ constexpr uint32_t CpuFeatureBit(CpuFeature feature) {
   return 1u << static_cast<uint32_t>(feature);
 }
 
-#if FJXL_ARCH_IS_X86
+#if !FJXL_STANDALONE
+// Within libjxl, use the CPU detection of Highway, so that the same code paths
+// are chosen as for the rest of the library and hwy::DisableTargets applies.
+// The AVX3 targets do not check AVX512CD, but all the CPUs with AVX512BW
+// have it.
+uint32_t DetectCpuFeatures() {
+  const int64_t targets = hwy::SupportedTargets();
+  uint32_t flags = 0;
+  if (targets & HWY_AVX2) {
+    flags |= CpuFeatureBit(CpuFeature::kAVX2);
+  }
+  if (targets & HWY_AVX3) {
+    flags |= CpuFeatureBit(CpuFeature::kAVX512F) |
+             CpuFeatureBit(CpuFeature::kAVX512VL) |
+             CpuFeatureBit(CpuFeature::kAVX512CD) |
+             CpuFeatureBit(CpuFeature::kAVX512BW);
+  }
+  if (targets & HWY_AVX3_DL) {
+    flags |=
+        CpuFeatureBit(CpuFeature::kVBMI) | CpuFeatureBit(CpuFeature::kVBMI2);
+  }
+  return flags;
+}
+#elif FJXL_ARCH_IS_X86
 #if defined(_MSC_VER)
 void Cpuid(const uint32_t level, const uint32_t count,
            std::array<uint32_t, 4>& abcd) {
@@ -189,9 +214,9 @@ uint32_t DetectCpuFeatures() {
 
   return flags;
 }
-#else   // FJXL_ARCH_IS_X86
+#else   // !FJXL_STANDALONE || FJXL_ARCH_IS_X86
 uint32_t DetectCpuFeatures() { return 0; }
-#endif  // FJXL_ARCH_IS_X86
+#endif  // !FJXL_STANDALONE || FJXL_ARCH_IS_X86
 
 #if defined(_MSC_VER)
 #define FJXL_UNUSED
@@ -299,18 +324,15 @@ struct BitWriter {
   uint64_t buffer = 0;
 };
 
-size_t SectionSize(const std::array<BitWriter, 4>& group_data) {
+size_t SectionSize(const std::vector<BitWriter>& group_data) {
   size_t sz = 0;
-  for (size_t j = 0; j < 4; j++) {
-    const auto& writer = group_data[j];
+  for (const auto& writer : group_data) {
     sz += writer.bytes_written * 8 + writer.bits_in_buffer;
   }
   sz = (sz + 7) / 8;
   return sz;
 }
 
-constexpr size_t kMaxFrameHeaderSize = 5;
-
 constexpr size_t kGroupSizeOffset[4] = {
     static_cast<size_t>(0),
     static_cast<size_t>(1024),
@@ -334,14 +356,10 @@ size_t TOCSize(const std::vector<size_t>& group_sizes) {
   return (toc_bits + 7) / 8;
 }
 
-size_t FrameHeaderSize(bool have_alpha, bool is_last) {
-  size_t nbits = 28 + (have_alpha ? 4 : 0) + (is_last ? 0 : 2);
-  return (nbits + 7) / 8;
-}
-#endif
-
 void ComputeAcGroupDataOffset(size_t dc_global_size, size_t num_dc_groups,
-                              size_t num_ac_groups, size_t& min_dc_global_size,
+                              size_t num_ac_groups,
+                              size_t max_frame_header_size,
+                              size_t& min_dc_global_size,
                               size_t& ac_group_offset) {
   // Max AC group size is 768 kB, so max AC group TOC bits is 24.
   size_t ac_toc_max_bits = num_ac_groups * 24;
@@ -358,24 +376,22 @@ void ComputeAcGroupDataOffset(size_t dc_global_size, size_t num_dc_groups,
   size_t max_toc_bits =
       kTOCBits[dc_global_bucket] + 12 * (1 + num_dc_groups) + ac_toc_max_bits;
   size_t max_toc_size = (max_toc_bits + 7) / 8;
-  ac_group_offset = kMaxFrameHeaderSize + max_toc_size + min_dc_global_size;
+  ac_group_offset = max_frame_header_size + max_toc_size + min_dc_global_size;
 }
 
-#if !FJXL_STANDALONE
 size_t ComputeDcGlobalPadding(const std::vector<size_t>& group_sizes,
                               size_t ac_group_data_offset,
-                              size_t min_dc_global_size, bool have_alpha,
-                              bool is_last) {
+                              size_t min_dc_global_size,
+                              size_t frame_header_size) {
   std::vector<size_t> new_group_sizes = group_sizes;
   new_group_sizes[0] = min_dc_global_size;
   size_t toc_size = TOCSize(new_group_sizes);
-  size_t actual_offset =
-      FrameHeaderSize(have_alpha, is_last) + toc_size + group_sizes[0];
+  size_t actual_offset = frame_header_size + toc_size + group_sizes[0];
   return ac_group_data_offset - actual_offset;
 }
 #endif
 
-constexpr size_t kNumRawSymbols = 19;
+constexpr size_t kNumRawSymbols = 128;
 constexpr size_t kNumLZ77 = 33;
 constexpr size_t kLZ77CacheSize = 32;
 
@@ -612,12 +628,31 @@ struct PrefixCode {
     }
   }
 
-  // Max bits written: 2 + 72 + 95 + 24 + 165 = 286
+  // Writes a run of `count` >= 3 zero code lengths with repeat codes.
+  static void WriteZeroCodeLengths(size_t count,
+                                   const uint8_t* code_length_nbits,
+                                   const uint16_t* code_length_bits,
+                                   BitWriter* writer) {
+    // Each repeat code after the first one multiplies the previous run length
+    // minus 2 by 8 and adds 3 to 10 to it.
+    size_t extra = count <= 10 ? count - 3 : (count - 3) % 8;
+    if (count > 10) {
+      WriteZeroCodeLengths((count - 3 - extra) / 8 + 2, code_length_nbits,
+                           code_length_bits, writer);
+    }
+    writer->Write(code_length_nbits[17], code_length_bits[17]);
+    writer->Write(3, extra);
+  }
+
+  // Max bits written: 2 + 72 + 640 + 24 + 165 = 903
   void WriteTo(BitWriter* writer) const {
+    // The lengths of at least the first 19 raw symbols are written, which are
+    // all the symbols used with up to 16 bits per sample.
+    size_t num_raw = std::max<size_t>(numraw, 19);
     uint64_t code_length_counts[18] = {};
     code_length_counts[17] = 3 + 2 * (kNumLZ77 - 1);
-    for (uint8_t raw_nbit : raw_nbits) {
-      code_length_counts[raw_nbit]++;
+    for (size_t i = 0; i < num_raw; i++) {
+      code_length_counts[raw_nbits[i]]++;
     }
     for (uint8_t lz77_nbit : lz77_nbits) {
       code_length_counts[lz77_nbit]++;
@@ -655,27 +690,21 @@ struct PrefixCode {
     ComputeCanonicalCode(nullptr, nullptr, 0, code_length_nbits,
                          code_length_bits, 18);
     // Encode raw bit code lengths.
-    // Max bits written in this loop: 19 * 5 = 95
-    for (uint8_t raw_nbit : raw_nbits) {
-      writer->Write(code_length_nbits[raw_nbit], code_length_bits[raw_nbit]);
+    // Max bits written in this loop: 128 * 5 = 640
+    for (size_t i = 0; i < num_raw; i++) {
+      writer->Write(code_length_nbits[raw_nbits[i]],
+                    code_length_bits[raw_nbits[i]]);
     }
     size_t num_lz77 = kNumLZ77;
     while (lz77_nbits[num_lz77 - 1] == 0) {
       num_lz77--;
     }
-    // Encode 0s until 224 (start of LZ77 symbols). This is in total 224-19 =
-    // 205.
-    static_assert(kLZ77Offset == 224);
-    static_assert(kNumRawSymbols == 19);
-    {
-      // Max bits in this block: 24
-      writer->Write(code_length_nbits[17], code_length_bits[17]);
-      writer->Write(3, 0b010);  // 5
-      writer->Write(code_length_nbits[17], code_length_bits[17]);
-      writer->Write(3, 0b000);  // (5-2)*8 + 3 = 27
-      writer->Write(code_length_nbits[17], code_length_bits[17]);
-      writer->Write(3, 0b010);  // (27-2)*8 + 5 = 205
-    }
+    // Encode 0s until 224 (start of LZ77 symbols), i.e. 96 to 205 of them, with
+    // up to three repeat codes.
+    // Max bits written: 24
+    static_assert(kLZ77Offset == 224, "");
+    WriteZeroCodeLengths(kLZ77Offset - num_raw, code_length_nbits,
+                         code_length_bits, writer);
     // Encode LZ77 symbols, with values 224+i.
     // Max bits written in this loop: 33 * 5 = 165
     for (size_t i = 0; i < num_lz77; i++) {
@@ -698,14 +727,30 @@ struct JxlFastLosslessFrameState {
   size_t num_dc_groups_x;
   size_t num_dc_groups_y;
   size_t nb_chans;
+  // Extra channels that are not interleaved with the color channels.
+  size_t num_extra_channels;
   size_t bitdepth;
   int big_endian;
   int effort;
+  // Frame header fields, see JxlFastLosslessSetFrameLayer and
+  // JxlFastLosslessSetAnimationFrame.
+  size_t canvas_xsize;
+  size_t canvas_ysize;
+  int32_t x0 = 0;
+  int32_t y0 = 0;
+  uint32_t blend_source = 0;
+  uint32_t save_as_reference = 0;
+  bool have_animation = false;
+  uint32_t tps_numerator = 100;
+  uint32_t tps_denominator = 1;
+  uint32_t duration = 0;
   bool collided;
+  // Step of the quantized residuals, 1 when lossless.
+  uint32_t multiplier = 1;
   PrefixCode hcode[4];
   std::vector<int16_t> lookup;
   BitWriter header;
-  std::vector<std::array<BitWriter, 4>> group_data;
+  std::vector<std::vector<BitWriter>> group_data;
   std::vector<size_t> group_sizes;
   size_t ac_group_data_offset = 0;
   size_t min_dc_global_size = 0;
@@ -716,6 +761,111 @@ struct JxlFastLosslessFrameState {
   bool process_done = false;
 };
 
+}  // extern "C"
+
+namespace {
+
+// U32 distribution of the frame origin and size.
+void WriteFrameDimension(uint32_t value, BitWriter* output) {
+  if (value < 256) {
+    output->Write(2, 0b00);
+    output->Write(8, value);
+  } else if (value < 2304) {
+    output->Write(2, 0b01);
+    output->Write(11, value - 256);
+  } else if (value < 18688) {
+    output->Write(2, 0b10);
+    output->Write(14, value - 2304);
+  } else {
+    output->Write(2, 0b11);
+    output->Write(30, value - 18688);
+  }
+}
+
+// Hand-crafted frame header, up to the TOC.
+void WriteFrameHeader(const JxlFastLosslessFrameState* frame, bool is_last,
+                      BitWriter* output) {
+  bool have_alpha = (frame->nb_chans == 2 || frame->nb_chans == 4);
+  size_t num_extra_channels = (have_alpha ? 1 : 0) + frame->num_extra_channels;
+  int64_t x1 = static_cast<int64_t>(frame->x0) + frame->width;
+  int64_t y1 = static_cast<int64_t>(frame->y0) + frame->height;
+  bool custom_size_or_origin = frame->x0 != 0 || frame->y0 != 0 ||
+                               frame->width != frame->canvas_xsize ||
+                               frame->height != frame->canvas_ysize;
+  bool is_partial_frame = frame->x0 > 0 || frame->y0 > 0 ||
+                          x1 < static_cast<int64_t>(frame->canvas_xsize) ||
+                          y1 < static_cast<int64_t>(frame->canvas_ysize);
+
+  output->Write(1, 0);     // all_default
+  output->Write(2, 0b00);  // regular frame
+  output->Write(1, 1);     // modular
+  output->Write(2, 0b00);  // default flags
+  output->Write(1, 0);     // not YCbCr
+  output->Write(2, 0b00);  // no upsampling
+  for (size_t i = 0; i < num_extra_channels; i++) {
+    output->Write(2, 0b00);  // no extra channel upsampling
+  }
+  output->Write(2, 0b01);  // default group size
+  output->Write(2, 0b00);  // exactly one pass
+  output->Write(1, custom_size_or_origin);
+  if (custom_size_or_origin) {
+    auto pack_signed = [](int32_t value) -> uint32_t {
+      return value >= 0 ? 2 * static_cast<uint32_t>(value)
+                        : 2 * static_cast<uint32_t>(-(value + 1)) + 1;
+    };
+    WriteFrameDimension(pack_signed(frame->x0), output);
+    WriteFrameDimension(pack_signed(frame->y0), output);
+    WriteFrameDimension(frame->width, output);
+    WriteFrameDimension(frame->height, output);
+  }
+  for (size_t i = 0; i < 1 + num_extra_channels; i++) {
+    output->Write(2, 0b00);  // kReplace blending mode
+    if (is_partial_frame) {
+      output->Write(2, frame->blend_source);  // the rest of the canvas
+    }
+  }
+  if (frame->have_animation) {
+    if (frame->duration < 2) {
+      output->Write(2, frame->duration);
+    } else if (frame->duration < 256) {
+      output->Write(2, 0b10);
+      output->Write(8, frame->duration);
+    } else {
+      output->Write(2, 0b11);
+      output->Write(32, frame->duration);
+    }
+  }
+  output->Write(1, is_last);  // is_last
+  if (!is_last) {
+    output->Write(2, frame->save_as_reference);
+    bool can_be_referenced =
+        frame->duration == 0 || frame->save_as_reference != 0;
+    if (can_be_referenced && !is_partial_frame) {
+      output->Write(1, 0);  // saved after the color transform
+    }
+  }
+  output->Write(2, 0b00);  // a frame has no name
+  output->Write(1, 0);     // loop filter is not all_default
+  output->Write(1, 0);     // no gaborish
+  output->Write(2, 0);     // 0 EPF iters
+  output->Write(2, 0b00);  // No LF extensions
+  output->Write(2, 0b00);  // No FH extensions
+
+  output->Write(1, 0);      // No TOC permutation
+  output->ZeroPadToByte();  // TOC is byte-aligned.
+}
+
+size_t FrameHeaderSize(const JxlFastLosslessFrameState* frame, bool is_last) {
+  BitWriter writer;
+  writer.Allocate(1024);
+  WriteFrameHeader(frame, is_last, &writer);
+  return writer.bytes_written;
+}
+
+}  // namespace
+
+extern "C" {
+
 size_t JxlFastLosslessOutputSize(const JxlFastLosslessFrameState* frame) {
   size_t total_size_groups = 0;
   for (const auto& section : frame->group_data) {
@@ -734,10 +884,9 @@ void JxlFastLosslessPrepareHeader(JxlFastLosslessFrameState* frame,
   BitWriter* output = &frame->header;
   output->Allocate(1000 + frame->group_sizes.size() * 32);
 
-  bool have_alpha = (frame->nb_chans == 2 || frame->nb_chans == 4);
-
 #if FJXL_STANDALONE
   if (add_image_header) {
+    bool have_alpha = (frame->nb_chans == 2 || frame->nb_chans == 4);
     // Signature
     output->Write(16, 0x0AFF);
 
@@ -761,23 +910,38 @@ void JxlFastLosslessPrepareHeader(JxlFastLosslessFrameState* frame,
       }
     };
 
-    wsz(frame->height);
+    wsz(frame->canvas_ysize);
 
     // No special ratio.
     output->Write(3, 0);
 
-    wsz(frame->width);
+    wsz(frame->canvas_xsize);
 
     // Hand-crafted ImageMetadata.
     output->Write(1, 0);  // all_default
-    output->Write(1, 0);  // extra_fields
-    output->Write(1, 0);  // bit_depth.floating_point_sample
+    output->Write(1, frame->have_animation);  // extra_fields
+    if (frame->have_animation) {
+      output->Write(3, 0);  // identity orientation
+      output->Write(1, 0);  // no intrinsic size
+      output->Write(1, 0);  // no preview
+      output->Write(1, 1);  // have_animation
+      output->Write(2, 0b11);  // tps_numerator: 1 + u(30)
+      output->Write(30, frame->tps_numerator - 1);
+      output->Write(2, 0b11);  // tps_denominator: 1 + u(10)
+      output->Write(10, frame->tps_denominator - 1);
+      output->Write(2, 0b00);  // loop forever
+      output->Write(1, 0);     // no timecodes
+    }
+    output->Write(1, frame->bitdepth == 32);  // floating_point_sample
     if (frame->bitdepth == 8) {
       output->Write(2, 0b00);  // bit_depth.bits_per_sample = 8
     } else if (frame->bitdepth == 10) {
       output->Write(2, 0b01);  // bit_depth.bits_per_sample = 10
     } else if (frame->bitdepth == 12) {
       output->Write(2, 0b10);  // bit_depth.bits_per_sample = 12
+    } else if (frame->bitdepth == 32) {
+      output->Write(2, 0b00);  // bit_depth.bits_per_sample = 32
+      output->Write(4, 7);     // bit_depth.exponent_bits_per_sample = 8
     } else {
       output->Write(2, 0b11);  // 1 + u(6)
       output->Write(6, frame->bitdepth - 1);
@@ -806,6 +970,9 @@ void JxlFastLosslessPrepareHeader(JxlFastLosslessFrameState* frame,
       output->Write(4, 11);    // tf of sRGB
       output->Write(2, 1);     // relative rendering intent
     }
+    if (frame->have_animation) {
+      output->Write(1, 1);  // tone_mapping.all_default
+    }
     output->Write(2, 0b00);  // No extensions.
 
     output->Write(1, 1);  // all_default transform data
@@ -813,40 +980,14 @@ void JxlFastLosslessPrepareHeader(JxlFastLosslessFrameState* frame,
     // No ICC, no preview. Frame should start at byte boundary.
     output->ZeroPadToByte();
   }
+  // The hand-crafted image header only describes the interleaved alpha.
+  assert(!add_image_header || frame->num_extra_channels == 0);
 #else
   assert(!add_image_header);
 #endif
-  // Handcrafted frame header.
-  output->Write(1, 0);     // all_default
-  output->Write(2, 0b00);  // regular frame
-  output->Write(1, 1);     // modular
-  output->Write(2, 0b00);  // default flags
-  output->Write(1, 0);     // not YCbCr
-  output->Write(2, 0b00);  // no upsampling
-  if (have_alpha) {
-    output->Write(2, 0b00);  // no alpha upsampling
-  }
-  output->Write(2, 0b01);  // default group size
-  output->Write(2, 0b00);  // exactly one pass
-  output->Write(1, 0);     // no custom size or origin
-  output->Write(2, 0b00);  // kReplace blending mode
-  if (have_alpha) {
-    output->Write(2, 0b00);  // kReplace blending mode for alpha channel
-  }
-  output->Write(1, is_last);  // is_last
-  if (!is_last) {
-    output->Write(2, 0b00);  // can not be saved as reference
-  }
-  output->Write(2, 0b00);  // a frame has no name
-  output->Write(1, 0);     // loop filter is not all_default
-  output->Write(1, 0);     // no gaborish
-  output->Write(2, 0);     // 0 EPF iters
-  output->Write(2, 0b00);  // No LF extensions
-  output->Write(2, 0b00);  // No FH extensions
-
-  output->Write(1, 0);      // No TOC permutation
-  output->ZeroPadToByte();  // TOC is byte-aligned.
-  assert(add_image_header || output->bytes_written <= kMaxFrameHeaderSize);
+  WriteFrameHeader(frame, is_last, output);
+  assert(add_image_header ||
+         output->bytes_written == FrameHeaderSize(frame, is_last));
   for (size_t group_size : frame->group_sizes) {
     size_t bucket = TOCBucket(group_size);
     output->Write(2, bucket);
@@ -927,13 +1068,13 @@ size_t JxlFastLosslessWriteOutput(JxlFastLosslessFrameState* frame,
   while (true) {
     size_t& cur = frame->current_bit_writer;
     size_t& bw_pos = frame->bit_writer_byte_pos;
-    if (cur >= 1 + frame->group_data.size() * frame->nb_chans) {
+    size_t nbc = frame->nb_chans + frame->num_extra_channels;
+    if (cur >= 1 + frame->group_data.size() * nbc) {
       return output - initial_output;
     }
     if (output_size <= 9) {
       return output - initial_output;
     }
-    size_t nbc = frame->nb_chans;
     const BitWriter& writer =
         cur == 0 ? frame->header
                  : frame->group_data[(cur - 1) / nbc][(cur - 1) % nbc];
@@ -989,6 +1130,69 @@ void JxlFastLosslessFreeFrameState(JxlFastLosslessFrameState* frame) {
   delete frame;
 }
 
+void JxlFastLosslessSetFrameLayer(JxlFastLosslessFrameState* frame,
+                                  size_t canvas_xsize, size_t canvas_ysize,
+                                  int32_t x0, int32_t y0,
+                                  uint32_t blend_source,
+                                  uint32_t save_as_reference) {
+  assert(blend_source < 4);
+  assert(save_as_reference < 4);
+  frame->canvas_xsize = canvas_xsize;
+  frame->canvas_ysize = canvas_ysize;
+  frame->x0 = x0;
+  frame->y0 = y0;
+  frame->blend_source = blend_source;
+  frame->save_as_reference = save_as_reference;
+}
+
+void JxlFastLosslessSetAnimationFrame(JxlFastLosslessFrameState* frame,
+                                      uint32_t tps_numerator,
+                                      uint32_t tps_denominator,
+                                      uint32_t duration) {
+  assert(tps_numerator >= 1 && tps_numerator <= (1u << 30));
+  assert(tps_denominator >= 1 && tps_denominator <= 1024);
+  frame->have_animation = true;
+  frame->tps_numerator = tps_numerator;
+  frame->tps_denominator = tps_denominator;
+  frame->duration = duration;
+}
+
+int JxlFastLosslessChangedRegion(const unsigned char* rgba,
+                                 const unsigned char* prev_rgba, size_t width,
+                                 size_t row_stride, size_t height,
+                                 size_t bytes_per_pixel, size_t* x0,
+                                 size_t* y0, size_t* xsize, size_t* ysize) {
+  const size_t row_size = width * bytes_per_pixel;
+  auto row_differs = [&](size_t y) {
+    return memcmp(rgba + y * row_stride, prev_rgba + y * row_stride,
+                  row_size) != 0;
+  };
+  size_t y_begin = 0;
+  while (y_begin < height && !row_differs(y_begin)) y_begin++;
+  if (y_begin == height) return 0;
+  size_t y_end = height;
+  while (!row_differs(y_end - 1)) y_end--;
+  // Bytes before `x_begin` and from `x_end` on are the same in all the rows
+  // seen so far, so only the outer parts of the next rows are compared.
+  size_t x_begin = row_size;
+  size_t x_end = 0;
+  for (size_t y = y_begin; y < y_end; y++) {
+    const unsigned char* row = rgba + y * row_stride;
+    const unsigned char* prev_row = prev_rgba + y * row_stride;
+    size_t x = 0;
+    while (x < x_begin && row[x] == prev_row[x]) x++;
+    x_begin = x;
+    x = row_size;
+    while (x > x_end && row[x - 1] == prev_row[x - 1]) x--;
+    x_end = x;
+  }
+  *x0 = x_begin / bytes_per_pixel;
+  *y0 = y_begin;
+  *xsize = (x_end + bytes_per_pixel - 1) / bytes_per_pixel - *x0;
+  *ysize = y_end - y_begin;
+  return 1;
+}
+
 }  // extern "C"
 
 #endif
@@ -2660,6 +2864,22 @@ void EncodeHybridUint000(uint32_t value, uint32_t* token, uint32_t* nbits,
   *bits = value ? value - (1 << n) : 0;
 }
 
+// 420 config, used for the residuals of 32-bit samples: with the 000 config,
+// they would need up to 31 extra bits, more than the 29 that are valid.
+void EncodeHybridUint420(uint32_t value, uint32_t* token, uint32_t* nbits,
+                         uint32_t* bits) {
+  if (value < 16) {
+    *token = value;
+    *nbits = 0;
+    *bits = 0;
+    return;
+  }
+  uint32_t n = FloorLog2(value);
+  *nbits = n - 2;
+  *token = 16 + ((n - 4) << 2) + ((value >> *nbits) & 3);
+  *bits = value & ((1u << *nbits) - 1);
+}
+
 #ifdef FJXL_AVX512
 constexpr static size_t kLogChunkSize = 5;
 #elif defined(FJXL_AVX2) || defined(FJXL_NEON)
@@ -2931,9 +3151,47 @@ struct MoreThan14Bits {
 constexpr uint8_t MoreThan14Bits::kMinRawLength[];
 constexpr uint8_t MoreThan14Bits::kMaxRawLength[];
 
+// Bit patterns of 32-bit floats, coded as 32-bit integers. The decoder computes
+// the samples modulo 2^32, so the residuals are too. They are tokenized with
+// EncodeHybridUint420, and Huffman codes and extra bits do not fit the 16- or
+// 32-bit lanes of the SIMD code, so only scalar code is used.
+struct Float32Bits {
+  explicit Float32Bits(size_t bitdepth) { assert(bitdepth == 32); }
+  // Up to 8 bits are enough for the 128 raw symbols and the LZ77 symbol.
+  static constexpr uint8_t kMinRawLength[kNumRawSymbols + 1] = {};
+  static constexpr uint8_t kMaxRawLength[kNumRawSymbols + 1] = {
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+      8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+  };
+  static constexpr size_t bitdepth = 32;
+  static size_t MaxEncodedBitsPerSample() { return 37; }
+  static constexpr size_t kInputBytes = 4;
+  using pixel_t = int64_t;
+  using upixel_t = uint32_t;
+
+  static void PrepareForSimd(const uint8_t* /* nbits */,
+                             const uint8_t* /* bits */, size_t /* n */,
+                             uint8_t* /* nbits_simd */,
+                             uint8_t* /* bits_simd */) {}
+
+  size_t NumSymbols(bool) const { return kNumRawSymbols; }
+};
+constexpr uint8_t Float32Bits::kMinRawLength[];
+constexpr uint8_t Float32Bits::kMaxRawLength[];
+
 void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
+                           bool is_float32, uint32_t multiplier,
                            const PrefixCode code[4], BitWriter* output) {
-  output->Allocate(100000 + (is_single_group ? width * height * 16 : 0));
+  size_t max_pixel_bits =
+      is_float32 ? Float32Bits::MaxEncodedBitsPerSample() : 16;
+  output->Allocate(100000 +
+                   (is_single_group ? width * height * max_pixel_bits : 0));
   // No patches, spline or noise.
   output->Write(1, 1);  // default DC dequantization factors (?)
   output->Write(1, 1);  // use global tree / histograms
@@ -2953,14 +3211,23 @@ void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
   output->Write(1, 0);  // First tree encoding option
 
   // Huffman table + extra bits for the tree.
-  uint8_t symbol_bits[6] = {0b00, 0b10, 0b001, 0b101, 0b0011, 0b0111};
-  uint8_t symbol_nbits[6] = {2, 2, 3, 3, 4, 4};
+  uint8_t symbol_bits[8] = {0b00,   0b10,   0b001,  0b101,
+                            0b0011, 0b0111, 0b1011, 0b1111};
+  uint8_t symbol_nbits[8] = {2, 2, 3, 3, 4, 4, 4, 4};
   // Write a tree with a leaf per channel, and gradient predictor for every
   // leaf.
-  for (auto v : {1, 2, 1, 4, 1, 0, 0, 5, 0, 0, 0, 0, 5,
-                 0, 0, 0, 0, 5, 0, 0, 0, 0, 5, 0, 0, 0}) {
+  for (auto v : {1, 2, 1, 4, 1, 0}) {
     output->Write(symbol_nbits[v], symbol_bits[v]);
   }
+  // The residuals are multiplied by (mul_bits + 1) << mul_log.
+  uint32_t mul_log = CtzNonZero(multiplier);
+  uint32_t mul_bits = (multiplier >> mul_log) - 1;
+  assert(mul_log < 8 && mul_bits < 8);
+  for (size_t i = 0; i < 4; i++) {
+    for (uint32_t v : {0u, 5u, 0u, mul_log, mul_bits}) {
+      output->Write(symbol_nbits[v], symbol_bits[v]);
+    }
+  }
 
   output->Write(1, 1);     // Enable lz77 for the main bitstream
   output->Write(2, 0b00);  // lz77 offset 224
@@ -2982,7 +3249,13 @@ void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
   output->Write(1, 1);  // use prefix codes
   output->Write(4, 0);  // 000 hybrid uint config for distances (only need 0)
   for (size_t i = 0; i < 4; i++) {
-    output->Write(4, 0);  // 000 hybrid uint config for symbols (only <= 10)
+    if (is_float32) {
+      output->Write(4, 4);  // 420 hybrid uint config for symbols
+      output->Write(3, 2);
+      output->Write(2, 0);
+    } else {
+      output->Write(4, 0);  // 000 hybrid uint config for symbols (only <= 10)
+    }
   }
 
   // Distance alphabet size:
@@ -3010,10 +3283,13 @@ void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
 }
 
 void PrepareDCGlobal(bool is_single_group, size_t width, size_t height,
-                     size_t nb_chans, const PrefixCode code[4],
-                     BitWriter* output) {
-  PrepareDCGlobalCommon(is_single_group, width, height, code, output);
-  if (nb_chans > 2) {
+                     size_t nb_chans, bool is_float32, uint32_t multiplier,
+                     const PrefixCode code[4], BitWriter* output) {
+  PrepareDCGlobalCommon(is_single_group, width, height, is_float32, multiplier,
+                        code, output);
+  // No YCoCg for float bit patterns, see FillRow(), nor with quantized
+  // residuals, which bound the error of the color channels themselves.
+  if (nb_chans > 2 && !is_float32 && multiplier == 1) {
     output->Write(2, 0b01);     // 1 transform
     output->Write(2, 0b00);     // RCT
     output->Write(5, 0b00000);  // Starting from ch 0
@@ -3067,6 +3343,20 @@ struct ChunkEncoder {
   alignas(64) uint8_t raw_bits_simd[16] = {};
 };
 
+template <>
+FJXL_INLINE void ChunkEncoder<Float32Bits>::Chunk(size_t run,
+                                                  uint32_t* residuals,
+                                                  size_t skip, size_t n) {
+  EncodeRle(run, *code, *output);
+  for (size_t ix = skip; ix < n; ix++) {
+    unsigned token, nbits, bits;
+    EncodeHybridUint420(residuals[ix], &token, &nbits, &bits);
+    uint64_t wbits = bits;
+    output->Write(code->raw_nbits[token] + nbits,
+                  code->raw_bits[token] | wbits << code->raw_nbits[token]);
+  }
+}
+
 template <typename BitDepth>
 struct ChunkSampleCollector {
   FJXL_INLINE void Rle(size_t count, uint64_t* lz77_counts) {
@@ -3096,11 +3386,120 @@ struct ChunkSampleCollector {
   uint64_t* lz77_counts;
 };
 
+template <>
+FJXL_INLINE void ChunkSampleCollector<Float32Bits>::Chunk(size_t run,
+                                                          uint32_t* residuals,
+                                                          size_t skip,
+                                                          size_t n) {
+  Rle(run, lz77_counts);
+  for (size_t ix = skip; ix < n; ix++) {
+    unsigned token, nbits, bits;
+    EncodeHybridUint420(residuals[ix], &token, &nbits, &bits);
+    raw_counts[token]++;
+  }
+}
+
 constexpr uint32_t PackSigned(int32_t value) {
   return (static_cast<uint32_t>(value) << 1) ^
          ((static_cast<uint32_t>(~value) >> 31) - 1);
 }
 
+// Computes the residuals of a chunk of pixels, and returns the number of zero
+// residuals at its start.
+template <typename pixel_t, typename upixel_t>
+size_t PredictChunk(const pixel_t* row, const pixel_t* row_left,
+                    const pixel_t* row_top, const pixel_t* row_topleft,
+                    upixel_t* residuals) {
+  size_t prefix_size = 0;
+  size_t required_prefix_size = 0;
+#ifdef FJXL_GENERIC_SIMD
+  constexpr size_t kNum =
+      sizeof(pixel_t) == 2 ? SIMDVec16::kLanes : SIMDVec32::kLanes;
+  for (size_t ix = 0; ix < kChunkSize; ix += kNum) {
+    size_t c =
+        PredictPixels<simd_t<pixel_t>>(row + ix, row_left + ix, row_top + ix,
+                                       row_topleft + ix, residuals + ix);
+    prefix_size =
+        prefix_size == required_prefix_size ? prefix_size + c : prefix_size;
+    required_prefix_size += kNum;
+  }
+#else
+  for (size_t ix = 0; ix < kChunkSize; ix++) {
+    pixel_t px = row[ix];
+    pixel_t left = row_left[ix];
+    pixel_t top = row_top[ix];
+    pixel_t topleft = row_topleft[ix];
+    pixel_t ac = left - topleft;
+    pixel_t ab = left - top;
+    pixel_t bc = top - topleft;
+    pixel_t grad = static_cast<pixel_t>(static_cast<upixel_t>(ac) +
+                                        static_cast<upixel_t>(top));
+    pixel_t d = ab ^ bc;
+    pixel_t clamp = d < 0 ? top : left;
+    pixel_t s = ac ^ bc;
+    pixel_t pred = s < 0 ? grad : clamp;
+    residuals[ix] = PackSigned(px - pred);
+    prefix_size = prefix_size == required_prefix_size
+                      ? prefix_size + (residuals[ix] == 0)
+                      : prefix_size;
+    required_prefix_size += 1;
+  }
+#endif
+  return prefix_size;
+}
+
+// 32-bit samples, predicted with 64-bit arithmetic like in the decoder, and
+// with residuals modulo 2^32.
+size_t PredictChunk(const int64_t* row, const int64_t* row_left,
+                    const int64_t* row_top, const int64_t* row_topleft,
+                    uint32_t* residuals) {
+  size_t prefix_size = 0;
+  for (size_t ix = 0; ix < kChunkSize; ix++) {
+    int64_t left = row_left[ix];
+    int64_t top = row_top[ix];
+    int64_t topleft = row_topleft[ix];
+    int64_t grad = left + top - topleft;
+    int64_t pred = std::min(std::max(grad, std::min(left, top)),
+                            std::max(left, top));
+    uint32_t res = static_cast<uint32_t>(row[ix] - pred);
+    // Same as PackSigned() of the residual as a signed 32-bit value.
+    residuals[ix] = (res << 1) ^ (0u - (res >> 31));
+    prefix_size += (prefix_size == ix && residuals[ix] == 0) ? 1 : 0;
+  }
+  return prefix_size;
+}
+
+// Step of the quantization of the residuals that keeps the error of every
+// sample within `max_error`. The largest such step is 2 * max_error + 1, but 9
+// does not fit in the alphabet of the tree code, so 8 is used instead.
+uint32_t ResidualMultiplier(int max_error) {
+  return max_error >= 4 ? 8 : 2 * max_error + 1;
+}
+
+// Quantizes the residuals of a row to multiples of `multiplier`, and replaces
+// the pixels with the decoded ones so that they are used for the prediction
+// of the next ones, as in the decoder. `row_left`, `row_top` and `row_topleft`
+// use the same layout as in ProcessRow.
+template <typename pixel_t, typename upixel_t>
+void QuantizeRow(pixel_t* row, const pixel_t* row_left,
+                 const pixel_t* row_top, const pixel_t* row_topleft,
+                 size_t xs, uint32_t multiplier, upixel_t* residuals) {
+  const int32_t mul = multiplier;
+  const int32_t half = mul / 2;
+  for (size_t x = 0; x < xs; x++) {
+    int32_t left = row_left[x];
+    int32_t top = row_top[x];
+    int32_t topleft = row_topleft[x];
+    int32_t grad = left + top - topleft;
+    int32_t pred = std::min(std::max(grad, std::min(left, top)),
+                            std::max(left, top));
+    int32_t diff = row[x] - pred;
+    int32_t q = diff >= 0 ? (diff + half) / mul : -((half - diff) / mul);
+    row[x] = static_cast<pixel_t>(pred + q * mul);
+    residuals[x] = PackSigned(q);
+  }
+}
+
 template <typename T, typename BitDepth>
 struct ChannelRowProcessor {
   using upixel_t = typename BitDepth::upixel_t;
@@ -3110,42 +3509,13 @@ struct ChannelRowProcessor {
                     const pixel_t* row_top, const pixel_t* row_topleft,
                     size_t n) {
     alignas(64) upixel_t residuals[kChunkSize] = {};
-    size_t prefix_size = 0;
-    size_t required_prefix_size = 0;
-#ifdef FJXL_GENERIC_SIMD
-    constexpr size_t kNum =
-        sizeof(pixel_t) == 2 ? SIMDVec16::kLanes : SIMDVec32::kLanes;
-    for (size_t ix = 0; ix < kChunkSize; ix += kNum) {
-      size_t c =
-          PredictPixels<simd_t<pixel_t>>(row + ix, row_left + ix, row_top + ix,
-                                         row_topleft + ix, residuals + ix);
-      prefix_size =
-          prefix_size == required_prefix_size ? prefix_size + c : prefix_size;
-      required_prefix_size += kNum;
-    }
-#else
-    for (size_t ix = 0; ix < kChunkSize; ix++) {
-      pixel_t px = row[ix];
-      pixel_t left = row_left[ix];
-      pixel_t top = row_top[ix];
-      pixel_t topleft = row_topleft[ix];
-      pixel_t ac = left - topleft;
-      pixel_t ab = left - top;
-      pixel_t bc = top - topleft;
-      pixel_t grad = static_cast<pixel_t>(static_cast<upixel_t>(ac) +
-                                          static_cast<upixel_t>(top));
-      pixel_t d = ab ^ bc;
-      pixel_t clamp = d < 0 ? top : left;
-      pixel_t s = ac ^ bc;
-      pixel_t pred = s < 0 ? grad : clamp;
-      residuals[ix] = PackSigned(px - pred);
-      prefix_size = prefix_size == required_prefix_size
-                        ? prefix_size + (residuals[ix] == 0)
-                        : prefix_size;
-      required_prefix_size += 1;
-    }
-#endif
-    prefix_size = std::min(n, prefix_size);
+    size_t prefix_size =
+        PredictChunk(row, row_left, row_top, row_topleft, residuals);
+    EncodeChunk(residuals, std::min(n, prefix_size), n);
+  }
+
+  // `prefix_size` is the number of zero residuals at the start of the chunk.
+  void EncodeChunk(upixel_t* residuals, size_t prefix_size, size_t n) {
     if (prefix_size == n && (run > 0 || prefix_size > kLZ77MinLength)) {
       // Run continues, nothing to do.
       run += prefix_size;
@@ -3168,6 +3538,18 @@ struct ChannelRowProcessor {
     }
   }
 
+  // Same as ProcessRow, with residuals computed by QuantizeRow.
+  void ProcessResidualRow(const upixel_t* row_residuals, size_t xs) {
+    for (size_t x = 0; x < xs; x += kChunkSize) {
+      size_t n = std::min(kChunkSize, xs - x);
+      alignas(64) upixel_t residuals[kChunkSize] = {};
+      std::copy(row_residuals + x, row_residuals + x + n, residuals);
+      size_t prefix_size = 0;
+      while (prefix_size < n && residuals[prefix_size] == 0) prefix_size++;
+      EncodeChunk(residuals, prefix_size, n);
+    }
+  }
+
   void Finalize() { t->Finalize(run); }
   // Invariant: run == 0 or run > kLZ77MinLength.
   size_t run = 0;
@@ -3411,14 +3793,100 @@ void FillRowRGBA16(const unsigned char* rgba, size_t oxs, pixel_t* y,
   }
 }
 
+// Pre-fills rows with YCoCg converted pixels.
+template <typename BitDepth>
+void FillRow(BitDepth, const unsigned char* rgba_row, size_t xs,
+             size_t nb_chans, bool big_endian,
+             typename BitDepth::pixel_t* crow[4]) {
+  if (nb_chans == 1) {
+    if (BitDepth::kInputBytes == 1) {
+      FillRowG8(rgba_row, xs, crow[0]);
+    } else if (big_endian) {
+      FillRowG16</*big_endian=*/true>(rgba_row, xs, crow[0]);
+    } else {
+      FillRowG16</*big_endian=*/false>(rgba_row, xs, crow[0]);
+    }
+  } else if (nb_chans == 2) {
+    if (BitDepth::kInputBytes == 1) {
+      FillRowGA8(rgba_row, xs, crow[0], crow[1]);
+    } else if (big_endian) {
+      FillRowGA16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1]);
+    } else {
+      FillRowGA16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1]);
+    }
+  } else if (nb_chans == 3) {
+    if (BitDepth::kInputBytes == 1) {
+      FillRowRGB8(rgba_row, xs, crow[0], crow[1], crow[2]);
+    } else if (big_endian) {
+      FillRowRGB16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1],
+                                        crow[2]);
+    } else {
+      FillRowRGB16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1],
+                                         crow[2]);
+    }
+  } else {
+    if (BitDepth::kInputBytes == 1) {
+      FillRowRGBA8(rgba_row, xs, crow[0], crow[1], crow[2], crow[3]);
+    } else if (big_endian) {
+      FillRowRGBA16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1],
+                                         crow[2], crow[3]);
+    } else {
+      FillRowRGBA16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1],
+                                          crow[2], crow[3]);
+    }
+  }
+}
+
+// Same as FillRow, without the YCoCg transform.
+template <typename BitDepth>
+void FillRowNoYCoCg(BitDepth, const unsigned char* rgba_row, size_t xs,
+                    size_t nb_chans, bool big_endian,
+                    typename BitDepth::pixel_t* crow[4]) {
+  for (size_t x = 0; x < xs; x++) {
+    for (size_t c = 0; c < nb_chans; c++) {
+      size_t i = x * nb_chans + c;
+      if (BitDepth::kInputBytes == 1) {
+        crow[c][x] = rgba_row[i];
+      } else {
+        uint16_t val = LoadLE16(rgba_row + 2 * i);
+        crow[c][x] = big_endian ? SwapEndian(val) : val;
+      }
+    }
+  }
+}
+
+// Pre-fills rows with the bit patterns of the floats, as signed 32-bit values.
+// There is no color transform, as the decoder computes the inverse RCT with
+// 32-bit arithmetic.
+void FillRow(Float32Bits, const unsigned char* rgba_row, size_t xs,
+             size_t nb_chans, bool big_endian, int64_t* crow[4]) {
+  for (size_t x = 0; x < xs; x++) {
+    for (size_t c = 0; c < nb_chans; c++) {
+      const unsigned char* p = rgba_row + 4 * (x * nb_chans + c);
+      uint32_t bits;
+      if (big_endian) {
+        bits = (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16) |
+               (uint32_t{p[2]} << 8) | p[3];
+      } else {
+        bits = (uint32_t{p[3]} << 24) | (uint32_t{p[2]} << 16) |
+               (uint32_t{p[1]} << 8) | p[0];
+      }
+      crow[c][x] = static_cast<int32_t>(bits);
+    }
+  }
+}
+
+// With `multiplier` > 1, the residuals are quantized by QuantizeRow, and
+// there is no YCoCg.
 template <typename Processor, typename BitDepth>
 void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
                       size_t xs, size_t yskip, size_t ys, size_t row_stride,
                       BitDepth bitdepth, size_t nb_chans, bool big_endian,
-                      Processor* processors) {
+                      uint32_t multiplier, Processor* processors) {
   constexpr size_t kPadding = 32;
 
   using pixel_t = typename BitDepth::pixel_t;
+  using upixel_t = typename BitDepth::upixel_t;
 
   constexpr size_t kAlign = 64;
   constexpr size_t kAlignPixels = kAlign / sizeof(pixel_t);
@@ -3436,6 +3904,8 @@ void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
       kAlignPixels;
 
   std::vector<std::array<std::array<pixel_t, kNumPx>, 2>> group_data(nb_chans);
+  std::vector<std::vector<upixel_t>> residuals(multiplier != 1 ? nb_chans : 0,
+                                               std::vector<upixel_t>(xs));
 
   for (size_t y = 0; y < ys; y++) {
     const auto rgba_row =
@@ -3447,43 +3917,10 @@ void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
       prow[i] = align(&group_data[i][(y - 1) & 1][kPadding]);
     }
 
-    // Pre-fill rows with YCoCg converted pixels.
-    if (nb_chans == 1) {
-      if (BitDepth::kInputBytes == 1) {
-        FillRowG8(rgba_row, xs, crow[0]);
-      } else if (big_endian) {
-        FillRowG16</*big_endian=*/true>(rgba_row, xs, crow[0]);
-      } else {
-        FillRowG16</*big_endian=*/false>(rgba_row, xs, crow[0]);
-      }
-    } else if (nb_chans == 2) {
-      if (BitDepth::kInputBytes == 1) {
-        FillRowGA8(rgba_row, xs, crow[0], crow[1]);
-      } else if (big_endian) {
-        FillRowGA16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1]);
-      } else {
-        FillRowGA16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1]);
-      }
-    } else if (nb_chans == 3) {
-      if (BitDepth::kInputBytes == 1) {
-        FillRowRGB8(rgba_row, xs, crow[0], crow[1], crow[2]);
-      } else if (big_endian) {
-        FillRowRGB16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1],
-                                          crow[2]);
-      } else {
-        FillRowRGB16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1],
-                                           crow[2]);
-      }
+    if (multiplier != 1) {
+      FillRowNoYCoCg(bitdepth, rgba_row, xs, nb_chans, big_endian, crow);
     } else {
-      if (BitDepth::kInputBytes == 1) {
-        FillRowRGBA8(rgba_row, xs, crow[0], crow[1], crow[2], crow[3]);
-      } else if (big_endian) {
-        FillRowRGBA16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1],
-                                           crow[2], crow[3]);
-      } else {
-        FillRowRGBA16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1],
-                                            crow[2], crow[3]);
-      }
+      FillRow(bitdepth, rgba_row, xs, nb_chans, big_endian, crow);
     }
     // Deal with x == 0.
     for (size_t c = 0; c < nb_chans; c++) {
@@ -3491,8 +3928,23 @@ void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
       // Fix topleft.
       *(prow[c] - 1) = y > 0 ? *(prow[c]) : 0;
     }
+    if (multiplier != 1) {
+      // Also needed for the skipped rows, as the next ones are predicted from
+      // the decoded pixels.
+      for (size_t c = 0; c < nb_chans; c++) {
+        const pixel_t* row_left = crow[c] - 1;
+        const pixel_t* row_top = y == 0 ? row_left : prow[c];
+        const pixel_t* row_topleft = y == 0 ? row_left : prow[c] - 1;
+        QuantizeRow(crow[c], row_left, row_top, row_topleft, xs, multiplier,
+                    residuals[c].data());
+      }
+    }
     if (y < yskip) continue;
     for (size_t c = 0; c < nb_chans; c++) {
+      if (multiplier != 1) {
+        processors[c].ProcessResidualRow(residuals[c].data(), xs);
+        continue;
+      }
       // Get pointers to px/left/top/topleft data to speedup loop.
       const pixel_t* row = crow[c];
       const pixel_t* row_left = crow[c] - 1;
@@ -3511,8 +3963,8 @@ template <typename BitDepth>
 void WriteACSection(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
                     size_t ys, size_t row_stride, bool is_single_group,
                     BitDepth bitdepth, size_t nb_chans, bool big_endian,
-                    const PrefixCode code[4],
-                    std::array<BitWriter, 4>& output) {
+                    uint32_t multiplier, const PrefixCode code[4],
+                    BitWriter* output) {
   for (size_t i = 0; i < nb_chans; i++) {
     if (is_single_group && i == 0) continue;
     output[i].Allocate(xs * ys * bitdepth.MaxEncodedBitsPerSample() + 4);
@@ -3536,7 +3988,27 @@ void WriteACSection(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
   }
   ProcessImageArea<ChannelRowProcessor<ChunkEncoder<BitDepth>, BitDepth>>(
       rgba, x0, y0, xs, 0, ys, row_stride, bitdepth, nb_chans, big_endian,
-      row_encoders);
+      multiplier, row_encoders);
+}
+
+// Encodes a (non-interleaved) extra channel of a group, after the color
+// channels written by WriteACSection.
+template <typename BitDepth>
+void WriteACSectionExtraChannel(const unsigned char* data, size_t xs,
+                                size_t ys, size_t row_stride,
+                                BitDepth bitdepth, bool big_endian,
+                                uint32_t multiplier, const PrefixCode& code,
+                                BitWriter* output) {
+  output->Allocate(xs * ys * bitdepth.MaxEncodedBitsPerSample() + 4);
+  ChunkEncoder<BitDepth> encoder;
+  ChannelRowProcessor<ChunkEncoder<BitDepth>, BitDepth> row_encoder;
+  row_encoder.t = &encoder;
+  encoder.output = output;
+  encoder.code = &code;
+  encoder.PrepareForSimd();
+  ProcessImageArea<ChannelRowProcessor<ChunkEncoder<BitDepth>, BitDepth>>(
+      data, 0, 0, xs, 0, ys, row_stride, bitdepth, /*nb_chans=*/1, big_endian,
+      multiplier, &row_encoder);
 }
 
 constexpr int kHashExp = 16;
@@ -3637,7 +4109,8 @@ void CollectSamples(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
                     uint64_t raw_counts[4][kNumRawSymbols],
                     uint64_t lz77_counts[4][kNumLZ77], bool is_single_group,
                     bool palette, BitDepth bitdepth, size_t nb_chans,
-                    bool big_endian, const int16_t* lookup) {
+                    bool big_endian, uint32_t multiplier,
+                    const int16_t* lookup) {
   if (palette) {
     ChunkSampleCollector<UpTo8Bits> sample_collectors[4];
     ChannelRowProcessor<ChunkSampleCollector<UpTo8Bits>, UpTo8Bits>
@@ -3663,7 +4136,7 @@ void CollectSamples(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
     ProcessImageArea<
         ChannelRowProcessor<ChunkSampleCollector<BitDepth>, BitDepth>>(
         rgba, x0, y0, xs, 1, 1 + row_count, row_stride, bitdepth, nb_chans,
-        big_endian, row_sample_collectors);
+        big_endian, multiplier, row_sample_collectors);
   }
 }
 
@@ -3671,7 +4144,8 @@ void PrepareDCGlobalPalette(bool is_single_group, size_t width, size_t height,
                             size_t nb_chans, const PrefixCode code[4],
                             const std::vector<uint32_t>& palette,
                             size_t pcolors, BitWriter* output) {
-  PrepareDCGlobalCommon(is_single_group, width, height, code, output);
+  PrepareDCGlobalCommon(is_single_group, width, height, /*is_float32=*/false,
+                        /*multiplier=*/1, code, output);
   output->Write(2, 0b01);     // 1 transform
   output->Write(2, 0b01);     // Palette
   output->Write(5, 0b00000);  // Starting from ch 0
@@ -3743,6 +4217,9 @@ bool detect_palette(const unsigned char* r, size_t width,
                     std::vector<uint32_t>& palette) {
   size_t x = 0;
   bool collided = false;
+  // Last pixel of the previous block, which is already in `palette`.
+  uint32_t last = 0;
+  bool have_last = false;
   // this is just an unrolling of the next loop
   size_t look_ahead = 7 + ((nb_chans == 1) ? 3 : ((nb_chans < 4) ? 1 : 0));
   for (; x + look_ahead < width; x += 8) {
@@ -3753,6 +4230,13 @@ bool detect_palette(const unsigned char* r, size_t width,
       }
     }
     for (int i = 0; i < 8; i++) p[i] &= ((1llu << (8 * nb_chans)) - 1);
+    // Skip the hash table lookups in flat areas, which make up most of
+    // screen content.
+    bool same = have_last;
+    for (int i = 0; i < 8; i++) same &= (p[i] == last);
+    if (same) continue;
+    last = p[7];
+    have_last = true;
     for (int i = 0; i < 8; i++) index[i] = pixel_hash(p[i]);
     for (int i = 0; i < 8; i++) {
       collided |= (palette[index[i]] != 0 && p[i] != palette[index[i]]);
@@ -3775,16 +4259,24 @@ template <typename BitDepth>
 JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
                                      size_t width, size_t height,
                                      BitDepth bitdepth, size_t nb_chans,
-                                     bool big_endian, int effort, int oneshot) {
+                                     size_t num_extra_channels,
+                                     bool big_endian, int effort, int oneshot,
+                                     int max_error) {
   assert(width != 0);
   assert(height != 0);
+  assert(max_error >= 0 && max_error <= 4);
+  assert(max_error == 0 || bitdepth.bitdepth <= 16);
+  const uint32_t multiplier = ResidualMultiplier(max_error);
+  // Index of the first non-interleaved extra channel in the input source.
+  size_t first_ec = (nb_chans == 2 || nb_chans == 4) ? 1 : 0;
 
   // Count colors to try palette
   std::vector<uint32_t> palette(kHashSize);
   std::vector<int16_t> lookup(kHashSize);
   lookup[0] = 0;
   int pcolors = 0;
-  bool collided = effort < 2 || bitdepth.bitdepth != 8 || !oneshot;
+  bool collided = bitdepth.bitdepth != 8 || !oneshot ||
+                  num_extra_channels != 0 || multiplier != 1;
   for (size_t y0 = 0; y0 < height && !collided; y0 += 256) {
     size_t ys = std::min<size_t>(height - y0, 256);
     for (size_t x0 = 0; x0 < width && !collided; x0 += 256) {
@@ -3817,9 +4309,11 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
       }
       // move entries to front so sort has less work
       palette[nb_entries] = palette[k];
-      if (p[0] != p[1] || p[0] != p[2]) have_color = true;
-      if (p[1] < minG) minG = p[1];
-      if (p[1] > maxG) maxG = p[1];
+      // Single-channel images only have the gray value in p[0].
+      uint8_t g = nb_chans == 1 ? p[0] : p[1];
+      if (nb_chans != 1 && (p[0] != p[1] || p[0] != p[2])) have_color = true;
+      if (g < minG) minG = g;
+      if (g > maxG) maxG = g;
       nb_entries++;
       // don't do palette if too many colors are needed
       if (nb_entries + pcolors > kMaxColors) {
@@ -3886,8 +4380,19 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
     int x_max = xs / kChunkSize * kChunkSize;
     CollectSamples(rgba, 0, y_begin_group, x_max, stride, y_count, raw_counts,
                    lz77_counts, onegroup, !collided, bitdepth, nb_chans,
-                   big_endian, lookup.data());
+                   big_endian, multiplier, lookup.data());
     input.release_buffer(input.opaque, buffer);
+    for (size_t i = 0; i < num_extra_channels; i++) {
+      // Extra channels share the context of the last tree leaf.
+      size_t c = std::min<size_t>(nb_chans + i, 3);
+      const void* ec_buffer = input.get_extra_channel_data_at(
+          input.opaque, first_ec + i, x0, y0, xs, ys, &stride);
+      CollectSamples(reinterpret_cast<const unsigned char*>(ec_buffer), 0,
+                     y_begin_group, x_max, stride, y_count, raw_counts + c,
+                     lz77_counts + c, onegroup, /*palette=*/false, bitdepth,
+                     /*nb_chans=*/1, big_endian, multiplier, nullptr);
+      input.release_buffer(input.opaque, ec_buffer);
+    }
   };
 
   // TODO(veluca): that `64` is an arbitrary constant, meant to correspond to
@@ -3911,10 +4416,10 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
 
   // TODO(veluca): can probably improve this and make it bitdepth-dependent.
   uint64_t base_raw_counts[kNumRawSymbols] = {
-      3843, 852, 1270, 1214, 1014, 727, 481, 300, 159, 51,
-      5,    1,   1,    1,    1,    1,   1,   1,   1};
+      3843, 852, 1270, 1214, 1014, 727, 481, 300, 159, 51, 5};
+  std::fill(base_raw_counts + 11, base_raw_counts + kNumRawSymbols, 1);
 
-  bool doing_ycocg = nb_chans > 2 && collided;
+  bool doing_ycocg = nb_chans > 2 && collided && multiplier == 1;
   bool large_palette = !collided || pcolors >= 256;
   for (size_t i = bitdepth.NumSymbols(doing_ycocg || large_palette);
        i < kNumRawSymbols; i++) {
@@ -3965,16 +4470,22 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
   frame_state->num_dc_groups_x = num_dc_groups_x;
   frame_state->num_dc_groups_y = num_dc_groups_y;
   frame_state->nb_chans = nb_chans;
+  frame_state->num_extra_channels = num_extra_channels;
   frame_state->bitdepth = bitdepth.bitdepth;
   frame_state->big_endian = big_endian;
   frame_state->effort = effort;
   frame_state->collided = collided;
+  frame_state->multiplier = multiplier;
   frame_state->lookup = lookup;
 
-  frame_state->group_data = std::vector<std::array<BitWriter, 4>>(num_groups);
+  frame_state->group_data.resize(num_groups);
+  for (auto& section : frame_state->group_data) {
+    section.resize(nb_chans + num_extra_channels);
+  }
   frame_state->group_sizes.resize(num_groups);
   if (collided) {
-    PrepareDCGlobal(onegroup, width, height, nb_chans, frame_state->hcode,
+    PrepareDCGlobal(onegroup, width, height, nb_chans,
+                    bitdepth.bitdepth == 32, multiplier, frame_state->hcode,
                     &frame_state->group_data[0][0]);
   } else {
     PrepareDCGlobalPalette(onegroup, width, height, nb_chans,
@@ -3982,11 +4493,8 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
                            &frame_state->group_data[0][0]);
   }
   frame_state->group_sizes[0] = SectionSize(frame_state->group_data[0]);
-  if (!onegroup) {
-    ComputeAcGroupDataOffset(frame_state->group_sizes[0], num_dc_groups,
-                             num_ac_groups, frame_state->min_dc_global_size,
-                             frame_state->ac_group_data_offset);
-  }
+  frame_state->canvas_xsize = width;
+  frame_state->canvas_ysize = height;
 
   return frame_state;
 }
@@ -4017,6 +4525,16 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
 #if !FJXL_STANDALONE
   size_t start_pos = 0;
   if (streaming) {
+    // The frame header depends on the settings made after
+    // JxlFastLosslessPrepareFrame, so the AC groups are placed here.
+    size_t max_frame_header_size =
+        std::max(FrameHeaderSize(frame_state, /*is_last=*/false),
+                 FrameHeaderSize(frame_state, /*is_last=*/true));
+    ComputeAcGroupDataOffset(
+        frame_state->group_sizes[0],
+        frame_state->num_dc_groups_x * frame_state->num_dc_groups_y,
+        total_groups, max_frame_header_size, frame_state->min_dc_global_size,
+        frame_state->ac_group_data_offset);
     start_pos = output_processor->CurrentPosition();
     JXL_RETURN_IF_ERROR(
         output_processor->Seek(start_pos + frame_state->ac_group_data_offset));
@@ -4025,9 +4543,13 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
   for (size_t offset = 0; offset < total_groups; offset += max_groups) {
     size_t num_groups = std::min(max_groups, total_groups - offset);
     JxlFastLosslessFrameState local_frame_state;
+    size_t nb_chans = frame_state->nb_chans;
+    size_t num_extra_channels = frame_state->num_extra_channels;
     if (streaming) {
-      local_frame_state.group_data =
-          std::vector<std::array<BitWriter, 4>>(num_groups);
+      local_frame_state.group_data.resize(num_groups);
+      for (auto& section : local_frame_state.group_data) {
+        section.resize(nb_chans + num_extra_channels);
+      }
     }
     auto run_one = [&](size_t i) {
       size_t g = offset + i;
@@ -4051,15 +4573,26 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
                            : frame_state->group_data[group_id];
       if (frame_state->collided) {
         WriteACSection(rgba, 0, 0, xs, ys, stride, onegroup, bitdepth,
-                       frame_state->nb_chans, frame_state->big_endian,
-                       frame_state->hcode, gd);
+                       nb_chans, frame_state->big_endian,
+                       frame_state->multiplier, frame_state->hcode, gd.data());
       } else {
         WriteACSectionPalette(rgba, 0, 0, xs, ys, stride, onegroup,
                               frame_state->hcode, frame_state->lookup.data(),
-                              frame_state->nb_chans, gd[0]);
+                              nb_chans, gd[0]);
       }
-      frame_state->group_sizes[group_id] = SectionSize(gd);
       input.release_buffer(input.opaque, buffer);
+      size_t first_ec = (nb_chans == 2 || nb_chans == 4) ? 1 : 0;
+      for (size_t k = 0; k < num_extra_channels; k++) {
+        size_t c = nb_chans + k;
+        const void* ec_buffer = input.get_extra_channel_data_at(
+            input.opaque, first_ec + k, x0, y0, xs, ys, &stride);
+        WriteACSectionExtraChannel(
+            reinterpret_cast<const unsigned char*>(ec_buffer), xs, ys, stride,
+            bitdepth, frame_state->big_endian, frame_state->multiplier,
+            frame_state->hcode[std::min<size_t>(c, 3)], &gd[c]);
+        input.release_buffer(input.opaque, ec_buffer);
+      }
+      frame_state->group_sizes[group_id] = SectionSize(gd);
     };
     runner(
         runner_opaque, &run_one,
@@ -4069,7 +4602,8 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
         num_groups);
 #if !FJXL_STANDALONE
     if (streaming) {
-      local_frame_state.nb_chans = frame_state->nb_chans;
+      local_frame_state.nb_chans = nb_chans;
+      local_frame_state.num_extra_channels = num_extra_channels;
       local_frame_state.current_bit_writer = 1;
       JXL_RETURN_IF_ERROR(
           JxlFastLosslessOutputFrame(&local_frame_state, output_processor));
@@ -4081,10 +4615,10 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
     size_t end_pos = output_processor->CurrentPosition();
     JXL_RETURN_IF_ERROR(output_processor->Seek(start_pos));
     frame_state->group_data.resize(1);
-    bool have_alpha = frame_state->nb_chans == 2 || frame_state->nb_chans == 4;
     size_t padding = ComputeDcGlobalPadding(
         frame_state->group_sizes, frame_state->ac_group_data_offset,
-        frame_state->min_dc_global_size, have_alpha, is_last);
+        frame_state->min_dc_global_size,
+        FrameHeaderSize(frame_state, is_last));
 
     for (size_t i = 0; i < padding; ++i) {
       frame_state->group_data[0][0].Write(8, 0);
@@ -4111,25 +4645,34 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
 
 JxlFastLosslessFrameState* JxlFastLosslessPrepareImpl(
     JxlChunkedFrameInputSource input, size_t width, size_t height,
-    size_t nb_chans, size_t bitdepth, bool big_endian, int effort,
-    int oneshot) {
+    size_t nb_chans, size_t num_extra_channels, size_t bitdepth,
+    bool big_endian, int effort, int oneshot, int max_error) {
   assert(bitdepth > 0);
   assert(nb_chans <= 4);
   assert(nb_chans != 0);
   if (bitdepth <= 8) {
     return LLPrepare(input, width, height, UpTo8Bits(bitdepth), nb_chans,
-                     big_endian, effort, oneshot);
+                     num_extra_channels, big_endian, effort, oneshot,
+                     max_error);
   }
   if (bitdepth <= 13) {
     return LLPrepare(input, width, height, From9To13Bits(bitdepth), nb_chans,
-                     big_endian, effort, oneshot);
+                     num_extra_channels, big_endian, effort, oneshot,
+                     max_error);
   }
   if (bitdepth == 14) {
     return LLPrepare(input, width, height, Exactly14Bits(bitdepth), nb_chans,
-                     big_endian, effort, oneshot);
+                     num_extra_channels, big_endian, effort, oneshot,
+                     max_error);
+  }
+  if (bitdepth == 32) {
+    return LLPrepare(input, width, height, Float32Bits(bitdepth), nb_chans,
+                     num_extra_channels, big_endian, effort, oneshot,
+                     max_error);
   }
   return LLPrepare(input, width, height, MoreThan14Bits(bitdepth), nb_chans,
-                   big_endian, effort, oneshot);
+                   num_extra_channels, big_endian, effort, oneshot,
+                   max_error);
 }
 
 jxl::Status JxlFastLosslessProcessFrameImpl(
@@ -4146,6 +4689,9 @@ jxl::Status JxlFastLosslessProcessFrameImpl(
   } else if (bitdepth == 14) {
     JXL_RETURN_IF_ERROR(LLProcess(frame_state, is_last, Exactly14Bits(bitdepth),
                                   runner_opaque, runner, output_processor));
+  } else if (bitdepth == 32) {
+    JXL_RETURN_IF_ERROR(LLProcess(frame_state, is_last, Float32Bits(bitdepth),
+                                  runner_opaque, runner, output_processor));
   } else {
     JXL_RETURN_IF_ERROR(LLProcess(frame_state, is_last,
                                   MoreThan14Bits(bitdepth), runner_opaque,
@@ -4230,6 +4776,42 @@ namespace AVX512 {
 
 #endif
 
+namespace {
+
+// Implementation for the CPU, chosen once per process.
+struct FastLosslessDispatch {
+  decltype(&default_implementation::JxlFastLosslessPrepareImpl) prepare;
+  decltype(&default_implementation::JxlFastLosslessProcessFrameImpl) process;
+};
+
+FastLosslessDispatch ChooseFastLosslessDispatch() {
+#if FJXL_ENABLE_AVX512
+  if (HasCpuFeature(CpuFeature::kAVX512CD) &&
+      HasCpuFeature(CpuFeature::kVBMI) &&
+      HasCpuFeature(CpuFeature::kAVX512BW) &&
+      HasCpuFeature(CpuFeature::kAVX512F) &&
+      HasCpuFeature(CpuFeature::kAVX512VL)) {
+    return {AVX512::JxlFastLosslessPrepareImpl,
+            AVX512::JxlFastLosslessProcessFrameImpl};
+  }
+#endif
+#if FJXL_ENABLE_AVX2
+  if (HasCpuFeature(CpuFeature::kAVX2)) {
+    return {AVX2::JxlFastLosslessPrepareImpl,
+            AVX2::JxlFastLosslessProcessFrameImpl};
+  }
+#endif
+  return {default_implementation::JxlFastLosslessPrepareImpl,
+          default_implementation::JxlFastLosslessProcessFrameImpl};
+}
+
+const FastLosslessDispatch& GetFastLosslessDispatch() {
+  static const FastLosslessDispatch dispatch = ChooseFastLosslessDispatch();
+  return dispatch;
+}
+
+}  // namespace
+
 extern "C" {
 
 #if FJXL_STANDALONE
@@ -4239,10 +4821,11 @@ class FJxlFrameInput {
                  size_t bitdepth)
       : rgba_(rgba),
         row_stride_(row_stride),
-        bytes_per_pixel_(bitdepth <= 8 ? nb_chans : 2 * nb_chans) {}
+        bytes_per_pixel_((bitdepth <= 8 ? 1 : bitdepth <= 16 ? 2 : 4) *
+                         nb_chans) {}
 
   JxlChunkedFrameInputSource GetInputSource() {
-    return JxlChunkedFrameInputSource{this, GetDataAt,
+    return JxlChunkedFrameInputSource{this, GetDataAt, nullptr,
                                       [](void*, const void*) {}};
   }
 
@@ -4264,10 +4847,23 @@ size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
                              size_t bitdepth, bool big_endian, int effort,
                              unsigned char** output, void* runner_opaque,
                              FJxlParallelRunner runner) {
+  return JxlFastNearLosslessEncode(rgba, width, row_stride, height, nb_chans,
+                                   bitdepth, big_endian, effort,
+                                   /*max_error=*/0, output, runner_opaque,
+                                   runner);
+}
+
+size_t JxlFastNearLosslessEncode(const unsigned char* rgba, size_t width,
+                                 size_t row_stride, size_t height,
+                                 size_t nb_chans, size_t bitdepth,
+                                 bool big_endian, int effort, int max_error,
+                                 unsigned char** output, void* runner_opaque,
+                                 FJxlParallelRunner runner) {
   FJxlFrameInput input(rgba, row_stride, nb_chans, bitdepth);
   auto frame_state = JxlFastLosslessPrepareFrame(
-      input.GetInputSource(), width, height, nb_chans, bitdepth, big_endian,
-      effort, /*oneshot=*/true);
+      input.GetInputSource(), width, height, nb_chans,
+      /*num_extra_channels=*/0, bitdepth, big_endian, effort,
+      /*oneshot=*/true, max_error);
   if (!JxlFastLosslessProcessFrame(frame_state, /*is_last=*/true, runner_opaque,
                                    runner, nullptr)) {
     return 0;
@@ -4289,27 +4885,11 @@ size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
 
 JxlFastLosslessFrameState* JxlFastLosslessPrepareFrame(
     JxlChunkedFrameInputSource input, size_t width, size_t height,
-    size_t nb_chans, size_t bitdepth, bool big_endian, int effort,
-    int oneshot) {
-#if FJXL_ENABLE_AVX512
-  if (HasCpuFeature(CpuFeature::kAVX512CD) &&
-      HasCpuFeature(CpuFeature::kVBMI) &&
-      HasCpuFeature(CpuFeature::kAVX512BW) &&
-      HasCpuFeature(CpuFeature::kAVX512F) &&
-      HasCpuFeature(CpuFeature::kAVX512VL)) {
-    return AVX512::JxlFastLosslessPrepareImpl(
-        input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot);
-  }
-#endif
-#if FJXL_ENABLE_AVX2
-  if (HasCpuFeature(CpuFeature::kAVX2)) {
-    return AVX2::JxlFastLosslessPrepareImpl(
-        input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot);
-  }
-#endif
-
-  return default_implementation::JxlFastLosslessPrepareImpl(
-      input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot);
+    size_t nb_chans, size_t num_extra_channels, size_t bitdepth,
+    bool big_endian, int effort, int oneshot, int max_error) {
+  return GetFastLosslessDispatch().prepare(
+      input, width, height, nb_chans, num_extra_channels, bitdepth, big_endian,
+      effort, oneshot, max_error);
 }
 
 bool JxlFastLosslessProcessFrame(
@@ -4327,26 +4907,7 @@ bool JxlFastLosslessProcessFrame(
     runner = trivial_runner;
   }
 
-#if FJXL_ENABLE_AVX512
-  if (HasCpuFeature(CpuFeature::kAVX512CD) &&
-      HasCpuFeature(CpuFeature::kVBMI) &&
-      HasCpuFeature(CpuFeature::kAVX512BW) &&
-      HasCpuFeature(CpuFeature::kAVX512F) &&
-      HasCpuFeature(CpuFeature::kAVX512VL)) {
-    JXL_RETURN_IF_ERROR(AVX512::JxlFastLosslessProcessFrameImpl(
-        frame_state, is_last, runner_opaque, runner, output_processor));
-    return true;
-  }
-#endif
-#if FJXL_ENABLE_AVX2
-  if (HasCpuFeature(CpuFeature::kAVX2)) {
-    JXL_RETURN_IF_ERROR(AVX2::JxlFastLosslessProcessFrameImpl(
-        frame_state, is_last, runner_opaque, runner, output_processor));
-    return true;
-  }
-#endif
-
-  JXL_RETURN_IF_ERROR(default_implementation::JxlFastLosslessProcessFrameImpl(
+  JXL_RETURN_IF_ERROR(GetFastLosslessDispatch().process(
       frame_state, is_last, runner_opaque, runner, output_processor));
   return true;
 }
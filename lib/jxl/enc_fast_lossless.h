@@ -5,7 +5,11 @@
 
 #ifndef LIB_JXL_ENC_FAST_LOSSLESS_H_
 #define LIB_JXL_ENC_FAST_LOSSLESS_H_
+#include <stdint.h>
 #include <stdlib.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
 
 // FJXL_STANDALONE=1 for a stand-alone jxl encoder
 // FJXL_STANDALONE=0 for use in libjxl to encode frames (but no image header)
@@ -25,18 +29,22 @@ extern "C" {
 // Simplified version of the streaming input source from jxl/encode.h
 // We only need this part to wrap the full image buffer in the standalone mode
 // and this way we don't need to depend on the jxl headers.
-struct JxlChunkedFrameInputSource {
+typedef struct JxlChunkedFrameInputSource {
   void* opaque;
   const void* (*get_color_channel_data_at)(void* opaque, size_t xpos,
                                            size_t ypos, size_t xsize,
                                            size_t ysize, size_t* row_offset);
+  const void* (*get_extra_channel_data_at)(void* opaque, size_t ec_index,
+                                           size_t xpos, size_t ypos,
+                                           size_t xsize, size_t ysize,
+                                           size_t* row_offset);
   void (*release_buffer)(void* opaque, const void* buf);
-};
+} JxlChunkedFrameInputSource;
 // The standalone version does not use this struct, but we define it here so
 // that we don't have to clutter all the function signatures with defines.
-struct JxlEncoderOutputProcessorWrapper {
+typedef struct JxlEncoderOutputProcessorWrapper {
   int unused;
-};
+} JxlEncoderOutputProcessorWrapper;
 #endif
 
 // Simple encoding API.
@@ -53,19 +61,68 @@ size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
                              size_t bitdepth, bool big_endian, int effort,
                              unsigned char** output, void* runner_opaque,
                              FJxlParallelRunner runner);
+
+// Same as JxlFastLosslessEncode, except that the decoded samples may differ
+// from the input ones by up to `max_error`, from 0 (lossless) to 4. This is
+// not supported for 32-bit float samples.
+size_t JxlFastNearLosslessEncode(const unsigned char* rgba, size_t width,
+                                 size_t row_stride, size_t height,
+                                 size_t nb_chans, size_t bitdepth,
+                                 bool big_endian, int effort, int max_error,
+                                 unsigned char** output, void* runner_opaque,
+                                 FJxlParallelRunner runner);
 #endif
 
 // More complex API for cases in which you may want to allocate your own buffer
 // and other advanced use cases.
 
 // Opaque struct that represents an intermediate state of the computation.
-struct JxlFastLosslessFrameState;
+typedef struct JxlFastLosslessFrameState JxlFastLosslessFrameState;
 
 // Returned JxlFastLosslessFrameState must be freed by calling
 // JxlFastLosslessFreeFrameState.
+// `nb_chans` is the number of interleaved channels of the color buffer, up to
+// 4 with alpha. The `num_extra_channels` other channels, in the same format
+// with a single channel, are read with get_extra_channel_data_at(); their
+// indices start at 1 if the color buffer includes alpha, and at 0 otherwise.
+// With `max_error` from 1 to 4, the residuals are quantized so that the decoded
+// samples differ from the input ones by up to that amount; it must be 0
+// (lossless) for 32-bit float samples.
 JxlFastLosslessFrameState* JxlFastLosslessPrepareFrame(
     JxlChunkedFrameInputSource input, size_t width, size_t height,
-    size_t nb_chans, size_t bitdepth, bool big_endian, int effort, int oneshot);
+    size_t nb_chans, size_t num_extra_channels, size_t bitdepth,
+    bool big_endian, int effort, int oneshot, int max_error);
+
+// Makes the frame, of the size given to JxlFastLosslessPrepareFrame, a layer
+// at (x0, y0) on a canvas of canvas_xsize x canvas_ysize. The parts of the
+// canvas that it does not cover come from reference frame `blend_source`.
+// Unless it is the last frame, the canvas is then saved as reference frame
+// `save_as_reference` (if not 0, or if the frame has no duration), so that
+// the next frames can be cropped to the region that changes. By default, the
+// frame covers the whole canvas and is not saved. Must be called before
+// JxlFastLosslessProcessFrame.
+void JxlFastLosslessSetFrameLayer(JxlFastLosslessFrameState* frame,
+                                  size_t canvas_xsize, size_t canvas_ysize,
+                                  int32_t x0, int32_t y0,
+                                  uint32_t blend_source,
+                                  uint32_t save_as_reference);
+
+// Makes the frame part of an animation, shown for `duration` ticks. The ticks
+// per second are only written by JxlFastLosslessPrepareHeader with
+// add_image_header = 1. Must be called before JxlFastLosslessProcessFrame.
+void JxlFastLosslessSetAnimationFrame(JxlFastLosslessFrameState* frame,
+                                      uint32_t tps_numerator,
+                                      uint32_t tps_denominator,
+                                      uint32_t duration);
+
+// Computes the smallest rectangle that contains all the pixels that differ
+// between two images with the same layout, e.g. consecutive frames of a
+// screen capture. Returns 0 if the images are the same.
+int JxlFastLosslessChangedRegion(const unsigned char* rgba,
+                                 const unsigned char* prev_rgba, size_t width,
+                                 size_t row_stride, size_t height,
+                                 size_t bytes_per_pixel, size_t* x0,
+                                 size_t* y0, size_t* xsize, size_t* ysize);
 
 #if !FJXL_STANDALONE
 class JxlEncoderOutputProcessorWrapper;
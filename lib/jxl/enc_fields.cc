@@ -14,7 +14,7 @@ namespace jxl {
 
 namespace {
 using ::jxl::fields_internal::VisitorBase;
-class WriteVisitor : public VisitorBase {
+class WriteVisitor final : public VisitorBase {
  public:
   WriteVisitor(const size_t extension_bits, BitWriter* JXL_RESTRICT writer)
       : extension_bits_(extension_bits), writer_(writer) {}
@@ -42,6 +42,12 @@ class WriteVisitor : public VisitorBase {
     return true;
   }
 
+  // Same as VisitorBase::Bool, without going through the virtual Bits.
+  Status Bool(bool /*default_value*/, bool* JXL_RESTRICT value) override {
+    writer_->Write(1, *value ? 1 : 0);
+    return true;
+  }
+
   Status BeginExtensions(uint64_t* JXL_RESTRICT extensions) override {
     JXL_QUIET_RETURN_IF_ERROR(VisitorBase::BeginExtensions(extensions));
     if (*extensions == 0) {
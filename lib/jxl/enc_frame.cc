@@ -9,6 +9,7 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
@@ -27,6 +28,7 @@
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
@@ -70,6 +72,7 @@
 #include "lib/jxl/quantizer.h"
 #include "lib/jxl/splines.h"
 #include "lib/jxl/toc.h"
+#include "lib/jxl/trace.h"
 
 namespace jxl {
 
@@ -119,11 +122,15 @@ uint32_t GetBitDepth(JxlBitDepth bit_depth, const T& metadata,
   }
 }
 
+// If `to_xyb` is true and the input is 8-bit sRGB, converts the color channels
+// straight to XYB, fills `linear` if it is not null, and sets `*is_xyb`.
 Status CopyColorChannels(JxlChunkedFrameInputSource input, Rect rect,
                          const FrameInfo& frame_info,
-                         const ImageMetadata& metadata, ThreadPool* pool,
-                         Image3F* color, ImageF* alpha,
-                         bool* has_interleaved_alpha) {
+                         const ImageMetadata& metadata, bool to_xyb,
+                         ThreadPool* pool, Image3F* color, Image3F* linear,
+                         ImageF* alpha, bool* has_interleaved_alpha,
+                         bool* is_xyb) {
+  *is_xyb = false;
   JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
   input.get_color_channels_pixel_format(input.opaque, &format);
   *has_interleaved_alpha = format.num_channels == 2 || format.num_channels == 4;
@@ -144,10 +151,18 @@ Status CopyColorChannels(JxlChunkedFrameInputSource input, Rect rect,
                        color_channels, format.num_channels);
   }
   const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer.get());
-  for (size_t c = 0; c < color_channels; ++c) {
-    JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
-        data, rect.xsize(), rect.ysize(), row_offset, bits_per_sample, format,
-        c, pool, &color->Plane(c)));
+  if (to_xyb && color_channels == 3 && format.num_channels >= 3 &&
+      format.data_type == JXL_TYPE_UINT8 && bits_per_sample == 8) {
+    JXL_RETURN_IF_ERROR(SRGB8ToXYB(data, row_offset, format.num_channels,
+                                   metadata.IntensityTarget(), pool, color,
+                                   linear));
+    *is_xyb = true;
+  } else {
+    for (size_t c = 0; c < color_channels; ++c) {
+      JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
+          data, rect.xsize(), rect.ysize(), row_offset, bits_per_sample,
+          format, c, pool, &color->Plane(c)));
+    }
   }
   if (color_channels == 1) {
     JXL_RETURN_IF_ERROR(CopyImageTo(color->Plane(0), &color->Plane(1)));
@@ -299,11 +314,53 @@ Status LoopFilterFromParams(const CompressParams& cparams, bool streaming_mode,
   return true;
 }
 
+// Histogram parameters of the patches, splines and coefficient orders.
+HistogramParams SectionHistogramParams(const CompressParams& cparams) {
+  HistogramParams params;
+  params.force_huffman =
+      cparams.force_prefix_codes || cparams.decoding_speed_tier >= 4;
+  return params;
+}
+
+// Gaborish and EPF are the slowest stages of the decoder's render pipeline.
+void CountLoopFilteredFrame(const FrameHeader& frame_header, AuxOut* aux_out) {
+  if (aux_out == nullptr) return;
+  if (frame_header.loop_filter.gab || frame_header.loop_filter.epf_iters > 0) {
+    aux_out->num_loop_filtered_frames++;
+  }
+}
+
+// Number of threads that the tasks run on `pool` are spread over.
+StatusOr<size_t> NumThreads(ThreadPool* pool) {
+  size_t num_threads = 1;
+  const auto init = [&](size_t n) -> Status {
+    num_threads = n;
+    return true;
+  };
+  const auto noop = [](uint32_t, size_t) -> Status { return true; };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, 1, init, noop, "NumThreads"));
+  return num_threads;
+}
+
+// VarDCT frames with fewer 256x256 groups than threads use 128x128 groups, so
+// that the per-group work (and the decoding) is spread over more threads. This
+// costs a few bytes per group for the TOC and the entropy coded streams, so
+// single-threaded encoding keeps the larger groups.
+size_t VarDCTGroupSizeShift(size_t xsize, size_t ysize, size_t num_threads) {
+  if (num_threads <= 1 || (xsize <= kGroupDim / 2 && ysize <= kGroupDim / 2)) {
+    return 1;
+  }
+  const size_t num_groups =
+      DivCeil(xsize, kGroupDim) * DivCeil(ysize, kGroupDim);
+  return num_groups < num_threads ? 0 : 1;
+}
+
 Status MakeFrameHeader(size_t xsize, size_t ysize,
                        const CompressParams& cparams,
                        const ProgressiveSplitter& progressive_splitter,
                        const FrameInfo& frame_info,
                        const jpeg::JPEGData* jpeg_data, bool streaming_mode,
+                       size_t num_threads,
                        FrameHeader* JXL_RESTRICT frame_header) {
   frame_header->nonserialized_is_preview = frame_info.is_preview;
   frame_header->is_last = frame_info.is_last;
@@ -327,6 +384,12 @@ Status MakeFrameHeader(size_t xsize, size_t ysize,
     } else {
       frame_header->group_size_shift = cparams.modular_group_size_shift;
     }
+  } else if (!jpeg_data && !streaming_mode &&
+             frame_info.frame_type == FrameType::kRegularFrame) {
+    // Groups are counted in the downsampled frame.
+    const size_t factor = cparams.already_downsampled ? 1 : cparams.resampling;
+    frame_header->group_size_shift = VarDCTGroupSizeShift(
+        DivCeil(xsize, factor), DivCeil(ysize, factor), num_threads);
   }
 
   if (jpeg_data) {
@@ -478,8 +541,12 @@ Status MakeFrameHeader(size_t xsize, size_t ysize,
 // edge duplication but not more. It would probably be better to smear in all
 // directions. That requires an alpha-weighed convolution with a large enough
 // kernel though, which might be overkill...
-void SimplifyInvisible(Image3F* image, const ImageF& alpha, bool lossless) {
-  for (size_t c = 0; c < 3; ++c) {
+// The channels are independent, each is a task on `pool`. Within a channel,
+// every invisible pixel depends on the ones before it.
+Status SimplifyInvisible(Image3F* image, const ImageF& alpha, bool lossless,
+                         ThreadPool* pool) {
+  const auto simplify_channel = [&](const uint32_t c,
+                                    size_t /* thread */) -> Status {
     for (size_t y = 0; y < image->ysize(); ++y) {
       float* JXL_RESTRICT row = image->PlaneRow(c, y);
       const float* JXL_RESTRICT prow =
@@ -536,7 +603,10 @@ void SimplifyInvisible(Image3F* image, const ImageF& alpha, bool lossless) {
         }
       }
     }
-  }
+    return true;
+  };
+  return RunOnPool(pool, 0, 3, ThreadPool::NoInit, simplify_channel,
+                   "SimplifyInvisible");
 }
 
 struct PixelStatsForChromacityAdjustment {
@@ -645,7 +715,7 @@ void ComputeChromacityAdjustments(const CompressParams& cparams,
 
 void ComputeNoiseParams(const CompressParams& cparams, bool streaming_mode,
                         bool color_is_jpeg, const Image3F& opsin,
-                        const FrameDimensions& frame_dim,
+                        const FrameDimensions& frame_dim, ThreadPool* pool,
                         FrameHeader* frame_header, NoiseParams* noise_params) {
   if (cparams.photon_noise_iso > 0) {
     *noise_params = SimulatePhotonNoise(frame_dim.xsize, frame_dim.ysize,
@@ -678,7 +748,7 @@ void ComputeNoiseParams(const CompressParams& cparams, bool streaming_mode,
     if (rampup < 0.0f) {
       quality_coef = kNoiseRampupStart;
     }
-    if (!GetNoiseParameter(opsin, noise_params, quality_coef)) {
+    if (!GetNoiseParameter(opsin, noise_params, quality_coef, pool)) {
       frame_header->flags &= ~FrameHeader::kNoise;
     }
   }
@@ -1091,7 +1161,8 @@ Status ComputeVarDCTEncodingData(const FrameHeader& frame_header,
 }
 
 Status ComputeAllCoeffOrders(PassesEncoderState& enc_state,
-                             const FrameDimensions& frame_dim) {
+                             const FrameDimensions& frame_dim,
+                             ThreadPool* pool) {
   auto used_orders_info = ComputeUsedOrders(
       enc_state.cparams.speed_tier, enc_state.shared.ac_strategy,
       Rect(enc_state.shared.raw_quant_field));
@@ -1101,7 +1172,7 @@ Status ComputeAllCoeffOrders(PassesEncoderState& enc_state,
         enc_state.cparams.speed_tier, *enc_state.coeffs[i],
         enc_state.shared.ac_strategy, frame_dim, enc_state.used_orders[i],
         enc_state.used_acs, used_orders_info.first, used_orders_info.second,
-        &enc_state.shared.coeff_orders[i * enc_state.shared.coeff_order_size]));
+        pool, &enc_state.shared.coeff_orders[i * enc_state.shared.coeff_order_size]));
   }
   enc_state.used_acs |= used_orders_info.first;
   return true;
@@ -1120,11 +1191,16 @@ struct EncCache {
   }
   // TokenizeCoefficients
   Image3I num_nzeroes;
+  // Tokens of the group being tokenized. TokenizeCoefficients reserves room
+  // for every coefficient of the group, so the tokens are moved to an exactly
+  // sized vector and this worst-case buffer is reused by the next group.
+  std::vector<Token> tokens;
 };
 
 Status TokenizeAllCoefficients(const FrameHeader& frame_header,
                                ThreadPool* pool,
                                PassesEncoderState* enc_state) {
+  JXL_TRACE_SCOPE(kTokenize);
   PassesSharedState& shared = enc_state->shared;
   std::vector<EncCache> group_caches;
   JxlMemoryManager* memory_manager = enc_state->memory_manager();
@@ -1148,9 +1224,12 @@ Status TokenizeAllCoefficients(const FrameHeader& frame_header,
       JXL_RETURN_IF_ERROR(TokenizeCoefficients(
           &shared.coeff_orders[idx_pass * shared.coeff_order_size], rect,
           ac_rows, shared.ac_strategy, frame_header.chroma_subsampling,
-          &group_caches[thread].num_nzeroes,
-          &enc_state->passes[idx_pass].ac_tokens[group_index], shared.quant_dc,
-          shared.raw_quant_field, shared.block_ctx_map));
+          &group_caches[thread].num_nzeroes, &group_caches[thread].tokens,
+          shared.quant_dc, shared.raw_quant_field, shared.block_ctx_map));
+      const std::vector<Token>& tokens = group_caches[thread].tokens;
+      // Keeps the capacity of token vectors taken over from a previous frame.
+      enc_state->passes[idx_pass].ac_tokens[group_index].assign(tokens.begin(),
+                                                                tokens.end());
     }
     return true;
   };
@@ -1205,7 +1284,9 @@ Status EncodeGlobalACInfo(PassesEncoderState* enc_state, BitWriter* writer,
       JXL_RETURN_IF_ERROR(
           EncodeCoeffOrders(enc_state->used_orders[i],
                             &shared.coeff_orders[i * shared.coeff_order_size],
-                            writer, LayerType::Order, aux_out));
+                            writer, LayerType::Order,
+                            SectionHistogramParams(enc_state->cparams),
+                            aux_out));
     }
 
     // Encode histograms.
@@ -1217,6 +1298,10 @@ Status EncodeGlobalACInfo(PassesEncoderState* enc_state, BitWriter* writer,
     if (enc_state->cparams.decoding_speed_tier >= 1) {
       hist_params.max_histograms = 6;
     }
+    if (enc_state->cparams.decoding_speed_tier >= 4 ||
+        enc_state->cparams.force_prefix_codes) {
+      hist_params.force_huffman = true;
+    }
     size_t num_histogram_groups = shared.num_histograms;
     if (enc_state->streaming_mode) {
       size_t prev_num_histograms =
@@ -1245,6 +1330,10 @@ Status EncodeGlobalACInfo(PassesEncoderState* enc_state, BitWriter* writer,
             enc_state->passes[i].ac_tokens, &enc_state->passes[i].codes,
             &enc_state->passes[i].context_map, writer, LayerType::Ac, aux_out));
     (void)cost;
+    if (aux_out != nullptr && !enc_state->passes[i].codes.use_prefix_code) {
+      aux_out->num_ans_histograms +=
+          enc_state->passes[i].codes.encoding_info.size();
+    }
   }
 
   return true;
@@ -1285,12 +1374,12 @@ Status EncodeGroups(const FrameHeader& frame_header,
     if (frame_header.flags & FrameHeader::kPatches) {
       JXL_RETURN_IF_ERROR(PatchDictionaryEncoder::Encode(
           shared.image_features.patches, get_output(0), LayerType::Dictionary,
-          aux_out));
+          SectionHistogramParams(enc_state->cparams), aux_out));
     }
     if (frame_header.flags & FrameHeader::kSplines) {
-      JXL_RETURN_IF_ERROR(EncodeSplines(shared.image_features.splines,
-                                        get_output(0), LayerType::Splines,
-                                        HistogramParams(), aux_out));
+      JXL_RETURN_IF_ERROR(EncodeSplines(
+          shared.image_features.splines, get_output(0), LayerType::Splines,
+          SectionHistogramParams(enc_state->cparams), aux_out));
     }
     if (frame_header.flags & FrameHeader::kNoise) {
       JXL_RETURN_IF_ERROR(EncodeNoise(shared.image_features.noise_params,
@@ -1364,17 +1453,31 @@ Status EncodeGroups(const FrameHeader& frame_header,
     }
     return true;
   };
+  // The AC histograms only depend on the AC tokens, so unless all the
+  // sections share the same writer they are built and written while the DC
+  // groups are encoded. Task 0 does it, so that the longest task starts first.
+  const bool is_vardct = frame_header.encoding == FrameEncoding::kVarDCT;
+  const size_t num_ac_global_tasks =
+      is_vardct && !enc_state->streaming_mode && !is_small_image ? 1 : 0;
+  const auto process_dc_task = [&](const uint32_t task,
+                                   const size_t thread) -> Status {
+    if (task < num_ac_global_tasks) {
+      return EncodeGlobalACInfo(enc_state, get_output(global_ac_index),
+                                enc_modular, aux_outs[thread].get());
+    }
+    return process_dc_group(task - num_ac_global_tasks, thread);
+  };
   if (enc_state->streaming_mode) {
     JXL_ENSURE(frame_dim.num_dc_groups == 1);
     JXL_RETURN_IF_ERROR(resize_aux_outs(1));
     JXL_RETURN_IF_ERROR(process_dc_group(enc_state->dc_group_index, 0));
   } else {
-    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, frame_dim.num_dc_groups,
-                                  resize_aux_outs, process_dc_group,
-                                  "EncodeDCGroup"));
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, num_ac_global_tasks + frame_dim.num_dc_groups,
+        resize_aux_outs, process_dc_task, "EncodeDCGroup"));
   }
   if (has_error) return JXL_FAILURE("EncodeDCGroup failed");
-  if (frame_header.encoding == FrameEncoding::kVarDCT) {
+  if (is_vardct && num_ac_global_tasks == 0) {
     JXL_RETURN_IF_ERROR(EncodeGlobalACInfo(
         enc_state, get_output(global_ac_index), enc_modular, aux_out));
   }
@@ -1449,16 +1552,16 @@ Status ComputeEncodingData(
 
   shared.image_features.patches.SetShared(&shared.reference_frames);
   const FrameDimensions& frame_dim = shared.frame_dim;
-  JXL_ASSIGN_OR_RETURN(
-      shared.ac_strategy,
-      AcStrategyImage::Create(memory_manager, frame_dim.xsize_blocks,
-                              frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared.raw_quant_field,
-                       ImageI::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared.epf_sharpness,
-                       ImageB::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
+  // The per-block images may come from a previous frame, see ReuseStorage.
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared.ac_strategy));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared.raw_quant_field));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared.epf_sharpness));
   JXL_ASSIGN_OR_RETURN(
       shared.cmap, ColorCorrelationMap::Create(memory_manager, frame_dim.xsize,
                                                frame_dim.ysize));
@@ -1468,12 +1571,11 @@ Status ComputeEncodingData(
                                kCoeffOrderMaxSize);
   }
 
-  JXL_ASSIGN_OR_RETURN(shared.quant_dc,
-                       ImageB::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared.dc_storage,
-                       Image3F::Create(memory_manager, frame_dim.xsize_blocks,
-                                       frame_dim.ysize_blocks));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks, &shared.quant_dc));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared.dc_storage));
   shared.dc = &shared.dc_storage;
 
   const size_t num_extra_channels = metadata->m.num_extra_channels;
@@ -1506,39 +1608,56 @@ Status ComputeEncodingData(
   }
   ImageF* alpha = alpha_eci ? &extra_channels[alpha_idx] : nullptr;
   ImageF* black = black_eci ? &extra_channels[black_idx] : nullptr;
+  const bool needs_xyb = frame_header.color_transform == ColorTransform::kXYB &&
+                         frame_info.ib_needs_color_transform;
+  Image3F linear_storage;
+  Image3F* linear = nullptr;
+  if (!jpeg_data && needs_xyb &&
+      frame_header.encoding == FrameEncoding::kVarDCT &&
+      (cparams.speed_tier <= SpeedTier::kKitten ||
+       cparams.target_butteraugli_score > 0)) {
+    JXL_ASSIGN_OR_RETURN(linear_storage,
+                         Image3F::Create(memory_manager, patch_rect.xsize(),
+                                         patch_rect.ysize()));
+    linear = &linear_storage;
+  }
+  // The XYB cache compares the input pixels, so it needs the separate passes.
+  const bool use_xyb_cache = cparams.xyb_cache != nullptr &&
+                             !enc_state.streaming_mode && black == nullptr;
   bool has_interleaved_alpha = false;
+  bool is_xyb = false;
   JxlChunkedFrameInputSource input = frame_data.GetInputSource();
   if (!jpeg_data) {
-    JXL_RETURN_IF_ERROR(CopyColorChannels(input, patch_rect, frame_info,
-                                          metadata->m, pool, &color, alpha,
-                                          &has_interleaved_alpha));
+    const bool to_xyb =
+        needs_xyb && c_enc.IsSRGB() && black == nullptr && !use_xyb_cache;
+    JXL_RETURN_IF_ERROR(CopyColorChannels(
+        input, patch_rect, frame_info, metadata->m, to_xyb, pool, &color,
+        linear, alpha, &has_interleaved_alpha, &is_xyb));
   }
   JXL_RETURN_IF_ERROR(CopyExtraChannels(input, patch_rect, frame_info,
                                         metadata->m, has_interleaved_alpha,
                                         pool, &extra_channels));
 
   enc_state.cparams = cparams;
-
-  Image3F linear_storage;
-  Image3F* linear = nullptr;
+  // The frames encoded while encoding this one, such as patch and DC frames,
+  // allocate their own buffers.
+  enc_state.cparams.spare_enc_state = nullptr;
 
   if (!jpeg_data) {
-    if (frame_header.color_transform == ColorTransform::kXYB &&
-        frame_info.ib_needs_color_transform) {
-      if (frame_header.encoding == FrameEncoding::kVarDCT &&
-          cparams.speed_tier <= SpeedTier::kKitten) {
-        JXL_ASSIGN_OR_RETURN(linear_storage,
-                             Image3F::Create(memory_manager, patch_rect.xsize(),
-                                             patch_rect.ysize()));
-        linear = &linear_storage;
+    if (needs_xyb && !is_xyb) {
+      if (use_xyb_cache) {
+        JXL_RETURN_IF_ERROR(cparams.xyb_cache->ToXYB(
+            c_enc, metadata->m.IntensityTarget(), pool, &color, cms, linear));
+      } else {
+        JXL_RETURN_IF_ERROR(ToXYB(c_enc, metadata->m.IntensityTarget(), black,
+                                  pool, &color, cms, linear));
       }
-      JXL_RETURN_IF_ERROR(ToXYB(c_enc, metadata->m.IntensityTarget(), black,
-                                pool, &color, cms, linear));
     } else {
       // Nothing to do.
       // RGB or YCbCr: forward YCbCr is not implemented, this is only used when
       // the input is already in YCbCr
       // If encoding a special DC or reference frame: input is already in XYB.
+      // 8-bit sRGB input may also have been converted while copying it.
     }
     bool lossless = cparams.IsLossless();
     if (alpha && !alpha_eci->alpha_associated &&
@@ -1547,9 +1666,10 @@ Status ComputeEncodingData(
         cparams.ec_resampling == cparams.resampling &&
         !cparams.disable_perceptual_optimizations) {
       // simplify invisible pixels
-      SimplifyInvisible(&color, *alpha, lossless);
+      JXL_RETURN_IF_ERROR(SimplifyInvisible(&color, *alpha, lossless, pool));
       if (linear) {
-        SimplifyInvisible(linear, *alpha, lossless);
+        JXL_RETURN_IF_ERROR(
+            SimplifyInvisible(linear, *alpha, lossless, pool));
       }
     }
     JXL_RETURN_IF_ERROR(PadImageToBlockMultipleInPlace(&color));
@@ -1567,7 +1687,7 @@ Status ComputeEncodingData(
 
   bool has_jpeg_data = (jpeg_data != nullptr);
   ComputeNoiseParams(cparams, enc_state.streaming_mode, has_jpeg_data, color,
-                     frame_dim, &mutable_frame_header,
+                     frame_dim, pool, &mutable_frame_header,
                      &shared.image_features.noise_params);
 
   JXL_RETURN_IF_ERROR(
@@ -1596,7 +1716,7 @@ Status ComputeEncodingData(
           frame_header, linear, &color, group_rect, cms, pool, &enc_modular,
           &enc_state, aux_out));
     }
-    JXL_RETURN_IF_ERROR(ComputeAllCoeffOrders(enc_state, frame_dim));
+    JXL_RETURN_IF_ERROR(ComputeAllCoeffOrders(enc_state, frame_dim, pool));
     if (!enc_state.streaming_mode) {
       shared.num_histograms = 1;
       enc_state.histogram_idx.resize(frame_dim.num_groups);
@@ -1637,19 +1757,11 @@ Status ComputeEncodingData(
   return true;
 }
 
-Status PermuteGroups(const CompressParams& cparams,
-                     const FrameDimensions& frame_dim, size_t num_passes,
-                     std::vector<coeff_order_t>* permutation,
-                     std::vector<std::unique_ptr<BitWriter>>* group_codes) {
-  const size_t num_groups = frame_dim.num_groups;
-  if (!cparams.centerfirst || (num_passes == 1 && num_groups == 1)) {
-    return true;
-  }
-  // Don't permute global DC/AC or DC.
-  permutation->resize(frame_dim.num_dc_groups + 2);
-  std::iota(permutation->begin(), permutation->end(), 0);
-  std::vector<coeff_order_t> ac_group_order(num_groups);
-  std::iota(ac_group_order.begin(), ac_group_order.end(), 0);
+// Orders the AC groups in concentric squares around the center, for
+// progressive viewing.
+Status CenterFirstGroupOrder(const CompressParams& cparams,
+                             const FrameDimensions& frame_dim,
+                             std::vector<coeff_order_t>* ac_group_order) {
   size_t group_dim = frame_dim.group_dim;
 
   // The center of the image is either given by parameters or chosen
@@ -1695,10 +1807,52 @@ Status PermuteGroups(const CompressParams& cparams,
     // Concentric squares in clockwise order.
     return std::make_pair(std::max(std::abs(dx), std::abs(dy)), angle);
   };
-  std::sort(ac_group_order.begin(), ac_group_order.end(),
+  std::sort(ac_group_order->begin(), ac_group_order->end(),
             [&](coeff_order_t a, coeff_order_t b) {
               return get_distance_from_center(a) < get_distance_from_center(b);
             });
+  return true;
+}
+
+// Stores the AC groups of each DC group (up to 8x8 groups) together, so that
+// the groups that become available together during an incremental decode are
+// adjacent, and their shared borders can be rendered right away.
+void TiledGroupOrder(const FrameDimensions& frame_dim,
+                     std::vector<coeff_order_t>* ac_group_order) {
+  const auto dc_group_of = [&](coeff_order_t gid) {
+    size_t gx = gid % frame_dim.xsize_groups;
+    size_t gy = gid / frame_dim.xsize_groups;
+    return (gy / kBlockDim) * frame_dim.xsize_dc_groups + gx / kBlockDim;
+  };
+  std::stable_sort(ac_group_order->begin(), ac_group_order->end(),
+                   [&](coeff_order_t a, coeff_order_t b) {
+                     return dc_group_of(a) < dc_group_of(b);
+                   });
+}
+
+Status PermuteGroups(const CompressParams& cparams,
+                     const FrameDimensions& frame_dim, size_t num_passes,
+                     std::vector<coeff_order_t>* permutation,
+                     std::vector<std::unique_ptr<BitWriter>>* group_codes) {
+  const size_t num_groups = frame_dim.num_groups;
+  if (!cparams.centerfirst &&
+      (!cparams.tiled_group_order || frame_dim.num_dc_groups == 1)) {
+    return true;
+  }
+  if (num_passes == 1 && num_groups == 1) {
+    return true;
+  }
+  // Don't permute global DC/AC or DC.
+  permutation->resize(frame_dim.num_dc_groups + 2);
+  std::iota(permutation->begin(), permutation->end(), 0);
+  std::vector<coeff_order_t> ac_group_order(num_groups);
+  std::iota(ac_group_order.begin(), ac_group_order.end(), 0);
+  if (cparams.tiled_group_order) {
+    TiledGroupOrder(frame_dim, &ac_group_order);
+  } else {
+    JXL_RETURN_IF_ERROR(
+        CenterFirstGroupOrder(cparams, frame_dim, &ac_group_order));
+  }
   std::vector<coeff_order_t> inv_ac_group_order(ac_group_order.size(), 0);
   for (size_t i = 0; i < ac_group_order.size(); i++) {
     inv_ac_group_order[ac_group_order[i]] = i;
@@ -1724,7 +1878,14 @@ bool CanDoStreamingEncoding(const CompressParams& cparams,
   if (cparams.buffering == 0) {
     return false;
   }
-  if (cparams.buffering == -1) {
+  // With a tight memory limit, prefer streaming whenever the buffers of the
+  // whole frame (a few float planes per channel) would take much of it.
+  const uint64_t frame_bytes =
+      static_cast<uint64_t>(frame_data.xsize) * frame_data.ysize *
+      (3 + metadata.m.num_extra_channels) * sizeof(float) * 4;
+  const bool memory_bound =
+      cparams.memory_limit != 0 && frame_bytes > cparams.memory_limit / 2;
+  if (cparams.buffering == -1 && !memory_bound) {
     if (cparams.speed_tier < SpeedTier::kTortoise) return false;
     if (cparams.speed_tier < SpeedTier::kSquirrel &&
         cparams.butteraugli_distance > 0.5f) {
@@ -1953,7 +2114,8 @@ Status OutputAcGlobal(PassesEncoderState& enc_state,
     JXL_RETURN_IF_ERROR(
         EncodeCoeffOrders(enc_state.used_orders[i],
                           &shared.coeff_orders[i * shared.coeff_order_size],
-                          &writer, LayerType::Order, aux_out));
+                          &writer, LayerType::Order,
+                          SectionHistogramParams(enc_state.cparams), aux_out));
     // Fix up context map and entropy codes to remove any fix histograms that
     // were not selected by clustering.
     RemoveUnusedHistograms(enc_state.passes[i].context_map,
@@ -1991,7 +2153,7 @@ Status EncodeFrameStreaming(JxlMemoryManager* memory_manager,
   JXL_RETURN_IF_ERROR(MakeFrameHeader(frame_data.xsize, frame_data.ysize,
                                       cparams, enc_state.progressive_splitter,
                                       frame_info, jpeg_data.get(), true,
-                                      &frame_header));
+                                      /*num_threads=*/1, &frame_header));
   const size_t num_passes = enc_state.progressive_splitter.GetNumPasses();
   JXL_ASSIGN_OR_RETURN(
       ModularFrameEncoder enc_modular,
@@ -2037,6 +2199,7 @@ Status EncodeFrameStreaming(JxlMemoryManager* memory_manager,
         &group_codes, aux_out));
     JXL_ENSURE(enc_state.special_frames.empty());
     if (i == 0) {
+      CountLoopFilteredFrame(frame_header, aux_out);
       BitWriter writer{memory_manager};
       JXL_RETURN_IF_ERROR(WriteFrameHeader(frame_header, &writer, aux_out));
       JXL_RETURN_IF_ERROR(
@@ -2103,6 +2266,9 @@ Status EncodeFrameOneShot(JxlMemoryManager* memory_manager,
                           JxlEncoderOutputProcessorWrapper* output_processor,
                           AuxOut* aux_out) {
   PassesEncoderState enc_state{memory_manager};
+  if (cparams.spare_enc_state != nullptr) {
+    enc_state.ReuseStorage(cparams.spare_enc_state);
+  }
   SetProgressiveMode(cparams, &enc_state.progressive_splitter);
   FrameHeader frame_header(metadata);
   std::unique_ptr<jpeg::JPEGData> jpeg_data;
@@ -2110,10 +2276,11 @@ Status EncodeFrameOneShot(JxlMemoryManager* memory_manager,
     jpeg_data = frame_data.TakeJPEGData();
     JXL_ENSURE(jpeg_data);
   }
+  JXL_ASSIGN_OR_RETURN(size_t num_threads, NumThreads(pool));
   JXL_RETURN_IF_ERROR(MakeFrameHeader(frame_data.xsize, frame_data.ysize,
                                       cparams, enc_state.progressive_splitter,
                                       frame_info, jpeg_data.get(), false,
-                                      &frame_header));
+                                      num_threads, &frame_header));
   const size_t num_passes = enc_state.progressive_splitter.GetNumPasses();
   JXL_ASSIGN_OR_RETURN(ModularFrameEncoder enc_modular,
                        ModularFrameEncoder::Create(memory_manager, frame_header,
@@ -2124,6 +2291,7 @@ Status EncodeFrameOneShot(JxlMemoryManager* memory_manager,
       frame_data.xsize, frame_data.ysize, cms, pool, frame_header, enc_modular,
       enc_state, &group_codes, aux_out));
 
+  CountLoopFilteredFrame(frame_header, aux_out);
   BitWriter writer{memory_manager};
   JXL_RETURN_IF_ERROR(writer.AppendByteAligned(enc_state.special_frames));
   JXL_RETURN_IF_ERROR(WriteFrameHeader(frame_header, &writer, aux_out));
@@ -2139,6 +2307,9 @@ Status EncodeFrameOneShot(JxlMemoryManager* memory_manager,
   PaddedBytes frame_bytes = std::move(writer).TakeBytes();
   JXL_RETURN_IF_ERROR(AppendData(*output_processor, frame_bytes));
 
+  if (cparams.spare_enc_state != nullptr) {
+    cparams.spare_enc_state->ReuseStorage(&enc_state);
+  }
   return true;
 }
 
@@ -2346,20 +2517,28 @@ Status EncodeFrame(JxlMemoryManager* memory_manager,
                    const JxlCmsInterface& cms, ThreadPool* pool,
                    JxlEncoderOutputProcessorWrapper* output_processor,
                    AuxOut* aux_out) {
+  JXL_TRACE_EVENT("EncodeFrame");
   CompressParams cparams = cparams_orig;
+  // Nested calls, such as the trials below, share the deadline of the frame.
+  if (cparams.time_budget_ms >= 0 &&
+      cparams.deadline == std::chrono::steady_clock::time_point()) {
+    cparams.deadline = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(cparams.time_budget_ms);
+  }
   if (cparams.speed_tier == SpeedTier::kTectonicPlate &&
       !cparams.IsLossless()) {
     cparams.speed_tier = SpeedTier::kGlacier;
   }
-  // Lightning mode is handled externally, so switch to Thunder mode to handle
-  // potentially weird cases.
-  if (cparams.speed_tier == SpeedTier::kLightning) {
+  // Lossless Lightning mode is handled externally, so switch to Thunder mode to
+  // handle potentially weird cases. VarDCT has a Lightning mode of its own.
+  if (cparams.speed_tier == SpeedTier::kLightning &&
+      (cparams.modular_mode || frame_data.IsJPEG())) {
     cparams.speed_tier = SpeedTier::kThunder;
   }
   if (cparams.speed_tier == SpeedTier::kTectonicPlate) {
     // Test palette performance to inform later trials.
     std::vector<CompressParams> all_params;
-    CompressParams cparams_attempt = cparams_orig;
+    CompressParams cparams_attempt = cparams;
     cparams_attempt.speed_tier = SpeedTier::kGlacier;
 
     cparams_attempt.options.max_properties = 4;
@@ -2388,7 +2567,13 @@ Status EncodeFrame(JxlMemoryManager* memory_manager,
       size_t avail_out = output.size();
       JxlEncoderOutputProcessorWrapper local_output(memory_manager);
       JXL_RETURN_IF_ERROR(local_output.SetAvailOut(&next_out, &avail_out));
-      JXL_RETURN_IF_ERROR(EncodeFrame(memory_manager, all_params[task],
+      // Only the tree of the variant that is finally encoded is reported.
+      CompressParams variant_params = all_params[task];
+      variant_params.learned_tree = nullptr;
+      variant_params.patch_cache = nullptr;
+      variant_params.xyb_cache = nullptr;
+      variant_params.spare_enc_state = nullptr;
+      JXL_RETURN_IF_ERROR(EncodeFrame(memory_manager, variant_params,
                                       frame_info, metadata, frame_data, cms,
                                       nullptr, &local_output, aux_out));
       size[task] = local_output.CurrentPosition();
@@ -2403,29 +2588,34 @@ Status EncodeFrame(JxlMemoryManager* memory_manager,
     size_t best_idx_test = 0;
 
     if (size_test[0] <= size_test[1]) {
-      all_params = TectonicPlateSettingsLessPalette(cparams_orig);
+      all_params = TectonicPlateSettingsLessPalette(cparams);
     } else {
       best_idx_test = 1;
-      all_params = TectonicPlateSettingsMorePalette(cparams_orig);
+      all_params = TectonicPlateSettingsMorePalette(cparams);
     }
 
-    size.clear();
-    size.resize(all_params.size());
+    if (cparams.PastDeadline()) {
+      // No time left for the second round of trials.
+      cparams = all_params_test[best_idx_test];
+    } else {
+      size.clear();
+      size.resize(all_params.size());
 
-    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, all_params.size(),
-                                  ThreadPool::NoInit, process_variant,
-                                  "Compress kTectonicPlate"));
+      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, all_params.size(),
+                                    ThreadPool::NoInit, process_variant,
+                                    "Compress kTectonicPlate"));
 
-    size_t best_idx = 0;
-    for (size_t i = 1; i < all_params.size(); i++) {
-      if (size[best_idx] > size[i]) {
-        best_idx = i;
+      size_t best_idx = 0;
+      for (size_t i = 1; i < all_params.size(); i++) {
+        if (size[best_idx] > size[i]) {
+          best_idx = i;
+        }
+      }
+      if (size[best_idx] < size_test[best_idx_test]) {
+        cparams = all_params[best_idx];
+      } else {
+        cparams = all_params_test[best_idx_test];
       }
-    }
-    if (size[best_idx] < size_test[best_idx_test]) {
-      cparams = all_params[best_idx];
-    } else {
-      cparams = all_params_test[best_idx_test];
     }
   }
 
@@ -2479,13 +2669,21 @@ Status EncodeFrame(JxlMemoryManager* memory_manager,
   }
 
   if (CanDoStreamingEncoding(cparams, frame_info, *metadata, frame_data)) {
-    return EncodeFrameStreaming(memory_manager, cparams, frame_info, metadata,
-                                frame_data, cms, pool, output_processor,
-                                aux_out);
+    JXL_RETURN_IF_ERROR(EncodeFrameStreaming(memory_manager, cparams,
+                                             frame_info, metadata, frame_data,
+                                             cms, pool, output_processor,
+                                             aux_out));
   } else {
-    return EncodeFrameOneShot(memory_manager, cparams, frame_info, metadata,
-                              frame_data, cms, pool, output_processor, aux_out);
+    JXL_RETURN_IF_ERROR(EncodeFrameOneShot(memory_manager, cparams, frame_info,
+                                           metadata, frame_data, cms, pool,
+                                           output_processor, aux_out));
   }
+  // This frame replaces the patch frame that later frames could refer to.
+  if (cparams.patch_cache != nullptr &&
+      frame_info.save_as_reference == kPatchFrameReferenceId) {
+    cparams.patch_cache->Clear();
+  }
+  return true;
 }
 
 Status EncodeFrame(JxlMemoryManager* memory_manager,
@@ -7,8 +7,13 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <hwy/base.h>
+#include <vector>
 
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
@@ -18,6 +23,13 @@
 
 namespace jxl {
 
+namespace {
+
+// Rows of the image filtered by one task of GaborishInverse.
+constexpr size_t kGaborishStripeRows = 64;
+
+}  // namespace
+
 Status GaborishInverse(Image3F* in_out, const Rect& rect, const float mul[3],
                        ThreadPool* pool) {
   JxlMemoryManager* memory_manager = in_out->memory_manager();
@@ -47,27 +59,74 @@ Status GaborishInverse(Image3F* in_out, const Rect& rect, const float mul[3],
                                    {HWY_REP4(normalize_mul * kGaborish[4])},
                                    {HWY_REP4(normalize_mul * kGaborish[3])}};
   }
-  // Reduce memory footprint by only allocating a single plane and swapping it
-  // into the output Image3F. Better still would be tiling.
-  // Note that we cannot *allocate* a plane, as doing so might cause Image3F to
-  // have planes of different stride. Instead, we copy one plane in a temporary
-  // image and reuse the existing planes of the in/out image.
-  ImageF temp;
-  JXL_ASSIGN_OR_RETURN(temp,
-                       ImageF::Create(memory_manager, in_out->Plane(2).xsize(),
-                                      in_out->Plane(2).ysize()));
-  JXL_RETURN_IF_ERROR(CopyImageTo(in_out->Plane(2), &temp));
-  Rect xrect = rect.Extend(3, Rect(*in_out));
-  JXL_RETURN_IF_ERROR(Symmetric5(in_out->Plane(0), xrect, weights[0], pool,
-                                 &in_out->Plane(2), xrect));
-  JXL_RETURN_IF_ERROR(Symmetric5(in_out->Plane(1), xrect, weights[1], pool,
-                                 &in_out->Plane(0), xrect));
-  JXL_RETURN_IF_ERROR(
-      Symmetric5(temp, xrect, weights[2], pool, &in_out->Plane(1), xrect));
-  // Now planes are 1, 2, 0.
-  in_out->Plane(0).Swap(in_out->Plane(1));
-  // 2 1 0
-  in_out->Plane(0).Swap(in_out->Plane(2));
+  // The image is filtered in place, in stripes of rows that run in parallel.
+  // A stripe also reads the two rows above and below it, which neighbouring
+  // stripes overwrite, so these are saved before any stripe is filtered.
+  // Mirroring at the image borders is resolved at the same time.
+  const Rect xrect = rect.Extend(3, Rect(*in_out));
+  const size_t xsize = in_out->xsize();
+  const int64_t ysize = in_out->ysize();
+  const size_t num_stripes = DivCeil(xrect.ysize(), kGaborishStripeRows);
+  const auto stripe_rows = [&](size_t stripe, size_t* y0, size_t* y1) {
+    *y0 = xrect.y0() + stripe * kGaborishStripeRows;
+    *y1 = std::min(*y0 + kGaborishStripeRows, xrect.y1());
+  };
+  Image3F halo;
+  JXL_ASSIGN_OR_RETURN(
+      halo, Image3F::Create(memory_manager, xsize, 4 * num_stripes));
+  for (size_t stripe = 0; stripe < num_stripes; ++stripe) {
+    size_t y0;
+    size_t y1;
+    stripe_rows(stripe, &y0, &y1);
+    for (size_t i = 0; i < 4; ++i) {
+      const int64_t y = i < 2 ? static_cast<int64_t>(y0 + i) - 2
+                              : static_cast<int64_t>(y1 + i - 2);
+      const size_t src_y = Mirror(y, ysize);
+      for (size_t c = 0; c < 3; ++c) {
+        memcpy(halo.PlaneRow(c, 4 * stripe + i),
+               in_out->ConstPlaneRow(c, src_y), xsize * sizeof(float));
+      }
+    }
+  }
+
+  // One plane of a stripe and its halo, per thread.
+  std::vector<ImageF> stripe_planes;
+  const auto allocate_stripe_planes = [&](const size_t num_threads) -> Status {
+    stripe_planes.resize(num_threads);
+    for (ImageF& plane : stripe_planes) {
+      JXL_ASSIGN_OR_RETURN(plane, ImageF::Create(memory_manager, xsize,
+                                                 kGaborishStripeRows + 4));
+    }
+    return true;
+  };
+  const auto filter_stripe = [&](const uint32_t stripe,
+                                 const size_t thread) -> Status {
+    size_t y0;
+    size_t y1;
+    stripe_rows(stripe, &y0, &y1);
+    const size_t stripe_ysize = y1 - y0;
+    ImageF& plane = stripe_planes[thread];
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t i = 0; i < 2; ++i) {
+        memcpy(plane.Row(i), halo.ConstPlaneRow(c, 4 * stripe + i),
+               xsize * sizeof(float));
+        memcpy(plane.Row(stripe_ysize + 2 + i),
+               halo.ConstPlaneRow(c, 4 * stripe + 2 + i),
+               xsize * sizeof(float));
+      }
+      for (size_t y = y0; y < y1; ++y) {
+        memcpy(plane.Row(y - y0 + 2), in_out->ConstPlaneRow(c, y),
+               xsize * sizeof(float));
+      }
+      JXL_RETURN_IF_ERROR(Symmetric5(
+          plane, Rect(xrect.x0(), 2, xrect.xsize(), stripe_ysize), weights[c],
+          /*pool=*/nullptr, &in_out->Plane(c),
+          Rect(xrect.x0(), y0, xrect.xsize(), stripe_ysize)));
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_stripes, allocate_stripe_planes,
+                                filter_stripe, "GaborishInverse"));
   return true;
 }
 
@@ -5,8 +5,10 @@
 
 #include "lib/jxl/enc_gaborish.h"
 
+#include <jxl/memory_manager.h>
 #include <jxl/types.h>
 
+#include <cstddef>
 #include <hwy/base.h>
 
 #include "lib/jxl/base/compiler_specific.h"
@@ -87,5 +89,38 @@ TEST(GaborishTest, TestFlat) {
   TestRoundTrip(in, 1E-5f);
 }
 
+// The image is filtered in stripes of rows; flipping it vertically moves the
+// stripe boundaries, which must not change the result.
+TEST(GaborishTest, TestStripes) {
+  const size_t xsize = 67;
+  const size_t ysize = 200;
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  JXL_TEST_ASSIGN_OR_DIE(Image3F in,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F flipped,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        const float v = static_cast<float>((x * 7 + y * 13 + c * 5) % 17);
+        in.PlaneRow(c, y)[x] = v;
+        flipped.PlaneRow(c, ysize - 1 - y)[x] = v;
+      }
+    }
+  }
+  test::ThreadPoolForTests pool(4);
+  const float weights[3] = {0.9f, 0.9f, 0.9f};
+  ASSERT_TRUE(GaborishInverse(&in, Rect(in), weights, pool.get()));
+  ASSERT_TRUE(GaborishInverse(&flipped, Rect(flipped), weights, pool.get()));
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        ASSERT_NEAR(in.PlaneRow(c, y)[x],
+                    flipped.PlaneRow(c, ysize - 1 - y)[x], 1e-4f);
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
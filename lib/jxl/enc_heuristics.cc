@@ -56,6 +56,7 @@
 #include "lib/jxl/memory_manager_internal.h"
 #include "lib/jxl/passes_state.h"
 #include "lib/jxl/quant_weights.h"
+#include "lib/jxl/trace.h"
 
 namespace jxl {
 
@@ -927,13 +928,19 @@ Status ComputeARHeuristics(const FrameHeader& frame_header,
     JXL_ASSIGN_OR_RETURN(error_images[val],
                          ImageF::Create(memory_manager, frame_dim.xsize_blocks,
                                         frame_dim.ysize_blocks));
-    for (size_t by = 0; by < frame_dim.ysize_blocks; by++) {
-      float* error_row = error_images[val].Row(by);
+    ImageF& error_image = error_images[val];
+    const auto compute_errors = [&](const uint32_t by,
+                                    size_t /* thread */) -> Status {
+      float* error_row = error_image.Row(by);
       for (size_t bx = 0; bx < frame_dim.xsize_blocks; bx++) {
         error_row[bx] = ComputeBlockL2Distance(
             orig_opsin, decoded, initial_quant_masking1x1, by, bx);
       }
-    }
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, frame_dim.ysize_blocks,
+                                  ThreadPool::NoInit, compute_errors,
+                                  "ARErrors"));
   }
   std::vector<std::vector<size_t>> histo(9, std::vector<size_t>(kNumEPFVals));
   std::vector<size_t> totals(9, 1);
@@ -1014,6 +1021,7 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
                             const Image3F* linear, Image3F* opsin,
                             const Rect& rect, const JxlCmsInterface& cms,
                             ThreadPool* pool, AuxOut* aux_out) {
+  JXL_TRACE_SCOPE(kEncoderHeuristics);
   const CompressParams& cparams = enc_state->cparams;
   const bool streaming_mode = enc_state->streaming_mode;
   const bool initialize_global_state = enc_state->initialize_global_state;
@@ -41,6 +41,7 @@
 #include "lib/jxl/modular/transform/enc_transform.h"
 #include "lib/jxl/pack_signed.h"
 #include "lib/jxl/quant_weights.h"
+#include "lib/jxl/trace.h"
 #include "modular/options.h"
 
 namespace jxl {
@@ -107,9 +108,10 @@ Status MergeTrees(const std::vector<Tree>& trees,
   return true;
 }
 
-void QuantizeChannel(Channel& ch, const int q) {
-  if (q == 1) return;
-  for (size_t y = 0; y < ch.plane.ysize(); y++) {
+Status QuantizeChannel(Channel& ch, const int q, ThreadPool* pool) {
+  if (q == 1) return true;
+  const auto quantize_row = [&](const uint32_t y,
+                                size_t /* thread */) -> Status {
     pixel_type* row = ch.plane.Row(y);
     for (size_t x = 0; x < ch.plane.xsize(); x++) {
       if (row[x] < 0) {
@@ -118,7 +120,11 @@ void QuantizeChannel(Channel& ch, const int q) {
         row[x] = ((row[x] + q / 2) / q) * q;
       }
     }
-  }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ch.plane.ysize(), ThreadPool::NoInit,
+                                quantize_row, "QuantizeChannel"));
+  return true;
 }
 
 // convert binary32 float that corresponds to custom [bits]-bit float (with
@@ -248,7 +254,9 @@ float EstimateWPCost(const Image& img, size_t i) {
   return histo_cost + extra_bits;
 }
 
-float EstimateCost(const Image& img) {
+// Estimates the cost of the rows y of `img` with y % row_stride equal to
+// row_stride - 1.
+float EstimateCost(const Image& img, size_t row_stride = 1) {
   // TODO(veluca): consider SIMDfication of this code.
   size_t extra_bits = 0;
   float histo_cost = 0;
@@ -259,7 +267,7 @@ float EstimateCost(const Image& img) {
   Histogram histo[nc] = {};
   for (const Channel& ch : img.channel) {
     const intptr_t onerow = ch.plane.PixelsPerRow();
-    for (size_t y = 0; y < ch.h; y++) {
+    for (size_t y = row_stride - 1; y < ch.h; y += row_stride) {
       const pixel_type* JXL_RESTRICT r = ch.Row(y);
       for (size_t x = 0; x < ch.w; x++) {
         pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
@@ -288,6 +296,32 @@ float EstimateCost(const Image& img) {
   return histo_cost + extra_bits;
 }
 
+// Copies the rows y - 1 and y of `num_c` channels of `img` starting at
+// `begin_c`, for each y that is rate - 1 modulo `rate`. The cost of the second
+// row of each pair (see EstimateCost with a row stride of 2) is the same as in
+// `img`, also after a transform that does not mix pixels, such as an RCT.
+StatusOr<Image> SampleRowPairs(const Image& img, size_t begin_c, size_t num_c,
+                               size_t rate) {
+  JXL_ENSURE(rate > 1);
+  const Channel& first = img.channel[begin_c];
+  const size_t num_pairs = first.h / rate;
+  JXL_ASSIGN_OR_RETURN(Image sample,
+                       Image::Create(img.memory_manager(), first.w,
+                                     2 * num_pairs, img.bitdepth, num_c));
+  for (size_t c = 0; c < num_c; c++) {
+    const Channel& ch = img.channel[begin_c + c];
+    JXL_ENSURE(ch.w == first.w && ch.h == first.h);
+    for (size_t i = 0; i < num_pairs; i++) {
+      size_t y = (i + 1) * rate - 1;
+      memcpy(sample.channel[c].Row(2 * i), ch.Row(y - 1),
+             ch.w * sizeof(pixel_type));
+      memcpy(sample.channel[c].Row(2 * i + 1), ch.Row(y),
+             ch.w * sizeof(pixel_type));
+    }
+  }
+  return sample;
+}
+
 bool do_transform(Image& image, const Transform& tr,
                   const weighted::Header& wp_header,
                   jxl::ThreadPool* pool = nullptr, bool force_jxlart = false) {
@@ -324,9 +358,10 @@ bool maybe_do_transform(Image& image, const Transform& tr,
   return did_it;
 }
 
-void try_palettes(Image& gi, int& max_bitdepth, int& maxval,
-                  const CompressParams& cparams_, float channel_colors_percent,
-                  jxl::ThreadPool* pool = nullptr) {
+Status try_palettes(Image& gi, int& max_bitdepth, int& maxval,
+                    const CompressParams& cparams_,
+                    float channel_colors_percent,
+                    jxl::ThreadPool* pool = nullptr) {
   float cost_before = 0.f;
   size_t did_palette = 0;
   float nb_pixels = gi.channel[0].w * gi.channel[0].h;
@@ -400,7 +435,8 @@ void try_palettes(Image& gi, int& max_bitdepth, int& maxval,
     for (size_t i = did_palette; i < nb_channels + did_palette; i++) {
       int32_t min;
       int32_t max;
-      compute_minmax(gi.channel[gi.nb_meta_channels + i], &min, &max);
+      JXL_RETURN_IF_ERROR(
+          compute_minmax(gi.channel[gi.nb_meta_channels + i], &min, &max, pool));
       int64_t colors = static_cast<int64_t>(max) - min + 1;
       JXL_DEBUG_V(10, "Channel %" PRIuS ": range=%i..%i", i, min, max);
       Transform maybe_palette_1(TransformId::kPalette);
@@ -416,7 +452,8 @@ void try_palettes(Image& gi, int& max_bitdepth, int& maxval,
       if (maybe_do_transform(gi, maybe_palette_1, cparams_, weighted::Header(),
                              cost_before, pool)) {
         // effective bit depth is lower, adjust quantization accordingly
-        compute_minmax(gi.channel[gi.nb_meta_channels + i], &min, &max);
+        JXL_RETURN_IF_ERROR(compute_minmax(gi.channel[gi.nb_meta_channels + i],
+                                           &min, &max, pool));
         if (max < maxval) maxval = max;
         int ch_bitdepth =
             (max > 0 ? CeilLog2Nonzero(static_cast<uint32_t>(max)) : 0);
@@ -426,6 +463,59 @@ void try_palettes(Image& gi, int& max_bitdepth, int& maxval,
       }
     }
   }
+  return true;
+}
+
+// Runs CollectPixelSamples on the streams [start, stop) using `pool`, and
+// appends the samples in stream order, so that the result is the same as
+// collecting them serially.
+Status CollectStreamPixelSamples(const std::vector<Image>& stream_images,
+                                 const std::vector<ModularOptions>& options,
+                                 uint32_t start, uint32_t stop,
+                                 ThreadPool* pool,
+                                 std::vector<uint32_t>& group_pixel_count,
+                                 std::vector<uint32_t>& channel_pixel_count,
+                                 std::vector<pixel_type>& pixel_samples,
+                                 std::vector<pixel_type>& diff_samples) {
+  struct StreamSamples {
+    std::vector<uint32_t> group_pixel_count;
+    std::vector<uint32_t> channel_pixel_count;
+    std::vector<pixel_type> pixel_samples;
+    std::vector<pixel_type> diff_samples;
+  };
+  std::vector<StreamSamples> samples(stop - start);
+  const auto collect = [&](const uint32_t i, size_t /* thread */) -> Status {
+    StreamSamples& out = samples[i - start];
+    CollectPixelSamples(stream_images[i], options[i], i, out.group_pixel_count,
+                        out.channel_pixel_count, out.pixel_samples,
+                        out.diff_samples);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, start, stop, ThreadPool::NoInit, collect,
+                                "CollectPixelSamples"));
+  size_t num_samples = pixel_samples.size();
+  for (const StreamSamples& s : samples) num_samples += s.pixel_samples.size();
+  pixel_samples.reserve(num_samples);
+  diff_samples.reserve(num_samples);
+  for (const StreamSamples& s : samples) {
+    if (group_pixel_count.size() < s.group_pixel_count.size()) {
+      group_pixel_count.resize(s.group_pixel_count.size());
+    }
+    for (size_t i = 0; i < s.group_pixel_count.size(); i++) {
+      group_pixel_count[i] += s.group_pixel_count[i];
+    }
+    if (channel_pixel_count.size() < s.channel_pixel_count.size()) {
+      channel_pixel_count.resize(s.channel_pixel_count.size());
+    }
+    for (size_t i = 0; i < s.channel_pixel_count.size(); i++) {
+      channel_pixel_count[i] += s.channel_pixel_count[i];
+    }
+    pixel_samples.insert(pixel_samples.end(), s.pixel_samples.begin(),
+                         s.pixel_samples.end());
+    diff_samples.insert(diff_samples.end(), s.diff_samples.begin(),
+                        s.diff_samples.end());
+  }
+  return true;
 }
 
 }  // namespace
@@ -473,6 +563,12 @@ Status ModularFrameEncoder::Init(const FrameHeader& frame_header,
       }
     }
   }
+  if (cparams_.decoding_speed_tier >= 2 &&
+      !cparams_.ModularPartIsLossless()) {
+    // Keep lossy trees off the weighted predictor, which has no fast path
+    // combined with other properties.
+    cparams_.options.wp_tree_mode = ModularOptions::TreeMode::kNoWP;
+  }
   if (cparams_.decoding_speed_tier >= 1 && cparams_.responsive &&
       cparams_.ModularPartIsLossless()) {
     cparams_.options.tree_kind =
@@ -625,13 +721,38 @@ Status ModularFrameEncoder::Init(const FrameHeader& frame_header,
   cparams_.options.max_chan_size = frame_dim_.group_dim;
   cparams_.options.group_dim = frame_dim_.group_dim;
 
+  if (cparams_.speed_tier == SpeedTier::kThunder && cparams_.modular_mode &&
+      cparams_.ModularPartIsLossless() && !cparams_.responsive &&
+      cparams_.decoding_speed_tier == 0 &&
+      cparams_.options.predictor == Predictor::Gradient &&
+      cparams_.options.tree_kind == ModularOptions::TreeKind::kLearn) {
+    // Learning the local trees would take most of the encoding time: use
+    // fixed trees instead, only choosing the predictors.
+    cparams_.options.tree_kind =
+        ModularOptions::TreeKind::kFixedChosenPredictor;
+  }
+  const CodecMetadata* metadata = frame_header.nonserialized_metadata;
+  if (cparams_.speed_tier == SpeedTier::kFalcon && cparams_.modular_mode &&
+      cparams_.ModularPartIsLossless() && !cparams_.responsive &&
+      cparams_.decoding_speed_tier == 0 &&
+      cparams_.options.predictor == Predictor::Weighted &&
+      cparams_.options.tree_kind == ModularOptions::TreeKind::kLearn &&
+      metadata != nullptr && metadata->m.color_encoding.IsGray() &&
+      metadata->m.bit_depth.bits_per_sample > 8) {
+    // Same for high bit depth grayscale, e.g. medical images, where the fixed
+    // trees lose little: choose between the weighted predictor and the simple
+    // ones.
+    cparams_.options.tree_kind =
+        ModularOptions::TreeKind::kFixedChosenPredictor;
+  }
+
   // TODO(veluca): figure out how to use different predictor sets per channel.
   stream_options_.resize(num_streams, cparams_.options);
 
   stream_options_[0] = cparams_.options;
   if (cparams_.speed_tier == SpeedTier::kFalcon) {
     stream_options_[0].tree_kind = ModularOptions::TreeKind::kWPFixedDC;
-  } else if (cparams_.speed_tier == SpeedTier::kThunder) {
+  } else if (cparams_.speed_tier >= SpeedTier::kThunder) {
     stream_options_[0].tree_kind = ModularOptions::TreeKind::kGradientFixedDC;
   }
   stream_options_[0].histogram_params =
@@ -745,7 +866,8 @@ Status ModularFrameEncoder::ComputeEncodingData(
         factor = enc_state->shared.matrices.InvDCQuant(c);
       if (c == 2 && cparams_.color_transform == ColorTransform::kXYB) {
         JXL_ENSURE(!fp);
-        for (size_t y = 0; y < ysize; ++y) {
+        const auto process_row = [&](const uint32_t y,
+                                     size_t /* thread */) -> Status {
           const float* const JXL_RESTRICT row_in = color->PlaneRow(c, y);
           pixel_type* const JXL_RESTRICT row_out = gi.channel[c_out].Row(y);
           pixel_type* const JXL_RESTRICT row_Y = gi.channel[0].Row(y);
@@ -754,7 +876,10 @@ Status ModularFrameEncoder::ComputeEncodingData(
             row_out[x] = row_in[x] * factor + 0.5f;
             row_out[x] -= row_Y[x];
           }
-        }
+          return true;
+        };
+        JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize, ThreadPool::NoInit,
+                                      process_row, "float2int"));
       } else {
         int bits = metadata.bit_depth.bits_per_sample;
         int exp_bits = metadata.bit_depth.exponent_bits_per_sample;
@@ -843,8 +968,8 @@ Status ModularFrameEncoder::ComputeEncodingData(
     channel_colors_percent = cparams_.channel_colors_pre_transform_percent;
   }
   if (!groupwise) {
-    try_palettes(gi, max_bitdepth, maxval, cparams_, channel_colors_percent,
-                 pool);
+    JXL_RETURN_IF_ERROR(try_palettes(gi, max_bitdepth, maxval, cparams_,
+                                     channel_colors_percent, pool));
   }
 
   // don't do an RCT if we're short on bits
@@ -958,7 +1083,7 @@ Status ModularFrameEncoder::ComputeEncodingData(
         }
       }
       if (q < 1) q = 1;
-      QuantizeChannel(gi.channel[i], q);
+      JXL_RETURN_IF_ERROR(QuantizeChannel(gi.channel[i], q, pool));
       quants_[i] = q;
     }
   }
@@ -1038,6 +1163,10 @@ Status ModularFrameEncoder::ComputeEncodingData(
 }
 
 Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
+  // See the sampling of the groups in process_chunk below.
+  constexpr size_t kMinTreeSampleStreams = 8;
+  constexpr size_t kMaxTreeSampleStride = 8;
+  constexpr float kTreeSampleConvergence = 0.01f;
   std::vector<ModularMultiplierInfo> multiplier_info;
   if (!quants_.empty()) {
     for (uint32_t stream_id = 0; stream_id < stream_images_.size();
@@ -1119,9 +1248,11 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
     useful_splits.push_back(tree_splits_.back());
 
     std::vector<Tree> trees(useful_splits.size() - 1);
+    // With a single tree, learn it on the pool instead of running the only
+    // chunk on it.
+    ThreadPool* learn_pool = trees.size() == 1 ? pool : nullptr;
     const auto process_chunk = [&](const uint32_t chunk,
                                    size_t /* thread */) -> Status {
-      // TODO(veluca): parallelize more.
       size_t total_pixels = 0;
       uint32_t start = useful_splits[chunk];
       uint32_t stop = useful_splits[chunk + 1];
@@ -1145,6 +1276,8 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
       JXL_RETURN_IF_ERROR(tree_samples.SetProperties(
           stream_options_[start].splitting_heuristics_properties,
           stream_options_[start].wp_tree_mode));
+      tree_samples.SetMemoryLimit(
+          stream_options_[start].max_tree_learning_memory);
       uint32_t max_c = 0;
       std::vector<pixel_type> pixel_samples;
       std::vector<pixel_type> diff_samples;
@@ -1152,10 +1285,10 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
       std::vector<uint32_t> channel_pixel_count;
       for (uint32_t i = start; i < stop; i++) {
         max_c = std::max<uint32_t>(stream_images_[i].channel.size(), max_c);
-        CollectPixelSamples(stream_images_[i], stream_options_[i], i,
-                            group_pixel_count, channel_pixel_count,
-                            pixel_samples, diff_samples);
       }
+      JXL_RETURN_IF_ERROR(CollectStreamPixelSamples(
+          stream_images_, stream_options_, start, stop, learn_pool,
+          group_pixel_count, channel_pixel_count, pixel_samples, diff_samples));
       StaticPropRange range;
       range[0] = {{0, max_c}};
       range[1] = {{start, stop}};
@@ -1164,24 +1297,62 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
           range, multiplier_info, group_pixel_count, channel_pixel_count,
           pixel_samples, diff_samples,
           stream_options_[start].max_property_values);
-      for (size_t i = start; i < stop; i++) {
-        JXL_RETURN_IF_ERROR(
-            ModularGenericCompress(stream_images_[i], stream_options_[i],
-                                   /*writer=*/nullptr,
-                                   /*aux_out=*/nullptr, LayerType::Header, i,
-                                   &tree_samples, &total_pixels));
+      // At the faster efforts, a fraction of the groups is often enough to
+      // learn the tree. The samples are then gathered from every 8th, 4th, 2nd
+      // and finally every group, and the gathering stops once the tree learned
+      // from more groups is not significantly better on the samples than the
+      // previous one.
+      size_t stride = 1;
+      if (cparams_.speed_tier >= SpeedTier::kWombat &&
+          cparams_.speed_tier <= SpeedTier::kCheetah &&
+          cparams_.ModularPartIsLossless()) {
+        while (stride < kMaxTreeSampleStride &&
+               (stop - start) / (2 * stride) >= kMinTreeSampleStreams) {
+          stride *= 2;
+        }
+      }
+      Tree previous_tree;
+      for (bool first_round = true;; first_round = false, stride /= 2) {
+        for (size_t i = start; i < stop; i += stride) {
+          // Already gathered in the previous round.
+          if (!first_round && (i - start) % (2 * stride) == 0) continue;
+          JXL_RETURN_IF_ERROR(
+              ModularGenericCompress(stream_images_[i], stream_options_[i],
+                                     /*writer=*/nullptr,
+                                     /*aux_out=*/nullptr, LayerType::Header, i,
+                                     &tree_samples, &total_pixels));
+        }
+        if (stride == 1) break;
+        JXL_ASSIGN_OR_RETURN(
+            Tree tree, LearnTree(TreeSamples(tree_samples), total_pixels,
+                                 stream_options_[start], multiplier_info,
+                                 range, learn_pool));
+        if (!first_round &&
+            EstimateTreeCost(tree_samples, previous_tree) <=
+                EstimateTreeCost(tree_samples, tree) *
+                    (1 + kTreeSampleConvergence)) {
+          JXL_DEBUG_V(3, "Tree learned from every %" PRIuS "th group",
+                      stride);
+          trees[chunk] = std::move(tree);
+          return true;
+        }
+        previous_tree = std::move(tree);
       }
 
-      // TODO(veluca): parallelize more.
       JXL_ASSIGN_OR_RETURN(
           trees[chunk],
           LearnTree(std::move(tree_samples), total_pixels,
-                    stream_options_[start], multiplier_info, range));
+                    stream_options_[start], multiplier_info, range,
+                    learn_pool));
       return true;
     };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, useful_splits.size() - 1,
-                                  ThreadPool::NoInit, process_chunk,
-                                  "LearnTrees"));
+    if (learn_pool) {
+      JXL_RETURN_IF_ERROR(process_chunk(0, 0));
+    } else {
+      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, useful_splits.size() - 1,
+                                    ThreadPool::NoInit, process_chunk,
+                                    "LearnTrees"));
+    }
     tree_.clear();
     JXL_RETURN_IF_ERROR(
         MergeTrees(trees, useful_splits, 0, useful_splits.size() - 1, &tree_));
@@ -1212,6 +1383,7 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
   JXL_RETURN_IF_ERROR(TokenizeTree(tree_, tree_tokens_.data(), &decoded_tree));
   JXL_ENSURE(tree_.size() == decoded_tree.size());
   tree_ = std::move(decoded_tree);
+  if (cparams_.learned_tree) *cparams_.learned_tree = tree_;
 
   /* TODO(szabadka) Add text output callback to cparams
   if (kPrintTree && WantDebugOutput(aux_out)) {
@@ -1226,6 +1398,7 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
 }
 
 Status ModularFrameEncoder::ComputeTokens(ThreadPool* pool) {
+  JXL_TRACE_SCOPE(kTokenize);
   size_t num_streams = stream_images_.size();
   stream_headers_.resize(num_streams);
   tokens_.resize(num_streams);
@@ -1242,6 +1415,12 @@ Status ModularFrameEncoder::ComputeTokens(ThreadPool* pool) {
         /*tree=*/&tree_, /*header=*/&stream_headers_[stream_id],
         /*tokens=*/&tokens_[stream_id],
         /*widths=*/&image_widths_[stream_id]));
+    // Only the tokens are needed from now on, so the samples of the stream can
+    // be released before tokenizing the remaining ones. The channels are kept
+    // as they tell EncodeStream whether the stream is empty.
+    for (Channel& ch : stream_images_[stream_id].channel) {
+      ch.plane = ImageI();
+    }
     return true;
   };
   JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_streams, ThreadPool::NoInit,
@@ -1267,6 +1446,15 @@ Status ModularFrameEncoder::EncodeGlobalInfo(bool streaming_mode,
       }));
   if (skip_rest) return true;
 
+  if (aux_out != nullptr) {
+    for (const PropertyDecisionNode& node : tree_) {
+      if (node.property == static_cast<int>(kWPProp) ||
+          (node.property == -1 && node.predictor == Predictor::Weighted)) {
+        aux_out->num_wp_tree_nodes++;
+      }
+    }
+  }
+
   // Write tree
   HistogramParams params =
       HistogramParams::ForModular(cparams_, extra_dc_precision, streaming_mode);
@@ -1293,6 +1481,9 @@ Status ModularFrameEncoder::EncodeGlobalInfo(bool streaming_mode,
                                tokens_, &code_, &context_map_, writer,
                                LayerType::ModularGlobal, aux_out));
   (void)cost;
+  if (aux_out != nullptr && !code_.use_prefix_code) {
+    aux_out->num_ans_histograms += code_.encoding_info.size();
+  }
   return true;
 }
 
@@ -1402,7 +1593,8 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
       if (!(cparams_.responsive && cparams_.decoding_speed_tier >= 1)) {
         channel_color_percent = cparams_.channel_colors_percent;
       }
-      try_palettes(gi, max_bitdepth, maxval, cparams_, channel_color_percent);
+      JXL_RETURN_IF_ERROR(try_palettes(gi, max_bitdepth, maxval, cparams_,
+                                       channel_color_percent));
     }
   }
 
@@ -1441,6 +1633,28 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
         nb_rcts_to_try = 19;
         break;
     }
+    size_t rct_sampling = cparams_.rct_sampling;
+    if (cparams_.rct_sampling == -1) {
+      rct_sampling = cparams_.speed_tier <= SpeedTier::kTortoise ? 1 : 4;
+    }
+    // The candidates are tried on a sample of the rows of the color channels
+    // if they have the same size and the sample is not too small.
+    constexpr size_t kMinSampledRows = 16;
+    const Channel& c0 = gi.channel[sg.begin_c];
+    bool sampled = rct_sampling > 1 && c0.h / rct_sampling >= kMinSampledRows;
+    for (size_t c = 1; c < 3; c++) {
+      const Channel& ch = gi.channel[sg.begin_c + c];
+      sampled &= ch.w == c0.w && ch.h == c0.h;
+    }
+    Image sample(memory_manager);
+    if (sampled) {
+      JXL_ASSIGN_OR_RETURN(sample,
+                           SampleRowPairs(gi, sg.begin_c, 3, rct_sampling));
+    }
+    Image& trial_image = sampled ? sample : gi;
+    Transform trial_sg = sg;
+    trial_sg.begin_c = trial_image.nb_meta_channels;
+    const size_t row_stride = sampled ? 2 : 1;
     float best_cost = std::numeric_limits<float>::max();
     size_t best_rct = 0;
     // These should be 19 actually different transforms; the remaining ones
@@ -1452,17 +1666,18 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
                   1 * 7 + 2, 2 * 7 + 1, 2 * 7 + 2, 2 * 7 + 3, 4 * 7 + 4,
                   4 * 7 + 5, 0 * 7 + 2, 0 * 7 + 1, 0 * 7 + 3}) {
       if (nb_rcts_to_try == 0) break;
-      sg.rct_type = i;
+      trial_sg.rct_type = i;
       nb_rcts_to_try--;
-      if (do_transform(gi, sg, weighted::Header())) {
-        float cost = EstimateCost(gi);
+      if (do_transform(trial_image, trial_sg, weighted::Header())) {
+        float cost = EstimateCost(trial_image, row_stride);
         if (cost < best_cost) {
           best_rct = i;
           best_cost = cost;
         }
-        Transform t = gi.transform.back();
-        JXL_RETURN_IF_ERROR(t.Inverse(gi, weighted::Header(), nullptr));
-        gi.transform.pop_back();
+        Transform t = trial_image.transform.back();
+        JXL_RETURN_IF_ERROR(
+            t.Inverse(trial_image, weighted::Header(), nullptr));
+        trial_image.transform.pop_back();
       }
     }
     // Apply the best RCT to the image for future encoding.
@@ -1544,7 +1759,8 @@ Status ModularFrameEncoder::AddVarDCTDC(const FrameHeader& frame_header,
         ModularOptions::TreeMode::kDefault;
     stream_options_[stream_id].tree_kind = ModularOptions::TreeKind::kLearn;
   }
-  if (cparams_.decoding_speed_tier >= 1) {
+  if (cparams_.decoding_speed_tier >= 1 ||
+      cparams_.speed_tier >= SpeedTier::kLightning) {
     stream_options_[stream_id].tree_kind =
         ModularOptions::TreeKind::kGradientFixedDC;
   }
@@ -10,7 +10,11 @@
 #include <cstdlib>
 #include <numeric>
 #include <utility>
+#include <vector>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_optimize.h"
@@ -117,23 +121,41 @@ class NoiseHistogram {
   uint32_t bins[kBins];
 };
 
-std::vector<float> GetSADScoresForPatches(const Image3F& opsin,
-                                          const size_t block_s,
-                                          const size_t num_bin,
-                                          NoiseHistogram* sad_histogram) {
-  std::vector<float> sad_scores(
-      (opsin.ysize() / block_s) * (opsin.xsize() / block_s), 0.0f);
+// Patches of large images are only analyzed on every `row_step`-th row of
+// patches, so that at most about this many patches are analyzed.
+constexpr size_t kMaxNoisePatches = size_t{1} << 16;
 
-  int block_index = 0;
+size_t NoisePatchRowStep(const Image3F& opsin, const size_t block_s) {
+  const size_t num_patches =
+      (opsin.ysize() / block_s) * (opsin.xsize() / block_s);
+  return std::max<size_t>(1, DivCeil(num_patches, kMaxNoisePatches));
+}
 
-  for (size_t y = 0; y + block_s <= opsin.ysize(); y += block_s) {
-    for (size_t x = 0; x + block_s <= opsin.xsize(); x += block_s) {
-      float sad_sc = GetScoreSumsOfAbsoluteDifferences(opsin, x, y, block_s);
-      sad_scores[block_index++] = sad_sc;
-      sad_histogram->Increment(sad_sc * num_bin);
+Status GetSADScoresForPatches(const Image3F& opsin, const size_t block_s,
+                              const size_t row_step, const size_t num_bin,
+                              ThreadPool* pool, NoiseHistogram* sad_histogram,
+                              std::vector<float>* sad_scores) {
+  const size_t patches_per_row = opsin.xsize() / block_s;
+  const size_t num_rows = DivCeil(opsin.ysize() / block_s, row_step);
+  sad_scores->assign(num_rows * patches_per_row, 0.0f);
+
+  const auto process_row = [&](const uint32_t row,
+                               size_t /*thread*/) -> Status {
+    const size_t y = row * row_step * block_s;
+    float* JXL_RESTRICT row_scores = sad_scores->data() + row * patches_per_row;
+    for (size_t i = 0; i < patches_per_row; ++i) {
+      row_scores[i] =
+          GetScoreSumsOfAbsoluteDifferences(opsin, i * block_s, y, block_s);
     }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(num_rows),
+                                ThreadPool::NoInit, process_row,
+                                "NoiseSADScores"));
+  for (const float sad_sc : *sad_scores) {
+    sad_histogram->Increment(sad_sc * num_bin);
   }
-  return sad_scores;
+  return true;
 }
 
 float GetSADThreshold(const NoiseHistogram& histogram, const int num_bin) {
@@ -226,11 +248,11 @@ void OptimizeNoiseParameters(const std::vector<NoiseLevel>& noise_level,
   }
 }
 
-std::vector<NoiseLevel> GetNoiseLevel(
-    const Image3F& opsin, const std::vector<float>& texture_strength,
-    const float threshold, const size_t block_s) {
-  std::vector<NoiseLevel> noise_level_per_intensity;
-
+Status GetNoiseLevel(const Image3F& opsin,
+                     const std::vector<float>& texture_strength,
+                     const float threshold, const size_t block_s,
+                     const size_t row_step, ThreadPool* pool,
+                     std::vector<NoiseLevel>* noise_level_per_intensity) {
   const int filt_size = 1;
   static const float kLaplFilter[filt_size * 2 + 1][filt_size * 2 + 1] = {
       {-0.25f, -1.0f, -0.25f},
@@ -240,9 +262,16 @@ std::vector<NoiseLevel> GetNoiseLevel(
 
   // The noise model is built based on channel 0.5 * (X+Y) as we notice that it
   // is similar to the model 0.5 * (Y-X)
-  size_t patch_index = 0;
-
-  for (size_t y = 0; y + block_s <= opsin.ysize(); y += block_s) {
+  const size_t patches_per_row = opsin.xsize() / block_s;
+  const size_t num_rows = DivCeil(opsin.ysize() / block_s, row_step);
+  // The levels of each row of patches are kept apart and concatenated in
+  // order, so that the result does not depend on the number of threads.
+  std::vector<std::vector<NoiseLevel>> row_levels(num_rows);
+
+  const auto process_row = [&](const uint32_t row,
+                               size_t /*thread*/) -> Status {
+    const size_t y = row * row_step * block_s;
+    size_t patch_index = row * patches_per_row;
     for (size_t x = 0; x + block_s <= opsin.xsize(); x += block_s) {
       if (texture_strength[patch_index] <= threshold) {
         // Calculate mean value
@@ -307,12 +336,21 @@ std::vector<NoiseLevel> GetNoiseLevel(
         NoiseLevel nl;
         nl.intensity = mean_int;
         nl.noise_level = noise_level;
-        noise_level_per_intensity.push_back(nl);
+        row_levels[row].push_back(nl);
       }
       ++patch_index;
     }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(num_rows),
+                                ThreadPool::NoInit, process_row,
+                                "NoiseLevel"));
+  noise_level_per_intensity->clear();
+  for (const auto& levels : row_levels) {
+    noise_level_per_intensity->insert(noise_level_per_intensity->end(),
+                                      levels.begin(), levels.end());
   }
-  return noise_level_per_intensity;
+  return true;
 }
 
 Status EncodeFloatParam(float val, float precision, BitWriter* writer) {
@@ -326,7 +364,7 @@ Status EncodeFloatParam(float val, float precision, BitWriter* writer) {
 }  // namespace
 
 Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
-                         float quality_coef) {
+                         float quality_coef, ThreadPool* pool) {
   // The size of a patch in decoder might be different from encoder's patch
   // size.
   // For encoder: the patch size should be big enough to estimate
@@ -334,9 +372,11 @@ Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
   //              to be able to estimate intensity value of the patch
   const size_t block_s = 8;
   const size_t kNumBin = 256;
+  const size_t row_step = NoisePatchRowStep(opsin, block_s);
   NoiseHistogram sad_histogram;
-  std::vector<float> sad_scores =
-      GetSADScoresForPatches(opsin, block_s, kNumBin, &sad_histogram);
+  std::vector<float> sad_scores;
+  JXL_RETURN_IF_ERROR(GetSADScoresForPatches(
+      opsin, block_s, row_step, kNumBin, pool, &sad_histogram, &sad_scores));
   float sad_threshold = GetSADThreshold(sad_histogram, kNumBin);
   // If threshold is too large, the image has a strong pattern. This pattern
   // fools our model and it will add too much noise. Therefore, we do not add
@@ -345,8 +385,9 @@ Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
     noise_params->Clear();
     return false;
   }
-  std::vector<NoiseLevel> nl =
-      GetNoiseLevel(opsin, sad_scores, sad_threshold, block_s);
+  std::vector<NoiseLevel> nl;
+  JXL_RETURN_IF_ERROR(GetNoiseLevel(opsin, sad_scores, sad_threshold, block_s,
+                                    row_step, pool, &nl));
 
   OptimizeNoiseParameters(nl, noise_params);
   for (float& i : noise_params->lut) {
@@ -10,6 +10,7 @@
 
 #include <cstdint>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/image.h"
@@ -23,7 +24,7 @@ enum class LayerType : uint8_t;
 // Get parameters of the noise for NoiseParams model
 // Returns whether a valid noise model (with HasAny()) is set.
 Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
-                         float quality_coef);
+                         float quality_coef, ThreadPool* pool);
 
 // Does not write anything if `noise_params` are empty. Otherwise, caller must
 // set FrameHeader.flags.kNoise.
@@ -12,6 +12,8 @@
 #include <jxl/encode.h>
 #include <stddef.h>
 
+#include <chrono>
+#include <cstdint>
 #include <vector>
 
 #include "lib/jxl/base/override.h"
@@ -25,6 +27,10 @@
 
 namespace jxl {
 
+class PatchReferenceCache;
+struct PassesEncoderState;
+class XybCache;
+
 // NOLINTNEXTLINE(clang-analyzer-optin.performance.Padding)
 struct CompressParams {
   float butteraugli_distance = 1.0f;
@@ -47,6 +53,22 @@ struct CompressParams {
   // 4 = fastest speed, lowest quality
   size_t decoding_speed_tier = 0;
 
+  // Entropy code all tokens of the frame with prefix codes instead of ANS.
+  bool force_prefix_codes = false;
+
+  // Time budget for encoding a frame in milliseconds, -1 for none. EncodeFrame
+  // turns it into `deadline`, after which the iterative refinements stop.
+  int64_t time_budget_ms = -1;
+  std::chrono::steady_clock::time_point deadline;
+
+  bool PastDeadline() const {
+    return time_budget_ms >= 0 && std::chrono::steady_clock::now() >= deadline;
+  }
+
+  // Use the cheaper ButteraugliComparator::DiffmapApproximate in all but the
+  // last iteration of the butteraugli quantization loop.
+  bool approximate_butteraugli = false;
+
   ColorTransform color_transform = ColorTransform::kXYB;
 
   // If true, the "modular mode options" members below are used.
@@ -71,6 +93,8 @@ struct CompressParams {
 
   // Put center groups first in the bitstream.
   bool centerfirst = false;
+  // Put the groups of each DC group together in the bitstream.
+  bool tiled_group_order = false;
 
   // Pixel coordinates of the center. First group will contain that center.
   size_t center_x = static_cast<size_t>(-1);
@@ -106,6 +130,14 @@ struct CompressParams {
   // exposure for a given ISO setting on a 35mm camera.
   float photon_noise_iso = 0;
 
+  // If positive, the global quantization of VarDCT frames is searched so that
+  // the maximum butteraugli distance of the decoded frame is at most this.
+  float target_butteraugli_score = 0.0f;
+
+  // In [0, 1]. Larger values skip more of the larger AC strategy candidates in
+  // areas where the best 8x8 transforms are smaller than 8x8.
+  float ac_strategy_pruning = 0.0f;
+
   // modular mode options below
   ModularOptions options;
 
@@ -120,6 +152,9 @@ struct CompressParams {
   float channel_colors_percent = 80.f;
   int palette_colors = 1 << 10;  // up to 10-bit palette is probably worthwhile
   bool lossy_palette = false;
+  // The cost of per-group RCT candidates is estimated on one out of every
+  // rct_sampling rows; -1 chooses based on the speed tier.
+  int rct_sampling = -1;
 
   // Returns whether these params are lossless as defined by SetLossless();
   bool IsLossless() const { return modular_mode && ModularPartIsLossless(); }
@@ -169,6 +204,9 @@ struct CompressParams {
 
   // See JXL_ENC_FRAME_SETTING_BUFFERING option value.
   int buffering = -1;
+  // Bytes the encoder may have in use at once, see JxlEncoderSetMemoryLimit;
+  // 0 if unlimited.
+  uint64_t memory_limit = 0;
   // See JXL_ENC_FRAME_SETTING_USE_FULL_IMAGE_HEURISTICS option value.
   bool use_full_image_heuristics = true;
 
@@ -176,8 +214,22 @@ struct CompressParams {
   std::vector<float> manual_xyb_factors;
 
   // If not empty, this tree will be used for dc global section.
-  // Used in jxl_from_tree tool.
+  // Used in jxl_from_tree tool and by JxlEncoderFrameSettingsSetModularTree.
   Tree custom_fixed_tree;
+  // If not null, receives the global MA tree of the frame, if it has one.
+  // Used by JxlEncoderGetModularTree.
+  Tree* learned_tree = nullptr;
+  // If not null, patch frames are shared with the previous frames that were
+  // encoded with the same cache, when possible. Used by the JxlEncoder.
+  PatchReferenceCache* patch_cache = nullptr;
+  // If not null, the XYB conversion of the frame is copied from the previous
+  // frame converted with the same cache, if it had the same pixels. Used by the
+  // JxlEncoder.
+  XybCache* xyb_cache = nullptr;
+  // If not null, a frame encoded in one shot takes over the buffers of this
+  // state and hands its own back to it once encoded, so that the next frame
+  // of the same size does not allocate them again. Used by the JxlEncoder.
+  PassesEncoderState* spare_enc_state = nullptr;
   // If not empty, these custom splines will be used instead of the computed
   // ones. Used in jxl_from_tee tool.
   Splines custom_splines;
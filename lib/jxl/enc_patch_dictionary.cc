@@ -13,11 +13,13 @@
 #include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/override.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/random.h"
@@ -40,11 +42,10 @@
 
 namespace jxl {
 
-static constexpr size_t kPatchFrameReferenceId = 3;
-
 // static
 Status PatchDictionaryEncoder::Encode(const PatchDictionary& pdic,
                                       BitWriter* writer, LayerType layer,
+                                      const HistogramParams& histogram_params,
                                       AuxOut* aux_out) {
   JXL_ENSURE(pdic.HasAny());
   JxlMemoryManager* memory_manager = writer->memory_manager();
@@ -111,7 +112,7 @@ Status PatchDictionaryEncoder::Encode(const PatchDictionary& pdic,
   std::vector<uint8_t> context_map;
   JXL_ASSIGN_OR_RETURN(
       size_t cost,
-      BuildAndEncodeHistograms(memory_manager, HistogramParams(),
+      BuildAndEncodeHistograms(memory_manager, histogram_params,
                                kNumPatchDictionaryContexts, tokens, &codes,
                                &context_map, writer, layer, aux_out));
   (void)cost;
@@ -215,6 +216,23 @@ struct PatchColorspaceInfo {
   }
 };
 
+// FNV-1a hash of the size and the quantized pixels of a patch, so that equal
+// patches (as in QuantizedPatch::operator==) have equal hashes.
+uint64_t HashPatch(const QuantizedPatch& patch) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  const auto add = [&hash](uint64_t value) {
+    hash = (hash ^ value) * 0x100000001B3ull;
+  };
+  add(patch.xsize);
+  add(patch.ysize);
+  for (const auto& pixels : patch.pixels) {
+    for (size_t i = 0; i < patch.xsize * patch.ysize; i++) {
+      add(static_cast<uint8_t>(pixels[i]));
+    }
+  }
+  return hash;
+}
+
 StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
     const CompressParams& cparams, const Image3F& opsin,
     const PassesEncoderState* JXL_RESTRICT state, ThreadPool* pool,
@@ -553,22 +571,36 @@ StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
     return info;
   }
 
-  // Remove duplicates.
+  // Remove duplicates. Only patches with the same hash are compared, and the
+  // occurrences of a patch are merged into its first occurrence in scan order.
   constexpr size_t kMinPatchOccurrences = 2;
-  std::sort(info.begin(), info.end());
-  size_t unique = 0;
-  for (size_t i = 1; i < info.size(); i++) {
-    if (info[i].first == info[unique].first) {
-      info[unique].second.insert(info[unique].second.end(),
-                                 info[i].second.begin(), info[i].second.end());
-    } else {
-      if (info[unique].second.size() >= kMinPatchOccurrences) {
-        unique++;
+  std::vector<uint64_t> hashes(info.size());
+  const auto hash_patch = [&](const uint32_t i, size_t /* thread */) -> Status {
+    hashes[i] = HashPatch(info[i].first);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, info.size(), ThreadPool::NoInit,
+                                hash_patch, "HashPatches"));
+  std::unordered_map<uint64_t, std::vector<size_t>> first_with_hash;
+  std::vector<uint8_t> is_duplicate(info.size());
+  for (size_t i = 0; i < info.size(); i++) {
+    std::vector<size_t>& candidates = first_with_hash[hashes[i]];
+    for (size_t j : candidates) {
+      if (info[j].first == info[i].first) {
+        info[j].second.insert(info[j].second.end(), info[i].second.begin(),
+                              info[i].second.end());
+        is_duplicate[i] = 1;
+        break;
       }
-      info[unique] = info[i];
     }
+    if (!is_duplicate[i]) candidates.push_back(i);
   }
-  if (info[unique].second.size() >= kMinPatchOccurrences) {
+  size_t unique = 0;
+  for (size_t i = 0; i < info.size(); i++) {
+    if (is_duplicate[i] || info[i].second.size() < kMinPatchOccurrences) {
+      continue;
+    }
+    if (unique != i) info[unique] = std::move(info[i]);
     unique++;
   }
   info.resize(unique);
@@ -589,8 +621,82 @@ StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
   return info;
 }
 
+// Places every patch of `info` at all of its occurrences, from the position of
+// the patch in the reference frame.
+void SetPatchPositions(const std::vector<PatchInfo>& info,
+                       std::vector<PatchReferencePosition> pref_positions,
+                       size_t num_ec, PatchDictionary* pdic) {
+  std::vector<PatchPosition> positions;
+  std::vector<PatchBlending> blendings;
+  for (size_t i = 0; i < info.size(); i++) {
+    for (const auto& pos : info[i].second) {
+      JXL_DEBUG_V(4, "Patch %" PRIuS "x%" PRIuS " at position %u,%u",
+                  pref_positions[i].xsize, pref_positions[i].ysize, pos.first,
+                  pos.second);
+      positions.emplace_back(PatchPosition{pos.first, pos.second, i});
+      // Add blending for color channels, ignore other channels.
+      blendings.push_back({PatchBlendMode::kAdd, 0, false});
+      for (size_t j = 0; j < num_ec; ++j) {
+        blendings.push_back({PatchBlendMode::kNone, 0, false});
+      }
+    }
+  }
+  // TODO(veluca): this assumes that applying patches is commutative, which is
+  // not true for all blending modes. This code only produces kAdd patches, so
+  // this works out.
+  PatchDictionaryEncoder::SetPositions(pdic, std::move(positions),
+                                       std::move(pref_positions),
+                                       std::move(blendings), num_ec + 1);
+}
+
 }  // namespace
 
+const PatchReferencePosition* PatchReferenceCache::Find(
+    const QuantizedPatch& patch) const {
+  const size_t num_pixels = patch.xsize * patch.ysize;
+  const auto range = index_.equal_range(HashPatch(patch));
+  for (auto it = range.first; it != range.second; ++it) {
+    const Entry& entry = entries_[it->second];
+    if (entry.xsize != patch.xsize || entry.ysize != patch.ysize) continue;
+    bool equal = true;
+    for (size_t c = 0; c < 3 && equal; c++) {
+      equal = memcmp(entry.pixels.data() + c * num_pixels,
+                     patch.pixels[c].data(), num_pixels) == 0;
+    }
+    if (equal) return &entry.ref_pos;
+  }
+  return nullptr;
+}
+
+Status PatchReferenceCache::Store(
+    const std::vector<PatchInfo>& info,
+    const std::vector<PatchReferencePosition>& ref_positions, bool is_xyb,
+    const ReferceFrame& frame) {
+  Clear();
+  JXL_ENSURE(info.size() == ref_positions.size());
+  JXL_ASSIGN_OR_RETURN(ImageBundle copy, frame.frame->Copy());
+  frame_.frame = jxl::make_unique<ImageBundle>(std::move(copy));
+  frame_.ib_is_in_xyb = frame.ib_is_in_xyb;
+  is_xyb_ = is_xyb;
+  entries_.reserve(info.size());
+  for (size_t i = 0; i < info.size(); i++) {
+    const QuantizedPatch& patch = info[i].first;
+    const size_t num_pixels = patch.xsize * patch.ysize;
+    Entry entry;
+    entry.xsize = patch.xsize;
+    entry.ysize = patch.ysize;
+    entry.pixels.reserve(3 * num_pixels);
+    for (const auto& pixels : patch.pixels) {
+      entry.pixels.insert(entry.pixels.end(), pixels.begin(),
+                          pixels.begin() + num_pixels);
+    }
+    entry.ref_pos = ref_positions[i];
+    index_.emplace(HashPatch(patch), entries_.size());
+    entries_.emplace_back(std::move(entry));
+  }
+  return true;
+}
+
 Status FindBestPatchDictionary(const Image3F& opsin,
                                PassesEncoderState* JXL_RESTRICT state,
                                const JxlCmsInterface& cms, ThreadPool* pool,
@@ -618,6 +724,31 @@ Status FindBestPatchDictionary(const Image3F& opsin,
 
   if (info.empty()) return true;
 
+  size_t num_ec = state->shared.metadata->m.num_extra_channels;
+
+  // If a previous frame already saved all the patches, refer to its patch
+  // frame instead of encoding them again.
+  PatchReferenceCache* cache = state->cparams.patch_cache;
+  if (cache != nullptr && cache->HasFrame(is_xyb)) {
+    std::vector<PatchReferencePosition> pref_positions;
+    pref_positions.reserve(info.size());
+    for (const auto& patch : info) {
+      const PatchReferencePosition* ref_pos = cache->Find(patch.first);
+      if (ref_pos == nullptr) break;
+      pref_positions.push_back(*ref_pos);
+    }
+    if (pref_positions.size() == info.size()) {
+      ReferceFrame& reference =
+          state->shared.reference_frames[kPatchFrameReferenceId];
+      JXL_ASSIGN_OR_RETURN(ImageBundle frame, cache->frame().frame->Copy());
+      *reference.frame = std::move(frame);
+      reference.ib_is_in_xyb = cache->frame().ib_is_in_xyb;
+      SetPatchPositions(info, std::move(pref_positions), num_ec,
+                        &state->shared.image_features.patches);
+      return true;
+    }
+  }
+
   std::sort(
       info.begin(), info.end(), [&](const PatchInfo& a, const PatchInfo& b) {
         return a.first.xsize * a.first.ysize > b.first.xsize * b.first.ysize;
@@ -716,16 +847,13 @@ Status FindBestPatchDictionary(const Image3F& opsin,
                        Image3F::Create(memory_manager, ref_xsize, ref_ysize));
   // TODO(veluca): figure out a better way to fill the image.
   ZeroFillImage(&reference_frame);
-  std::vector<PatchPosition> positions;
   std::vector<PatchReferencePosition> pref_positions;
-  std::vector<PatchBlending> blendings;
   float* JXL_RESTRICT ref_rows[3] = {
       reference_frame.PlaneRow(0, 0),
       reference_frame.PlaneRow(1, 0),
       reference_frame.PlaneRow(2, 0),
   };
   size_t ref_stride = reference_frame.PixelsPerRow();
-  size_t num_ec = state->shared.metadata->m.num_extra_channels;
 
   for (size_t i = 0; i < info.size(); i++) {
     PatchReferencePosition ref_pos;
@@ -742,23 +870,16 @@ Status FindBestPatchDictionary(const Image3F& opsin,
         }
       }
     }
-    for (const auto& pos : info[i].second) {
-      JXL_DEBUG_V(4, "Patch %" PRIuS "x%" PRIuS " at position %u,%u",
-                  ref_pos.xsize, ref_pos.ysize, pos.first, pos.second);
-      positions.emplace_back(
-          PatchPosition{pos.first, pos.second, pref_positions.size()});
-      // Add blending for color channels, ignore other channels.
-      blendings.push_back({PatchBlendMode::kAdd, 0, false});
-      for (size_t j = 0; j < num_ec; ++j) {
-        blendings.push_back({PatchBlendMode::kNone, 0, false});
-      }
-    }
     pref_positions.emplace_back(ref_pos);
   }
 
   CompressParams cparams = state->cparams;
   // Recursive application of patches could create very weird issues.
   cparams.patches = Override::kOff;
+  // The MA tree of the main frame does not apply to the patch frame.
+  cparams.custom_fixed_tree.clear();
+  cparams.learned_tree = nullptr;
+  cparams.patch_cache = nullptr;
 
   if (WantDebugOutput(cparams)) {
     if (is_xyb) {
@@ -774,12 +895,14 @@ Status FindBestPatchDictionary(const Image3F& opsin,
                                           kPatchFrameReferenceId, cparams, cms,
                                           pool, aux_out, /*subtract=*/true));
 
-  // TODO(veluca): this assumes that applying patches is commutative, which is
-  // not true for all blending modes. This code only produces kAdd patches, so
-  // this works out.
-  PatchDictionaryEncoder::SetPositions(
-      &state->shared.image_features.patches, std::move(positions),
-      std::move(pref_positions), std::move(blendings), num_ec + 1);
+  if (cache != nullptr) {
+    JXL_RETURN_IF_ERROR(
+        cache->Store(info, pref_positions, is_xyb,
+                     state->shared.reference_frames[kPatchFrameReferenceId]));
+  }
+
+  SetPatchPositions(info, std::move(pref_positions), num_ec,
+                    &state->shared.image_features.patches);
   return true;
 }
 
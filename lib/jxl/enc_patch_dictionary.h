@@ -14,6 +14,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -21,6 +22,7 @@
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_patch_dictionary.h"
+#include "lib/jxl/enc_ans_params.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_params.h"
@@ -33,6 +35,9 @@ enum class LayerType : uint8_t;
 
 constexpr size_t kMaxPatchSize = 32;
 
+// Reference frame slot that patch frames are saved in.
+constexpr size_t kPatchFrameReferenceId = 3;
+
 struct QuantizedPatch {
   size_t xsize;
   size_t ysize;
@@ -74,12 +79,53 @@ struct QuantizedPatch {
 using PatchInfo =
     std::pair<QuantizedPatch, std::vector<std::pair<uint32_t, uint32_t>>>;
 
+// The patches of the last patch frame saved in kPatchFrameReferenceId, kept
+// across the frames of a codestream. A later frame whose patches were all
+// already in it (e.g. the same header and footer on every page of a scanned
+// document) refers to that frame instead of encoding a new one. Only valid
+// until some other frame is saved in the same slot.
+class PatchReferenceCache {
+ public:
+  // Returns the position of `patch` in the cached reference frame, or nullptr.
+  const PatchReferencePosition* Find(const QuantizedPatch& patch) const;
+
+  // Replaces the cache with the patches of a patch frame that was just
+  // encoded, `ref_positions[i]` being the position of `info[i]` in `frame`.
+  Status Store(const std::vector<PatchInfo>& info,
+               const std::vector<PatchReferencePosition>& ref_positions,
+               bool is_xyb, const ReferceFrame& frame);
+
+  void Clear() {
+    entries_.clear();
+    index_.clear();
+    frame_.frame.reset();
+  }
+
+  bool HasFrame(bool is_xyb) const { return frame_.frame && is_xyb_ == is_xyb; }
+  const ReferceFrame& frame() const { return frame_; }
+
+ private:
+  struct Entry {
+    size_t xsize;
+    size_t ysize;
+    // Quantized pixels of the three channels, one after the other.
+    std::vector<int8_t> pixels;
+    PatchReferencePosition ref_pos;
+  };
+  std::vector<Entry> entries_;
+  // Indices into entries_, by hash of the patch.
+  std::unordered_multimap<uint64_t, size_t> index_;
+  ReferceFrame frame_;
+  bool is_xyb_ = false;
+};
+
 // Friend class of PatchDictionary.
 class PatchDictionaryEncoder {
  public:
   // Only call if HasAny().
   static Status Encode(const PatchDictionary& pdic, BitWriter* writer,
-                       LayerType layer, AuxOut* aux_out);
+                       LayerType layer, const HistogramParams& histogram_params,
+                       AuxOut* aux_out);
 
   static void SetPositions(PatchDictionary* pdic,
                            std::vector<PatchPosition> positions,
@@ -8,7 +8,9 @@
 #include <jxl/memory_manager.h>
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/enc_xyb.cc"
@@ -26,6 +28,7 @@
 #include "lib/jxl/enc_image_bundle.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
+#include "lib/jxl/trace.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
@@ -221,6 +224,53 @@ void ComputePremulAbsorb(float intensity_target, float* premul_absorb) {
   }
 }
 
+Status SRGB8ToXYB(const uint8_t* JXL_RESTRICT data, size_t stride,
+                  size_t num_channels, float intensity_target, ThreadPool* pool,
+                  Image3F* JXL_RESTRICT xyb, Image3F* JXL_RESTRICT linear) {
+  JXL_ENSURE(num_channels == 3 || num_channels == 4);
+  if (linear) JXL_ENSURE(SameSize(*xyb, *linear));
+  const size_t xsize = xyb->xsize();
+
+  const HWY_FULL(float) d;
+  HWY_ALIGN float premul_absorb[MaxLanes(d) * 12];
+  ComputePremulAbsorb(intensity_target, premul_absorb);
+  // Computed with the same float conversion and transfer function as the
+  // separate passes, so that the result does not depend on the path taken.
+  HWY_ALIGN float to_linear[256];
+  const float scale = 1.0f / 255;
+  for (size_t i = 0; i < 256; i += Lanes(d)) {
+    HWY_ALIGN float encoded[MaxLanes(d)];
+    for (size_t j = 0; j < Lanes(d); ++j) {
+      encoded[j] = static_cast<float>(i + j) * scale;
+    }
+    Store(LinearFromSRGB(Load(d, encoded)), d, to_linear + i);
+  }
+
+  const auto process_row = [&](const uint32_t task,
+                               size_t /*thread*/) -> Status {
+    const size_t y = static_cast<size_t>(task);
+    const uint8_t* JXL_RESTRICT row_in = data + y * stride;
+    float* JXL_RESTRICT row0 = xyb->PlaneRow(0, y);
+    float* JXL_RESTRICT row1 = xyb->PlaneRow(1, y);
+    float* JXL_RESTRICT row2 = xyb->PlaneRow(2, y);
+    for (size_t x = 0; x < xsize; ++x) {
+      row0[x] = to_linear[row_in[x * num_channels + 0]];
+      row1[x] = to_linear[row_in[x * num_channels + 1]];
+      row2[x] = to_linear[row_in[x * num_channels + 2]];
+    }
+    if (linear) {
+      memcpy(linear->PlaneRow(0, y), row0, xsize * sizeof(float));
+      memcpy(linear->PlaneRow(1, y), row1, xsize * sizeof(float));
+      memcpy(linear->PlaneRow(2, y), row2, xsize * sizeof(float));
+    }
+    LinearRGBRowToXYB(row0, row1, row2, premul_absorb, xsize);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(xyb->ysize()),
+                                ThreadPool::NoInit, process_row, "SRGB8ToXYB"));
+  return true;
+}
+
 // This is different from Butteraugli's OpsinDynamicsImage() in the sense that
 // it does not contain a sensitivity multiplier based on the blurred image.
 Status ToXYB(const ColorEncoding& c_current, float intensity_target,
@@ -347,6 +397,7 @@ HWY_EXPORT(ToXYB);
 Status ToXYB(const ColorEncoding& c_current, float intensity_target,
              const ImageF* black, ThreadPool* pool, Image3F* JXL_RESTRICT image,
              const JxlCmsInterface& cms, Image3F* const JXL_RESTRICT linear) {
+  JXL_TRACE_SCOPE(kToXYB);
   return HWY_DYNAMIC_DISPATCH(ToXYB)(c_current, intensity_target, black, pool,
                                      image, cms, linear);
 }
@@ -362,6 +413,74 @@ Status ToXYB(const ImageBundle& in, ThreadPool* pool, Image3F* JXL_RESTRICT xyb,
   return true;
 }
 
+namespace {
+
+bool SamePixels(const Image3F& a, const Image3F& b) {
+  if (!SameSize(a, b)) return false;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < a.ysize(); ++y) {
+      if (memcmp(a.ConstPlaneRow(c, y), b.ConstPlaneRow(c, y),
+                 a.xsize() * sizeof(float)) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool XybCache::Matches(const ColorEncoding& c_current, float intensity_target,
+                       const Image3F& image, bool needs_linear) const {
+  if (!has_image_ || intensity_target != intensity_target_ ||
+      !c_current.SameColorEncoding(c_current_)) {
+    return false;
+  }
+  if (needs_linear && linear_.xsize() == 0) return false;
+  return SamePixels(image, input_);
+}
+
+Status XybCache::ToXYB(const ColorEncoding& c_current, float intensity_target,
+                       ThreadPool* pool, Image3F* JXL_RESTRICT image,
+                       const JxlCmsInterface& cms,
+                       Image3F* JXL_RESTRICT linear) {
+  if (Matches(c_current, intensity_target, *image, linear != nullptr)) {
+    JXL_RETURN_IF_ERROR(CopyImageTo(xyb_, image));
+    if (linear) JXL_RETURN_IF_ERROR(CopyImageTo(linear_, linear));
+    return true;
+  }
+  Clear();
+  JxlMemoryManager* memory_manager = image->memory_manager();
+  JXL_ASSIGN_OR_RETURN(
+      input_,
+      Image3F::Create(memory_manager, image->xsize(), image->ysize()));
+  JXL_RETURN_IF_ERROR(CopyImageTo(*image, &input_));
+  JXL_RETURN_IF_ERROR(jxl::ToXYB(c_current, intensity_target,
+                                 /*black=*/nullptr, pool, image, cms, linear));
+  JXL_ASSIGN_OR_RETURN(
+      xyb_, Image3F::Create(memory_manager, image->xsize(), image->ysize()));
+  JXL_RETURN_IF_ERROR(CopyImageTo(*image, &xyb_));
+  if (linear) {
+    JXL_ASSIGN_OR_RETURN(linear_, Image3F::Create(memory_manager,
+                                                  linear->xsize(),
+                                                  linear->ysize()));
+    JXL_RETURN_IF_ERROR(CopyImageTo(*linear, &linear_));
+  }
+  c_current_ = c_current;
+  intensity_target_ = intensity_target;
+  has_image_ = true;
+  return true;
+}
+
+HWY_EXPORT(SRGB8ToXYB);
+Status SRGB8ToXYB(const uint8_t* JXL_RESTRICT data, size_t stride,
+                  size_t num_channels, float intensity_target, ThreadPool* pool,
+                  Image3F* JXL_RESTRICT xyb, Image3F* JXL_RESTRICT linear) {
+  JXL_TRACE_SCOPE(kToXYB);
+  return HWY_DYNAMIC_DISPATCH(SRGB8ToXYB)(data, stride, num_channels,
+                                          intensity_target, pool, xyb, linear);
+}
+
 HWY_EXPORT(LinearRGBRowToXYB);
 void LinearRGBRowToXYB(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
                        float* JXL_RESTRICT row2,
@@ -11,6 +11,7 @@
 #include <jxl/cms_interface.h>
 
 #include <cstddef>
+#include <cstdint>
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
@@ -31,6 +32,47 @@ Status ToXYB(const ImageBundle& in, ThreadPool* pool, Image3F* JXL_RESTRICT xyb,
              const JxlCmsInterface& cms,
              Image3F* JXL_RESTRICT linear = nullptr);
 
+// Converts interleaved 8-bit sRGB pixels with `num_channels` (3 or 4) bytes
+// per pixel and `stride` bytes per row to XYB in a single pass, with the same
+// result as converting them to float and calling ToXYB. The size of the image
+// is that of `xyb`. If `linear` is not null, fills it with linear sRGB.
+Status SRGB8ToXYB(const uint8_t* JXL_RESTRICT data, size_t stride,
+                  size_t num_channels, float intensity_target, ThreadPool* pool,
+                  Image3F* JXL_RESTRICT xyb, Image3F* JXL_RESTRICT linear);
+
+// Keeps the pixels of the last image converted with it before and after ToXYB,
+// so that converting the same pixels again, e.g. to encode one image at several
+// distances, only copies the result.
+class XybCache {
+ public:
+  // Like ToXYB without a black channel, but copies the kept result instead if
+  // `image` has the same pixels, color encoding and intensity target as the
+  // kept image, and the kept image has a linear copy if `linear` is not null.
+  // Otherwise, converts `image` and keeps it instead.
+  Status ToXYB(const ColorEncoding& c_current, float intensity_target,
+               ThreadPool* pool, Image3F* JXL_RESTRICT image,
+               const JxlCmsInterface& cms, Image3F* JXL_RESTRICT linear);
+
+  void Clear() {
+    input_ = Image3F();
+    xyb_ = Image3F();
+    linear_ = Image3F();
+    has_image_ = false;
+  }
+
+ private:
+  bool Matches(const ColorEncoding& c_current, float intensity_target,
+               const Image3F& image, bool needs_linear) const;
+
+  bool has_image_ = false;
+  ColorEncoding c_current_;
+  float intensity_target_ = 0.0f;
+  Image3F input_;
+  Image3F xyb_;
+  // Empty if the kept image was converted without a linear copy.
+  Image3F linear_;
+};
+
 void LinearRGBRowToXYB(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
                        float* JXL_RESTRICT row2,
                        const float* JXL_RESTRICT premul_absorb, size_t xsize);
@@ -17,6 +17,7 @@
 #include <cstdint>
 #include <cstring>
 #include <utility>
+#include <vector>
 
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
@@ -37,9 +38,11 @@
 #include "lib/jxl/enc_icc_codec.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/encode_internal.h"
+#include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
 #include "lib/jxl/luminance.h"
 #include "lib/jxl/memory_manager_internal.h"
+#include "lib/jxl/modular/encoding/enc_ma.h"
 #include "lib/jxl/padded_bytes.h"
 
 struct JxlErrorOrStatus {
@@ -520,6 +523,65 @@ JxlEncoderStatus BrotliCompress(int quality, const uint8_t* in, size_t in_size,
   return JxlErrorOrStatus::Success();
 }
 
+// Compresses the contents of all the queued boxes that are to be written as
+// brob boxes, one box per task on the thread pool. If `jpeg_data` is not null,
+// it is also encoded as the JPEG reconstruction data in the same batch of
+// tasks, so that all the Brotli streams of a transcoded JPEG are compressed
+// concurrently.
+JxlEncoderStatus CompressBoxes(JxlEncoder* enc, jxl::jpeg::JPEGData* jpeg_data,
+                               const jxl::CompressParams& cparams) {
+  std::vector<jxl::JxlEncoderQueuedBox*> boxes;
+  for (jxl::JxlEncoderQueuedInput& input : enc->input_queue) {
+    if (input.box && input.box->compress_box && !input.box->compressed) {
+      boxes.push_back(input.box.get());
+    }
+  }
+  const uint32_t num_jbrd_tasks = jpeg_data ? 1 : 0;
+  const int quality = enc->brotli_effort >= 0 ? enc->brotli_effort : 4;
+  JxlMemoryManager* memory_manager = &enc->memory_manager;
+  std::vector<uint8_t> jbrd;
+  std::atomic<bool> jbrd_ok{true};
+  std::atomic<bool> boxes_ok{true};
+  const auto process = [&](const uint32_t task, size_t) -> jxl::Status {
+    if (task < num_jbrd_tasks) {
+      if (!jxl::jpeg::EncodeJPEGData(memory_manager, *jpeg_data, &jbrd,
+                                     cparams)) {
+        jbrd_ok = false;
+      }
+      return true;
+    }
+    jxl::JxlEncoderQueuedBox* box = boxes[task - num_jbrd_tasks];
+    jxl::PaddedBytes compressed(memory_manager);
+    // Prepend the original box type in the brob box contents
+    if (!compressed.append(box->type) ||
+        JXL_ENC_SUCCESS != BrotliCompress(quality, box->contents.data(),
+                                          box->contents.size(), &compressed)) {
+      boxes_ok = false;
+      return true;
+    }
+    box->contents.assign(compressed.data(),
+                         compressed.data() + compressed.size());
+    box->compressed = true;
+    return true;
+  };
+  if (!jxl::RunOnPool(enc->thread_pool.get(), 0,
+                      num_jbrd_tasks + boxes.size(), jxl::ThreadPool::NoInit,
+                      process, "Compress boxes")) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "Error compressing boxes");
+  }
+  if (!jbrd_ok) {
+    return JXL_API_ERROR(
+        enc, JXL_ENC_ERR_JBRD,
+        "JPEG bitstream reconstruction data cannot be encoded");
+  }
+  if (!boxes_ok) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC,
+                         "Brotli compression for brob box failed");
+  }
+  if (jpeg_data) enc->jpeg_metadata = std::move(jbrd);
+  return JxlErrorOrStatus::Success();
+}
+
 // The JXL codestream can have level 5 or level 10. Levels have certain
 // restrictions such as max allowed image dimensions. This function checks the
 // level required to support the current encoder settings. The debug_string is
@@ -732,6 +794,188 @@ void FastLosslessRunnerAdapter(void* void_ticket, void* opaque,
   }
 }
 
+// Checks a queued frame and fills in `frame_info` and the parameters that
+// depend on the encoder for EncodeFrame.
+jxl::Status PrepareQueuedFrame(JxlEncoder* enc,
+                               jxl::JxlEncoderQueuedFrame* frame,
+                               bool last_frame, jxl::FrameInfo* frame_info) {
+  for (unsigned idx = 0; idx < frame->ec_initialized.size(); idx++) {
+    if (!frame->ec_initialized[idx]) {
+      return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                           "Extra channel %u is not initialized", idx);
+    }
+  }
+
+  // TODO(zond): Handle progressive mode like EncodeFile does it.
+
+  const JxlFrameHeader& header = frame->option_values.header;
+  jxl::CompressParams& cparams = frame->option_values.cparams;
+  if (enc->metadata.m.xyb_encoded) {
+    cparams.color_transform = jxl::ColorTransform::kXYB;
+  } else {
+    // TODO(zond): Figure out when to use kYCbCr instead.
+    cparams.color_transform = jxl::ColorTransform::kNone;
+  }
+
+  size_t save_as_reference = header.layer_info.save_as_reference;
+  if (save_as_reference >= 3) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Cannot use save_as_reference values >=3 (found: %d)",
+                         static_cast<int>(save_as_reference));
+  }
+
+  frame_info->is_last = last_frame;
+  frame_info->save_as_reference = save_as_reference;
+  frame_info->source = header.layer_info.blend_info.source;
+  frame_info->clamp = FROM_JXL_BOOL(header.layer_info.blend_info.clamp);
+  frame_info->alpha_channel = header.layer_info.blend_info.alpha;
+  frame_info->extra_channel_blending_info.resize(
+      enc->metadata.m.num_extra_channels);
+  // If extra channel blend info has not been set, use the blend mode from
+  // the layer_info.
+  JxlBlendInfo default_blend_info = header.layer_info.blend_info;
+  for (size_t i = 0; i < enc->metadata.m.num_extra_channels; ++i) {
+    auto& to = frame_info->extra_channel_blending_info[i];
+    const auto& from =
+        i < frame->option_values.extra_channel_blend_info.size()
+            ? frame->option_values.extra_channel_blend_info[i]
+            : default_blend_info;
+    to.mode = static_cast<jxl::BlendMode>(from.blendmode);
+    to.source = from.source;
+    to.alpha_channel = from.alpha;
+    to.clamp = (from.clamp != 0);
+  }
+  frame_info->origin.x0 = header.layer_info.crop_x0;
+  frame_info->origin.y0 = header.layer_info.crop_y0;
+  frame_info->blendmode =
+      static_cast<jxl::BlendMode>(header.layer_info.blend_info.blendmode);
+  frame_info->blend =
+      header.layer_info.blend_info.blendmode != JXL_BLEND_REPLACE;
+  frame_info->image_bit_depth = frame->option_values.image_bit_depth;
+  if (enc->metadata.m.have_animation) {
+    frame_info->duration = header.duration;
+    frame_info->timecode = header.timecode;
+  } else {
+    // If have_animation is false, the encoder should ignore the duration and
+    // timecode values. However, assigning them to ib will cause the encoder
+    // to write an invalid frame header that can't be decoded so ensure
+    // they're the default value of 0 here.
+    frame_info->duration = 0;
+    frame_info->timecode = 0;
+  }
+  frame_info->name = frame->option_values.frame_name;
+
+  cparams.learned_tree = &enc->modular_tree;
+  cparams.patch_cache = &enc->patch_cache;
+  cparams.xyb_cache =
+      enc->reuse_color_transform ? &enc->xyb_cache : nullptr;
+  // Decoding may start at an indexed frame, so neither it nor the frames after
+  // it can refer to the patch frames before it.
+  if (frame->option_values.frame_index_box) enc->patch_cache.Clear();
+  if (enc->memory_tracker && enc->memory_tracker->limit() != 0) {
+    cparams.memory_limit = enc->memory_tracker->limit();
+    // Leave most of the budget to the image buffers.
+    if (cparams.options.max_tree_learning_memory == 0) {
+      cparams.options.max_tree_learning_memory = cparams.memory_limit / 8;
+    }
+  } else {
+    // The buffers kept between frames would count against a memory limit.
+    if (!enc->spare_enc_state) {
+      enc->spare_enc_state =
+          jxl::make_unique<jxl::PassesEncoderState>(&enc->memory_manager);
+    }
+    cparams.spare_enc_state = enc->spare_enc_state.get();
+  }
+  return true;
+}
+
+// Frames of up to this many groups are encoded several at a time, one per
+// thread, since there is too little work in each to keep the threads busy.
+constexpr size_t kMaxGroupsForParallelFrames = 4;
+constexpr size_t kMaxParallelFrames = 32;
+
+// Whether `frame` can be encoded on a thread of its own, at the same time as
+// the frames next to it. The encoder keeps no state between the frames, the
+// references they blend from are only resolved when decoding, but the
+// statistics and debug callbacks are shared and only safe from one frame at a
+// time.
+bool CanEncodeInParallel(const JxlEncoder* enc,
+                         const jxl::JxlEncoderQueuedFrame& frame) {
+  const jxl::CompressParams& cparams = frame.option_values.cparams;
+  if (frame.option_values.aux_out != nullptr ||
+      cparams.debug_image != nullptr) {
+    return false;
+  }
+  // Encoding several frames at once needs more memory.
+  if (enc->memory_tracker && enc->memory_tracker->limit() != 0) return false;
+  const size_t num_groups =
+      jxl::DivCeil(frame.frame_data.xsize, jxl::kGroupDim) *
+      jxl::DivCeil(frame.frame_data.ysize, jxl::kGroupDim);
+  return num_groups <= kMaxGroupsForParallelFrames;
+}
+
+// Encodes `frame`, which was just taken from the front of the queue, together
+// with the frames queued right after it that can also be encoded in parallel,
+// each on one thread of the runner. The codestreams are kept in the queued
+// frames, to be written in order.
+jxl::Status EncodeQueuedFramesInParallel(JxlEncoder* enc,
+                                         jxl::JxlEncoderQueuedFrame* frame,
+                                         const jxl::FrameInfo& frame_info) {
+  std::vector<jxl::JxlEncoderQueuedFrame*> frames = {frame};
+  std::vector<jxl::FrameInfo> frame_infos = {frame_info};
+  for (size_t i = 0; i < enc->input_queue.size(); ++i) {
+    jxl::JxlEncoderQueuedFrame* next = enc->input_queue[i].frame.get();
+    if (frames.size() == kMaxParallelFrames || next == nullptr ||
+        next->is_encoded || !CanEncodeInParallel(enc, *next)) {
+      break;
+    }
+    // Only called once the frames are closed, so the last queued frame is the
+    // last one of the image.
+    const bool last_frame = enc->num_queued_frames == i + 1;
+    frame_infos.emplace_back();
+    JXL_RETURN_IF_ERROR(
+        PrepareQueuedFrame(enc, next, last_frame, &frame_infos.back()));
+    frames.push_back(next);
+  }
+  if (frames.size() == 1) return true;
+  // Only the tree of the last frame is reported, as if they were encoded one
+  // after the other.
+  for (size_t i = 0; i + 1 < frames.size(); ++i) {
+    frames[i]->option_values.cparams.learned_tree = nullptr;
+  }
+  // None of the frames can rely on the patch frames of the others, and any of
+  // them may replace the one of the frames before them.
+  for (jxl::JxlEncoderQueuedFrame* f : frames) {
+    f->option_values.cparams.patch_cache = nullptr;
+    f->option_values.cparams.xyb_cache = nullptr;
+    f->option_values.cparams.spare_enc_state = nullptr;
+  }
+  enc->patch_cache.Clear();
+
+  const auto encode_frame = [&](const uint32_t i, size_t) -> jxl::Status {
+    std::vector<uint8_t>& output = frames[i]->encoded;
+    output.resize(64);
+    uint8_t* next_out = output.data();
+    size_t avail_out = output.size();
+    JxlEncoderOutputProcessorWrapper local_output(&enc->memory_manager);
+    JXL_RETURN_IF_ERROR(local_output.SetAvailOut(&next_out, &avail_out));
+    JXL_RETURN_IF_ERROR(jxl::EncodeFrame(
+        &enc->memory_manager, frames[i]->option_values.cparams, frame_infos[i],
+        &enc->metadata, frames[i]->frame_data, enc->cms, nullptr,
+        &local_output, nullptr));
+    JXL_RETURN_IF_ERROR(local_output.SetFinalizedPosition());
+    JXL_RETURN_IF_ERROR(local_output.CopyOutput(output, next_out, avail_out));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(jxl::RunOnPool(enc->thread_pool.get(), 0, frames.size(),
+                                     jxl::ThreadPool::NoInit, encode_frame,
+                                     "EncodeFrames"));
+  for (jxl::JxlEncoderQueuedFrame* encoded_frame : frames) {
+    encoded_frame->is_encoded = true;
+  }
+  return true;
+}
+
 }  // namespace
 
 jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
@@ -860,48 +1104,27 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
         std::move(input.fast_lossless_frame);
     input_queue.erase(input_queue.begin());
     num_queued_frames--;
-    if (input_frame) {
-      for (unsigned idx = 0; idx < input_frame->ec_initialized.size(); idx++) {
-        if (!input_frame->ec_initialized[idx]) {
-          return JXL_API_ERROR(this, JXL_ENC_ERR_API_USAGE,
-                               "Extra channel %u is not initialized", idx);
-        }
-      }
+    const bool last_frame = frames_closed && (num_queued_frames == 0);
 
+    jxl::FrameInfo frame_info;
+    if (input_frame) {
       // TODO(zond): If the input queue is empty and the frames_closed is true,
       // then mark this frame as the last.
 
-      // TODO(zond): Handle progressive mode like EncodeFile does it.
       // TODO(zond): Handle animation like EncodeFile does it, by checking if
       //             JxlEncoderCloseFrames has been called and if the frame
       //             queue is empty (to see if it's the last animation frame).
-
-      if (metadata.m.xyb_encoded) {
-        input_frame->option_values.cparams.color_transform =
-            jxl::ColorTransform::kXYB;
-      } else {
-        // TODO(zond): Figure out when to use kYCbCr instead.
-        input_frame->option_values.cparams.color_transform =
-            jxl::ColorTransform::kNone;
+      JXL_RETURN_IF_ERROR(PrepareQueuedFrame(this, input_frame.get(),
+                                             last_frame, &frame_info));
+      // Frames queued after this one are only known to be before the last
+      // frame once the frames are closed.
+      if (!input_frame->is_encoded && frames_closed && thread_pool &&
+          CanEncodeInParallel(this, *input_frame)) {
+        JXL_RETURN_IF_ERROR(
+            EncodeQueuedFramesInParallel(this, input_frame.get(), frame_info));
       }
     }
 
-    uint32_t duration;
-    uint32_t timecode;
-    if (input_frame && metadata.m.have_animation) {
-      duration = input_frame->option_values.header.duration;
-      timecode = input_frame->option_values.header.timecode;
-    } else {
-      // If have_animation is false, the encoder should ignore the duration and
-      // timecode values. However, assigning them to ib will cause the encoder
-      // to write an invalid frame header that can't be decoded so ensure
-      // they're the default value of 0 here.
-      duration = 0;
-      timecode = 0;
-    }
-
-    const bool last_frame = frames_closed && (num_queued_frames == 0);
-
     uint32_t max_bits_per_sample = metadata.m.bit_depth.bits_per_sample;
     for (const auto& info : metadata.m.extra_channel_info) {
       max_bits_per_sample =
@@ -939,62 +1162,17 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
     JXL_RETURN_IF_ERROR(AppendData(output_processor, header_bytes));
 
     if (input_frame) {
-      frame_index_box.AddFrame(codestream_bytes_written_end_of_frame, duration,
+      frame_index_box.AddFrame(codestream_bytes_written_end_of_frame,
+                               frame_info.duration,
                                input_frame->option_values.frame_index_box);
 
-      size_t save_as_reference =
-          input_frame->option_values.header.layer_info.save_as_reference;
-      if (save_as_reference >= 3) {
-        return JXL_API_ERROR(
-            this, JXL_ENC_ERR_API_USAGE,
-            "Cannot use save_as_reference values >=3 (found: %d)",
-            static_cast<int>(save_as_reference));
-      }
-
-      jxl::FrameInfo frame_info;
-      frame_info.is_last = last_frame;
-      frame_info.save_as_reference = save_as_reference;
-      frame_info.source =
-          input_frame->option_values.header.layer_info.blend_info.source;
-      frame_info.clamp = FROM_JXL_BOOL(
-          input_frame->option_values.header.layer_info.blend_info.clamp);
-      frame_info.alpha_channel =
-          input_frame->option_values.header.layer_info.blend_info.alpha;
-      frame_info.extra_channel_blending_info.resize(
-          metadata.m.num_extra_channels);
-      // If extra channel blend info has not been set, use the blend mode from
-      // the layer_info.
-      JxlBlendInfo default_blend_info =
-          input_frame->option_values.header.layer_info.blend_info;
-      for (size_t i = 0; i < metadata.m.num_extra_channels; ++i) {
-        auto& to = frame_info.extra_channel_blending_info[i];
-        const auto& from =
-            i < input_frame->option_values.extra_channel_blend_info.size()
-                ? input_frame->option_values.extra_channel_blend_info[i]
-                : default_blend_info;
-        to.mode = static_cast<jxl::BlendMode>(from.blendmode);
-        to.source = from.source;
-        to.alpha_channel = from.alpha;
-        to.clamp = (from.clamp != 0);
-      }
-      frame_info.origin.x0 =
-          input_frame->option_values.header.layer_info.crop_x0;
-      frame_info.origin.y0 =
-          input_frame->option_values.header.layer_info.crop_y0;
-      frame_info.blendmode = static_cast<jxl::BlendMode>(
-          input_frame->option_values.header.layer_info.blend_info.blendmode);
-      frame_info.blend =
-          input_frame->option_values.header.layer_info.blend_info.blendmode !=
-          JXL_BLEND_REPLACE;
-      frame_info.image_bit_depth = input_frame->option_values.image_bit_depth;
-      frame_info.duration = duration;
-      frame_info.timecode = timecode;
-      frame_info.name = input_frame->option_values.frame_name;
-
-      if (!jxl::EncodeFrame(&memory_manager, input_frame->option_values.cparams,
-                            frame_info, &metadata, input_frame->frame_data, cms,
-                            thread_pool.get(), &output_processor,
-                            input_frame->option_values.aux_out)) {
+      if (input_frame->is_encoded) {
+        JXL_RETURN_IF_ERROR(AppendData(output_processor, input_frame->encoded));
+      } else if (!jxl::EncodeFrame(
+                     &memory_manager, input_frame->option_values.cparams,
+                     frame_info, &metadata, input_frame->frame_data, cms,
+                     thread_pool.get(), &output_processor,
+                     input_frame->option_values.aux_out)) {
         return JXL_API_ERROR(this, JXL_ENC_ERR_GENERIC,
                              "Failed to encode frame");
       }
@@ -1060,25 +1238,20 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
     }
   } else {
     // Not a frame, so is a box instead
+    if (input.box->compress_box && !input.box->compressed) {
+      // Compress this box together with the following ones.
+      if (JXL_ENC_SUCCESS != CompressBoxes(this, nullptr, last_used_cparams)) {
+        return JXL_FAILURE("Brotli compression for brob boxes failed");
+      }
+    }
     jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedBox> box =
         std::move(input.box);
     input_queue.erase(input_queue.begin());
     num_queued_boxes--;
 
     if (box->compress_box) {
-      jxl::PaddedBytes compressed(&memory_manager);
-      // Prepend the original box type in the brob box contents
-      JXL_RETURN_IF_ERROR(compressed.append(box->type));
-      if (JXL_ENC_SUCCESS !=
-          BrotliCompress((brotli_effort >= 0 ? brotli_effort : 4),
-                         box->contents.data(), box->contents.size(),
-                         &compressed)) {
-        return JXL_API_ERROR(this, JXL_ENC_ERR_GENERIC,
-                             "Brotli compression for brob box failed");
-      }
-
       JXL_RETURN_IF_ERROR(
-          AppendBoxWithContents(jxl::MakeBoxType("brob"), compressed));
+          AppendBoxWithContents(jxl::MakeBoxType("brob"), box->contents));
     } else {
       JXL_RETURN_IF_ERROR(AppendBoxWithContents(box->type, box->contents));
     }
@@ -1566,7 +1739,6 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
     case JXL_ENC_FRAME_SETTING_GABORISH:
     case JXL_ENC_FRAME_SETTING_MODULAR:
     case JXL_ENC_FRAME_SETTING_KEEP_INVISIBLE:
-    case JXL_ENC_FRAME_SETTING_GROUP_ORDER:
     case JXL_ENC_FRAME_SETTING_RESPONSIVE:
     case JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC:
     case JXL_ENC_FRAME_SETTING_QPROGRESSIVE_AC:
@@ -1674,7 +1846,12 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
           static_cast<jxl::Override>(value);
       break;
     case JXL_ENC_FRAME_SETTING_GROUP_ORDER:
+      if (value < -1 || value > 2) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be in [-1..2]");
+      }
       frame_settings->values.cparams.centerfirst = (value == 1);
+      frame_settings->values.cparams.tiled_group_order = (value == 2);
       break;
     case JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_X:
       if (value < -1) {
@@ -1786,9 +1963,11 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
         return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                              "Option value has to be 0 or 1");
       }
-      frame_settings->values.frame_index_box = true;
+      frame_settings->values.frame_index_box = (value == 1);
       break;
     case JXL_ENC_FRAME_SETTING_PHOTON_NOISE:
+    case JXL_ENC_FRAME_SETTING_TARGET_BUTTERAUGLI_SCORE:
+    case JXL_ENC_FRAME_SETTING_AC_STRATEGY_PRUNING_PERCENT:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                            "Float option, try setting it with "
                            "JxlEncoderFrameSettingsSetFloatOption");
@@ -1796,6 +1975,13 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
       frame_settings->values.cparams.jpeg_compress_boxes =
           default_to_true(value);
       break;
+    case JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      frame_settings->values.zero_copy_input = default_to_false(value);
+      break;
     case JXL_ENC_FRAME_SETTING_BUFFERING:
       if (value < -1 || value > 3) {
         return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
@@ -1835,6 +2021,44 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
             "Set uses_original_profile=true for non-perceptual encoding");
       }
       break;
+    case JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_MEMORY:
+      if (value < -1 || value == 0 || value > (1 << 20)) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be -1 or in [1..1048576]");
+      }
+      frame_settings->values.cparams.options.max_tree_learning_memory =
+          value == -1 ? 0 : static_cast<size_t>(value) << 20;
+      break;
+    case JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING:
+      if (value < -1 || value == 0 || value > 64) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be -1 or in [1..64]");
+      }
+      frame_settings->values.cparams.rct_sampling = value;
+      break;
+    case JXL_ENC_FRAME_SETTING_PREFIX_CODES:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      frame_settings->values.cparams.force_prefix_codes =
+          default_to_false(value);
+      break;
+    case JXL_ENC_FRAME_SETTING_TIME_BUDGET:
+      if (value < -1 || value > INT32_MAX) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..2^31-1]");
+      }
+      frame_settings->values.cparams.time_budget_ms = value;
+      break;
+    case JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      frame_settings->values.cparams.approximate_butteraugli =
+          default_to_false(value);
+      break;
 
     default:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
@@ -1895,6 +2119,22 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
         frame_settings->values.cparams.channel_colors_percent = value;
       }
       return JxlErrorOrStatus::Success();
+    case JXL_ENC_FRAME_SETTING_TARGET_BUTTERAUGLI_SCORE:
+      if (value < 0 && value != -1.f) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be -1, 0 or positive");
+      }
+      frame_settings->values.cparams.target_butteraugli_score =
+          std::max(0.0f, value);
+      return JxlErrorOrStatus::Success();
+    case JXL_ENC_FRAME_SETTING_AC_STRATEGY_PRUNING_PERCENT:
+      if (value < -1.f || value > 100.f) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Option value has to be in [-1..100]");
+      }
+      frame_settings->values.cparams.ac_strategy_pruning =
+          std::max(0.0f, value) * 0.01f;
+      return JxlErrorOrStatus::Success();
     case JXL_ENC_FRAME_SETTING_EFFORT:
     case JXL_ENC_FRAME_SETTING_DECODING_SPEED:
     case JXL_ENC_FRAME_SETTING_RESAMPLING:
@@ -1931,6 +2171,12 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_XMP:
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_JUMBF:
     case JXL_ENC_FRAME_SETTING_USE_FULL_IMAGE_HEURISTICS:
+    case JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_MEMORY:
+    case JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT:
+    case JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING:
+    case JXL_ENC_FRAME_SETTING_PREFIX_CODES:
+    case JXL_ENC_FRAME_SETTING_TIME_BUDGET:
+    case JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                            "Int option, try setting it with "
                            "JxlEncoderFrameSettingsSetOption");
@@ -1950,6 +2196,7 @@ JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager) {
   if (!alloc) return nullptr;
   JxlEncoder* enc = new (alloc) JxlEncoder();
   enc->memory_manager = local_memory_manager;
+  enc->user_memory_manager = local_memory_manager;
   // TODO(sboukortt): add an API function to set this.
   enc->cms = *JxlGetDefaultCms();
   enc->cms_set = true;
@@ -1960,45 +2207,132 @@ JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager) {
   return enc;
 }
 
-void JxlEncoderReset(JxlEncoder* enc) {
-  enc->thread_pool.reset();
+namespace {
+
+// Resets the state of the image being encoded, but not the settings.
+void ResetImageState(JxlEncoder* enc) {
   enc->input_queue.clear();
   enc->num_queued_frames = 0;
   enc->num_queued_boxes = 0;
-  enc->encoder_options.clear();
   enc->codestream_bytes_written_end_of_frame = 0;
+  enc->frame_index_box = jxl::JxlEncoderFrameIndexBox();
   enc->wrote_bytes = false;
   enc->jxlp_counter = 0;
   enc->metadata = jxl::CodecMetadata();
+  enc->jpeg_metadata.clear();
   enc->last_used_cparams = jxl::CompressParams();
+  enc->modular_tree.clear();
+  enc->patch_cache.Clear();
+  enc->error = JxlEncoderError::JXL_ENC_ERR_OK;
   enc->frames_closed = false;
   enc->boxes_closed = false;
   enc->basic_info_set = false;
   enc->color_encoding_set = false;
   enc->intensity_target_set = false;
+  enc->output_processor =
+      JxlEncoderOutputProcessorWrapper(&enc->memory_manager);
+  JxlEncoderInitBasicInfo(&enc->basic_info);
+}
+
+}  // namespace
+
+void JxlEncoderReset(JxlEncoder* enc) {
+  ResetImageState(enc);
+  enc->thread_pool.reset();
+  enc->encoder_options.clear();
   enc->use_container = false;
   enc->use_boxes = false;
+  enc->reuse_color_transform = false;
+  enc->xyb_cache.Clear();
+  enc->spare_enc_state.reset();
   enc->store_jpeg_metadata = false;
   enc->codestream_level = -1;
-  enc->output_processor =
-      JxlEncoderOutputProcessorWrapper(&enc->memory_manager);
-  JxlEncoderInitBasicInfo(&enc->basic_info);
 
-  // jxl::JxlEncoderFrameIndexBox frame_index_box;
-  // JxlEncoderError error = JxlEncoderError::JXL_ENC_ERR_OK;
   // bool allow_expert_options = false;
   // int brotli_effort = -1;
 }
 
+void JxlEncoderResetKeepSettings(JxlEncoder* enc) { ResetImageState(enc); }
+
+void JxlEncoderReuseColorTransform(JxlEncoder* enc, JXL_BOOL reuse) {
+  enc->reuse_color_transform = FROM_JXL_BOOL(reuse);
+  if (!enc->reuse_color_transform) enc->xyb_cache.Clear();
+}
+
 void JxlEncoderDestroy(JxlEncoder* enc) {
   if (enc) {
-    JxlMemoryManager local_memory_manager = enc->memory_manager;
+    // The encoder itself was allocated before any arena or tracker.
+    JxlMemoryManager local_memory_manager = enc->user_memory_manager;
     // Call destructor directly since custom free function is used.
     enc->~JxlEncoder();
     jxl::MemoryManagerFree(&local_memory_manager, enc);
   }
 }
 
+JxlEncoderStatus JxlEncoderSetMemoryArena(JxlEncoder* enc,
+                                          size_t block_size) {
+  if (enc->wrote_bytes) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "the memory arena can only be set at the beginning");
+  }
+  if (enc->arena) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "memory arena already set");
+  }
+  if (block_size == 0) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "invalid arena block size");
+  }
+  enc->arena = jxl::make_unique<jxl::MemoryArena>(enc->memory_manager,
+                                                  block_size);
+  // Buffers allocated before remain valid: freeing them through the arena
+  // forwards them to the original memory manager.
+  enc->memory_manager = enc->arena->memory_manager();
+  return JxlErrorOrStatus::Success();
+}
+
+JxlEncoderStatus JxlEncoderSetHugePageThreshold(JxlEncoder* enc,
+                                                size_t threshold) {
+  if (enc->wrote_bytes) {
+    return JXL_API_ERROR(
+        enc, JXL_ENC_ERR_API_USAGE,
+        "the huge page threshold can only be set at the beginning");
+  }
+  if (enc->huge_pages) {
+    enc->huge_pages->set_threshold(threshold);
+    return JxlErrorOrStatus::Success();
+  }
+  enc->huge_pages =
+      jxl::make_unique<jxl::HugePageAdvisor>(enc->memory_manager, threshold);
+  enc->memory_manager = enc->huge_pages->memory_manager();
+  return JxlErrorOrStatus::Success();
+}
+
+JxlEncoderStatus JxlEncoderSetMemoryLimit(JxlEncoder* enc,
+                                          uint64_t limit_bytes) {
+  if (enc->memory_tracker) {
+    enc->memory_tracker->set_limit(limit_bytes);
+    return JxlErrorOrStatus::Success();
+  }
+  if (enc->wrote_bytes) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "the memory limit can only be set at the beginning");
+  }
+  enc->memory_tracker =
+      jxl::make_unique<jxl::MemoryTracker>(enc->memory_manager, limit_bytes);
+  enc->memory_manager = enc->memory_tracker->memory_manager();
+  return JxlErrorOrStatus::Success();
+}
+
+JxlEncoderStatus JxlEncoderGetPeakMemoryUsage(const JxlEncoder* enc,
+                                              uint64_t* peak_bytes) {
+  if (!enc->memory_tracker) {
+    return JXL_API_ERROR_NOSET("JxlEncoderSetMemoryLimit was not called");
+  }
+  *peak_bytes = enc->memory_tracker->peak_bytes();
+  return JxlErrorOrStatus::Success();
+}
+
 JxlEncoderError JxlEncoderGetError(JxlEncoder* enc) { return enc->error; }
 
 JxlEncoderStatus JxlEncoderUseContainer(JxlEncoder* enc,
@@ -2091,7 +2425,8 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
   }
 
   jxl::CodecInOut io{&frame_settings->enc->memory_manager};
-  if (!jxl::jpeg::DecodeImageJPG(jxl::Bytes(buffer, size), &io)) {
+  if (!jxl::jpeg::DecodeImageJPG(jxl::Bytes(buffer, size), &io,
+                                 frame_settings->enc->thread_pool.get())) {
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_BAD_INPUT,
                          "Error during decode of input JPEG");
   }
@@ -2171,6 +2506,7 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
         io.blobs.jumbf.size(),
         TO_JXL_BOOL(frame_settings->values.cparams.jpeg_compress_boxes));
   }
+  jxl::jpeg::JPEGData data_in;
   if (frame_settings->enc->store_jpeg_metadata) {
     if (!frame_settings->values.cparams.jpeg_keep_exif ||
         !frame_settings->values.cparams.jpeg_keep_xmp) {
@@ -2178,17 +2514,15 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
                            "Need to preserve EXIF and XMP to allow JPEG "
                            "bitstream reconstruction");
     }
-    jxl::jpeg::JPEGData data_in = *io.Main().jpeg_data;
-    std::vector<uint8_t> jpeg_data;
-    if (!jxl::jpeg::EncodeJPEGData(&frame_settings->enc->memory_manager,
-                                   data_in, &jpeg_data,
-                                   frame_settings->values.cparams)) {
-      return JXL_API_ERROR(
-          frame_settings->enc, JXL_ENC_ERR_JBRD,
-          "JPEG bitstream reconstruction data cannot be encoded");
-    }
-    frame_settings->enc->jpeg_metadata = jpeg_data;
-  }
+    data_in = *io.Main().jpeg_data;
+  }
+  // The JPEG reconstruction data and the metadata boxes added above are
+  // Brotli compressed concurrently.
+  JxlEncoderStatus status = CompressBoxes(
+      frame_settings->enc,
+      frame_settings->enc->store_jpeg_metadata ? &data_in : nullptr,
+      frame_settings->values.cparams);
+  if (status != JXL_ENC_SUCCESS) return status;
 
   jxl::JxlEncoderChunkedFrameAdapter frame_data(
       xsize, ysize, frame_settings->enc->metadata.m.num_extra_channels);
@@ -2198,8 +2532,11 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
       &frame_settings->enc->memory_manager,
       // JxlEncoderQueuedFrame is a struct with no constructors, so we use the
       // default move constructor there.
-      jxl::JxlEncoderQueuedFrame{
-          frame_settings->values, std::move(frame_data), {}});
+      jxl::JxlEncoderQueuedFrame{frame_settings->values,
+                                 std::move(frame_data),
+                                 {},
+                                 /*is_encoded=*/false,
+                                 {}});
   if (!queued_frame) {
     // TODO(jon): when can this happen? is this an API usage error?
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
@@ -2212,9 +2549,12 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
   return JxlErrorOrStatus::Success();
 }
 
+// Extra channels that are not interleaved with the color channels are read
+// from `input`, so they are only supported with a chunked input source.
 static bool CanDoFastLossless(const JxlEncoderFrameSettings* frame_settings,
                               const JxlPixelFormat* pixel_format,
-                              bool has_alpha) {
+                              bool has_alpha,
+                              JxlChunkedFrameInputSource* input) {
   if (!frame_settings->values.lossless) {
     return false;
   }
@@ -2223,12 +2563,23 @@ static bool CanDoFastLossless(const JxlEncoderFrameSettings* frame_settings,
   if (frame_settings->values.frame_index_box) {
     return false;
   }
-  if (frame_settings->values.header.layer_info.have_crop) {
+  if (frame_settings->enc->metadata.m.have_animation &&
+      frame_settings->enc->metadata.m.animation.have_timecodes) {
     return false;
   }
-  if (frame_settings->enc->metadata.m.have_animation) {
+  // Cropped frames only replace their region of the reference frame.
+  const JxlLayerInfo& layer_info = frame_settings->values.header.layer_info;
+  if (layer_info.blend_info.blendmode != JXL_BLEND_REPLACE ||
+      layer_info.save_as_reference >= 3) {
     return false;
   }
+  for (const JxlBlendInfo& ec_blend_info :
+       frame_settings->values.extra_channel_blend_info) {
+    if (ec_blend_info.blendmode != JXL_BLEND_REPLACE ||
+        ec_blend_info.source != layer_info.blend_info.source) {
+      return false;
+    }
+  }
   if (frame_settings->values.cparams.speed_tier != jxl::SpeedTier::kLightning) {
     return false;
   }
@@ -2247,29 +2598,75 @@ static bool CanDoFastLossless(const JxlEncoderFrameSettings* frame_settings,
   if (!frame_settings->values.frame_name.empty()) {
     return false;
   }
-  // No extra channels other than alpha.
-  if (!(has_alpha && frame_settings->enc->metadata.m.num_extra_channels == 1) &&
-      frame_settings->enc->metadata.m.num_extra_channels != 0) {
+  const jxl::ImageMetadata& metadata = frame_settings->enc->metadata.m;
+  const bool interleaved_alpha =
+      pixel_format->num_channels == 2 || pixel_format->num_channels == 4;
+  // The interleaved alpha channel is the first extra channel.
+  if (interleaved_alpha &&
+      (!has_alpha ||
+       metadata.extra_channel_info[0].type != jxl::ExtraChannel::kAlpha)) {
     return false;
   }
-  if (frame_settings->enc->metadata.m.bit_depth.bits_per_sample > 16) {
+  const size_t num_separate_ec =
+      metadata.num_extra_channels - (interleaved_alpha ? 1 : 0);
+  if (num_separate_ec != 0 && input == nullptr) {
     return false;
   }
-  if (pixel_format->data_type != JxlDataType::JXL_TYPE_FLOAT16 &&
-      pixel_format->data_type != JxlDataType::JXL_TYPE_UINT16 &&
-      pixel_format->data_type != JxlDataType::JXL_TYPE_UINT8) {
-    return false;
+  const jxl::BitDepth& bit_depth = metadata.bit_depth;
+  // 32-bit floats are encoded as the bit patterns of the samples, which
+  // requires the extra channels to be the same kind of float.
+  const auto is_float32 = [](const jxl::BitDepth& depth) {
+    return depth.floating_point_sample && depth.bits_per_sample == 32 &&
+           depth.exponent_bits_per_sample == 8;
+  };
+  if (is_float32(bit_depth)) {
+    if (pixel_format->data_type != JxlDataType::JXL_TYPE_FLOAT) {
+      return false;
+    }
+    for (const jxl::ExtraChannelInfo& eci : metadata.extra_channel_info) {
+      if (!is_float32(eci.bit_depth)) return false;
+    }
+  } else {
+    if (bit_depth.bits_per_sample > 16) {
+      return false;
+    }
+    if (pixel_format->data_type != JxlDataType::JXL_TYPE_FLOAT16 &&
+        pixel_format->data_type != JxlDataType::JXL_TYPE_UINT16 &&
+        pixel_format->data_type != JxlDataType::JXL_TYPE_UINT8) {
+      return false;
+    }
+    if ((bit_depth.bits_per_sample > 8) !=
+        (pixel_format->data_type == JxlDataType::JXL_TYPE_UINT16 ||
+         pixel_format->data_type == JxlDataType::JXL_TYPE_FLOAT16)) {
+      return false;
+    }
   }
-  if ((frame_settings->enc->metadata.m.bit_depth.bits_per_sample > 8) !=
-      (pixel_format->data_type == JxlDataType::JXL_TYPE_UINT16 ||
-       pixel_format->data_type == JxlDataType::JXL_TYPE_FLOAT16)) {
-    return false;
+  // Separate extra channels are encoded at full resolution, with the sample
+  // handling of the color channels.
+  for (size_t i = interleaved_alpha ? 1 : 0; i < metadata.num_extra_channels;
+       i++) {
+    const jxl::ExtraChannelInfo& eci = metadata.extra_channel_info[i];
+    if (eci.dim_shift != 0 ||
+        eci.bit_depth.floating_point_sample !=
+            bit_depth.floating_point_sample ||
+        eci.bit_depth.bits_per_sample > bit_depth.bits_per_sample) {
+      return false;
+    }
   }
-  if (!((pixel_format->num_channels == 1 || pixel_format->num_channels == 3) &&
-        !has_alpha) &&
-      !((pixel_format->num_channels == 2 || pixel_format->num_channels == 4) &&
-        has_alpha)) {
-    return false;
+  // Checked last, as the callback should only be called once per channel.
+  const auto is_big_endian = [](const JxlPixelFormat& format) {
+    return format.endianness == JXL_BIG_ENDIAN ||
+           (format.endianness == JXL_NATIVE_ENDIAN && !IsLittleEndian());
+  };
+  for (size_t i = 0; i < num_separate_ec; i++) {
+    JxlPixelFormat ec_format = {1, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+    input->get_extra_channel_pixel_format(
+        input->opaque, (interleaved_alpha ? 1 : 0) + i, &ec_format);
+    if (ec_format.num_channels != 1 ||
+        ec_format.data_type != pixel_format->data_type ||
+        is_big_endian(ec_format) != is_big_endian(*pixel_format)) {
+      return false;
+    }
   }
 
   return true;
@@ -2335,7 +2732,10 @@ JxlEncoderStatus JxlEncoderAddImageFrameInternal(
   bool has_alpha = frame_settings->enc->metadata.m.HasAlpha();
 
   // All required conditions to do fast-lossless.
-  if (CanDoFastLossless(frame_settings, &pixel_format, has_alpha)) {
+  JxlChunkedFrameInputSource input_source = frame_data.GetInputSource();
+  if (CanDoFastLossless(frame_settings, &pixel_format, has_alpha,
+                        frame_data.StreamingInput() ? &input_source
+                                                    : nullptr)) {
     const bool big_endian =
         pixel_format.endianness == JXL_BIG_ENDIAN ||
         (pixel_format.endianness == JXL_NATIVE_ENDIAN && !IsLittleEndian());
@@ -2343,9 +2743,29 @@ JxlEncoderStatus JxlEncoderAddImageFrameInternal(
     RunnerTicket ticket{frame_settings->enc->thread_pool.get()};
     JXL_BOOL oneshot = TO_JXL_BOOL(!frame_data.StreamingInput());
     auto* frame_state = JxlFastLosslessPrepareFrame(
-        frame_data.GetInputSource(), xsize, ysize, num_channels,
+        input_source, xsize, ysize, num_channels,
+        frame_settings->enc->metadata.m.num_extra_channels -
+            has_interleaved_alpha,
         frame_settings->enc->metadata.m.bit_depth.bits_per_sample, big_endian,
-        /*effort=*/2, oneshot);
+        /*effort=*/2, oneshot, /*max_error=*/0);
+    const jxl::CodecMetadata& metadata = frame_settings->enc->metadata;
+    const JxlLayerInfo& layer_info = frame_settings->values.header.layer_info;
+    if (layer_info.have_crop) {
+      JxlFastLosslessSetFrameLayer(
+          frame_state, metadata.xsize(), metadata.ysize(), layer_info.crop_x0,
+          layer_info.crop_y0, layer_info.blend_info.source,
+          layer_info.save_as_reference);
+    } else {
+      JxlFastLosslessSetFrameLayer(frame_state, xsize, ysize, 0, 0,
+                                   layer_info.blend_info.source,
+                                   layer_info.save_as_reference);
+    }
+    if (metadata.m.have_animation) {
+      JxlFastLosslessSetAnimationFrame(
+          frame_state, metadata.m.animation.tps_numerator,
+          metadata.m.animation.tps_denominator,
+          frame_settings->values.header.duration);
+    }
     if (!streaming) {
       bool ok =
           JxlFastLosslessProcessFrame(frame_state, /*is_last=*/false, &ticket,
@@ -2359,10 +2779,11 @@ JxlEncoderStatus JxlEncoderAddImageFrameInternal(
     return JxlErrorOrStatus::Success();
   }
 
-  if (!streaming) {
+  if (!streaming && !frame_settings->values.zero_copy_input) {
     // The input callbacks are only guaranteed to be available during frame
-    // encoding when both the input and the output is streaming. In all other
-    // cases we need to create an internal copy of the frame data.
+    // encoding when both the input and the output is streaming, or when the
+    // caller asked for zero-copy input. In all other cases we need to create
+    // an internal copy of the frame data.
     if (!frame_data.CopyBuffers()) {
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
                            "Invalid chunked frame input source");
@@ -2384,8 +2805,11 @@ JxlEncoderStatus JxlEncoderAddImageFrameInternal(
       &frame_settings->enc->memory_manager,
       // JxlEncoderQueuedFrame is a struct with no constructors, so we use the
       // default move constructor there.
-      jxl::JxlEncoderQueuedFrame{
-          frame_settings->values, std::move(frame_data), {}});
+      jxl::JxlEncoderQueuedFrame{frame_settings->values,
+                                 std::move(frame_data),
+                                 {},
+                                 /*is_encoded=*/false,
+                                 {}});
 
   if (!queued_frame) {
     // TODO(jon): when can this happen? is this an API usage error?
@@ -2540,8 +2964,9 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
   }
   const uint8_t* uint8_buffer = reinterpret_cast<const uint8_t*>(buffer);
   auto* queued_frame = frame_settings->enc->input_queue.back().frame.get();
-  if (!queued_frame->frame_data.SetFromBuffer(1 + index, uint8_buffer, size,
-                                              ec_format)) {
+  if (!queued_frame->frame_data.SetFromBuffer(
+          1 + index, uint8_buffer, size, ec_format,
+          queued_frame->option_values.zero_copy_input)) {
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
                          "provided image buffer too small");
   }
@@ -2679,6 +3104,57 @@ JxlEncoderStatus JxlEncoderSetFrameBitDepth(
   return JxlErrorOrStatus::Success();
 }
 
+JxlEncoderStatus JxlEncoderFrameSettingsSetModularTree(
+    JxlEncoderFrameSettings* frame_settings, const uint8_t* tree,
+    size_t size) {
+  jxl::Tree& custom_tree = frame_settings->values.cparams.custom_fixed_tree;
+  custom_tree.clear();
+  if (size == 0) return JxlErrorOrStatus::Success();
+  if (!jxl::DeserializeTree(&frame_settings->enc->memory_manager,
+                            jxl::Span<const uint8_t>(tree, size),
+                            &custom_tree)) {
+    custom_tree.clear();
+    return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                         "Invalid MA tree");
+  }
+  return JxlErrorOrStatus::Success();
+}
+
+JxlEncoderStatus JxlEncoderGetModularTreeSize(JxlEncoder* enc, size_t* size) {
+  if (enc->modular_tree.empty()) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "No frame with a global MA tree was encoded");
+  }
+#define QUIT(message) return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, message)
+  JXL_ASSIGN_OR_QUIT(
+      std::vector<uint8_t> bytes,
+      jxl::SerializeTree(&enc->memory_manager, enc->modular_tree),
+      "Failed to serialize the MA tree");
+#undef QUIT
+  *size = bytes.size();
+  return JxlErrorOrStatus::Success();
+}
+
+JxlEncoderStatus JxlEncoderGetModularTree(JxlEncoder* enc, uint8_t* tree,
+                                          size_t size) {
+  if (enc->modular_tree.empty()) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "No frame with a global MA tree was encoded");
+  }
+#define QUIT(message) return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, message)
+  JXL_ASSIGN_OR_QUIT(
+      std::vector<uint8_t> bytes,
+      jxl::SerializeTree(&enc->memory_manager, enc->modular_tree),
+      "Failed to serialize the MA tree");
+#undef QUIT
+  if (bytes.size() != size) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "Buffer size does not match the MA tree size");
+  }
+  memcpy(tree, bytes.data(), size);
+  return JxlErrorOrStatus::Success();
+}
+
 void JxlColorEncodingSetToSRGB(JxlColorEncoding* color_encoding,
                                JXL_BOOL is_gray) {
   *color_encoding =
@@ -2773,6 +3249,12 @@ JXL_EXPORT size_t JxlEncoderStatsGet(const JxlEncoderStats* stats,
       return aux_out.num_dct64_blocks;
     case JXL_ENC_STAT_NUM_BUTTERAUGLI_ITERS:
       return aux_out.num_butteraugli_iters;
+    case JXL_ENC_STAT_NUM_WP_TREE_NODES:
+      return aux_out.num_wp_tree_nodes;
+    case JXL_ENC_STAT_NUM_ANS_HISTOGRAMS:
+      return aux_out.num_ans_histograms;
+    case JXL_ENC_STAT_NUM_LOOP_FILTERED_FRAMES:
+      return aux_out.num_loop_filtered_frames;
     default:
       return 0;
   }
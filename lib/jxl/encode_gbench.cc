@@ -0,0 +1,216 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Costly parts of the encoder, on a crop of a test image and on a synthetic
+// image of the same size. Throughput is reported in megapixels per second.
+
+#include <jxl/cms.h>
+#include <jxl/encode.h>
+#include <jxl/memory_manager.h>
+#include <jxl/types.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/codec.h"
+#include "lib/extras/enc/jxl.h"
+#include "lib/extras/packed_image.h"
+#include "lib/extras/packed_image_convert.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/rect.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/codec_in_out.h"
+#include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/enc_adaptive_quantization.h"
+#include "lib/jxl/enc_ans_params.h"
+#include "lib/jxl/enc_cluster.h"
+#include "lib/jxl/enc_context_map.h"
+#include "lib/jxl/enc_xyb.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_ops.h"
+#include "tools/file_io.h"
+#include "tools/no_memory_manager.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+enum Input : int64_t { kFlower = 0, kSynthetic = 1 };
+
+// Smooth gradients, sharp edges and noise, roughly in the range of sRGB.
+void FillSynthetic(Image3F* image) {
+  Rng rng(0);
+  const size_t xsize = image->xsize();
+  const size_t ysize = image->ysize();
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      float* JXL_RESTRICT row = image->PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        float v = 0.5f + 0.3f * std::sin(0.01f * (x + 2 * c * y));
+        if (((x / 64) + (y / 64)) % 2 == 0) v = 1.f - v;
+        v += rng.UniformF(-0.05f, 0.05f);
+        row[x] = std::min(std::max(v, 0.f), 1.f);
+      }
+    }
+  }
+}
+
+// A crop of the top left corner of the flower test image, or the synthetic
+// image, in sRGB.
+Status MakeInput(int64_t input, size_t xsize, size_t ysize, CodecInOut* io) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  JXL_ASSIGN_OR_RETURN(Image3F color,
+                       Image3F::Create(memory_manager, xsize, ysize));
+  if (input == kFlower) {
+    std::vector<uint8_t> bytes;
+    JXL_RETURN_IF_ERROR(jpegxl::tools::ReadFile(
+        std::string(TEST_DATA_PATH "/jxl/flower/flower.png"), &bytes));
+    CodecInOut flower{memory_manager};
+    JXL_RETURN_IF_ERROR(SetFromBytes(Bytes(bytes), &flower));
+    JXL_RETURN_IF_ERROR(flower.Main().TransformTo(
+        ColorEncoding::SRGB(), *JxlGetDefaultCms()));
+    const Image3F& pixels = *flower.Main().color();
+    JXL_ENSURE(pixels.xsize() >= xsize && pixels.ysize() >= ysize);
+    JXL_RETURN_IF_ERROR(CopyImageTo(Rect(0, 0, xsize, ysize), pixels,
+                                    Rect(color), &color));
+  } else {
+    FillSynthetic(&color);
+  }
+  io->metadata.m.SetUintSamples(8);
+  return io->SetFromImage(std::move(color), ColorEncoding::SRGB());
+}
+
+void SetMegapixelsProcessed(benchmark::State& state, size_t num_pixels) {
+  state.counters["MP/s"] = benchmark::Counter(
+      1e-6 * num_pixels * state.iterations(), benchmark::Counter::kIsRate);
+}
+
+constexpr size_t kSize = 1024;
+
+void BM_ToXYB(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  CodecInOut io{memory_manager};
+  BM_CHECK(MakeInput(state.range(0), kSize, kSize, &io));
+  // ToXYB allocates the XYB image, the linear one is given.
+  Image3F xyb;
+  JXL_ASSIGN_OR_QUIT(Image3F linear,
+                     Image3F::Create(memory_manager, kSize, kSize),
+                     "Failed to allocate linear image.");
+  for (auto _ : state) {
+    (void)_;
+    BM_CHECK(ToXYB(io.Main(), nullptr, &xyb, *JxlGetDefaultCms(), &linear));
+  }
+  SetMegapixelsProcessed(state, kSize * kSize);
+}
+
+BENCHMARK(BM_ToXYB)->ArgName("synthetic")->DenseRange(kFlower, kSynthetic);
+
+void BM_InitialQuantField(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  CodecInOut io{memory_manager};
+  BM_CHECK(MakeInput(state.range(0), kSize, kSize, &io));
+  Image3F xyb;
+  BM_CHECK(ToXYB(io.Main(), nullptr, &xyb, *JxlGetDefaultCms()));
+  for (auto _ : state) {
+    (void)_;
+    ImageF mask;
+    ImageF mask1x1;
+    JXL_ASSIGN_OR_QUIT(ImageF quant_field,
+                       InitialQuantField(/*butteraugli_target=*/1.0f, xyb,
+                                         Rect(xyb), nullptr, 1.0f, &mask,
+                                         &mask1x1),
+                       "Failed to compute the quant field.");
+    benchmark::DoNotOptimize(quant_field.Row(0)[0]);
+  }
+  SetMegapixelsProcessed(state, kSize * kSize);
+}
+
+BENCHMARK(BM_InitialQuantField)
+    ->ArgName("synthetic")
+    ->DenseRange(kFlower, kSynthetic);
+
+// Clusters `num_histograms` geometric-like histograms of varied slopes, as
+// those of the contexts of an image.
+void BM_ClusterHistograms(benchmark::State& state) {
+  const size_t num_histograms = state.range(0);
+  Rng rng(0);
+  std::vector<Histogram> histograms(num_histograms);
+  for (Histogram& histogram : histograms) {
+    const Rng::GeometricDistribution dist =
+        Rng::MakeGeometric(rng.UniformF(0.05f, 0.8f));
+    for (size_t i = 0; i < 4096; ++i) {
+      histogram.Add(std::min<uint32_t>(rng.Geometric(dist), 63));
+    }
+  }
+  HistogramParams params;
+  params.clustering = state.range(1) ? HistogramParams::ClusteringType::kBest
+                                     : HistogramParams::ClusteringType::kFast;
+  for (auto _ : state) {
+    (void)_;
+    std::vector<Histogram> clustered;
+    std::vector<uint32_t> symbols;
+    BM_CHECK(ClusterHistograms(params, histograms, kClustersLimit, &clustered,
+                               &symbols));
+    benchmark::DoNotOptimize(clustered.size());
+  }
+  state.SetItemsProcessed(num_histograms * state.iterations());
+}
+
+BENCHMARK(BM_ClusterHistograms)
+    ->ArgNames({"histograms", "best"})
+    ->ArgsProduct({{16, 64, 256}, {0, 1}});
+
+// Whole encodes at each effort, which is where the AC strategy and quantizer
+// searches (VarDCT), the tree learning (modular) and the patch search run.
+void BM_Encode(benchmark::State& state, bool lossless) {
+  constexpr size_t kEncodeSize = 512;
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  CodecInOut io{memory_manager};
+  BM_CHECK(MakeInput(state.range(0), kEncodeSize, kEncodeSize, &io));
+  extras::PackedPixelFile ppf;
+  const JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  BM_CHECK(extras::ConvertCodecInOutToPackedPixelFile(
+      io, format, ColorEncoding::SRGB(), nullptr, &ppf));
+
+  extras::JXLCompressParams params;
+  params.distance = lossless ? 0.f : 1.f;
+  params.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, state.range(1));
+  for (auto _ : state) {
+    (void)_;
+    std::vector<uint8_t> compressed;
+    BM_CHECK(extras::EncodeImageJXL(params, ppf, nullptr, &compressed));
+  }
+  SetMegapixelsProcessed(state, kEncodeSize * kEncodeSize);
+}
+
+void BM_EncodeVarDCT(benchmark::State& state) { BM_Encode(state, false); }
+void BM_EncodeLossless(benchmark::State& state) { BM_Encode(state, true); }
+
+BENCHMARK(BM_EncodeVarDCT)
+    ->ArgNames({"synthetic", "effort"})
+    ->ArgsProduct({{kFlower, kSynthetic}, benchmark::CreateDenseRange(1, 9, 1)})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_EncodeLossless)
+    ->ArgNames({"synthetic", "effort"})
+    ->ArgsProduct({{kFlower, kSynthetic}, benchmark::CreateDenseRange(1, 9, 1)})
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace jxl
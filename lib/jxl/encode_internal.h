@@ -30,8 +30,11 @@
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_fast_lossless.h"
 #include "lib/jxl/enc_params.h"
+#include "lib/jxl/enc_patch_dictionary.h"
+#include "lib/jxl/enc_xyb.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 #include "lib/jxl/memory_manager_internal.h"
@@ -129,6 +132,8 @@ typedef struct JxlEncoderFrameSettingsValuesStruct {
   std::string frame_name;
   JxlBitDepth image_bit_depth;
   bool frame_index_box = false;
+  // Set by JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT.
+  bool zero_copy_input = false;
   jxl::AuxOut* aux_out = nullptr;
 } JxlEncoderFrameSettingsValues;
 
@@ -202,13 +207,15 @@ class JxlEncoderChunkedFrameAdapter {
     has_input_source_ = true;
   }
 
+  // The buffers of extra channels are copied right away, unless `zero_copy`;
+  // the one of the color channels is copied by CopyBuffers.
   bool SetFromBuffer(size_t channel, const uint8_t* buffer, size_t size,
-                     JxlPixelFormat format) {
+                     JxlPixelFormat format, bool zero_copy = false) {
     if (channel >= channels_.size()) return false;
     if (!channels_[channel].SetFromBuffer(buffer, size, format, xsize, ysize)) {
       return false;
     }
-    if (channel > 0) channels_[channel].CopyBuffer();
+    if (channel > 0 && !zero_copy) channels_[channel].CopyBuffer();
     return true;
   }
 
@@ -375,12 +382,19 @@ struct JxlEncoderQueuedFrame {
   JxlEncoderFrameSettingsValues option_values;
   JxlEncoderChunkedFrameAdapter frame_data;
   std::vector<uint8_t> ec_initialized;
+  // Set when the frame was encoded ahead of its turn, together with the
+  // frames around it; `encoded` then has its codestream.
+  bool is_encoded;
+  std::vector<uint8_t> encoded;
 };
 
 struct JxlEncoderQueuedBox {
   BoxType type;
   std::vector<uint8_t> contents;
   bool compress_box;
+  // The contents were already replaced by those of the brob box, i.e. the
+  // original box type followed by the Brotli compressed contents.
+  bool compressed = false;
 };
 
 using FJXLFrameUniquePtr =
@@ -596,6 +610,16 @@ jxl::Status AppendData(JxlEncoderOutputProcessorWrapper& output_processor,
 // JxlEncoderCreate.
 struct JxlEncoderStruct {
   JxlEncoderStruct() : output_processor(&memory_manager) {}
+  // Set by JxlEncoderSetHugePageThreshold, JxlEncoderSetMemoryLimit and
+  // JxlEncoderSetMemoryArena, each wrapping the memory_manager in use at that
+  // time. Declared first so that they outlive all the allocations made from
+  // them, and the arena last since the others may be its backing memory
+  // manager.
+  std::unique_ptr<jxl::HugePageAdvisor> huge_pages;
+  std::unique_ptr<jxl::MemoryTracker> memory_tracker;
+  std::unique_ptr<jxl::MemoryArena> arena;
+  // As passed to JxlEncoderCreate.
+  JxlMemoryManager user_memory_manager;
   JxlMemoryManager memory_manager;
   jxl::MemoryManagerUniquePtr<jxl::ThreadPool> thread_pool{
       nullptr, jxl::MemoryManagerDeleteHelper(&memory_manager)};
@@ -634,6 +658,19 @@ struct JxlEncoderStruct {
 
   jxl::CompressParams last_used_cparams;
   JxlBasicInfo basic_info;
+  // Global MA tree of the last encoded frame that had one, for
+  // JxlEncoderGetModularTree.
+  jxl::Tree modular_tree;
+  // Patch frame that the next frames can refer to instead of encoding their
+  // own, if they repeat the same patches.
+  jxl::PatchReferenceCache patch_cache;
+  // Set by JxlEncoderReuseColorTransform. The cache is kept by
+  // JxlEncoderResetKeepSettings.
+  bool reuse_color_transform = false;
+  jxl::XybCache xyb_cache;
+  // Buffers of the last frame encoded in one shot, for the next frames. Kept by
+  // JxlEncoderResetKeepSettings.
+  std::unique_ptr<jxl::PassesEncoderState> spare_enc_state;
 
   JxlEncoderError error = JxlEncoderError::JXL_ENC_ERR_OK;
 
@@ -12,8 +12,11 @@
 #include <jxl/encode.h>
 #include <jxl/encode_cxx.h>
 #include <jxl/memory_manager.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -270,6 +273,66 @@ TEST(EncodeTest, EncoderResetTest) {
                       false);
 }
 
+TEST(EncodeTest, MemoryArenaTest) {
+  struct CalledCounters {
+    int allocs = 0;
+    int frees = 0;
+  } counters;
+
+  JxlMemoryManager mm;
+  mm.opaque = &counters;
+  mm.alloc = [](void* opaque, size_t size) {
+    reinterpret_cast<CalledCounters*>(opaque)->allocs++;
+    return malloc(size);
+  };
+  mm.free = [](void* opaque, void* address) {
+    if (address) reinterpret_cast<CalledCounters*>(opaque)->frees++;
+    free(address);
+  };
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(&mm);
+    EXPECT_NE(nullptr, enc.get());
+    // Allocated before the arena, freed through it.
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR, JxlEncoderSetMemoryArena(enc.get(), 0));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetMemoryArena(enc.get(), 1 << 20));
+    EXPECT_EQ(JXL_ENC_ERROR, JxlEncoderSetMemoryArena(enc.get(), 1 << 20));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+    JxlEncoderReset(enc.get());
+    VerifyFrameEncoding(enc.get(),
+                        JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+  }
+  EXPECT_EQ(counters.allocs, counters.frees);
+}
+
+TEST(EncodeTest, MemoryLimitTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  uint64_t peak_bytes = 0;
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderGetPeakMemoryUsage(enc.get(), &peak_bytes));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetMemoryLimit(enc.get(), uint64_t{1} << 30));
+  VerifyFrameEncoding(enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderGetPeakMemoryUsage(enc.get(), &peak_bytes));
+  EXPECT_LT(0u, peak_bytes);
+  EXPECT_GE(uint64_t{1} << 30, peak_bytes);
+}
+
+TEST(EncodeTest, HugePageThresholdTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  // Advise every allocation, to exercise the path even on small images.
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetHugePageThreshold(enc.get(), 1));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetMemoryArena(enc.get(), 1 << 22));
+  VerifyFrameEncoding(enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+}
+
 TEST(EncodeTest, CmsTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -395,6 +458,54 @@ TEST(EncodeTest, FrameSettingsTest) {
     EXPECT_EQ(JXL_ENC_SUCCESS,
               JxlEncoderFrameSettingsSetFloatOption(
                   frame_settings, JXL_ENC_FRAME_SETTING_PHOTON_NOISE, 100.0f));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings,
+                  JXL_ENC_FRAME_SETTING_TARGET_BUTTERAUGLI_SCORE, -2.0f));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings,
+                  JXL_ENC_FRAME_SETTING_TARGET_BUTTERAUGLI_SCORE, 2.0f));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings,
+                  JXL_ENC_FRAME_SETTING_TARGET_BUTTERAUGLI_SCORE, -1.0f));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings,
+                  JXL_ENC_FRAME_SETTING_AC_STRATEGY_PRUNING_PERCENT, 101.0f));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings,
+                  JXL_ENC_FRAME_SETTING_AC_STRATEGY_PRUNING_PERCENT, 50.0f));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING,
+                  0));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING,
+                  8));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_PREFIX_CODES, 2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_PREFIX_CODES, 1));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TIME_BUDGET, -2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TIME_BUDGET, 0));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI,
+                  2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI,
+                  1));
     EXPECT_EQ(
         JXL_ENC_ERROR,
         JxlEncoderFrameSettingsSetFloatOption(
@@ -486,6 +597,38 @@ TEST(EncodeTest, FrameSettingsTest) {
     EXPECT_EQ(2u, enc->last_used_cparams.decoding_speed_tier);
   }
 
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, 9));
+    // An exhausted budget still produces a valid frame.
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TIME_BUDGET, 0));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+    EXPECT_EQ(0, enc->last_used_cparams.time_budget_ms);
+  }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, 8));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI,
+                  1));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+    EXPECT_TRUE(enc->last_used_cparams.approximate_butteraugli);
+  }
+
   {
     JxlEncoderPtr enc = JxlEncoderMake(nullptr);
     EXPECT_NE(nullptr, enc.get());
@@ -506,6 +649,22 @@ TEST(EncodeTest, FrameSettingsTest) {
     EXPECT_EQ(5, enc->last_used_cparams.center_x);
   }
 
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_GROUP_ORDER, 3));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_GROUP_ORDER, 2));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+    EXPECT_EQ(false, enc->last_used_cparams.centerfirst);
+    EXPECT_EQ(true, enc->last_used_cparams.tiled_group_order);
+  }
+
   {
     JxlEncoderPtr enc = JxlEncoderMake(nullptr);
     EXPECT_NE(nullptr, enc.get());
@@ -1042,6 +1201,340 @@ static void ProcessEncoder(JxlEncoder* enc, std::vector<uint8_t>& compressed,
   EXPECT_EQ(JXL_ENC_SUCCESS, process_result);
 }
 
+JXL_TRANSCODE_JPEG_TEST(EncodeTest, JPEGResetKeepSettingsTest) {
+  const auto transcode = [](JxlEncoder* enc,
+                            JxlEncoderFrameSettings* frame_settings,
+                            const std::vector<uint8_t>& jpeg)
+      -> std::vector<uint8_t> {
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddJPEGFrame(frame_settings, jpeg.data(), jpeg.size()));
+    JxlEncoderCloseInput(enc);
+    std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc, compressed, next_out, avail_out);
+    return compressed;
+  };
+  const auto setup = [](JxlEncoder* enc) -> JxlEncoderFrameSettings* {
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderStoreJPEGMetadata(enc, JXL_TRUE));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc, nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, 3));
+    return frame_settings;
+  };
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlEncoderFrameSettings* frame_settings = setup(enc.get());
+  for (const char* jpeg_path : {"jxl/flower/flower.png.im_q85_420.jpg",
+                                "jxl/jpeg_reconstruction/1x1_exif_xmp.jpg",
+                                "jxl/flower/flower.png.im_q85_444.jpg"}) {
+    const std::vector<uint8_t> orig = jxl::test::ReadTestData(jpeg_path);
+    // The settings and the frame settings are kept for the next image.
+    const std::vector<uint8_t> compressed =
+        transcode(enc.get(), frame_settings, orig);
+    JxlEncoderResetKeepSettings(enc.get());
+
+    JxlEncoderPtr fresh_enc = JxlEncoderMake(nullptr);
+    EXPECT_EQ(compressed, transcode(fresh_enc.get(), setup(fresh_enc.get()),
+                                    orig));
+
+    jxl::extras::JXLDecompressParams dparams;
+    jxl::test::DefaultAcceptedFormats(dparams);
+    std::vector<uint8_t> decoded_jpeg_bytes;
+    jxl::extras::PackedPixelFile ppf;
+    EXPECT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                               nullptr, &ppf, &decoded_jpeg_bytes));
+    EXPECT_EQ(orig, decoded_jpeg_bytes);
+  }
+}
+
+TEST(EncodeTest, ReuseColorTransformTest) {
+  const size_t xsize = 128;
+  const size_t ysize = 96;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  const std::vector<uint8_t> other_pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 1);
+
+  const auto encode = [&](JxlEncoder* enc, float distance,
+                          const std::vector<uint8_t>& image) {
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc, nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameDistance(frame_settings, distance));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc, &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetColorEncoding(enc, &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      image.data(), image.size()));
+    JxlEncoderCloseInput(enc);
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc, compressed, next_out, avail_out);
+    return compressed;
+  };
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlEncoderReuseColorTransform(enc.get(), JXL_TRUE);
+  // The second image replaces the kept one, and is then reused in turn.
+  for (const auto& image : {pixels, pixels, other_pixels, other_pixels}) {
+    for (float distance : {1.0f, 3.0f}) {
+      std::vector<uint8_t> compressed = encode(enc.get(), distance, image);
+      JxlEncoderResetKeepSettings(enc.get());
+      JxlEncoderPtr fresh_enc = JxlEncoderMake(nullptr);
+      EXPECT_EQ(encode(fresh_enc.get(), distance, image), compressed);
+    }
+  }
+}
+
+TEST(EncodeTest, ResetKeepSettingsReusesBuffersTest) {
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const auto encode = [&](JxlEncoder* enc, size_t xsize, size_t ysize) {
+    const std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, xsize + ysize);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc, nullptr);
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc, &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetColorEncoding(enc, &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc);
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc, compressed, next_out, avail_out);
+    return compressed;
+  };
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  // The buffers of each image are reused by the next one if it has the same
+  // size, and reallocated otherwise.
+  for (size_t size : {300, 300, 64, 300}) {
+    std::vector<uint8_t> compressed = encode(enc.get(), size, size - 20);
+    JxlEncoderResetKeepSettings(enc.get());
+    JxlEncoderPtr fresh_enc = JxlEncoderMake(nullptr);
+    EXPECT_EQ(encode(fresh_enc.get(), size, size - 20), compressed);
+  }
+}
+
+TEST(EncodeTest, DecodingSpeedStatsTest) {
+  const size_t xsize = 128;
+  const size_t ysize = 96;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+
+  const auto encode = [&](int64_t decoding_speed, bool modular,
+                          JxlEncoderStats* stats) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    JxlEncoderCollectStats(frame_settings, stats);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameDistance(frame_settings, 2.0f));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_DECODING_SPEED,
+                  decoding_speed));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_MODULAR, modular));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+  };
+
+  for (bool modular : {false, true}) {
+    JxlEncoderStats* slow = JxlEncoderStatsCreate();
+    encode(0, modular, slow);
+    if (!modular) {
+      EXPECT_EQ(1u, JxlEncoderStatsGet(slow,
+                                       JXL_ENC_STAT_NUM_LOOP_FILTERED_FRAMES));
+    }
+    JxlEncoderStatsDestroy(slow);
+
+    JxlEncoderStats* fast = JxlEncoderStatsCreate();
+    encode(4, modular, fast);
+    EXPECT_EQ(0u, JxlEncoderStatsGet(fast, JXL_ENC_STAT_NUM_WP_TREE_NODES));
+    EXPECT_EQ(0u, JxlEncoderStatsGet(fast, JXL_ENC_STAT_NUM_ANS_HISTOGRAMS));
+    EXPECT_EQ(0u,
+              JxlEncoderStatsGet(fast, JXL_ENC_STAT_NUM_LOOP_FILTERED_FRAMES));
+    JxlEncoderStatsDestroy(fast);
+  }
+}
+
+TEST(EncodeTest, ModularTreeTest) {
+  const size_t xsize = 128;
+  const size_t ysize = 96;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+
+  // Encodes losslessly with the given tree, unless it is empty, and outputs the
+  // global tree of the frame if `tree_out` is not null.
+  const auto encode = [&](int64_t effort, const std::vector<uint8_t>& tree,
+                          std::vector<uint8_t>* tree_out) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    size_t tree_size;
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderGetModularTreeSize(enc.get(), &tree_size));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, effort));
+    if (!tree.empty()) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderFrameSettingsSetModularTree(
+                    frame_settings, tree.data(), tree.size()));
+    }
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = JXL_TRUE;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    if (tree_out) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderGetModularTreeSize(enc.get(), &tree_size));
+      tree_out->resize(tree_size);
+      EXPECT_EQ(JXL_ENC_ERROR, JxlEncoderGetModularTree(
+                                   enc.get(), tree_out->data(), tree_size - 1));
+      EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderGetModularTree(
+                                     enc.get(), tree_out->data(), tree_size));
+    }
+    return compressed;
+  };
+
+  std::vector<uint8_t> tree;
+  std::vector<uint8_t> learned = encode(10, {}, &tree);
+  ASSERT_FALSE(tree.empty());
+  // At effort 7, lossless frames learn a tree per group, unless given one.
+  std::vector<uint8_t> reused_tree;
+  std::vector<uint8_t> reused = encode(7, tree, &reused_tree);
+  EXPECT_EQ(tree, reused_tree);
+  EXPECT_TRUE(SameDecodedPixels(learned, reused));
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  tree.resize(tree.size() / 2);
+  EXPECT_EQ(JXL_ENC_ERROR, JxlEncoderFrameSettingsSetModularTree(
+                               frame_settings, tree.data(), tree.size()));
+}
+
+TEST(EncodeTest, ZeroCopyInputTest) {
+  const size_t xsize = 128;
+  const size_t ysize = 96;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  const std::vector<uint8_t> other_pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 1);
+
+  // Adds `pixels` as the frame, then overwrites them with `other_pixels`
+  // before encoding.
+  const auto encode = [&](int64_t zero_copy) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderFrameSettingsSetOption(
+                                   frame_settings,
+                                   JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT,
+                                   zero_copy));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = JXL_TRUE;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    std::vector<uint8_t> buffer = pixels;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      buffer.data(), buffer.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::copy(other_pixels.begin(), other_pixels.end(), buffer.begin());
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    return compressed;
+  };
+
+  std::vector<uint8_t> copied = encode(0);
+  std::vector<uint8_t> zero_copy = encode(1);
+  // Without a copy, the encoder sees the pixels as they are when encoding.
+  EXPECT_FALSE(SameDecodedPixels(copied, zero_copy));
+  jxl::extras::PackedPixelFile ppf;
+  jxl::extras::JXLDecompressParams dparams;
+  dparams.accepted_formats.push_back(pixel_format);
+  ASSERT_TRUE(DecodeImageJXL(zero_copy.data(), zero_copy.size(), dparams,
+                             nullptr, &ppf, nullptr));
+  ASSERT_EQ(1u, ppf.frames.size());
+  const jxl::extras::PackedImage& image = ppf.frames[0].color;
+  ASSERT_EQ(other_pixels.size(), image.pixels_size);
+  EXPECT_EQ(0, memcmp(other_pixels.data(), image.pixels(), image.pixels_size));
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderFrameSettingsSetOption(
+                frame_settings, JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT, 2));
+}
+
 TEST(EncodeTest, BasicInfoTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -1343,6 +1836,189 @@ TEST(EncodeTest, CroppedFrameTest) {
   EXPECT_EQ(true, seen_frame);
 }
 
+// Animation in which the second frame only replaces a region of the first,
+// encoded with the fast lossless encoder of effort 1.
+TEST(EncodeTest, CroppedAnimationFastLosslessTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  size_t xsize = 300;
+  size_t ysize = 200;
+  size_t crop_xsize = 70;
+  size_t crop_ysize = 40;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> crop =
+      jxl::test::GetSomeTestImage(crop_xsize, crop_ysize, 3, 1);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 100;
+  basic_info.animation.tps_denominator = 1;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderSetFrameLossless(frame_settings, JXL_TRUE);
+  JxlEncoderFrameSettingsSetOption(frame_settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   1);
+
+  JxlFrameHeader header;
+  JxlEncoderInitFrameHeader(&header);
+  header.duration = 10;
+  header.layer_info.save_as_reference = 1;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameHeader(frame_settings, &header));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  header.duration = 20;
+  header.layer_info.have_crop = JXL_TRUE;
+  header.layer_info.crop_x0 = 200;
+  header.layer_info.crop_y0 = 150;
+  header.layer_info.xsize = crop_xsize;
+  header.layer_info.ysize = crop_ysize;
+  header.layer_info.blend_info.source = 1;
+  header.layer_info.save_as_reference = 0;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameHeader(frame_settings, &header));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format, crop.data(),
+                                    crop.size()));
+  JxlEncoderCloseFrames(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size() - (next_out - compressed.data());
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  std::vector<uint8_t> expected = pixels;
+  for (size_t y = 0; y < crop_ysize; ++y) {
+    memcpy(&expected[((150 + y) * xsize + 200) * 3], &crop[y * crop_xsize * 3],
+           crop_xsize * 3);
+  }
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_NE(nullptr, dec.get());
+  EXPECT_EQ(
+      JXL_DEC_SUCCESS,
+      JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+
+  std::vector<uint8_t> decoded(pixels.size());
+  size_t num_frames = 0;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_ERROR) {
+      FAIL();
+    } else if (status == JXL_DEC_SUCCESS) {
+      break;
+    } else if (status == JXL_DEC_FRAME) {
+      JxlFrameHeader header2;
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec.get(), &header2));
+      EXPECT_EQ(num_frames == 0 ? 10u : 20u, header2.duration);
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec.get(), &pixel_format,
+                                            decoded.data(), decoded.size()));
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      const std::vector<uint8_t>& want = num_frames == 0 ? pixels : expected;
+      EXPECT_EQ(0, memcmp(want.data(), decoded.data(), want.size()));
+      ++num_frames;
+    } else {
+      FAIL();  // unexpected status
+    }
+  }
+  EXPECT_EQ(2u, num_frames);
+}
+
+TEST(EncodeTest, ParallelAnimationFramesTest) {
+  const size_t xsize = 96;
+  const size_t ysize = 64;
+  const size_t num_frames = 7;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<std::vector<uint8_t>> frames;
+  for (size_t i = 0; i < num_frames; ++i) {
+    frames.push_back(jxl::test::GetSomeTestImage(xsize, ysize, 3, i));
+  }
+
+  // Small frames are encoded several at a time when there is a runner, which
+  // must give the same bytes as encoding them one after the other.
+  const auto encode = [&](bool use_runner, bool use_container) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+    if (use_runner) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                            runner.get()));
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderUseContainer(enc.get(), TO_JXL_BOOL(use_container)));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.have_animation = JXL_TRUE;
+    basic_info.animation.tps_numerator = 100;
+    basic_info.animation.tps_denominator = 1;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    for (size_t i = 0; i < num_frames; ++i) {
+      JxlFrameHeader header;
+      JxlEncoderInitFrameHeader(&header);
+      header.duration = 10 + i;
+      header.layer_info.save_as_reference = i % 2;
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetFrameHeader(frame_settings, &header));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        frames[i].data(), frames[i].size()));
+    }
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    return compressed;
+  };
+
+  for (bool use_container : {false, true}) {
+    std::vector<uint8_t> serial = encode(false, use_container);
+    std::vector<uint8_t> parallel = encode(true, use_container);
+    EXPECT_EQ(serial, parallel);
+
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FRAME));
+    JxlDecoderSetInput(dec.get(), parallel.data(), parallel.size());
+    JxlDecoderCloseInput(dec.get());
+    size_t decoded_frames = 0;
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+      if (status != JXL_DEC_FRAME) {
+        EXPECT_EQ(JXL_DEC_SUCCESS, status);
+        break;
+      }
+      JxlFrameHeader header;
+      EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec.get(), &header));
+      EXPECT_EQ(10 + decoded_frames, header.duration);
+      EXPECT_EQ(decoded_frames + 1 == num_frames, header.is_last);
+      ++decoded_frames;
+    }
+    EXPECT_EQ(num_frames, decoded_frames);
+  }
+}
+
 struct EncodeBoxTest : public testing::TestWithParam<std::tuple<bool, size_t>> {
 };
 
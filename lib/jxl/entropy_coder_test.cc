@@ -64,5 +64,29 @@ TEST(HybridUintTest, Test421) {
   HybridUintRoundtrip(HybridUintConfig{4, 2, 1}, 256);
 }
 
+template <typename FixedConfig>
+void FixedHybridUintRoundtrip(HybridUintConfig config) {
+  ASSERT_TRUE(FixedConfig::Matches(config));
+  ASSERT_FALSE(FixedConfig::Matches(HybridUintConfig{4, 1, 1}));
+  Rng rng(0);
+  for (size_t i = 0; i < (1 << 16); i++) {
+    uint32_t integer = rng.UniformU(0, (1 << 24) + 1);
+    uint32_t token;
+    uint32_t nbits;
+    uint32_t bits;
+    config.Encode(integer, &token, &nbits, &bits);
+    MockBitReader br{nbits, bits};
+    EXPECT_EQ(integer,
+              ANSSymbolReader::ReadHybridUintConfig(FixedConfig(), token, &br));
+  }
+}
+
+TEST(HybridUintTest, TestFixed000) {
+  FixedHybridUintRoundtrip<HybridUint000Config>(HybridUintConfig{0, 0, 0});
+}
+TEST(HybridUintTest, TestFixed420) {
+  FixedHybridUintRoundtrip<HybridUint420Config>(HybridUintConfig{4, 2, 0});
+}
+
 }  // namespace
 }  // namespace jxl
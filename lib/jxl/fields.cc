@@ -20,7 +20,7 @@ namespace {
 
 using ::jxl::fields_internal::VisitorBase;
 
-struct InitVisitor : public VisitorBase {
+struct InitVisitor final : public VisitorBase {
   Status Bits(const size_t /*unused*/, const uint32_t default_value,
               uint32_t* JXL_RESTRICT value) override {
     *value = default_value;
@@ -67,7 +67,7 @@ struct InitVisitor : public VisitorBase {
 };
 
 // Similar to InitVisitor, but also initializes nested fields.
-struct SetDefaultVisitor : public VisitorBase {
+struct SetDefaultVisitor final : public VisitorBase {
   Status Bits(const size_t /*unused*/, const uint32_t default_value,
               uint32_t* JXL_RESTRICT value) override {
     *value = default_value;
@@ -107,7 +107,7 @@ struct SetDefaultVisitor : public VisitorBase {
   }
 };
 
-class AllDefaultVisitor : public VisitorBase {
+class AllDefaultVisitor final : public VisitorBase {
  public:
   explicit AllDefaultVisitor() = default;
 
@@ -146,7 +146,7 @@ class AllDefaultVisitor : public VisitorBase {
   bool all_default_ = true;
 };
 
-class ReadVisitor : public VisitorBase {
+class ReadVisitor final : public VisitorBase {
  public:
   explicit ReadVisitor(BitReader* reader) : reader_(reader) {}
 
@@ -190,6 +190,14 @@ class ReadVisitor : public VisitorBase {
     return true;
   }
 
+  // Same as VisitorBase::Bool, but the call to Bits is not virtual.
+  Status Bool(bool default_value, bool* JXL_RESTRICT value) override {
+    uint32_t bits;
+    JXL_RETURN_IF_ERROR(Bits(1, static_cast<uint32_t>(default_value), &bits));
+    *value = bits == 1;
+    return true;
+  }
+
   void SetDefault(Fields* fields) override { Bundle::SetDefault(fields); }
 
   bool IsReading() const override { return true; }
@@ -271,7 +279,7 @@ class ReadVisitor : public VisitorBase {
                                         size_t /* bits */);
 };
 
-class MaxBitsVisitor : public VisitorBase {
+class MaxBitsVisitor final : public VisitorBase {
  public:
   Status Bits(const size_t bits, const uint32_t /*default_value*/,
               uint32_t* JXL_RESTRICT /*value*/) override {
@@ -320,7 +328,7 @@ class MaxBitsVisitor : public VisitorBase {
   size_t max_bits_ = 0;
 };
 
-class CanEncodeVisitor : public VisitorBase {
+class CanEncodeVisitor final : public VisitorBase {
  public:
   explicit CanEncodeVisitor() = default;
 
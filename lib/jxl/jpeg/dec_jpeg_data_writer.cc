@@ -11,12 +11,14 @@
 #include <cstdlib>
 #include <cstring> /* for memset, memcpy */
 #include <deque>
+#include <iterator>
 #include <utility>
 #include <vector>
 
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/jpeg/dec_jpeg_serialization_state.h"
@@ -720,6 +722,119 @@ bool EncodeRefinementBits(const coeff_t* coeffs, HuffmanCodeTable* ac_huff,
   return true;
 }
 
+int NextExtraZeroRunIndex(const JPEGScanInfo& scan_info,
+                          const EncodeScanState& ss) {
+  if (ss.extra_zero_runs_pos < scan_info.extra_zero_runs.size()) {
+    return scan_info.extra_zero_runs[ss.extra_zero_runs_pos].block_idx;
+  } else {
+    return -1;
+  }
+}
+
+int NextResetPoint(const JPEGScanInfo& scan_info, EncodeScanState* ss) {
+  if (ss->next_reset_point_pos < scan_info.reset_points.size()) {
+    return scan_info.reset_points[ss->next_reset_point_pos++];
+  } else {
+    return -1;
+  }
+}
+
+// Encodes the MCUs [mcu_begin, mcu_end) of the scan in raster order, each
+// preceded by a restart marker when ss->restarts_to_go reaches zero.
+template <int kMode>
+bool EncodeMCUs(const JPEGData& jpg, const JPEGScanInfo& scan_info,
+                SerializationState* state, int restart_interval,
+                int MCUs_per_row, size_t mcu_begin, size_t mcu_end,
+                const uint8_t** pad_bits, const uint8_t* pad_bits_end,
+                EncodeScanState* ss) {
+  JpegBitWriter* bw = &ss->bw;
+  DCTCodingState* coding_state = &ss->coding_state;
+  // "Non-interleaved" means color data comes in separate scans, in other words
+  // each scan can contain only one color component.
+  const bool is_interleaved = (scan_info.num_components > 1);
+  const bool is_progressive = state->is_progressive;
+  const int Al = is_progressive ? scan_info.Al : 0;
+  const int Ss = is_progressive ? scan_info.Ss : 0;
+  const int Se = is_progressive ? scan_info.Se : 63;
+  // DC-only is defined by [0..0] spectral range.
+  const bool want_ac = ((Ss != 0) || (Se != 0));
+  const bool want_dc = (Ss == 0);
+
+  for (size_t mcu = mcu_begin; mcu < mcu_end; ++mcu) {
+    const int mcu_y = mcu / MCUs_per_row;
+    const int mcu_x = mcu % MCUs_per_row;
+    // Possibly emit a restart marker.
+    if (restart_interval > 0 && ss->restarts_to_go == 0) {
+      Flush(coding_state, bw);
+      if (!JumpToByteBoundary(bw, pad_bits, pad_bits_end)) {
+        return false;
+      }
+      EmitMarker(bw, 0xD0 + ss->next_restart_marker);
+      ss->next_restart_marker += 1;
+      ss->next_restart_marker &= 0x7;
+      ss->restarts_to_go = restart_interval;
+      memset(ss->last_dc_coeff, 0, sizeof(ss->last_dc_coeff));
+    }
+
+    // Encode one MCU
+    for (size_t i = 0; i < scan_info.num_components; ++i) {
+      const JPEGComponentScanInfo& si = scan_info.components[i];
+      const JPEGComponent& c = jpg.components[si.comp_idx];
+      size_t dc_tbl_idx = si.dc_tbl_idx;
+      size_t ac_tbl_idx = si.ac_tbl_idx;
+      HuffmanCodeTable* dc_huff = &state->dc_huff_table[dc_tbl_idx];
+      HuffmanCodeTable* ac_huff = &state->ac_huff_table[ac_tbl_idx];
+      if (want_dc && !dc_huff->initialized) {
+        return false;
+      }
+      if (want_ac && !ac_huff->initialized) {
+        return false;
+      }
+      int n_blocks_y = is_interleaved ? c.v_samp_factor : 1;
+      int n_blocks_x = is_interleaved ? c.h_samp_factor : 1;
+      for (int iy = 0; iy < n_blocks_y; ++iy) {
+        for (int ix = 0; ix < n_blocks_x; ++ix) {
+          int block_y = mcu_y * n_blocks_y + iy;
+          int block_x = mcu_x * n_blocks_x + ix;
+          int block_idx = block_y * c.width_in_blocks + block_x;
+          if (ss->block_scan_index == ss->next_reset_point) {
+            Flush(coding_state, bw);
+            ss->next_reset_point = NextResetPoint(scan_info, ss);
+          }
+          int num_zero_runs = 0;
+          if (ss->block_scan_index == ss->next_extra_zero_run_index) {
+            num_zero_runs = scan_info.extra_zero_runs[ss->extra_zero_runs_pos]
+                                .num_extra_zero_runs;
+            ++ss->extra_zero_runs_pos;
+            ss->next_extra_zero_run_index =
+                NextExtraZeroRunIndex(scan_info, *ss);
+          }
+          const coeff_t* coeffs = &c.coeffs[block_idx << 6];
+          bool ok;
+          // compressed size per block cannot be more than 512 bytes
+          Reserve(bw, 512);
+          if (kMode == 0) {
+            ok = EncodeDCTBlockSequential(coeffs, dc_huff, ac_huff,
+                                          num_zero_runs,
+                                          ss->last_dc_coeff + si.comp_idx, bw);
+          } else if (kMode == 1) {
+            ok = EncodeDCTBlockProgressive(
+                coeffs, dc_huff, ac_huff, Ss, Se, Al, num_zero_runs,
+                coding_state, ss->last_dc_coeff + si.comp_idx, bw);
+          } else {
+            ok = EncodeRefinementBits(coeffs, ac_huff, Ss, Se, Al,
+                                      coding_state, bw);
+          }
+          if (!ok) return false;
+          ++ss->block_scan_index;
+        }
+      }
+    }
+    --ss->restarts_to_go;
+  }
+  return true;
+}
+
 template <int kMode>
 SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
                                               SerializationState* state) {
@@ -729,22 +844,6 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
   const int restart_interval =
       state->seen_dri_marker ? jpg.restart_interval : 0;
 
-  const auto get_next_extra_zero_run_index = [&ss, &scan_info]() -> int {
-    if (ss.extra_zero_runs_pos < scan_info.extra_zero_runs.size()) {
-      return scan_info.extra_zero_runs[ss.extra_zero_runs_pos].block_idx;
-    } else {
-      return -1;
-    }
-  };
-
-  const auto get_next_reset_point = [&ss, &scan_info]() -> int {
-    if (ss.next_reset_point_pos < scan_info.reset_points.size()) {
-      return scan_info.reset_points[ss.next_reset_point_pos++];
-    } else {
-      return -1;
-    }
-  };
-
   if (ss.stage == EncodeScanState::HEAD) {
     if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
     JpegBitWriterInit(&ss.bw, &state->output_queue);
@@ -753,9 +852,9 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
     ss.next_restart_marker = 0;
     ss.block_scan_index = 0;
     ss.extra_zero_runs_pos = 0;
-    ss.next_extra_zero_run_index = get_next_extra_zero_run_index();
+    ss.next_extra_zero_run_index = NextExtraZeroRunIndex(scan_info, ss);
     ss.next_reset_point_pos = 0;
-    ss.next_reset_point = get_next_reset_point();
+    ss.next_reset_point = NextResetPoint(scan_info, &ss);
     ss.mcu_y = 0;
     memset(ss.last_dc_coeff, 0, sizeof(ss.last_dc_coeff));
     ss.stage = EncodeScanState::BODY;
@@ -765,20 +864,15 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
 
   if (ss.stage != EncodeScanState::BODY) return SerializationStatus::ERROR;
 
-  // "Non-interleaved" means color data comes in separate scans, in other words
-  // each scan can contain only one color component.
-  const bool is_interleaved = (scan_info.num_components > 1);
   int MCUs_per_row = 0;
   int MCU_rows = 0;
   jpg.CalculateMcuSize(scan_info, &MCUs_per_row, &MCU_rows);
   const bool is_progressive = state->is_progressive;
-  const int Al = is_progressive ? scan_info.Al : 0;
   const int Ss = is_progressive ? scan_info.Ss : 0;
   const int Se = is_progressive ? scan_info.Se : 63;
 
   // DC-only is defined by [0..0] spectral range.
   const bool want_ac = ((Ss != 0) || (Se != 0));
-  const bool want_dc = (Ss == 0);
   // TODO(user): support streaming decoding again.
   const bool complete_ac = true;
   const bool has_ac = true;
@@ -799,76 +893,15 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
   (void)complete;
   const int last_mcu_y = complete ? MCU_rows : 0;
 
-  for (; ss.mcu_y < last_mcu_y; ++ss.mcu_y) {
-    for (int mcu_x = 0; mcu_x < MCUs_per_row; ++mcu_x) {
-      // Possibly emit a restart marker.
-      if (restart_interval > 0 && ss.restarts_to_go == 0) {
-        Flush(coding_state, bw);
-        if (!JumpToByteBoundary(bw, &state->pad_bits, state->pad_bits_end)) {
-          return SerializationStatus::ERROR;
-        }
-        EmitMarker(bw, 0xD0 + ss.next_restart_marker);
-        ss.next_restart_marker += 1;
-        ss.next_restart_marker &= 0x7;
-        ss.restarts_to_go = restart_interval;
-        memset(ss.last_dc_coeff, 0, sizeof(ss.last_dc_coeff));
-      }
-
-      // Encode one MCU
-      for (size_t i = 0; i < scan_info.num_components; ++i) {
-        const JPEGComponentScanInfo& si = scan_info.components[i];
-        const JPEGComponent& c = jpg.components[si.comp_idx];
-        size_t dc_tbl_idx = si.dc_tbl_idx;
-        size_t ac_tbl_idx = si.ac_tbl_idx;
-        HuffmanCodeTable* dc_huff = &state->dc_huff_table[dc_tbl_idx];
-        HuffmanCodeTable* ac_huff = &state->ac_huff_table[ac_tbl_idx];
-        if (want_dc && !dc_huff->initialized) {
-          return SerializationStatus::ERROR;
-        }
-        if (want_ac && !ac_huff->initialized) {
-          return SerializationStatus::ERROR;
-        }
-        int n_blocks_y = is_interleaved ? c.v_samp_factor : 1;
-        int n_blocks_x = is_interleaved ? c.h_samp_factor : 1;
-        for (int iy = 0; iy < n_blocks_y; ++iy) {
-          for (int ix = 0; ix < n_blocks_x; ++ix) {
-            int block_y = ss.mcu_y * n_blocks_y + iy;
-            int block_x = mcu_x * n_blocks_x + ix;
-            int block_idx = block_y * c.width_in_blocks + block_x;
-            if (ss.block_scan_index == ss.next_reset_point) {
-              Flush(coding_state, bw);
-              ss.next_reset_point = get_next_reset_point();
-            }
-            int num_zero_runs = 0;
-            if (ss.block_scan_index == ss.next_extra_zero_run_index) {
-              num_zero_runs = scan_info.extra_zero_runs[ss.extra_zero_runs_pos]
-                                  .num_extra_zero_runs;
-              ++ss.extra_zero_runs_pos;
-              ss.next_extra_zero_run_index = get_next_extra_zero_run_index();
-            }
-            const coeff_t* coeffs = &c.coeffs[block_idx << 6];
-            bool ok;
-            // compressed size per block cannot be more than 512 bytes
-            Reserve(bw, 512);
-            if (kMode == 0) {
-              ok = EncodeDCTBlockSequential(coeffs, dc_huff, ac_huff,
-                                            num_zero_runs,
-                                            ss.last_dc_coeff + si.comp_idx, bw);
-            } else if (kMode == 1) {
-              ok = EncodeDCTBlockProgressive(
-                  coeffs, dc_huff, ac_huff, Ss, Se, Al, num_zero_runs,
-                  coding_state, ss.last_dc_coeff + si.comp_idx, bw);
-            } else {
-              ok = EncodeRefinementBits(coeffs, ac_huff, Ss, Se, Al,
-                                        coding_state, bw);
-            }
-            if (!ok) return SerializationStatus::ERROR;
-            ++ss.block_scan_index;
-          }
-        }
-      }
-      --ss.restarts_to_go;
+  if (ss.mcu_y < last_mcu_y) {
+    if (!EncodeMCUs<kMode>(jpg, scan_info, state, restart_interval,
+                           MCUs_per_row,
+                           static_cast<size_t>(ss.mcu_y) * MCUs_per_row,
+                           static_cast<size_t>(last_mcu_y) * MCUs_per_row,
+                           &state->pad_bits, state->pad_bits_end, &ss)) {
+      return SerializationStatus::ERROR;
     }
+    ss.mcu_y = last_mcu_y;
   }
   if (ss.mcu_y < MCU_rows) {
     if (!bw->healthy) return SerializationStatus::ERROR;
@@ -886,8 +919,99 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
   return SerializationStatus::DONE;
 }
 
+// Upper bound on the number of segments a sequential scan with restart
+// intervals is split into by EncodeSequentialScanParallel.
+constexpr size_t kMaxScanSegments = 256;
+
+// Encodes a sequential scan with restart intervals, split into segments of
+// whole intervals that are Huffman coded concurrently on `pool` into separate
+// output queues, then appended to the output in order. Each segment starts
+// with the restart marker preceding its first interval and ends on a byte
+// boundary, so the output is the same as the one of DoEncodeScan<0>. Requires
+// the default (all ones) padding bits, as otherwise the padding bits used by
+// an interval depend on the number of bits of all the previous ones.
+SerializationStatus EncodeSequentialScanParallel(const JPEGData& jpg,
+                                                 SerializationState* state,
+                                                 ThreadPool* pool) {
+  const JPEGScanInfo& scan_info = jpg.scan_info[state->scan_index];
+  const int restart_interval = jpg.restart_interval;
+  int MCUs_per_row = 0;
+  int MCU_rows = 0;
+  jpg.CalculateMcuSize(scan_info, &MCUs_per_row, &MCU_rows);
+  const bool is_interleaved = (scan_info.num_components > 1);
+  size_t blocks_per_mcu = 0;
+  for (size_t i = 0; i < scan_info.num_components; ++i) {
+    const JPEGComponent& c = jpg.components[scan_info.components[i].comp_idx];
+    blocks_per_mcu += is_interleaved ? c.v_samp_factor * c.h_samp_factor : 1;
+  }
+  const size_t num_mcus = static_cast<size_t>(MCU_rows) * MCUs_per_row;
+  const size_t num_intervals = DivCeil(num_mcus, restart_interval);
+  const size_t intervals_per_segment =
+      DivCeil(num_intervals, std::min(num_intervals, kMaxScanSegments));
+  const size_t num_segments = DivCeil(num_intervals, intervals_per_segment);
+  const size_t mcus_per_segment = intervals_per_segment * restart_interval;
+
+  if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
+  std::vector<std::deque<OutputChunk>> queues(num_segments);
+  const auto encode_segment = [&](const uint32_t i,
+                                  size_t /* thread */) -> Status {
+    const size_t mcu_begin = i * mcus_per_segment;
+    const size_t mcu_end = std::min(num_mcus, mcu_begin + mcus_per_segment);
+    EncodeScanState ss;
+    JpegBitWriterInit(&ss.bw, &queues[i]);
+    DCTCodingStateInit(&ss.coding_state);
+    // All the segments but the first one start with a restart marker.
+    const size_t interval = mcu_begin / restart_interval;
+    ss.restarts_to_go = interval == 0 ? restart_interval : 0;
+    ss.next_restart_marker = (interval + 7) & 7;
+    ss.block_scan_index = mcu_begin * blocks_per_mcu;
+    // The extra zero runs and reset points are sorted by block index.
+    const auto& zero_runs = scan_info.extra_zero_runs;
+    const uint32_t first_block = ss.block_scan_index;
+    const auto before_block = [](const JPEGScanInfo::ExtraZeroRunInfo& info,
+                                 uint32_t block) {
+      return info.block_idx < block;
+    };
+    ss.extra_zero_runs_pos =
+        std::lower_bound(zero_runs.begin(), zero_runs.end(), first_block,
+                         before_block) -
+        zero_runs.begin();
+    ss.next_extra_zero_run_index = NextExtraZeroRunIndex(scan_info, ss);
+    ss.next_reset_point_pos =
+        std::lower_bound(scan_info.reset_points.begin(),
+                         scan_info.reset_points.end(), first_block) -
+        scan_info.reset_points.begin();
+    ss.next_reset_point = NextResetPoint(scan_info, &ss);
+    const uint8_t* pad_bits = nullptr;
+    if (!EncodeMCUs<0>(jpg, scan_info, state, restart_interval, MCUs_per_row,
+                       mcu_begin, mcu_end, &pad_bits, nullptr, &ss)) {
+      return JXL_FAILURE("Failed to encode scan segment %u", i);
+    }
+    Flush(&ss.coding_state, &ss.bw);
+    if (!JumpToByteBoundary(&ss.bw, &pad_bits, nullptr)) {
+      return JXL_FAILURE("Failed to encode scan segment %u", i);
+    }
+    JpegBitWriterFinish(&ss.bw);
+    if (!ss.bw.healthy) {
+      return JXL_FAILURE("Failed to encode scan segment %u", i);
+    }
+    return true;
+  };
+  if (!RunOnPool(pool, 0, num_segments, ThreadPool::NoInit, encode_segment,
+                 "EncodeJpegScan")) {
+    return SerializationStatus::ERROR;
+  }
+  for (std::deque<OutputChunk>& queue : queues) {
+    std::move(queue.begin(), queue.end(),
+              std::back_inserter(state->output_queue));
+  }
+  state->scan_index++;
+  return SerializationStatus::DONE;
+}
+
 SerializationStatus JXL_INLINE EncodeScan(const JPEGData& jpg,
-                                          SerializationState* state) {
+                                          SerializationState* state,
+                                          ThreadPool* pool) {
   const JPEGScanInfo& scan_info = jpg.scan_info[state->scan_index];
   const bool is_progressive = state->is_progressive;
   const int Al = is_progressive ? scan_info.Al : 0;
@@ -897,6 +1021,16 @@ SerializationStatus JXL_INLINE EncodeScan(const JPEGData& jpg,
   const bool need_sequential =
       !is_progressive || (Ah == 0 && Al == 0 && Ss == 0 && Se == 63);
   if (need_sequential) {
+    int MCUs_per_row = 0;
+    int MCU_rows = 0;
+    jpg.CalculateMcuSize(scan_info, &MCUs_per_row, &MCU_rows);
+    const bool has_restarts = state->seen_dri_marker &&
+                              jpg.restart_interval > 0 &&
+                              static_cast<size_t>(MCUs_per_row) * MCU_rows >
+                                  jpg.restart_interval;
+    if (pool != nullptr && has_restarts && state->pad_bits == nullptr) {
+      return EncodeSequentialScanParallel(jpg, state, pool);
+    }
     return DoEncodeScan<0>(jpg, state);
   } else if (Ah == 0) {
     return DoEncodeScan<1>(jpg, state);
@@ -906,7 +1040,7 @@ SerializationStatus JXL_INLINE EncodeScan(const JPEGData& jpg,
 }
 
 SerializationStatus SerializeSection(uint8_t marker, SerializationState* state,
-                                     const JPEGData& jpg) {
+                                     const JPEGData& jpg, ThreadPool* pool) {
   const auto to_status = [](bool result) {
     return result ? SerializationStatus::DONE : SerializationStatus::ERROR;
   };
@@ -936,7 +1070,7 @@ SerializationStatus SerializeSection(uint8_t marker, SerializationState* state,
       return to_status(EncodeEOI(jpg, state));
 
     case 0xDA:
-      return EncodeScan(jpg, state);
+      return EncodeScan(jpg, state, pool);
 
     case 0xDB:
       return to_status(EncodeDQT(jpg, state));
@@ -975,7 +1109,7 @@ SerializationStatus SerializeSection(uint8_t marker, SerializationState* state,
 
 // TODO(veluca): add streaming support again.
 Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
-                         SerializationState* ss) {
+                         ThreadPool* pool, SerializationState* ss) {
   const auto maybe_push_output = [&]() -> Status {
     if (ss->stage != SerializationState::STAGE_ERROR) {
       while (!ss->output_queue.empty()) {
@@ -1023,7 +1157,7 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
           break;
         }
         uint8_t marker = jpg.marker_order[ss->section_index];
-        SerializationStatus status = SerializeSection(marker, ss, jpg);
+        SerializationStatus status = SerializeSection(marker, ss, jpg, pool);
         if (status == SerializationStatus::ERROR) {
           JXL_WARNING("Failed to encode marker 0x%.2x", marker);
           ss->stage = SerializationState::STAGE_ERROR;
@@ -1056,9 +1190,10 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
 
 }  // namespace
 
-Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out) {
+Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                 ThreadPool* pool) {
   auto ss = jxl::make_unique<SerializationState>();
-  return WriteJpegInternal(jpg, out, ss.get());
+  return WriteJpegInternal(jpg, out, pool, ss.get());
 }
 
 }  // namespace jpeg
@@ -13,6 +13,8 @@
 
 #include <functional>
 
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
 #include "lib/jxl/jpeg/dec_jpeg_serialization_state.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
@@ -23,7 +25,10 @@ namespace jpeg {
 // written.
 using JPEGOutput = std::function<size_t(const uint8_t* buf, size_t len)>;
 
-Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out);
+// Writes the JPEG bytes of `jpg` to `out`. If `pool` is not null, the
+// sequential scans with restart intervals are Huffman coded in parallel.
+Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                 ThreadPool* pool = nullptr);
 
 }  // namespace jpeg
 }  // namespace jxl
@@ -389,7 +389,8 @@ Status EncodeJPEGData(JxlMemoryManager* memory_manager, JPEGData& jpeg_data,
   return true;
 }
 
-Status DecodeImageJPG(const Span<const uint8_t> bytes, CodecInOut* io) {
+Status DecodeImageJPG(const Span<const uint8_t> bytes, CodecInOut* io,
+                      ThreadPool* pool) {
   if (!IsJPG(bytes)) return false;
   JxlMemoryManager* memory_manager = io->memory_manager;
   io->frames.clear();
@@ -398,7 +399,7 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes, CodecInOut* io) {
   io->Main().jpeg_data = make_unique<jpeg::JPEGData>();
   jpeg::JPEGData* jpeg_data = io->Main().jpeg_data.get();
   if (!jpeg::ReadJpeg(bytes.data(), bytes.size(), jpeg::JpegReadMode::kReadAll,
-                      jpeg_data)) {
+                      jpeg_data, pool)) {
     return JXL_FAILURE("Error reading JPEG");
   }
   JXL_RETURN_IF_ERROR(
@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -36,9 +37,11 @@ Status SetColorTransformFromJpegData(const JPEGData& jpg,
 
 /**
  * Decodes bytes containing JPEG codestream into a CodecInOut as coefficients
- * only, for lossless JPEG transcoding.
+ * only, for lossless JPEG transcoding. Uses `pool`, if not null, to decode the
+ * restart intervals of the scans in parallel.
  */
-Status DecodeImageJPG(Span<const uint8_t> bytes, CodecInOut* io);
+Status DecodeImageJPG(Span<const uint8_t> bytes, CodecInOut* io,
+                      ThreadPool* pool = nullptr);
 
 }  // namespace jpeg
 }  // namespace jxl
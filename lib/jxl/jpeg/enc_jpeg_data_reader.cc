@@ -13,6 +13,7 @@
 #include <vector>
 
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/frame_dimensions.h"
@@ -432,19 +433,20 @@ struct BitReaderState {
   }
 
   // Sets *pos to the next stream position where parsing should continue.
-  // Enqueue the padding bits seen (0 or 1).
+  // Enqueue the padding bits seen (0 or 1) to *padding_bits.
   // Returns false if there is inconsistent or invalid padding or the stream
   // ended too early.
-  bool FinishStream(JPEGData* jpg, size_t* pos) {
+  bool FinishStream(bool* has_zero_padding_bit,
+                    std::vector<uint8_t>* padding_bits, size_t* pos) {
     int npadbits = bits_left_ & 7;
     if (npadbits > 0) {
       uint64_t padmask = (1ULL << npadbits) - 1;
       uint64_t padbits = (val_ >> (bits_left_ - npadbits)) & padmask;
       if (padbits != padmask) {
-        jpg->has_zero_padding_bit = true;
+        *has_zero_padding_bit = true;
       }
       for (int i = npadbits - 1; i >= 0; --i) {
-        jpg->padding_bits.push_back((padbits >> i) & 1);
+        padding_bits->push_back((padbits >> i) & 1);
       }
     }
     // Give back some bytes that we did not use.
@@ -536,7 +538,7 @@ int HuffExtend(int x, int s) {
 bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
                     const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
                     int* eobrun, bool* reset_state, int* num_zero_runs,
-                    BitReaderState* br, JPEGData* jpg, coeff_t* last_dc_coeff,
+                    BitReaderState* br, coeff_t* last_dc_coeff,
                     coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
   int Am = 1 << Al;
@@ -617,7 +619,7 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
 
 bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
                     int* eobrun, bool* reset_state, BitReaderState* br,
-                    JPEGData* jpg, coeff_t* coeffs) {
+                    coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
   int Am = 1 << Al;
   bool eobrun_allowed = Ss > 0;
@@ -724,11 +726,24 @@ bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
   return true;
 }
 
+// Padding bits and block indexes found while decoding a segment of a scan,
+// i.e. a number of whole restart intervals, that are appended to the JPEGData
+// in the order of the segments.
+struct ScanSegment {
+  // Position of the first byte after the entropy-coded data of the segment.
+  size_t end_pos = 0;
+  bool has_zero_padding_bit = false;
+  std::vector<uint8_t> padding_bits;
+  std::vector<uint32_t> reset_points;
+  std::vector<JPEGScanInfo::ExtraZeroRunInfo> extra_zero_runs;
+};
+
 bool ProcessRestart(const uint8_t* data, const size_t len,
                     int* next_restart_marker, BitReaderState* br,
-                    JPEGData* jpg) {
+                    ScanSegment* segment) {
   size_t pos = 0;
-  if (!br->FinishStream(jpg, &pos)) {
+  if (!br->FinishStream(&segment->has_zero_padding_bit,
+                        &segment->padding_bits, &pos)) {
     return JXL_FAILURE("Invalid scan");
   }
   int expected_marker = 0xd0 + *next_restart_marker;
@@ -744,11 +759,42 @@ bool ProcessRestart(const uint8_t* data, const size_t len,
   return true;
 }
 
+// Outputs the positions where the segments of `num_segments` x
+// `intervals_per_segment` restart intervals start, i.e. `pos` and the
+// positions after the restart markers that end the last interval of each
+// segment but the last one. Markers are found the way BitReaderState finds
+// them, so for a valid scan these are where the serial decoding continues.
+// Returns false if the markers are not the expected restart markers; the scan
+// is then decoded serially instead.
+bool FindSegmentStarts(const uint8_t* data, const size_t len, size_t pos,
+                       size_t num_segments, size_t intervals_per_segment,
+                       std::vector<size_t>* starts) {
+  starts->assign(1, pos);
+  const size_t num_markers = (num_segments - 1) * intervals_per_segment;
+  for (size_t marker = 0; marker < num_markers; ++marker) {
+    // Skips the entropy-coded data and the 0xff00 escape sequences.
+    while (pos + 1 < len && (data[pos] != 0xff || data[pos + 1] == 0)) {
+      pos += data[pos] == 0xff ? 2 : 1;
+    }
+    if (pos + 1 >= len || data[pos + 1] != 0xd0 + (marker & 7)) {
+      return false;
+    }
+    pos += 2;
+    if ((marker + 1) % intervals_per_segment == 0) starts->push_back(pos);
+  }
+  return true;
+}
+
+// Upper bound on the number of segments a scan with restart intervals is
+// split into, to bound the memory for the per-segment outputs.
+constexpr size_t kMaxScanSegments = 256;
+
 bool ProcessScan(const uint8_t* data, const size_t len,
                  const std::vector<HuffmanTableEntry>& dc_huff_lut,
                  const std::vector<HuffmanTableEntry>& ac_huff_lut,
                  uint16_t scan_progression[kMaxComponents][kDCTBlockSize],
-                 bool is_progressive, size_t* pos, JPEGData* jpg) {
+                 bool is_progressive, ThreadPool* pool, size_t* pos,
+                 JPEGData* jpg) {
   if (!ProcessSOS(data, len, pos, jpg)) {
     return false;
   }
@@ -768,12 +814,6 @@ bool ProcessScan(const uint8_t* data, const size_t len,
     MCUs_per_row = DivCeil(jpg->width * c.h_samp_factor, 8 * max_h_samp_factor);
     MCU_rows = DivCeil(jpg->height * c.v_samp_factor, 8 * max_v_samp_factor);
   }
-  coeff_t last_dc_coeff[kMaxComponents] = {0};
-  BitReaderState br(data, len, *pos);
-  int restarts_to_go = jpg->restart_interval;
-  int next_restart_marker = 0;
-  int eobrun = -1;
-  int block_scan_index = 0;
   const int Al = is_progressive ? scan_info->Al : 0;
   const int Ah = is_progressive ? scan_info->Ah : 0;
   const int Ss = is_progressive ? scan_info->Ss : 0;
@@ -800,12 +840,34 @@ bool ProcessScan(const uint8_t* data, const size_t len,
   if (Al > 10) {
     return JXL_FAILURE("Scan parameter Al=%d is not supported.", Al);
   }
-  for (int mcu_y = 0; mcu_y < MCU_rows; ++mcu_y) {
-    for (int mcu_x = 0; mcu_x < MCUs_per_row; ++mcu_x) {
+  size_t blocks_per_mcu = 0;
+  for (size_t i = 0; i < scan_info->num_components; ++i) {
+    const JPEGComponent& c = jpg->components[scan_info->components[i].comp_idx];
+    blocks_per_mcu += is_interleaved ? c.v_samp_factor * c.h_samp_factor : 1;
+  }
+
+  // Decodes the MCUs [mcu_begin, mcu_end) from `start_pos`, where a restart
+  // interval starts. Each restart interval only depends on its own data, so
+  // segments of whole intervals can be decoded concurrently; they write to
+  // distinct blocks of the components.
+  const auto decode_segment = [&](size_t mcu_begin, size_t mcu_end,
+                                  size_t start_pos,
+                                  ScanSegment* segment) -> bool {
+    coeff_t last_dc_coeff[kMaxComponents] = {0};
+    BitReaderState br(data, len, start_pos);
+    int restarts_to_go = jpg->restart_interval;
+    int next_restart_marker =
+        jpg->restart_interval > 0 ? (mcu_begin / jpg->restart_interval) & 7
+                                  : 0;
+    int eobrun = -1;
+    size_t block_scan_index = mcu_begin * blocks_per_mcu;
+    for (size_t mcu = mcu_begin; mcu < mcu_end; ++mcu) {
+      const int mcu_y = mcu / MCUs_per_row;
+      const int mcu_x = mcu % MCUs_per_row;
       // Handle the restart intervals.
       if (jpg->restart_interval > 0) {
         if (restarts_to_go == 0) {
-          if (ProcessRestart(data, len, &next_restart_marker, &br, jpg)) {
+          if (ProcessRestart(data, len, &next_restart_marker, &br, segment)) {
             restarts_to_go = jpg->restart_interval;
             memset(static_cast<void*>(last_dc_coeff), 0, sizeof(last_dc_coeff));
             if (eobrun > 0) {
@@ -820,7 +882,7 @@ bool ProcessScan(const uint8_t* data, const size_t len,
       }
       // Decode one MCU.
       for (size_t i = 0; i < scan_info->num_components; ++i) {
-        JPEGComponentScanInfo* si = &scan_info->components[i];
+        const JPEGComponentScanInfo* si = &scan_info->components[i];
         JPEGComponent* c = &jpg->components[si->comp_idx];
         const HuffmanTableEntry* dc_lut =
             &dc_huff_lut[si->dc_tbl_idx * kJpegHuffmanLutSize];
@@ -838,37 +900,90 @@ bool ProcessScan(const uint8_t* data, const size_t len,
             coeff_t* coeffs = &c->coeffs[block_idx * kDCTBlockSize];
             if (Ah == 0) {
               if (!DecodeDCTBlock(dc_lut, ac_lut, Ss, Se, Al, &eobrun,
-                                  &reset_state, &num_zero_runs, &br, jpg,
+                                  &reset_state, &num_zero_runs, &br,
                                   &last_dc_coeff[si->comp_idx], coeffs)) {
                 return false;
               }
             } else {
               if (!RefineDCTBlock(ac_lut, Ss, Se, Al, &eobrun, &reset_state,
-                                  &br, jpg, coeffs)) {
+                                  &br, coeffs)) {
                 return false;
               }
             }
             if (reset_state) {
-              scan_info->reset_points.emplace_back(block_scan_index);
+              segment->reset_points.emplace_back(block_scan_index);
             }
             if (num_zero_runs > 0) {
               JPEGScanInfo::ExtraZeroRunInfo info;
               info.block_idx = block_scan_index;
               info.num_extra_zero_runs = num_zero_runs;
-              scan_info->extra_zero_runs.push_back(info);
+              segment->extra_zero_runs.push_back(info);
             }
             ++block_scan_index;
           }
         }
       }
     }
+    if (eobrun > 0) {
+      return JXL_FAILURE("End-of-block run too long.");
+    }
+    if (!br.FinishStream(&segment->has_zero_padding_bit,
+                         &segment->padding_bits, &segment->end_pos)) {
+      return JXL_FAILURE("Invalid scan.");
+    }
+    return true;
+  };
+
+  const size_t num_mcus = static_cast<size_t>(MCU_rows) * MCUs_per_row;
+  const size_t num_intervals =
+      jpg->restart_interval > 0 ? DivCeil(num_mcus, jpg->restart_interval) : 1;
+  const size_t intervals_per_segment =
+      DivCeil(num_intervals, std::min(num_intervals, kMaxScanSegments));
+  size_t num_segments = DivCeil(num_intervals, intervals_per_segment);
+  std::vector<size_t> starts;
+  if (pool == nullptr || num_segments < 2 ||
+      !FindSegmentStarts(data, len, *pos, num_segments, intervals_per_segment,
+                         &starts)) {
+    num_segments = 1;
+    starts.assign(1, *pos);
   }
-  if (eobrun > 0) {
-    return JXL_FAILURE("End-of-block run too long.");
+  const size_t mcus_per_segment =
+      num_segments > 1 ? intervals_per_segment * jpg->restart_interval
+                       : num_mcus;
+  std::vector<ScanSegment> segments(num_segments);
+  const auto process_segment = [&](const uint32_t i,
+                                   size_t /* thread */) -> Status {
+    const size_t mcu_begin = i * mcus_per_segment;
+    const size_t mcu_end = std::min(num_mcus, mcu_begin + mcus_per_segment);
+    if (!decode_segment(mcu_begin, mcu_end, starts[i], &segments[i])) {
+      return JXL_FAILURE("Failed to decode scan segment %u", i);
+    }
+    // Serially, the next segment would start after the restart marker at
+    // the end of this one.
+    if (i + 1 < num_segments && segments[i].end_pos + 2 != starts[i + 1]) {
+      return JXL_FAILURE("Restart marker expected at %" PRIuS,
+                         segments[i].end_pos);
+    }
+    return true;
+  };
+  if (!RunOnPool(pool, 0, num_segments, ThreadPool::NoInit, process_segment,
+                 "DecodeJpegScan")) {
+    return false;
   }
-  if (!br.FinishStream(jpg, pos)) {
-    return JXL_FAILURE("Invalid scan.");
+
+  for (ScanSegment& segment : segments) {
+    jpg->has_zero_padding_bit |= segment.has_zero_padding_bit;
+    jpg->padding_bits.insert(jpg->padding_bits.end(),
+                             segment.padding_bits.begin(),
+                             segment.padding_bits.end());
+    scan_info->reset_points.insert(scan_info->reset_points.end(),
+                                   segment.reset_points.begin(),
+                                   segment.reset_points.end());
+    scan_info->extra_zero_runs.insert(scan_info->extra_zero_runs.end(),
+                                      segment.extra_zero_runs.begin(),
+                                      segment.extra_zero_runs.end());
   }
+  *pos = segments.back().end_pos;
   if (*pos > len) {
     return JXL_FAILURE("Unexpected end of file during scan. pos=%" PRIuS
                        " len=%" PRIuS,
@@ -917,7 +1032,7 @@ size_t FindNextMarker(const uint8_t* data, const size_t len, size_t pos) {
 }  // namespace
 
 bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
-              JPEGData* jpg) {
+              JPEGData* jpg, ThreadPool* pool) {
   size_t pos = 0;
   // Check SOI marker.
   JXL_JPEG_EXPECT_MARKER();
@@ -975,7 +1090,7 @@ bool ReadJpeg(const uint8_t* data, const size_t len, JpegReadMode mode,
       case 0xda:
         if (mode == JpegReadMode::kReadAll) {
           ok = ProcessScan(data, len, dc_huff_lut, ac_huff_lut,
-                           scan_progression, is_progressive, &pos, jpg);
+                           scan_progression, is_progressive, pool, &pos, jpg);
         }
         break;
       case 0xdb:
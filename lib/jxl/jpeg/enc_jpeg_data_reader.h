@@ -11,6 +11,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
 namespace jxl {
@@ -27,8 +28,10 @@ enum class JpegReadMode {
 // If mode is kReadHeader, it fills in only the image dimensions in *jpg.
 // Returns false if the data is not valid JPEG, or if it contains an unsupported
 // JPEG feature.
+// The restart intervals of the scans are decoded in parallel on `pool`, if
+// not null.
 bool ReadJpeg(const uint8_t* data, size_t len, JpegReadMode mode,
-              JPEGData* jpg);
+              JPEGData* jpg, ThreadPool* pool = nullptr);
 
 }  // namespace jpeg
 }  // namespace jxl
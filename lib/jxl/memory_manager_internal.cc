@@ -8,17 +8,25 @@
 #include <jxl/memory_manager.h>
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>     // memcpy
 #include <hwy/base.h>  // kMaxVectorSize
+#include <map>
+#include <mutex>
+#include <unordered_map>
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/simd_util.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
 namespace jxl {
 
 namespace {
@@ -57,6 +65,191 @@ Status MemoryManagerInit(JxlMemoryManager* self,
   return true;
 }
 
+MemoryArena::MemoryArena(const JxlMemoryManager& backing,
+                         const size_t block_size)
+    : backing_(backing), block_size_(block_size), current_(blocks_.end()) {
+  memory_manager_.opaque = this;
+  memory_manager_.alloc = &MemoryArena::Alloc;
+  memory_manager_.free = &MemoryArena::Free;
+}
+
+MemoryArena::~MemoryArena() {
+  for (auto& block : blocks_) {
+    MemoryManagerFree(&backing_, block.second.data);
+  }
+}
+
+void MemoryArena::ReleaseBlock(std::map<uintptr_t, Block>::iterator block) {
+  if (block == current_) current_ = blocks_.end();
+  MemoryManagerFree(&backing_, block->second.data);
+  blocks_.erase(block);
+}
+
+// static
+void* MemoryArena::Alloc(void* opaque, size_t size) {
+  MemoryArena* self = static_cast<MemoryArena*>(opaque);
+  // Same alignment as malloc, for the objects created by
+  // MemoryManagerMakeUnique; AlignedMemory aligns further by itself.
+  constexpr size_t kArenaAlignment = alignof(std::max_align_t);
+  const size_t rounded_size = RoundUpTo(size, kArenaAlignment);
+  if (rounded_size < size) return nullptr;  // Overflow.
+
+  std::lock_guard<std::mutex> lock(self->mutex_);
+  if (self->current_ != self->blocks_.end()) {
+    Block& block = self->current_->second;
+    if (block.size - block.used >= rounded_size) {
+      uint8_t* address = block.data + block.used;
+      block.used += rounded_size;
+      ++block.num_live;
+      return address;
+    }
+  }
+
+  // Large allocations get a block of their own, so that the current block is
+  // not wasted; it is returned as soon as the allocation is freed.
+  const bool dedicated = rounded_size > self->block_size_ / 4;
+  const size_t block_size = dedicated ? rounded_size : self->block_size_;
+  uint8_t* data =
+      static_cast<uint8_t*>(MemoryManagerAlloc(&self->backing_, block_size));
+  if (!data) return nullptr;
+  Block block;
+  block.data = data;
+  block.size = block_size;
+  block.used = rounded_size;
+  block.num_live = 1;
+  const auto inserted =
+      self->blocks_.emplace(reinterpret_cast<uintptr_t>(data), block).first;
+  if (!dedicated) {
+    // Nothing else can be allocated from the previous block; return it if it
+    // is already empty.
+    if (self->current_ != self->blocks_.end() &&
+        self->current_->second.num_live == 0) {
+      self->ReleaseBlock(self->current_);
+    }
+    self->current_ = inserted;
+  }
+  return data;
+}
+
+// static
+void MemoryArena::Free(void* opaque, void* address) {
+  if (!address) return;
+  MemoryArena* self = static_cast<MemoryArena*>(opaque);
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(address);
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    auto block = self->blocks_.upper_bound(addr);
+    if (block != self->blocks_.begin()) {
+      --block;
+      if (addr < block->first + block->second.size) {
+        if (--block->second.num_live == 0) {
+          if (block == self->current_) {
+            // Keep the current block and start over from its beginning.
+            block->second.used = 0;
+          } else {
+            self->ReleaseBlock(block);
+          }
+        }
+        return;
+      }
+    }
+  }
+  MemoryManagerFree(&self->backing_, address);
+}
+
+MemoryTracker::MemoryTracker(const JxlMemoryManager& backing,
+                             const uint64_t limit)
+    : backing_(backing), limit_(limit) {
+  memory_manager_.opaque = this;
+  memory_manager_.alloc = &MemoryTracker::Alloc;
+  memory_manager_.free = &MemoryTracker::Free;
+}
+
+void MemoryTracker::set_limit(const uint64_t limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  limit_ = limit;
+}
+
+uint64_t MemoryTracker::peak_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_bytes_;
+}
+
+// static
+void* MemoryTracker::Alloc(void* opaque, size_t size) {
+  MemoryTracker* self = static_cast<MemoryTracker*>(opaque);
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    const uint64_t new_bytes_in_use = self->bytes_in_use_ + size;
+    if (new_bytes_in_use < size ||
+        (self->limit_ != 0 && new_bytes_in_use > self->limit_)) {
+      return nullptr;
+    }
+    // Reserve the bytes before allocating, so that concurrent allocations
+    // cannot exceed the limit together.
+    self->bytes_in_use_ = new_bytes_in_use;
+    self->peak_bytes_ = std::max(self->peak_bytes_, new_bytes_in_use);
+  }
+  void* address = MemoryManagerAlloc(&self->backing_, size);
+  std::lock_guard<std::mutex> lock(self->mutex_);
+  if (address) {
+    self->allocations_[address] = size;
+  } else {
+    self->bytes_in_use_ -= size;
+  }
+  return address;
+}
+
+// static
+void MemoryTracker::Free(void* opaque, void* address) {
+  if (!address) return;
+  MemoryTracker* self = static_cast<MemoryTracker*>(opaque);
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    auto allocation = self->allocations_.find(address);
+    if (allocation != self->allocations_.end()) {
+      self->bytes_in_use_ -= allocation->second;
+      self->allocations_.erase(allocation);
+    }
+  }
+  MemoryManagerFree(&self->backing_, address);
+}
+
+HugePageAdvisor::HugePageAdvisor(const JxlMemoryManager& backing,
+                                 const size_t threshold)
+    : backing_(backing), threshold_(threshold) {
+  memory_manager_.opaque = this;
+  memory_manager_.alloc = &HugePageAdvisor::Alloc;
+  memory_manager_.free = &HugePageAdvisor::Free;
+}
+
+// static
+void* HugePageAdvisor::Alloc(void* opaque, size_t size) {
+  HugePageAdvisor* self = static_cast<HugePageAdvisor*>(opaque);
+  void* address = MemoryManagerAlloc(&self->backing_, size);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (address && self->threshold_ != 0 && size >= self->threshold_) {
+    // The kernel only uses huge pages for aligned huge page sized ranges;
+    // advise those inside the allocation, which may not be aligned itself.
+    const uintptr_t start = reinterpret_cast<uintptr_t>(address);
+    const uintptr_t begin = RoundUpTo(start, kHugePageSize);
+    const uintptr_t end = (start + size) & ~(kHugePageSize - 1);
+    if (begin < end) {
+      // Only a hint: failure (e.g. THP disabled) is harmless.
+      (void)madvise(reinterpret_cast<void*>(begin), end - begin,
+                    MADV_HUGEPAGE);
+    }
+  }
+#endif
+  return address;
+}
+
+// static
+void HugePageAdvisor::Free(void* opaque, void* address) {
+  HugePageAdvisor* self = static_cast<HugePageAdvisor*>(opaque);
+  MemoryManagerFree(&self->backing_, address);
+}
+
 size_t BytesPerRow(const size_t xsize, const size_t sizeof_t) {
   // Special case: we don't allow any ops -> don't need extra padding/
   if (xsize == 0) {
@@ -11,7 +11,11 @@
 #include <jxl/memory_manager.h>
 
 #include <cstddef>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <utility>
 
 #include "lib/jxl/base/compiler_specific.h"
@@ -85,6 +89,114 @@ JXL_INLINE MemoryManagerUniquePtr<T> MemoryManagerMakeUnique(
                                    MemoryManagerDeleteHelper(memory_manager));
 }
 
+// Memory manager that serves allocations from large blocks obtained from a
+// backing memory manager, to reduce the number of calls to it and the
+// fragmentation of its heap. A block is returned to the backing memory manager
+// once all the allocations in it are freed, and all of them are returned when
+// the arena is destroyed. Freeing an address that was not allocated by the
+// arena (e.g. allocated before it was installed) forwards it to the backing
+// memory manager. Thread-safe.
+class MemoryArena {
+ public:
+  MemoryArena(const JxlMemoryManager& backing, size_t block_size);
+  ~MemoryArena();
+
+  MemoryArena(const MemoryArena&) = delete;
+  MemoryArena& operator=(const MemoryArena&) = delete;
+
+  // Memory manager allocating from this arena; valid while it is alive.
+  const JxlMemoryManager& memory_manager() const { return memory_manager_; }
+
+ private:
+  struct Block {
+    uint8_t* data;
+    size_t size;
+    size_t used = 0;
+    // Number of allocations in the block that are not freed yet.
+    size_t num_live = 0;
+  };
+
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  // Returns the block to the backing memory manager. Requires mutex_.
+  void ReleaseBlock(std::map<uintptr_t, Block>::iterator block);
+
+  const JxlMemoryManager backing_;
+  const size_t block_size_;
+  JxlMemoryManager memory_manager_;
+
+  std::mutex mutex_;  // guards the following.
+  // By start address, to find the block of an address on Free.
+  std::map<uintptr_t, Block> blocks_;
+  // Block that new small allocations are taken from, or blocks_.end().
+  std::map<uintptr_t, Block>::iterator current_;
+};
+
+// Memory manager that counts the bytes allocated through it from a backing
+// memory manager, and fails the allocations that would exceed `limit` bytes in
+// use (unless it is 0). As for MemoryArena, freeing an address that was not
+// allocated through it forwards it to the backing memory manager.
+// Thread-safe.
+class MemoryTracker {
+ public:
+  MemoryTracker(const JxlMemoryManager& backing, uint64_t limit);
+
+  MemoryTracker(const MemoryTracker&) = delete;
+  MemoryTracker& operator=(const MemoryTracker&) = delete;
+
+  // Memory manager tracking the allocations; valid while this is alive.
+  const JxlMemoryManager& memory_manager() const { return memory_manager_; }
+
+  uint64_t limit() const { return limit_; }
+  void set_limit(uint64_t limit);
+  // Largest number of bytes in use at once since construction.
+  uint64_t peak_bytes() const;
+
+ private:
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  const JxlMemoryManager backing_;
+  JxlMemoryManager memory_manager_;
+
+  mutable std::mutex mutex_;  // guards the following.
+  std::unordered_map<void*, size_t> allocations_;
+  uint64_t limit_;
+  uint64_t bytes_in_use_ = 0;
+  uint64_t peak_bytes_ = 0;
+};
+
+// Memory manager that forwards to a backing memory manager and asks the kernel
+// to back the allocations of at least `threshold` bytes with transparent huge
+// pages, to reduce the TLB misses when walking large planes (e.g. column by
+// column). Only the 2 MiB aligned part of an allocation can be backed by huge
+// pages, so the smallest threshold with an effect is 4 MiB. No-op where
+// madvise(MADV_HUGEPAGE) is not available. Thread-safe.
+class HugePageAdvisor {
+ public:
+  HugePageAdvisor(const JxlMemoryManager& backing, size_t threshold);
+
+  HugePageAdvisor(const HugePageAdvisor&) = delete;
+  HugePageAdvisor& operator=(const HugePageAdvisor&) = delete;
+
+  // Memory manager advising the allocations; valid while this is alive.
+  const JxlMemoryManager& memory_manager() const { return memory_manager_; }
+
+  // Not to be called concurrently with allocations.
+  void set_threshold(size_t threshold) { threshold_ = threshold; }
+
+  static constexpr size_t kHugePageSize = size_t{2} << 20;
+
+ private:
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  const JxlMemoryManager backing_;
+  JxlMemoryManager memory_manager_;
+  size_t threshold_;
+};
+
 // Returns recommended distance in bytes between the start of two consecutive
 // rows.
 size_t BytesPerRow(size_t xsize, size_t sizeof_t);
@@ -66,26 +66,27 @@ struct Header : public Fields {
   uint32_t w[kNumPredictors] = {};
 };
 
+// Allows to approximate division by a number from 1 to 64.
+//  for (int i = 0; i < 64; i++) kDivLookup[i] = (1 << 24) / (i + 1);
+constexpr uint32_t kDivLookup[64] = {
+    16777216, 8388608, 5592405, 4194304, 3355443, 2796202, 2396745, 2097152,
+    1864135,  1677721, 1525201, 1398101, 1290555, 1198372, 1118481, 1048576,
+    986895,   932067,  883011,  838860,  798915,  762600,  729444,  699050,
+    671088,   645277,  621378,  599186,  578524,  559240,  541200,  524288,
+    508400,   493447,  479349,  466033,  453438,  441505,  430185,  419430,
+    409200,   399457,  390167,  381300,  372827,  364722,  356962,  349525,
+    342392,   335544,  328965,  322638,  316551,  310689,  305040,  299593,
+    294337,   289262,  284359,  279620,  275036,  270600,  266305,  262144};
+
 struct State {
   pixel_type_w prediction[kNumPredictors] = {};
   pixel_type_w pred = 0;  // *before* removing the added bits.
-  std::vector<uint32_t> pred_errors[kNumPredictors];
+  // The errors of the kNumPredictors predictors of a pixel are stored next to
+  // each other, so that the N, NE and NW errors are in one or two cache lines.
+  std::vector<uint32_t> pred_errors;
   std::vector<int32_t> error;
   const Header &header;
 
-  // Allows to approximate division by a number from 1 to 64.
-  //  for (int i = 0; i < 64; i++) divlookup[i] = (1 << 24) / (i + 1);
-
-  const uint32_t divlookup[64] = {
-      16777216, 8388608, 5592405, 4194304, 3355443, 2796202, 2396745, 2097152,
-      1864135,  1677721, 1525201, 1398101, 1290555, 1198372, 1118481, 1048576,
-      986895,   932067,  883011,  838860,  798915,  762600,  729444,  699050,
-      671088,   645277,  621378,  599186,  578524,  559240,  541200,  524288,
-      508400,   493447,  479349,  466033,  453438,  441505,  430185,  419430,
-      409200,   399457,  390167,  381300,  372827,  364722,  356962,  349525,
-      342392,   335544,  328965,  322638,  316551,  310689,  305040,  299593,
-      294337,   289262,  284359,  279620,  275036,  270600,  266305,  262144};
-
   constexpr static pixel_type_w AddBits(pixel_type_w x) {
     return static_cast<uint64_t>(x) << kPredExtraBits;
   }
@@ -93,9 +94,7 @@ struct State {
   State(const Header &header, size_t xsize, size_t ysize) : header(header) {
     // Extra margin to avoid out-of-bounds writes.
     // All have space for two rows of data.
-    for (auto &pred_error : pred_errors) {
-      pred_error.resize((xsize + 2) * 2);
-    }
+    pred_errors.resize((xsize + 2) * 2 * kNumPredictors);
     error.resize((xsize + 2) * 2);
   }
 
@@ -103,7 +102,7 @@ struct State {
   JXL_INLINE uint32_t ErrorWeight(uint64_t x, uint32_t maxweight) const {
     int shift = static_cast<int>(FloorLog2Nonzero(x + 1)) - 5;
     if (shift < 0) shift = 0;
-    return 4 + ((maxweight * divlookup[x >> shift]) >> shift);
+    return 4 + ((maxweight * kDivLookup[x >> shift]) >> shift);
   }
 
   // Approximates the weighted average of the input values with the given
@@ -127,7 +126,7 @@ struct State {
     for (size_t i = 0; i < kNumPredictors; i++) {
       sum += p[i] * w[i];
     }
-    return (sum * divlookup[weight_sum - 1]) >> 24;
+    return (sum * kDivLookup[weight_sum - 1]) >> 24;
   }
 
   template <bool compute_properties>
@@ -141,13 +140,17 @@ struct State {
     size_t pos_N = prev_row + x;
     size_t pos_NE = x < xsize - 1 ? pos_N + 1 : pos_N;
     size_t pos_NW = x > 0 ? pos_N - 1 : pos_N;
+    // The errors at pos_N also contain the errors of pixel W.
+    // The errors at pos_NW also contain the errors of pixel WW.
+    const uint32_t *JXL_RESTRICT err_N = &pred_errors[pos_N * kNumPredictors];
+    const uint32_t *JXL_RESTRICT err_NE =
+        &pred_errors[pos_NE * kNumPredictors];
+    const uint32_t *JXL_RESTRICT err_NW =
+        &pred_errors[pos_NW * kNumPredictors];
     std::array<uint32_t, kNumPredictors> weights;
     for (size_t i = 0; i < kNumPredictors; i++) {
-      // pred_errors[pos_N] also contains the error of pixel W.
-      // pred_errors[pos_NW] also contains the error of pixel WW.
-      weights[i] = pred_errors[i][pos_N] + pred_errors[i][pos_NE] +
-                   pred_errors[i][pos_NW];
-      weights[i] = ErrorWeight(weights[i], header.w[i]);
+      weights[i] =
+          ErrorWeight(err_N[i] + err_NE[i] + err_NW[i], header.w[i]);
     }
 
     N = AddBits(N);
@@ -198,14 +201,18 @@ struct State {
     size_t prev_row = y & 1 ? (xsize + 2) : 0;
     val = AddBits(val);
     error[cur_row + x] = pred - val;
+    uint32_t *JXL_RESTRICT err_cur =
+        &pred_errors[(cur_row + x) * kNumPredictors];
+    uint32_t *JXL_RESTRICT err_NE =
+        &pred_errors[(prev_row + x + 1) * kNumPredictors];
     for (size_t i = 0; i < kNumPredictors; i++) {
       pixel_type_w err =
           (std::abs(prediction[i] - val) + kPredictionRound) >> kPredExtraBits;
       // For predicting in the next row.
-      pred_errors[i][cur_row + x] = err;
+      err_cur[i] = err;
       // Add the error on this pixel to the error on the NE pixel. This has the
       // effect of adding the error on this pixel to the E and EE pixels.
-      pred_errors[i][prev_row + x + 1] += err;
+      err_NE[i] += err;
     }
   }
 };
@@ -312,7 +319,9 @@ using FlatTree = std::vector<FlatDecisionNode>;
 
 class MATreeLookup {
  public:
-  explicit MATreeLookup(const FlatTree &tree) : nodes_(tree) {}
+  explicit MATreeLookup(const FlatTree &tree) : nodes_(tree) {
+    BuildFixedDepthTree();
+  }
   struct LookupResult {
     uint32_t context;
     Predictor predictor;
@@ -320,6 +329,7 @@ class MATreeLookup {
     int32_t multiplier;
   };
   JXL_INLINE LookupResult Lookup(const Properties &properties) const {
+    if (fixed_depth_ != 0) return FixedDepthLookup(properties);
     uint32_t pos = 0;
     while (true) {
 #define TRAVERSE_THE_TREE                                                      \
@@ -341,7 +351,68 @@ class MATreeLookup {
   }
 
  private:
+  // Trees of at most this many levels of flat nodes (i.e. up to twice as many
+  // levels of decisions) are evaluated with a fixed number of steps.
+  static constexpr size_t kMaxFixedDepth = 4;
+
+  // For shallow trees, the loop above mostly pays for mispredicting the
+  // `property0 < 0` exit, since which leaf is reached changes from pixel to
+  // pixel. Instead, turn every leaf into a node that routes to itself,
+  // whatever the properties are, so that all lookups take exactly
+  // `fixed_depth_` steps and end on a node whose payload is the leaf.
+  void BuildFixedDepthTree() {
+    if (nodes_.size() < 2) return;
+    // Children always come after their parent in a FlatTree.
+    std::vector<uint32_t> depth(nodes_.size());
+    for (size_t i = nodes_.size(); i-- > 0;) {
+      const FlatDecisionNode &node = nodes_[i];
+      if (node.property0 < 0) continue;
+      for (size_t c = 0; c < 4; c++) {
+        depth[i] = std::max<uint32_t>(depth[i], depth[node.childID + c] + 1);
+      }
+    }
+    if (depth[0] > kMaxFixedDepth) return;
+    FlatDecisionNode routing;
+    routing.property0 = 0;
+    routing.splitval0 = 0;
+    routing.properties[0] = routing.properties[1] = 0;
+    routing.splitvals[0] = routing.splitvals[1] = 0;
+    fixed_nodes_ = nodes_;
+    fixed_leaves_.resize(nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      const FlatDecisionNode &node = nodes_[i];
+      if (node.property0 >= 0) continue;
+      const LookupResult leaf = {node.childID, node.predictor,
+                                 node.predictor_offset, node.multiplier};
+      routing.childID = static_cast<uint32_t>(fixed_nodes_.size());
+      fixed_nodes_[i] = routing;
+      fixed_leaves_[i] = leaf;
+      for (size_t c = 0; c < 4; c++) {
+        fixed_nodes_.push_back(routing);
+        fixed_leaves_.push_back(leaf);
+      }
+    }
+    fixed_depth_ = depth[0];
+  }
+
+  JXL_INLINE LookupResult
+  FixedDepthLookup(const Properties &properties) const {
+    uint32_t pos = 0;
+    for (size_t i = 0; i < fixed_depth_; i++) {
+      const FlatDecisionNode &node = fixed_nodes_[pos];
+      bool p0 = properties[node.property0] <= node.splitval0;
+      uint32_t off0 = properties[node.properties[0]] <= node.splitvals[0];
+      uint32_t off1 = 2 | (properties[node.properties[1]] <= node.splitvals[1]);
+      pos = node.childID + (p0 ? off1 : off0);
+    }
+    return fixed_leaves_[pos];
+  }
+
   const FlatTree &nodes_;
+  // Number of steps of FixedDepthLookup, or 0 if `nodes_` is traversed as is.
+  size_t fixed_depth_ = 0;
+  FlatTree fixed_nodes_;
+  std::vector<LookupResult> fixed_leaves_;
 };
 
 static constexpr size_t kExtraPropsPerChannel = 4;
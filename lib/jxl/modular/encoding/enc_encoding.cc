@@ -21,6 +21,7 @@
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_cluster.h"
 #include "lib/jxl/enc_fields.h"
 #include "lib/jxl/fields.h"
 #include "lib/jxl/image_ops.h"
@@ -62,6 +63,13 @@ inline std::array<uint8_t, 3> PredictorColor(Predictor p) {
   };
 }
 
+// Cutoffs of the fixed trees, for 8-bit images.
+std::vector<int32_t> FixedTreeCutoffs() {
+  return {-500, -392, -255, -191, -127, -95, -63, -47, -31, -23, -15,
+          -11,  -7,   -4,   -3,   -1,   0,   1,   3,   5,   7,   11,
+          15,   23,   31,   47,   63,   95,  127, 191, 255, 392, 500};
+}
+
 // `cutoffs` must be sorted.
 Tree MakeFixedTree(int property, const std::vector<int32_t> &cutoffs,
                    Predictor pred, size_t num_pixels, int bitdepth) {
@@ -96,6 +104,176 @@ Tree MakeFixedTree(int property, const std::vector<int32_t> &cutoffs,
   return tree;
 }
 
+// Places `subtree` at `pos` in `tree`, appending all its other nodes.
+void AppendSubtree(const Tree &subtree, size_t pos, Tree *tree) {
+  // Children of a node are never its ancestors, so all the nodes but the root
+  // are just shifted.
+  const size_t offset = tree->size() - 1;
+  const auto remap =
+      [&](const PropertyDecisionNode &node) -> PropertyDecisionNode {
+    PropertyDecisionNode remapped = node;
+    if (node.property != -1) {
+      remapped.lchild += offset;
+      remapped.rchild += offset;
+    }
+    return remapped;
+  };
+  (*tree)[pos] = remap(subtree[0]);
+  for (size_t i = 1; i < subtree.size(); i++) {
+    tree->push_back(remap(subtree[i]));
+  }
+}
+
+// Entropy estimate of the tokens counted in `histograms`, with `extra_bits`
+// raw bits.
+float HistogramsCost(const Histogram *histograms, size_t num_histograms,
+                     size_t extra_bits) {
+  float cost = extra_bits;
+  for (size_t i = 0; i < num_histograms; i++) {
+    if (histograms[i].total_count_ != 0) {
+      cost += histograms[i].ShannonEntropy();
+    }
+  }
+  return cost;
+}
+
+// Builds a tree splitting on the channel first, then using the fixed gradient
+// property tree of kGradientFixedDC in each channel. The predictor of each
+// channel is the one of a few simple candidates with the lowest entropy
+// estimate, computed with the contexts of the fixed tree on a quarter of the
+// rows. If options.predictor is Weighted, the fixed tree of kWPFixedDC with the
+// weighted predictor is a candidate too.
+Tree FixedTreeWithChosenPredictors(const Image &image,
+                                   const ModularOptions &options,
+                                   const weighted::Header &wp_header) {
+  const std::array<Predictor, 5> kCandidates = {
+      {Predictor::Gradient, Predictor::Select, Predictor::Left,
+       Predictor::Top, Predictor::Zero}};
+  const HybridUintConfig uint_config;
+  std::vector<Tree> channel_trees;
+  for (size_t i = 0; i < image.channel.size(); i++) {
+    const Channel &channel = image.channel[i];
+    if (i >= image.nb_meta_channels &&
+        (channel.w > options.max_chan_size ||
+         channel.h > options.max_chan_size)) {
+      break;
+    }
+    Tree tree = MakeFixedTree(kGradientProp, FixedTreeCutoffs(),
+                              Predictor::Gradient, channel.w * channel.h,
+                              image.bitdepth);
+    if (channel.w == 0 || channel.h == 0) {
+      channel_trees.push_back(std::move(tree));
+      continue;
+    }
+    // Histograms of the tokens, per candidate and per node of the tree (only
+    // the ones of leaves are used).
+    std::vector<Histogram> histograms(kCandidates.size() * tree.size());
+    std::vector<size_t> extra_bits(kCandidates.size());
+    const intptr_t onerow = channel.plane.PixelsPerRow();
+    const size_t row_step = channel.h >= 16 ? 4 : 1;
+    for (size_t y = 0; y < channel.h; y += row_step) {
+      const pixel_type *JXL_RESTRICT r = channel.Row(y);
+      for (size_t x = 0; x < channel.w; x++) {
+        pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+        pixel_type_w top = (y ? *(r + x - onerow) : left);
+        pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
+        pixel_type_w gradient = top + left - topleft;
+        size_t pos = 0;
+        while (tree[pos].property != -1) {
+          pos = gradient > tree[pos].splitval ? tree[pos].lchild
+                                              : tree[pos].rchild;
+        }
+        // Same order as kCandidates.
+        const std::array<pixel_type_w, 5> guesses = {
+            {ClampedGradient(left, top, topleft), Select(left, top, topleft),
+             left, top, 0}};
+        for (size_t k = 0; k < kCandidates.size(); k++) {
+          int32_t residual = r[x] - guesses[k];
+          uint32_t token;
+          uint32_t nbits;
+          uint32_t bits;
+          uint_config.Encode(PackSigned(residual), &token, &nbits, &bits);
+          histograms[k * tree.size() + pos].Add(token);
+          extra_bits[k] += nbits;
+        }
+      }
+    }
+    size_t best = 0;
+    float best_cost = std::numeric_limits<float>::max();
+    for (size_t k = 0; k < kCandidates.size(); k++) {
+      float cost = HistogramsCost(histograms.data() + k * tree.size(),
+                                  tree.size(), extra_bits[k]);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = k;
+      }
+    }
+    for (PropertyDecisionNode &node : tree) {
+      node.predictor = kCandidates[best];
+    }
+    if (options.predictor == Predictor::Weighted) {
+      Tree wp_tree =
+          MakeFixedTree(kWPProp, FixedTreeCutoffs(), Predictor::Weighted,
+                        channel.w * channel.h, image.bitdepth);
+      std::vector<Histogram> wp_histograms(wp_tree.size());
+      size_t wp_extra_bits = 0;
+      // The state of the weighted predictor depends on all the previous rows,
+      // so it runs on all of them, but only the sampled ones are counted.
+      weighted::State wp_state(wp_header, channel.w, channel.h);
+      Properties properties(1);
+      for (size_t y = 0; y < channel.h; y++) {
+        const pixel_type *JXL_RESTRICT r = channel.Row(y);
+        for (size_t x = 0; x < channel.w; x++) {
+          pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+          pixel_type_w top = (y ? *(r + x - onerow) : left);
+          pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
+          pixel_type_w topright =
+              (x + 1 < channel.w && y ? *(r + x + 1 - onerow) : top);
+          pixel_type_w toptop = (y > 1 ? *(r + x - onerow - onerow) : top);
+          int32_t guess = wp_state.Predict</*compute_properties=*/true>(
+              x, y, channel.w, top, left, topright, topleft, toptop,
+              &properties, /*offset=*/0);
+          wp_state.UpdateErrors(r[x], x, y, channel.w);
+          if (y % row_step != 0) continue;
+          size_t pos = 0;
+          while (wp_tree[pos].property != -1) {
+            pos = properties[0] > wp_tree[pos].splitval ? wp_tree[pos].lchild
+                                                        : wp_tree[pos].rchild;
+          }
+          uint32_t token;
+          uint32_t nbits;
+          uint32_t bits;
+          uint_config.Encode(PackSigned(r[x] - guess), &token, &nbits, &bits);
+          wp_histograms[pos].Add(token);
+          wp_extra_bits += nbits;
+        }
+      }
+      if (HistogramsCost(wp_histograms.data(), wp_tree.size(), wp_extra_bits) <
+          best_cost) {
+        tree = std::move(wp_tree);
+      }
+    }
+    JXL_DEBUG_V(7, "Channel %" PRIuS ": predictor %d", i,
+                static_cast<int>(tree[0].predictor));
+    channel_trees.push_back(std::move(tree));
+  }
+  if (channel_trees.empty()) {
+    return {PropertyDecisionNode::Leaf(Predictor::Gradient)};
+  }
+  Tree tree(1);
+  size_t pos = 0;
+  for (size_t i = 0; i + 1 < channel_trees.size(); i++) {
+    // c > i: next channels, otherwise channel i.
+    tree[pos] = PropertyDecisionNode::Split(0, i, tree.size());
+    tree.emplace_back();
+    tree.emplace_back();
+    pos = tree.size() - 2;
+    AppendSubtree(channel_trees[i], pos + 1, &tree);
+  }
+  AppendSubtree(channel_trees.back(), pos, &tree);
+  return tree;
+}
+
 }  // namespace
 
 Status GatherTreeData(const Image &image, pixel_type chan, size_t group_id,
@@ -264,21 +442,16 @@ Tree PredefinedTree(ModularOptions::TreeKind tree_kind, size_t total_pixels,
       return tree;
     }
     case ModularOptions::TreeKind::kWPFixedDC: {
-      std::vector<int32_t> cutoffs = {
-          -500, -392, -255, -191, -127, -95, -63, -47, -31, -23, -15,
-          -11,  -7,   -4,   -3,   -1,   0,   1,   3,   5,   7,   11,
-          15,   23,   31,   47,   63,   95,  127, 191, 255, 392, 500};
-      return MakeFixedTree(kWPProp, cutoffs, Predictor::Weighted, total_pixels,
-                           bitdepth);
+      return MakeFixedTree(kWPProp, FixedTreeCutoffs(), Predictor::Weighted,
+                           total_pixels, bitdepth);
     }
+    // Without the image, the predictors cannot be chosen: use the gradient one
+    // everywhere.
+    case ModularOptions::TreeKind::kFixedChosenPredictor:
     case ModularOptions::TreeKind::kGradientFixedDC: {
-      std::vector<int32_t> cutoffs = {
-          -500, -392, -255, -191, -127, -95, -63, -47, -31, -23, -15,
-          -11,  -7,   -4,   -3,   -1,   0,   1,   3,   5,   7,   11,
-          15,   23,   31,   47,   63,   95,  127, 191, 255, 392, 500};
       return MakeFixedTree(
-          prevprop > 0 ? kNumNonrefProperties + 2 : kGradientProp, cutoffs,
-          Predictor::Gradient, total_pixels, bitdepth);
+          prevprop > 0 ? kNumNonrefProperties + 2 : kGradientProp,
+          FixedTreeCutoffs(), Predictor::Gradient, total_pixels, bitdepth);
     }
     case ModularOptions::TreeKind::kLearn: {
       JXL_DEBUG_ABORT("internal: kLearn is not predefined tree");
@@ -294,7 +467,7 @@ StatusOr<Tree> LearnTree(
     TreeSamples &&tree_samples, size_t total_pixels,
     const ModularOptions &options,
     const std::vector<ModularMultiplierInfo> &multiplier_info = {},
-    StaticPropRange static_prop_range = {}) {
+    StaticPropRange static_prop_range = {}, ThreadPool *pool = nullptr) {
   Tree tree;
   for (size_t i = 0; i < kNumStaticProperties; i++) {
     if (static_prop_range[i][1] == 0) {
@@ -314,7 +487,7 @@ StatusOr<Tree> LearnTree(
   tree_samples.AllSamplesDone();
   JXL_RETURN_IF_ERROR(ComputeBestTree(
       tree_samples, options.splitting_heuristics_node_threshold * required_cost,
-      multiplier_info, static_prop_range, options.fast_decode_multiplier,
+      multiplier_info, static_prop_range, options.fast_decode_multiplier, pool,
       &tree));
   return tree;
 }
@@ -602,6 +775,7 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
           options.predictor, options.wp_tree_mode));
       JXL_RETURN_IF_ERROR(tree_samples_storage.SetProperties(
           options.splitting_heuristics_properties, options.wp_tree_mode));
+      tree_samples_storage.SetMemoryLimit(options.max_tree_learning_memory);
       std::vector<pixel_type> pixel_samples;
       std::vector<pixel_type> diff_samples;
       std::vector<uint32_t> group_pixel_count;
@@ -645,6 +819,10 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
       JXL_ASSIGN_OR_RETURN(
           tree_storage,
           LearnTree(std::move(tree_samples_storage), *total_pixels, options));
+    } else if (options.tree_kind ==
+               ModularOptions::TreeKind::kFixedChosenPredictor) {
+      tree_storage =
+          FixedTreeWithChosenPredictors(image, options, header->wp_header);
     } else {
       tree_storage = PredefinedTree(options.tree_kind, *total_pixels,
                                     image.bitdepth, options.max_properties);
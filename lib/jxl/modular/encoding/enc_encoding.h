@@ -31,7 +31,7 @@ StatusOr<Tree> LearnTree(
     TreeSamples &&tree_samples, size_t total_pixels,
     const ModularOptions &options,
     const std::vector<ModularMultiplierInfo> &multiplier_info = {},
-    StaticPropRange static_prop_range = {});
+    StaticPropRange static_prop_range = {}, ThreadPool *pool = nullptr);
 
 // TODO(veluca): make cleaner interfaces.
 
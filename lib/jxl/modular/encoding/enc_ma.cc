@@ -6,6 +6,7 @@
 #include "lib/jxl/modular/encoding/enc_ma.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <limits>
 #include <numeric>
@@ -19,9 +20,14 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/fast_math-inl.h"
 #include "lib/jxl/base/random.h"
+#include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_aux_out.h"
+#include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/options.h"
 #include "lib/jxl/pack_signed.h"
@@ -160,290 +166,419 @@ void SplitTreeSamples(TreeSamples &tree_samples, size_t begin, size_t pos,
   }
 }
 
-void FindBestSplit(TreeSamples &tree_samples, float threshold,
-                   const std::vector<ModularMultiplierInfo> &mul_info,
-                   StaticPropRange initial_static_prop_range,
-                   float fast_decode_multiplier, Tree *tree) {
-  struct NodeInfo {
-    size_t pos;
-    size_t begin;
-    size_t end;
-    uint64_t used_properties;
-    StaticPropRange static_prop_range;
+struct NodeInfo {
+  size_t pos;
+  size_t begin;
+  size_t end;
+  uint64_t used_properties;
+  StaticPropRange static_prop_range;
+};
+
+struct SplitInfo {
+  size_t prop = 0;
+  uint32_t val = 0;
+  size_t pos = 0;
+  float lcost = std::numeric_limits<float>::max();
+  float rcost = std::numeric_limits<float>::max();
+  Predictor lpred = Predictor::Zero;
+  Predictor rpred = Predictor::Zero;
+  float Cost() const { return lcost + rcost; }
+};
+
+// The best split of each kind is tracked separately, as the final choice
+// favours some kinds over cheaper splits of other kinds.
+enum SplitKind : size_t {
+  kSplitStaticConstant,
+  kSplitStatic,
+  kSplitNonstatic,
+  kSplitNoWP,
+  kNumSplitKinds
+};
+
+// State of the search for the best split of a single node.
+struct NodeSplitSearch {
+  explicit NodeSplitSearch(const NodeInfo &node) : node(node) {}
+
+  NodeInfo node;
+  size_t max_symbols = 0;
+  std::vector<int32_t> counts;
+  std::vector<uint32_t> tot_extra_bits;
+  float base_bits = 0;
+  bool forced = false;
+  SplitInfo forced_split;
+  // kNumSplitKinds best splits for each property.
+  std::vector<SplitInfo> property_splits;
+  bool split = false;
+  SplitInfo best;
+};
+
+// Buffers of FindBestSplitAlongProperty, kept across calls to avoid
+// reallocating them. count_increase and extra_bits_increase are all zeros
+// between calls.
+struct SplitSearchScratch {
+  std::vector<int> prop_value_used_count;
+  std::vector<int> count_increase;
+  std::vector<size_t> extra_bits_increase;
+  struct CostInfo {
+    float cost = std::numeric_limits<float>::max();
+    float extra_cost = 0;
+    float Cost() const { return cost + extra_cost; }
+    Predictor pred;  // will be uninitialized in some cases, but never used.
   };
-  std::vector<NodeInfo> nodes;
-  nodes.push_back(NodeInfo{0, 0, tree_samples.NumDistinctSamples(), 0,
-                           initial_static_prop_range});
+  std::vector<CostInfo> costs_l;
+  std::vector<CostInfo> costs_r;
+  std::vector<int32_t> counts_above;
+  std::vector<int32_t> counts_below;
+};
 
+// Computes the histograms of the samples of the node, and whether the
+// multipliers force a split.
+void PrepareSplitSearch(const TreeSamples &tree_samples, float threshold,
+                        const std::vector<ModularMultiplierInfo> &mul_info,
+                        Tree *tree, NodeSplitSearch *search) {
+  const size_t pos = search->node.pos;
+  const size_t begin = search->node.begin;
+  const size_t end = search->node.end;
   size_t num_predictors = tree_samples.NumPredictors();
-  size_t num_properties = tree_samples.NumProperties();
 
-  // TODO(veluca): consider parallelizing the search (processing multiple nodes
-  // at a time).
-  while (!nodes.empty()) {
-    size_t pos = nodes.back().pos;
-    size_t begin = nodes.back().begin;
-    size_t end = nodes.back().end;
-    uint64_t used_properties = nodes.back().used_properties;
-    StaticPropRange static_prop_range = nodes.back().static_prop_range;
-    nodes.pop_back();
-    if (begin == end) continue;
-
-    struct SplitInfo {
-      size_t prop = 0;
-      uint32_t val = 0;
-      size_t pos = 0;
-      float lcost = std::numeric_limits<float>::max();
-      float rcost = std::numeric_limits<float>::max();
-      Predictor lpred = Predictor::Zero;
-      Predictor rpred = Predictor::Zero;
-      float Cost() const { return lcost + rcost; }
-    };
+  JXL_DASSERT(begin <= end);
+  JXL_DASSERT(end <= tree_samples.NumDistinctSamples());
 
-    SplitInfo best_split_static_constant;
-    SplitInfo best_split_static;
-    SplitInfo best_split_nonstatic;
-    SplitInfo best_split_nowp;
+  // Compute the maximum token in the range.
+  size_t max_symbols = 0;
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    for (size_t i = begin; i < end; i++) {
+      uint32_t tok = tree_samples.Token(pred, i);
+      max_symbols = max_symbols > tok + 1 ? max_symbols : tok + 1;
+    }
+  }
+  max_symbols = Padded(max_symbols);
+  search->max_symbols = max_symbols;
+  std::vector<int32_t> &counts = search->counts;
+  std::vector<uint32_t> &tot_extra_bits = search->tot_extra_bits;
+  counts.resize(max_symbols * num_predictors);
+  tot_extra_bits.resize(num_predictors);
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    for (size_t i = begin; i < end; i++) {
+      counts[pred * max_symbols + tree_samples.Token(pred, i)] +=
+          tree_samples.Count(i);
+      tot_extra_bits[pred] +=
+          tree_samples.NBits(pred, i) * tree_samples.Count(i);
+    }
+  }
 
-    JXL_DASSERT(begin <= end);
-    JXL_DASSERT(end <= tree_samples.NumDistinctSamples());
+  {
+    size_t pred = tree_samples.PredictorIndex((*tree)[pos].predictor);
+    search->base_bits =
+        EstimateBits(counts.data() + pred * max_symbols, max_symbols) +
+        tot_extra_bits[pred];
+  }
 
-    // Compute the maximum token in the range.
-    size_t max_symbols = 0;
-    for (size_t pred = 0; pred < num_predictors; pred++) {
-      for (size_t i = begin; i < end; i++) {
-        uint32_t tok = tree_samples.Token(pred, i);
-        max_symbols = max_symbols > tok + 1 ? max_symbols : tok + 1;
-      }
+  // The multiplier ranges cut halfway through the current ranges of static
+  // properties. We do this even if the current node is not a leaf, to
+  // minimize the number of nodes in the resulting tree.
+  for (const auto &mmi : mul_info) {
+    uint32_t axis;
+    uint32_t val;
+    IntersectionType t =
+        BoxIntersects(search->node.static_prop_range, mmi.range, axis, val);
+    if (t == IntersectionType::kNone) continue;
+    if (t == IntersectionType::kInside) {
+      (*tree)[pos].multiplier = mmi.multiplier;
+      break;
     }
-    max_symbols = Padded(max_symbols);
-    std::vector<int32_t> counts(max_symbols * num_predictors);
-    std::vector<uint32_t> tot_extra_bits(num_predictors);
-    for (size_t pred = 0; pred < num_predictors; pred++) {
-      for (size_t i = begin; i < end; i++) {
-        counts[pred * max_symbols + tree_samples.Token(pred, i)] +=
-            tree_samples.Count(i);
-        tot_extra_bits[pred] +=
-            tree_samples.NBits(pred, i) * tree_samples.Count(i);
+    if (t == IntersectionType::kPartial) {
+      SplitInfo *best = &search->forced_split;
+      search->forced = true;
+      best->val = tree_samples.QuantizeProperty(axis, val);
+      best->prop = axis;
+      best->lcost = best->rcost = search->base_bits / 2 - threshold;
+      best->lpred = best->rpred = (*tree)[pos].predictor;
+      best->pos = begin;
+      JXL_DASSERT(best->prop == tree_samples.PropertyFromIndex(best->prop));
+      for (size_t x = begin; x < end; x++) {
+        if (tree_samples.Property(best->prop, x) <= best->val) {
+          best->pos++;
+        }
       }
+      break;
     }
+  }
+}
 
-    float base_bits;
-    {
-      size_t pred = tree_samples.PredictorIndex((*tree)[pos].predictor);
-      base_bits =
-          EstimateBits(counts.data() + pred * max_symbols, max_symbols) +
-          tot_extra_bits[pred];
-    }
-
-    SplitInfo *best = &best_split_nonstatic;
-
-    SplitInfo forced_split;
-    // The multiplier ranges cut halfway through the current ranges of static
-    // properties. We do this even if the current node is not a leaf, to
-    // minimize the number of nodes in the resulting tree.
-    for (const auto &mmi : mul_info) {
-      uint32_t axis;
-      uint32_t val;
-      IntersectionType t =
-          BoxIntersects(static_prop_range, mmi.range, axis, val);
-      if (t == IntersectionType::kNone) continue;
-      if (t == IntersectionType::kInside) {
-        (*tree)[pos].multiplier = mmi.multiplier;
-        break;
+// For property `prop`, computes which of its values are used, and what tokens
+// correspond to those usages. Then, iterates through the values, and computes
+// the entropy of each side of the split (of the form `prop > threshold`).
+// Finally, stores the split of each kind that minimizes the cost in `splits`.
+void FindBestSplitAlongProperty(const TreeSamples &tree_samples,
+                                float threshold, const Tree &tree, size_t prop,
+                                const NodeSplitSearch &search,
+                                SplitSearchScratch *scratch,
+                                SplitInfo *splits) {
+  const size_t pos = search.node.pos;
+  const size_t begin = search.node.begin;
+  const size_t end = search.node.end;
+  const uint64_t used_properties = search.node.used_properties;
+  const size_t max_symbols = search.max_symbols;
+  size_t num_predictors = tree_samples.NumPredictors();
+
+  std::vector<int> &prop_value_used_count = scratch->prop_value_used_count;
+  std::vector<int> &count_increase = scratch->count_increase;
+  std::vector<size_t> &extra_bits_increase = scratch->extra_bits_increase;
+  std::vector<SplitSearchScratch::CostInfo> &costs_l = scratch->costs_l;
+  std::vector<SplitSearchScratch::CostInfo> &costs_r = scratch->costs_r;
+  std::vector<int32_t> &counts_above = scratch->counts_above;
+  std::vector<int32_t> &counts_below = scratch->counts_below;
+  counts_above.resize(max_symbols);
+  counts_below.resize(max_symbols);
+
+  // The lower the threshold, the higher the expected noisiness of the
+  // estimate. Thus, discourage changing predictors.
+  float change_pred_penalty = 800.0f / (100.0f + threshold);
+
+  costs_l.clear();
+  costs_r.clear();
+  size_t prop_size = tree_samples.NumPropertyValues(prop);
+  if (count_increase.size() < prop_size * max_symbols) {
+    count_increase.resize(prop_size * max_symbols);
+  }
+  if (extra_bits_increase.size() < prop_size) {
+    extra_bits_increase.resize(prop_size);
+  }
+  // Clear prop_value_used_count (which cannot be cleared "on the go")
+  prop_value_used_count.clear();
+  prop_value_used_count.resize(prop_size);
+
+  size_t first_used = prop_size;
+  size_t last_used = 0;
+
+  // TODO(veluca): consider finding multiple splits along a single
+  // property at the same time, possibly with a bottom-up approach.
+  for (size_t i = begin; i < end; i++) {
+    size_t p = tree_samples.Property(prop, i);
+    prop_value_used_count[p]++;
+    last_used = std::max(last_used, p);
+    first_used = std::min(first_used, p);
+  }
+  costs_l.resize(last_used - first_used);
+  costs_r.resize(last_used - first_used);
+  // For all predictors, compute the right and left costs of each split.
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    // Compute cost and histogram increments for each property value.
+    for (size_t i = begin; i < end; i++) {
+      size_t p = tree_samples.Property(prop, i);
+      size_t cnt = tree_samples.Count(i);
+      size_t sym = tree_samples.Token(pred, i);
+      count_increase[p * max_symbols + sym] += cnt;
+      extra_bits_increase[p] += tree_samples.NBits(pred, i) * cnt;
+    }
+    memcpy(counts_above.data(), search.counts.data() + pred * max_symbols,
+           max_symbols * sizeof counts_above[0]);
+    memset(counts_below.data(), 0, max_symbols * sizeof counts_below[0]);
+    size_t extra_bits_below = 0;
+    // Exclude last used: this ensures neither counts_above nor
+    // counts_below is empty.
+    for (size_t i = first_used; i < last_used; i++) {
+      if (!prop_value_used_count[i]) continue;
+      extra_bits_below += extra_bits_increase[i];
+      // The increase for this property value has been used, and will not
+      // be used again: clear it. Also below.
+      extra_bits_increase[i] = 0;
+      for (size_t sym = 0; sym < max_symbols; sym++) {
+        counts_above[sym] -= count_increase[i * max_symbols + sym];
+        counts_below[sym] += count_increase[i * max_symbols + sym];
+        count_increase[i * max_symbols + sym] = 0;
       }
-      if (t == IntersectionType::kPartial) {
-        forced_split.val = tree_samples.QuantizeProperty(axis, val);
-        forced_split.prop = axis;
-        forced_split.lcost = forced_split.rcost = base_bits / 2 - threshold;
-        forced_split.lpred = forced_split.rpred = (*tree)[pos].predictor;
-        best = &forced_split;
-        best->pos = begin;
-        JXL_DASSERT(best->prop == tree_samples.PropertyFromIndex(best->prop));
-        for (size_t x = begin; x < end; x++) {
-          if (tree_samples.Property(best->prop, x) <= best->val) {
-            best->pos++;
-          }
-        }
-        break;
+      float rcost = EstimateBits(counts_above.data(), max_symbols) +
+                    search.tot_extra_bits[pred] - extra_bits_below;
+      float lcost =
+          EstimateBits(counts_below.data(), max_symbols) + extra_bits_below;
+      JXL_DASSERT(extra_bits_below <= search.tot_extra_bits[pred]);
+      float penalty = 0;
+      // Never discourage moving away from the Weighted predictor.
+      if (tree_samples.PredictorFromIndex(pred) != tree[pos].predictor &&
+          tree[pos].predictor != Predictor::Weighted) {
+        penalty = change_pred_penalty;
+      }
+      // If everything else is equal, disfavour Weighted (slower) and
+      // favour Zero (faster if it's the only predictor used in a
+      // group+channel combination)
+      if (tree_samples.PredictorFromIndex(pred) == Predictor::Weighted) {
+        penalty += 1e-8;
+      }
+      if (tree_samples.PredictorFromIndex(pred) == Predictor::Zero) {
+        penalty -= 1e-8;
+      }
+      if (rcost + penalty < costs_r[i - first_used].Cost()) {
+        costs_r[i - first_used].cost = rcost;
+        costs_r[i - first_used].extra_cost = penalty;
+        costs_r[i - first_used].pred = tree_samples.PredictorFromIndex(pred);
+      }
+      if (lcost + penalty < costs_l[i - first_used].Cost()) {
+        costs_l[i - first_used].cost = lcost;
+        costs_l[i - first_used].extra_cost = penalty;
+        costs_l[i - first_used].pred = tree_samples.PredictorFromIndex(pred);
       }
     }
+  }
+  // Iterate through the possible splits and find the one with minimum sum
+  // of costs of the two sides.
+  size_t split = begin;
+  for (size_t i = first_used; i < last_used; i++) {
+    if (!prop_value_used_count[i]) continue;
+    split += prop_value_used_count[i];
+    float rcost = costs_r[i - first_used].cost;
+    float lcost = costs_l[i - first_used].cost;
+    // WP was not used + we would use the WP property or predictor
+    bool adds_wp =
+        (tree_samples.PropertyFromIndex(prop) == kWPProp &&
+         (used_properties & (1LU << prop)) == 0) ||
+        ((costs_l[i - first_used].pred == Predictor::Weighted ||
+          costs_r[i - first_used].pred == Predictor::Weighted) &&
+         tree[pos].predictor != Predictor::Weighted);
+    bool zero_entropy_side = rcost == 0 || lcost == 0;
 
-    if (best != &forced_split) {
-      std::vector<int> prop_value_used_count;
-      std::vector<int> count_increase;
-      std::vector<size_t> extra_bits_increase;
-      // For each property, compute which of its values are used, and what
-      // tokens correspond to those usages. Then, iterate through the values,
-      // and compute the entropy of each side of the split (of the form `prop >
-      // threshold`). Finally, find the split that minimizes the cost.
-      struct CostInfo {
-        float cost = std::numeric_limits<float>::max();
-        float extra_cost = 0;
-        float Cost() const { return cost + extra_cost; }
-        Predictor pred;  // will be uninitialized in some cases, but never used.
-      };
-      std::vector<CostInfo> costs_l;
-      std::vector<CostInfo> costs_r;
-
-      std::vector<int32_t> counts_above(max_symbols);
-      std::vector<int32_t> counts_below(max_symbols);
-
-      // The lower the threshold, the higher the expected noisiness of the
-      // estimate. Thus, discourage changing predictors.
-      float change_pred_penalty = 800.0f / (100.0f + threshold);
-      for (size_t prop = 0; prop < num_properties && base_bits > threshold;
-           prop++) {
-        costs_l.clear();
-        costs_r.clear();
-        size_t prop_size = tree_samples.NumPropertyValues(prop);
-        if (extra_bits_increase.size() < prop_size) {
-          count_increase.resize(prop_size * max_symbols);
-          extra_bits_increase.resize(prop_size);
-        }
-        // Clear prop_value_used_count (which cannot be cleared "on the go")
-        prop_value_used_count.clear();
-        prop_value_used_count.resize(prop_size);
-
-        size_t first_used = prop_size;
-        size_t last_used = 0;
-
-        // TODO(veluca): consider finding multiple splits along a single
-        // property at the same time, possibly with a bottom-up approach.
-        for (size_t i = begin; i < end; i++) {
-          size_t p = tree_samples.Property(prop, i);
-          prop_value_used_count[p]++;
-          last_used = std::max(last_used, p);
-          first_used = std::min(first_used, p);
-        }
-        costs_l.resize(last_used - first_used);
-        costs_r.resize(last_used - first_used);
-        // For all predictors, compute the right and left costs of each split.
-        for (size_t pred = 0; pred < num_predictors; pred++) {
-          // Compute cost and histogram increments for each property value.
-          for (size_t i = begin; i < end; i++) {
-            size_t p = tree_samples.Property(prop, i);
-            size_t cnt = tree_samples.Count(i);
-            size_t sym = tree_samples.Token(pred, i);
-            count_increase[p * max_symbols + sym] += cnt;
-            extra_bits_increase[p] += tree_samples.NBits(pred, i) * cnt;
-          }
-          memcpy(counts_above.data(), counts.data() + pred * max_symbols,
-                 max_symbols * sizeof counts_above[0]);
-          memset(counts_below.data(), 0, max_symbols * sizeof counts_below[0]);
-          size_t extra_bits_below = 0;
-          // Exclude last used: this ensures neither counts_above nor
-          // counts_below is empty.
-          for (size_t i = first_used; i < last_used; i++) {
-            if (!prop_value_used_count[i]) continue;
-            extra_bits_below += extra_bits_increase[i];
-            // The increase for this property value has been used, and will not
-            // be used again: clear it. Also below.
-            extra_bits_increase[i] = 0;
-            for (size_t sym = 0; sym < max_symbols; sym++) {
-              counts_above[sym] -= count_increase[i * max_symbols + sym];
-              counts_below[sym] += count_increase[i * max_symbols + sym];
-              count_increase[i * max_symbols + sym] = 0;
-            }
-            float rcost = EstimateBits(counts_above.data(), max_symbols) +
-                          tot_extra_bits[pred] - extra_bits_below;
-            float lcost = EstimateBits(counts_below.data(), max_symbols) +
-                          extra_bits_below;
-            JXL_DASSERT(extra_bits_below <= tot_extra_bits[pred]);
-            float penalty = 0;
-            // Never discourage moving away from the Weighted predictor.
-            if (tree_samples.PredictorFromIndex(pred) !=
-                    (*tree)[pos].predictor &&
-                (*tree)[pos].predictor != Predictor::Weighted) {
-              penalty = change_pred_penalty;
-            }
-            // If everything else is equal, disfavour Weighted (slower) and
-            // favour Zero (faster if it's the only predictor used in a
-            // group+channel combination)
-            if (tree_samples.PredictorFromIndex(pred) == Predictor::Weighted) {
-              penalty += 1e-8;
-            }
-            if (tree_samples.PredictorFromIndex(pred) == Predictor::Zero) {
-              penalty -= 1e-8;
-            }
-            if (rcost + penalty < costs_r[i - first_used].Cost()) {
-              costs_r[i - first_used].cost = rcost;
-              costs_r[i - first_used].extra_cost = penalty;
-              costs_r[i - first_used].pred =
-                  tree_samples.PredictorFromIndex(pred);
-            }
-            if (lcost + penalty < costs_l[i - first_used].Cost()) {
-              costs_l[i - first_used].cost = lcost;
-              costs_l[i - first_used].extra_cost = penalty;
-              costs_l[i - first_used].pred =
-                  tree_samples.PredictorFromIndex(pred);
-            }
-          }
-        }
-        // Iterate through the possible splits and find the one with minimum sum
-        // of costs of the two sides.
-        size_t split = begin;
-        for (size_t i = first_used; i < last_used; i++) {
-          if (!prop_value_used_count[i]) continue;
-          split += prop_value_used_count[i];
-          float rcost = costs_r[i - first_used].cost;
-          float lcost = costs_l[i - first_used].cost;
-          // WP was not used + we would use the WP property or predictor
-          bool adds_wp =
-              (tree_samples.PropertyFromIndex(prop) == kWPProp &&
-               (used_properties & (1LU << prop)) == 0) ||
-              ((costs_l[i - first_used].pred == Predictor::Weighted ||
-                costs_r[i - first_used].pred == Predictor::Weighted) &&
-               (*tree)[pos].predictor != Predictor::Weighted);
-          bool zero_entropy_side = rcost == 0 || lcost == 0;
-
-          SplitInfo &best =
-              prop < kNumStaticProperties
-                  ? (zero_entropy_side ? best_split_static_constant
-                                       : best_split_static)
-                  : (adds_wp ? best_split_nonstatic : best_split_nowp);
-          if (lcost + rcost < best.Cost()) {
-            best.prop = prop;
-            best.val = i;
-            best.pos = split;
-            best.lcost = lcost;
-            best.lpred = costs_l[i - first_used].pred;
-            best.rcost = rcost;
-            best.rpred = costs_r[i - first_used].pred;
-          }
-        }
-        // Clear extra_bits_increase and cost_increase for last_used.
-        extra_bits_increase[last_used] = 0;
-        for (size_t sym = 0; sym < max_symbols; sym++) {
-          count_increase[last_used * max_symbols + sym] = 0;
-        }
-      }
+    SplitInfo &best =
+        splits[prop < kNumStaticProperties
+                   ? (zero_entropy_side ? kSplitStaticConstant : kSplitStatic)
+                   : (adds_wp ? kSplitNonstatic : kSplitNoWP)];
+    if (lcost + rcost < best.Cost()) {
+      best.prop = prop;
+      best.val = i;
+      best.pos = split;
+      best.lcost = lcost;
+      best.lpred = costs_l[i - first_used].pred;
+      best.rcost = rcost;
+      best.rpred = costs_r[i - first_used].pred;
+    }
+  }
+  // Clear extra_bits_increase and cost_increase for last_used.
+  extra_bits_increase[last_used] = 0;
+  for (size_t sym = 0; sym < max_symbols; sym++) {
+    count_increase[last_used * max_symbols + sym] = 0;
+  }
+}
 
-      // Try to avoid introducing WP.
-      if (best_split_nowp.Cost() + threshold < base_bits &&
-          best_split_nowp.Cost() <= fast_decode_multiplier * best->Cost()) {
-        best = &best_split_nowp;
+// Picks the split of the node among the best ones along each property, and
+// returns whether it is worth doing it.
+bool ChooseSplit(float threshold, float fast_decode_multiplier,
+                 NodeSplitSearch *search) {
+  if (search->forced) {
+    search->best = search->forced_split;
+  } else {
+    // Reducing in property order gives the same result as a single search
+    // over all the properties.
+    SplitInfo best_of_kind[kNumSplitKinds];
+    for (size_t i = 0; i < search->property_splits.size(); i++) {
+      SplitInfo &cur = best_of_kind[i % kNumSplitKinds];
+      if (search->property_splits[i].Cost() < cur.Cost()) {
+        cur = search->property_splits[i];
       }
-      // Split along static props if possible and not significantly more
-      // expensive.
-      if (best_split_static.Cost() + threshold < base_bits &&
-          best_split_static.Cost() <= fast_decode_multiplier * best->Cost()) {
-        best = &best_split_static;
+    }
+    const float base_bits = search->base_bits;
+    const SplitInfo *best = &best_of_kind[kSplitNonstatic];
+    // Try to avoid introducing WP.
+    const SplitInfo &split_nowp = best_of_kind[kSplitNoWP];
+    if (split_nowp.Cost() + threshold < base_bits &&
+        split_nowp.Cost() <= fast_decode_multiplier * best->Cost()) {
+      best = &split_nowp;
+    }
+    // Split along static props if possible and not significantly more
+    // expensive.
+    const SplitInfo &split_static = best_of_kind[kSplitStatic];
+    if (split_static.Cost() + threshold < base_bits &&
+        split_static.Cost() <= fast_decode_multiplier * best->Cost()) {
+      best = &split_static;
+    }
+    // Split along static props to create constant nodes if possible.
+    const SplitInfo &split_constant = best_of_kind[kSplitStaticConstant];
+    if (split_constant.Cost() + threshold < base_bits) {
+      best = &split_constant;
+    }
+    search->best = *best;
+  }
+  search->split = search->best.Cost() + threshold < search->base_bits;
+  return search->split;
+}
+
+// Nodes are processed a whole level at a time: the split searches of all the
+// nodes of a level are independent, so they run in parallel, one task per
+// node and property. Since each search only depends on the samples of its
+// node, the learned tree does not depend on the number of threads.
+Status FindBestSplit(TreeSamples &tree_samples, float threshold,
+                     const std::vector<ModularMultiplierInfo> &mul_info,
+                     StaticPropRange initial_static_prop_range,
+                     float fast_decode_multiplier, ThreadPool *pool,
+                     Tree *tree) {
+  std::vector<NodeInfo> nodes;
+  nodes.push_back(NodeInfo{0, 0, tree_samples.NumDistinctSamples(), 0,
+                           initial_static_prop_range});
+
+  size_t num_properties = tree_samples.NumProperties();
+  std::vector<SplitSearchScratch> scratch;
+
+  while (!nodes.empty()) {
+    std::vector<NodeSplitSearch> level;
+    for (const NodeInfo &node : nodes) {
+      if (node.begin != node.end) level.emplace_back(node);
+    }
+    nodes.clear();
+
+    const auto prepare = [&](const uint32_t i, size_t /* thread */) -> Status {
+      NodeSplitSearch &search = level[i];
+      PrepareSplitSearch(tree_samples, threshold, mul_info, tree, &search);
+      if (!search.forced && search.base_bits > threshold) {
+        search.property_splits.resize(num_properties * kNumSplitKinds);
       }
-      // Split along static props to create constant nodes if possible.
-      if (best_split_static_constant.Cost() + threshold < base_bits) {
-        best = &best_split_static_constant;
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, level.size(), ThreadPool::NoInit,
+                                  prepare, "PrepareTreeSplits"));
+
+    const auto alloc_scratch = [&](const size_t num_threads) -> Status {
+      if (scratch.size() < num_threads) scratch.resize(num_threads);
+      return true;
+    };
+    const auto search_property = [&](const uint32_t task,
+                                     size_t thread) -> Status {
+      const NodeSplitSearch &search = level[task / num_properties];
+      if (search.property_splits.empty()) return true;
+      size_t prop = task % num_properties;
+      FindBestSplitAlongProperty(
+          tree_samples, threshold, *tree, prop, search, &scratch[thread],
+          &level[task / num_properties].property_splits[prop * kNumSplitKinds]);
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, level.size() * num_properties,
+                                  alloc_scratch, search_property,
+                                  "FindTreeSplits"));
+
+    const auto split = [&](const uint32_t i, size_t /* thread */) -> Status {
+      NodeSplitSearch &search = level[i];
+      if (!ChooseSplit(threshold, fast_decode_multiplier, &search)) {
+        return true;
       }
-    }
+      // "Sort" according to winning property
+      SplitTreeSamples(tree_samples, search.node.begin, search.best.pos,
+                       search.node.end, search.best.prop);
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, level.size(), ThreadPool::NoInit,
+                                  split, "SplitTreeSamples"));
 
-    if (best->Cost() + threshold < base_bits) {
+    for (const NodeSplitSearch &search : level) {
+      if (!search.split) continue;
+      const SplitInfo *best = &search.best;
+      const size_t pos = search.node.pos;
+      const size_t begin = search.node.begin;
+      const size_t end = search.node.end;
+      uint64_t used_properties = search.node.used_properties;
+      const StaticPropRange &static_prop_range = search.node.static_prop_range;
       uint32_t p = tree_samples.PropertyFromIndex(best->prop);
       pixel_type dequant =
           tree_samples.UnquantizeProperty(best->prop, best->val);
       // Split node and try to split children.
       MakeSplitNode(pos, p, dequant, best->lpred, 0, best->rpred, 0, tree);
-      // "Sort" according to winning property
-      SplitTreeSamples(tree_samples, begin, best->pos, end, best->prop);
       if (p >= kNumStaticProperties) {
         used_properties |= 1 << best->prop;
       }
@@ -465,6 +600,7 @@ void FindBestSplit(TreeSamples &tree_samples, float threshold,
                                used_properties, new_sp_range});
     }
   }
+  return true;
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -480,7 +616,8 @@ HWY_EXPORT(FindBestSplit);  // Local function.
 Status ComputeBestTree(TreeSamples &tree_samples, float threshold,
                        const std::vector<ModularMultiplierInfo> &mul_info,
                        StaticPropRange static_prop_range,
-                       float fast_decode_multiplier, Tree *tree) {
+                       float fast_decode_multiplier, ThreadPool *pool,
+                       Tree *tree) {
   // TODO(veluca): take into account that different contexts can have different
   // uint configs.
   //
@@ -494,10 +631,43 @@ Status ComputeBestTree(TreeSamples &tree_samples, float threshold,
 
   JXL_ENSURE(tree_samples.NumDistinctSamples() <=
              std::numeric_limits<uint32_t>::max());
-  HWY_DYNAMIC_DISPATCH(FindBestSplit)
-  (tree_samples, threshold, mul_info, static_prop_range, fast_decode_multiplier,
-   tree);
-  return true;
+  return HWY_DYNAMIC_DISPATCH(FindBestSplit)(tree_samples, threshold, mul_info,
+                                            static_prop_range,
+                                            fast_decode_multiplier, pool, tree);
+}
+
+float EstimateTreeCost(const TreeSamples &tree_samples, const Tree &tree) {
+  // Histogram of the residual tokens of each leaf, with its predictor.
+  std::vector<std::vector<int32_t>> leaf_counts(tree.size());
+  float extra_bits = 0;
+  for (size_t i = 0; i < tree_samples.NumDistinctSamples(); i++) {
+    size_t pos = 0;
+    while (tree[pos].property >= 0) {
+      size_t prop = tree_samples.PropertyIndex(tree[pos].property);
+      size_t quant = tree_samples.Property(prop, i);
+      // The last quantized value is above all the split values.
+      bool greater = quant + 1 == tree_samples.NumPropertyValues(prop) ||
+                     tree_samples.UnquantizeProperty(prop, quant) >
+                         tree[pos].splitval;
+      pos = greater ? tree[pos].lchild : tree[pos].rchild;
+    }
+    size_t pred = tree_samples.PredictorIndex(tree[pos].predictor);
+    std::vector<int32_t> &counts = leaf_counts[pos];
+    size_t tok = tree_samples.Token(pred, i);
+    if (counts.size() <= tok) counts.resize(tok + 1);
+    counts[tok] += tree_samples.Count(i);
+    extra_bits += tree_samples.NBits(pred, i) * tree_samples.Count(i);
+  }
+  float bits = extra_bits;
+  for (const std::vector<int32_t> &counts : leaf_counts) {
+    int32_t total = std::accumulate(counts.begin(), counts.end(), 0);
+    for (int32_t count : counts) {
+      if (count == 0 || count == total) continue;
+      float prob = std::max(count * 1.0f / total, 1.0f / ANS_TAB_SIZE);
+      bits -= count * std::log2(prob);
+    }
+  }
+  return bits;
 }
 
 #if JXL_CXX_LANG < JXL_CXX_17
@@ -610,7 +780,22 @@ void TreeSamples::AddToTable(size_t a) {
   }
 }
 
+void TreeSamples::SetMemoryLimit(size_t max_bytes) {
+  // The residuals, properties and count of each distinct sample, plus the
+  // deduplication table, which has less than 3 entries per sample.
+  size_t bytes_per_sample = predictors.size() * sizeof(ResidualToken) +
+                            props_to_use.size() * sizeof(uint8_t) +
+                            sizeof(uint16_t) + 3 * sizeof(uint32_t);
+  max_distinct_samples_ =
+      max_bytes == 0 ? 0 : std::max<size_t>(max_bytes / bytes_per_sample, 1);
+}
+
 void TreeSamples::PrepareForSamples(size_t num_samples) {
+  if (max_distinct_samples_ != 0) {
+    num_samples = std::min(
+        num_samples, max_distinct_samples_ - std::min(max_distinct_samples_,
+                                                      NumDistinctSamples()));
+  }
   for (auto &res : residuals) {
     res.reserve(res.size() + num_samples);
   }
@@ -667,6 +852,10 @@ bool TreeSamples::IsSameSample(size_t a, size_t b) const {
 
 void TreeSamples::AddSample(pixel_type_w pixel, const Properties &properties,
                             const pixel_type_w *predictions) {
+  if (sample_shift_ != 0 &&
+      (rng_() & ((uint64_t{1} << sample_shift_) - 1)) != 0) {
+    return;
+  }
   for (size_t i = 0; i < predictors.size(); i++) {
     pixel_type v = pixel - predictions[static_cast<int>(predictors[i])];
     uint32_t tok, nbits, bits;
@@ -685,6 +874,41 @@ void TreeSamples::AddSample(pixel_type_w pixel, const Properties &properties,
     for (auto &r : residuals) r.pop_back();
     for (auto &p : props) p.pop_back();
     sample_counts.pop_back();
+  } else if (max_distinct_samples_ != 0 &&
+             NumDistinctSamples() >= max_distinct_samples_) {
+    HalveSamples();
+  }
+}
+
+void TreeSamples::HalveSamples() {
+  if (sample_shift_ < 63) sample_shift_++;
+  size_t num_kept = 0;
+  num_samples = 0;
+  for (size_t i = 0; i < NumDistinctSamples(); i++) {
+    // Keep each of the occurrences of the sample with probability 1/2.
+    uint32_t count = 0;
+    for (uint32_t left = sample_counts[i]; left > 0;) {
+      uint32_t n = std::min<uint32_t>(left, 64);
+      uint64_t bits = rng_();
+      if (n < 64) bits &= (uint64_t{1} << n) - 1;
+      count += hwy::PopCount(bits);
+      left -= n;
+    }
+    if (count == 0) continue;
+    for (auto &r : residuals) r[num_kept] = r[i];
+    for (auto &p : props) p[num_kept] = p[i];
+    sample_counts[num_kept] = static_cast<uint16_t>(count);
+    num_samples += count;
+    num_kept++;
+  }
+  for (auto &r : residuals) r.resize(num_kept);
+  for (auto &p : props) p.resize(num_kept);
+  sample_counts.resize(num_kept);
+  std::fill(dedup_table_.begin(), dedup_table_.end(), kDedupEntryUnused);
+  for (size_t i = 0; i < num_kept; i++) {
+    if (sample_counts[i] != std::numeric_limits<uint16_t>::max()) {
+      AddToTable(i);
+    }
   }
 }
 
@@ -1018,5 +1242,40 @@ Status TokenizeTree(const Tree &tree, std::vector<Token> *tokens,
   return true;
 }
 
+StatusOr<std::vector<uint8_t>> SerializeTree(JxlMemoryManager *memory_manager,
+                                             const Tree &tree) {
+  std::vector<std::vector<Token>> tokens(1);
+  Tree decoder_tree;
+  JXL_RETURN_IF_ERROR(TokenizeTree(tree, tokens.data(), &decoder_tree));
+  BitWriter writer{memory_manager};
+  EntropyEncodingData code;
+  std::vector<uint8_t> context_map;
+  JXL_ASSIGN_OR_RETURN(
+      size_t cost,
+      BuildAndEncodeHistograms(memory_manager, HistogramParams(),
+                               kNumTreeContexts, tokens, &code, &context_map,
+                               &writer, LayerType::ModularTree, nullptr));
+  (void)cost;
+  JXL_RETURN_IF_ERROR(WriteTokens(tokens[0], code, context_map, 0, &writer,
+                                  LayerType::ModularTree, nullptr));
+  JXL_RETURN_IF_ERROR(
+      writer.WithMaxBits(kBitsPerByte, LayerType::ModularTree, nullptr, [&] {
+        writer.ZeroPadToByte();
+        return true;
+      }));
+  Span<const uint8_t> bytes = writer.GetSpan();
+  return std::vector<uint8_t>(bytes.data(), bytes.data() + bytes.size());
+}
+
+Status DeserializeTree(JxlMemoryManager *memory_manager,
+                       Span<const uint8_t> bytes, Tree *tree) {
+  BitReader br(bytes);
+  Status status = DecodeTree(memory_manager, &br, tree, kMaxTreeSize);
+  // Also fails if the tree is truncated.
+  Status close_status = br.Close();
+  JXL_RETURN_IF_ERROR(status);
+  return close_status;
+}
+
 }  // namespace jxl
 #endif  // HWY_ONCE
@@ -6,11 +6,15 @@
 #ifndef LIB_JXL_MODULAR_ENCODING_ENC_MA_H_
 #define LIB_JXL_MODULAR_ENCODING_ENC_MA_H_
 
+#include <jxl/memory_manager.h>
+
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <vector>
 
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/modular/encoding/dec_ma.h"
@@ -71,6 +75,12 @@ struct TreeSamples {
   size_t NumPredictors() const { return predictors.size(); }
   size_t NumProperties() const { return props_to_use.size(); }
 
+  // Limits the memory used to store the samples to about `max_bytes`, or
+  // removes the limit if it is 0. When the limit is reached, half of the
+  // samples are dropped, and the following ones are kept with half the
+  // probability, so that the stored samples remain a uniform subset of the
+  // added ones. Must be called after SetPredictor and SetProperties.
+  void SetMemoryLimit(size_t max_bytes);
   // Preallocate data for a given number of samples. MUST be called before
   // adding any sample.
   void PrepareForSamples(size_t num_samples);
@@ -130,6 +140,11 @@ struct TreeSamples {
   // Table for deduplication.
   static constexpr uint32_t kDedupEntryUnused{static_cast<uint32_t>(-1)};
   std::vector<uint32_t> dedup_table_;
+  // Maximum number of distinct samples, or 0 if there is no limit.
+  size_t max_distinct_samples_ = 0;
+  // Added samples are kept with probability 2^-sample_shift_.
+  size_t sample_shift_ = 0;
+  Rng rng_{0};
 
   // Functions for sample deduplication.
   bool IsSameSample(size_t a, size_t b) const;
@@ -138,12 +153,20 @@ struct TreeSamples {
   void InitTable(size_t log_size);
   // Returns true if `a` was already present in the table.
   bool AddToTableAndMerge(size_t a);
+  // Keeps each of the samples seen so far with probability 1/2.
+  void HalveSamples();
   void AddToTable(size_t a);
 };
 
 Status TokenizeTree(const Tree &tree, std::vector<Token> *tokens,
                     Tree *decoder_tree);
 
+// Tree (de)serialization, with the same encoding as in the bitstream.
+StatusOr<std::vector<uint8_t>> SerializeTree(JxlMemoryManager *memory_manager,
+                                             const Tree &tree);
+Status DeserializeTree(JxlMemoryManager *memory_manager,
+                       Span<const uint8_t> bytes, Tree *tree);
+
 void CollectPixelSamples(const Image &image, const ModularOptions &options,
                          uint32_t group_id,
                          std::vector<uint32_t> &group_pixel_count,
@@ -151,10 +174,20 @@ void CollectPixelSamples(const Image &image, const ModularOptions &options,
                          std::vector<pixel_type> &pixel_samples,
                          std::vector<pixel_type> &diff_samples);
 
+// Learns the tree, using `pool` (if not null) to search for the splits of
+// multiple nodes and properties in parallel. The result does not depend on
+// the number of threads.
 Status ComputeBestTree(TreeSamples &tree_samples, float threshold,
                        const std::vector<ModularMultiplierInfo> &mul_info,
                        StaticPropRange static_prop_range,
-                       float fast_decode_multiplier, Tree *tree);
+                       float fast_decode_multiplier, ThreadPool *pool,
+                       Tree *tree);
+
+// Estimates the number of bits needed to encode the residuals of the samples
+// with the contexts and predictors of `tree`, which must only use the
+// properties and predictors of `tree_samples`. Unlike the tree learning, the
+// samples are not reordered.
+float EstimateTreeCost(const TreeSamples &tree_samples, const Tree &tree);
 
 }  // namespace jxl
 #endif  // LIB_JXL_MODULAR_ENCODING_ENC_MA_H_
@@ -16,6 +16,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/scope_guard.h"
 #include "lib/jxl/base/status.h"
@@ -139,6 +140,171 @@ FlatTree FilterTree(const Tree &global_tree,
 }
 
 namespace detail {
+// Adds the clamped gradient prediction to the residuals stored in `channel` by
+// DecodeModularChannelMAANS, see `gradient_deferred`.
+void UndoGradientPrediction(Channel &channel) {
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  for (size_t y = 0; y < channel.h; y++) {
+    pixel_type *JXL_RESTRICT r = channel.Row(y);
+    for (size_t x = 0; x < channel.w; x++) {
+      pixel_type left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+      pixel_type top = (y ? *(r + x - onerow) : left);
+      pixel_type topleft = (x && y ? *(r + x - 1 - onerow) : left);
+      pixel_type_w guess = ClampedGradient(top, left, topleft);
+      r[x] = static_cast<pixel_type>(r[x] + guess);
+    }
+  }
+}
+
+// Decodes a channel whose tree is a single gradient leaf with context `ctx_id`,
+// using UintConfig for its values.
+template <bool uses_lz77, typename UintConfig>
+void DecodeGradientChannel(ANSSymbolReader *reader, BitReader *br,
+                           size_t ctx_id, Channel &channel) {
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  for (size_t y = 0; y < channel.h; y++) {
+    pixel_type *JXL_RESTRICT r = channel.Row(y);
+    for (size_t x = 0; x < channel.w; x++) {
+      pixel_type left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+      pixel_type top = (y ? *(r + x - onerow) : left);
+      pixel_type topleft = (x && y ? *(r + x - 1 - onerow) : left);
+      pixel_type guess = ClampedGradient(top, left, topleft);
+      uint64_t v =
+          reader->ReadHybridUintClusteredMaybeInlined<uses_lz77, UintConfig>(
+              ctx_id, br);
+      r[x] = static_cast<pixel_type>(pixel_type_w{UnpackSigned(v)} + guess);
+    }
+  }
+}
+
+// Decodes a channel whose tree only splits on the gradient property, looked up
+// in `tree_lut`, using UintConfig for the values of all the contexts.
+template <bool uses_lz77, typename UintConfig>
+void DecodeGradientLutChannel(ANSSymbolReader *reader, BitReader *br,
+                              const TreeLut<uint8_t, false, false> &tree_lut,
+                              Channel &channel) {
+  const intptr_t onerow = channel.plane.PixelsPerRow();
+  for (size_t y = 0; y < channel.h; y++) {
+    pixel_type *JXL_RESTRICT r = channel.Row(y);
+    for (size_t x = 0; x < channel.w; x++) {
+      pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
+      pixel_type_w top = (y ? *(r + x - onerow) : left);
+      pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
+      int32_t guess = ClampedGradient(top, left, topleft);
+      uint32_t pos =
+          kPropRangeFast +
+          std::min<pixel_type_w>(
+              std::max<pixel_type_w>(-kPropRangeFast, top + left - topleft),
+              kPropRangeFast - 1);
+      uint32_t ctx_id = tree_lut.context_lookup[pos];
+      uint64_t v =
+          reader->ReadHybridUintClusteredMaybeInlined<uses_lz77, UintConfig>(
+              ctx_id, br);
+      r[x] = static_cast<pixel_type>(pixel_type_w{UnpackSigned(v)} + guess);
+    }
+  }
+}
+
+// Reads `xsize` values of the *clustered* context `ctx_id` into `row`, without
+// prediction.
+template <bool uses_lz77>
+JXL_INLINE void ReadRowUnpackSigned(ANSSymbolReader *reader, size_t ctx_id,
+                                    BitReader *br, pixel_type *row,
+                                    size_t xsize) {
+  // The values are unpacked in place; int32_t and uint32_t may alias.
+  uint32_t *tokens = reinterpret_cast<uint32_t *>(row);
+  reader->ReadHybridUintClusteredBatch<uses_lz77>(ctx_id, br, tokens, xsize);
+  for (size_t x = 0; x < xsize; x++) {
+    row[x] = static_cast<pixel_type>(UnpackSigned(tokens[x]));
+  }
+}
+
+// Returns true if no inner node of `tree` uses a property that depends on the
+// pixels of the current row, i.e. for y > 0 the leaves of a whole row can be
+// looked up before any of its pixels is decoded.
+bool TreeUsesOnlyPreviousRows(const FlatTree &tree) {
+  const auto is_previous_rows_property = [](int32_t p) {
+    return p < 5 || p == 6 || p == 11 || p == 12 || p == 13;
+  };
+  for (const FlatDecisionNode &node : tree) {
+    if (node.property0 == -1) continue;
+    if (!is_previous_rows_property(node.property0) ||
+        !is_previous_rows_property(node.properties[0]) ||
+        !is_previous_rows_property(node.properties[1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Leaf of a pixel, with the part of the prediction that does not depend on
+// the current row already added to `guess`.
+struct RowLeaf {
+  uint32_t context;
+  Predictor predictor;
+  int32_t multiplier;
+  pixel_type_w guess;
+};
+
+// Looks up the leaves of row `y` > 0 of `channel` for a tree that passes
+// TreeUsesOnlyPreviousRows. The predictions that only use the rows above are
+// folded into the guess and their predictor is replaced with Zero, so that
+// only Left, Gradient, Select and the like remain for the decoding loop.
+void LookupRowLeaves(const Channel &channel, size_t y,
+                     const MATreeLookup &tree_lookup, Properties *properties,
+                     RowLeaf *JXL_RESTRICT leaves) {
+  const pixel_type *JXL_RESTRICT rtop = channel.Row(y - 1);
+  const pixel_type *JXL_RESTRICT rtoptop = y > 1 ? channel.Row(y - 2) : rtop;
+  const size_t w = channel.w;
+  Properties &p = *properties;
+  for (size_t x = 0; x < w; x++) {
+    // Same edge handling as in Predict.
+    pixel_type_w top = rtop[x];
+    pixel_type_w topleft = x ? rtop[x - 1] : top;
+    pixel_type_w topright = x + 1 < w ? rtop[x + 1] : top;
+    pixel_type_w toptop = rtoptop[x];
+    p[3] = x;
+    p[4] = top > 0 ? top : -top;
+    p[6] = top;
+    p[11] = topleft - top;
+    p[12] = top - topright;
+    p[13] = top - toptop;
+    MATreeLookup::LookupResult lr = tree_lookup.Lookup(p);
+    RowLeaf &leaf = leaves[x];
+    leaf.context = lr.context;
+    leaf.multiplier = lr.multiplier;
+    leaf.guess = lr.offset;
+    leaf.predictor = Predictor::Zero;
+    switch (lr.predictor) {
+      case Predictor::Zero:
+        break;
+      case Predictor::Top:
+        leaf.guess += top;
+        break;
+      case Predictor::TopLeft:
+        leaf.guess += topleft;
+        break;
+      case Predictor::TopRight:
+        leaf.guess += topright;
+        break;
+      case Predictor::Average2:
+        leaf.guess += (topleft + top) / 2;
+        break;
+      case Predictor::Average3:
+        leaf.guess += (top + topright) / 2;
+        break;
+      default:
+        leaf.predictor = lr.predictor;
+        break;
+    }
+  }
+}
+
+// If `gradient_deferred` is not null and the tree of the channel is a single
+// gradient leaf, only the residuals are decoded and *gradient_deferred is set;
+// UndoGradientPrediction must then be called on the channel. This takes the
+// prediction out of the entropy decoding loop, and lets it run in parallel for
+// multiple channels.
 template <bool uses_lz77>
 Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                  const std::vector<uint8_t> &context_map,
@@ -147,7 +313,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                  pixel_type chan, size_t group_id,
                                  TreeLut<uint8_t, false, false> &tree_lut,
                                  Image *image, uint32_t &fl_run,
-                                 uint32_t &fl_v) {
+                                 uint32_t &fl_v, bool *gradient_deferred) {
   JxlMemoryManager *memory_manager = image->memory_manager();
   Channel &channel = image->channel[chan];
 
@@ -209,11 +375,7 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
         if (multiplier == 1 && offset == 0) {
           for (size_t y = 0; y < channel.h; y++) {
             pixel_type *JXL_RESTRICT r = channel.Row(y);
-            for (size_t x = 0; x < channel.w; x++) {
-              uint32_t v =
-                  reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id, br);
-              r[x] = UnpackSigned(v);
-            }
+            ReadRowUnpackSigned<uses_lz77>(reader, ctx_id, br, r, channel.w);
           }
         } else {
           for (size_t y = 0; y < channel.h; y++) {
@@ -263,20 +425,26 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
       }
       return true;
     } else if (predictor == Predictor::Gradient && offset == 0 &&
-               multiplier == 1) {
-      JXL_DEBUG_V(8, "Gradient very fast track.");
-      const intptr_t onerow = channel.plane.PixelsPerRow();
+               multiplier == 1 && gradient_deferred) {
+      JXL_DEBUG_V(8, "Gradient residuals fast track.");
       for (size_t y = 0; y < channel.h; y++) {
         pixel_type *JXL_RESTRICT r = channel.Row(y);
-        for (size_t x = 0; x < channel.w; x++) {
-          pixel_type left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
-          pixel_type top = (y ? *(r + x - onerow) : left);
-          pixel_type topleft = (x && y ? *(r + x - 1 - onerow) : left);
-          pixel_type guess = ClampedGradient(top, left, topleft);
-          uint64_t v = reader->ReadHybridUintClusteredMaybeInlined<uses_lz77>(
-              ctx_id, br);
-          r[x] = make_pixel(v, 1, guess);
-        }
+        ReadRowUnpackSigned<uses_lz77>(reader, ctx_id, br, r, channel.w);
+      }
+      *gradient_deferred = true;
+      return true;
+    } else if (predictor == Predictor::Gradient && offset == 0 &&
+               multiplier == 1) {
+      JXL_DEBUG_V(8, "Gradient very fast track.");
+      if (reader->ContextUses<HybridUint420Config>(ctx_id)) {
+        DecodeGradientChannel<uses_lz77, HybridUint420Config>(reader, br,
+                                                              ctx_id, channel);
+      } else if (reader->ContextUses<HybridUint000Config>(ctx_id)) {
+        DecodeGradientChannel<uses_lz77, HybridUint000Config>(reader, br,
+                                                              ctx_id, channel);
+      } else {
+        DecodeGradientChannel<uses_lz77, DynamicHybridUintConfig>(
+            reader, br, ctx_id, channel);
       }
       return true;
     }
@@ -293,24 +461,15 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
 
   if (is_gradient_only) {
     JXL_DEBUG_V(8, "Gradient fast track.");
-    const intptr_t onerow = channel.plane.PixelsPerRow();
-    for (size_t y = 0; y < channel.h; y++) {
-      pixel_type *JXL_RESTRICT r = channel.Row(y);
-      for (size_t x = 0; x < channel.w; x++) {
-        pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
-        pixel_type_w top = (y ? *(r + x - onerow) : left);
-        pixel_type_w topleft = (x && y ? *(r + x - 1 - onerow) : left);
-        int32_t guess = ClampedGradient(top, left, topleft);
-        uint32_t pos =
-            kPropRangeFast +
-            std::min<pixel_type_w>(
-                std::max<pixel_type_w>(-kPropRangeFast, top + left - topleft),
-                kPropRangeFast - 1);
-        uint32_t ctx_id = tree_lut.context_lookup[pos];
-        uint64_t v =
-            reader->ReadHybridUintClusteredMaybeInlined<uses_lz77>(ctx_id, br);
-        r[x] = make_pixel(v, 1, guess);
-      }
+    if (reader->AllContextsUse<HybridUint420Config>()) {
+      DecodeGradientLutChannel<uses_lz77, HybridUint420Config>(
+          reader, br, tree_lut, channel);
+    } else if (reader->AllContextsUse<HybridUint000Config>()) {
+      DecodeGradientLutChannel<uses_lz77, HybridUint000Config>(
+          reader, br, tree_lut, channel);
+    } else {
+      DecodeGradientLutChannel<uses_lz77, DynamicHybridUintConfig>(
+          reader, br, tree_lut, channel);
     }
   } else if (!uses_lz77 && is_wp_only && channel.w > 8) {
     JXL_DEBUG_V(8, "WP fast track.");
@@ -372,6 +531,47 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
         wp_state.UpdateErrors(r[x], x, y, channel.w);
       }
     }
+  } else if (!tree_has_wp_prop_or_pred && num_props == kNumNonrefProperties &&
+             TreeUsesOnlyPreviousRows(tree)) {
+    // special optimized case: the contexts only depend on the rows above, so
+    // the tree is traversed for a whole row before decoding it, and the
+    // decoding loop only computes the predictions that use the left pixels.
+    JXL_DEBUG_V(8, "Previous rows track.");
+    MATreeLookup tree_lookup(tree);
+    Properties properties = Properties(num_props);
+    const intptr_t onerow = channel.plane.PixelsPerRow();
+    JXL_ASSIGN_OR_RETURN(Channel references,
+                         Channel::Create(memory_manager, 0, channel.w));
+    std::vector<RowLeaf> leaves(channel.w);
+    for (size_t y = 0; y < channel.h; y++) {
+      pixel_type *JXL_RESTRICT p = channel.Row(y);
+      InitPropsRow(&properties, static_props, y);
+      if (y == 0) {
+        // The first row predicts "top" from the left pixels.
+        for (size_t x = 0; x < channel.w; x++) {
+          PredictionResult res =
+              PredictTreeNoWP(&properties, channel.w, p + x, onerow, x, y,
+                              tree_lookup, references);
+          uint64_t v = reader->ReadHybridUintClusteredMaybeInlined<uses_lz77>(
+              res.context, br);
+          p[x] = make_pixel(v, res.multiplier, res.guess);
+        }
+        continue;
+      }
+      LookupRowLeaves(channel, y, tree_lookup, &properties, leaves.data());
+      for (size_t x = 0; x < channel.w; x++) {
+        const RowLeaf &leaf = leaves[x];
+        pixel_type_w guess = leaf.guess;
+        if (leaf.predictor != Predictor::Zero) {
+          guess += PredictNoTreeNoWP(channel.w, p + x, onerow, x, y,
+                                     leaf.predictor)
+                       .guess;
+        }
+        uint64_t v = reader->ReadHybridUintClusteredMaybeInlined<uses_lz77>(
+            leaf.context, br);
+        p[x] = make_pixel(v, leaf.multiplier, guess);
+      }
+    }
   } else if (!tree_has_wp_prop_or_pred) {
     // special optimized case: the weighted predictor and its properties are not
     // used, so no need to compute weights and properties.
@@ -489,15 +689,15 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                  pixel_type chan, size_t group_id,
                                  TreeLut<uint8_t, false, false> &tree_lut,
                                  Image *image, uint32_t &fl_run,
-                                 uint32_t &fl_v) {
+                                 uint32_t &fl_v, bool *gradient_deferred) {
   if (reader->UsesLZ77()) {
     return detail::DecodeModularChannelMAANS</*uses_lz77=*/true>(
         br, reader, context_map, global_tree, wp_header, chan, group_id,
-        tree_lut, image, fl_run, fl_v);
+        tree_lut, image, fl_run, fl_v, gradient_deferred);
   } else {
     return detail::DecodeModularChannelMAANS</*uses_lz77=*/false>(
         br, reader, context_map, global_tree, wp_header, chan, group_id,
-        tree_lut, image, fl_run, fl_v);
+        tree_lut, image, fl_run, fl_v, gradient_deferred);
   }
 }
 
@@ -567,12 +767,16 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
   for (size_t i = 0; i < nb_channels; i++) {
     Channel &channel = image.channel[i];
     if (!channel.w || !channel.h) {
+      JXL_RETURN_IF_ERROR(channel.shrink());
       continue;  // skip empty channels
     }
     if (i >= image.nb_meta_channels && (channel.w > options->max_chan_size ||
                                         channel.h > options->max_chan_size)) {
       break;
     }
+    // Transforms may have left the channel unallocated; the ones that are not
+    // decoded here are allocated by the caller if it keeps them.
+    JXL_RETURN_IF_ERROR(channel.shrink());
     if (channel.w > distance_multiplier) {
       distance_multiplier = channel.w;
     }
@@ -629,6 +833,19 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
   auto tree_lut = jxl::make_unique<TreeLut<uint8_t, false, false>>();
   uint32_t fl_run = 0;
   uint32_t fl_v = 0;
+  // Channels whose prediction is undone after decoding all of them, only worth
+  // it if that can run in parallel.
+  std::vector<size_t> deferred_channels;
+  const auto undo_deferred_predictions = [&]() -> Status {
+    const auto undo_prediction = [&](const uint32_t task,
+                                     size_t /* thread */) -> Status {
+      detail::UndoGradientPrediction(image.channel[deferred_channels[task]]);
+      return true;
+    };
+    return RunOnPool(options->pool, 0, deferred_channels.size(),
+                     ThreadPool::NoInit, undo_prediction,
+                     "UndoGradientPrediction");
+  };
   for (; next_channel < nb_channels; next_channel++) {
     Channel &channel = image.channel[next_channel];
     if (!channel.w || !channel.h) {
@@ -639,16 +856,21 @@ Status ModularDecode(BitReader *br, Image &image, GroupHeader &header,
          channel.h > options->max_chan_size)) {
       break;
     }
+    bool gradient_deferred = false;
     JXL_RETURN_IF_ERROR(DecodeModularChannelMAANS(
         br, &reader, *context_map, *tree, header.wp_header, next_channel,
-        group_id, *tree_lut, &image, fl_run, fl_v));
+        group_id, *tree_lut, &image, fl_run, fl_v,
+        options->pool ? &gradient_deferred : nullptr));
+    if (gradient_deferred) deferred_channels.push_back(next_channel);
 
     // Truncated group.
     if (!br->AllReadsWithinBounds()) {
       if (!allow_truncated_group) return JXL_FAILURE("Truncated input");
+      JXL_RETURN_IF_ERROR(undo_deferred_predictions());
       return Status(StatusCode::kNotEnoughBytes);
     }
   }
+  JXL_RETURN_IF_ERROR(undo_deferred_predictions());
 
   // Make sure no zero-filling happens even if next_channel < nb_channels.
   scope_guard.Disarm();
@@ -43,7 +43,14 @@ class Channel {
                                   size_t ih, int hsh = 0, int vsh = 0) {
     JXL_ASSIGN_OR_RETURN(Plane<pixel_type> plane,
                          Plane<pixel_type>::Create(memory_manager, iw, ih));
-    return Channel(std::move(plane), iw, ih, hsh, vsh);
+    return Channel(memory_manager, std::move(plane), iw, ih, hsh, vsh);
+  }
+
+  // Creates a channel of the given size whose plane is only allocated by the
+  // first call to shrink().
+  static Channel CreateUnallocated(JxlMemoryManager* memory_manager, size_t iw,
+                                   size_t ih, int hsh = 0, int vsh = 0) {
+    return Channel(memory_manager, Plane<pixel_type>(), iw, ih, hsh, vsh);
   }
 
   // Move assignment
@@ -53,13 +60,14 @@ class Channel {
     hshift = other.hshift;
     vshift = other.vshift;
     plane = std::move(other.plane);
+    memory_manager_ = other.memory_manager_;
     return *this;
   }
 
   // Move constructor
   Channel(Channel&& other) noexcept = default;
 
-  JxlMemoryManager* memory_manager() const { return plane.memory_manager(); };
+  JxlMemoryManager* memory_manager() const { return memory_manager_; };
 
   Status shrink() {
     if (plane.xsize() == w && plane.ysize() == h) return true;
@@ -79,8 +87,17 @@ class Channel {
   }
 
  private:
-  Channel(jxl::Plane<pixel_type>&& p, size_t iw, size_t ih, int hsh, int vsh)
-      : plane(std::move(p)), w(iw), h(ih), hshift(hsh), vshift(vsh) {}
+  Channel(JxlMemoryManager* memory_manager, jxl::Plane<pixel_type>&& p,
+          size_t iw, size_t ih, int hsh, int vsh)
+      : plane(std::move(p)),
+        w(iw),
+        h(ih),
+        hshift(hsh),
+        vshift(vsh),
+        memory_manager_(memory_manager) {}
+
+  // Kept separately from the plane, which may not be allocated yet.
+  JxlMemoryManager* memory_manager_;
 };
 
 class Transform;
@@ -15,6 +15,8 @@
 
 namespace jxl {
 
+class ThreadPool;
+
 using PropertyVal = int32_t;
 using Properties = std::vector<PropertyVal>;
 
@@ -72,6 +74,11 @@ struct ModularOptions {
   // (if zero there is no MA context model)
   float nb_repeats = .5f;
 
+  // Approximate upper bound, in bytes, of the memory used to store the samples
+  // that MA trees are learned from, or 0 for no limit. When reached, fewer
+  // pixels are sampled.
+  size_t max_tree_learning_memory = 0;
+
   // Maximum number of (previous channel) properties to use in the MA trees
   int max_properties = 0;  // no previous channels
 
@@ -109,6 +116,10 @@ struct ModularOptions {
     kACMeta,
     kWPFixedDC,
     kGradientFixedDC,
+    // Fixed gradient trees per channel, each with the predictor that looks
+    // the cheapest on a subset of the rows of the channel. With the weighted
+    // predictor, the fixed WP tree is also considered.
+    kFixedChosenPredictor,
   };
   TreeKind tree_kind = TreeKind::kLearn;
 
@@ -116,6 +127,12 @@ struct ModularOptions {
 
   // Ignore the image and just pretend all tokens are zeroes
   bool zero_tokens = false;
+
+  /// Decode options:
+  // If not null, used for the parts of decoding that do not depend on the
+  // entropy coded stream, e.g. undoing the prediction of some channels. Must
+  // not be set when already running on the pool.
+  ThreadPool* pool = nullptr;
 };
 
 }  // namespace jxl
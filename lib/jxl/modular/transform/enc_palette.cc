@@ -7,11 +7,14 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <map>
 #include <set>
 
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
@@ -28,6 +31,9 @@ static constexpr bool kEncodeToHighQualityImplicitPalette = true;
 // Inclusive.
 static constexpr int kMinImplicitPaletteIndex = -(2 * 72 - 1);
 
+// Number of rows whose colors are collected by one task of a lossless palette.
+static constexpr size_t kColorCollectionRows = 32;
+
 float ColorDistance(const std::vector<float> &JXL_RESTRICT a,
                     const std::vector<pixel_type> &JXL_RESTRICT b) {
   JXL_DASSERT(a.size() == b.size());
@@ -165,7 +171,8 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
                            uint32_t &nb_colors, uint32_t &nb_deltas,
                            bool ordered, bool lossy, Predictor &predictor,
                            const weighted::Header &wp_header,
-                           PaletteIterationData &palette_iteration_data) {
+                           PaletteIterationData &palette_iteration_data,
+                           ThreadPool *pool) {
   JXL_QUIET_RETURN_IF_ERROR(CheckEqualChannels(input, begin_c, end_c));
   JXL_ENSURE(begin_c >= input.nb_meta_channels);
   JxlMemoryManager *memory_manager = input.memory_manager();
@@ -179,86 +186,102 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
   if (!lossy && nb == 1) {
     // Channel palette special case
     if (nb_colors == 0) return false;
-    std::vector<pixel_type> lookup;
+    const Channel &ch = input.channel[begin_c];
     pixel_type minval;
     pixel_type maxval;
-    compute_minmax(input.channel[begin_c], &minval, &maxval);
+    JXL_RETURN_IF_ERROR(compute_minmax(ch, &minval, &maxval, pool));
     size_t lookup_table_size =
         static_cast<int64_t>(maxval) - static_cast<int64_t>(minval) + 1;
+    // Each thread collects the values of the rows it is given; all of them
+    // stop as soon as one has seen more than nb_colors values.
+    std::atomic<bool> too_many_colors{false};
+    std::vector<pixel_type> values;
+    // Index of each value minus minval, if a lookup table is used.
+    std::vector<pixel_type> lookup;
     if (lookup_table_size > palette_internal::kMaxPaletteLookupTableSize) {
       // a lookup table would use too much memory, instead use a slower approach
       // with std::set
+      std::vector<std::set<pixel_type>> thread_values;
+      const auto init = [&](size_t num_threads) -> Status {
+        thread_values.resize(num_threads);
+        return true;
+      };
+      const auto collect = [&](const uint32_t y, size_t thread) -> Status {
+        if (too_many_colors) return true;
+        std::set<pixel_type> &chpalette = thread_values[thread];
+        const pixel_type *p = ch.Row(y);
+        for (size_t x = 0; x < w; x++) chpalette.insert(p[x]);
+        if (chpalette.size() > nb_colors) too_many_colors = true;
+        return true;
+      };
+      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, h, init, collect,
+                                    "FwdChannelPaletteCollect"));
+      if (too_many_colors) return false;
       std::set<pixel_type> chpalette;
-      pixel_type idx = 0;
-      for (size_t y = 0; y < h; y++) {
-        const pixel_type *p = input.channel[begin_c].Row(y);
-        for (size_t x = 0; x < w; x++) {
-          const bool new_color = chpalette.insert(p[x]).second;
-          if (new_color) {
-            idx++;
-            if (idx > static_cast<int>(nb_colors)) return false;
-          }
-        }
-      }
-      JXL_DEBUG_V(6, "Channel %i uses only %i colors.", begin_c, idx);
-      JXL_ASSIGN_OR_RETURN(Channel pch,
-                           Channel::Create(memory_manager, idx, 1));
-      pch.hshift = -1;
-      pch.vshift = -1;
-      nb_colors = idx;
-      idx = 0;
-      pixel_type *JXL_RESTRICT p_palette = pch.Row(0);
-      for (pixel_type p : chpalette) {
-        p_palette[idx++] = p;
+      for (const std::set<pixel_type> &tv : thread_values) {
+        chpalette.insert(tv.begin(), tv.end());
+        if (chpalette.size() > nb_colors) return false;
       }
-      for (size_t y = 0; y < h; y++) {
-        pixel_type *p = input.channel[begin_c].Row(y);
+      values.assign(chpalette.begin(), chpalette.end());
+    } else {
+      std::vector<std::vector<uint8_t>> thread_used;
+      std::vector<size_t> thread_count;
+      const auto init = [&](size_t num_threads) -> Status {
+        thread_used.resize(num_threads);
+        thread_count.resize(num_threads);
+        return true;
+      };
+      const auto collect = [&](const uint32_t y, size_t thread) -> Status {
+        if (too_many_colors) return true;
+        std::vector<uint8_t> &used = thread_used[thread];
+        if (used.empty()) used.resize(lookup_table_size);
+        size_t &count = thread_count[thread];
+        const pixel_type *p = ch.Row(y);
         for (size_t x = 0; x < w; x++) {
-          for (idx = 0;
-               p[x] != p_palette[idx] && idx < static_cast<int>(nb_colors);
-               idx++) {
-            // no-op
-          }
-          JXL_DASSERT(idx < static_cast<int>(nb_colors));
-          p[x] = idx;
+          uint8_t &u = used[p[x] - minval];
+          count += 1 - u;
+          u = 1;
         }
-      }
-      predictor = Predictor::Zero;
-      input.nb_meta_channels++;
-      input.channel.insert(input.channel.begin(), std::move(pch));
-
-      return true;
-    }
-    lookup.resize(lookup_table_size, 0);
-    pixel_type idx = 0;
-    for (size_t y = 0; y < h; y++) {
-      const pixel_type *p = input.channel[begin_c].Row(y);
-      for (size_t x = 0; x < w; x++) {
-        if (lookup[p[x] - minval] == 0) {
-          lookup[p[x] - minval] = 1;
-          idx++;
-          if (idx > static_cast<int>(nb_colors)) return false;
+        if (count > nb_colors) too_many_colors = true;
+        return true;
+      };
+      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, h, init, collect,
+                                    "FwdChannelPaletteCollect"));
+      if (too_many_colors) return false;
+      lookup.resize(lookup_table_size);
+      for (size_t i = 0; i < lookup_table_size; i++) {
+        for (const std::vector<uint8_t> &used : thread_used) {
+          if (used.empty() || !used[i]) continue;
+          lookup[i] = static_cast<pixel_type>(values.size());
+          values.push_back(i + minval);
+          if (values.size() > nb_colors) return false;
+          break;
         }
       }
     }
+    pixel_type idx = values.size();
     JXL_DEBUG_V(6, "Channel %i uses only %i colors.", begin_c, idx);
     JXL_ASSIGN_OR_RETURN(Channel pch, Channel::Create(memory_manager, idx, 1));
     pch.hshift = -1;
     pch.vshift = -1;
     nb_colors = idx;
-    idx = 0;
-    pixel_type *JXL_RESTRICT p_palette = pch.Row(0);
-    for (size_t i = 0; i < lookup_table_size; i++) {
-      if (lookup[i]) {
-        p_palette[idx] = i + minval;
-        lookup[i] = idx;
-        idx++;
-      }
-    }
-    for (size_t y = 0; y < h; y++) {
+    std::copy(values.begin(), values.end(), pch.Row(0));
+    const auto map_row = [&](const uint32_t y, size_t /*thread*/) -> Status {
       pixel_type *p = input.channel[begin_c].Row(y);
-      for (size_t x = 0; x < w; x++) p[x] = lookup[p[x] - minval];
-    }
+      if (!lookup.empty()) {
+        for (size_t x = 0; x < w; x++) p[x] = lookup[p[x] - minval];
+        return true;
+      }
+      // The values are sorted, so their index is found with a binary search.
+      for (size_t x = 0; x < w; x++) {
+        auto it = std::lower_bound(values.begin(), values.end(), p[x]);
+        JXL_DASSERT(it != values.end() && *it == p[x]);
+        p[x] = it - values.begin();
+      }
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, h, ThreadPool::NoInit, map_row,
+                                  "FwdChannelPalette"));
     predictor = Predictor::Zero;
     input.nb_meta_channels++;
     input.channel.insert(input.channel.begin(), std::move(pch));
@@ -340,27 +363,80 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
 
   std::map<std::vector<pixel_type>, size_t> color_freq_map;
   uint32_t implicit_colors_used = 0;
-  for (size_t y = 0; y < h; y++) {
-    for (uint32_t c = 0; c < nb; c++) {
-      p_in[c] = input.channel[begin_c + c].Row(y);
+  if (!lossy) {
+    // The colors of each band of rows are collected in parallel, in the order
+    // of their first occurrence, and then merged in band order, which gives
+    // the same image order as a serial scan. All bands stop as soon as one of
+    // them has more than nb_colors explicit colors.
+    struct BandColors {
+      std::vector<std::vector<pixel_type>> imageorder;
+      std::map<std::vector<pixel_type>, size_t> freq;
+    };
+    const size_t rows = palette_internal::kColorCollectionRows;
+    std::vector<BandColors> bands(DivCeil(h, rows));
+    std::atomic<bool> too_many_colors{false};
+    const auto collect = [&](const uint32_t band, size_t /*thread*/) -> Status {
+      BandColors &colors = bands[band];
+      std::vector<pixel_type> color(nb);
+      for (size_t y = band * rows; y < std::min(h, (band + 1) * rows); y++) {
+        if (too_many_colors) return true;
+        for (size_t x = 0; x < w; x++) {
+          for (uint32_t c = 0; c < nb; c++) {
+            color[c] = input.channel[begin_c + c].Row(y)[x];
+          }
+          auto it = colors.freq.emplace(color, 0).first;
+          if (it->second++ == 0 && implicit_color.count(color) == 0) {
+            colors.imageorder.push_back(color);
+            if (colors.imageorder.size() > nb_colors) {
+              too_many_colors = true;
+              return true;
+            }
+          }
+        }
+      }
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, bands.size(), ThreadPool::NoInit,
+                                  collect, "FwdPaletteCollect"));
+    if (too_many_colors) return false;
+    for (BandColors &band : bands) {
+      for (std::vector<pixel_type> &c : band.imageorder) {
+        if (color_freq_map.count(c)) continue;
+        candidate_palette_imageorder.push_back(std::move(c));
+        if (candidate_palette_imageorder.size() > nb_colors) {
+          return false;  // too many colors
+        }
+      }
+      for (const auto &color_freq : band.freq) {
+        color_freq_map[color_freq.first] += color_freq.second;
+      }
     }
-    for (size_t x = 0; x < w; x++) {
-      if (lossy && candidate_palette.size() >= nb_colors) break;
+    for (const auto &implicit : implicit_color) {
+      implicit_colors_used += color_freq_map.count(implicit.first);
+    }
+  } else {
+    for (size_t y = 0; y < h; y++) {
       for (uint32_t c = 0; c < nb; c++) {
-        color[c] = p_in[c][x];
+        p_in[c] = input.channel[begin_c + c].Row(y);
       }
-      const bool new_color = candidate_palette.insert(color).second;
-      if (new_color) {
-        if (implicit_color[color]) {
-          implicit_colors_used++;
-        } else {
-          candidate_palette_imageorder.push_back(color);
-          if (candidate_palette_imageorder.size() > nb_colors) {
-            return false;  // too many colors
+      for (size_t x = 0; x < w; x++) {
+        if (candidate_palette.size() >= nb_colors) break;
+        for (uint32_t c = 0; c < nb; c++) {
+          color[c] = p_in[c][x];
+        }
+        const bool new_color = candidate_palette.insert(color).second;
+        if (new_color) {
+          if (implicit_color[color]) {
+            implicit_colors_used++;
+          } else {
+            candidate_palette_imageorder.push_back(color);
+            if (candidate_palette_imageorder.size() > nb_colors) {
+              return false;  // too many colors
+            }
           }
         }
+        color_freq_map[color] += 1;
       }
-      color_freq_map[color] += 1;
     }
   }
 
@@ -634,7 +710,7 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
 Status FwdPalette(Image &input, uint32_t begin_c, uint32_t end_c,
                   uint32_t &nb_colors, uint32_t &nb_deltas, bool ordered,
                   bool lossy, Predictor &predictor,
-                  const weighted::Header &wp_header) {
+                  const weighted::Header &wp_header, ThreadPool *pool) {
   PaletteIterationData palette_iteration_data;
   uint32_t nb_colors_orig = nb_colors;
   uint32_t nb_deltas_orig = nb_deltas;
@@ -642,12 +718,12 @@ Status FwdPalette(Image &input, uint32_t begin_c, uint32_t end_c,
   if (lossy && input.bitdepth >= 8) {
     JXL_RETURN_IF_ERROR(FwdPaletteIteration(
         input, begin_c, end_c, nb_colors_orig, nb_deltas_orig, ordered, lossy,
-        predictor, wp_header, palette_iteration_data));
+        predictor, wp_header, palette_iteration_data, pool));
   }
   palette_iteration_data.final_run = true;
   return FwdPaletteIteration(input, begin_c, end_c, nb_colors, nb_deltas,
                              ordered, lossy, predictor, wp_header,
-                             palette_iteration_data);
+                             palette_iteration_data, pool);
 }
 
 }  // namespace jxl
@@ -6,6 +6,7 @@
 #ifndef LIB_JXL_MODULAR_TRANSFORM_ENC_PALETTE_H_
 #define LIB_JXL_MODULAR_TRANSFORM_ENC_PALETTE_H_
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/fields.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/modular_image.h"
@@ -15,7 +16,7 @@ namespace jxl {
 Status FwdPalette(Image &input, uint32_t begin_c, uint32_t end_c,
                   uint32_t &nb_colors, uint32_t &nb_deltas, bool ordered,
                   bool lossy, Predictor &predictor,
-                  const weighted::Header &wp_header);
+                  const weighted::Header &wp_header, ThreadPool *pool);
 
 }  // namespace jxl
 
@@ -7,7 +7,10 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <utility>
+#include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/modular/modular_image.h"
@@ -18,111 +21,88 @@ namespace jxl {
 
 #define AVERAGE(X, Y) (((X) + (Y) + (((X) > (Y)) ? 1 : 0)) >> 1)
 
-Status FwdHSqueeze(Image &input, int c, int rc) {
-  const Channel &chin = input.channel[c];
-  JxlMemoryManager *memory_manager = input.memory_manager();
-
-  JXL_DEBUG_V(4, "Doing horizontal squeeze of channel %i to new channel %i", c,
-              rc);
-
-  JXL_ASSIGN_OR_RETURN(Channel chout,
-                       Channel::Create(memory_manager, (chin.w + 1) / 2, chin.h,
-                                       chin.hshift + 1, chin.vshift));
-  JXL_ASSIGN_OR_RETURN(Channel chout_residual,
-                       Channel::Create(memory_manager, chin.w - chout.w,
-                                       chout.h, chin.hshift + 1, chin.vshift));
-
-  for (size_t y = 0; y < chout.h; y++) {
-    const pixel_type *JXL_RESTRICT p_in = chin.Row(y);
-    pixel_type *JXL_RESTRICT p_out = chout.Row(y);
-    pixel_type *JXL_RESTRICT p_res = chout_residual.Row(y);
-    for (size_t x = 0; x < chout_residual.w; x++) {
-      pixel_type A = p_in[x * 2];
-      pixel_type B = p_in[x * 2 + 1];
-      pixel_type avg = AVERAGE(A, B);
-      p_out[x] = avg;
-
-      pixel_type diff = A - B;
-
-      pixel_type next_avg = avg;
-      if (x + 1 < chout_residual.w) {
-        pixel_type C = p_in[x * 2 + 2];
-        pixel_type D = p_in[x * 2 + 3];
-        next_avg = AVERAGE(C, D);  // which will be chout.value(y,x+1)
-      } else if (chin.w & 1) {
-        next_avg = p_in[x * 2 + 2];
-      }
-      pixel_type left = (x > 0 ? p_in[x * 2 - 1] : avg);
-      pixel_type tendency = SmoothTendency(left, avg, next_avg);
-
-      p_res[x] = diff - tendency;
-    }
-    if (chin.w & 1) {
-      int x = chout.w - 1;
-      p_out[x] = p_in[x * 2];
+namespace {
+
+// Computes row `y` of the horizontal squeeze of `chin`.
+void FwdHSqueezeRow(const Channel &chin, size_t y, Channel *chout,
+                    Channel *chout_residual) {
+  const pixel_type *JXL_RESTRICT p_in = chin.Row(y);
+  pixel_type *JXL_RESTRICT p_out = chout->Row(y);
+  pixel_type *JXL_RESTRICT p_res = chout_residual->Row(y);
+  for (size_t x = 0; x < chout_residual->w; x++) {
+    pixel_type A = p_in[x * 2];
+    pixel_type B = p_in[x * 2 + 1];
+    pixel_type avg = AVERAGE(A, B);
+    p_out[x] = avg;
+
+    pixel_type diff = A - B;
+
+    pixel_type next_avg = avg;
+    if (x + 1 < chout_residual->w) {
+      pixel_type C = p_in[x * 2 + 2];
+      pixel_type D = p_in[x * 2 + 3];
+      next_avg = AVERAGE(C, D);  // which will be chout.value(y,x+1)
+    } else if (chin.w & 1) {
+      next_avg = p_in[x * 2 + 2];
     }
+    pixel_type left = (x > 0 ? p_in[x * 2 - 1] : avg);
+    pixel_type tendency = SmoothTendency(left, avg, next_avg);
+
+    p_res[x] = diff - tendency;
+  }
+  if (chin.w & 1) {
+    int x = chout->w - 1;
+    p_out[x] = p_in[x * 2];
   }
-  input.channel[c] = std::move(chout);
-  input.channel.insert(input.channel.begin() + rc, std::move(chout_residual));
-  return true;
 }
 
-Status FwdVSqueeze(Image &input, int c, int rc) {
-  const Channel &chin = input.channel[c];
-  JxlMemoryManager *memory_manager = input.memory_manager();
-
-  JXL_DEBUG_V(4, "Doing vertical squeeze of channel %i to new channel %i", c,
-              rc);
-
-  JXL_ASSIGN_OR_RETURN(Channel chout,
-                       Channel::Create(memory_manager, chin.w, (chin.h + 1) / 2,
-                                       chin.hshift, chin.vshift + 1));
-  JXL_ASSIGN_OR_RETURN(Channel chout_residual,
-                       Channel::Create(memory_manager, chin.w, chin.h - chout.h,
-                                       chin.hshift, chin.vshift + 1));
-  intptr_t onerow_in = chin.plane.PixelsPerRow();
-  for (size_t y = 0; y < chout_residual.h; y++) {
-    const pixel_type *JXL_RESTRICT p_in = chin.Row(y * 2);
-    pixel_type *JXL_RESTRICT p_out = chout.Row(y);
-    pixel_type *JXL_RESTRICT p_res = chout_residual.Row(y);
-    for (size_t x = 0; x < chout.w; x++) {
-      pixel_type A = p_in[x];
-      pixel_type B = p_in[x + onerow_in];
-      pixel_type avg = AVERAGE(A, B);
-      p_out[x] = avg;
-
-      pixel_type diff = A - B;
-
-      pixel_type next_avg = avg;
-      if (y + 1 < chout_residual.h) {
-        pixel_type C = p_in[x + 2 * onerow_in];
-        pixel_type D = p_in[x + 3 * onerow_in];
-        next_avg = AVERAGE(C, D);  // which will be chout.value(y+1,x)
-      } else if (chin.h & 1) {
-        next_avg = p_in[x + 2 * onerow_in];
-      }
-      pixel_type top =
-          (y > 0 ? p_in[static_cast<ssize_t>(x) - onerow_in] : avg);
-      pixel_type tendency = SmoothTendency(top, avg, next_avg);
-
-      p_res[x] = diff - tendency;
+// Computes row `y` of the vertical squeeze of `chin`, and row `y` of the
+// residual if there is one.
+void FwdVSqueezeRow(const Channel &chin, size_t y, Channel *chout,
+                    Channel *chout_residual) {
+  const pixel_type *JXL_RESTRICT p_in = chin.Row(y * 2);
+  pixel_type *JXL_RESTRICT p_out = chout->Row(y);
+  if (y >= chout_residual->h) {
+    // Last row of an odd number of rows.
+    for (size_t x = 0; x < chout->w; x++) {
+      p_out[x] = p_in[x];
     }
+    return;
   }
-  if (chin.h & 1) {
-    size_t y = chout.h - 1;
-    const pixel_type *p_in = chin.Row(y * 2);
-    pixel_type *p_out = chout.Row(y);
-    for (size_t x = 0; x < chout.w; x++) {
-      p_out[x] = p_in[x];
+  intptr_t onerow_in = chin.plane.PixelsPerRow();
+  pixel_type *JXL_RESTRICT p_res = chout_residual->Row(y);
+  for (size_t x = 0; x < chout->w; x++) {
+    pixel_type A = p_in[x];
+    pixel_type B = p_in[x + onerow_in];
+    pixel_type avg = AVERAGE(A, B);
+    p_out[x] = avg;
+
+    pixel_type diff = A - B;
+
+    pixel_type next_avg = avg;
+    if (y + 1 < chout_residual->h) {
+      pixel_type C = p_in[x + 2 * onerow_in];
+      pixel_type D = p_in[x + 3 * onerow_in];
+      next_avg = AVERAGE(C, D);  // which will be chout.value(y+1,x)
+    } else if (chin.h & 1) {
+      next_avg = p_in[x + 2 * onerow_in];
     }
+    pixel_type top =
+        (y > 0 ? p_in[static_cast<ssize_t>(x) - onerow_in] : avg);
+    pixel_type tendency = SmoothTendency(top, avg, next_avg);
+
+    p_res[x] = diff - tendency;
   }
-  input.channel[c] = std::move(chout);
-  input.channel.insert(input.channel.begin() + rc, std::move(chout_residual));
-  return true;
 }
 
+// Number of output rows of one squeeze task.
+constexpr size_t kSqueezeRowsPerTask = 64;
+
+}  // namespace
+
 Status FwdSqueeze(Image &input, std::vector<SqueezeParams> parameters,
                   ThreadPool *pool) {
+  JxlMemoryManager *memory_manager = input.memory_manager();
   if (parameters.empty()) {
     DefaultSqueezeParameters(&parameters, input);
   }
@@ -141,12 +121,54 @@ Status FwdSqueeze(Image &input, std::vector<SqueezeParams> parameters,
     } else {
       offset = input.channel.size();
     }
+    // The channels of one step are independent, so stripes of rows of all of
+    // them are squeezed in parallel.
+    std::vector<Channel> chout;
+    std::vector<Channel> chout_residual;
+    std::vector<std::pair<uint32_t, uint32_t>> stripes;
     for (uint32_t c = beginc; c <= endc; c++) {
-      if (horizontal) {
-        JXL_RETURN_IF_ERROR(FwdHSqueeze(input, c, offset + c - beginc));
-      } else {
-        JXL_RETURN_IF_ERROR(FwdVSqueeze(input, c, offset + c - beginc));
+      const Channel &chin = input.channel[c];
+      JXL_DEBUG_V(4, "Doing %s squeeze of channel %i to new channel %i",
+                  horizontal ? "horizontal" : "vertical", c,
+                  offset + c - beginc);
+      size_t w = horizontal ? (chin.w + 1) / 2 : chin.w;
+      size_t h = horizontal ? chin.h : (chin.h + 1) / 2;
+      size_t hshift = chin.hshift + (horizontal ? 1 : 0);
+      size_t vshift = chin.vshift + (horizontal ? 0 : 1);
+      JXL_ASSIGN_OR_RETURN(
+          Channel out, Channel::Create(memory_manager, w, h, hshift, vshift));
+      JXL_ASSIGN_OR_RETURN(
+          Channel residual,
+          Channel::Create(memory_manager, horizontal ? chin.w - w : w,
+                          horizontal ? h : chin.h - h, hshift, vshift));
+      for (size_t y = 0; y < h; y += kSqueezeRowsPerTask) {
+        stripes.emplace_back(c - beginc, y);
       }
+      chout.emplace_back(std::move(out));
+      chout_residual.emplace_back(std::move(residual));
+    }
+    const auto squeeze_stripe = [&](const uint32_t task,
+                                    size_t /*thread*/) -> Status {
+      const uint32_t i = stripes[task].first;
+      const size_t y0 = stripes[task].second;
+      const Channel &chin = input.channel[beginc + i];
+      const size_t y1 = std::min(y0 + kSqueezeRowsPerTask, chout[i].h);
+      for (size_t y = y0; y < y1; y++) {
+        if (horizontal) {
+          FwdHSqueezeRow(chin, y, &chout[i], &chout_residual[i]);
+        } else {
+          FwdVSqueezeRow(chin, y, &chout[i], &chout_residual[i]);
+        }
+      }
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(
+        pool, 0, static_cast<uint32_t>(stripes.size()), ThreadPool::NoInit,
+        squeeze_stripe, "FwdSqueeze"));
+    for (uint32_t c = beginc; c <= endc; c++) {
+      input.channel[c] = std::move(chout[c - beginc]);
+      input.channel.insert(input.channel.begin() + offset + c - beginc,
+                           std::move(chout_residual[c - beginc]));
     }
   }
   return true;
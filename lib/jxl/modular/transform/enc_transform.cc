@@ -5,6 +5,10 @@
 
 #include "lib/jxl/modular/transform/enc_transform.h"
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 #include "lib/jxl/modular/transform/enc_palette.h"
 #include "lib/jxl/modular/transform/enc_rct.h"
 #include "lib/jxl/modular/transform/enc_squeeze.h"
@@ -21,26 +25,41 @@ Status TransformForward(Transform &t, Image &input,
     case TransformId::kPalette:
       return FwdPalette(input, t.begin_c, t.begin_c + t.num_c - 1, t.nb_colors,
                         t.nb_deltas, t.ordered_palette, t.lossy_palette,
-                        t.predictor, wp_header);
+                        t.predictor, wp_header, pool);
     default:
       return JXL_FAILURE("Unknown transformation (ID=%u)",
                          static_cast<unsigned int>(t.id));
   }
 }
 
-void compute_minmax(const Channel &ch, pixel_type *min, pixel_type *max) {
-  pixel_type realmin = std::numeric_limits<pixel_type>::max();
-  pixel_type realmax = std::numeric_limits<pixel_type>::min();
-  for (size_t y = 0; y < ch.h; y++) {
+Status compute_minmax(const Channel &ch, pixel_type *min, pixel_type *max,
+                      ThreadPool *pool) {
+  // One entry even if `init` is not called because the channel is empty.
+  std::vector<pixel_type> thread_min(1, std::numeric_limits<pixel_type>::max());
+  std::vector<pixel_type> thread_max(1, std::numeric_limits<pixel_type>::min());
+  const auto init = [&](size_t num_threads) -> Status {
+    thread_min.assign(num_threads, std::numeric_limits<pixel_type>::max());
+    thread_max.assign(num_threads, std::numeric_limits<pixel_type>::min());
+    return true;
+  };
+  const auto process_row = [&](const uint32_t y, size_t thread) -> Status {
+    pixel_type realmin = thread_min[thread];
+    pixel_type realmax = thread_max[thread];
     const pixel_type *JXL_RESTRICT p = ch.Row(y);
     for (size_t x = 0; x < ch.w; x++) {
       if (p[x] < realmin) realmin = p[x];
       if (p[x] > realmax) realmax = p[x];
     }
-  }
+    thread_min[thread] = realmin;
+    thread_max[thread] = realmax;
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(
+      RunOnPool(pool, 0, ch.h, init, process_row, "compute_minmax"));
 
-  if (min) *min = realmin;
-  if (max) *max = realmax;
+  if (min) *min = *std::min_element(thread_min.begin(), thread_min.end());
+  if (max) *max = *std::max_element(thread_max.begin(), thread_max.end());
+  return true;
 }
 
 }  // namespace jxl
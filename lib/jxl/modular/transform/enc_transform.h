@@ -15,7 +15,10 @@ namespace jxl {
 Status TransformForward(Transform &t, Image &input,
                         const weighted::Header &wp_header, ThreadPool *pool);
 
-void compute_minmax(const Channel &ch, pixel_type *min, pixel_type *max);
+// Computes the range of the values of `ch`, splitting its rows among the
+// threads of `pool`.
+Status compute_minmax(const Channel &ch, pixel_type *min, pixel_type *max,
+                      ThreadPool *pool = nullptr);
 
 }  // namespace jxl
 
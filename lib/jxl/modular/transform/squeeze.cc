@@ -7,7 +7,9 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <vector>
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/data_parallel.h"
@@ -101,36 +103,14 @@ JXL_INLINE void FastUnsqueeze(const pixel_type *JXL_RESTRICT p_residual,
 
 #endif
 
-Status InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
-  JXL_ENSURE(c < input.channel.size());
-  JXL_ENSURE(rc < input.channel.size());
-  Channel &chin = input.channel[c];
-  const Channel &chin_residual = input.channel[rc];
-  // These must be valid since we ran MetaApply already.
-  JXL_ENSURE(chin.w == DivCeil(chin.w + chin_residual.w, 2));
-  JXL_ENSURE(chin.h == chin_residual.h);
-  JxlMemoryManager *memory_manager = input.memory_manager();
+// Horizontal unsqueeze has horizontal data dependencies, so each task does
+// 8 rows at a time.
+constexpr size_t kRowsPerTask = 8;
+// Vertical unsqueeze is done in strips of 64 columns.
+constexpr size_t kColsPerTask = 64;
 
-  if (chin_residual.w == 0) {
-    // Short-circuit: output channel has same dimensions as input.
-    input.channel[c].hshift--;
-    return true;
-  }
-
-  // Note: chin.w >= chin_residual.w and at most 1 different.
-  JXL_ASSIGN_OR_RETURN(Channel chout,
-                       Channel::Create(memory_manager, chin.w + chin_residual.w,
-                                       chin.h, chin.hshift - 1, chin.vshift));
-  JXL_DEBUG_V(4,
-              "Undoing horizontal squeeze of channel %i using residuals in "
-              "channel %i (going from width %" PRIuS " to %" PRIuS ")",
-              c, rc, chin.w, chout.w);
-
-  if (chin_residual.h == 0) {
-    // Short-circuit: channel with no pixels.
-    input.channel[c] = std::move(chout);
-    return true;
-  }
+void InvHSqueezeRows(const Channel &chin, const Channel &chin_residual,
+                     Channel &chout, size_t task) {
   auto unsqueeze_row = [&](size_t y, size_t x0) {
     const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y);
     const pixel_type *JXL_RESTRICT p_avg = chin.Row(y);
@@ -150,158 +130,200 @@ Status InvHSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
     if (chout.w & 1) p_out[chout.w - 1] = p_avg[chin.w - 1];
   };
 
-  // somewhat complicated trickery just to be able to SIMD this.
-  // Horizontal unsqueeze has horizontal data dependencies, so we do
-  // 8 rows at a time and treat it as a vertical unsqueeze of a
-  // transposed 8x8 block (or 9x8 for one input).
-  static constexpr const size_t kRowsPerThread = 8;
-  const auto unsqueeze_span = [&](const uint32_t task,
-                                  size_t /* thread */) -> Status {
-    const size_t y0 = task * kRowsPerThread;
-    const size_t rows = std::min(kRowsPerThread, chin.h - y0);
-    size_t x = 0;
+  const size_t y0 = task * kRowsPerTask;
+  const size_t rows = std::min(kRowsPerTask, chin.h - y0);
+  size_t x = 0;
 
+  // somewhat complicated trickery just to be able to SIMD this: we treat
+  // the rows as a vertical unsqueeze of a transposed 8x8 block (or 9x8 for
+  // one input).
 #if HWY_TARGET != HWY_SCALAR
-    intptr_t onerow_in = chin.plane.PixelsPerRow();
-    intptr_t onerow_inr = chin_residual.plane.PixelsPerRow();
-    intptr_t onerow_out = chout.plane.PixelsPerRow();
-    const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y0);
-    const pixel_type *JXL_RESTRICT p_avg = chin.Row(y0);
-    pixel_type *JXL_RESTRICT p_out = chout.Row(y0);
-    HWY_ALIGN pixel_type b_p_avg[9 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_residual[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_even[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_odd[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_evenT[8 * kRowsPerThread];
-    HWY_ALIGN pixel_type b_p_out_oddT[8 * kRowsPerThread];
-    const HWY_CAPPED(pixel_type, 8) d;
-    const size_t N = Lanes(d);
-    if (chin_residual.w > 16 && rows == kRowsPerThread) {
-      for (; x < chin_residual.w - 9; x += 8) {
-        Transpose8x8Block(p_residual + x, b_p_residual, onerow_inr);
-        Transpose8x8Block(p_avg + x, b_p_avg, onerow_in);
-        for (size_t y = 0; y < kRowsPerThread; y++) {
-          b_p_avg[8 * 8 + y] = p_avg[x + 8 + onerow_in * y];
-        }
-        for (size_t i = 0; i < 8; i++) {
-          FastUnsqueeze(
-              b_p_residual + 8 * i, b_p_avg + 8 * i, b_p_avg + 8 * (i + 1),
-              (x + i ? b_p_out_odd + 8 * ((x + i - 1) & 7) : b_p_avg + 8 * i),
-              b_p_out_even + 8 * i, b_p_out_odd + 8 * i);
-        }
+  intptr_t onerow_in = chin.plane.PixelsPerRow();
+  intptr_t onerow_inr = chin_residual.plane.PixelsPerRow();
+  intptr_t onerow_out = chout.plane.PixelsPerRow();
+  const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y0);
+  const pixel_type *JXL_RESTRICT p_avg = chin.Row(y0);
+  pixel_type *JXL_RESTRICT p_out = chout.Row(y0);
+  HWY_ALIGN pixel_type b_p_avg[9 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_residual[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_even[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_odd[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_evenT[8 * kRowsPerTask];
+  HWY_ALIGN pixel_type b_p_out_oddT[8 * kRowsPerTask];
+  const HWY_CAPPED(pixel_type, 8) d;
+  const size_t N = Lanes(d);
+  if (chin_residual.w > 16 && rows == kRowsPerTask) {
+    for (; x < chin_residual.w - 9; x += 8) {
+      Transpose8x8Block(p_residual + x, b_p_residual, onerow_inr);
+      Transpose8x8Block(p_avg + x, b_p_avg, onerow_in);
+      for (size_t y = 0; y < kRowsPerTask; y++) {
+        b_p_avg[8 * 8 + y] = p_avg[x + 8 + onerow_in * y];
+      }
+      for (size_t i = 0; i < 8; i++) {
+        FastUnsqueeze(
+            b_p_residual + 8 * i, b_p_avg + 8 * i, b_p_avg + 8 * (i + 1),
+            (x + i ? b_p_out_odd + 8 * ((x + i - 1) & 7) : b_p_avg + 8 * i),
+            b_p_out_even + 8 * i, b_p_out_odd + 8 * i);
+      }
 
-        Transpose8x8Block(b_p_out_even, b_p_out_evenT, 8);
-        Transpose8x8Block(b_p_out_odd, b_p_out_oddT, 8);
-        for (size_t y = 0; y < kRowsPerThread; y++) {
-          for (size_t i = 0; i < kRowsPerThread; i += N) {
-            auto even = Load(d, b_p_out_evenT + 8 * y + i);
-            auto odd = Load(d, b_p_out_oddT + 8 * y + i);
-            StoreInterleaved(d, even, odd,
-                             p_out + ((x + i) << 1) + onerow_out * y);
-          }
+      Transpose8x8Block(b_p_out_even, b_p_out_evenT, 8);
+      Transpose8x8Block(b_p_out_odd, b_p_out_oddT, 8);
+      for (size_t y = 0; y < kRowsPerTask; y++) {
+        for (size_t i = 0; i < kRowsPerTask; i += N) {
+          auto even = Load(d, b_p_out_evenT + 8 * y + i);
+          auto odd = Load(d, b_p_out_oddT + 8 * y + i);
+          StoreInterleaved(d, even, odd,
+                           p_out + ((x + i) << 1) + onerow_out * y);
         }
       }
     }
-#endif
-    for (size_t y = 0; y < rows; y++) {
-      unsqueeze_row(y0 + y, x);
-    }
-    return true;
-  };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, DivCeil(chin.h, kRowsPerThread),
-                                ThreadPool::NoInit, unsqueeze_span,
-                                "InvHorizontalSqueeze"));
-  input.channel[c] = std::move(chout);
-  return true;
-}
-
-Status InvVSqueeze(Image &input, uint32_t c, uint32_t rc, ThreadPool *pool) {
-  JXL_ENSURE(c < input.channel.size());
-  JXL_ENSURE(rc < input.channel.size());
-  const Channel &chin = input.channel[c];
-  const Channel &chin_residual = input.channel[rc];
-  // These must be valid since we ran MetaApply already.
-  JXL_ENSURE(chin.h == DivCeil(chin.h + chin_residual.h, 2));
-  JXL_ENSURE(chin.w == chin_residual.w);
-  JxlMemoryManager *memory_manager = input.memory_manager();
-
-  if (chin_residual.h == 0) {
-    // Short-circuit: output channel has same dimensions as input.
-    input.channel[c].vshift--;
-    return true;
   }
-
-  // Note: chin.h >= chin_residual.h and at most 1 different.
-  JXL_ASSIGN_OR_RETURN(
-      Channel chout,
-      Channel::Create(memory_manager, chin.w, chin.h + chin_residual.h,
-                      chin.hshift, chin.vshift - 1));
-  JXL_DEBUG_V(
-      4,
-      "Undoing vertical squeeze of channel %i using residuals in channel "
-      "%i (going from height %" PRIuS " to %" PRIuS ")",
-      c, rc, chin.h, chout.h);
-
-  if (chin_residual.w == 0) {
-    // Short-circuit: channel with no pixels.
-    input.channel[c] = std::move(chout);
-    return true;
+#endif
+  for (size_t y = 0; y < rows; y++) {
+    unsqueeze_row(y0 + y, x);
   }
+}
 
-  static constexpr const int kColsPerThread = 64;
-  const auto unsqueeze_slice = [&](const uint32_t task,
-                                   size_t /* thread */) -> Status {
-    const size_t x0 = task * kColsPerThread;
-    const size_t x1 =
-        std::min(static_cast<size_t>(task + 1) * kColsPerThread, chin.w);
-    const size_t w = x1 - x0;
-    // We only iterate up to std::min(chin_residual.h, chin.h) which is
-    // always chin_residual.h.
-    for (size_t y = 0; y < chin_residual.h; y++) {
-      const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y) + x0;
-      const pixel_type *JXL_RESTRICT p_avg = chin.Row(y) + x0;
-      const pixel_type *JXL_RESTRICT p_navg =
-          chin.Row(y + 1 < chin.h ? y + 1 : y) + x0;
-      pixel_type *JXL_RESTRICT p_out = chout.Row(y << 1) + x0;
-      pixel_type *JXL_RESTRICT p_nout = chout.Row((y << 1) + 1) + x0;
-      const pixel_type *p_pout = y > 0 ? chout.Row((y << 1) - 1) + x0 : p_avg;
-      size_t x = 0;
+void InvVSqueezeColumns(const Channel &chin, const Channel &chin_residual,
+                        Channel &chout, size_t task) {
+  const size_t x0 = task * kColsPerTask;
+  const size_t x1 = std::min((task + 1) * kColsPerTask, chin.w);
+  const size_t w = x1 - x0;
+  // We only iterate up to std::min(chin_residual.h, chin.h) which is
+  // always chin_residual.h.
+  for (size_t y = 0; y < chin_residual.h; y++) {
+    const pixel_type *JXL_RESTRICT p_residual = chin_residual.Row(y) + x0;
+    const pixel_type *JXL_RESTRICT p_avg = chin.Row(y) + x0;
+    const pixel_type *JXL_RESTRICT p_navg =
+        chin.Row(y + 1 < chin.h ? y + 1 : y) + x0;
+    pixel_type *JXL_RESTRICT p_out = chout.Row(y << 1) + x0;
+    pixel_type *JXL_RESTRICT p_nout = chout.Row((y << 1) + 1) + x0;
+    const pixel_type *p_pout = y > 0 ? chout.Row((y << 1) - 1) + x0 : p_avg;
+    size_t x = 0;
 #if HWY_TARGET != HWY_SCALAR
-      for (; x + 7 < w; x += 8) {
-        FastUnsqueeze(p_residual + x, p_avg + x, p_navg + x, p_pout + x,
-                      p_out + x, p_nout + x);
-      }
+    for (; x + 7 < w; x += 8) {
+      FastUnsqueeze(p_residual + x, p_avg + x, p_navg + x, p_pout + x,
+                    p_out + x, p_nout + x);
+    }
 #endif
-      for (; x < w; x++) {
-        pixel_type_w avg = p_avg[x];
-        pixel_type_w next_avg = p_navg[x];
-        pixel_type_w top = p_pout[x];
-        pixel_type_w tendency = SmoothTendency(top, avg, next_avg);
-        pixel_type_w diff_minus_tendency = p_residual[x];
-        pixel_type_w diff = diff_minus_tendency + tendency;
-        pixel_type_w out = avg + (diff / 2);
-        p_out[x] = out;
-        // If the chin_residual.h == chin.h, the output has an even number
-        // of rows so the next line is fine. Otherwise, this loop won't
-        // write to the last output row which is handled separately.
-        p_nout[x] = out - diff;
-      }
+    for (; x < w; x++) {
+      pixel_type_w avg = p_avg[x];
+      pixel_type_w next_avg = p_navg[x];
+      pixel_type_w top = p_pout[x];
+      pixel_type_w tendency = SmoothTendency(top, avg, next_avg);
+      pixel_type_w diff_minus_tendency = p_residual[x];
+      pixel_type_w diff = diff_minus_tendency + tendency;
+      pixel_type_w out = avg + (diff / 2);
+      p_out[x] = out;
+      // If the chin_residual.h == chin.h, the output has an even number
+      // of rows so the next line is fine. Otherwise, this loop won't
+      // write to the last output row which is handled separately.
+      p_nout[x] = out - diff;
     }
-    return true;
-  };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, DivCeil(chin.w, kColsPerThread),
-                                ThreadPool::NoInit, unsqueeze_slice,
-                                "InvVertSqueeze"));
-
-  if (chout.h & 1) {
-    size_t y = chin.h - 1;
+  }
+  // The last row of an odd-height output is the last average row.
+  if ((chout.h & 1) && x1 == chin.w) {
+    const size_t y = chin.h - 1;
     const pixel_type *p_avg = chin.Row(y);
     pixel_type *p_out = chout.Row(y << 1);
     for (size_t x = 0; x < chin.w; x++) {
       p_out[x] = p_avg[x];
     }
   }
-  input.channel[c] = std::move(chout);
+}
+
+// Undoes one step of the squeeze transform. The channels of the step are
+// independent, so the tasks of all of them run on the pool at once, which
+// keeps it busy also for the small channels of the first steps.
+Status InvSqueezeStep(Image &input, const SqueezeParams &params,
+                      uint32_t offset, ThreadPool *pool) {
+  JxlMemoryManager *memory_manager = input.memory_manager();
+  const bool horizontal = params.horizontal;
+  const uint32_t beginc = params.begin_c;
+  const uint32_t endc = params.begin_c + params.num_c - 1;
+
+  // The channels that need to be computed, and the first task of each.
+  std::vector<uint32_t> channels;
+  std::vector<Channel> outputs;
+  std::vector<size_t> first_task = {0};
+  for (uint32_t c = beginc; c <= endc; c++) {
+    uint32_t rc = offset + c - beginc;
+    // MetaApply should imply that `rc` is within range, otherwise there's a
+    // programming bug.
+    JXL_ENSURE(rc < input.channel.size());
+    Channel &chin = input.channel[c];
+    const Channel &chin_residual = input.channel[rc];
+    if ((chin.w < chin_residual.w) || (chin.h < chin_residual.h)) {
+      return JXL_FAILURE("Corrupted squeeze transform");
+    }
+    // These must be valid since we ran MetaApply already.
+    if (horizontal) {
+      JXL_ENSURE(chin.w == DivCeil(chin.w + chin_residual.w, 2));
+      JXL_ENSURE(chin.h == chin_residual.h);
+    } else {
+      JXL_ENSURE(chin.h == DivCeil(chin.h + chin_residual.h, 2));
+      JXL_ENSURE(chin.w == chin_residual.w);
+    }
+    const size_t residual_size = horizontal ? chin_residual.w : chin_residual.h;
+    if (residual_size == 0) {
+      // Short-circuit: output channel has same dimensions as input.
+      if (horizontal) {
+        chin.hshift--;
+      } else {
+        chin.vshift--;
+      }
+      continue;
+    }
+
+    // Note: the input is at least as large as the residual, and at most 1
+    // different.
+    JXL_ASSIGN_OR_RETURN(
+        Channel chout,
+        horizontal
+            ? Channel::Create(memory_manager, chin.w + chin_residual.w, chin.h,
+                              chin.hshift - 1, chin.vshift)
+            : Channel::Create(memory_manager, chin.w, chin.h + chin_residual.h,
+                              chin.hshift, chin.vshift - 1));
+    JXL_DEBUG_V(4,
+                "Undoing %s squeeze of channel %i using residuals in "
+                "channel %i (going from %" PRIuS "x%" PRIuS " to %" PRIuS
+                "x%" PRIuS ")",
+                horizontal ? "horizontal" : "vertical", c, rc, chin.w, chin.h,
+                chout.w, chout.h);
+
+    if (chin_residual.w == 0 || chin_residual.h == 0) {
+      // Short-circuit: channel with no pixels.
+      chin = std::move(chout);
+      continue;
+    }
+    channels.push_back(c);
+    outputs.push_back(std::move(chout));
+    first_task.push_back(first_task.back() +
+                         (horizontal ? DivCeil(chin.h, kRowsPerTask)
+                                     : DivCeil(chin.w, kColsPerTask)));
+  }
+
+  const auto unsqueeze = [&](const uint32_t task,
+                             size_t /* thread */) -> Status {
+    size_t i = std::upper_bound(first_task.begin(), first_task.end(), task) -
+               first_task.begin() - 1;
+    const Channel &chin = input.channel[channels[i]];
+    const Channel &chin_residual =
+        input.channel[offset + channels[i] - beginc];
+    if (horizontal) {
+      InvHSqueezeRows(chin, chin_residual, outputs[i], task - first_task[i]);
+    } else {
+      InvVSqueezeColumns(chin, chin_residual, outputs[i],
+                         task - first_task[i]);
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, static_cast<uint32_t>(first_task.back()), ThreadPool::NoInit,
+      unsqueeze, horizontal ? "InvHorizontalSqueeze" : "InvVertSqueeze"));
+  for (size_t i = 0; i < channels.size(); ++i) {
+    input.channel[channels[i]] = std::move(outputs[i]);
+  }
   return true;
 }
 
@@ -310,7 +332,6 @@ Status InvSqueeze(Image &input, const std::vector<SqueezeParams> &parameters,
   for (int i = parameters.size() - 1; i >= 0; i--) {
     JXL_RETURN_IF_ERROR(
         CheckMetaSqueezeParams(parameters[i], input.channel.size()));
-    bool horizontal = parameters[i].horizontal;
     bool in_place = parameters[i].in_place;
     uint32_t beginc = parameters[i].begin_c;
     uint32_t endc = parameters[i].begin_c + parameters[i].num_c - 1;
@@ -326,21 +347,7 @@ Status InvSqueeze(Image &input, const std::vector<SqueezeParams> &parameters,
       input.nb_meta_channels -= parameters[i].num_c;
     }
 
-    for (uint32_t c = beginc; c <= endc; c++) {
-      uint32_t rc = offset + c - beginc;
-      // MetaApply should imply that `rc` is within range, otherwise there's a
-      // programming bug.
-      JXL_ENSURE(rc < input.channel.size());
-      if ((input.channel[c].w < input.channel[rc].w) ||
-          (input.channel[c].h < input.channel[rc].h)) {
-        return JXL_FAILURE("Corrupted squeeze transform");
-      }
-      if (horizontal) {
-        JXL_RETURN_IF_ERROR(InvHSqueeze(input, c, rc, pool));
-      } else {
-        JXL_RETURN_IF_ERROR(InvVSqueeze(input, c, rc, pool));
-      }
-    }
+    JXL_RETURN_IF_ERROR(InvSqueezeStep(input, parameters[i], offset, pool));
     input.channel.erase(input.channel.begin() + offset,
                         input.channel.begin() + offset + (endc - beginc + 1));
   }
@@ -476,9 +483,14 @@ Status MetaSqueeze(Image &image, std::vector<SqueezeParams> *parameters) {
         if (image.channel[c].vshift >= 0) image.channel[c].vshift++;
         h = h - (h + 1) / 2;
       }
-      JXL_RETURN_IF_ERROR(image.channel[c].shrink());
-      JXL_ASSIGN_OR_RETURN(Channel placeholder,
-                           Channel::Create(memory_manager, w, h));
+      // The planes are only allocated by ModularDecode once all transforms
+      // have been applied, rather than once per squeeze step.
+      Channel &squeezed = image.channel[c];
+      if (squeezed.plane.xsize() != squeezed.w ||
+          squeezed.plane.ysize() != squeezed.h) {
+        squeezed.plane = ImageI();
+      }
+      Channel placeholder = Channel::CreateUnallocated(memory_manager, w, h);
       placeholder.hshift = image.channel[c].hshift;
       placeholder.vshift = image.channel[c].vshift;
 
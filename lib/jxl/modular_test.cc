@@ -120,6 +120,123 @@ TEST(ModularTest, RoundtripLosslessCustomWpPermuteRCT) {
   EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
 }
 
+TEST(ModularTest, RoundtripLosslessTreeLearningMemoryLimit) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(t.ppf().xsize() / 2, t.ppf().ysize() / 2));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0}};
+
+  extras::PackedPixelFile ppf_out;
+  size_t unlimited_size =
+      Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  // Far less than what the default sampling of this image needs.
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_MEMORY, 1);
+  size_t limited_size = Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
+  EXPECT_LE(limited_size, unlimited_size * 1.1);
+}
+
+TEST(ModularTest, RoundtripLosslessRctSampling) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(t.ppf().xsize() / 2, t.ppf().ysize() / 2));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 7);
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0}};
+
+  extras::PackedPixelFile ppf_out;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING, 1);
+  size_t full_size = Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING, 8);
+  size_t sampled_size = Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
+  EXPECT_LE(sampled_size, full_size * 1.02);
+}
+
+TEST(ModularTest, RoundtripLosslessTreeFromGroupSubset) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(t.ppf().xsize() / 2, t.ppf().ysize() / 2));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  // Enough 128x128 groups for the tree to be learned from a subset of them,
+  // and possibly used for groups it has seen no samples of.
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 5);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE, 0);
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0}};
+
+  extras::PackedPixelFile ppf_out;
+  Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
+}
+
+TEST(ModularTest, RoundtripLosslessGradientSingleGroupWithPool) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(t.ppf().xsize() / 4, t.ppf().ysize() / 4));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  // A single group, decoded in the global section, with a tree that is a single
+  // gradient leaf, so that the prediction of each channel is undone on the
+  // pool after entropy decoding all of them.
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE, 3);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR,
+                    static_cast<int64_t>(Predictor::Gradient));
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT, 0);
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0}};
+
+  test::ThreadPoolForTests pool(4);
+  extras::PackedPixelFile ppf_out;
+  Roundtrip(t.ppf(), cparams, dparams, pool.get(), &ppf_out);
+  EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
+}
+
+JXL_SLOW_TEST(ModularTest, RoundtripLosslessTreeLearningWithPool) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(t.ppf().xsize() / 8, t.ppf().ysize() / 8));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 9);
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0}};
+
+  // The learned tree, and thus the compressed size, must not depend on the
+  // number of threads.
+  extras::PackedPixelFile ppf_out;
+  size_t size = Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
+  for (int num_threads : {1, 3, 8}) {
+    test::ThreadPoolForTests pool(num_threads);
+    extras::PackedPixelFile ppf_pool;
+    EXPECT_EQ(size,
+              Roundtrip(t.ppf(), cparams, dparams, pool.get(), &ppf_pool));
+    EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_pool));
+  }
+}
+
 TEST(ModularTest, RoundtripLossyDeltaPalette) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   const std::vector<uint8_t> orig =
@@ -273,6 +390,47 @@ TEST(ModularTest, RoundtripExtraProperties) {
   }
 }
 
+TEST(ModularTest, RoundtripPreviousRowsProperties) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  constexpr size_t kSize = 250;
+  JXL_TEST_ASSIGN_OR_DIE(Image image,
+                         Image::Create(memory_manager, kSize, kSize,
+                                       /*bitdepth=*/8, 3));
+  ModularOptions options;
+  // Only properties that can be computed before decoding the current row.
+  options.splitting_heuristics_properties = {0, 1, 2, 3, 4, 6, 11, 12, 13};
+  options.predictor = Predictor::Variable;
+  options.wp_tree_mode = ModularOptions::TreeMode::kNoWP;
+  Rng rng(0);
+  for (size_t c = 0; c < image.channel.size(); c++) {
+    for (size_t y = 0; y < kSize; y++) {
+      pixel_type* row = image.channel[c].plane.Row(y);
+      for (size_t x = 0; x < kSize; x++) {
+        row[x] = static_cast<pixel_type>((x * (c + 1) + y) / 4 % 256) +
+                 rng.UniformI(-4, 5);
+      }
+    }
+  }
+  BitWriter writer{memory_manager};
+  ASSERT_TRUE(ModularGenericCompress(image, options, &writer));
+  writer.ZeroPadToByte();
+  JXL_TEST_ASSIGN_OR_DIE(Image decoded,
+                         Image::Create(memory_manager, kSize, kSize,
+                                       /*bitdepth=*/8, image.channel.size()));
+  Status status = true;
+  {
+    BitReader reader(writer.GetSpan());
+    BitReaderScopedCloser closer(reader, status);
+    ASSERT_TRUE(ModularGenericDecompress(&reader, decoded, /*header=*/nullptr,
+                                         /*group_id=*/0, &options));
+  }
+  ASSERT_TRUE(status);
+  for (size_t c = 0; c < image.channel.size(); c++) {
+    JXL_EXPECT_OK(
+        SamePixels(image.channel[c].plane, decoded.channel[c].plane, _));
+  }
+}
+
 struct RoundtripLosslessConfig {
   int bitdepth;
   int responsive;
@@ -417,6 +575,81 @@ TEST(ModularTest, RoundtripLosslessCustomFloat) {
   JXL_EXPECT_OK(SamePixels(*io.Main().color(), *io2.Main().color(), _));
 }
 
+TEST(ModularTest, RoundtripLosslessThunderFixedTrees) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  CodecInOut io{memory_manager};
+  size_t xsize = 300;
+  size_t ysize = 280;
+  ASSERT_TRUE(io.SetSize(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F testimage,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  // Channels that suit different predictors: smooth, vertical stripes and
+  // noise.
+  Rng generator(123);
+  for (size_t y = 0; y < ysize; y++) {
+    float* const JXL_RESTRICT row0 = testimage.PlaneRow(0, y);
+    float* const JXL_RESTRICT row1 = testimage.PlaneRow(1, y);
+    float* const JXL_RESTRICT row2 = testimage.PlaneRow(2, y);
+    for (size_t x = 0; x < xsize; x++) {
+      row0[x] = ((x + y) % 256) / 255.f;
+      row1[x] = ((x * 37) % 256) / 255.f;
+      row2[x] = generator.UniformU(0, 256) / 255.f;
+    }
+  }
+  ASSERT_TRUE(
+      io.SetFromImage(std::move(testimage), ColorEncoding::SRGB(false)));
+
+  CompressParams cparams;
+  cparams.modular_mode = true;
+  cparams.color_transform = jxl::ColorTransform::kNone;
+  cparams.butteraugli_distance = 0.f;
+  cparams.speed_tier = SpeedTier::kThunder;
+
+  CodecInOut io2{memory_manager};
+  size_t compressed_size;
+  JXL_EXPECT_OK(Roundtrip(&io, cparams, {}, &io2, _, &compressed_size));
+  // The noise channel alone takes about 8 bits per pixel.
+  EXPECT_LE(compressed_size, xsize * ysize * 13 / 10);
+  JXL_EXPECT_OK(SamePixels(*io.Main().color(), *io2.Main().color(), _));
+}
+
+TEST(ModularTest, RoundtripLosslessFalconGray16FixedTrees) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  CodecInOut io{memory_manager};
+  size_t xsize = 300;
+  size_t ysize = 280;
+  ASSERT_TRUE(io.SetSize(xsize, ysize));
+  io.metadata.m.SetUintSamples(16);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F testimage,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  // Smooth content with noise in the low bits, like a medical scan.
+  Rng generator(123);
+  for (size_t y = 0; y < ysize; y++) {
+    float* const JXL_RESTRICT row = testimage.PlaneRow(0, y);
+    for (size_t x = 0; x < xsize; x++) {
+      uint32_t value = (x * x + 3 * y * y + 50 * x) % 60000 +
+                       generator.UniformU(0, 64);
+      row[x] = value / 65535.f;
+    }
+  }
+  ASSERT_TRUE(CopyImageTo(testimage.Plane(0), &testimage.Plane(1)));
+  ASSERT_TRUE(CopyImageTo(testimage.Plane(0), &testimage.Plane(2)));
+  ASSERT_TRUE(io.SetFromImage(std::move(testimage),
+                              ColorEncoding::SRGB(/*is_gray=*/true)));
+
+  CompressParams cparams;
+  cparams.modular_mode = true;
+  cparams.butteraugli_distance = 0.f;
+  cparams.speed_tier = SpeedTier::kFalcon;
+
+  CodecInOut io2{memory_manager};
+  size_t compressed_size;
+  JXL_EXPECT_OK(Roundtrip(&io, cparams, {}, &io2, _, &compressed_size));
+  // The noise alone takes 6 bits per pixel.
+  EXPECT_LE(compressed_size, xsize * ysize);
+  JXL_EXPECT_OK(SamePixels(*io.Main().color(), *io2.Main().color(), _));
+}
+
 void WriteHeaders(BitWriter* writer, size_t xsize, size_t ysize) {
   ASSERT_TRUE(writer->WithMaxBits(16, LayerType::Header, nullptr, [&] {
     writer->Write(8, 0xFF);
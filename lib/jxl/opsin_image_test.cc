@@ -7,17 +7,21 @@
 #include <jxl/memory_manager.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <utility>
+#include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/matrix_ops.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/cms/opsin_params.h"
 #include "lib/jxl/dec_xyb.h"
+#include "lib/jxl/enc_external_image.h"
 #include "lib/jxl/enc_xyb.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
+#include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/opsin_params.h"
 #include "lib/jxl/test_memory_manager.h"
 #include "lib/jxl/test_utils.h"
@@ -137,5 +141,39 @@ TEST(OpsinImageTest, VerifyGray) {
   }
 }
 
+TEST(OpsinImageTest, SRGB8ToXYBMatchesSeparatePasses) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 67;
+  const size_t ysize = 13;
+  const size_t stride = xsize * 4 + 5;
+  std::vector<uint8_t> pixels(stride * ysize);
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    pixels[i] = static_cast<uint8_t>(i * 7 + i / 5);
+  }
+  const JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+
+  JXL_TEST_ASSIGN_OR_DIE(Image3F expected,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  for (size_t c = 0; c < 3; ++c) {
+    ASSERT_TRUE(ConvertFromExternalNoSizeCheck(
+        pixels.data(), xsize, ysize, stride, /*bits_per_sample=*/8, format, c,
+        /*pool=*/nullptr, &expected.Plane(c)));
+  }
+  JXL_TEST_ASSIGN_OR_DIE(Image3F expected_linear,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(ToXYB(ColorEncoding::SRGB(), 255.0f, /*black=*/nullptr,
+                    /*pool=*/nullptr, &expected, *JxlGetDefaultCms(),
+                    &expected_linear));
+
+  JXL_TEST_ASSIGN_OR_DIE(Image3F xyb,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F linear,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(SRGB8ToXYB(pixels.data(), stride, /*num_channels=*/4, 255.0f,
+                         /*pool=*/nullptr, &xyb, &linear));
+  JXL_TEST_ASSERT_OK(SamePixels(expected, xyb, _));
+  JXL_TEST_ASSERT_OK(SamePixels(expected_linear, linear, _));
+}
+
 }  // namespace
 }  // namespace jxl
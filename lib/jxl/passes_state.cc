@@ -7,6 +7,8 @@
 
 #include <jxl/memory_manager.h>
 
+#include <cstddef>
+
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/coeff_order.h"
@@ -25,16 +27,17 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
   const FrameDimensions& frame_dim = shared->frame_dim;
   JxlMemoryManager* memory_manager = shared->memory_manager;
 
-  JXL_ASSIGN_OR_RETURN(
-      shared->ac_strategy,
-      AcStrategyImage::Create(memory_manager, frame_dim.xsize_blocks,
-                              frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared->raw_quant_field,
-                       ImageI::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared->epf_sharpness,
-                       ImageB::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
+  // The per-block images are fully rewritten for each frame, so that their
+  // storage can be reused across frames (and images) of the same size.
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared->ac_strategy));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared->raw_quant_field));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared->epf_sharpness));
   JXL_ASSIGN_OR_RETURN(
       shared->cmap, ColorCorrelationMap::Create(memory_manager, frame_dim.xsize,
                                                 frame_dim.ysize));
@@ -50,9 +53,9 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
                                 kCoeffOrderMaxSize);
   }
 
-  JXL_ASSIGN_OR_RETURN(shared->quant_dc,
-                       ImageB::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                    frame_dim.ysize_blocks,
+                                    &shared->quant_dc));
 
   bool use_dc_frame = ((frame_header.flags & FrameHeader::kUseDcFrame) != 0u);
   if (!encoder && use_dc_frame) {
@@ -70,9 +73,9 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
     }
     ZeroFillImage(&shared->quant_dc);
   } else {
-    JXL_ASSIGN_OR_RETURN(shared->dc_storage,
-                         Image3F::Create(memory_manager, frame_dim.xsize_blocks,
-                                         frame_dim.ysize_blocks));
+    JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, frame_dim.xsize_blocks,
+                                      frame_dim.ysize_blocks,
+                                      &shared->dc_storage));
     shared->dc = &shared->dc_storage;
   }
 
@@ -96,6 +96,16 @@ struct PassesSharedState {
   size_t num_histograms = 0;
 };
 
+// Keeps the storage of `image` if it already has the requested dimensions,
+// otherwise allocates a new one. The contents are unspecified in either case.
+template <typename T>
+Status ReuseOrCreate(JxlMemoryManager* memory_manager, size_t xsize,
+                     size_t ysize, T* image) {
+  if (image->xsize() == xsize && image->ysize() == ysize) return true;
+  JXL_ASSIGN_OR_RETURN(*image, T::Create(memory_manager, xsize, ysize));
+  return true;
+}
+
 // Initialized the state information that is shared between encoder and decoder.
 Status InitializePassesSharedState(const FrameHeader& frame_header,
                                    PassesSharedState* JXL_RESTRICT shared,
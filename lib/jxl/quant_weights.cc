@@ -6,9 +6,11 @@
 
 #include <jxl/memory_manager.h>
 
+#include <atomic>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
@@ -1200,37 +1202,104 @@ DequantMatrices::DequantMatrices() {
   }
 }
 
-Status DequantMatrices::EnsureComputed(JxlMemoryManager* memory_manager,
-                                       uint32_t acs_mask) {
-  const QuantEncoding* library = Library();
-
-  if (!table_storage_) {
-    size_t table_storage_bytes = 2 * kTotalTableSize * sizeof(float);
-    JXL_ASSIGN_OR_RETURN(
-        table_storage_,
-        AlignedMemory::Create(memory_manager, table_storage_bytes));
-    table_ = table_storage_.address<float>();
-    inv_table_ = table_ + kTotalTableSize;
-  }
+namespace {
 
-  size_t offsets[kNumQuantTables * 3 + 1];
+// Stores the offsets of the tables of each quant table kind and channel in
+// `offsets`, followed by the total size of the tables.
+void ComputeTableOffsets(size_t offsets[kNumQuantTables * 3 + 1]) {
   size_t pos = 0;
   for (size_t i = 0; i < kNumQuantTables; i++) {
-    size_t num = required_size_x[i] * required_size_y[i] * kDCTBlockSize;
+    size_t num = DequantMatrices::required_size_x[i] *
+                 DequantMatrices::required_size_y[i] * kDCTBlockSize;
     for (size_t c = 0; c < 3; c++) {
       offsets[3 * i + c] = pos + c * num;
     }
     pos += 3 * num;
   }
   offsets[kNumQuantTables * 3] = pos;
-  JXL_ENSURE(pos == kTotalTableSize);
+}
 
+struct LibraryTableStorage {
+  // Default allocator: the tables outlive the decoders that requested them.
+  JxlMemoryManager memory_manager;
+  AlignedMemory storage;
+  std::mutex mutex;  // guards computing the tables.
+  std::atomic<uint32_t> computed_kind_mask{0};
+};
+
+}  // namespace
+
+StatusOr<const float*> DequantMatrices::LibraryTables(uint32_t kind_mask) {
+  static LibraryTableStorage shared;
+  uint32_t computed_kind_mask =
+      shared.computed_kind_mask.load(std::memory_order_acquire);
+  if (computed_kind_mask != 0 && (kind_mask & ~computed_kind_mask) == 0) {
+    return shared.storage.address<const float>();
+  }
+
+  std::lock_guard<std::mutex> lock(shared.mutex);
+  if (!shared.storage) {
+    JXL_RETURN_IF_ERROR(MemoryManagerInit(&shared.memory_manager, nullptr));
+    JXL_ASSIGN_OR_RETURN(
+        shared.storage,
+        AlignedMemory::Create(&shared.memory_manager,
+                              2 * kTotalTableSize * sizeof(float)));
+  }
+  size_t offsets[kNumQuantTables * 3 + 1];
+  ComputeTableOffsets(offsets);
+  JXL_ENSURE(offsets[kNumQuantTables * 3] == kTotalTableSize);
+  const QuantEncoding* library = Library();
+  float* table = shared.storage.address<float>();
+  computed_kind_mask = shared.computed_kind_mask.load(std::memory_order_relaxed);
+  for (size_t kind = 0; kind < kNumQuantTables; kind++) {
+    if ((1u << kind) & computed_kind_mask) continue;
+    if ((1u << kind) & ~kind_mask) continue;
+    size_t pos = offsets[kind * 3];
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
+        library[kind], table, table + kTotalTableSize, kind, QuantTable(kind),
+        &pos));
+    JXL_ENSURE(pos == offsets[kind * 3 + 3]);
+  }
+  shared.computed_kind_mask.store(computed_kind_mask | kind_mask,
+                                  std::memory_order_release);
+  return shared.storage.address<const float>();
+}
+
+Status DequantMatrices::EnsureComputed(JxlMemoryManager* memory_manager,
+                                       uint32_t acs_mask) {
   uint32_t kind_mask = 0;
   for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
     if (acs_mask & (1u << i)) {
       kind_mask |= 1u << static_cast<uint32_t>(kAcStrategyToQuantTableMap[i]);
     }
   }
+
+  bool all_library = true;
+  for (const QuantEncoding& encoding : encodings_) {
+    all_library &= (encoding.mode == QuantEncoding::kQuantModeLibrary);
+  }
+  if (all_library) {
+    const float* library_tables;
+    JXL_ASSIGN_OR_RETURN(library_tables, LibraryTables(kind_mask));
+    table_ = library_tables;
+    inv_table_ = table_ + kTotalTableSize;
+    computed_mask_ |= acs_mask;
+    return true;
+  }
+
+  if (!table_storage_) {
+    size_t table_storage_bytes = 2 * kTotalTableSize * sizeof(float);
+    JXL_ASSIGN_OR_RETURN(
+        table_storage_,
+        AlignedMemory::Create(memory_manager, table_storage_bytes));
+  }
+  table_ = table_storage_.address<float>();
+  inv_table_ = table_ + kTotalTableSize;
+
+  size_t offsets[kNumQuantTables * 3 + 1];
+  ComputeTableOffsets(offsets);
+  JXL_ENSURE(offsets[kNumQuantTables * 3] == kTotalTableSize);
+
   uint32_t computed_kind_mask = 0;
   for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
     if (computed_mask_ & (1u << i)) {
@@ -1243,15 +1312,10 @@ Status DequantMatrices::EnsureComputed(JxlMemoryManager* memory_manager,
     if ((1 << table) & ~kind_mask) continue;
     size_t pos = offsets[table * 3];
     float* mutable_table = table_storage_.address<float>();
-    if (encodings_[table].mode == QuantEncoding::kQuantModeLibrary) {
-      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
-          library[table], mutable_table, mutable_table + kTotalTableSize, table,
-          QuantTable(table), &pos));
-    } else {
-      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
-          encodings_[table], mutable_table, mutable_table + kTotalTableSize,
-          table, QuantTable(table), &pos));
-    }
+    JXL_ENSURE(encodings_[table].mode != QuantEncoding::kQuantModeLibrary);
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
+        encodings_[table], mutable_table, mutable_table + kTotalTableSize,
+        table, QuantTable(table), &pos));
     JXL_ENSURE(pos == offsets[table * 3 + 3]);
   }
   computed_mask_ |= acs_mask;
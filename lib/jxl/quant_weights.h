@@ -423,6 +423,12 @@ class DequantMatrices {
  private:
   static constexpr size_t kTotalTableSize = kSumRequiredXy * kDCTBlockSize * 3;
 
+  // Returns kTotalTableSize entries followed by kTotalTableSize for inv_table,
+  // with the tables of the library encodings. These do not depend on the
+  // frame, so they are computed at most once per process, for the kinds of
+  // `kind_mask` that were not computed yet, and shared by all instances.
+  static StatusOr<const float*> LibraryTables(uint32_t kind_mask);
+
   uint32_t computed_mask_ = 0;
   // kTotalTableSize entries followed by kTotalTableSize for inv_table
   AlignedMemory table_storage_;
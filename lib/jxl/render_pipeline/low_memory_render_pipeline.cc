@@ -8,17 +8,56 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <utility>
 #include <vector>
 
 #include "lib/jxl/base/arch_macros.h"
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/float.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_ops.h"
 
 namespace jxl {
+
+namespace {
+
+#if JXL_HALF_PRECISION_BORDERS
+void ConvertBorderRow(const float* in, size_t xsize, uint16_t* out) {
+  for (size_t x = 0; x < xsize; ++x) out[x] = detail::StoreFloat16(in[x]);
+}
+
+void ConvertBorderRow(const uint16_t* in, size_t xsize, float* out) {
+  for (size_t x = 0; x < xsize; ++x) out[x] = detail::LoadFloat16(in[x]);
+}
+
+// Same as CopyImageTo, between the pipeline buffers and a float16 border
+// storage.
+template <typename From, typename To>
+Status CopyBorder(const Rect& rect_from, const Plane<From>& from,
+                  const Rect& rect_to, Plane<To>* to) {
+  JXL_ENSURE(SameSize(rect_from, rect_to));
+  JXL_ENSURE(rect_from.IsInside(from));
+  JXL_ENSURE(rect_to.IsInside(*to));
+  for (size_t y = 0; y < rect_from.ysize(); ++y) {
+    ConvertBorderRow(rect_from.ConstRow(from, y), rect_from.xsize(),
+                     rect_to.Row(to, y));
+  }
+  return true;
+}
+#else
+Status CopyBorder(const Rect& rect_from, const ImageF& from,
+                  const Rect& rect_to, ImageF* to) {
+  return CopyImageTo(rect_from, from, rect_to, to);
+}
+#endif
+
+}  // namespace
+
 std::pair<size_t, size_t>
 LowMemoryRenderPipeline::ColorDimensionsToChannelDimensions(
     std::pair<size_t, size_t> in, size_t c, size_t stage) const {
@@ -60,26 +99,26 @@ Status LowMemoryRenderPipeline::SaveBorders(size_t group_id, size_t c,
     Rect from(group_data_x_border_, group_data_y_border_, x1 - x0,
               bordery_write);
     Rect to(x0, (gy * 2 - 1) * bordery_write, x1 - x0, bordery_write);
-    JXL_RETURN_IF_ERROR(CopyImageTo(from, in, to, &borders_horizontal_[c]));
+    JXL_RETURN_IF_ERROR(CopyBorder(from, in, to, &borders_horizontal_[c]));
   }
   if (gy + 1 < frame_dimensions_.ysize_groups) {
     Rect from(group_data_x_border_,
               group_data_y_border_ + y1 - y0 - bordery_write, x1 - x0,
               bordery_write);
     Rect to(x0, (gy * 2) * bordery_write, x1 - x0, bordery_write);
-    JXL_RETURN_IF_ERROR(CopyImageTo(from, in, to, &borders_horizontal_[c]));
+    JXL_RETURN_IF_ERROR(CopyBorder(from, in, to, &borders_horizontal_[c]));
   }
   if (gx > 0) {
     Rect from(group_data_x_border_, group_data_y_border_, borderx_write,
               y1 - y0);
     Rect to((gx * 2 - 1) * borderx_write, y0, borderx_write, y1 - y0);
-    JXL_RETURN_IF_ERROR(CopyImageTo(from, in, to, &borders_vertical_[c]));
+    JXL_RETURN_IF_ERROR(CopyBorder(from, in, to, &borders_vertical_[c]));
   }
   if (gx + 1 < frame_dimensions_.xsize_groups) {
     Rect from(group_data_x_border_ + x1 - x0 - borderx_write,
               group_data_y_border_, borderx_write, y1 - y0);
     Rect to((gx * 2) * borderx_write, y0, borderx_write, y1 - y0);
-    JXL_RETURN_IF_ERROR(CopyImageTo(from, in, to, &borders_vertical_[c]));
+    JXL_RETURN_IF_ERROR(CopyBorder(from, in, to, &borders_vertical_[c]));
   }
   return true;
 }
@@ -132,7 +171,7 @@ Status LowMemoryRenderPipeline::LoadBorders(size_t group_id, size_t c,
   // Copy other groups' borders from the border storage.
   if (y0src < y0) {
     JXL_ENSURE(gy > 0);
-    JXL_RETURN_IF_ERROR(CopyImageTo(
+    JXL_RETURN_IF_ERROR(CopyBorder(
         Rect(x0src, (gy * 2 - 2) * bordery_write, x1src - x0src, bordery_write),
         borders_horizontal_[c],
         Rect(group_data_x_border_ + x0src - x0,
@@ -143,7 +182,7 @@ Status LowMemoryRenderPipeline::LoadBorders(size_t group_id, size_t c,
   if (y1src > y1) {
     // When copying the bottom border we must not be on the bottom groups.
     JXL_ENSURE(gy + 1 < frame_dimensions_.ysize_groups);
-    JXL_RETURN_IF_ERROR(CopyImageTo(
+    JXL_RETURN_IF_ERROR(CopyBorder(
         Rect(x0src, (gy * 2 + 1) * bordery_write, x1src - x0src, bordery_write),
         borders_horizontal_[c],
         Rect(group_data_x_border_ + x0src - x0, group_data_y_border_ + y1 - y0,
@@ -152,7 +191,7 @@ Status LowMemoryRenderPipeline::LoadBorders(size_t group_id, size_t c,
   }
   if (x0src < x0) {
     JXL_ENSURE(gx > 0);
-    JXL_RETURN_IF_ERROR(CopyImageTo(
+    JXL_RETURN_IF_ERROR(CopyBorder(
         Rect((gx * 2 - 2) * borderx_write, y0src, borderx_write, y1src - y0src),
         borders_vertical_[c],
         Rect(group_data_x_border_ - borderx_write,
@@ -162,7 +201,7 @@ Status LowMemoryRenderPipeline::LoadBorders(size_t group_id, size_t c,
   if (x1src > x1) {
     // When copying the right border we must not be on the rightmost groups.
     JXL_ENSURE(gx + 1 < frame_dimensions_.xsize_groups);
-    JXL_RETURN_IF_ERROR(CopyImageTo(
+    JXL_RETURN_IF_ERROR(CopyBorder(
         Rect((gx * 2 + 1) * borderx_write, y0src, borderx_write, y1src - y0src),
         borders_vertical_[c],
         Rect(group_data_x_border_ + x1 - x0, group_data_y_border_ + y0src - y0,
@@ -202,15 +241,17 @@ Status LowMemoryRenderPipeline::EnsureBordersStorage() {
                                        1 << shifts[c].second);
     Rect horizontal = Rect(0, 0, downsampled_xsize, bordery * num_yborders);
     if (!SameSize(horizontal, borders_horizontal_[c])) {
-      JXL_ASSIGN_OR_RETURN(borders_horizontal_[c],
-                           ImageF::Create(memory_manager_, horizontal.xsize(),
-                                          horizontal.ysize()));
+      JXL_ASSIGN_OR_RETURN(
+          borders_horizontal_[c],
+          BorderImage::Create(memory_manager_, horizontal.xsize(),
+                              horizontal.ysize()));
     }
     Rect vertical = Rect(0, 0, borderx * num_xborders, downsampled_ysize);
     if (!SameSize(vertical, borders_vertical_[c])) {
-      JXL_ASSIGN_OR_RETURN(
-          borders_vertical_[c],
-          ImageF::Create(memory_manager_, vertical.xsize(), vertical.ysize()));
+      JXL_ASSIGN_OR_RETURN(borders_vertical_[c],
+                           BorderImage::Create(memory_manager_,
+                                               vertical.xsize(),
+                                               vertical.ysize()));
     }
   }
   return true;
@@ -270,6 +311,8 @@ Status LowMemoryRenderPipeline::Init() {
 
   JXL_RETURN_IF_ERROR(EnsureBordersStorage());
   group_border_assigner_.Init(frame_dimensions_);
+  deferred_rects_.clear();
+  deferred_rects_.resize(frame_dimensions_.num_groups);
 
   for (first_trailing_stage_ = stages_.size(); first_trailing_stage_ > 0;
        first_trailing_stage_--) {
@@ -389,6 +432,20 @@ Status LowMemoryRenderPipeline::PrepareForThreadsInternal(size_t num,
                          kRenderPipelineXOffset));
     }
   }
+  if (defer_rendering_) {
+    for (size_t t = stripe_data_.size(); t < num; t++) {
+      stripe_data_.emplace_back();
+      stripe_data_[t].resize(shifts.size());
+      for (size_t c = 0; c < shifts.size(); c++) {
+        JXL_ASSIGN_OR_RETURN(
+            stripe_data_[t][c],
+            ImageF::Create(memory_manager_,
+                           GroupInputXSize(c) + group_data_x_border_ * 2,
+                           GroupInputYSize(c) + group_data_y_border_ * 2,
+                           kRenderPipelineXOffset));
+      }
+    }
+  }
   // TODO(veluca): avoid reallocating buffers if not needed.
   stage_data_.resize(num);
   size_t upsampling = 1u << base_color_shift_;
@@ -732,8 +789,8 @@ Status LowMemoryRenderPipeline::RenderRect(size_t thread_id,
       prepare_io_rows(y, i);
 
       // Produce output rows.
-      JXL_RETURN_IF_ERROR(stages_[i]->ProcessRow(
-          input_rows[i], output_rows, xpadding_for_output_[i],
+      JXL_RETURN_IF_ERROR(ProcessStageRow(
+          i, input_rows[i], output_rows, xpadding_for_output_[i],
           group_rect[i].xsize(), group_rect[i].x0(), image_y, thread_id));
     }
 
@@ -774,8 +831,8 @@ Status LowMemoryRenderPipeline::RenderRect(size_t thread_id,
           i < first_image_dim_stage_ ? full_image_x0 - frame_x0 : full_image_x0;
       size_t y =
           i < first_image_dim_stage_ ? full_image_y - frame_y0 : full_image_y;
-      JXL_RETURN_IF_ERROR(stages_[i]->ProcessRow(
-          input_rows[first_trailing_stage_], output_rows,
+      JXL_RETURN_IF_ERROR(ProcessStageRow(
+          i, input_rows[first_trailing_stage_], output_rows,
           /*xextra=*/0, full_image_x1 - full_image_x0, x0, y, thread_id));
     }
   }
@@ -796,8 +853,8 @@ Status LowMemoryRenderPipeline::RenderPadding(size_t thread_id, Rect rect) {
     stages_[first_image_dim_stage_ - 1]->ProcessPaddingRow(
         input_rows, rect.xsize(), rect.x0(), rect.y0() + y);
     for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
-      JXL_RETURN_IF_ERROR(stages_[i]->ProcessRow(
-          input_rows, output_rows,
+      JXL_RETURN_IF_ERROR(ProcessStageRow(
+          i, input_rows, output_rows,
           /*xextra=*/0, rect.xsize(), rect.x0(), rect.y0() + y, thread_id));
     }
   }
@@ -806,6 +863,10 @@ Status LowMemoryRenderPipeline::RenderPadding(size_t thread_id, Rect rect) {
 
 Status LowMemoryRenderPipeline::ProcessBuffers(size_t group_id,
                                                size_t thread_id) {
+  JXL_TRACE_EVENT("ProcessBuffers");
+  // Deferred rects are rendered from the group data, which must still be
+  // there by then.
+  JXL_ENSURE(!defer_rendering_ || use_group_ids_);
   std::vector<ImageF>& input_data =
       group_data_[use_group_ids_ ? group_id : thread_id];
 
@@ -900,10 +961,91 @@ Status LowMemoryRenderPipeline::ProcessBuffers(size_t group_id,
             gy * frame_dimensions_.group_dim,
         image_max_color_channel_rect.xsize(),
         image_max_color_channel_rect.ysize());
+    if (defer_rendering_) {
+      deferred_rects_[group_id].push_back({group_id,
+                                           data_max_color_channel_rect,
+                                           image_max_color_channel_rect});
+      continue;
+    }
     JXL_RETURN_IF_ERROR(RenderRect(thread_id, input_data,
                                    data_max_color_channel_rect,
                                    image_max_color_channel_rect));
   }
   return true;
 }
+
+Status LowMemoryRenderPipeline::RenderStripe(const DeferredRect& stripe,
+                                             size_t thread_id) {
+  const std::vector<ImageF>& group_data = group_data_[stripe.group_id];
+  std::vector<ImageF>& input_data = stripe_data_[thread_id];
+  // Rows of the group data in the color channels that the stripe can read,
+  // relative to the first row of the group. The stripes are tall enough that
+  // rows mirrored at the image boundaries are also included.
+  const ssize_t border = group_data_y_border_;
+  const ssize_t y0 =
+      static_cast<ssize_t>(stripe.data_max_color_channel_rect.y0()) - border;
+  const ssize_t y1 =
+      static_cast<ssize_t>(stripe.data_max_color_channel_rect.y1()) - border;
+  for (size_t c = 0; c < group_data.size(); c++) {
+    // Converts to rows of channel `c`, rounding down.
+    const ssize_t div = ssize_t{1} << channel_shifts_[0][c].second;
+    const auto channel_y = [&](ssize_t y) -> ssize_t {
+      y *= ssize_t{1} << base_color_shift_;
+      return y >= 0 ? y / div : -((div - 1 - y) / div);
+    };
+    const ssize_t padding = padding_[0][c].second + 1;
+    const ssize_t ysize = group_data[c].ysize();
+    const ssize_t first_row =
+        std::max<ssize_t>(0, border + channel_y(y0) - padding);
+    const ssize_t end_row =
+        std::min<ssize_t>(ysize, border + channel_y(y1) + 1 + padding);
+    for (ssize_t y = first_row; y < end_row; y++) {
+      memcpy(input_data[c].Row(y), group_data[c].ConstRow(y),
+             group_data[c].xsize() * sizeof(float));
+    }
+  }
+  return RenderRect(thread_id, input_data, stripe.data_max_color_channel_rect,
+                    stripe.image_max_color_channel_rect);
+}
+
+Status LowMemoryRenderPipeline::RenderDeferred(ThreadPool* pool) {
+  // Each stripe redoes the work of the stages on the padding rows, so stripes
+  // should be much taller than the padding.
+  constexpr size_t kStripeYSize = 64;
+  std::vector<DeferredRect> stripes;
+  for (std::vector<DeferredRect>& rects : deferred_rects_) {
+    for (const DeferredRect& rect : rects) {
+      const Rect& data_rect = rect.data_max_color_channel_rect;
+      const Rect& image_rect = rect.image_max_color_channel_rect;
+      size_t num_stripes =
+          std::max<size_t>(1, image_rect.ysize() / kStripeYSize);
+      for (size_t i = 0; i < num_stripes; i++) {
+        size_t y0 = i * kStripeYSize;
+        size_t ysize =
+            i + 1 == num_stripes ? image_rect.ysize() - y0 : kStripeYSize;
+        stripes.push_back(
+            {rect.group_id,
+             Rect(data_rect.x0(), data_rect.y0() + y0, data_rect.xsize(),
+                  ysize),
+             Rect(image_rect.x0(), image_rect.y0() + y0, image_rect.xsize(),
+                  ysize)});
+      }
+    }
+    rects.clear();
+  }
+  if (stripes.empty()) return true;
+  const auto prepare = [&](size_t num_threads) -> Status {
+    JXL_RETURN_IF_ERROR(
+        PrepareForThreads(num_threads, /*use_group_ids=*/true));
+    return true;
+  };
+  const auto render_stripe = [&](uint32_t i, size_t thread_id) -> Status {
+    JXL_RETURN_IF_ERROR(RenderStripe(stripes[i], thread_id));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, stripes.size(), prepare,
+                                render_stripe, "RenderStripes"));
+  return true;
+}
+
 }  // namespace jxl
@@ -15,6 +15,7 @@
 
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/common.h"  // JXL_HALF_PRECISION_BORDERS
 #include "lib/jxl/dec_group_border.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/image.h"
@@ -39,6 +40,10 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
 
   void ClearDone(size_t i) override { group_border_assigner_.ClearDone(i); }
 
+  void SetDeferRendering(bool defer) override { defer_rendering_ = defer; }
+
+  Status RenderDeferred(ThreadPool* pool) override;
+
   Status Init() override;
 
   Status EnsureBordersStorage();
@@ -49,6 +54,13 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
                     Rect image_max_color_channel_rect);
   Status RenderPadding(size_t thread_id, Rect rect);
 
+  struct DeferredRect {
+    size_t group_id;
+    Rect data_max_color_channel_rect;
+    Rect image_max_color_channel_rect;
+  };
+  Status RenderStripe(const DeferredRect& stripe, size_t thread_id);
+
   Status SaveBorders(size_t group_id, size_t c, const ImageF& in);
   Status LoadBorders(size_t group_id, size_t c, const Rect& r, ImageF* out);
 
@@ -59,11 +71,25 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
 
   bool use_group_ids_;
 
+  // If true, ProcessBuffers only records the rects that are ready to be
+  // rendered in deferred_rects_, indexed by group.
+  bool defer_rendering_ = false;
+  std::vector<std::vector<DeferredRect>> deferred_rects_;
+  // Copies of the group data needed to render a stripe, indexed by
+  // [thread][channel]. Stripes of the same group can then be rendered in
+  // parallel, even if some stages modify their input or mirror it.
+  std::vector<std::vector<ImageF>> stripe_data_;
+
   // Storage for borders between groups. Borders of adjacent groups are stacked
   // together, e.g. bottom border of current group is followed by top border
-  // of next group.
-  std::vector<ImageF> borders_horizontal_;
-  std::vector<ImageF> borders_vertical_;
+  // of next group. Samples are float16 bits if JXL_HALF_PRECISION_BORDERS.
+#if JXL_HALF_PRECISION_BORDERS
+  using BorderImage = Plane<uint16_t>;
+#else
+  using BorderImage = ImageF;
+#endif
+  std::vector<BorderImage> borders_horizontal_;
+  std::vector<BorderImage> borders_vertical_;
 
   // Manages the status of borders.
   GroupBorderAssigner group_border_assigner_;
@@ -15,6 +15,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/render_pipeline/low_memory_render_pipeline.h"
 #include "lib/jxl/render_pipeline/simple_render_pipeline.h"
+#include "lib/jxl/trace.h"
 
 namespace jxl {
 
@@ -92,6 +93,14 @@ StatusOr<std::unique_ptr<RenderPipeline>> RenderPipeline::Builder::Finalize(
       }
     }
   }
+  res->channel_used_.resize(num_c_);
+  for (const auto& stage : stages_) {
+    for (size_t c = 0; c < num_c_; c++) {
+      if (stage->GetChannelMode(c) != RenderPipelineChannelMode::kIgnored) {
+        res->channel_used_[c] = 1;
+      }
+    }
+  }
   res->stages_ = std::move(stages_);
   JXL_RETURN_IF_ERROR(res->Init());
   return res;
@@ -111,10 +120,11 @@ RenderPipelineInput RenderPipeline::GetInputBuffers(size_t group_id,
 Status RenderPipeline::InputReady(
     size_t group_id, size_t thread_id,
     const std::vector<std::pair<ImageF*, Rect>>& buffers) {
+  JXL_TRACE_SCOPE(kRenderPipeline);
   JXL_ENSURE(group_id < group_completed_passes_.size());
   group_completed_passes_[group_id]++;
   for (size_t i = 0; i < buffers.size(); ++i) {
-    (void)i;
+    if (!IsChannelUsed(i)) continue;
     JXL_CHECK_PLANE_INITIALIZED(*buffers[i].first, buffers[i].second, i);
   }
 
@@ -130,6 +140,43 @@ Status RenderPipeline::PrepareForThreads(size_t num, bool use_group_ids) {
   return true;
 }
 
+void RenderPipeline::SetStats(DecoderStats* stats) {
+  stage_stats_.clear();
+  stage_bytes_per_pixel_.clear();
+  if (!stats) return;
+  for (size_t i = 0; i < stages_.size(); i++) {
+    const auto& stage = stages_[i];
+    stage_stats_.push_back(stats->Get(stage->GetName()));
+    // Rows read and written for each row of output, for every channel.
+    size_t bytes_per_pixel = 0;
+    for (size_t c = 0; c < channel_shifts_[i].size(); c++) {
+      switch (stage->GetChannelMode(c)) {
+        case RenderPipelineChannelMode::kIgnored:
+          break;
+        case RenderPipelineChannelMode::kInput:
+          bytes_per_pixel += sizeof(float);
+          break;
+        case RenderPipelineChannelMode::kInPlace:
+          bytes_per_pixel += 2 * sizeof(float);
+          break;
+        case RenderPipelineChannelMode::kInOut:
+          bytes_per_pixel +=
+              (2 * stage->settings_.border_y + 1 +
+               (size_t{1} << (stage->settings_.shift_x +
+                              stage->settings_.shift_y))) *
+              sizeof(float);
+          break;
+      }
+    }
+    stage_bytes_per_pixel_.push_back(bytes_per_pixel);
+  }
+}
+
+bool RenderPipelineInput::IsChannelUsed(size_t c) const {
+  JXL_DASSERT(pipeline_);
+  return pipeline_->IsChannelUsed(c);
+}
+
 Status RenderPipelineInput::Done() {
   JXL_ENSURE(pipeline_);
   JXL_RETURN_IF_ERROR(pipeline_->InputReady(group_id_, thread_id_, buffers_));
@@ -15,8 +15,10 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
@@ -49,6 +51,10 @@ class RenderPipelineInput {
     return buffers_[c];
   }
 
+  // Whether the pipeline reads channel `c` at all; the buffers of unused
+  // channels may be left unwritten.
+  bool IsChannelUsed(size_t c) const;
+
  private:
   RenderPipeline* pipeline_ = nullptr;
   size_t group_id_;
@@ -116,9 +122,46 @@ class RenderPipeline {
 
   virtual void ClearDone(size_t i) {}
 
+  // If `defer` is true, the parts of the frame that become ready when the
+  // input of a group is done are not rendered right away, but by the next call
+  // to RenderDeferred. That splits them in horizontal stripes that are
+  // rendered in parallel, which helps frames with fewer groups than threads.
+  // Deferring requires storage for each group, see PrepareForThreads.
+  virtual void SetDeferRendering(bool defer) {}
+
+  // Renders all the parts of the frame recorded while rendering was deferred.
+  virtual Status RenderDeferred(ThreadPool* pool) { return true; }
+
+  // Accounts the time spent and the memory touched by each stage to the
+  // entry of `stats` named after the stage. `stats` must outlive the pipeline.
+  void SetStats(DecoderStats* stats);
+
+  // Whether any stage reads or writes channel `c`.
+  bool IsChannelUsed(size_t c) const {
+    JXL_DASSERT(c < channel_used_.size());
+    return channel_used_[c] != 0;
+  }
+
  protected:
   explicit RenderPipeline(JxlMemoryManager* memory_manager)
       : memory_manager_(memory_manager) {}
+
+  // Runs stage `i` on one row; implementations must call stages through this.
+  Status ProcessStageRow(size_t i,
+                         const RenderPipelineStage::RowInfo& input_rows,
+                         const RenderPipelineStage::RowInfo& output_rows,
+                         size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                         size_t thread_id) const {
+    if (stage_stats_.empty()) {
+      return stages_[i]->ProcessRow(input_rows, output_rows, xextra, xsize,
+                                    xpos, ypos, thread_id);
+    }
+    ScopedStatsTimer timer(stage_stats_[i],
+                           stage_bytes_per_pixel_[i] * (xsize + 2 * xextra));
+    return stages_[i]->ProcessRow(input_rows, output_rows, xextra, xsize, xpos,
+                                  ypos, thread_id);
+  }
+
   JxlMemoryManager* memory_manager_;
 
   std::vector<std::unique_ptr<RenderPipelineStage>> stages_;
@@ -133,6 +176,12 @@ class RenderPipeline {
 
   std::vector<uint8_t> group_completed_passes_;
 
+  std::vector<uint8_t> channel_used_;
+
+  // Empty unless statistics are collected, see SetStats.
+  std::vector<DecoderStats::Entry*> stage_stats_;
+  std::vector<size_t> stage_bytes_per_pixel_;
+
   friend class RenderPipelineInput;
 
  private:
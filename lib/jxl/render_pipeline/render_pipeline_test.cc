@@ -11,6 +11,7 @@
 #include <cctype>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -22,6 +23,8 @@
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/override.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/chroma_from_luma.h"
@@ -30,7 +33,9 @@
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/dec_frame.h"
+#include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/enc_params.h"
+#include "lib/jxl/epf.h"
 #include "lib/jxl/fake_parallel_runner_testonly.h"
 #include "lib/jxl/fields.h"
 #include "lib/jxl/frame_dimensions.h"
@@ -41,6 +46,11 @@
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
+#include "lib/jxl/loop_filter.h"
+#include "lib/jxl/render_pipeline/stage_epf.h"
+#include "lib/jxl/render_pipeline/stage_gaborish.h"
+#include "lib/jxl/render_pipeline/stage_write.h"
+#include "lib/jxl/render_pipeline/stage_xyb.h"
 #include "lib/jxl/render_pipeline/test_render_pipeline_stages.h"
 #include "lib/jxl/splines.h"
 #include "lib/jxl/test_memory_manager.h"
@@ -185,6 +195,113 @@ TEST(RenderPipelineTest, CallAllGroupsFast) {
   EXPECT_EQ(pipeline->PassesWithAllInput(), 1);
 }
 
+// Runs the loop filters of `lf` and the XYB to linear conversion on `input`,
+// either as separate stages or with the conversion done by the last filter.
+Status RenderLoopFilters(const LoopFilter& lf, const ImageF& sigma,
+                         const OutputEncodingInfo& output_encoding_info,
+                         bool fuse_xyb, const Image3F& input,
+                         Image3F* output) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const OpsinParams* xyb_params =
+      fuse_xyb ? &output_encoding_info.opsin_params : nullptr;
+  RenderPipeline::Builder builder(memory_manager, /*num_c=*/3);
+  if (lf.gab) {
+    JXL_RETURN_IF_ERROR(builder.AddStage(
+        GetGaborishStage(lf, lf.epf_iters == 0 ? xyb_params : nullptr)));
+  }
+  if (lf.epf_iters >= 3) {
+    JXL_RETURN_IF_ERROR(
+        builder.AddStage(GetEPFStage(lf, sigma, EpfStage::Zero)));
+  }
+  if (lf.epf_iters >= 1) {
+    JXL_RETURN_IF_ERROR(builder.AddStage(GetEPFStage(
+        lf, sigma, EpfStage::One, lf.epf_iters == 1 ? xyb_params : nullptr)));
+  }
+  if (lf.epf_iters >= 2) {
+    JXL_RETURN_IF_ERROR(
+        builder.AddStage(GetEPFStage(lf, sigma, EpfStage::Two, xyb_params)));
+  }
+  if (!fuse_xyb) {
+    JXL_RETURN_IF_ERROR(builder.AddStage(GetXYBStage(output_encoding_info)));
+  }
+  JXL_RETURN_IF_ERROR(
+      builder.AddStage(GetWriteToImage3FStage(memory_manager, output)));
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(input.xsize(), input.ysize(), /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+  JXL_ASSIGN_OR_RETURN(auto pipeline,
+                       std::move(builder).Finalize(frame_dimensions));
+  JXL_RETURN_IF_ERROR(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+  for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+    const Rect group_rect = frame_dimensions.GroupRect(i);
+    auto input_buffers = pipeline->GetInputBuffers(i, 0);
+    for (size_t c = 0; c < 3; c++) {
+      const auto& buffer = input_buffers.GetBuffer(c);
+      for (size_t y = 0; y < group_rect.ysize(); y++) {
+        memcpy(buffer.second.Row(buffer.first, y),
+               group_rect.ConstPlaneRow(input, c, y),
+               group_rect.xsize() * sizeof(float));
+      }
+    }
+    JXL_RETURN_IF_ERROR(input_buffers.Done());
+  }
+  return true;
+}
+
+TEST(RenderPipelineTest, FusedLoopFilterXYBIsBitExact) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  constexpr size_t kXSize = 300;
+  constexpr size_t kYSize = 200;
+  Rng rng(123);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F input,
+                         Image3F::Create(memory_manager, kXSize, kYSize));
+  for (size_t y = 0; y < kYSize; y++) {
+    float* JXL_RESTRICT row_x = input.PlaneRow(0, y);
+    float* JXL_RESTRICT row_y = input.PlaneRow(1, y);
+    float* JXL_RESTRICT row_b = input.PlaneRow(2, y);
+    for (size_t x = 0; x < kXSize; x++) {
+      row_x[x] = rng.UniformF(-0.02f, 0.02f);
+      row_y[x] = rng.UniformF(0.0f, 0.8f);
+      row_b[x] = rng.UniformF(0.0f, 0.8f);
+    }
+  }
+  // Some of the blocks have a sigma below kMinSigma, so that the pass-through
+  // path of the EPF stages is covered as well.
+  JXL_TEST_ASSIGN_OR_DIE(
+      ImageF sigma,
+      ImageF::Create(memory_manager,
+                     DivCeil(kXSize, kBlockDim) + 2 * kSigmaPadding,
+                     DivCeil(kYSize, kBlockDim) + 2 * kSigmaPadding));
+  for (size_t y = 0; y < sigma.ysize(); y++) {
+    float* JXL_RESTRICT row = sigma.Row(y);
+    for (size_t x = 0; x < sigma.xsize(); x++) {
+      row[x] = rng.UniformF(2 * kMinSigma, -0.1f);
+    }
+  }
+  OutputEncodingInfo output_encoding_info;
+  output_encoding_info.opsin_params.Init(kDefaultIntensityTarget);
+
+  for (bool gab : {false, true}) {
+    for (uint32_t epf_iters = 0; epf_iters <= 3; epf_iters++) {
+      if (!gab && epf_iters == 0) continue;
+      LoopFilter lf;
+      lf.gab = gab;
+      lf.epf_iters = epf_iters;
+      Image3F separate;
+      ASSERT_TRUE(RenderLoopFilters(lf, sigma, output_encoding_info,
+                                    /*fuse_xyb=*/false, input, &separate));
+      Image3F fused;
+      ASSERT_TRUE(RenderLoopFilters(lf, sigma, output_encoding_info,
+                                    /*fuse_xyb=*/true, input, &fused));
+      std::stringstream failures;
+      EXPECT_TRUE(SamePixels(separate, fused, failures))
+          << "gab=" << gab << " epf_iters=" << epf_iters << "\n"
+          << failures.str();
+    }
+  }
+}
+
 struct RenderPipelineTestInputSettings {
   // Input image.
   std::string input_path;
@@ -308,7 +425,8 @@ std::vector<RenderPipelineTestInputSettings> GeneratePipelineTests() {
   std::vector<RenderPipelineTestInputSettings> all_tests;
 
   std::pair<size_t, size_t> sizes[] = {
-      {3, 8}, {128, 128}, {256, 256}, {258, 258}, {533, 401}, {777, 777},
+      {3, 8},     {128, 128}, {256, 256}, {258, 258},
+      {533, 401}, {777, 777}, {256, 1100},
   };
 
   for (auto size : sizes) {
@@ -15,6 +15,7 @@
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/sanitizers.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
@@ -72,6 +73,7 @@ std::vector<std::pair<ImageF*, Rect>> SimpleRenderPipeline::PrepareBuffers(
 }
 
 Status SimpleRenderPipeline::ProcessBuffers(size_t group_id, size_t thread_id) {
+  JXL_TRACE_EVENT("ProcessBuffers");
   for (size_t c = 0; c < channel_data_.size(); c++) {
     Rect r = MakeChannelRect(group_id, c);
     (void)r;
@@ -199,9 +201,9 @@ Status SimpleRenderPipeline::ProcessBuffers(size_t group_id, size_t thread_id) {
                 (y << stage->settings_.shift_y) + iy + kRenderPipelineXOffset);
           }
         }
-        JXL_RETURN_IF_ERROR(stage->ProcessRow(input_rows, output_rows,
-                                              /*xextra=*/0, xsize,
-                                              /*xpos=*/0, y, thread_id));
+        JXL_RETURN_IF_ERROR(ProcessStageRow(stage_id, input_rows, output_rows,
+                                            /*xextra=*/0, xsize,
+                                            /*xpos=*/0, y, thread_id));
       }
     }
 
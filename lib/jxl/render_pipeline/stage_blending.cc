@@ -5,8 +5,6 @@
 
 #include "lib/jxl/render_pipeline/stage_blending.h"
 
-#include <jxl/memory_manager.h>
-
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/render_pipeline/stage_blending.cc"
 #include <hwy/foreach_target.h>
@@ -14,6 +12,7 @@
 
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/blending.h"
+#include "lib/jxl/memory_manager_internal.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
@@ -119,7 +118,6 @@ class BlendingStage : public RenderPipelineStage {
                     size_t xextra, size_t xsize, size_t xpos, size_t ypos,
                     size_t thread_id) const final {
     JXL_ENSURE(initialized_);
-    JxlMemoryManager* memory_manager = state_.memory_manager;
     const FrameOrigin& frame_origin = frame_header_.frame_origin;
     ssize_t bg_xpos = frame_origin.x0 + static_cast<ssize_t>(xpos);
     ssize_t bg_ypos = frame_origin.y0 + static_cast<ssize_t>(ypos);
@@ -160,10 +158,24 @@ class BlendingStage : public RenderPipelineStage {
                 : zeroes_.data();
       }
     }
-    return PerformBlending(memory_manager, bg_row_ptrs_.data(),
-                           fg_row_ptrs_.data(), fg_row_ptrs_.data(), 0, xsize,
-                           blending_info_[0], blending_info_.data() + 1,
-                           *extra_channel_info_);
+    return PerformBlending(bg_row_ptrs_.data(), fg_row_ptrs_.data(),
+                           fg_row_ptrs_.data(), 0, xsize, blending_info_[0],
+                           blending_info_.data() + 1, *extra_channel_info_,
+                           scratch_[thread_id].address<float>());
+  }
+
+  Status PrepareForThreads(size_t num_threads) override {
+    const size_t num_channels = 3 + extra_channel_info_->size();
+    scratch_.resize(num_threads);
+    for (AlignedMemory& scratch : scratch_) {
+      if (scratch) continue;
+      JXL_ASSIGN_OR_RETURN(
+          scratch,
+          AlignedMemory::Create(state_.memory_manager,
+                                num_channels * kBlendingChunkSize *
+                                    sizeof(float)));
+    }
+    return true;
   }
 
   RenderPipelineChannelMode GetChannelMode(size_t c) const final {
@@ -221,6 +233,8 @@ class BlendingStage : public RenderPipelineStage {
   std::vector<PatchBlending> blending_info_;
   const std::vector<ExtraChannelInfo>* extra_channel_info_;
   std::vector<float> zeroes_;
+  // Blending scratch buffer of each thread.
+  std::vector<AlignedMemory> scratch_;
 };
 
 std::unique_ptr<RenderPipelineStage> GetBlendingStage(
@@ -5,6 +5,8 @@
 
 #include "lib/jxl/render_pipeline/stage_epf.h"
 
+#include <cstring>
+
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
@@ -16,6 +18,8 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/dec_xyb-inl.h"
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -38,15 +42,68 @@ JXL_INLINE Vec<DF> Weight(Vec<DF> sad, Vec<DF> inv_sigma, Vec<DF> thres) {
   return ZeroIfNegative(v);
 }
 
+// Stores the filtered pixels of one vector. If `opsin_params` is not null, the
+// stage also takes over the work of the XYB stage that would follow it, and
+// the pixels are converted to linear RGB while they are still in registers.
+template <bool aligned>
+JXL_INLINE void StorePixels(const OpsinParams* opsin_params, Vec<DF> X,
+                            Vec<DF> Y, Vec<DF> B, float* JXL_RESTRICT row_x,
+                            float* JXL_RESTRICT row_y,
+                            float* JXL_RESTRICT row_b) {
+  const DF df;
+  if (opsin_params != nullptr) {
+    auto r = Undefined(df);
+    auto g = Undefined(df);
+    auto b = Undefined(df);
+    XybToRgb(df, X, Y, B, *opsin_params, &r, &g, &b);
+    X = r;
+    Y = g;
+    B = b;
+  }
+  if (aligned) {
+    Store(X, df, row_x);
+    Store(Y, df, row_y);
+    Store(B, df, row_b);
+  } else {
+    StoreU(X, df, row_x);
+    StoreU(Y, df, row_y);
+    StoreU(B, df, row_b);
+  }
+}
+
+// Called when the vector at `x` belongs to a block that is not filtered and
+// there is no XYB conversion to do: extends it to the whole run of such
+// vectors before `x_end`, copies the run with memcpy and returns its end.
+JXL_INLINE ssize_t CopyUnfilteredRun(
+    const float* JXL_RESTRICT row_sigma, size_t xpos, ssize_t x, ssize_t x_end,
+    const float* row_x, const float* row_y, const float* row_b,
+    float* JXL_RESTRICT row_out_x, float* JXL_RESTRICT row_out_y,
+    float* JXL_RESTRICT row_out_b) {
+  const ssize_t lanes = Lanes(DF());
+  ssize_t end = x + lanes;
+  while (end < x_end &&
+         row_sigma[(end + xpos + kSigmaPadding * kBlockDim) / kBlockDim] <
+             kMinSigma) {
+    end += lanes;
+  }
+  const size_t bytes = (end - x) * sizeof(float);
+  memcpy(row_out_x + x, row_x + x, bytes);
+  memcpy(row_out_y + x, row_y + x, bytes);
+  memcpy(row_out_b + x, row_b + x, bytes);
+  return end;
+}
+
 // 5x5 plus-shaped kernel with 5 SADs per pixel (3x3 plus-shaped). So this makes
 // this filter a 7x7 filter.
 class EPF0Stage : public RenderPipelineStage {
  public:
-  EPF0Stage(LoopFilter lf, const ImageF& sigma)
+  EPF0Stage(LoopFilter lf, const ImageF& sigma, const OpsinParams* xyb_params)
       : RenderPipelineStage(RenderPipelineStage::Settings::Symmetric(
             /*shift=*/0, /*border=*/3)),
         lf_(std::move(lf)),
-        sigma_(&sigma) {}
+        sigma_(&sigma),
+        xyb_output_(xyb_params != nullptr),
+        opsin_params_(xyb_params ? *xyb_params : OpsinParams()) {}
 
   template <bool aligned>
   JXL_INLINE void AddPixel(int row, float* JXL_RESTRICT rows[3][7], ssize_t x,
@@ -100,16 +157,28 @@ class EPF0Stage : public RenderPipelineStage {
             ? sad_mul_border
             : sad_mul_center;
 
-    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
-         x += Lanes(df)) {
+    float* JXL_RESTRICT row_out_x = GetOutputRow(output_rows, 0, 0);
+    float* JXL_RESTRICT row_out_y = GetOutputRow(output_rows, 1, 0);
+    float* JXL_RESTRICT row_out_b = GetOutputRow(output_rows, 2, 0);
+    const OpsinParams* xyb_params = xyb_output_ ? &opsin_params_ : nullptr;
+
+    const ssize_t x_end = xsize + xextra;
+    for (ssize_t x = -xextra; x < x_end; x += Lanes(df)) {
       size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
       size_t ix = (x + xpos) % kBlockDim;
 
       if (row_sigma[bx] < kMinSigma) {
-        for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][3 + 0] + x);
-          StoreU(px, df, GetOutputRow(output_rows, c, 0) + x);
+        if (xyb_params == nullptr) {
+          x = CopyUnfilteredRun(row_sigma, xpos, x, x_end, rows[0][3],
+                                rows[1][3], rows[2][3], row_out_x, row_out_y,
+                                row_out_b) -
+              Lanes(df);
+          continue;
         }
+        StorePixels</*aligned=*/false>(
+            xyb_params, Load(df, rows[0][3 + 0] + x),
+            Load(df, rows[1][3 + 0] + x), Load(df, rows[2][3 + 0] + x),
+            row_out_x + x, row_out_y + x, row_out_b + x);
         continue;
       }
 
@@ -123,19 +192,23 @@ class EPF0Stage : public RenderPipelineStage {
       };
 
       // compute sads
-      // TODO(veluca): consider unrolling and optimizing this.
       for (size_t c = 0; c < 3; c++) {
         auto scale = Set(df, lf_.epf_channel_scale[c]);
+        // The plus-shaped neighbourhood of the current pixel is the same for
+        // all 12 SADs, so it is only loaded once.
+        const auto p_c = Load(df, rows[c][3 + 0] + x);
+        const auto p_t = Load(df, rows[c][3 - 1] + x);
+        const auto p_l = LoadU(df, rows[c][3 + 0] + x - 1);
+        const auto p_b = Load(df, rows[c][3 + 1] + x);
+        const auto p_r = LoadU(df, rows[c][3 + 0] + x + 1);
         for (size_t i = 0; i < 12; i++) {
-          auto sad = Zero(df);
-          constexpr std::array<int, 2> plus_off[] = {
-              {{0, 0}}, {{-1, 0}}, {{0, -1}}, {{1, 0}}, {{0, 1}}};
-          for (const auto& off : plus_off) {
-            const auto r11 = LoadU(df, rows[c][3 + off[0]] + x + off[1]);
-            const auto c11 = LoadU(df, rows[c][3 + sads_off[i][0] + off[0]] +
-                                           x + sads_off[i][1] + off[1]);
-            sad = Add(sad, AbsDiff(r11, c11));
-          }
+          const int dy = sads_off[i][0];
+          const ssize_t dx = x + sads_off[i][1];
+          auto sad = AbsDiff(p_c, LoadU(df, rows[c][3 + dy] + dx));
+          sad = Add(sad, AbsDiff(p_t, LoadU(df, rows[c][2 + dy] + dx)));
+          sad = Add(sad, AbsDiff(p_l, LoadU(df, rows[c][3 + dy] + dx - 1)));
+          sad = Add(sad, AbsDiff(p_b, LoadU(df, rows[c][4 + dy] + dx)));
+          sad = Add(sad, AbsDiff(p_r, LoadU(df, rows[c][3 + dy] + dx + 1)));
           *sads[i] = MulAdd(sad, scale, *sads[i]);
         }
       }
@@ -158,9 +231,9 @@ class EPF0Stage : public RenderPipelineStage {
 #else
       auto inv_w = ApproximateReciprocal(w);
 #endif
-      StoreU(Mul(X, inv_w), df, GetOutputRow(output_rows, 0, 0) + x);
-      StoreU(Mul(Y, inv_w), df, GetOutputRow(output_rows, 1, 0) + x);
-      StoreU(Mul(B, inv_w), df, GetOutputRow(output_rows, 2, 0) + x);
+      StorePixels</*aligned=*/false>(xyb_params, Mul(X, inv_w), Mul(Y, inv_w),
+                                     Mul(B, inv_w), row_out_x + x,
+                                     row_out_y + x, row_out_b + x);
     }
     return true;
   }
@@ -170,22 +243,28 @@ class EPF0Stage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "EPF0"; }
+  const char* GetName() const override {
+    return xyb_output_ ? "EPF0+XYB" : "EPF0";
+  }
 
  private:
   LoopFilter lf_;
   const ImageF* sigma_;
+  const bool xyb_output_;
+  const OpsinParams opsin_params_;
 };
 
 // 3x3 plus-shaped kernel with 5 SADs per pixel (also 3x3 plus-shaped). So this
 // makes this filter a 5x5 filter.
 class EPF1Stage : public RenderPipelineStage {
  public:
-  EPF1Stage(LoopFilter lf, const ImageF& sigma)
+  EPF1Stage(LoopFilter lf, const ImageF& sigma, const OpsinParams* xyb_params)
       : RenderPipelineStage(RenderPipelineStage::Settings::Symmetric(
             /*shift=*/0, /*border=*/2)),
         lf_(std::move(lf)),
-        sigma_(&sigma) {}
+        sigma_(&sigma),
+        xyb_output_(xyb_params != nullptr),
+        opsin_params_(xyb_params ? *xyb_params : OpsinParams()) {}
 
   template <bool aligned>
   JXL_INLINE void AddPixel(int row, float* JXL_RESTRICT rows[3][5], ssize_t x,
@@ -235,16 +314,28 @@ class EPF1Stage : public RenderPipelineStage {
             ? sad_mul_border
             : sad_mul_center;
 
-    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
-         x += Lanes(df)) {
+    float* JXL_RESTRICT row_out_x = GetOutputRow(output_rows, 0, 0);
+    float* JXL_RESTRICT row_out_y = GetOutputRow(output_rows, 1, 0);
+    float* JXL_RESTRICT row_out_b = GetOutputRow(output_rows, 2, 0);
+    const OpsinParams* xyb_params = xyb_output_ ? &opsin_params_ : nullptr;
+
+    const ssize_t x_end = xsize + xextra;
+    for (ssize_t x = -xextra; x < x_end; x += Lanes(df)) {
       size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
       size_t ix = (x + xpos) % kBlockDim;
 
       if (row_sigma[bx] < kMinSigma) {
-        for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][2 + 0] + x);
-          Store(px, df, GetOutputRow(output_rows, c, 0) + x);
+        if (xyb_params == nullptr) {
+          x = CopyUnfilteredRun(row_sigma, xpos, x, x_end, rows[0][2],
+                                rows[1][2], rows[2][2], row_out_x, row_out_y,
+                                row_out_b) -
+              Lanes(df);
+          continue;
         }
+        StorePixels</*aligned=*/true>(
+            xyb_params, Load(df, rows[0][2 + 0] + x),
+            Load(df, rows[1][2 + 0] + x), Load(df, rows[2][2 + 0] + x),
+            row_out_x + x, row_out_y + x, row_out_b + x);
         continue;
       }
 
@@ -339,9 +430,9 @@ class EPF1Stage : public RenderPipelineStage {
 #else
       auto inv_w = ApproximateReciprocal(w);
 #endif
-      Store(Mul(X, inv_w), df, GetOutputRow(output_rows, 0, 0) + x);
-      Store(Mul(Y, inv_w), df, GetOutputRow(output_rows, 1, 0) + x);
-      Store(Mul(B, inv_w), df, GetOutputRow(output_rows, 2, 0) + x);
+      StorePixels</*aligned=*/true>(xyb_params, Mul(X, inv_w), Mul(Y, inv_w),
+                                    Mul(B, inv_w), row_out_x + x, row_out_y + x,
+                                    row_out_b + x);
     }
     return true;
   }
@@ -351,22 +442,28 @@ class EPF1Stage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "EPF1"; }
+  const char* GetName() const override {
+    return xyb_output_ ? "EPF1+XYB" : "EPF1";
+  }
 
  private:
   LoopFilter lf_;
   const ImageF* sigma_;
+  const bool xyb_output_;
+  const OpsinParams opsin_params_;
 };
 
 // 3x3 plus-shaped kernel with 1 SAD per pixel. So this makes this filter a 3x3
 // filter.
 class EPF2Stage : public RenderPipelineStage {
  public:
-  EPF2Stage(LoopFilter lf, const ImageF& sigma)
+  EPF2Stage(LoopFilter lf, const ImageF& sigma, const OpsinParams* xyb_params)
       : RenderPipelineStage(RenderPipelineStage::Settings::Symmetric(
             /*shift=*/0, /*border=*/1)),
         lf_(std::move(lf)),
-        sigma_(&sigma) {}
+        sigma_(&sigma),
+        xyb_output_(xyb_params != nullptr),
+        opsin_params_(xyb_params ? *xyb_params : OpsinParams()) {}
 
   template <bool aligned>
   JXL_INLINE void AddPixel(int row, float* JXL_RESTRICT rows[3][3], ssize_t x,
@@ -421,16 +518,28 @@ class EPF2Stage : public RenderPipelineStage {
             ? sad_mul_border
             : sad_mul_center;
 
-    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
-         x += Lanes(df)) {
+    float* JXL_RESTRICT row_out_x = GetOutputRow(output_rows, 0, 0);
+    float* JXL_RESTRICT row_out_y = GetOutputRow(output_rows, 1, 0);
+    float* JXL_RESTRICT row_out_b = GetOutputRow(output_rows, 2, 0);
+    const OpsinParams* xyb_params = xyb_output_ ? &opsin_params_ : nullptr;
+
+    const ssize_t x_end = xsize + xextra;
+    for (ssize_t x = -xextra; x < x_end; x += Lanes(df)) {
       size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
       size_t ix = (x + xpos) % kBlockDim;
 
       if (row_sigma[bx] < kMinSigma) {
-        for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][1 + 0] + x);
-          Store(px, df, GetOutputRow(output_rows, c, 0) + x);
+        if (xyb_params == nullptr) {
+          x = CopyUnfilteredRun(row_sigma, xpos, x, x_end, rows[0][1],
+                                rows[1][1], rows[2][1], row_out_x, row_out_y,
+                                row_out_b) -
+              Lanes(df);
+          continue;
         }
+        StorePixels</*aligned=*/true>(
+            xyb_params, Load(df, rows[0][1 + 0] + x),
+            Load(df, rows[1][1 + 0] + x), Load(df, rows[2][1 + 0] + x),
+            row_out_x + x, row_out_y + x, row_out_b + x);
         continue;
       }
 
@@ -462,9 +571,9 @@ class EPF2Stage : public RenderPipelineStage {
 #else
       auto inv_w = ApproximateReciprocal(w);
 #endif
-      Store(Mul(X, inv_w), df, GetOutputRow(output_rows, 0, 0) + x);
-      Store(Mul(Y, inv_w), df, GetOutputRow(output_rows, 1, 0) + x);
-      Store(Mul(B, inv_w), df, GetOutputRow(output_rows, 2, 0) + x);
+      StorePixels</*aligned=*/true>(xyb_params, Mul(X, inv_w), Mul(Y, inv_w),
+                                    Mul(B, inv_w), row_out_x + x, row_out_y + x,
+                                    row_out_b + x);
     }
     return true;
   }
@@ -474,26 +583,30 @@ class EPF2Stage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "EPF2"; }
+  const char* GetName() const override {
+    return xyb_output_ ? "EPF2+XYB" : "EPF2";
+  }
 
  private:
   LoopFilter lf_;
   const ImageF* sigma_;
+  const bool xyb_output_;
+  const OpsinParams opsin_params_;
 };
 
-std::unique_ptr<RenderPipelineStage> GetEPFStage0(const LoopFilter& lf,
-                                                  const ImageF& sigma) {
-  return jxl::make_unique<EPF0Stage>(lf, sigma);
+std::unique_ptr<RenderPipelineStage> GetEPFStage0(
+    const LoopFilter& lf, const ImageF& sigma, const OpsinParams* xyb_params) {
+  return jxl::make_unique<EPF0Stage>(lf, sigma, xyb_params);
 }
 
-std::unique_ptr<RenderPipelineStage> GetEPFStage1(const LoopFilter& lf,
-                                                  const ImageF& sigma) {
-  return jxl::make_unique<EPF1Stage>(lf, sigma);
+std::unique_ptr<RenderPipelineStage> GetEPFStage1(
+    const LoopFilter& lf, const ImageF& sigma, const OpsinParams* xyb_params) {
+  return jxl::make_unique<EPF1Stage>(lf, sigma, xyb_params);
 }
 
-std::unique_ptr<RenderPipelineStage> GetEPFStage2(const LoopFilter& lf,
-                                                  const ImageF& sigma) {
-  return jxl::make_unique<EPF2Stage>(lf, sigma);
+std::unique_ptr<RenderPipelineStage> GetEPFStage2(
+    const LoopFilter& lf, const ImageF& sigma, const OpsinParams* xyb_params) {
+  return jxl::make_unique<EPF2Stage>(lf, sigma, xyb_params);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -508,17 +621,17 @@ HWY_EXPORT(GetEPFStage0);
 HWY_EXPORT(GetEPFStage1);
 HWY_EXPORT(GetEPFStage2);
 
-std::unique_ptr<RenderPipelineStage> GetEPFStage(const LoopFilter& lf,
-                                                 const ImageF& sigma,
-                                                 EpfStage epf_stage) {
+std::unique_ptr<RenderPipelineStage> GetEPFStage(
+    const LoopFilter& lf, const ImageF& sigma, EpfStage epf_stage,
+    const OpsinParams* xyb_params) {
   if (lf.epf_iters == 0) return nullptr;
   switch (epf_stage) {
     case EpfStage::Zero:
-      return HWY_DYNAMIC_DISPATCH(GetEPFStage0)(lf, sigma);
+      return HWY_DYNAMIC_DISPATCH(GetEPFStage0)(lf, sigma, xyb_params);
     case EpfStage::One:
-      return HWY_DYNAMIC_DISPATCH(GetEPFStage1)(lf, sigma);
+      return HWY_DYNAMIC_DISPATCH(GetEPFStage1)(lf, sigma, xyb_params);
     case EpfStage::Two:
-      return HWY_DYNAMIC_DISPATCH(GetEPFStage2)(lf, sigma);
+      return HWY_DYNAMIC_DISPATCH(GetEPFStage2)(lf, sigma, xyb_params);
   }
   JXL_DEBUG_ABORT("internal: unexpected EpfStage: %d",
                   static_cast<int>(epf_stage));
@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <memory>
 
+#include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/loop_filter.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
@@ -21,9 +22,11 @@ enum class EpfStage : uint8_t { Zero, One, Two };
 // `sigma` will be accessed with an offset of (kSigmaPadding, kSigmaPadding),
 // and should have (kSigmaBorder, kSigmaBorder) mirrored sigma values available
 // around the main image. See also filters.(h|cc)
-std::unique_ptr<RenderPipelineStage> GetEPFStage(const LoopFilter& lf,
-                                                 const ImageF& sigma,
-                                                 EpfStage epf_stage);
+// If `xyb_params` is not null, the stage also converts its output from XYB to
+// linear RGB, replacing the XYB stage that would otherwise directly follow it.
+std::unique_ptr<RenderPipelineStage> GetEPFStage(
+    const LoopFilter& lf, const ImageF& sigma, EpfStage epf_stage,
+    const OpsinParams* xyb_params = nullptr);
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_EPF_H_
@@ -10,6 +10,8 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/dec_xyb-inl.h"
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -21,9 +23,11 @@ using hwy::HWY_NAMESPACE::MulAdd;
 
 class GaborishStage : public RenderPipelineStage {
  public:
-  explicit GaborishStage(const LoopFilter& lf)
+  GaborishStage(const LoopFilter& lf, const OpsinParams* xyb_params)
       : RenderPipelineStage(RenderPipelineStage::Settings::Symmetric(
-            /*shift=*/0, /*border=*/1)) {
+            /*shift=*/0, /*border=*/1)),
+        xyb_output_(xyb_params != nullptr),
+        opsin_params_(xyb_params ? *xyb_params : OpsinParams()) {
     weights_[0] = 1;
     weights_[1] = lf.gab_x_weight1;
     weights_[2] = lf.gab_x_weight2;
@@ -83,6 +87,24 @@ class GaborishStage : public RenderPipelineStage {
         Store(pixels, d, row_out + x);
       }
     }
+    if (xyb_output_) {
+      // The output rows of this call were just written and are still in
+      // cache, so convert them in place instead of in a separate XYB stage.
+      float* JXL_RESTRICT row0 = GetOutputRow(output_rows, 0, 0);
+      float* JXL_RESTRICT row1 = GetOutputRow(output_rows, 1, 0);
+      float* JXL_RESTRICT row2 = GetOutputRow(output_rows, 2, 0);
+      for (ssize_t x = -RoundUpTo(xextra, Lanes(d));
+           x < static_cast<ssize_t>(xsize + xextra); x += Lanes(d)) {
+        auto r = Undefined(d);
+        auto g = Undefined(d);
+        auto b = Undefined(d);
+        XybToRgb(d, Load(d, row0 + x), Load(d, row1 + x), Load(d, row2 + x),
+                 opsin_params_, &r, &g, &b);
+        Store(r, d, row0 + x);
+        Store(g, d, row1 + x);
+        Store(b, d, row2 + x);
+      }
+    }
     return true;
   }
 #undef LoadMaybeU
@@ -92,14 +114,19 @@ class GaborishStage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "Gab"; }
+  const char* GetName() const override {
+    return xyb_output_ ? "Gab+XYB" : "Gab";
+  }
 
  private:
   float weights_[9];
+  const bool xyb_output_;
+  const OpsinParams opsin_params_;
 };
 
-std::unique_ptr<RenderPipelineStage> GetGaborishStage(const LoopFilter& lf) {
-  return jxl::make_unique<GaborishStage>(lf);
+std::unique_ptr<RenderPipelineStage> GetGaborishStage(
+    const LoopFilter& lf, const OpsinParams* xyb_params) {
+  return jxl::make_unique<GaborishStage>(lf, xyb_params);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -112,9 +139,10 @@ namespace jxl {
 
 HWY_EXPORT(GetGaborishStage);
 
-std::unique_ptr<RenderPipelineStage> GetGaborishStage(const LoopFilter& lf) {
+std::unique_ptr<RenderPipelineStage> GetGaborishStage(
+    const LoopFilter& lf, const OpsinParams* xyb_params) {
   if (lf.gab != 1) return nullptr;
-  return HWY_DYNAMIC_DISPATCH(GetGaborishStage)(lf);
+  return HWY_DYNAMIC_DISPATCH(GetGaborishStage)(lf, xyb_params);
 }
 
 }  // namespace jxl
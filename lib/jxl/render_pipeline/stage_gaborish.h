@@ -12,13 +12,17 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/loop_filter.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 namespace jxl {
 
 // Applies decoder-side Gaborish with the given settings. `lf.gab` must be 1.
-std::unique_ptr<RenderPipelineStage> GetGaborishStage(const LoopFilter& lf);
+// If `xyb_params` is not null, the stage also converts its output from XYB to
+// linear RGB, replacing the XYB stage that would otherwise directly follow it.
+std::unique_ptr<RenderPipelineStage> GetGaborishStage(
+    const LoopFilter& lf, const OpsinParams* xyb_params = nullptr);
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_GABORISH_H_
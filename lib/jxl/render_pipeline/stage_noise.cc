@@ -238,6 +238,15 @@ std::unique_ptr<RenderPipelineStage> GetAddNoiseStage(
                                          noise_c_start);
 }
 
+// Sum of the pixels at `x` of the two rows above and the two rows below the
+// center one.
+template <class D>
+static HWY_INLINE Vec<D> NoiseColumnSum(D d, float* JXL_RESTRICT const* rows,
+                                        ssize_t x) {
+  return Add(Add(LoadU(d, rows[0] + x), LoadU(d, rows[1] + x)),
+             Add(LoadU(d, rows[3] + x), LoadU(d, rows[4] + x)));
+}
+
 class ConvolveNoiseStage : public RenderPipelineStage {
  public:
   explicit ConvolveNoiseStage(size_t first_c)
@@ -258,18 +267,18 @@ class ConvolveNoiseStage : public RenderPipelineStage {
       for (ssize_t x = -RoundUpTo(xextra, Lanes(d));
            x < static_cast<ssize_t>(xsize + xextra); x += Lanes(d)) {
         const auto p00 = LoadU(d, rows[2] + x);
-        auto others = Zero(d);
-        // TODO(eustas): sum loaded values to reduce the calculation chain
-        for (ssize_t i = -2; i <= 2; i++) {
-          others = Add(others, LoadU(d, rows[0] + x + i));
-          others = Add(others, LoadU(d, rows[1] + x + i));
-          others = Add(others, LoadU(d, rows[3] + x + i));
-          others = Add(others, LoadU(d, rows[4] + x + i));
-        }
-        others = Add(others, LoadU(d, rows[2] + x - 2));
-        others = Add(others, LoadU(d, rows[2] + x - 1));
-        others = Add(others, LoadU(d, rows[2] + x + 1));
-        others = Add(others, LoadU(d, rows[2] + x + 2));
+        // Sum the 24 neighbours as a balanced tree rather than one long chain
+        // of dependent additions, so that the loads and adds can overlap.
+        const auto c0 = NoiseColumnSum(d, rows, x - 2);
+        const auto c1 = NoiseColumnSum(d, rows, x - 1);
+        const auto c2 = NoiseColumnSum(d, rows, x);
+        const auto c3 = NoiseColumnSum(d, rows, x + 1);
+        const auto c4 = NoiseColumnSum(d, rows, x + 2);
+        const auto center_row =
+            Add(Add(LoadU(d, rows[2] + x - 2), LoadU(d, rows[2] + x - 1)),
+                Add(LoadU(d, rows[2] + x + 1), LoadU(d, rows[2] + x + 2)));
+        const auto others =
+            Add(Add(Add(c0, c1), Add(c3, c4)), Add(c2, center_row));
         // 4 * (1 - box kernel)
         auto pixels = MulAdd(others, Set(d, 0.16), Mul(p00, Set(d, -3.84)));
         StoreU(pixels, d, row_out + x);
@@ -9,7 +9,10 @@
 #include <memory>
 #include <vector>
 
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/blending.h"
 #include "lib/jxl/dec_patch_dictionary.h"
+#include "lib/jxl/memory_manager_internal.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 namespace jxl {
@@ -33,7 +36,22 @@ class PatchDictionaryStage : public RenderPipelineStage {
       row_ptrs[i] = GetInputRow(input_rows, i, 0) + x0 - xpos;
     }
     return patches_.AddOneRow(row_ptrs.data(), ypos, x0,
-                              xsize + xextra + xpos - x0, *extra_channel_info_);
+                              xsize + xextra + xpos - x0, *extra_channel_info_,
+                              scratch_[thread_id].address<float>());
+  }
+
+  Status PrepareForThreads(size_t num_threads) override {
+    const size_t num_channels = 3 + extra_channel_info_->size();
+    scratch_.resize(num_threads);
+    for (AlignedMemory& scratch : scratch_) {
+      if (scratch) continue;
+      JXL_ASSIGN_OR_RETURN(
+          scratch,
+          AlignedMemory::Create(patches_.memory_manager(),
+                                num_channels * kBlendingChunkSize *
+                                    sizeof(float)));
+    }
+    return true;
   }
 
   RenderPipelineChannelMode GetChannelMode(size_t c) const final {
@@ -47,6 +65,8 @@ class PatchDictionaryStage : public RenderPipelineStage {
  private:
   const PatchDictionary& patches_;
   const std::vector<ExtraChannelInfo>* extra_channel_info_;
+  // Blending scratch buffer of each thread.
+  std::vector<AlignedMemory> scratch_;
 };
 }  // namespace
 
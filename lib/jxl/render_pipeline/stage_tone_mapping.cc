@@ -112,7 +112,7 @@ class ToneMappingStage : public RenderPipelineStage {
   const char* GetName() const override { return "ToneMapping"; }
 
  private:
-  using ToneMapper = Rec2408ToneMapper<HWY_FULL(float)>;
+  using ToneMapper = Rec2408ToneMapperLut<HWY_FULL(float)>;
   OutputEncodingInfo output_encoding_info_;
   std::unique_ptr<ToneMapper> tone_mapper_;
   std::unique_ptr<HlgOOTF> hlg_ootf_;
@@ -44,6 +44,9 @@ class UpsamplingStage : public RenderPipelineStage {
             weights[5 * N * y - y * (y - 1) / 2 + x - y];
       }
     }
+    if (shift == 1) ComputePhaseWeights<2>();
+    if (shift == 2) ComputePhaseWeights<4>();
+    if (shift == 3) ComputePhaseWeights<8>();
   }
 
   Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
@@ -105,6 +108,23 @@ class UpsamplingStage : public RenderPipelineStage {
     }
   }
 
+  // Resolves the kernel symmetries once per stage, so that the weights of
+  // output phase (ox, oy) are the 25 consecutive floats starting at
+  // phase_weights_[(oy * N + ox) * 25], in input row-major order.
+  template <size_t N>
+  void ComputePhaseWeights() {
+    float* w = phase_weights_;
+    for (size_t oy = 0; oy < N; oy++) {
+      for (size_t ox = 0; ox < N; ox++) {
+        for (ssize_t iy = -2; iy <= 2; iy++) {
+          for (ssize_t ix = -2; ix <= 2; ix++) {
+            *w++ = Kernel<N>(ox, oy, ix, iy);
+          }
+        }
+      }
+    }
+  }
+
   template <ssize_t N>
   void ProcessRowImpl(const RowInfo& input_rows, const RowInfo& output_rows,
                       ssize_t x0, ssize_t x1) const {
@@ -131,19 +151,37 @@ class UpsamplingStage : public RenderPipelineStage {
       ups[7] = &ups7;
     }
 
+    const float* rows_in[5];
+    for (ssize_t iy = -2; iy <= 2; iy++) {
+      rows_in[iy + 2] = GetInputRow(input_rows, c_, iy) - 2;
+    }
+    float* rows_out[N];
     for (size_t oy = 0; oy < N; oy++) {
-      float* dst_row = GetOutputRow(output_rows, c_, oy);
-      for (ssize_t x = x0; x < x1; x += Lanes(df)) {
+      rows_out[oy] = GetOutputRow(output_rows, c_, oy);
+    }
+
+    // All N * N output phases of a vector of input pixels read the same 5x5
+    // neighbourhood, so its range is computed once and each phase only does
+    // the weighted sum.
+    for (ssize_t x = x0; x < x1; x += Lanes(df)) {
+      auto min = LoadU(df, rows_in[2] + x + 2);
+      auto max = min;
+      for (size_t iy = 0; iy < 5; iy++) {
+        for (size_t ix = 0; ix < 5; ix++) {
+          auto v = LoadU(df, rows_in[iy] + x + ix);
+          min = Min(v, min);
+          max = Max(v, max);
+        }
+      }
+      for (size_t oy = 0; oy < N; oy++) {
+        float* dst_row = rows_out[oy];
         for (size_t ox = 0; ox < N; ox++) {
+          const float* JXL_RESTRICT w = phase_weights_ + (oy * N + ox) * 25;
           auto result = Zero(df);
-          auto min = LoadU(df, GetInputRow(input_rows, c_, 0) + x);
-          auto max = min;
-          for (ssize_t iy = -2; iy <= 2; iy++) {
-            for (ssize_t ix = -2; ix <= 2; ix++) {
-              auto v = LoadU(df, GetInputRow(input_rows, c_, iy) + x + ix);
-              result = MulAdd(Set(df, Kernel<N>(ox, oy, ix, iy)), v, result);
-              min = Min(v, min);
-              max = Max(v, max);
+          for (size_t iy = 0; iy < 5; iy++) {
+            for (size_t ix = 0; ix < 5; ix++) {
+              auto v = LoadU(df, rows_in[iy] + x + ix);
+              result = MulAdd(Set(df, w[iy * 5 + ix]), v, result);
             }
           }
           // Avoid overshooting.
@@ -165,6 +203,7 @@ class UpsamplingStage : public RenderPipelineStage {
 
   size_t c_;
   float kernel_[4][4][5][5];
+  float phase_weights_[8 * 8 * 25];
 };
 
 std::unique_ptr<RenderPipelineStage> GetUpsamplingStage(
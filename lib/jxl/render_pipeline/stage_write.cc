@@ -13,6 +13,7 @@
 #include "lib/jxl/alpha.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/sanitizers.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_cache.h"
@@ -26,6 +27,10 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/cms/transfer_functions-inl.h"
+#include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
+#include "lib/jxl/dec_xyb-inl.h"
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -116,25 +121,46 @@ VFromD<Rebind<T, DF>> MakeUnsigned(VFromD<DF> v, size_t x0, size_t y0,
 
 class WriteToOutputStage : public RenderPipelineStage {
  public:
-  WriteToOutputStage(const ImageOutput& main_output, size_t width,
-                     size_t height, bool has_alpha, bool unpremul_alpha,
-                     size_t alpha_c, Orientation undo_orientation,
+  WriteToOutputStage(const ImageOutput& main_output, const Rect& output_rect,
+                     size_t downsampling, bool has_alpha, bool unpremul_alpha,
+                     bool premul_alpha, size_t alpha_c,
+                     Orientation undo_orientation,
                      const std::vector<ImageOutput>& extra_output,
+                     const OpsinParams* xyb_params, bool linear_input,
                      JxlMemoryManager* memory_manager)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
-        width_(width),
-        height_(height),
+        x0_(output_rect.x0()),
+        y0_(output_rect.y0()),
+        downsampling_(downsampling),
+        width_(output_rect.xsize()),
+        height_(output_rect.ysize()),
         main_(main_output),
         num_color_(main_.num_channels_ < 3 ? 1 : 3),
         want_alpha_(main_.num_channels_ == 2 || main_.num_channels_ == 4),
         has_alpha_(has_alpha),
         unpremul_alpha_(unpremul_alpha),
+        premul_alpha_(premul_alpha),
         alpha_c_(alpha_c),
         flip_x_(ShouldFlipX(undo_orientation)),
         flip_y_(ShouldFlipY(undo_orientation)),
         transpose_(ShouldTranspose(undo_orientation)),
         opaque_alpha_(kMaxPixelsPerCall, 1.0f),
+        xyb_input_(xyb_params != nullptr),
+        linear_input_(linear_input),
         memory_manager_(memory_manager) {
+    JXL_DASSERT(!(xyb_input_ && linear_input_));
+    if (xyb_input_ || linear_input_) {
+      JXL_DASSERT(num_color_ == 3 && main_output.planes.empty());
+    }
+    if (xyb_input_) opsin_params_ = *xyb_params;
+    for (const ImageOutputPlane& plane : main_output.planes) {
+      Output out(main_output);
+      out.buffer_ = plane.buffer;
+      out.buffer_size_ = plane.buffer_size;
+      out.stride_ = plane.stride;
+      out.num_channels_ = 1;
+      main_planes_.push_back(out);
+    }
     for (size_t ec = 0; ec < extra_output.size(); ++ec) {
       if (extra_output[ec].callback.IsPresent() || extra_output[ec].buffer) {
         Output extra(extra_output[ec]);
@@ -165,34 +191,29 @@ class WriteToOutputStage : public RenderPipelineStage {
                     size_t thread_id) const final {
     JXL_ENSURE(xextra == 0);
     JXL_ENSURE(main_.run_opaque_ || main_.buffer_);
+    if (downsampling_ != 1) {
+      return ProcessDownsampledRow(input_rows, xsize, xpos, ypos, thread_id);
+    }
+    // Translate to output coordinates, skipping the pixels that are left of
+    // or above the output rect.
+    if (ypos < y0_ || xpos + xsize <= x0_) return true;
+    ypos -= y0_;
+    size_t xskip = xpos < x0_ ? x0_ - xpos : 0;
+    xpos = xpos + xskip - x0_;
+    xsize -= xskip;
     if (ypos >= height_) return true;
     if (xpos >= width_) return true;
     if (flip_y_) {
       ypos = height_ - 1u - ypos;
     }
-    size_t limit = std::min(xsize, width_ - xpos);
-    for (size_t x0 = 0; x0 < limit; x0 += kMaxPixelsPerCall) {
-      size_t xstart = xpos + x0;
+    size_t limit = std::min(xsize, width_ - xpos) + xskip;
+    for (size_t x0 = xskip; x0 < limit; x0 += kMaxPixelsPerCall) {
+      size_t xstart = xpos + x0 - xskip;
       size_t len = std::min<size_t>(kMaxPixelsPerCall, limit - x0);
-
-      const float* line_buffers[4];
-      for (size_t c = 0; c < num_color_; c++) {
-        line_buffers[c] = GetInputRow(input_rows, c, 0) + x0;
-      }
-      if (has_alpha_) {
-        line_buffers[num_color_] = GetInputRow(input_rows, alpha_c_, 0) + x0;
-      } else {
-        // opaque_alpha_ is a way to set all values to 1.0f.
-        line_buffers[num_color_] = opaque_alpha_.data();
-      }
-      if (has_alpha_ && want_alpha_ && unpremul_alpha_) {
-        UnpremulAlpha(thread_id, len, line_buffers);
-      }
-      OutputBuffers(main_, thread_id, ypos, xstart, len, line_buffers);
-      for (const auto& extra : extra_channels_) {
-        line_buffers[0] = GetInputRow(input_rows, extra.channel_index_, 0) + x0;
-        OutputBuffers(extra, thread_id, ypos, xstart, len, line_buffers);
-      }
+      OutputPixels(thread_id, ypos, xstart, len,
+                   [&](size_t c, size_t /* slot */) -> const float* {
+                     return GetInputRow(input_rows, c, 0) + x0;
+                   });
     }
     return true;
   }
@@ -246,8 +267,85 @@ class WriteToOutputStage : public RenderPipelineStage {
     size_t channel_index_;  // used for extra_channels
   };
 
+  // Writes `len` pixels starting at output position (`xstart`, `ypos`).
+  // `get_row(c, slot)` returns the input pixels of channel `c`; `slot` is a
+  // distinct index in [0, NumSlots()) for each channel that is written.
+  template <typename GetRow>
+  void OutputPixels(size_t thread_id, size_t ypos, size_t xstart, size_t len,
+                    const GetRow& get_row) const {
+    const float* line_buffers[4];
+    for (size_t c = 0; c < num_color_; c++) {
+      line_buffers[c] = get_row(c, c);
+    }
+    if (has_alpha_) {
+      line_buffers[num_color_] = get_row(alpha_c_, num_color_);
+    } else {
+      // opaque_alpha_ is a way to set all values to 1.0f.
+      line_buffers[num_color_] = opaque_alpha_.data();
+    }
+    if (has_alpha_ && want_alpha_ && unpremul_alpha_) {
+      UnpremulAlpha(thread_id, len, line_buffers);
+    } else if (has_alpha_ && want_alpha_ && premul_alpha_) {
+      PremulAlpha(thread_id, len, line_buffers);
+    }
+    if (xyb_input_ || linear_input_) {
+      OutputSRGBBuffers(thread_id, ypos, xstart, len, line_buffers);
+    } else if (main_planes_.empty()) {
+      OutputBuffers(main_, thread_id, ypos, xstart, len, line_buffers);
+    } else {
+      for (size_t c = 0; c < main_planes_.size(); ++c) {
+        const float* plane_input[4] = {line_buffers[c]};
+        OutputBuffers(main_planes_[c], thread_id, ypos, xstart, len,
+                      plane_input);
+      }
+    }
+    for (size_t i = 0; i < extra_channels_.size(); ++i) {
+      const Output& extra = extra_channels_[i];
+      line_buffers[0] = get_row(extra.channel_index_, num_color_ + 1 + i);
+      OutputBuffers(extra, thread_id, ypos, xstart, len, line_buffers);
+    }
+  }
+
+  size_t NumSlots() const { return num_color_ + 1 + extra_channels_.size(); }
+
+  Status ProcessDownsampledRow(const RowInfo& input_rows, size_t xsize,
+                               size_t xpos, size_t ypos,
+                               size_t thread_id) const {
+    const size_t f = downsampling_;
+    if (ypos % f != 0) return true;
+    ypos /= f;
+    // Offset of the first pixel of the row that is written.
+    size_t skip = (f - xpos % f) % f;
+    if (ypos >= height_ || skip >= xsize) return true;
+    size_t xpos_out = (xpos + skip) / f;
+    if (xpos_out >= width_) return true;
+    if (flip_y_) {
+      ypos = height_ - 1u - ypos;
+    }
+    size_t num = std::min(DivCeil(xsize - skip, f), width_ - xpos_out);
+    for (size_t x0 = 0; x0 < num; x0 += kMaxPixelsPerCall) {
+      size_t len = std::min<size_t>(kMaxPixelsPerCall, num - x0);
+      OutputPixels(thread_id, ypos, xpos_out + x0, len,
+                   [&](size_t c, size_t slot) -> const float* {
+                     const float* JXL_RESTRICT row =
+                         GetInputRow(input_rows, c, 0) + skip + x0 * f;
+                     float* JXL_RESTRICT out =
+                         temp_downsampled_[thread_id * NumSlots() + slot]
+                             .address<float>();
+                     for (size_t i = 0; i < len; ++i) {
+                       out[i] = row[i * f];
+                     }
+                     return out;
+                   });
+    }
+    return true;
+  }
+
   Status PrepareForThreads(size_t num_threads) override {
     JXL_RETURN_IF_ERROR(main_.PrepareForThreads(num_threads));
+    for (auto& plane : main_planes_) {
+      JXL_RETURN_IF_ERROR(plane.PrepareForThreads(num_threads));
+    }
     for (auto& extra : extra_channels_) {
       JXL_RETURN_IF_ERROR(extra.PrepareForThreads(num_threads));
     }
@@ -258,7 +356,16 @@ class WriteToOutputStage : public RenderPipelineStage {
       JXL_ASSIGN_OR_RETURN(temp,
                            AlignedMemory::Create(memory_manager_, alloc_size));
     }
-    if ((has_alpha_ && want_alpha_ && unpremul_alpha_) || flip_x_) {
+    if (downsampling_ != 1) {
+      temp_downsampled_.resize(num_threads * NumSlots());
+      for (AlignedMemory& temp : temp_downsampled_) {
+        size_t alloc_size = sizeof(float) * kMaxPixelsPerCall;
+        JXL_ASSIGN_OR_RETURN(
+            temp, AlignedMemory::Create(memory_manager_, alloc_size));
+      }
+    }
+    if ((has_alpha_ && want_alpha_ && (unpremul_alpha_ || premul_alpha_)) ||
+        flip_x_) {
       temp_in_.resize(num_threads * main_.num_channels_);
       for (AlignedMemory& temp : temp_in_) {
         size_t alloc_size = sizeof(float) * kMaxPixelsPerCall;
@@ -311,6 +418,27 @@ class WriteToOutputStage : public RenderPipelineStage {
     }
   }
 
+  void PremulAlpha(size_t thread_id, size_t len,
+                   const float** line_buffers) const {
+    const HWY_FULL(float) d;
+    float* temp_in[4];
+    for (size_t c = 0; c < num_color_; ++c) {
+      size_t tix = thread_id * main_.num_channels_ + c;
+      temp_in[c] = temp_in_[tix].address<float>();
+    }
+    const float* JXL_RESTRICT row_alpha = line_buffers[num_color_];
+    for (size_t ix = 0; ix < len; ix += Lanes(d)) {
+      auto alpha = LoadU(d, row_alpha + ix);
+      for (size_t c = 0; c < num_color_; ++c) {
+        auto val = LoadU(d, line_buffers[c] + ix);
+        StoreU(Mul(val, alpha), d, temp_in[c] + ix);
+      }
+    }
+    for (size_t c = 0; c < num_color_; ++c) {
+      line_buffers[c] = temp_in[c];
+    }
+  }
+
   void OutputBuffers(const Output& out, size_t thread_id, size_t ypos,
                      size_t xstart, size_t len, const float* input[4]) const {
     if (flip_x_) {
@@ -329,13 +457,7 @@ class WriteToOutputStage : public RenderPipelineStage {
         StoreFloat16Row(out, input, len, temp);
       }
       if (out.swap_endianness_) {
-        const HWY_FULL(uint16_t) du;
-        size_t output_len = len * out.num_channels_;
-        for (size_t j = 0; j < output_len; j += Lanes(du)) {
-          auto v = LoadU(du, temp + j);
-          auto vswap = Or(ShiftRightSame(v, 8), ShiftLeftSame(v, 8));
-          StoreU(vswap, du, temp + j);
-        }
+        SwapBytes16(len * out.num_channels_, temp);
       }
       WriteToOutput(out, thread_id, ypos, xstart, len, temp);
     } else if (out.data_type_ == JXL_TYPE_FLOAT) {
@@ -351,6 +473,112 @@ class WriteToOutputStage : public RenderPipelineStage {
     }
   }
 
+  // Same as OutputBuffers for main_, but the color channels of `input` are XYB
+  // or linear and are converted to 8 or 16 bit sRGB in a single pass while
+  // storing.
+  void OutputSRGBBuffers(size_t thread_id, size_t ypos, size_t xstart,
+                         size_t len, const float* input[4]) const {
+    if (flip_x_) {
+      FlipX(main_, thread_id, len, &xstart, input);
+    }
+    if (main_.data_type_ == JXL_TYPE_UINT8) {
+      uint8_t* JXL_RESTRICT temp = temp_out_[thread_id].address<uint8_t>();
+      StoreToSRGBRow(input, len, temp, xstart, ypos);
+      WriteToOutput(main_, thread_id, ypos, xstart, len, temp);
+    } else {
+      JXL_DASSERT(main_.data_type_ == JXL_TYPE_UINT16);
+      uint16_t* JXL_RESTRICT temp = temp_out_[thread_id].address<uint16_t>();
+      StoreToSRGBRow(input, len, temp, xstart, ypos);
+      if (main_.swap_endianness_) {
+        SwapBytes16(len * main_.num_channels_, temp);
+      }
+      WriteToOutput(main_, thread_id, ypos, xstart, len, temp);
+    }
+  }
+
+  static void SwapBytes16(size_t output_len, uint16_t* JXL_RESTRICT temp) {
+    const HWY_FULL(uint16_t) du;
+    for (size_t j = 0; j < output_len; j += Lanes(du)) {
+      auto v = LoadU(du, temp + j);
+      auto vswap = Or(ShiftRightSame(v, 8), ShiftLeftSame(v, 8));
+      StoreU(vswap, du, temp + j);
+    }
+  }
+
+  template <typename D, typename V>
+  static V LinearToSRGB(D d, V linear) {
+#if JXL_HIGH_PRECISION
+    return TF_SRGB().EncodedFromDisplay(d, linear);
+#else
+    return FastLinearToSRGB(d, linear);
+#endif
+  }
+
+  template <typename T>
+  void StoreToSRGBRow(const float* input[4], size_t len, T* output,
+                      size_t xstart, size_t ypos) const {
+    if (xyb_input_) {
+      StoreToSRGBRow</*kXYB=*/true>(input, len, output, xstart, ypos);
+    } else {
+      StoreToSRGBRow</*kXYB=*/false>(input, len, output, xstart, ypos);
+    }
+  }
+
+  // Computes the same values as the XYB stage (if kXYB), the sRGB stage and
+  // StoreUnsignedRow one after the other, without the intermediate stores.
+  template <bool kXYB, typename T>
+  void StoreToSRGBRow(const float* input[4], size_t len, T* output,
+                      size_t xstart, size_t ypos) const {
+    const HWY_FULL(float) d;
+    auto mul = Set(d, (1u << (main_.bits_per_sample_)) - 1);
+    const Rebind<T, decltype(d)> du;
+    const size_t padding = RoundUpTo(len, Lanes(d)) - len;
+    for (size_t c = 0; c < main_.num_channels_; ++c) {
+      msan::UnpoisonMemory(input[c] + len, sizeof(input[c][0]) * padding);
+    }
+    using V = VFromD<decltype(d)>;
+    const auto to_srgb = [&](size_t i, V* r, V* g, V* b) {
+      if (kXYB) {
+        XybToRgb(d, LoadU(d, &input[0][i]), LoadU(d, &input[1][i]),
+                 LoadU(d, &input[2][i]), opsin_params_, r, g, b);
+      } else {
+        *r = LoadU(d, &input[0][i]);
+        *g = LoadU(d, &input[1][i]);
+        *b = LoadU(d, &input[2][i]);
+      }
+      *r = LinearToSRGB(d, *r);
+      *g = LinearToSRGB(d, *g);
+      *b = LinearToSRGB(d, *b);
+    };
+    if (main_.num_channels_ == 3) {
+      for (size_t i = 0; i < len; i += Lanes(d)) {
+        auto r = Undefined(d);
+        auto g = Undefined(d);
+        auto b = Undefined(d);
+        to_srgb(i, &r, &g, &b);
+        StoreInterleaved3(MakeUnsigned<T>(r, xstart + i, ypos, mul),
+                          MakeUnsigned<T>(g, xstart + i, ypos, mul),
+                          MakeUnsigned<T>(b, xstart + i, ypos, mul), du,
+                          &output[3 * i]);
+      }
+    } else {
+      for (size_t i = 0; i < len; i += Lanes(d)) {
+        auto r = Undefined(d);
+        auto g = Undefined(d);
+        auto b = Undefined(d);
+        to_srgb(i, &r, &g, &b);
+        StoreInterleaved4(
+            MakeUnsigned<T>(r, xstart + i, ypos, mul),
+            MakeUnsigned<T>(g, xstart + i, ypos, mul),
+            MakeUnsigned<T>(b, xstart + i, ypos, mul),
+            MakeUnsigned<T>(LoadU(d, &input[3][i]), xstart + i, ypos, mul), du,
+            &output[4 * i]);
+      }
+    }
+    msan::PoisonMemory(output + main_.num_channels_ * len,
+                       sizeof(output[0]) * main_.num_channels_ * padding);
+  }
+
   void FlipX(const Output& out, size_t thread_id, size_t len, size_t* xstart,
              const float** line_buffers) const {
     float* temp_in[4];
@@ -523,22 +751,36 @@ class WriteToOutputStage : public RenderPipelineStage {
   }
 
   static constexpr size_t kMaxPixelsPerCall = 1024;
+  size_t x0_;
+  size_t y0_;
+  size_t downsampling_;
   size_t width_;
   size_t height_;
   Output main_;  // color + alpha
+  // One single-channel output per channel of main_, for planar output.
+  std::vector<Output> main_planes_;
   size_t num_color_;
   bool want_alpha_;
   bool has_alpha_;
   bool unpremul_alpha_;
+  bool premul_alpha_;
   size_t alpha_c_;
   bool flip_x_;
   bool flip_y_;
   bool transpose_;
   std::vector<Output> extra_channels_;
   std::vector<float> opaque_alpha_;
+  // If true, the color input is XYB and is converted to sRGB with
+  // opsin_params_ when writing the main output.
+  bool xyb_input_;
+  OpsinParams opsin_params_;
+  // If true, the color input is linear and is converted to sRGB when writing
+  // the main output, instead of by a separate FromLinear stage.
+  bool linear_input_;
   JxlMemoryManager* memory_manager_;
   std::vector<AlignedMemory> temp_in_;
   std::vector<AlignedMemory> temp_out_;
+  std::vector<AlignedMemory> temp_downsampled_;
 };
 
 #if JXL_CXX_LANG < JXL_CXX_17
@@ -546,12 +788,16 @@ constexpr size_t WriteToOutputStage::kMaxPixelsPerCall;
 #endif
 
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
-    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
-    bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
-    std::vector<ImageOutput>& extra_output, JxlMemoryManager* memory_manager) {
+    const ImageOutput& main_output, const Rect& output_rect,
+    size_t downsampling, bool has_alpha, bool unpremul_alpha,
+    bool premul_alpha, size_t alpha_c, Orientation undo_orientation,
+    std::vector<ImageOutput>& extra_output,
+    const OpsinParams* xyb_params, bool linear_input,
+    JxlMemoryManager* memory_manager) {
   return jxl::make_unique<WriteToOutputStage>(
-      main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-      undo_orientation, extra_output, memory_manager);
+      main_output, output_rect, downsampling, has_alpha, unpremul_alpha,
+      premul_alpha, alpha_c, undo_orientation, extra_output, xyb_params,
+      linear_input, memory_manager);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -685,12 +931,16 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(
 }
 
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
-    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
-    bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
-    std::vector<ImageOutput>& extra_output, JxlMemoryManager* memory_manager) {
+    const ImageOutput& main_output, const Rect& output_rect,
+    size_t downsampling, bool has_alpha, bool unpremul_alpha,
+    bool premul_alpha, size_t alpha_c, Orientation undo_orientation,
+    std::vector<ImageOutput>& extra_output,
+    const OpsinParams* xyb_params, bool linear_input,
+    JxlMemoryManager* memory_manager) {
   return HWY_DYNAMIC_DISPATCH(GetWriteToOutputStage)(
-      main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-      undo_orientation, extra_output, memory_manager);
+      main_output, output_rect, downsampling, has_alpha, unpremul_alpha,
+      premul_alpha, alpha_c, undo_orientation, extra_output, xyb_params,
+      linear_input, memory_manager);
 }
 
 }  // namespace jxl
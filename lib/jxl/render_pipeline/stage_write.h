@@ -12,6 +12,7 @@
 #include <memory>
 #include <vector>
 
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/image.h"
@@ -28,11 +29,25 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImageBundleStage(
 std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(
     JxlMemoryManager* memory_manager, Image3F* image);
 
-// Gets a stage to write to a pixel callback or image buffer.
+// Gets a stage to write to a pixel callback or image buffer. Only the pixels
+// inside `output_rect` (in image coordinates, before undoing the orientation)
+// are written, the top-left corner of the rect being the first output pixel.
+// If `downsampling` is not 1, `output_rect` must start at the origin and be
+// given in downsampled coordinates, and only pixels whose coordinates are both
+// multiples of `downsampling` are written.
+// If `xyb_params` is not null, the color channels are XYB and are converted to
+// sRGB while writing; the main output must then be an interleaved RGB(A)
+// buffer or callback with an unsigned 8 or 16 bit data type. The same holds if
+// `linear_input` is set, for color channels in linear sRGB.
+// If `unpremul_alpha` (resp. `premul_alpha`) is set, the color channels are
+// divided (resp. multiplied) by alpha while writing an output with alpha.
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
-    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
-    bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
-    std::vector<ImageOutput>& extra_output, JxlMemoryManager* memory_manager);
+    const ImageOutput& main_output, const Rect& output_rect,
+    size_t downsampling, bool has_alpha, bool unpremul_alpha,
+    bool premul_alpha, size_t alpha_c,
+    Orientation undo_orientation, std::vector<ImageOutput>& extra_output,
+    const OpsinParams* xyb_params, bool linear_input,
+    JxlMemoryManager* memory_manager);
 
 }  // namespace jxl
 
@@ -156,10 +156,21 @@ void DrawSegments(float* JXL_RESTRICT row_x, float* JXL_RESTRICT row_y,
                   float* JXL_RESTRICT row_b, size_t y, size_t x0, size_t x1,
                   const bool add, const SplineSegment* segments,
                   const size_t* segment_indices,
-                  const size_t* segment_y_start) {
+                  const size_t* segment_bin_start, const size_t num_bins) {
+  if (x1 <= x0) return;
   float* JXL_RESTRICT rows[3] = {row_x - x0, row_y - x0, row_b - x0};
-  for (size_t i = segment_y_start[y]; i < segment_y_start[y + 1]; i++) {
-    DrawSegment(segments[segment_indices[i]], add, y, x0, x1, rows);
+  const size_t first_bin = std::min(x0 / kSplineBinXSize, num_bins - 1);
+  const size_t last_bin = std::min((x1 - 1) / kSplineBinXSize, num_bins - 1);
+  for (size_t bin = first_bin; bin <= last_bin; bin++) {
+    // Every pixel is drawn from the bin it is in, so segments that span
+    // several bins are drawn piecewise.
+    const size_t bin_x0 = std::max(x0, bin * kSplineBinXSize);
+    const size_t bin_x1 =
+        bin + 1 == num_bins ? x1 : std::min(x1, (bin + 1) * kSplineBinXSize);
+    const size_t* bin_start = segment_bin_start + y * num_bins + bin;
+    for (size_t i = bin_start[0]; i < bin_start[1]; i++) {
+      DrawSegment(segments[segment_indices[i]], add, y, bin_x0, bin_x1, rows);
+    }
   }
 }
 
@@ -564,7 +575,8 @@ void Splines::Clear() {
   starting_points_.clear();
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_bin_start_.clear();
+  num_segment_bins_ = 0;
 }
 
 Status Splines::Decode(JxlMemoryManager* memory_manager, jxl::BitReader* br,
@@ -629,7 +641,7 @@ Status Splines::InitializeDrawCache(const size_t image_xsize,
   // boundaries.
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_bin_start_.clear();
   std::vector<std::pair<size_t, size_t>> segments_by_y;
   std::vector<Spline::Point> intermediate_points;
   uint64_t total_estimated_area_reached = 0;
@@ -683,19 +695,48 @@ Status Splines::InitializeDrawCache(const size_t image_xsize,
     (spline, points_to_draw, arc_length, segments_, segments_by_y);
   }
 
-  // TODO(eustas): consider linear sorting here.
-  std::sort(segments_by_y.begin(), segments_by_y.end());
-  segment_indices_.resize(segments_by_y.size());
-  segment_y_start_.resize(image_ysize + 1);
-  for (size_t i = 0; i < segments_by_y.size(); i++) {
-    segment_indices_[i] = segments_by_y[i].second;
-    size_t y = segments_by_y[i].first;
-    if (y < image_ysize) {
-      segment_y_start_[y + 1]++;
+  // Counting sort by row and column bin. The segments of a row are listed in
+  // increasing index order, so each bin keeps the drawing order.
+  num_segment_bins_ =
+      std::max<size_t>(1, DivCeil(image_xsize, kSplineBinXSize));
+  const size_t last_bin = num_segment_bins_ - 1;
+  // Returns the bins [first, end) of the row of `entry` that its segment
+  // covers, none for rows outside of the image.
+  const auto bins_of = [&](const std::pair<size_t, size_t>& entry) {
+    std::pair<size_t, size_t> bins(0, 0);
+    if (entry.first >= image_ysize) return bins;
+    const SplineSegment& segment = segments_[entry.second];
+    // Same pixel range as in DrawSegment, x1 is one-past-the-end.
+    const int64_t x0 =
+        std::llround(segment.center_x - segment.maximum_distance);
+    const int64_t x1 =
+        std::llround(segment.center_x + segment.maximum_distance) + 1;
+    if (x1 <= x0) return bins;
+    bins.first = x0 <= 0 ? 0 : std::min<size_t>(x0 / kSplineBinXSize, last_bin);
+    bins.second =
+        x1 <= 1 ? 1
+                : std::min<size_t>((x1 - 1) / kSplineBinXSize, last_bin) + 1;
+    return bins;
+  };
+  segment_bin_start_.assign(image_ysize * num_segment_bins_ + 1, 0);
+  for (const auto& entry : segments_by_y) {
+    const std::pair<size_t, size_t> bins = bins_of(entry);
+    for (size_t bin = bins.first; bin < bins.second; bin++) {
+      segment_bin_start_[entry.first * num_segment_bins_ + bin + 1]++;
     }
   }
-  for (size_t y = 0; y < image_ysize; y++) {
-    segment_y_start_[y + 1] += segment_y_start_[y];
+  for (size_t key = 0; key + 1 < segment_bin_start_.size(); key++) {
+    segment_bin_start_[key + 1] += segment_bin_start_[key];
+  }
+  segment_indices_.resize(segment_bin_start_.back());
+  std::vector<size_t> next(segment_bin_start_.begin(),
+                           segment_bin_start_.end() - 1);
+  for (const auto& entry : segments_by_y) {
+    const std::pair<size_t, size_t> bins = bins_of(entry);
+    for (size_t bin = bins.first; bin < bins.second; bin++) {
+      segment_indices_[next[entry.first * num_segment_bins_ + bin]++] =
+          entry.second;
+    }
   }
   return true;
 }
@@ -707,7 +748,7 @@ void Splines::ApplyToRow(float* JXL_RESTRICT row_x, float* JXL_RESTRICT row_y,
   if (segments_.empty()) return;
   HWY_DYNAMIC_DISPATCH(DrawSegments)
   (row_x, row_y, row_b, y, x0, x1, add, segments_.data(),
-   segment_indices_.data(), segment_y_start_.data());
+   segment_indices_.data(), segment_bin_start_.data(), num_segment_bins_);
 }
 
 template <bool add>
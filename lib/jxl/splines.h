@@ -90,6 +90,10 @@ class QuantizedSpline {
 // render each Gaussian. The structure doesn't actually depend on the exact
 // row, which allows reuse for different y values (which are tracked
 // separately).
+// Width of the column bins that the segments of each row are grouped in, so
+// that drawing part of a row only visits the segments near it.
+constexpr size_t kSplineBinXSize = 256;
+
 struct SplineSegment {
   float center_x, center_y;
   float maximum_distance;
@@ -148,8 +152,13 @@ class Splines {
   std::vector<QuantizedSpline> splines_;
   std::vector<Spline::Point> starting_points_;
   std::vector<SplineSegment> segments_;
+  // Indices in segments_ of the segments to draw in each column bin of each
+  // row, ordered by row, then by bin. Those of bin b in row y start at
+  // segment_bin_start_[y * num_segment_bins_ + b]. The first and last bins
+  // also hold the segments that extend beyond the left and right image edges.
   std::vector<size_t> segment_indices_;
-  std::vector<size_t> segment_y_start_;
+  std::vector<size_t> segment_bin_start_;
+  size_t num_segment_bins_ = 0;
 };
 
 }  // namespace jxl
@@ -74,5 +74,61 @@ void BM_Splines(benchmark::State& state) {
 
 BENCHMARK(BM_Splines)->Range(1, 1 << 10);
 
+// Draws n splines spread over a wide image one group-sized piece of a row at a
+// time, as the render pipeline does.
+void BM_SplinesRows(benchmark::State& state) {
+  const size_t n = state.range();
+  constexpr size_t kXSize = 4096;
+  constexpr size_t kYSize = 256;
+  constexpr size_t kPieceXSize = 256;
+
+  std::vector<QuantizedSpline> quantized_splines;
+  std::vector<Spline::Point> starting_points;
+  for (size_t i = 0; i < n; ++i) {
+    const float x = (i * 997) % (kXSize - 160);
+    const float y = (i * 61) % (kYSize - 160);
+    Spline spline{
+        /*control_points=*/{{x + 9, y + 54},
+                            {x + 118, y + 159},
+                            {x + 97, y + 3},
+                            {x + 150, y + 25}},
+        /*color_dct=*/
+        {Dct32{0.03125f, 0.00625f, 0.003125f}, Dct32{1.f, 0.321875f},
+         Dct32{1.f, 0.24375f}},
+        /*sigma_dct=*/{0.3125f, 0.f, 0.f, 0.0625f}};
+    JXL_ASSIGN_OR_QUIT(
+        QuantizedSpline qspline,
+        QuantizedSpline::Create(spline, kQuantizationAdjustment, kYToX, kYToB),
+        "Failed to create spline.");
+    quantized_splines.emplace_back(std::move(qspline));
+    starting_points.push_back(spline.control_points.front());
+  }
+  Splines splines(kQuantizationAdjustment, std::move(quantized_splines),
+                  std::move(starting_points));
+
+  JXL_ASSIGN_OR_QUIT(
+      Image3F drawing_area,
+      Image3F::Create(jpegxl::tools::NoMemoryManager(), kXSize, kYSize),
+      "Failed to allocate drawing plane.");
+  ZeroFillImage(&drawing_area);
+  BM_CHECK(splines.InitializeDrawCache(
+      drawing_area.xsize(), drawing_area.ysize(), color_correlation));
+  for (auto _ : state) {
+    (void)_;
+    for (size_t y = 0; y < kYSize; ++y) {
+      for (size_t x0 = 0; x0 < kXSize; x0 += kPieceXSize) {
+        splines.AddToRow(drawing_area.PlaneRow(0, y) + x0,
+                         drawing_area.PlaneRow(1, y) + x0,
+                         drawing_area.PlaneRow(2, y) + x0, y, x0,
+                         x0 + kPieceXSize);
+      }
+    }
+  }
+
+  state.SetItemsProcessed(n * state.iterations());
+}
+
+BENCHMARK(BM_SplinesRows)->Range(1, 1 << 10);
+
 }  // namespace
 }  // namespace jxl
@@ -8,6 +8,7 @@
 #include <jxl/cms.h>
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -340,6 +341,48 @@ TEST(SplinesTest, Drawing) {
       *io_expected.Main().color(), *io_actual.Main().color(), 1e-2f, 1e-1f, _));
 }
 
+TEST(SplinesTest, DrawingInPieces) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  std::vector<Spline::Point> control_points{{9, 54},   {318, 159}, {597, 3},
+                                            {10, 140}, {650, 25},  {520, 190}};
+  const Spline spline{
+      control_points,
+      /*color_dct=*/
+      {Dct32{0.5f, 0.5f}, Dct32{0.5f, 0.f, 0.5f}, Dct32{0.f, 0.5f, 0.5f}},
+      /*sigma_dct=*/{4.f, 0.f, 1.f}};
+  JXL_TEST_ASSIGN_OR_DIE(
+      QuantizedSpline qspline,
+      QuantizedSpline::Create(spline, kQuantizationAdjustment, kYToX, kYToB));
+  std::vector<QuantizedSpline> quantized_splines;
+  quantized_splines.emplace_back(std::move(qspline));
+  std::vector<Spline::Point> starting_points = {control_points.front()};
+  Splines splines(kQuantizationAdjustment, std::move(quantized_splines),
+                  std::move(starting_points));
+
+  JXL_TEST_ASSIGN_OR_DIE(Image3F image,
+                         Image3F::Create(memory_manager, 700, 200));
+  ASSERT_TRUE(splines.InitializeDrawCache(image.xsize(), image.ysize(),
+                                          color_correlation));
+  ZeroFillImage(&image);
+  splines.AddTo(&image, Rect(image));
+
+  // Pieces that start and end both inside and across column bins must draw
+  // exactly the same pixels.
+  for (size_t piece : {37, 256, 300}) {
+    JXL_TEST_ASSIGN_OR_DIE(Image3F pieces,
+                           Image3F::Create(memory_manager, 700, 200));
+    ZeroFillImage(&pieces);
+    for (size_t y = 0; y < pieces.ysize(); ++y) {
+      for (size_t x0 = 0; x0 < pieces.xsize(); x0 += piece) {
+        const size_t x1 = std::min(x0 + piece, pieces.xsize());
+        splines.AddToRow(pieces.PlaneRow(0, y) + x0, pieces.PlaneRow(1, y) + x0,
+                         pieces.PlaneRow(2, y) + x0, y, x0, x1);
+      }
+    }
+    JXL_TEST_ASSERT_OK(SamePixels(image, pieces, _));
+  }
+}
+
 TEST(SplinesTest, ClearedEveryFrame) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   CodecInOut io_expected{memory_manager};
@@ -3,6 +3,10 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
 #include "benchmark/benchmark.h"
 #include "lib/jxl/image_ops.h"
 
@@ -11,6 +15,7 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/cms/tone_mapping-inl.h"
 #include "lib/jxl/cms/transfer_functions-inl.h"
 
 HWY_BEFORE_NAMESPACE();
@@ -92,6 +97,103 @@ HWY_NOINLINE void BM_PQSlowDFE(benchmark::State& state) {
 HWY_NOINLINE void BM_PQSlowEFD(benchmark::State& state) {
   RUN_BENCHMARK_SCALAR(TF_PQ_Base::EncodedFromDisplay, 10000.0);
 }
+
+template <class ToneMapper>
+void RunToneMapBenchmark(benchmark::State& state) {
+  constexpr size_t kNum = 1 << 12;
+  HWY_FULL(float) d;
+  const ToneMapper tone_mapper({0.0f, 10000.0f}, {0.0f, 250.0f},
+                               {0.2627f, 0.6780f, 0.0593f});
+  auto sum = Zero(d);
+  for (auto _ : state) {
+    auto x = Set(d, 1.0f / kNum);
+    auto r = Zero(d);
+    auto g = Set(d, 0.5f / kNum);
+    auto b = Set(d, 0.25f / kNum);
+    for (size_t i = 0; i < kNum; i++) {
+      auto r1 = r;
+      auto g1 = g;
+      auto b1 = b;
+      tone_mapper.ToneMap(&r1, &g1, &b1);
+      sum = Add(sum, Add(r1, Add(g1, b1)));
+      r = Add(r, x);
+      g = Add(g, x);
+      b = Add(b, x);
+    }
+  }
+  /* pixels per second */
+  state.SetItemsProcessed(kNum * state.iterations() * Lanes(d));
+  benchmark::DoNotOptimize(sum);
+}
+
+HWY_NOINLINE void BM_Rec2408ToneMap(benchmark::State& state) {
+  RunToneMapBenchmark<Rec2408ToneMapper<HWY_FULL(float)>>(state);
+}
+
+HWY_NOINLINE void BM_Rec2408ToneMapLut(benchmark::State& state) {
+  RunToneMapBenchmark<Rec2408ToneMapperLut<HWY_FULL(float)>>(state);
+}
+
+// Linear to 8-bit sRGB, as done by the output stage: polynomial approximation
+// of the transfer function followed by quantization.
+struct SRGB8Polynomial {
+  template <class D>
+  VFromD<RebindToSigned<D>> operator()(D d, VFromD<D> linear) const {
+    const auto encoded = Mul(FastLinearToSRGB(d, linear), Set(d, 255.0f));
+    return NearestInt(Clamp(encoded, Zero(d), Set(d, 255.0f)));
+  }
+};
+
+// Same, with a table of the 8-bit result indexed by the quantized linear
+// value, for comparison.
+struct SRGB8Table {
+  static constexpr size_t kTableSize = 4096;
+  SRGB8Table() {
+    for (size_t i = 0; i < kTableSize; ++i) {
+      const float linear = static_cast<float>(i) / (kTableSize - 1);
+      const float encoded =
+          linear < 0.0031308f ? 12.92f * linear
+                              : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+      table[i] = static_cast<int32_t>(std::lround(encoded * 255.0f));
+    }
+  }
+  template <class D>
+  VFromD<RebindToSigned<D>> operator()(D d, VFromD<D> linear) const {
+    const RebindToSigned<D> di;
+    const auto max = Set(d, kTableSize - 1);
+    const auto index = NearestInt(Clamp(Mul(linear, max), Zero(d), max));
+    return GatherIndex(di, table, index);
+  }
+  HWY_ALIGN int32_t table[kTableSize];
+};
+
+template <class ToSRGB8>
+void RunSRGB8Benchmark(benchmark::State& state) {
+  constexpr size_t kNum = 1 << 12;
+  HWY_FULL(float) d;
+  const RebindToSigned<decltype(d)> di;
+  const ToSRGB8 to_srgb8;
+  auto sum = Zero(di);
+  for (auto _ : state) {
+    auto x = Set(d, 1.0f / kNum);
+    auto v = Zero(d);
+    for (size_t i = 0; i < kNum; i++) {
+      sum = Add(sum, to_srgb8(d, v));
+      v = Add(v, x);
+    }
+  }
+  /* samples per second */
+  state.SetItemsProcessed(kNum * state.iterations() * Lanes(d));
+  benchmark::DoNotOptimize(sum);
+}
+
+HWY_NOINLINE void BM_FastSRGB8(benchmark::State& state) {
+  RunSRGB8Benchmark<SRGB8Polynomial>(state);
+}
+
+HWY_NOINLINE void BM_TableSRGB8(benchmark::State& state) {
+  RunSRGB8Benchmark<SRGB8Table>(state);
+}
 }  // namespace
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
@@ -108,6 +210,10 @@ HWY_EXPORT(BM_PQDFE);
 HWY_EXPORT(BM_PQEFD);
 HWY_EXPORT(BM_PQSlowDFE);
 HWY_EXPORT(BM_PQSlowEFD);
+HWY_EXPORT(BM_Rec2408ToneMap);
+HWY_EXPORT(BM_Rec2408ToneMapLut);
+HWY_EXPORT(BM_FastSRGB8);
+HWY_EXPORT(BM_TableSRGB8);
 
 float SRGB_pow(float _, float x) {
   return x < 0.0031308f ? 12.92f * x : 1.055f * powf(x, 1.0f / 2.4f) - 0.055f;
@@ -131,6 +237,18 @@ void BM_PQSlowDFE(benchmark::State& state) {
 void BM_PQSlowEFD(benchmark::State& state) {
   HWY_DYNAMIC_DISPATCH(BM_PQSlowEFD)(state);
 }
+void BM_Rec2408ToneMap(benchmark::State& state) {
+  HWY_DYNAMIC_DISPATCH(BM_Rec2408ToneMap)(state);
+}
+void BM_Rec2408ToneMapLut(benchmark::State& state) {
+  HWY_DYNAMIC_DISPATCH(BM_Rec2408ToneMapLut)(state);
+}
+void BM_FastSRGB8(benchmark::State& state) {
+  HWY_DYNAMIC_DISPATCH(BM_FastSRGB8)(state);
+}
+void BM_TableSRGB8(benchmark::State& state) {
+  HWY_DYNAMIC_DISPATCH(BM_TableSRGB8)(state);
+}
 
 void BM_SRGB_pow(benchmark::State& state) { RUN_BENCHMARK_SCALAR(SRGB_pow, 0); }
 
@@ -141,6 +259,10 @@ BENCHMARK(BM_PQDFE);
 BENCHMARK(BM_PQEFD);
 BENCHMARK(BM_PQSlowDFE);
 BENCHMARK(BM_PQSlowEFD);
+BENCHMARK(BM_Rec2408ToneMap);
+BENCHMARK(BM_Rec2408ToneMapLut);
+BENCHMARK(BM_FastSRGB8);
+BENCHMARK(BM_TableSRGB8);
 
 }  // namespace
 }  // namespace jxl
@@ -0,0 +1,121 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/trace.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace jxl {
+
+namespace {
+
+std::array<std::atomic<int64_t>, kNumTracePhases> trace_nanoseconds;
+
+// Threads currently in each phase, and since when one of them is.
+struct PhaseWallTime {
+  std::mutex mutex;
+  size_t active = 0;
+  std::chrono::steady_clock::time_point start;
+  int64_t nanoseconds = 0;
+};
+
+std::array<PhaseWallTime, kNumTracePhases> wall_times;
+
+thread_local size_t current_phase = kNumTracePhases;
+
+}  // namespace
+
+namespace detail {
+
+std::atomic<bool> tracing_enabled{false};
+
+size_t EnterTracePhase(TracePhase phase) {
+  const size_t previous = current_phase;
+  current_phase = static_cast<size_t>(phase);
+  PhaseWallTime& wall = wall_times[static_cast<size_t>(phase)];
+  std::lock_guard<std::mutex> lock(wall.mutex);
+  if (wall.active++ == 0) wall.start = std::chrono::steady_clock::now();
+  return previous;
+}
+
+void LeaveTracePhase(TracePhase phase, int64_t nanoseconds, size_t previous) {
+  current_phase = previous;
+  trace_nanoseconds[static_cast<size_t>(phase)].fetch_add(
+      nanoseconds, std::memory_order_relaxed);
+  PhaseWallTime& wall = wall_times[static_cast<size_t>(phase)];
+  std::lock_guard<std::mutex> lock(wall.mutex);
+  if (--wall.active == 0) {
+    wall.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - wall.start)
+                            .count();
+  }
+}
+
+}  // namespace detail
+
+const char* TracePhaseName(TracePhase phase) {
+  switch (phase) {
+    case TracePhase::kToXYB:
+      return "xyb";
+    case TracePhase::kEncoderHeuristics:
+      return "heuristics";
+    case TracePhase::kAcStrategy:
+      return "ac_strategy";
+    case TracePhase::kAdaptiveQuantization:
+      return "adaptive_quantization";
+    case TracePhase::kTokenize:
+      return "tokenize";
+    case TracePhase::kClusterHistograms:
+      return "cluster_histograms";
+    case TracePhase::kWriteTokens:
+      return "write_tokens";
+    case TracePhase::kDecodeGroups:
+      return "decode_groups";
+    case TracePhase::kRenderPipeline:
+      return "render_pipeline";
+  }
+  return "unknown";
+}
+
+void SetTracingEnabled(bool enabled) {
+  detail::tracing_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void ResetTrace() {
+  for (std::atomic<int64_t>& nanoseconds : trace_nanoseconds) {
+    nanoseconds.store(0, std::memory_order_relaxed);
+  }
+  for (PhaseWallTime& wall : wall_times) {
+    std::lock_guard<std::mutex> lock(wall.mutex);
+    wall.nanoseconds = 0;
+    wall.start = std::chrono::steady_clock::now();
+  }
+}
+
+std::array<double, kNumTracePhases> GetTrace() {
+  std::array<double, kNumTracePhases> seconds;
+  for (size_t i = 0; i < kNumTracePhases; ++i) {
+    seconds[i] = trace_nanoseconds[i].load(std::memory_order_relaxed) * 1e-9;
+  }
+  return seconds;
+}
+
+size_t CurrentTracePhase() { return current_phase; }
+
+std::array<double, kNumTracePhases> GetTraceWallTime() {
+  std::array<double, kNumTracePhases> seconds;
+  for (size_t i = 0; i < kNumTracePhases; ++i) {
+    std::lock_guard<std::mutex> lock(wall_times[i].mutex);
+    seconds[i] = wall_times[i].nanoseconds * 1e-9;
+  }
+  return seconds;
+}
+
+}  // namespace jxl
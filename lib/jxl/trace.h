@@ -0,0 +1,104 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_TRACE_H_
+#define LIB_JXL_TRACE_H_
+
+// Accumulates the time spent in the main phases of encoding and decoding, so
+// that benchmarks can show where the time goes. Tracing is process-wide and
+// disabled by default; a disabled scope costs one relaxed atomic load.
+//
+// Times are summed over all threads, so a phase that runs on a thread pool can
+// take longer than the wall clock. Phases nest, e.g. the AC strategy search is
+// also part of the encoder heuristics, and rendering part of decoding groups.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/jxl/base/common.h"
+
+namespace jxl {
+
+enum class TracePhase : uint32_t {
+  kToXYB,
+  kEncoderHeuristics,
+  kAcStrategy,
+  kAdaptiveQuantization,
+  kTokenize,
+  kClusterHistograms,
+  kWriteTokens,
+  kDecodeGroups,
+  kRenderPipeline,
+};
+
+constexpr size_t kNumTracePhases =
+    static_cast<size_t>(TracePhase::kRenderPipeline) + 1;
+
+// Short snake_case name, e.g. for JSON keys.
+const char* TracePhaseName(TracePhase phase);
+
+void SetTracingEnabled(bool enabled);
+
+// Sets the accumulated times to zero.
+void ResetTrace();
+
+// Returns the seconds spent in each phase since the last ResetTrace(),
+// indexed by TracePhase.
+std::array<double, kNumTracePhases> GetTrace();
+
+// Returns the wall clock seconds during which at least one thread was in each
+// phase since the last ResetTrace(), indexed by TracePhase. Unlike GetTrace(),
+// this shrinks as a phase is spread over more threads.
+std::array<double, kNumTracePhases> GetTraceWallTime();
+
+// Returns the innermost phase that the calling thread is in, as the index of
+// the TracePhase, or kNumTracePhases if it is in no scope traced while tracing
+// was enabled.
+size_t CurrentTracePhase();
+
+namespace detail {
+extern std::atomic<bool> tracing_enabled;
+// Returns the phase that the thread was in, to be restored on leaving.
+size_t EnterTracePhase(TracePhase phase);
+void LeaveTracePhase(TracePhase phase, int64_t nanoseconds, size_t previous);
+}  // namespace detail
+
+// Adds the lifetime of the scope to `phase`, if tracing is enabled.
+class TraceScope {
+ public:
+  explicit TraceScope(TracePhase phase)
+      : phase_(phase),
+        enabled_(detail::tracing_enabled.load(std::memory_order_relaxed)) {
+    if (!enabled_) return;
+    previous_ = detail::EnterTracePhase(phase_);
+    start_ = std::chrono::steady_clock::now();
+  }
+  ~TraceScope() {
+    if (!enabled_) return;
+    const auto elapsed = std::chrono::steady_clock::now() - start_;
+    detail::LeaveTracePhase(
+        phase_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        previous_);
+  }
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  TracePhase phase_;
+  bool enabled_;
+  size_t previous_ = kNumTracePhases;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define JXL_TRACE_SCOPE(phase) \
+  ::jxl::TraceScope JXL_JOIN(trace_scope_, __LINE__)(::jxl::TracePhase::phase)
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_TRACE_H_
@@ -0,0 +1,56 @@
+# Copyright (c) the JPEG XL Project Authors. All rights reserved.
+#
+# Use of this source code is governed by a BSD-style
+# license that can be found in the LICENSE file.
+
+# libfjxl: the fast lossless encoder of enc_fast_lossless.cc built on its own
+# (FJXL_STANDALONE), with no dependency on the rest of libjxl, highway or
+# brotli. It writes complete JPEG XL files with JxlFastLosslessEncode and the
+# other functions of enc_fast_lossless.h.
+add_library(fjxl jxl/enc_fast_lossless.cc)
+target_compile_definitions(fjxl PUBLIC -DFJXL_STANDALONE=1)
+set_property(TARGET fjxl PROPERTY POSITION_INDEPENDENT_CODE ON)
+
+target_include_directories(fjxl
+  PRIVATE
+    "${PROJECT_SOURCE_DIR}"
+  PUBLIC
+    "$<BUILD_INTERFACE:${CMAKE_CURRENT_SOURCE_DIR}/jxl>"
+    "$<INSTALL_INTERFACE:${CMAKE_INSTALL_INCLUDEDIR}/fjxl>")
+
+# Only the C API (Jxl* symbols) is exported.
+set_target_properties(fjxl PROPERTIES
+  VERSION ${JPEGXL_LIBRARY_VERSION}
+  SOVERSION ${JPEGXL_LIBRARY_SOVERSION}
+  LINK_DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/jxl/jxl.version)
+if(APPLE)
+  set_property(TARGET fjxl APPEND_STRING PROPERTY
+      LINK_FLAGS "-Wl,-exported_symbols_list,${CMAKE_CURRENT_SOURCE_DIR}/jxl/jxl_osx.syms")
+elseif(WIN32)
+  # The header has no dllexport annotations.
+  set_property(TARGET fjxl PROPERTY WINDOWS_EXPORT_ALL_SYMBOLS ON)
+else()
+  set_property(TARGET fjxl APPEND_STRING PROPERTY
+      LINK_FLAGS " -Wl,--version-script=${CMAKE_CURRENT_SOURCE_DIR}/jxl/jxl.version")
+endif()  # APPLE
+
+install(TARGETS fjxl
+  RUNTIME DESTINATION ${CMAKE_INSTALL_BINDIR}
+  LIBRARY DESTINATION ${CMAKE_INSTALL_LIBDIR}
+  ARCHIVE DESTINATION ${CMAKE_INSTALL_LIBDIR})
+install(FILES jxl/enc_fast_lossless.h
+  DESTINATION "${CMAKE_INSTALL_INCLUDEDIR}/fjxl")
+
+# Add a pkg-config file for libfjxl.
+if (BUILD_SHARED_LIBS)
+  set(JPEGXL_PRIVATE_LIBS "-lm ${PKGCONFIG_CXX_LIB}")
+  set(JPEGXL_PUBLIC_LIBS "")
+else()
+  set(JPEGXL_PRIVATE_LIBS "")
+  set(JPEGXL_PUBLIC_LIBS "-lm ${PKGCONFIG_CXX_LIB}")
+endif()
+
+configure_file("${CMAKE_CURRENT_SOURCE_DIR}/jxl/libfjxl.pc.in"
+               "libfjxl.pc" @ONLY)
+install(FILES "${CMAKE_CURRENT_BINARY_DIR}/libfjxl.pc"
+  DESTINATION "${CMAKE_INSTALL_LIBDIR}/pkgconfig")
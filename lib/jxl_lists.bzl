@@ -33,6 +33,7 @@ libjxl_base_sources = [
     "jxl/base/scope_guard.h",
     "jxl/base/span.h",
     "jxl/base/status.h",
+    "jxl/base/trace_events.h",
 ]
 
 libjxl_cms_sources = [
@@ -179,6 +180,7 @@ libjxl_dec_sources = [
     "jxl/dec_noise.h",
     "jxl/dec_patch_dictionary.cc",
     "jxl/dec_patch_dictionary.h",
+    "jxl/dec_stats.h",
     "jxl/dec_transforms-inl.h",
     "jxl/dec_xyb-inl.h",
     "jxl/dec_xyb.cc",
@@ -294,6 +296,8 @@ libjxl_dec_sources = [
     "jxl/splines.h",
     "jxl/toc.cc",
     "jxl/toc.h",
+    "jxl/trace.cc",
+    "jxl/trace.h",
     "jxl/transpose-inl.h",
     "jxl/xorshift128plus-inl.h",
 ]
@@ -409,6 +413,8 @@ libjxl_enc_sources = [
 libjxl_extras_for_tools_sources = [
     "extras/codec.cc",
     "extras/codec.h",
+    "extras/gain_map_render.cc",
+    "extras/gain_map_render.h",
     "extras/hlg.cc",
     "extras/hlg.h",
     "extras/metrics.cc",
@@ -446,10 +452,15 @@ libjxl_extras_sources = [
 
 libjxl_gbench_sources = [
     "extras/tone_mapping_gbench.cc",
+    "jxl/dec_ans_gbench.cc",
     "jxl/dec_external_image_gbench.cc",
+    "jxl/dec_transforms_gbench.cc",
+    "jxl/decode_gbench.cc",
     "jxl/enc_external_image_gbench.cc",
+    "jxl/encode_gbench.cc",
     "jxl/splines_gbench.cc",
     "jxl/tf_gbench.cc",
+    "threads/thread_parallel_runner_gbench.cc",
 ]
 
 libjxl_jpegli_lib_version = 62
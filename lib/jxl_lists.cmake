@@ -30,6 +30,7 @@ set(JPEGXL_INTERNAL_BASE_SOURCES
   jxl/base/scope_guard.h
   jxl/base/span.h
   jxl/base/status.h
+  jxl/base/trace_events.h
 )
 
 set(JPEGXL_INTERNAL_CMS_SOURCES
@@ -176,6 +177,7 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/dec_noise.h
   jxl/dec_patch_dictionary.cc
   jxl/dec_patch_dictionary.h
+  jxl/dec_stats.h
   jxl/dec_transforms-inl.h
   jxl/dec_xyb-inl.h
   jxl/dec_xyb.cc
@@ -291,6 +293,8 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/splines.h
   jxl/toc.cc
   jxl/toc.h
+  jxl/trace.cc
+  jxl/trace.h
   jxl/transpose-inl.h
   jxl/xorshift128plus-inl.h
 )
@@ -406,6 +410,8 @@ set(JPEGXL_INTERNAL_ENC_SOURCES
 set(JPEGXL_INTERNAL_EXTRAS_FOR_TOOLS_SOURCES
   extras/codec.cc
   extras/codec.h
+  extras/gain_map_render.cc
+  extras/gain_map_render.h
   extras/hlg.cc
   extras/hlg.h
   extras/metrics.cc
@@ -443,10 +449,15 @@ set(JPEGXL_INTERNAL_EXTRAS_SOURCES
 
 set(JPEGXL_INTERNAL_GBENCH_SOURCES
   extras/tone_mapping_gbench.cc
+  jxl/dec_ans_gbench.cc
   jxl/dec_external_image_gbench.cc
+  jxl/dec_transforms_gbench.cc
+  jxl/decode_gbench.cc
   jxl/enc_external_image_gbench.cc
+  jxl/encode_gbench.cc
   jxl/splines_gbench.cc
   jxl/tf_gbench.cc
+  threads/thread_parallel_runner_gbench.cc
 )
 
 set(JPEGXL_INTERNAL_JPEGLI_LIBJPEG_HELPER_FILES
@@ -102,6 +102,25 @@ void JxlThreadParallelRunnerDestroy(void* runner_opaque) {
   }
 }
 
+JxlParallelRetCode JxlThreadParallelRunnerSetAffinity(void* runner_opaque,
+                                                     const size_t* cpus,
+                                                     size_t num_cpus) {
+  jpegxl::ThreadParallelRunner* runner =
+      reinterpret_cast<jpegxl::ThreadParallelRunner*>(runner_opaque);
+  if (!runner || !cpus || num_cpus == 0) return JXL_PARALLEL_RET_RUNNER_ERROR;
+  return runner->SetAffinity(cpus, num_cpus) ? JXL_PARALLEL_RET_SUCCESS
+                                             : JXL_PARALLEL_RET_RUNNER_ERROR;
+}
+
+JxlParallelRetCode JxlThreadParallelRunnerSetSpinTime(void* runner_opaque,
+                                                     uint32_t spin_us) {
+  jpegxl::ThreadParallelRunner* runner =
+      reinterpret_cast<jpegxl::ThreadParallelRunner*>(runner_opaque);
+  if (!runner) return JXL_PARALLEL_RET_RUNNER_ERROR;
+  runner->SetSpinTime(spin_us);
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
 // Get default value for num_worker_threads parameter of
 // InitJxlThreadParallelRunner.
 size_t JxlThreadParallelRunnerDefaultNumWorkerThreads() {
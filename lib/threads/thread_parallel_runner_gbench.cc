@@ -0,0 +1,215 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/codestream_header.h>
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
+#include <jxl/encode.h>
+#include <jxl/encode_cxx.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
+#include <jxl/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+constexpr size_t kNumWorkerThreads = 8;
+
+// Busy work proportional to `cost`.
+uint32_t Work(uint32_t cost) {
+  uint32_t x = cost;
+  for (uint32_t i = 0; i < cost; ++i) {
+    x = x * 1664525u + 1013904223u;
+  }
+  return x;
+}
+
+// Runs state.range() tasks with the given per-task cost.
+template <class Cost>
+void RunTasks(benchmark::State& state, const Cost& cost) {
+  const uint32_t num_tasks = state.range();
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(nullptr, kNumWorkerThreads);
+  ThreadPool pool(JxlThreadParallelRunner, runner.get());
+  std::atomic<uint32_t> sink{0};
+  const auto process = [&](const uint32_t task, size_t) -> Status {
+    sink.fetch_add(Work(cost(task)), std::memory_order_relaxed);
+    return true;
+  };
+  for (auto _ : state) {
+    (void)_;
+    BM_CHECK(RunOnPool(&pool, 0, num_tasks, ThreadPool::NoInit, process,
+                       "Tasks"));
+  }
+  benchmark::DoNotOptimize(sink.load());
+  state.SetItemsProcessed(num_tasks * state.iterations());
+}
+
+void BM_RunnerUniformTasks(benchmark::State& state) {
+  RunTasks(state, [](uint32_t) -> uint32_t { return 1000; });
+}
+
+// Few expensive tasks among many cheap ones, like detailed groups among flat
+// ones.
+void BM_RunnerUnevenTasks(benchmark::State& state) {
+  RunTasks(state, [](uint32_t task) -> uint32_t {
+    return (task * 2654435761u) % 16 == 0 ? 100000 : 100;
+  });
+}
+
+// Few cheap tasks, where the scheduling overhead dominates.
+void BM_RunnerTinyTasks(benchmark::State& state) {
+  RunTasks(state, [](uint32_t) -> uint32_t { return 1; });
+}
+
+BENCHMARK(BM_RunnerUniformTasks)->Range(16, 1 << 14)->UseRealTime();
+BENCHMARK(BM_RunnerUnevenTasks)->Range(16, 1 << 14)->UseRealTime();
+BENCHMARK(BM_RunnerTinyTasks)->Range(16, 1 << 14)->UseRealTime();
+
+constexpr size_t kImageSize = 1024;
+
+// Half of the image is flat and the other half is noise, so that the groups
+// are very uneven.
+std::vector<uint8_t> MakeUnevenImage() {
+  std::vector<uint8_t> pixels(kImageSize * kImageSize * 3);
+  uint32_t rng = 1;
+  for (size_t y = 0; y < kImageSize; ++y) {
+    for (size_t x = 0; x < kImageSize * 3; ++x) {
+      rng = rng * 1664525u + 1013904223u;
+      pixels[y * kImageSize * 3 + x] = y < kImageSize / 2 ? 128 : rng >> 24;
+    }
+  }
+  return pixels;
+}
+
+bool Encode(JxlParallelRunner runner, void* runner_opaque, bool lossless,
+            std::vector<uint8_t>* compressed) {
+  const std::vector<uint8_t> pixels = MakeUnevenImage();
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  if (JxlEncoderSetParallelRunner(enc.get(), runner, runner_opaque) !=
+      JXL_ENC_SUCCESS) {
+    return false;
+  }
+  JxlBasicInfo info;
+  JxlEncoderInitBasicInfo(&info);
+  info.xsize = kImageSize;
+  info.ysize = kImageSize;
+  info.bits_per_sample = 8;
+  info.uses_original_profile = TO_JXL_BOOL(lossless);
+  if (JxlEncoderSetBasicInfo(enc.get(), &info) != JXL_ENC_SUCCESS) return false;
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+  if (JxlEncoderSetColorEncoding(enc.get(), &color_encoding) !=
+      JXL_ENC_SUCCESS) {
+    return false;
+  }
+  JxlEncoderFrameSettings* settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  if (lossless && JxlEncoderSetFrameLossless(settings, JXL_TRUE) !=
+                      JXL_ENC_SUCCESS) {
+    return false;
+  }
+  const JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  if (JxlEncoderAddImageFrame(settings, &format, pixels.data(),
+                              pixels.size()) != JXL_ENC_SUCCESS) {
+    return false;
+  }
+  JxlEncoderCloseInput(enc.get());
+  compressed->resize(1 << 16);
+  uint8_t* next_out = compressed->data();
+  size_t avail_out = compressed->size();
+  for (;;) {
+    const JxlEncoderStatus status =
+        JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+    if (status == JXL_ENC_SUCCESS) break;
+    if (status != JXL_ENC_NEED_MORE_OUTPUT) return false;
+    const size_t offset = next_out - compressed->data();
+    compressed->resize(compressed->size() * 2);
+    next_out = compressed->data() + offset;
+    avail_out = compressed->size() - offset;
+  }
+  compressed->resize(next_out - compressed->data());
+  return true;
+}
+
+bool Decode(JxlParallelRunner runner, void* runner_opaque,
+            const std::vector<uint8_t>& compressed) {
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  if (JxlDecoderSetParallelRunner(dec.get(), runner, runner_opaque) !=
+          JXL_DEC_SUCCESS ||
+      JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE) !=
+          JXL_DEC_SUCCESS ||
+      JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size()) !=
+          JXL_DEC_SUCCESS) {
+    return false;
+  }
+  JxlDecoderCloseInput(dec.get());
+  const JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels(kImageSize * kImageSize * 3);
+  for (;;) {
+    const JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_SUCCESS) return true;
+    if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      if (JxlDecoderSetImageOutBuffer(dec.get(), &format, pixels.data(),
+                                      pixels.size()) != JXL_DEC_SUCCESS) {
+        return false;
+      }
+    } else if (status != JXL_DEC_FULL_IMAGE) {
+      return false;
+    }
+  }
+}
+
+// state.range(0) is 1 for lossless (modular) and 0 for VarDCT.
+void BM_RunnerEncode(benchmark::State& state) {
+  const bool lossless = state.range(0) != 0;
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(nullptr, kNumWorkerThreads);
+  std::vector<uint8_t> compressed;
+  for (auto _ : state) {
+    (void)_;
+    BM_CHECK(Encode(JxlThreadParallelRunner, runner.get(), lossless,
+                    &compressed));
+  }
+  state.SetItemsProcessed(kImageSize * kImageSize * state.iterations());
+}
+
+void BM_RunnerDecode(benchmark::State& state) {
+  const bool lossless = state.range(0) != 0;
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(nullptr, kNumWorkerThreads);
+  std::vector<uint8_t> compressed;
+  BM_CHECK(
+      Encode(JxlThreadParallelRunner, runner.get(), lossless, &compressed));
+  for (auto _ : state) {
+    (void)_;
+    BM_CHECK(Decode(JxlThreadParallelRunner, runner.get(), compressed));
+  }
+  state.SetItemsProcessed(kImageSize * kImageSize * state.iterations());
+}
+
+BENCHMARK(BM_RunnerEncode)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_RunnerDecode)->Arg(0)->Arg(1)->UseRealTime();
+
+}  // namespace
+}  // namespace jxl
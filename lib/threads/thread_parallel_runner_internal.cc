@@ -10,13 +10,24 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <mutex>
 #include <thread>
 
+#include "lib/jxl/base/arch_macros.h"
 #include "lib/jxl/base/compiler_specific.h"
 
+#if JXL_ARCH_X64
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace jpegxl {
 
 // static
@@ -32,8 +43,9 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
   if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
 
   // Use a sequential run when num_worker_threads_ is zero since we have no
-  // worker threads.
-  if (self->num_worker_threads_ == 0) {
+  // worker threads, or when there is a single task, which the calling thread
+  // would run anyway; waking workers for it costs more than it saves.
+  if (self->num_worker_threads_ == 0 || end_range - start_range == 1) {
     const size_t thread = 0;
     for (uint32_t task = start_range; task < end_range; ++task) {
       func(jpegxl_opaque, task, thread);
@@ -41,70 +53,163 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     return JXL_PARALLEL_RET_SUCCESS;
   }
 
-  if (self->depth_.fetch_add(1, std::memory_order_acq_rel) != 0) {
-    return JXL_PARALLEL_RET_RUNNER_ERROR;  // Must not re-enter.
+  // The calling thread runs tasks too and idle workers (if any) join in.
+  Job job(func, jpegxl_opaque, start_range, end_range, self->num_threads_);
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->jobs_.push_back(&job);
+    self->work_generation_.fetch_add(1, std::memory_order_relaxed);
   }
+  self->work_cv_.notify_all();
 
-  const WorkerCommand worker_command =
-      (static_cast<WorkerCommand>(start_range) << 32) + end_range;
-  // Ensure the inputs do not result in a reserved command.
-  if ((worker_command == kWorkerWait) || (worker_command == kWorkerOnce) ||
-      (worker_command == kWorkerExit)) {
-    return JXL_PARALLEL_RET_RUNNER_ERROR;
+  self->RunJob(&job, /*thread=*/0);
+
+  // Wait for the workers to complete the tasks they started; `job` must
+  // outlive their accesses to it.
+  std::unique_lock<std::mutex> lock(self->mutex_);
+  self->ForgetJob(&job);
+  --job.num_active;
+  while (job.num_active != 0) {
+    self->done_cv_.wait(lock);
   }
+  return JXL_PARALLEL_RET_SUCCESS;
+}
 
-  self->data_func_ = func;
-  self->jpegxl_opaque_ = jpegxl_opaque;
-  self->num_reserved_.store(0, std::memory_order_relaxed);
+ThreadParallelRunner::Job* ThreadParallelRunner::PickJob() {
+  Job* best = nullptr;
+  for (size_t i = 0; i < jobs_.size();) {
+    Job* job = jobs_[i];
+    if (job->Exhausted()) {
+      jobs_.erase(jobs_.begin() + i);
+      continue;
+    }
+    ++i;
+    // All the thread indices passed to `init` are in use.
+    if (job->num_thread_ids >= num_threads_) continue;
+    if (!best || job->num_active < best->num_active) best = job;
+  }
+  return best;
+}
 
-  self->StartWorkers(worker_command);
-  self->WorkersReadyBarrier();
+void ThreadParallelRunner::ForgetJob(const Job* job) {
+  const auto it = std::find(jobs_.begin(), jobs_.end(), job);
+  if (it != jobs_.end()) jobs_.erase(it);
+}
+
+namespace {
 
-  if (self->depth_.fetch_add(-1, std::memory_order_acq_rel) != 1) {
-    return JXL_PARALLEL_RET_RUNNER_ERROR;
+// Hints the CPU that this is a spin-wait loop.
+inline void Pause() {
+#if JXL_ARCH_X64
+  _mm_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+}  // namespace
+
+bool ThreadParallelRunner::SpinForWork(std::unique_lock<std::mutex>& lock) {
+  const uint32_t spin_us = spin_us_.load(std::memory_order_relaxed);
+  if (spin_us == 0) return false;
+  const uint64_t generation = work_generation_.load(std::memory_order_relaxed);
+  lock.unlock();
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+  for (uint32_t i = 1;; ++i) {
+    if (work_generation_.load(std::memory_order_relaxed) != generation) break;
+    Pause();
+    // Reading the clock is slower than a pause, so only check it sometimes.
+    if (i % 64 == 0 && std::chrono::steady_clock::now() >= deadline) break;
   }
-  return JXL_PARALLEL_RET_SUCCESS;
+  lock.lock();
+  // The generation only changes with mutex_ held, so this is exact.
+  return work_generation_.load(std::memory_order_relaxed) != generation;
 }
 
-// static
-void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
-                                    const WorkerCommand command,
-                                    const int thread) {
-  const uint32_t begin = command >> 32;
-  const uint32_t end = command & 0xFFFFFFFF;
-  const uint32_t num_tasks = end - begin;
-  const uint32_t num_worker_threads = self->num_worker_threads_;
-
-  // OpenMP introduced several "schedule" strategies:
-  // "single" (static assignment of exactly one chunk per thread): slower.
-  // "dynamic" (allocates k tasks at a time): competitive for well-chosen k.
-  // "guided" (allocates k tasks, decreases k): computing k = remaining/n
-  //   is faster than halving k each iteration. We prefer this strategy
-  //   because it avoids user-specified parameters.
+namespace {
 
+constexpr uint64_t PackRange(const uint32_t begin, const uint32_t end) {
+  return (static_cast<uint64_t>(begin) << 32) | end;
+}
+constexpr uint32_t RangeBegin(const uint64_t bits) { return bits >> 32; }
+constexpr uint32_t RangeEnd(const uint64_t bits) { return bits & 0xFFFFFFFF; }
+constexpr uint32_t RangeSize(const uint64_t bits) {
+  return RangeBegin(bits) < RangeEnd(bits) ? RangeEnd(bits) - RangeBegin(bits)
+                                           : 0;
+}
+
+}  // namespace
+
+ThreadParallelRunner::Job::Job(JxlParallelRunFunction func, void* opaque,
+                               const uint32_t begin, const uint32_t end,
+                               const uint32_t num_threads)
+    : func(func),
+      opaque(opaque),
+      num_ranges(num_threads),
+      ranges(new TaskRange[num_threads]) {
+  const uint64_t num_tasks = end - begin;
+  for (uint32_t i = 0; i < num_ranges; ++i) {
+    const uint32_t range_begin = begin + num_tasks * i / num_ranges;
+    const uint32_t range_end = begin + num_tasks * (i + 1) / num_ranges;
+    ranges[i].bits.store(PackRange(range_begin, range_end),
+                         std::memory_order_relaxed);
+  }
+}
+
+bool ThreadParallelRunner::Job::Exhausted() const {
+  for (uint32_t i = 0; i < num_ranges; ++i) {
+    if (RangeSize(ranges[i].bits.load(std::memory_order_relaxed)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// static
+void ThreadParallelRunner::RunJob(Job* job, const uint32_t thread) {
+  std::atomic<uint64_t>& own = job->ranges[thread].bits;
   for (;;) {
-#if JXL_FALSE
-    // dynamic
-    const uint32_t my_size = std::max(num_tasks / (num_worker_threads * 4), 1);
-#else
-    // guided
-    const uint32_t num_reserved =
-        self->num_reserved_.load(std::memory_order_relaxed);
-    // It is possible that more tasks are reserved than ready to run.
-    const uint32_t num_remaining =
-        num_tasks - std::min(num_reserved, num_tasks);
-    const uint32_t my_size =
-        std::max(num_remaining / (num_worker_threads * 4), 1u);
-#endif
-    const uint32_t my_begin = begin + self->num_reserved_.fetch_add(
-                                          my_size, std::memory_order_relaxed);
-    const uint32_t my_end = std::min(my_begin + my_size, begin + num_tasks);
-    // Another thread already reserved the last task.
-    if (my_begin >= my_end) {
-      break;
+    // Take tasks one at a time from the front of the own range; only thieves
+    // compete for it, so this rarely fails. Unlike a shared counter, this
+    // keeps uneven tasks (e.g. flat and detailed groups) balanced without
+    // choosing a chunk size.
+    uint64_t bits = own.load(std::memory_order_relaxed);
+    while (RangeSize(bits) != 0) {
+      const uint32_t task = RangeBegin(bits);
+      if (!own.compare_exchange_weak(bits, PackRange(task + 1, RangeEnd(bits)),
+                                     std::memory_order_relaxed)) {
+        continue;  // `bits` was reloaded.
+      }
+      job->func(job->opaque, task, thread);
+      bits = own.load(std::memory_order_relaxed);
     }
-    for (uint32_t task = my_begin; task < my_end; ++task) {
-      self->data_func_(self->jpegxl_opaque_, task, thread);
+
+    // Steal the back half of the largest remaining range. Task indices are
+    // handed out only once, so a range never returns to a previous non-empty
+    // value and the compare-exchange cannot succeed on a stale one.
+    for (;;) {
+      uint32_t victim = thread;
+      uint64_t victim_bits = 0;
+      for (uint32_t i = 0; i < job->num_ranges; ++i) {
+        const uint64_t other = job->ranges[i].bits.load(
+            std::memory_order_relaxed);
+        if (RangeSize(other) > RangeSize(victim_bits)) {
+          victim = i;
+          victim_bits = other;
+        }
+      }
+      // All the tasks are started.
+      if (RangeSize(victim_bits) == 0) return;
+      const uint32_t end = RangeEnd(victim_bits);
+      const uint32_t split = end - (RangeSize(victim_bits) + 1) / 2;
+      if (job->ranges[victim].bits.compare_exchange_strong(
+              victim_bits, PackRange(RangeBegin(victim_bits), split),
+              std::memory_order_relaxed)) {
+        // The own range is empty, so nobody else can modify it meanwhile.
+        own.store(PackRange(split, end), std::memory_order_relaxed);
+        break;
+      }
     }
   }
 }
@@ -112,59 +217,85 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
                                       const int thread) {
-  // Until kWorkerExit command received:
+  uint64_t each_thread_generation = 0;
+  std::unique_lock<std::mutex> lock(self->mutex_);
+  // Until the destructor sets exit_:
   for (;;) {
-    std::unique_lock<std::mutex> lock(self->mutex_);
-    // Notify main thread that this thread is ready.
-    if (++self->workers_ready_ == self->num_threads_) {
-      self->workers_ready_cv_.notify_one();
+    if (self->exit_) return;
+    if (each_thread_generation != self->each_thread_generation_) {
+      each_thread_generation = self->each_thread_generation_;
+      const JxlParallelRunFunction func = self->each_thread_func_;
+      void* opaque = self->each_thread_opaque_;
+      lock.unlock();
+      func(opaque, thread, thread);
+      lock.lock();
+      if (++self->each_thread_done_ == self->num_worker_threads_) {
+        self->done_cv_.notify_all();
+      }
+      continue;
     }
-  RESUME_WAIT:
-    // Wait for a command.
-    self->worker_start_cv_.wait(lock);
-    const WorkerCommand command = self->worker_start_command_;
-    switch (command) {
-      case kWorkerWait:    // spurious wakeup:
-        goto RESUME_WAIT;  // lock still held, avoid incrementing ready.
-      case kWorkerOnce:
-        lock.unlock();
-        self->data_func_(self->jpegxl_opaque_, thread, thread);
-        break;
-      case kWorkerExit:
-        return;  // exits thread
-      default:
-        lock.unlock();
-        RunRange(self, command, thread);
-        break;
+    Job* job = self->PickJob();
+    if (!job) {
+      if (!self->SpinForWork(lock)) self->work_cv_.wait(lock);
+      continue;
+    }
+    const uint32_t job_thread = job->num_thread_ids++;
+    ++job->num_active;
+    lock.unlock();
+    self->RunJob(job, job_thread);
+    lock.lock();
+    // All the tasks are reserved, so no other worker needs to join.
+    self->ForgetJob(job);
+    if (--job->num_active == 0) {
+      self->done_cv_.notify_all();
     }
   }
 }
 
+bool ThreadParallelRunner::SetAffinity(const size_t* cpus,
+                                       const size_t num_cpus) {
+#if defined(__linux__)
+  std::atomic<bool> ok{true};
+  const auto pin = [&](const int thread, int) {
+    const size_t cpu = cpus[thread % num_cpus];
+    if (cpu >= CPU_SETSIZE) {
+      ok.store(false);
+      return;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) !=
+        0) {
+      ok.store(false);
+    }
+  };
+  if (num_worker_threads_ == 0) return true;
+  RunOnEachThread(pin);
+  return ok.load();
+#else
+  (void)cpus;
+  (void)num_cpus;
+  return num_worker_threads_ == 0;
+#endif
+}
+
 ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
     : num_worker_threads_(num_worker_threads),
       num_threads_(std::max(num_worker_threads, 1)) {
   threads_.reserve(num_worker_threads_);
-
-  // Suppress "unused-private-field" warning.
-  (void)padding1;
-  (void)padding2;
-
-  // Safely handle spurious worker wakeups.
-  worker_start_command_ = kWorkerWait;
-
   for (uint32_t i = 0; i < num_worker_threads_; ++i) {
     threads_.emplace_back(ThreadFunc, this, i);
   }
-
-  if (num_worker_threads_ != 0) {
-    WorkersReadyBarrier();
-  }
 }
 
 ThreadParallelRunner::~ThreadParallelRunner() {
-  if (num_worker_threads_ != 0) {
-    StartWorkers(kWorkerExit);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
+    work_generation_.fetch_add(1, std::memory_order_relaxed);
   }
+  work_cv_.notify_all();
 
   for (std::thread& thread : threads_) {
     if (thread.joinable()) {
@@ -11,15 +11,18 @@
 // JxlParallelRunner when using the JPEG XL library. This uses std::thread
 // internally and related synchronization functions. The number of threads
 // created is fixed at construction time and the threads are re-used for every
-// ThreadParallelRunner::Runner call. Only one concurrent Runner() call per
-// instance is allowed at a time.
+// ThreadParallelRunner::Runner call. Runner() may be called concurrently, e.g.
+// by several decoders sharing one instance, and from within the tasks of
+// another Runner() call; the workers are shared between all the pending calls.
 //
 // This is a scalable, lower-overhead thread pool runner, especially suitable
 // for data-parallel computations in the fork-join model, where clients need to
 // know when all tasks have completed.
 //
-// This thread pool can efficiently load-balance millions of tasks using an
-// atomic counter, thus avoiding per-task virtual or system calls. With 48
+// This thread pool can efficiently load-balance millions of tasks using
+// per-thread ranges of tasks in atomic words, from which idle threads steal
+// half of the largest remaining range, thus avoiding per-task virtual or
+// system calls and contention on a single counter. With 48
 // hyperthreads and 1M tasks that add to an atomic counter, overall runtime is
 // 10-20x higher when using std::async, and ~200x for a queue-based thread
 // pool.
@@ -40,6 +43,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
 #include <mutex>               //NOLINT
 #include <thread>              //NOLINT
 #include <vector>
@@ -70,7 +74,8 @@ class ThreadParallelRunner {
 
   // Runs func(thread, thread) on all thread(s) that may participate in Run.
   // If NumThreads() == 0, runs on the main thread with thread == 0, otherwise
-  // concurrently called by each worker thread in [0, NumThreads()).
+  // concurrently called by each worker thread in [0, NumThreads()). Must not
+  // be called concurrently with itself or from within a task.
   template <class Func>
   void RunOnEachThread(const Func& func) {
     if (num_worker_threads_ == 0) {
@@ -79,29 +84,66 @@ class ThreadParallelRunner {
       return;
     }
 
-    data_func_ = reinterpret_cast<JxlParallelRunFunction>(&CallClosure<Func>);
-    jpegxl_opaque_ = const_cast<void*>(static_cast<const void*>(&func));
-    StartWorkers(kWorkerOnce);
-    WorkersReadyBarrier();
+    std::unique_lock<std::mutex> lock(mutex_);
+    each_thread_func_ =
+        reinterpret_cast<JxlParallelRunFunction>(&CallClosure<Func>);
+    each_thread_opaque_ = const_cast<void*>(static_cast<const void*>(&func));
+    each_thread_done_ = 0;
+    ++each_thread_generation_;
+    work_generation_.fetch_add(1, std::memory_order_relaxed);
+    work_cv_.notify_all();
+    while (each_thread_done_ != num_worker_threads_) {
+      done_cv_.wait(lock);
+    }
+  }
+
+  // Pins worker thread i to CPU cpus[i % num_cpus]. Returns false if any of
+  // them could not be pinned, e.g. if not supported on this platform. Must not
+  // be called from within a task.
+  bool SetAffinity(const size_t* cpus, size_t num_cpus);
+
+  // Lets idle workers spin for up to `spin_us` microseconds, waiting for new
+  // tasks, before they block. May be called at any time.
+  void SetSpinTime(uint32_t spin_us) {
+    spin_us_.store(spin_us, std::memory_order_relaxed);
   }
 
   JxlMemoryManager memory_manager;
 
  private:
-  // After construction and between calls to Run, workers are "ready", i.e.
-  // waiting on worker_start_cv_. They are "started" by sending a "command"
-  // and notifying all worker_start_cv_ waiters. (That is why all workers
-  // must be ready/waiting - otherwise, the notification will not reach all of
-  // them and the main thread waits in vain for them to report readiness.)
-  using WorkerCommand = uint64_t;
-
-  // Special values; all others encode the begin/end parameters. Note that all
-  // these are no-op ranges (begin >= end) and therefore never used to encode
-  // ranges.
-  static constexpr WorkerCommand kWorkerWait = ~1ULL;
-  static constexpr WorkerCommand kWorkerOnce = ~2ULL;
-  static constexpr WorkerCommand kWorkerExit = ~3ULL;
+  // One pending Runner() call. Lives on the stack of the calling thread, which
+  // also runs its tasks, so that nested calls make progress even when all the
+  // workers are busy.
+  // Tasks [begin, end) not yet started, packed as (begin << 32) | end. The
+  // thread owning the range takes tasks from the front, other threads steal
+  // from the back; padding avoids false sharing.
+  struct TaskRange {
+    TaskRange() {
+      // Suppress "unused-private-field" warning.
+      (void)padding;
+    }
+    std::atomic<uint64_t> bits{0};
+    uint8_t padding[64 - sizeof(uint64_t)];
+  };
+
+  struct Job {
+    Job(JxlParallelRunFunction func, void* opaque, uint32_t begin,
+        uint32_t end, uint32_t num_threads);
+
+    const JxlParallelRunFunction func;
+    void* const opaque;
+
+    // Guarded by mutex_. The caller has thread index 0 and is active until
+    // all the tasks are started.
+    uint32_t num_thread_ids = 1;
+    uint32_t num_active = 1;
 
+    // One range per thread index, initially an even split of the tasks.
+    const uint32_t num_ranges;
+    std::unique_ptr<TaskRange[]> ranges;
+
+    bool Exhausted() const;
+  };
   // Calls f(task, thread). Used for type erasure of Func arguments. The
   // signature must match JxlParallelRunFunction, hence a void* argument.
   template <class Closure>
@@ -109,31 +151,21 @@ class ThreadParallelRunner {
     (*reinterpret_cast<const Closure*>(f))(task, thread);
   }
 
-  void WorkersReadyBarrier() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    // Typically only a single iteration.
-    while (workers_ready_ != threads_.size()) {
-      workers_ready_cv_.wait(lock);
-    }
-    workers_ready_ = 0;
+  // Returns the pending job that has tasks left and the fewest threads working
+  // on it, so that concurrent jobs share the workers fairly, or nullptr.
+  // Forgets the jobs that have no tasks left. Requires mutex_.
+  Job* PickJob();
 
-    // Safely handle spurious worker wakeups.
-    worker_start_command_ = kWorkerWait;
-  }
+  // Removes `job` from jobs_ if still there. Requires mutex_.
+  void ForgetJob(const Job* job);
 
-  // Precondition: all workers are ready.
-  void StartWorkers(const WorkerCommand worker_command) {
-    mutex_.lock();
-    worker_start_command_ = worker_command;
-    // Workers will need this lock, so release it before they wake up.
-    mutex_.unlock();
-    worker_start_cv_.notify_all();
-  }
+  // Releases `lock` on mutex_ for up to spin_us_ while no work is added, then
+  // reacquires it. Returns whether work was added in the meantime.
+  bool SpinForWork(std::unique_lock<std::mutex>& lock);
 
-  // Attempts to reserve and perform some work from the global range of tasks,
-  // which is encoded within "command". Returns after all tasks are reserved.
-  static void RunRange(ThreadParallelRunner* self, WorkerCommand command,
-                       int thread);
+  // Performs the tasks of the range of `thread`, then steals from the other
+  // ranges of `job` until all of its tasks are started.
+  static void RunJob(Job* job, uint32_t thread);
 
   static void ThreadFunc(ThreadParallelRunner* self, int thread);
 
@@ -143,22 +175,24 @@ class ThreadParallelRunner {
   const uint32_t num_worker_threads_;  // == threads_.size()
   const uint32_t num_threads_;
 
-  std::atomic<int> depth_{0};  // detects if Run is re-entered (not supported).
-
-  std::mutex mutex_;  // guards both cv and their variables.
-  std::condition_variable workers_ready_cv_;
-  uint32_t workers_ready_ = 0;
-  std::condition_variable worker_start_cv_;
-  WorkerCommand worker_start_command_;
-
-  // Written by main thread, read by workers (after mutex lock/unlock).
-  JxlParallelRunFunction data_func_;
-  void* jpegxl_opaque_;
-
-  // Updated by workers; padding avoids false sharing.
-  uint8_t padding1[64];
-  std::atomic<uint32_t> num_reserved_{0};
-  uint8_t padding2[64];
+  std::mutex mutex_;  // guards both cv and the variables below.
+  // Notified when a job is added, for RunOnEachThread and on exit.
+  std::condition_variable work_cv_;
+  // Notified when a job or a RunOnEachThread call is complete.
+  std::condition_variable done_cv_;
+  std::vector<Job*> jobs_;
+  bool exit_ = false;
+  // Incremented, with mutex_ held, whenever work_cv_ is notified, so that
+  // spinning workers notice new work without taking mutex_.
+  std::atomic<uint64_t> work_generation_{0};
+  std::atomic<uint32_t> spin_us_{0};
+
+  // RunOnEachThread state: workers run each_thread_func_ once when they see a
+  // new generation.
+  uint64_t each_thread_generation_ = 0;
+  uint32_t each_thread_done_ = 0;
+  JxlParallelRunFunction each_thread_func_ = nullptr;
+  void* each_thread_opaque_ = nullptr;
 };
 
 }  // namespace jpegxl
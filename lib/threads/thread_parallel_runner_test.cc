@@ -3,9 +3,14 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <jxl/parallel_runner.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
+
 #include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <thread>
 #include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
@@ -125,5 +130,104 @@ TEST(ThreadParallelRunnerTest, TestCounter) {
   EXPECT_EQ(expected, counters[0].counter);
 }
 
+// Runs the pool from within its own tasks.
+TEST(ThreadParallelRunnerTest, TestNested) {
+  const int kNumThreads = 4;
+  ThreadPoolForTests pool(kNumThreads);
+  const int kNumOuter = 16;
+  const int kNumInner = 32;
+  std::atomic<int> sum{0};
+  const auto outer = [&](const int outer_task, int) -> jxl::Status {
+    const auto inner = [&](const int inner_task, int thread) -> jxl::Status {
+      EXPECT_LT(thread, kNumThreads);
+      sum.fetch_add(outer_task * kNumInner + inner_task);
+      return true;
+    };
+    return RunOnPool(pool.get(), 0, kNumInner, jxl::ThreadPool::NoInit, inner,
+                     "TestNestedInner");
+  };
+  EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumOuter, jxl::ThreadPool::NoInit,
+                        outer, "TestNestedOuter"));
+  const int n = kNumOuter * kNumInner;
+  EXPECT_EQ(n * (n - 1) / 2, sum.load());
+}
+
+// Runs the pool from several threads at once, e.g. one per decoder.
+TEST(ThreadParallelRunnerTest, TestConcurrent) {
+  const int kNumThreads = 4;
+  ThreadPoolForTests pool(kNumThreads);
+  const int kNumCallers = 3;
+  const int kNumRuns = 20;
+  const int kNumTasks = 100;
+  std::vector<int> sums(kNumCallers);
+  std::vector<std::thread> callers;
+  for (int caller = 0; caller < kNumCallers; ++caller) {
+    callers.emplace_back([&, caller]() {
+      for (int run = 0; run < kNumRuns; ++run) {
+        std::vector<int> counters(kNumThreads);
+        const auto count = [&](const int task, int thread) -> jxl::Status {
+          counters[thread] += task;
+          return true;
+        };
+        EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks,
+                              jxl::ThreadPool::NoInit, count,
+                              "TestConcurrent"));
+        for (int counter : counters) sums[caller] += counter;
+      }
+    });
+  }
+  for (std::thread& caller : callers) caller.join();
+  for (int caller = 0; caller < kNumCallers; ++caller) {
+    EXPECT_EQ(kNumRuns * kNumTasks * (kNumTasks - 1) / 2, sums[caller]);
+  }
+}
+
+TEST(ThreadParallelRunnerTest, TestSetAffinity) {
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(/*memory_manager=*/nullptr, 4);
+  const size_t cpus[] = {0};
+  EXPECT_EQ(JXL_PARALLEL_RET_RUNNER_ERROR,
+            JxlThreadParallelRunnerSetAffinity(runner.get(), cpus, 0));
+#if defined(__linux__)
+  EXPECT_EQ(JXL_PARALLEL_RET_SUCCESS,
+            JxlThreadParallelRunnerSetAffinity(runner.get(), cpus, 1));
+#endif
+  // The pinned workers still run tasks.
+  jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+  std::atomic<int> num_calls{0};
+  const auto count = [&num_calls](int /*task*/, int) -> jxl::Status {
+    num_calls.fetch_add(1);
+    return true;
+  };
+  EXPECT_TRUE(RunOnPool(&pool, 0, 100, jxl::ThreadPool::NoInit, count,
+                        "TestSetAffinity"));
+  EXPECT_EQ(100, num_calls.load());
+}
+
+TEST(ThreadParallelRunnerTest, TestSpinTime) {
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(/*memory_manager=*/nullptr, 4);
+  EXPECT_EQ(JXL_PARALLEL_RET_RUNNER_ERROR,
+            JxlThreadParallelRunnerSetSpinTime(nullptr, 100));
+  EXPECT_EQ(JXL_PARALLEL_RET_SUCCESS,
+            JxlThreadParallelRunnerSetSpinTime(runner.get(), 100));
+  // Many short calls, with and without spinning workers.
+  jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+  for (uint32_t spin_us : {100u, 0u}) {
+    EXPECT_EQ(JXL_PARALLEL_RET_SUCCESS,
+              JxlThreadParallelRunnerSetSpinTime(runner.get(), spin_us));
+    std::atomic<int> num_calls{0};
+    const auto count = [&num_calls](int /*task*/, int) -> jxl::Status {
+      num_calls.fetch_add(1);
+      return true;
+    };
+    for (int run = 0; run < 100; ++run) {
+      EXPECT_TRUE(RunOnPool(&pool, 0, 1 + run % 4, jxl::ThreadPool::NoInit,
+                            count, "TestSpinTime"));
+    }
+    EXPECT_EQ(25 * (1 + 2 + 3 + 4), num_calls.load());
+  }
+}
+
 }  // namespace
 }  // namespace jpegxl
@@ -386,6 +386,20 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
           return TRUE;
         }
 
+        // For thumbnails, decode at the smallest reduced resolution that is
+        // still at least the requested size; the loader scales the rest.
+        for (uint32_t factor = 8; factor > 1; factor /= 2) {
+          size_t xsize = (info.xsize + factor - 1) / factor;
+          size_t ysize = (info.ysize + factor - 1) / factor;
+          if (xsize < (size_t)width || ysize < (size_t)height) continue;
+          if (JxlDecoderSetDownsampling(decoder_state->decoder, factor) ==
+              JXL_DEC_SUCCESS) {
+            decoder_state->xsize = xsize;
+            decoder_state->ysize = ysize;
+          }
+          break;
+        }
+
         // Set an appropriate number of threads for the image size.
         JxlResizableParallelRunnerSetThreads(
             decoder_state->parallel_runner,
@@ -51,7 +51,6 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
   gint32 layer;
 
   gpointer pixels_buffer_1 = nullptr;
-  gpointer pixels_buffer_2 = nullptr;
   size_t buffer_size = 0;
 
   GimpImageBaseType image_type = GIMP_RGB;
@@ -378,9 +377,7 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
       gimp_image_insert_layer(*image_id, layer, /*parent_id=*/-1,
                               /*position=*/0);
 
-      pixels_buffer_2 = g_malloc(buffer_size);
       GeglBuffer *buffer = gimp_drawable_get_buffer(layer);
-      const Babl *destination_format = gegl_buffer_set_format(buffer, nullptr);
 
       std::string babl_format_str = "";
       if (is_gray) {
@@ -395,16 +392,14 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
 
       const Babl *source_format = babl_format(babl_format_str.c_str());
 
-      babl_process(babl_fish(source_format, destination_format),
-                   pixels_buffer_1, pixels_buffer_2, xsize * ysize);
-
-      gegl_buffer_set(buffer, GEGL_RECTANGLE(0, 0, xsize, ysize), 0, nullptr,
-                      pixels_buffer_2, GEGL_AUTO_ROWSTRIDE);
+      // GEGL converts to the layer format tile by tile, so there is no need
+      // for a second full-size copy of the decoded frame.
+      gegl_buffer_set(buffer, GEGL_RECTANGLE(0, 0, xsize, ysize), 0,
+                      source_format, pixels_buffer_1, GEGL_AUTO_ROWSTRIDE);
       gimp_item_transform_translate(layer, crop_x0, crop_y0);
 
       g_clear_object(&buffer);
       g_free(pixels_buffer_1);
-      g_free(pixels_buffer_2);
       if (stop_processing) status = JXL_DEC_SUCCESS;
       g_free(layer_name);
       layer_idx++;
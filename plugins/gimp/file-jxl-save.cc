@@ -10,7 +10,9 @@
 #include <jxl/types.h>
 
 #include <cmath>
+#include <memory>
 #include <utility>
+#include <vector>
 
 #include "gobject/gsignal.h"
 
@@ -33,6 +35,75 @@ void g_clear_signal_handler(gulong* handler, gpointer instance) {
 }
 #endif  // g_clear_signal_handler
 
+// Feeds a layer to JxlEncoderAddChunkedFrame, reading each requested
+// rectangle from the GEGL buffer (converted to `format`) only when the
+// encoder asks for it, instead of materializing the whole layer up front.
+class GeglChunkedSource {
+ public:
+  GeglChunkedSource(GeglBuffer* buffer, const Babl* format,
+                    const JxlPixelFormat& pixel_format)
+      : buffer_(buffer),
+        format_(format),
+        pixel_format_(pixel_format),
+        bytes_per_pixel_(babl_format_get_bytes_per_pixel(format)) {}
+
+  ~GeglChunkedSource() { g_clear_object(&buffer_); }
+
+  GeglChunkedSource(const GeglChunkedSource&) = delete;
+  GeglChunkedSource& operator=(const GeglChunkedSource&) = delete;
+
+  JxlChunkedFrameInputSource InputSource() {
+    return JxlChunkedFrameInputSource{this,
+                                      &GetColorChannelsPixelFormat,
+                                      &GetColorChannelDataAt,
+                                      &GetExtraChannelPixelFormat,
+                                      &GetExtraChannelDataAt,
+                                      &ReleaseBuffer};
+  }
+
+ private:
+  static void GetColorChannelsPixelFormat(void* opaque,
+                                          JxlPixelFormat* pixel_format) {
+    *pixel_format = static_cast<GeglChunkedSource*>(opaque)->pixel_format_;
+  }
+
+  static const void* GetColorChannelDataAt(void* opaque, size_t xpos,
+                                           size_t ypos, size_t xsize,
+                                           size_t ysize, size_t* row_offset) {
+    GeglChunkedSource* self = static_cast<GeglChunkedSource*>(opaque);
+    *row_offset = xsize * self->bytes_per_pixel_;
+    gpointer pixels = g_malloc(*row_offset * ysize);
+    GeglRectangle rect = {static_cast<gint>(xpos), static_cast<gint>(ypos),
+                          static_cast<gint>(xsize), static_cast<gint>(ysize)};
+    gegl_buffer_get(self->buffer_, &rect, 1.0, self->format_, pixels,
+                    *row_offset, GEGL_ABYSS_NONE);
+    return pixels;
+  }
+
+  // The only extra channel is the alpha channel, which is interleaved with
+  // the color channels.
+  static void GetExtraChannelPixelFormat(void* /*opaque*/,
+                                         size_t /*ec_index*/,
+                                         JxlPixelFormat* /*pixel_format*/) {}
+
+  static const void* GetExtraChannelDataAt(void* /*opaque*/,
+                                           size_t /*ec_index*/,
+                                           size_t /*xpos*/, size_t /*ypos*/,
+                                           size_t /*xsize*/, size_t /*ysize*/,
+                                           size_t* /*row_offset*/) {
+    return nullptr;
+  }
+
+  static void ReleaseBuffer(void* /*opaque*/, const void* buf) {
+    g_free(const_cast<void*>(buf));
+  }
+
+  GeglBuffer* buffer_;
+  const Babl* format_;
+  JxlPixelFormat pixel_format_;
+  size_t bytes_per_pixel_;
+};
+
 class JpegXlSaveOpts {
  public:
   float distance;
@@ -802,54 +873,38 @@ bool SaveJpegXlImage(const gint32 image_id, const gint32 drawable_id,
     gimp_image_convert_precision(duplicate, GIMP_PRECISION_FLOAT_GAMMA);
   }
 
-  // process layers and compress into JXL
-  size_t buffer_size =
-      jxl_save_opts.basic_info.xsize * jxl_save_opts.basic_info.ysize *
-      jxl_save_opts.pixel_format.num_channels * 4;  // bytes per sample
+  // The encoder reads the layers through their GEGL buffers while it
+  // produces output, so they have to stay alive until then.
+  JxlEncoderFrameSettingsSetOption(frame_settings,
+                                   JXL_ENC_FRAME_SETTING_ZERO_COPY_INPUT, 1);
+  std::vector<std::unique_ptr<GeglChunkedSource>> sources;
 
+  // process layers and compress into JXL
   for (int i = nlayers - 1; i >= 0; i--) {
     gimp_save_progress.update();
 
-    // copy image into buffer...
-    gpointer pixels_buffer_1;
-    gpointer pixels_buffer_2;
-    pixels_buffer_1 = g_malloc(buffer_size);
-    pixels_buffer_2 = g_malloc(buffer_size);
-
     gimp_layer_resize_to_image_size(layers[i]);
 
     GeglBuffer* buffer = gimp_drawable_get_buffer(layers[i]);
 
-    // using gegl_buffer_set_format to get the format because
-    // gegl_buffer_get_format doesn't always get the original format
-    const Babl* native_format = gegl_buffer_set_format(buffer, nullptr);
-
-    gegl_buffer_get(buffer,
-                    GEGL_RECTANGLE(0, 0, jxl_save_opts.basic_info.xsize,
-                                   jxl_save_opts.basic_info.ysize),
-                    1.0, native_format, pixels_buffer_1, GEGL_AUTO_ROWSTRIDE,
-                    GEGL_ABYSS_NONE);
-    g_clear_object(&buffer);
-
-    // use babl to fix gamma mismatch issues
+    // let GEGL convert to the requested format, which also fixes gamma
+    // mismatch issues
     jxl_save_opts.SetModel(jxl_save_opts.is_linear);
     jxl_save_opts.pixel_format.data_type = JXL_TYPE_FLOAT;
     jxl_save_opts.SetBablType("float");
     const Babl* destination_format =
         babl_format(jxl_save_opts.babl_format_str.c_str());
 
-    babl_process(
-        babl_fish(native_format, destination_format), pixels_buffer_1,
-        pixels_buffer_2,
-        jxl_save_opts.basic_info.xsize * jxl_save_opts.basic_info.ysize);
+    sources.emplace_back(new GeglChunkedSource(buffer, destination_format,
+                                               jxl_save_opts.pixel_format));
 
     gimp_save_progress.update();
 
     // send layer to encoder
     if (JXL_ENC_SUCCESS !=
-        JxlEncoderAddImageFrame(frame_settings, &jxl_save_opts.pixel_format,
-                                pixels_buffer_2, buffer_size)) {
-      g_printerr(SAVE_PROC " Error: JxlEncoderAddImageFrame failed\n");
+        JxlEncoderAddChunkedFrame(frame_settings, /*is_last_frame=*/JXL_FALSE,
+                                  sources.back()->InputSource())) {
+      g_printerr(SAVE_PROC " Error: JxlEncoderAddChunkedFrame failed\n");
       return false;
     }
   }
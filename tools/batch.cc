@@ -0,0 +1,107 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "tools/batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lib/jxl/base/printf_macros.h"
+#include "tools/file_io.h"
+
+namespace jpegxl {
+namespace tools {
+
+bool ReadBatchList(const std::string& path, std::vector<BatchEntry>* entries) {
+  std::vector<uint8_t> list;
+  if (!ReadFile(path, &list)) {
+    fprintf(stderr, "Could not read the batch list %s\n", path.c_str());
+    return false;
+  }
+  const std::string text(list.begin(), list.end());
+  std::istringstream lines(text);
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(lines, line)) {
+    ++line_number;
+    std::istringstream fields(line);
+    BatchEntry entry;
+    if (!(fields >> entry.input) || entry.input[0] == '#') continue;
+    std::string extra;
+    if (!(fields >> entry.output) || (fields >> extra)) {
+      fprintf(stderr, "%s:%" PRIuS ": expected INPUT OUTPUT\n", path.c_str(),
+              line_number);
+      return false;
+    }
+    entries->push_back(entry);
+  }
+  return true;
+}
+
+size_t RunBatch(size_t num_entries, size_t num_workers, size_t max_ahead,
+                const std::function<bool(size_t)>& prepare,
+                const std::function<bool(size_t)>& process) {
+  num_workers = std::max<size_t>(1, std::min(num_workers, num_entries));
+  max_ahead = std::max<size_t>(1, max_ahead);
+  std::mutex mutex;
+  std::condition_variable cv;
+  // Entries [0, num_prepared) are prepared, [0, next) are taken by workers.
+  size_t num_prepared = 0;
+  size_t next = 0;
+  std::vector<char> prepared_ok(num_entries);
+  std::atomic<size_t> num_failed{0};
+
+  std::thread loader([&]() {
+    for (size_t i = 0; i < num_entries; ++i) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return i < next + max_ahead; });
+      }
+      const bool ok = prepare(i);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        prepared_ok[i] = ok;
+        ++num_prepared;
+      }
+      cv.notify_all();
+    }
+  });
+  const auto work = [&]() {
+    for (;;) {
+      size_t i;
+      bool ok;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock,
+                [&]() { return next == num_entries || next < num_prepared; });
+        if (next == num_entries) return;
+        i = next++;
+        ok = prepared_ok[i];
+      }
+      // The loader may prepare one more.
+      cv.notify_all();
+      if (!ok || !process(i)) ++num_failed;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_workers; ++i) workers.emplace_back(work);
+  work();
+  for (std::thread& worker : workers) worker.join();
+  loader.join();
+  return num_failed;
+}
+
+}  // namespace tools
+}  // namespace jpegxl
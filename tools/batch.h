@@ -0,0 +1,45 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_BATCH_H_
+#define TOOLS_BATCH_H_
+
+// Batch mode of cjxl and djxl: many files in one process, with one thread
+// pool, so that process startup and library initialization are paid once.
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace jpegxl {
+namespace tools {
+
+struct BatchEntry {
+  std::string input;
+  std::string output;
+};
+
+// Reads the files of a batch from `path`, one "INPUT OUTPUT" pair per line,
+// separated by whitespace. Empty lines and lines starting with '#' are
+// skipped. `path` can be '-' for stdin.
+bool ReadBatchList(const std::string& path, std::vector<BatchEntry>* entries);
+
+// Calls `prepare` for each of `num_entries` entries, in order on a thread of
+// its own, e.g. to read and decode the input, and then `process` for the
+// entry on one of `num_workers` threads. Entries are prepared at most
+// `max_ahead` before a worker takes them, which bounds the memory used, and up
+// to `num_workers` are processed at once, so that the workers of a shared
+// thread pool stay busy at the file boundaries and with small files. `process`
+// is not called for the entries where `prepare` returned false.
+// Returns the number of entries for which either returned false.
+size_t RunBatch(size_t num_entries, size_t num_workers, size_t max_ahead,
+                const std::function<bool(size_t)>& prepare,
+                const std::function<bool(size_t)>& process);
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BATCH_H_
@@ -16,6 +16,7 @@
 #include "lib/extras/dec/color_description.h"
 #include "lib/extras/dec/decode.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "tools/benchmark/benchmark_codec_custom.h"  // for AddCommand..
 #include "tools/benchmark/benchmark_codec_jpeg.h"    // for AddCommand..
@@ -71,6 +72,14 @@ Status BenchmarkArgs::AddCommandLineOptions() {
           false);
   AddFlag(&print_details_csv, "print_details_csv",
           "When print_details is used, print as CSV.", false);
+  AddString(&phase_timing_json, "phase_timing_json",
+            "If not empty, writes the time spent in each phase of the JXL "
+            "encoder and decoder for each image to this file, as JSON. The "
+            "images are then benchmarked one at a time.");
+  AddString(&trace_events_json, "trace_events_json",
+            "If not empty, writes the spans of the work of each thread to "
+            "this file, in the Chrome trace event format. Requires building "
+            "with -DJXL_ENABLE_TRACE_EVENTS=1.");
   AddString(&extra_metrics, "extra_metrics",
             "Extra metrics to be computed. Only displayed with --print_details "
             "or --print_details_csv. Comma-separated list of NAME:COMMAND "
@@ -177,6 +186,23 @@ Status BenchmarkArgs::AddCommandLineOptions() {
             "The number of extra threads per task. "
             "Defaults to occupy cores (if negative).",
             -1);
+  AddUnsigned(&thread_scaling, "thread_scaling",
+              "If > 0, runs the benchmark with 1, 2, 4, ... up to this many "
+              "inner threads, one task at a time, and prints the speedup, "
+              "parallel efficiency and serial fraction of each method and the "
+              "scaling of each phase of the JXL encoder and decoder.",
+              0);
+  AddFlag(&memory_stats, "memory_stats",
+          "Prints the peak heap use, bytes allocated and allocation count of "
+          "each encode and decode, in total and per phase of the JXL encoder "
+          "and decoder.",
+          false);
+  AddFlag(&perf_counters, "perf_counters",
+          "Prints the CPU cycles, instructions, last level cache misses and "
+          "branch misses per megapixel of each method, from the Linux "
+          "perf_event counters. Disables inner threads, the counters are per "
+          "thread.",
+          false);
   AddUnsigned(&encode_reps, "encode_reps",
               "How many times to encode (>1 for more precise measurements). "
               "Defaults to 1.",
@@ -266,6 +292,15 @@ Status BenchmarkArgs::ValidateArgs() {
   JXL_RETURN_IF_ERROR(ValidateArgsJxlCodec(this));
 
   if (print_details_csv) print_details = true;
+  // The phase timings are process-wide.
+  if (!phase_timing_json.empty() || thread_scaling > 0) num_threads = 0;
+  if (perf_counters) inner_threads = 0;
+  if (!phase_timing_json.empty() && thread_scaling > 0) {
+    return JXL_FAILURE("phase_timing_json and thread_scaling are exclusive");
+  }
+  if (!trace_events_json.empty() && !JXL_ENABLE_TRACE_EVENTS) {
+    return JXL_FAILURE("trace_events_json requires JXL_ENABLE_TRACE_EVENTS");
+  }
 
   if (override_bitdepth > 32) {
     return JXL_FAILURE("override_bitdepth must be <= 32");
@@ -107,6 +107,11 @@ struct BenchmarkArgs {
   bool print_details;
   bool print_details_csv;
   bool print_more_stats;
+  std::string phase_timing_json;
+  std::string trace_events_json;
+  size_t thread_scaling;
+  bool memory_stats;
+  bool perf_counters;
   bool print_distance_percentiles;
   bool silent_errors;
   bool save_compressed;
@@ -55,6 +55,9 @@ const char* JxlStatsName(JxlEncoderStatsKey key) {
     ADD_NAME(NUM_DCT32X64_BLOCKS, "Number of 32x64 blocks");
     ADD_NAME(NUM_DCT64_BLOCKS, "Number of 64x64 blocks");
     ADD_NAME(NUM_BUTTERAUGLI_ITERS, "Butteraugli iters");
+    ADD_NAME(NUM_WP_TREE_NODES, "Weighted predictor nodes");
+    ADD_NAME(NUM_ANS_HISTOGRAMS, "ANS histograms");
+    ADD_NAME(NUM_LOOP_FILTERED_FRAMES, "Loop-filtered frames");
     default:
       return "";
   };
@@ -207,6 +210,19 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   for (size_t i = 0; i < victim.extra_metrics.size(); i++) {
     extra_metrics[i] += victim.extra_metrics[i];
   }
+  const auto add_phases = [](const std::vector<double>& from,
+                             std::vector<double>* to) {
+    if (to->size() < from.size()) to->resize(from.size());
+    for (size_t i = 0; i < from.size(); i++) (*to)[i] += from[i];
+  };
+  add_phases(victim.encode_phase_seconds, &encode_phase_seconds);
+  add_phases(victim.decode_phase_seconds, &decode_phase_seconds);
+  add_phases(victim.encode_phase_wall_seconds, &encode_phase_wall_seconds);
+  add_phases(victim.decode_phase_wall_seconds, &decode_phase_wall_seconds);
+  add_phases(victim.encode_perf_counts, &encode_perf_counts);
+  add_phases(victim.decode_perf_counts, &decode_perf_counts);
+  encode_memory.Assimilate(victim.encode_memory);
+  decode_memory.Assimilate(victim.decode_memory);
 }
 
 ::jxl::Status BenchmarkStats::PrintMoreStats() const {
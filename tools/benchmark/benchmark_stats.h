@@ -8,7 +8,9 @@
 
 #include <jxl/stats.h>
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -33,6 +35,31 @@ struct JxlStats {
   std::unique_ptr<JxlEncoderStats, decltype(JxlEncoderStatsDestroy)*> stats;
 };
 
+// Heap use of an encode or decode through the memory manager of the codec.
+struct MemoryStats {
+  void Assimilate(const MemoryStats& victim) {
+    peak_bytes = std::max(peak_bytes, victim.peak_bytes);
+    allocations += victim.allocations;
+    bytes_allocated += victim.bytes_allocated;
+    if (phase_allocations.size() < victim.phase_allocations.size()) {
+      phase_allocations.resize(victim.phase_allocations.size());
+      phase_bytes_allocated.resize(victim.phase_bytes_allocated.size());
+    }
+    for (size_t i = 0; i < victim.phase_allocations.size(); ++i) {
+      phase_allocations[i] += victim.phase_allocations[i];
+      phase_bytes_allocated[i] += victim.phase_bytes_allocated[i];
+    }
+  }
+
+  uint64_t peak_bytes = 0;
+  double allocations = 0;
+  double bytes_allocated = 0;
+  // Indexed by jxl::TracePhase, then one for the allocations outside of all
+  // phases.
+  std::vector<double> phase_allocations;
+  std::vector<double> phase_bytes_allocated;
+};
+
 // The value of an entry in the table. Depending on the ColumnType, the string,
 // size_t or double should be used.
 struct ColumnValue {
@@ -67,6 +94,20 @@ struct BenchmarkStats {
   size_t total_errors = 0;
   JxlStats jxl_stats;
   std::vector<float> extra_metrics;
+  // Seconds spent in each jxl::TracePhase per encode and per decode, summed
+  // over threads and in wall clock time, only with --phase_timing_json or
+  // --thread_scaling.
+  std::vector<double> encode_phase_seconds;
+  std::vector<double> decode_phase_seconds;
+  std::vector<double> encode_phase_wall_seconds;
+  std::vector<double> decode_phase_wall_seconds;
+  // Per encode and per decode, only with --memory_stats.
+  MemoryStats encode_memory;
+  MemoryStats decode_memory;
+  // Per encode and per decode, indexed by PerfCounters::Counter, NaN if
+  // unavailable. Only with --perf_counters.
+  std::vector<double> encode_perf_counts;
+  std::vector<double> decode_perf_counts;
 };
 
 ::jxl::StatusOr<std::string> PrintHeader(
@@ -10,11 +10,13 @@
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <numeric>
@@ -37,6 +39,7 @@
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/trace_events.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -45,6 +48,7 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
+#include "lib/jxl/trace.h"
 #include "tools/benchmark/benchmark_args.h"
 #include "tools/benchmark/benchmark_codec.h"
 #include "tools/benchmark/benchmark_file_io.h"
@@ -137,10 +141,56 @@ std::string CodecToExtension(const std::string& codec_name, char sep) {
   return result;
 }
 
+bool TracePhases() {
+  return !Args()->phase_timing_json.empty() || Args()->thread_scaling > 0 ||
+         Args()->memory_stats;
+}
+
+// Adds the traced time of each phase since the last reset, per repetition.
+void AddPhaseSeconds(size_t reps, std::vector<double>* seconds,
+                     std::vector<double>* wall_seconds) {
+  const std::array<double, jxl::kNumTracePhases> trace = jxl::GetTrace();
+  const std::array<double, jxl::kNumTracePhases> wall =
+      jxl::GetTraceWallTime();
+  seconds->resize(jxl::kNumTracePhases);
+  wall_seconds->resize(jxl::kNumTracePhases);
+  for (size_t i = 0; i < jxl::kNumTracePhases; ++i) {
+    (*seconds)[i] += trace[i] / std::max<size_t>(reps, 1);
+    (*wall_seconds)[i] += wall[i] / std::max<size_t>(reps, 1);
+  }
+}
+
+// Adds the heap use since the last ResetStats(), per repetition.
+void AddMemoryStats(const TrackingMemoryManager& memory, size_t reps,
+                    MemoryStats* stats) {
+  const double per_rep = 1.0 / std::max<size_t>(reps, 1);
+  stats->peak_bytes = std::max(stats->peak_bytes, memory.max_bytes_in_use);
+  stats->allocations += memory.total_allocations * per_rep;
+  stats->bytes_allocated += memory.total_bytes_allocated * per_rep;
+  stats->phase_allocations.resize(memory.tag_allocations.size());
+  stats->phase_bytes_allocated.resize(memory.tag_bytes_allocated.size());
+  for (size_t i = 0; i < memory.tag_allocations.size(); ++i) {
+    stats->phase_allocations[i] += memory.tag_allocations[i] * per_rep;
+    stats->phase_bytes_allocated[i] += memory.tag_bytes_allocated[i] * per_rep;
+  }
+}
+
+// Adds the counts of one of `reps` repetitions.
+void AddPerfCounts(const PerfCounters::Counts& counts, size_t reps,
+                   std::vector<double>* total) {
+  total->resize(PerfCounters::kNumCounters);
+  for (size_t i = 0; i < PerfCounters::kNumCounters; ++i) {
+    (*total)[i] += counts[i] < 0 ? std::numeric_limits<double>::quiet_NaN()
+                                 : counts[i] / std::max<size_t>(reps, 1);
+  }
+}
+
+// `memory` is the memory manager of the codec, if its heap use is measured.
 Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
                   const std::vector<std::string>& extra_metrics_commands,
-                  ImageCodec* codec, ThreadPool* inner_pool,
-                  std::vector<uint8_t>* compressed, BenchmarkStats* s) {
+                  ImageCodec* codec, TrackingMemoryManager* memory,
+                  ThreadPool* inner_pool, std::vector<uint8_t>* compressed,
+                  BenchmarkStats* s) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
   ++s->total_input_files;
 
@@ -168,11 +218,18 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
   }
   const PackedPixelFile* ppf1 = &ppf;
   PackedPixelFile ppf2;
+  const bool trace_phases = TracePhases();
+  // Per thread, so opened by the one that runs the task.
+  std::unique_ptr<PerfCounters> perf;
+  if (Args()->perf_counters) perf = jxl::make_unique<PerfCounters>();
 
   for (size_t generation = 0; generation <= Args()->generations; generation++) {
     std::string ext = FileExtension(filename);
     if (valid && !Args()->decode_only) {
+      if (trace_phases) jxl::ResetTrace();
+      if (memory) memory->ResetStats();
       for (size_t i = 0; i < Args()->encode_reps; ++i) {
+        if (perf) perf->Start();
         if (codec->CanRecompressJpeg() && (ext == ".jpg" || ext == ".jpeg")) {
           std::vector<uint8_t> data_in;
           JXL_RETURN_IF_ERROR(ReadFile(filename, &data_in));
@@ -195,9 +252,20 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
             }
           }
         }
+        if (perf) {
+          AddPerfCounts(perf->Stop(), Args()->encode_reps,
+                        &s->encode_perf_counts);
+        }
       }
       JXL_RETURN_IF_ERROR(speed_stats.GetSummary(&summary));
       s->total_time_encode += summary.central_tendency;
+      if (trace_phases) {
+        AddPhaseSeconds(Args()->encode_reps, &s->encode_phase_seconds,
+                        &s->encode_phase_wall_seconds);
+      }
+      if (memory) {
+        AddMemoryStats(*memory, Args()->encode_reps, &s->encode_memory);
+      }
     }
 
     if (valid && Args()->decode_only) {
@@ -209,7 +277,10 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     // Decompress
     if (valid) {
       speed_stats = jpegxl::tools::SpeedStats();
+      if (trace_phases) jxl::ResetTrace();
+      if (memory) memory->ResetStats();
       for (size_t i = 0; i < Args()->decode_reps; ++i) {
+        if (perf) perf->Start();
         if (!codec->Decompress(filename, Bytes(*compressed), inner_pool, &ppf2,
                                &speed_stats)) {
           if (!Args()->silent_errors) {
@@ -220,9 +291,20 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
           }
           valid = false;
         }
+        if (perf) {
+          AddPerfCounts(perf->Stop(), Args()->decode_reps,
+                        &s->decode_perf_counts);
+        }
       }
       JXL_RETURN_IF_ERROR(speed_stats.GetSummary(&summary));
       s->total_time_decode += summary.central_tendency;
+      if (trace_phases) {
+        AddPhaseSeconds(Args()->decode_reps, &s->decode_phase_seconds,
+                        &s->decode_phase_wall_seconds);
+      }
+      if (memory) {
+        AddMemoryStats(*memory, Args()->decode_reps, &s->decode_memory);
+      }
     }
     ppf1 = &ppf2;
   }
@@ -277,7 +359,7 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
                                                             : 80.f;
 
       const JxlCmsInterface& cms = *JxlGetDefaultCms();
-      JxlButteraugliComparator comparator(params, cms);
+      JxlButteraugliComparator comparator(params, cms, inner_pool);
       JXL_RETURN_IF_ERROR(ComputeScore(ib1, ib2, &comparator, cms, &distance,
                                        &distmap, inner_pool,
                                        codec->IgnoreAlpha()));
@@ -295,7 +377,8 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     double pnorm =
         ComputeDistanceP(distmap, ButteraugliParams(), Args()->error_pnorm);
     s->distance_p_norm += pnorm * input_pixels;
-    JXL_ASSIGN_OR_RETURN(Msssim msssim, ComputeSSIMULACRA2(ib1, ib2));
+    JXL_ASSIGN_OR_RETURN(Msssim msssim,
+                         ComputeSSIMULACRA2(ib1, ib2, 0.5f, inner_pool));
     double ssimulacra2 = msssim.Score();
     s->ssimulacra2 += ssimulacra2 * input_pixels;
     s->max_distance = std::max(s->max_distance, distance);
@@ -418,6 +501,8 @@ std::string Base64Image(const std::string& filename) {
 }
 
 struct Task {
+  // Only with --memory_stats, used by the codec instead of the shared one.
+  std::unique_ptr<TrackingMemoryManager> memory_manager;
   ImageCodecPtr codec;
   size_t idx_image;
   size_t idx_method;
@@ -855,13 +940,43 @@ class Benchmark {
       std::vector<PackedPixelFile> loaded_images =
           LoadImages(fnames, pool->get());
 
-      if (RunTasks(methods, extra_metrics_names, extra_metrics_commands, fnames,
-                   loaded_images, pool->get(), inner_pools, &tasks) != 0) {
+      const bool trace_phases = TracePhases();
+      if (trace_phases) jxl::SetTracingEnabled(true);
+#if JXL_ENABLE_TRACE_EVENTS
+      const bool trace_events = !Args()->trace_events_json.empty();
+      if (trace_events) jxl::SetTraceEventsEnabled(true);
+#endif
+      size_t num_errors;
+      if (Args()->thread_scaling > 0) {
+        JXL_ASSIGN_OR_RETURN(
+            num_errors,
+            RunThreadScaling(methods, extra_metrics_names,
+                             extra_metrics_commands, fnames, loaded_images,
+                             memory_manager.get(), pool->get()));
+      } else {
+        num_errors =
+            RunTasks(methods, extra_metrics_names, extra_metrics_commands,
+                     fnames, loaded_images, pool->get(), inner_pools, &tasks);
+        if (Args()->memory_stats) PrintMemoryStats(methods, fnames, tasks);
+        if (Args()->perf_counters) PrintPerfCounters(methods, tasks);
+      }
+      if (num_errors != 0) {
         ok = false;
         if (!Args()->silent_errors) {
           fprintf(stderr, "There were error(s) in the benchmark.\n");
         }
       }
+      if (trace_phases) {
+        jxl::SetTracingEnabled(false);
+        JXL_RETURN_IF_ERROR(WritePhaseTimingJson(methods, fnames, tasks));
+      }
+#if JXL_ENABLE_TRACE_EVENTS
+      if (trace_events) {
+        jxl::SetTraceEventsEnabled(false);
+        JXL_RETURN_IF_ERROR(WriteFile(Args()->trace_events_json,
+                                      jxl::TakeTraceEventsJson()));
+      }
+#endif
     }
 
     PrintStats(memory_manager);
@@ -869,6 +984,206 @@ class Benchmark {
     return true;
   }
 
+ private:
+  // Counts per megapixel of each method.
+  static void PrintPerfCounters(const StringVec& methods,
+                                const std::vector<Task>& tasks) {
+    if (!PerfCounters().Available()) {
+      fprintf(stderr, "Hardware performance counters are unavailable.\n");
+    }
+    printf("\nHardware counters per megapixel:\n%-30s %-6s", "method",
+           "phase");
+    for (size_t i = 0; i < PerfCounters::kNumCounters; ++i) {
+      printf(" %14s",
+             PerfCounters::Name(static_cast<PerfCounters::Counter>(i)));
+    }
+    printf(" %6s\n", "IPC");
+    for (size_t m = 0; m < methods.size(); ++m) {
+      BenchmarkStats stats;
+      for (const Task& t : tasks) {
+        if (t.idx_method == m) stats.Assimilate(t.stats);
+      }
+      const double megapixels = stats.total_input_pixels * 1e-6;
+      for (const auto& phase :
+           {std::make_pair("encode", &stats.encode_perf_counts),
+            std::make_pair("decode", &stats.decode_perf_counts)}) {
+        const std::vector<double>& counts = *phase.second;
+        if (counts.empty() || megapixels == 0) continue;
+        printf("%-30s %-6s", methods[m].c_str(), phase.first);
+        for (double count : counts) printf(" %14.4E", count / megapixels);
+        printf(" %6.2f\n", counts[PerfCounters::kInstructions] /
+                               counts[PerfCounters::kCycles]);
+      }
+    }
+    fflush(stdout);
+  }
+
+  // Heap use of each task, in total and per phase.
+  static void PrintMemoryStats(const StringVec& methods,
+                               const StringVec& fnames,
+                               const std::vector<Task>& tasks) {
+    const auto print = [](const char* direction, const MemoryStats& memory) {
+      if (memory.allocations == 0) return;
+      printf("  %s: peak %.4E bytes, %.4E bytes in %.0f allocations\n",
+             direction, static_cast<double>(memory.peak_bytes),
+             memory.bytes_allocated, memory.allocations);
+      for (size_t i = 0; i < memory.phase_allocations.size(); ++i) {
+        if (memory.phase_allocations[i] == 0) continue;
+        const char* name =
+            i < jxl::kNumTracePhases
+                ? jxl::TracePhaseName(static_cast<jxl::TracePhase>(i))
+                : "other";
+        printf("    %-22s %.4E bytes in %.0f allocations\n", name,
+               memory.phase_bytes_allocated[i], memory.phase_allocations[i]);
+      }
+    };
+    printf("\nMemory use per encode and decode:\n");
+    for (const Task& t : tasks) {
+      printf("%s %s\n", methods[t.idx_method].c_str(),
+             FileBaseName(fnames[t.idx_image]).c_str());
+      print("encode", t.stats.encode_memory);
+      print("decode", t.stats.decode_memory);
+    }
+    fflush(stdout);
+  }
+
+  // Encoding or decoding times of a method with a number of inner threads.
+  struct ScalingPoint {
+    size_t num_threads;
+    double seconds;
+    std::vector<double> phase_wall_seconds;
+  };
+
+  // Runs all tasks with 1, 2, 4, ... up to --thread_scaling inner threads and
+  // prints how the times of each method scale. Returns the number of errors.
+  static StatusOr<size_t> RunThreadScaling(
+      const StringVec& methods, const StringVec& extra_metrics_names,
+      const StringVec& extra_metrics_commands, const StringVec& fnames,
+      const std::vector<PackedPixelFile>& loaded_images,
+      JxlMemoryManager* memory_manager, ThreadPool* pool) {
+    std::vector<size_t> thread_counts;
+    for (size_t n = 1; n < Args()->thread_scaling; n *= 2) {
+      thread_counts.push_back(n);
+    }
+    thread_counts.push_back(Args()->thread_scaling);
+
+    // Indexed by method.
+    std::vector<std::vector<ScalingPoint>> encode(methods.size());
+    std::vector<std::vector<ScalingPoint>> decode(methods.size());
+    size_t num_errors = 0;
+    for (size_t num_threads : thread_counts) {
+      JXL_ASSIGN_OR_RETURN(std::vector<Task> tasks,
+                           CreateTasks(methods, fnames, memory_manager));
+      // The tasks run one at a time, on a single inner pool. One thread is
+      // the caller itself, without workers.
+      std::vector<std::unique_ptr<ThreadPoolInternal>> inner_pools;
+      inner_pools.emplace_back(
+          new ThreadPoolInternal(num_threads == 1 ? 0 : num_threads));
+      printf("Inner threads: %" PRIuS "\n", num_threads);
+      num_errors += RunTasks(methods, extra_metrics_names,
+                             extra_metrics_commands, fnames, loaded_images,
+                             pool, inner_pools, &tasks);
+      std::vector<BenchmarkStats> method_stats(methods.size());
+      for (const Task& t : tasks) {
+        method_stats[t.idx_method].Assimilate(t.stats);
+      }
+      for (size_t i = 0; i < methods.size(); ++i) {
+        const BenchmarkStats& s = method_stats[i];
+        encode[i].push_back(
+            {num_threads, s.total_time_encode, s.encode_phase_wall_seconds});
+        decode[i].push_back(
+            {num_threads, s.total_time_decode, s.decode_phase_wall_seconds});
+      }
+    }
+    for (size_t i = 0; i < methods.size(); ++i) {
+      PrintThreadScaling(methods[i], "encode", encode[i]);
+      PrintThreadScaling(methods[i], "decode", decode[i]);
+    }
+    fflush(stdout);
+    return num_errors;
+  }
+
+  // The serial fraction is the Karp-Flatt estimate of the fraction of the
+  // work that does not run in parallel, in Amdahl's law. The idle time of a
+  // phase is the thread time it takes beyond its single-threaded time.
+  static void PrintThreadScaling(const std::string& method,
+                                 const char* direction,
+                                 const std::vector<ScalingPoint>& points) {
+    const ScalingPoint& serial = points[0];
+    if (serial.seconds <= 0) return;
+    printf("\nThread scaling of %s %s:\n", method.c_str(), direction);
+    printf("%7s %10s %8s %10s %8s\n", "threads", "seconds", "speedup",
+           "efficiency", "serial");
+    for (const ScalingPoint& p : points) {
+      const double speedup = serial.seconds / p.seconds;
+      std::string serial_fraction = "-";
+      if (p.num_threads > 1) {
+        const double n = p.num_threads;
+        serial_fraction =
+            StringPrintf("%.3f", (1 / speedup - 1 / n) / (1 - 1 / n));
+      }
+      printf("%7" PRIuS " %10.4f %8.2f %9.1f%% %8s\n", p.num_threads,
+             p.seconds, speedup, 100 * speedup / p.num_threads,
+             serial_fraction.c_str());
+    }
+    if (serial.phase_wall_seconds.empty()) return;
+    printf("%-22s %7s %10s %8s %10s\n", "phase", "threads", "seconds",
+           "speedup", "idle");
+    for (size_t i = 0; i < jxl::kNumTracePhases; ++i) {
+      const double serial_wall = serial.phase_wall_seconds[i];
+      if (serial_wall <= 0) continue;
+      const char* name =
+          jxl::TracePhaseName(static_cast<jxl::TracePhase>(i));
+      for (const ScalingPoint& p : points) {
+        const double wall = p.phase_wall_seconds[i];
+        printf("%-22s %7" PRIuS " %10.4f %8.2f %10.4f\n", name,
+               p.num_threads, wall, serial_wall / wall,
+               std::max(0.0, wall * p.num_threads - serial_wall));
+      }
+    }
+  }
+
+  // One object per task, with the name of the phases as keys.
+  static Status WritePhaseTimingJson(const StringVec& methods,
+                                     const StringVec& fnames,
+                                     const std::vector<Task>& tasks) {
+    const auto quoted = [](const std::string& str) {
+      std::string out = "\"";
+      for (char c : str) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+      }
+      return out + "\"";
+    };
+    const auto phases = [](const std::vector<double>& seconds) {
+      std::string out = "{";
+      for (size_t i = 0; i < seconds.size(); ++i) {
+        out += StringPrintf(
+            "%s\"%s\": %.6f", i == 0 ? "" : ", ",
+            jxl::TracePhaseName(static_cast<jxl::TracePhase>(i)), seconds[i]);
+      }
+      return out + "}";
+    };
+    std::string json = "[\n";
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      const Task& t = tasks[i];
+      json += StringPrintf(
+          "  {\"method\": %s, \"image\": %s, \"pixels\": %" PRIuS
+          ", \"errors\": %" PRIuS
+          ", \"encode_seconds\": %.6f, \"decode_seconds\": %.6f",
+          quoted(methods[t.idx_method]).c_str(),
+          quoted(FileBaseName(fnames[t.idx_image])).c_str(),
+          t.stats.total_input_pixels, t.stats.total_errors,
+          t.stats.total_time_encode, t.stats.total_time_decode);
+      json += ", \"encode_phases\": " + phases(t.stats.encode_phase_seconds);
+      json += ", \"decode_phases\": " + phases(t.stats.decode_phase_seconds);
+      json += i + 1 < tasks.size() ? "},\n" : "}\n";
+    }
+    json += "]\n";
+    JXL_RETURN_IF_ERROR(WriteFile(Args()->phase_timing_json, json));
+    return true;
+  }
+
  private:
   static size_t NumOuterThreads(const size_t num_hw_threads,
                                 const size_t num_tasks) {
@@ -1096,7 +1411,15 @@ class Benchmark {
       for (size_t idx_method = 0; idx_method < methods.size(); ++idx_method) {
         tasks.emplace_back();
         Task& t = tasks.back();
-        t.codec = CreateImageCodec(methods[idx_method], memory_manager);
+        if (Args()->memory_stats) {
+          t.memory_manager = jxl::make_unique<TrackingMemoryManager>();
+          t.memory_manager->SetTagger(&jxl::CurrentTracePhase,
+                                      jxl::kNumTracePhases + 1);
+          t.codec = CreateImageCodec(methods[idx_method],
+                                     t.memory_manager->get());
+        } else {
+          t.codec = CreateImageCodec(methods[idx_method], memory_manager);
+        }
         t.idx_image = idx_image;
         t.idx_method = idx_method;
         // t.stats is default-initialized.
@@ -1138,8 +1461,8 @@ class Benchmark {
       t.image = &image;
       std::vector<uint8_t> compressed;
       if (!DoCompress(fnames[t.idx_image], image, extra_metrics_commands,
-                      t.codec.get(), inner_pools[thread]->get(), &compressed,
-                      &t.stats)) {
+                      t.codec.get(), t.memory_manager.get(),
+                      inner_pools[thread]->get(), &compressed, &t.stats)) {
         t.stats.total_errors++;
       } else if (!printer.TaskDone(i, t)) {
         t.stats.total_errors++;
@@ -0,0 +1,424 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Decodes each input many times and prints the distribution of the wall time
+// of single decodes, split into the fixed setup cost (decoder and thread pool
+// creation, headers, ICC profile, up to the first output buffer) and the pixel
+// work. Meant for small images, where the setup is a large part of the time
+// and hidden by the throughput that benchmark_xl reports.
+//
+// With --bandwidth_kbps, the input is instead given to the decoder in chunks
+// as they would arrive over a network, and the times at which the DC, the
+// first AC pass and the full image become available are printed.
+
+#include <jxl/codestream_header.h>
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
+#include <jxl/types.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "lib/extras/time.h"
+#include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/status.h"
+#include "tools/benchmark/benchmark_file_io.h"
+#include "tools/cmdline.h"
+#include "tools/file_io.h"
+
+namespace jpegxl {
+namespace tools {
+namespace {
+
+using ::jxl::Status;
+
+struct Args {
+  std::string input;
+  size_t num_reps = 100;
+  bool cold = false;
+  int num_threads = 0;
+  double bandwidth_kbps = 0;
+  size_t chunk_size = 4096;
+  bool flush_each_chunk = false;
+};
+
+// Seconds of one decode.
+struct Latency {
+  double setup;
+  double pixels;
+};
+
+// Seconds since the first byte was sent until each step was flushed, or -1 if
+// the image has no such step, and the CPU seconds of all flushes.
+struct Progression {
+  double dc = -1;
+  double first_pass = -1;
+  double full = -1;
+  double flush = 0;
+};
+
+// Runs `fn` and adds its wall time to `clock`, and to `cpu` if not null.
+template <typename Fn>
+auto Timed(double* clock, double* cpu, const Fn& fn) -> decltype(fn()) {
+  const double start = jxl::Now();
+  auto result = fn();
+  const double elapsed = jxl::Now() - start;
+  *clock += elapsed;
+  if (cpu) *cpu += elapsed;
+  return result;
+}
+
+// Reuses the decoder and the thread pool in warm mode, creates them for each
+// decode in cold mode.
+class LatencyDecoder {
+ public:
+  explicit LatencyDecoder(const Args& args) : args_(args) {}
+
+  Status Decode(const std::vector<uint8_t>& data, Latency* latency) {
+    const double start = jxl::Now();
+    JXL_RETURN_IF_ERROR(Start(JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING |
+                              JXL_DEC_FULL_IMAGE));
+    JxlDecoder* dec = decoder_.get();
+    if (JXL_DEC_SUCCESS != JxlDecoderSetInput(dec, data.data(), data.size())) {
+      return JXL_FAILURE("JxlDecoderSetInput failed");
+    }
+    JxlDecoderCloseInput(dec);
+
+    double pixels_start = 0;
+    for (;;) {
+      const JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+      if (status == JXL_DEC_NEED_MORE_INPUT) {
+        return JXL_FAILURE("Truncated input");
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        continue;
+      } else if (status == JXL_DEC_SUCCESS) {
+        break;
+      }
+      JXL_RETURN_IF_ERROR(HandleEvent(status));
+      // Only the first frame counts as setup.
+      if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER && pixels_start == 0) {
+        pixels_start = jxl::Now();
+      }
+    }
+    const double end = jxl::Now();
+    if (pixels_start == 0) return JXL_FAILURE("No image");
+    latency->setup = pixels_start - start;
+    latency->pixels = end - pixels_start;
+    return true;
+  }
+
+  // Gives the input to the decoder chunk by chunk at the simulated arrival
+  // time of each, and flushes the image at each progressive step. The decoder
+  // runs as soon as there is input, so the simulated time is the later of the
+  // arrival of the input and the end of the previous decoding work.
+  Status DecodeProgressive(const std::vector<uint8_t>& data,
+                           Progression* progression) {
+    const double bytes_per_second = args_.bandwidth_kbps * 1000 / 8;
+    double clock = 0;
+    JXL_RETURN_IF_ERROR(Timed(&clock, nullptr, [&] {
+      return Start(JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING |
+                   JXL_DEC_FRAME_PROGRESSION | JXL_DEC_FULL_IMAGE);
+    }));
+    JxlDecoder* dec = decoder_.get();
+    if (JXL_DEC_SUCCESS != JxlDecoderSetProgressiveDetail(dec, kPasses)) {
+      return JXL_FAILURE("JxlDecoderSetProgressiveDetail failed");
+    }
+
+    *progression = Progression();
+    bool has_buffer = false;
+    const auto flush = [&] {
+      if (!has_buffer) return;
+      Timed(&clock, &progression->flush,
+            [&] { return JxlDecoderFlushImage(dec); });
+    };
+    size_t consumed = 0;
+    size_t available = 0;
+    const auto add_input = [&]() -> Status {
+      available = std::min(data.size(), available + args_.chunk_size);
+      clock = std::max(clock, available / bytes_per_second);
+      if (JXL_DEC_SUCCESS != JxlDecoderSetInput(dec, data.data() + consumed,
+                                                available - consumed)) {
+        return JXL_FAILURE("JxlDecoderSetInput failed");
+      }
+      if (available == data.size()) JxlDecoderCloseInput(dec);
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(add_input());
+    for (;;) {
+      const JxlDecoderStatus status =
+          Timed(&clock, nullptr, [&] { return JxlDecoderProcessInput(dec); });
+      if (status == JXL_DEC_NEED_MORE_INPUT) {
+        if (available == data.size()) return JXL_FAILURE("Truncated input");
+        if (args_.flush_each_chunk) flush();
+        consumed = available - JxlDecoderReleaseInput(dec);
+        JXL_RETURN_IF_ERROR(add_input());
+      } else if (status == JXL_DEC_FRAME_PROGRESSION) {
+        flush();
+        // 8 for the DC, less for the AC passes.
+        if (JxlDecoderGetIntendedDownsamplingRatio(dec) >= 8) {
+          if (progression->dc < 0) progression->dc = clock;
+        } else if (progression->first_pass < 0) {
+          progression->first_pass = clock;
+        }
+      } else if (status == JXL_DEC_FULL_IMAGE) {
+        if (progression->full < 0) progression->full = clock;
+      } else if (status == JXL_DEC_SUCCESS) {
+        break;
+      } else {
+        JXL_RETURN_IF_ERROR(
+            Timed(&clock, nullptr, [&] { return HandleEvent(status); }));
+        if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) has_buffer = true;
+      }
+    }
+    if (progression->full < 0) return JXL_FAILURE("No image");
+    return true;
+  }
+
+ private:
+  // Creates or resets the decoder.
+  Status Start(int events) {
+    if (args_.cold || !decoder_) {
+      decoder_ = JxlDecoderMake(/*memory_manager=*/nullptr);
+      runner_ = JxlThreadParallelRunnerMake(
+          /*memory_manager=*/nullptr, args_.num_threads);
+    } else {
+      JxlDecoderReset(decoder_.get());
+    }
+    JxlDecoder* dec = decoder_.get();
+    if (JXL_DEC_SUCCESS != JxlDecoderSetParallelRunner(
+                               dec, JxlThreadParallelRunner, runner_.get())) {
+      return JXL_FAILURE("JxlDecoderSetParallelRunner failed");
+    }
+    if (JXL_DEC_SUCCESS != JxlDecoderSubscribeEvents(dec, events)) {
+      return JXL_FAILURE("JxlDecoderSubscribeEvents failed");
+    }
+    return true;
+  }
+
+  // The events that both kinds of decoding handle the same.
+  Status HandleEvent(JxlDecoderStatus status) {
+    JxlDecoder* dec = decoder_.get();
+    // RGBA, as most image viewers want it.
+    const JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+    if (status == JXL_DEC_ERROR) {
+      return JXL_FAILURE("Decoding error");
+    } else if (status == JXL_DEC_BASIC_INFO) {
+      JxlBasicInfo info;
+      if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec, &info)) {
+        return JXL_FAILURE("JxlDecoderGetBasicInfo failed");
+      }
+    } else if (status == JXL_DEC_COLOR_ENCODING) {
+      size_t icc_size;
+      if (JXL_DEC_SUCCESS !=
+          JxlDecoderGetICCProfileSize(dec, JXL_COLOR_PROFILE_TARGET_DATA,
+                                      &icc_size)) {
+        return JXL_FAILURE("JxlDecoderGetICCProfileSize failed");
+      }
+      icc_.resize(icc_size);
+      if (JXL_DEC_SUCCESS !=
+          JxlDecoderGetColorAsICCProfile(dec, JXL_COLOR_PROFILE_TARGET_DATA,
+                                         icc_.data(), icc_.size())) {
+        return JXL_FAILURE("JxlDecoderGetColorAsICCProfile failed");
+      }
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t buffer_size;
+      if (JXL_DEC_SUCCESS !=
+          JxlDecoderImageOutBufferSize(dec, &format, &buffer_size)) {
+        return JXL_FAILURE("JxlDecoderImageOutBufferSize failed");
+      }
+      pixels_.resize(buffer_size);
+      if (JXL_DEC_SUCCESS != JxlDecoderSetImageOutBuffer(dec, &format,
+                                                         pixels_.data(),
+                                                         pixels_.size())) {
+        return JXL_FAILURE("JxlDecoderSetImageOutBuffer failed");
+      }
+    } else {
+      return JXL_FAILURE("Unexpected decoder status %d",
+                         static_cast<int>(status));
+    }
+    return true;
+  }
+
+  const Args& args_;
+  JxlDecoderPtr decoder_;
+  JxlThreadParallelRunnerPtr runner_;
+  std::vector<uint8_t> icc_;
+  std::vector<uint8_t> pixels_;
+};
+
+// Nearest-rank percentile, `sorted` must not be empty.
+double Percentile(const std::vector<double>& sorted, double p) {
+  const size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+void PrintHeader(const std::vector<const char*>& columns) {
+  printf("%-30s %9s %5s ", "file", "bytes", "reps");
+  for (const char* column : columns) {
+    for (const char* p : {"p50", "p90", "p99"}) {
+      printf(" %6s_%-3s", column, p);
+    }
+  }
+  printf("\n");
+}
+
+// Percentiles of each column, in milliseconds. Negative values are missing
+// steps, which are the same for all decodes of a file.
+void PrintRow(const std::string& name, size_t bytes, size_t reps,
+              std::vector<std::vector<double>> columns) {
+  printf("%-30s %9" PRIuS " %5" PRIuS " ", name.c_str(), bytes, reps);
+  for (std::vector<double>& values : columns) {
+    values.erase(std::remove_if(values.begin(), values.end(),
+                                [](double v) { return v < 0; }),
+                 values.end());
+    std::sort(values.begin(), values.end());
+    for (double p : {0.5, 0.9, 0.99}) {
+      if (values.empty()) {
+        printf(" %10s", "-");
+      } else {
+        printf(" %10.3f", Percentile(values, p) * 1e3);
+      }
+    }
+  }
+  printf("\n");
+}
+
+// Appends one column per timing of the decodes of a file.
+void AddColumns(const std::vector<Latency>& latencies,
+                std::vector<std::vector<double>>* columns) {
+  columns->resize(3);
+  for (const Latency& l : latencies) {
+    (*columns)[0].push_back(l.setup + l.pixels);
+    (*columns)[1].push_back(l.setup);
+    (*columns)[2].push_back(l.pixels);
+  }
+}
+
+void AddColumns(const std::vector<Progression>& progressions,
+                std::vector<std::vector<double>>* columns) {
+  columns->resize(4);
+  for (const Progression& p : progressions) {
+    (*columns)[0].push_back(p.dc);
+    (*columns)[1].push_back(p.first_pass);
+    (*columns)[2].push_back(p.full);
+    (*columns)[3].push_back(p.flush);
+  }
+}
+
+template <typename T>
+Status RunFiles(const Args& args, const std::vector<std::string>& fnames,
+                Status (LatencyDecoder::*decode)(const std::vector<uint8_t>&,
+                                                 T*)) {
+  LatencyDecoder decoder(args);
+  std::vector<std::vector<double>> all;
+  size_t all_bytes = 0;
+  for (const std::string& fname : fnames) {
+    std::vector<uint8_t> data;
+    JXL_RETURN_IF_ERROR(ReadFile(fname, &data));
+    T result;
+    // In warm mode, the first decode only warms up the decoder.
+    if (!args.cold) JXL_RETURN_IF_ERROR((decoder.*decode)(data, &result));
+    std::vector<T> results;
+    for (size_t i = 0; i < args.num_reps; ++i) {
+      JXL_RETURN_IF_ERROR((decoder.*decode)(data, &result));
+      results.push_back(result);
+    }
+    std::vector<std::vector<double>> columns;
+    AddColumns(results, &columns);
+    AddColumns(results, &all);
+    PrintRow(FileBaseName(fname), data.size(), args.num_reps, columns);
+    all_bytes += data.size();
+  }
+  if (fnames.size() > 1) {
+    PrintRow("all", all_bytes / fnames.size(), args.num_reps * fnames.size(),
+             all);
+  }
+  return true;
+}
+
+Status Run(const Args& args) {
+  std::vector<std::string> fnames;
+  JXL_RETURN_IF_ERROR(MatchFiles(args.input, &fnames));
+  if (fnames.empty()) return JXL_FAILURE("No input file matches pattern");
+  std::sort(fnames.begin(), fnames.end());
+
+  if (args.bandwidth_kbps > 0) {
+    printf("Progressive steps of %s decodes in ms at %.0f kbit/s in chunks "
+           "of %" PRIuS " bytes, %d worker threads\n",
+           args.cold ? "cold" : "warm", args.bandwidth_kbps, args.chunk_size,
+           args.num_threads);
+    PrintHeader({"dc", "pass", "full", "flush"});
+    return RunFiles(args, fnames, &LatencyDecoder::DecodeProgressive);
+  }
+  printf("Latency of %s decodes in ms, %d worker threads\n",
+         args.cold ? "cold" : "warm", args.num_threads);
+  PrintHeader({"total", "setup", "pixels"});
+  return RunFiles(args, fnames, &LatencyDecoder::Decode);
+}
+
+int DecodeLatencyMain(int argc, const char** argv) {
+  Args args;
+  CommandLineParser parser;
+  parser.AddOptionValue('\0', "input", "GLOB",
+                        "The JXL files to decode, a file name or a glob.",
+                        &args.input, &ParseString);
+  parser.AddOptionValue('\0', "num_reps", "N",
+                        "How many times to decode each file (default: 100).",
+                        &args.num_reps, &ParseUnsigned);
+  parser.AddOptionFlag('\0', "cold",
+                       "Create a new decoder and thread pool for each decode, "
+                       "instead of reusing them.",
+                       &args.cold, &SetBooleanTrue);
+  parser.AddOptionValue('\0', "num_threads", "N",
+                        "Number of worker threads (default: 0, decode on the "
+                        "calling thread).",
+                        &args.num_threads, &ParseSigned);
+  parser.AddOptionValue('\0', "bandwidth_kbps", "KBPS",
+                        "If > 0, simulates the delivery of the input at this "
+                        "many kbit/s and prints when the DC, the first AC pass "
+                        "and the full image are flushed instead, and the CPU "
+                        "time of the flushes.",
+                        &args.bandwidth_kbps, &ParseDouble);
+  parser.AddOptionValue('\0', "chunk_size", "BYTES",
+                        "With --bandwidth_kbps, the size of the network chunks "
+                        "(default: 4096).",
+                        &args.chunk_size, &ParseUnsigned);
+  parser.AddOptionFlag('\0', "flush_each_chunk",
+                       "With --bandwidth_kbps, also flush the image after each "
+                       "chunk, as a viewer that repaints as data comes in.",
+                       &args.flush_each_chunk, &SetBooleanTrue);
+
+  if (!parser.Parse(argc, argv)) {
+    fprintf(stderr, "See -h for help.\n");
+    return EXIT_FAILURE;
+  }
+  if (parser.HelpFlagPassed()) {
+    parser.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+  if (args.input.empty() || args.num_reps == 0 || args.num_threads < 0 ||
+      args.chunk_size == 0) {
+    fprintf(stderr, "Missing --input, or invalid --num_reps, --num_threads "
+                    "or --chunk_size.\nSee -h for help.\n");
+    return EXIT_FAILURE;
+  }
+  return Run(args) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace
+}  // namespace tools
+}  // namespace jpegxl
+
+int main(int argc, const char** argv) {
+  return jpegxl::tools::DecodeLatencyMain(argc, argv);
+}
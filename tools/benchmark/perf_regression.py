@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+# Copyright (c) the JPEG XL Project Authors. All rights reserved.
+#
+# Use of this source code is governed by a BSD-style
+# license that can be found in the LICENSE file.
+
+
+"""perf_regression.py: Detect encoding and decoding slowdowns.
+
+Runs a corpus through benchmark_xl at the standard efforts several times, and
+either records the timings as a baseline JSON file or compares them with one.
+A method and image is a regression when its median time grew by more than the
+threshold and a one-sided Mann-Whitney U test says that the new times are
+larger with the given significance, so that noise alone does not fail the
+check.
+
+  perf_regression.py record --corpus="corpus/*.png" --output=baseline.json
+  perf_regression.py compare --corpus="corpus/*.png" --baseline=baseline.json
+
+The exit code of compare is 1 if there is any regression. Both runs should use
+the same machine, build type and corpus.
+"""
+
+import argparse
+import json
+import math
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+# Lossless at efforts 1, 3, 5 and 7, and lossy at efforts 3, 5 and 7.
+DEFAULT_CODECS = ','.join([
+  'jxl:lightning:d0', 'jxl:falcon:d0', 'jxl:hare:d0', 'jxl:squirrel:d0',
+  'jxl:falcon:d1', 'jxl:hare:d1', 'jxl:squirrel:d1',
+])
+
+BASELINE_VERSION = 1
+
+
+def RunBenchmark(args):
+  """Returns {"method|image": {"encode": [...], "decode": [...]}}, seconds."""
+  samples = {}
+  with tempfile.TemporaryDirectory() as tmp:
+    json_path = os.path.join(tmp, 'phases.json')
+    for run in range(args.runs):
+      cmd = [args.benchmark_xl, '--input=' + args.corpus,
+             '--codec=' + args.codec,
+             '--encode_reps=%d' % args.reps, '--decode_reps=%d' % args.reps,
+             '--phase_timing_json=' + json_path]
+      print('Run %d/%d: %s' % (run + 1, args.runs, ' '.join(cmd)),
+            file=sys.stderr)
+      subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+      with open(json_path) as f:
+        tasks = json.load(f)
+      for task in tasks:
+        if task['errors'] != 0:
+          sys.exit('Errors in %s on %s' % (task['method'], task['image']))
+        key = task['method'] + '|' + task['image']
+        entry = samples.setdefault(key, {'encode': [], 'decode': []})
+        entry['encode'].append(task['encode_seconds'])
+        entry['decode'].append(task['decode_seconds'])
+  return samples
+
+
+def Ranks(values):
+  """Ranks from 1, ties get the mean of their ranks."""
+  order = sorted(range(len(values)), key=lambda i: values[i])
+  ranks = [0.0] * len(values)
+  i = 0
+  while i < len(order):
+    j = i
+    while j + 1 < len(order) and values[order[j + 1]] == values[order[i]]:
+      j += 1
+    for k in range(i, j + 1):
+      ranks[order[k]] = (i + j) / 2.0 + 1
+    i = j + 1
+  return ranks
+
+
+def MannWhitneyGreater(xs, ys):
+  """One-sided p-value of the hypothesis that xs tend to exceed ys."""
+  n1, n2 = len(xs), len(ys)
+  combined = list(xs) + list(ys)
+  ranks = Ranks(combined)
+  u = sum(ranks[:n1]) - n1 * (n1 + 1) / 2.0
+  has_ties = len(set(combined)) < len(combined)
+  if not has_ties and n1 * n2 <= 400:
+    # Exact distribution: counts[a][b][k] is the number of orderings of a xs
+    # and b ys where the xs are larger than k pairs, computed one n at a time.
+    counts = [[[1]] * (n2 + 1) for _ in range(n1 + 1)]
+    for a in range(1, n1 + 1):
+      for b in range(1, n2 + 1):
+        # The largest value is either an x, larger than all b ys, or a y.
+        with_x = [0] * b + counts[a - 1][b]
+        with_y = counts[a][b - 1]
+        size = max(len(with_x), len(with_y))
+        counts[a][b] = [
+          (with_x[k] if k < len(with_x) else 0) +
+          (with_y[k] if k < len(with_y) else 0) for k in range(size)]
+    dist = counts[n1][n2]
+    return sum(dist[int(u):]) / float(sum(dist))
+  # Normal approximation with tie and continuity corrections.
+  n = n1 + n2
+  tie_sum = sum(combined.count(v) ** 3 - combined.count(v)
+                for v in set(combined))
+  variance = n1 * n2 / 12.0 * ((n + 1) - tie_sum / float(n * (n - 1)))
+  if variance <= 0:
+    return 1.0
+  z = (u - n1 * n2 / 2.0 - 0.5) / math.sqrt(variance)
+  return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+def Compare(baseline, current, threshold, alpha):
+  """Prints the comparison and returns the number of regressions."""
+  regressions = 0
+  print('%-40s %-6s %10s %10s %8s %8s' %
+        ('method|image', 'phase', 'base_ms', 'new_ms', 'change', 'p'))
+  for key in sorted(current):
+    if key not in baseline:
+      print('%-40s not in the baseline' % key)
+      continue
+    for phase in ('encode', 'decode'):
+      old = baseline[key][phase]
+      new = current[key][phase]
+      old_median = statistics.median(old)
+      new_median = statistics.median(new)
+      change = new_median / old_median - 1 if old_median > 0 else 0
+      p = MannWhitneyGreater(new, old)
+      regressed = change > threshold and p < alpha
+      regressions += regressed
+      print('%-40s %-6s %10.3f %10.3f %+7.1f%% %8.4f%s' %
+            (key, phase, old_median * 1e3, new_median * 1e3, change * 100, p,
+             '  REGRESSION' if regressed else ''))
+  return regressions
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+  parser.add_argument('command', choices=['record', 'compare'])
+  parser.add_argument('--corpus', required=True,
+                      help='Glob of the input images, as for benchmark_xl.')
+  parser.add_argument('--benchmark_xl', default='build/tools/benchmark_xl',
+                      help='Path to the benchmark_xl binary.')
+  parser.add_argument('--codec', default=DEFAULT_CODECS,
+                      help='benchmark_xl --codec argument.')
+  parser.add_argument('--runs', type=int, default=7,
+                      help='benchmark_xl runs, each gives one sample.')
+  parser.add_argument('--reps', type=int, default=3,
+                      help='Encode and decode repetitions per run.')
+  parser.add_argument('--output', help='Where record writes the baseline.')
+  parser.add_argument('--baseline', help='The baseline that compare reads.')
+  parser.add_argument('--threshold', type=float, default=0.05,
+                      help='Relative slowdown of the median that fails.')
+  parser.add_argument('--alpha', type=float, default=0.01,
+                      help='Significance level of the Mann-Whitney U test.')
+  args = parser.parse_args()
+
+  if args.command == 'record' and not args.output:
+    parser.error('record needs --output')
+  if args.command == 'compare' and not args.baseline:
+    parser.error('compare needs --baseline')
+  if args.runs < 2:
+    parser.error('--runs must be at least 2')
+
+  if args.command == 'compare':
+    with open(args.baseline) as f:
+      baseline = json.load(f)
+    if baseline.get('version') != BASELINE_VERSION:
+      sys.exit('Unsupported baseline version')
+    if baseline['codec'] != args.codec:
+      print('Warning: the baseline was recorded with --codec=%s' %
+            baseline['codec'], file=sys.stderr)
+
+  samples = RunBenchmark(args)
+
+  if args.command == 'record':
+    with open(args.output, 'w') as f:
+      json.dump({'version': BASELINE_VERSION, 'codec': args.codec,
+                 'reps': args.reps, 'samples': samples}, f, indent=1,
+                sort_keys=True)
+    return 0
+
+  regressions = Compare(baseline['samples'], samples, args.threshold,
+                        args.alpha)
+  print('%d regression(s)' % regressions)
+  return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())
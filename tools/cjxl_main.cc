@@ -27,10 +27,14 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "lib/extras/dec/apng.h"
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/exr.h"
+#include "lib/extras/dec/gif.h"
 #include "lib/extras/dec/pnm.h"
 #include "lib/extras/enc/jxl.h"
 #include "lib/extras/packed_image.h"
@@ -43,6 +47,7 @@
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "tools/args.h"
+#include "tools/batch.h"
 #include "tools/cmdline.h"
 #include "tools/codec_config.h"
 #include "tools/file_io.h"
@@ -165,6 +170,12 @@ struct CompressArgs {
                             "boxes. Default is 1 (enabled).",
                             &compress_boxes, &ParseOverride, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "crop_unchanged_frames", "0|1",
+        "Encode the full frames of an animation as the region in which they "
+        "differ from the previous frame. Default is 1 (enabled).",
+        &crop_unchanged_frames, &ParseOverride, 2);
+
     cmdline->AddOptionValue(
         '\0', "brotli_effort", "B_EFFORT",
         "Brotli effort setting. Range: 0 .. 11.\n"
@@ -191,6 +202,20 @@ struct CompressArgs {
         "0 == do not use multithreading).",
         &num_threads, &ParseSigned, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "batch", "LIST",
+        "Encode the files listed in LIST, one 'INPUT OUTPUT' pair per line, "
+        "instead of\n"
+        "    the INPUT and OUTPUT arguments. All files share one thread pool "
+        "and inputs\n"
+        "    are decoded while the previous files are encoded.",
+        &batch_list, &ParseString, 1);
+
+    cmdline->AddOptionValue('\0', "batch_jobs", "N",
+                            "How many files of --batch to encode at once, "
+                            "default is 4.",
+                            &batch_jobs, &ParseUnsigned, 1);
+
     cmdline->AddOptionValue(
         '\0', "photon_noise_iso", "ISO_FILM_SPEED",
         "Adds noise to the image emulating photographic film or sensor noise.\n"
@@ -322,6 +347,12 @@ struct CompressArgs {
                             "is 'encoder chooses'",
                             &gaborish, &ParseOverride, 2);
 
+    cmdline->AddOptionValue('\0', "prefix_codes", "0|1",
+                            "Force disable/enable prefix codes instead of ANS "
+                            "for all entropy coded data, which decodes faster. "
+                            "Default is 'encoder chooses'",
+                            &prefix_codes, &ParseOverride, 2);
+
     cmdline->AddOptionValue('\0', "override_bitdepth", "BITDEPTH",
                             "Default is zero (use the input image bit depth); "
                             "if nonzero, override the bit depth",
@@ -347,7 +378,8 @@ struct CompressArgs {
 
     cmdline->AddOptionFlag('\0', "streaming_input",
                            "Enable streaming processing of the input file "
-                           "(works only for PPM and PGM input files).",
+                           "(works only for PPM, PGM, non-interlaced and "
+                           "non-animated PNG, and EXR input files).",
                            &streaming_input, &SetBooleanTrue, 3);
     cmdline->AddOptionFlag('\0', "streaming_output",
                            "Enable incremental writing of the output file.",
@@ -399,6 +431,18 @@ struct CompressArgs {
         "    the encoder chooses. Zero means no MA trees are used.",
         &modular_ma_tree_learning_percent, &ParseFloat, 4);
 
+    cmdline->AddOptionValue(
+        '\0', "tree_learning_memory", "MIB",
+        "Approximate limit, in MiB, of the memory used to store the pixels\n"
+        "    sampled to learn MA trees. Default of -1 means no limit.",
+        &modular_ma_tree_learning_memory, &ParseInt64, 4);
+
+    cmdline->AddOptionValue(
+        '\0', "modular_rct_sampling", "N",
+        "Estimate the color transforms tried per group on one out of every\n"
+        "    N rows. Default of -1 means the encoder chooses.",
+        &modular_rct_sampling, &ParseInt64, 4);
+
     cmdline->AddOptionValue(
         'C', "modular_colorspace", "K",
         ("Color transform: -1 = default (try several per group, depending\n"
@@ -481,6 +525,8 @@ struct CompressArgs {
   size_t num_reps = 1;
   int32_t num_threads = -1;
   float intensity_target = 0;
+  std::string batch_list;
+  size_t batch_jobs = 4;
 
   // Whether to perform lossless transcoding with kVarDCT or kJPEG encoding.
   // If true, attempts to load JPEG coefficients instead of pixels.
@@ -504,9 +550,11 @@ struct CompressArgs {
   jxl::Override keep_invisible = jxl::Override::kDefault;
   jxl::Override dots = jxl::Override::kDefault;
   jxl::Override patches = jxl::Override::kDefault;
+  jxl::Override prefix_codes = jxl::Override::kDefault;
   jxl::Override gaborish = jxl::Override::kDefault;
   jxl::Override group_order = jxl::Override::kDefault;
   jxl::Override compress_boxes = jxl::Override::kDefault;
+  jxl::Override crop_unchanged_frames = jxl::Override::kDefault;
   jxl::Override noise = jxl::Override::kDefault;
 
   bool allow_expert_options = false;
@@ -526,6 +574,8 @@ struct CompressArgs {
   int64_t modular_palette_colors = -1;
   int64_t modular_nb_prev_channels = -1;
   float modular_ma_tree_learning_percent = -1.f;
+  int64_t modular_ma_tree_learning_memory = -1;
+  int64_t modular_rct_sampling = -1;
   float photon_noise_iso = 0;
   int64_t codestream_level = -1;
   int64_t responsive = -1;
@@ -683,6 +733,8 @@ void ProcessFlags(const jxl::extras::Codec codec,
   ProcessBoolFlag(args->dots, JXL_ENC_FRAME_SETTING_DOTS, params);
   ProcessBoolFlag(args->patches, JXL_ENC_FRAME_SETTING_PATCHES, params);
   ProcessBoolFlag(args->gaborish, JXL_ENC_FRAME_SETTING_GABORISH, params);
+  ProcessBoolFlag(args->prefix_codes, JXL_ENC_FRAME_SETTING_PREFIX_CODES,
+                  params);
   ProcessBoolFlag(args->group_order, JXL_ENC_FRAME_SETTING_GROUP_ORDER, params);
   ProcessBoolFlag(args->noise, JXL_ENC_FRAME_SETTING_NOISE, params);
 
@@ -840,6 +892,22 @@ void ProcessFlags(const jxl::extras::Codec codec,
                            : "Invalid --modular_ma_tree_learning_percent, Valid"
                              "rang is [-1, 100].\n";
               });
+  ProcessFlag("tree_learning_memory", args->modular_ma_tree_learning_memory,
+              JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_MEMORY, params,
+              [](int64_t x) -> std::string {
+                return (x == -1 || (1 <= x && x <= (1 << 20)))
+                           ? ""
+                           : "Invalid --tree_learning_memory. Valid range is "
+                             "{-1, 1, 2, ..., 1048576}.\n";
+              });
+  ProcessFlag("modular_rct_sampling", args->modular_rct_sampling,
+              JXL_ENC_FRAME_SETTING_MODULAR_RCT_SAMPLING, params,
+              [](int64_t x) -> std::string {
+                return (x == -1 || (1 <= x && x <= 64))
+                           ? ""
+                           : "Invalid --modular_rct_sampling. Valid range is "
+                             "{-1, 1, 2, ..., 64}.\n";
+              });
   ProcessFlag("modular_nb_prev_channels", args->modular_nb_prev_channels,
               JXL_ENC_FRAME_SETTING_MODULAR_NB_PREV_CHANNELS, params,
               [](int64_t x) -> std::string {
@@ -915,6 +983,8 @@ void ProcessFlags(const jxl::extras::Codec codec,
   params->codestream_level = args->codestream_level;
   params->premultiply = args->premultiply;
   params->compress_boxes = args->compress_boxes != jxl::Override::kOff;
+  params->crop_unchanged_frames =
+      args->crop_unchanged_frames != jxl::Override::kOff;
   params->upsampling_mode = args->upsampling_mode;
 
   // If a metadata field is set to an empty value, it is stripped.
@@ -983,6 +1053,194 @@ struct JxlOutputProcessor {
   std::unique_ptr<FileWrapper> outfile;
 };
 
+// An input image and the settings to encode it with.
+struct InputImage {
+  jxl::extras::JXLCompressParams params;
+  jxl::extras::PackedPixelFile ppf;
+  jxl::extras::Codec codec = jxl::extras::Codec::kUnknown;
+  // The input file. It outlives the encoding, which may read the JPEG to
+  // transcode or the GIF frames from it.
+  std::vector<uint8_t> image_data;
+  // Points to image_data for lossless JPEG transcoding.
+  std::vector<uint8_t>* jpeg_bytes = nullptr;
+  size_t input_bytes = 0;
+  double decode_mps = 0;
+  size_t pixels = 0;
+};
+
+// Reads and decodes `file_in`, or keeps the JPEG for lossless transcoding.
+bool LoadInput(const char* file_in, CommandLineParser* cmdline,
+               CompressArgs* args, InputImage* input) {
+  jxl::extras::PackedPixelFile& ppf = input->ppf;
+  std::vector<uint8_t>& image_data = input->image_data;
+  // Loading the input.
+  // Depending on flags-settings, we want to either load a JPEG and
+  // faithfully convert it to JPEG XL, or load (JPEG or non-JPEG)
+  // pixel data.
+  jpegxl::tools::FileWrapper f(file_in, "rb");
+  if (!f) {
+    std::cerr << "Reading image data failed.\n";
+    return false;
+  }
+  if (!jpegxl::tools::ReadFile(f, &image_data)) {
+    std::cerr << "Reading image data failed.\n";
+    return false;
+  }
+  input->input_bytes = image_data.size();
+  if (!jpegxl::tools::IsJPG(image_data)) args->lossless_jpeg = JXL_FALSE;
+  ProcessFlags(input->codec, ppf, input->jpeg_bytes, cmdline, args,
+               &input->params);
+  if (!FROM_JXL_BOOL(args->lossless_jpeg)) {
+    const double t0 = jxl::Now();
+    // The frames of a GIF are composited while the previous ones are
+    // encoded, image_data outlives the encoding.
+    ppf.info.uses_original_profile = JXL_TRUE;
+    jxl::Status status = jxl::extras::DecodeImageGIFFrames(
+        jxl::Bytes(image_data), args->color_hints_proxy.target, &ppf);
+    if (status) {
+      input->codec = jxl::extras::Codec::kGIF;
+    } else {
+      status = jxl::extras::DecodeBytes(jxl::Bytes(image_data),
+                                        args->color_hints_proxy.target, &ppf,
+                                        nullptr, &input->codec);
+    }
+
+    if (!status) {
+      std::cerr << "Getting pixel data failed.\n";
+      return false;
+    }
+    if (ppf.num_frames() == 0) {
+      std::cerr << "No frames on input file.\n";
+      return false;
+    }
+    input->pixels = ppf.info.xsize * ppf.info.ysize;
+    const double t1 = jxl::Now();
+    input->decode_mps =
+        input->pixels * ppf.info.num_color_channels * 1E-6 / (t1 - t0);
+  }
+
+  if (FROM_JXL_BOOL(args->lossless_jpeg) && jpegxl::tools::IsJPG(image_data)) {
+    if (!cmdline->GetOption(args->opt_lossless_jpeg_id)->matched()) {
+      std::cerr << "Note: Implicit-default for JPEG is lossless-transcoding. "
+                << "To silence this message, set --lossless_jpeg=(1|0).\n";
+    }
+    input->jpeg_bytes = &image_data;
+    if (args->allow_jpeg_reconstruction) {
+      (void)args->color_hints_proxy.target.Foreach(
+          [](const std::string& key, const std::string& value) -> jxl::Status {
+            if (value.empty()) {
+              if (key != "jumbf") {
+                std::cerr
+                    << "Cannot strip " << key
+                    << " metadata, try setting --allow_jpeg_reconstruction=0. "
+                       "Note that with that setting byte exact reconstruction "
+                       "of the JPEG file won't be possible.\n";
+                exit(EXIT_FAILURE);
+              }
+            }
+            return true;
+          });
+    }
+  }
+  return true;
+}
+
+// Reads the orientation from Exif and decides whether the metadata needs a
+// container.
+void ProcessMetadata(CommandLineParser* cmdline, CompressArgs* args,
+                     jxl::extras::PackedPixelFile* ppf) {
+  if (!ppf->metadata.exif.empty()) {
+    jxl::InterpretExif(ppf->metadata.exif, &ppf->info.orientation);
+  }
+
+  if (!ppf->metadata.exif.empty() || !ppf->metadata.xmp.empty() ||
+      !ppf->metadata.jhgm.empty() || !ppf->metadata.jumbf.empty() ||
+      !ppf->metadata.iptc.empty() ||
+      (FROM_JXL_BOOL(args->lossless_jpeg) &&
+       FROM_JXL_BOOL(args->allow_jpeg_reconstruction))) {
+    if (args->container == jxl::Override::kDefault) {
+      args->container = jxl::Override::kOn;
+    } else if (args->container == jxl::Override::kOff) {
+      cmdline->VerbosePrintf(
+          1, "Stripping all metadata due to explicit container=0\n");
+      ppf->metadata.exif.clear();
+      ppf->metadata.xmp.clear();
+      ppf->metadata.jumbf.clear();
+      ppf->metadata.jhgm.clear();
+      ppf->metadata.iptc.clear();
+      args->allow_jpeg_reconstruction = JXL_FALSE;
+    }
+  }
+}
+
+// Encodes the files of --batch with one thread pool. Each file gets its own
+// copy of the flags, since they are adjusted to the input.
+int RunBatchMode(CommandLineParser* cmdline, const CompressArgs& args,
+                 void* runner) {
+  std::vector<BatchEntry> entries;
+  if (!ReadBatchList(args.batch_list, &entries)) return EXIT_FAILURE;
+  struct BatchItem {
+    CompressArgs args;
+    InputImage input;
+  };
+  std::vector<std::unique_ptr<BatchItem>> items(entries.size());
+  const auto prepare = [&](size_t i) -> bool {
+    items[i] = jxl::make_unique<BatchItem>();
+    BatchItem& item = *items[i];
+    item.args = args;
+    if (!LoadInput(entries[i].input.c_str(), cmdline, &item.args,
+                   &item.input)) {
+      fprintf(stderr, "Failed to load %s\n", entries[i].input.c_str());
+      items[i].reset();
+      return false;
+    }
+    InputImage& input = item.input;
+    ProcessFlags(input.codec, input.ppf, input.jpeg_bytes, cmdline, &item.args,
+                 &input.params);
+    ProcessMetadata(cmdline, &item.args, &input.ppf);
+    input.params.runner = JxlThreadParallelRunner;
+    input.params.runner_opaque = runner;
+    return true;
+  };
+  const auto process = [&](size_t i) -> bool {
+    std::unique_ptr<BatchItem> item = std::move(items[i]);
+    InputImage& input = item->input;
+    std::vector<uint8_t> compressed;
+    if (!EncodeImageJXL(input.params, input.ppf, input.jpeg_bytes,
+                        &compressed)) {
+      fprintf(stderr, "Failed to encode %s\n", entries[i].input.c_str());
+      return false;
+    }
+    if (!args.disable_output &&
+        !jpegxl::tools::WriteFile(entries[i].output, compressed)) {
+      fprintf(stderr, "Could not write %s\n", entries[i].output.c_str());
+      return false;
+    }
+    if (!args.quiet) {
+      cmdline->VerbosePrintf(0, "%s -> %s: %" PRIuS " bytes\n",
+                             entries[i].input.c_str(),
+                             entries[i].output.c_str(), compressed.size());
+    }
+    return true;
+  };
+  const double t0 = jxl::Now();
+  // One decoded input waits for each encoder, so that the next file can
+  // start as soon as one is done.
+  const size_t num_failed =
+      RunBatch(entries.size(), args.batch_jobs, args.batch_jobs, prepare,
+               process);
+  const double t1 = jxl::Now();
+  if (!args.quiet) {
+    cmdline->VerbosePrintf(0, "Encoded %" PRIuS " files in %.3f s",
+                           entries.size() - num_failed, t1 - t0);
+    if (num_failed != 0) {
+      cmdline->VerbosePrintf(0, ", %" PRIuS " failed", num_failed);
+    }
+    cmdline->VerbosePrintf(0, ".\n");
+  }
+  return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 }  // namespace tools
 }  // namespace jpegxl
 
@@ -1008,11 +1266,26 @@ int main(int argc, char** argv) {
     fprintf(stderr, "JPEG XL encoder %s\n", version.c_str());
   }
 
-  if (cmdline.HelpFlagPassed() || !args.file_in) {
+  if (cmdline.HelpFlagPassed() || (!args.file_in && args.batch_list.empty())) {
     cmdline.PrintHelp();
     return jpegxl::tools::CjxlRetCode::OK;
   }
 
+  if (!args.batch_list.empty()) {
+    if ((args.streaming_input || args.streaming_output || args.num_reps > 1) &&
+        !args.quiet) {
+      fprintf(stderr,
+              "Warning: --streaming_input, --streaming_output and --num_reps "
+              "are ignored with --batch.\n");
+    }
+    size_t num_worker_threads =
+        JxlThreadParallelRunnerDefaultNumWorkerThreads();
+    if (args.num_threads > -1) num_worker_threads = args.num_threads;
+    JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+        /*memory_manager=*/nullptr, num_worker_threads);
+    return jpegxl::tools::RunBatchMode(&cmdline, args, runner.get());
+  }
+
   if (!args.file_out && !args.disable_output) {
     std::cerr
         << "No output file specified and --disable_output flag not passed.\n";
@@ -1024,127 +1297,72 @@ int main(int argc, char** argv) {
             "Encoding will be performed, but the result will be discarded.\n");
   }
 
-  jxl::extras::JXLCompressParams params;
-  jxl::extras::PackedPixelFile ppf;
-  jxl::extras::Codec codec = jxl::extras::Codec::kUnknown;
-  std::vector<uint8_t> image_data;
-  std::vector<uint8_t>* jpeg_bytes = nullptr;
-  size_t input_bytes = 0;
-  double decode_mps = 0;
-  size_t pixels = 0;
+  jpegxl::tools::InputImage input;
+  jxl::extras::JXLCompressParams& params = input.params;
+  jxl::extras::PackedPixelFile& ppf = input.ppf;
+  jxl::extras::Codec& codec = input.codec;
+  std::vector<uint8_t>*& jpeg_bytes = input.jpeg_bytes;
+  size_t& pixels = input.pixels;
   bool try_non_streaming = true;
   jxl::extras::ChunkedPNMDecoder pnm_dec;
+  jxl::extras::ChunkedPNGDecoder png_dec;
+  jxl::extras::ChunkedEXRDecoder exr_dec;
   if (args.streaming_input) {
-    bool ok = [&]() -> jxl::Status {
+    // Each decoder rejects the files of the other formats.
+    auto init_pnm = [&]() -> jxl::Status {
       JXL_ASSIGN_OR_RETURN(pnm_dec,
                            jxl::extras::ChunkedPNMDecoder::Init(args.file_in));
+      codec = jxl::extras::Codec::kPNM;
       return true;
-    }();
+    };
+    auto init_png = [&]() -> jxl::Status {
+      JXL_ASSIGN_OR_RETURN(png_dec,
+                           jxl::extras::ChunkedPNGDecoder::Init(args.file_in));
+      codec = jxl::extras::Codec::kPNG;
+      return true;
+    };
+    auto init_exr = [&]() -> jxl::Status {
+      JXL_ASSIGN_OR_RETURN(exr_dec,
+                           jxl::extras::ChunkedEXRDecoder::Init(args.file_in));
+      codec = jxl::extras::Codec::kEXR;
+      return true;
+    };
+    bool ok = init_pnm() || init_png() || init_exr();
     if (!ok) {
-      std::cerr << "Warning PPM/PGM streaming decoding failed, trying "
-                   "non-streaming mode.\n";
+      std::cerr << "Warning streaming decoding failed, trying non-streaming "
+                   "mode.\n";
     } else {  // ok
-      if (!pnm_dec.InitializePPF(args.color_hints_proxy.target, &ppf)) {
+      const jxl::extras::ColorHints& color_hints =
+          args.color_hints_proxy.target;
+      jxl::Status status = true;
+      if (codec == jxl::extras::Codec::kPNM) {
+        status = pnm_dec.InitializePPF(color_hints, &ppf);
+      } else if (codec == jxl::extras::Codec::kPNG) {
+        status = png_dec.InitializePPF(color_hints, &ppf);
+      } else {
+        status = exr_dec.InitializePPF(color_hints, &ppf);
+      }
+      if (!status) {
         std::cerr
             << "Failed to initialize decoding with the given color hints\n";
         exit(EXIT_FAILURE);
       }
-      codec = jxl::extras::Codec::kPNM;
       args.lossless_jpeg = JXL_FALSE;
       pixels = ppf.info.xsize * ppf.info.ysize;
       try_non_streaming = false;
     }
   }
-  if (try_non_streaming) {
-    // Loading the input.
-    // Depending on flags-settings, we want to either load a JPEG and
-    // faithfully convert it to JPEG XL, or load (JPEG or non-JPEG)
-    // pixel data.
-    jpegxl::tools::FileWrapper f(args.file_in, "rb");
-    if (!f) {
-      std::cerr << "Reading image data failed.\n";
-      exit(EXIT_FAILURE);
-    }
-    if (!jpegxl::tools::ReadFile(f, &image_data)) {
-      std::cerr << "Reading image data failed.\n";
-      exit(EXIT_FAILURE);
-    }
-    input_bytes = image_data.size();
-    if (!jpegxl::tools::IsJPG(image_data)) args.lossless_jpeg = JXL_FALSE;
-    ProcessFlags(codec, ppf, jpeg_bytes, &cmdline, &args, &params);
-    if (!FROM_JXL_BOOL(args.lossless_jpeg)) {
-      const double t0 = jxl::Now();
-      jxl::Status status = jxl::extras::DecodeBytes(
-          jxl::Bytes(image_data), args.color_hints_proxy.target, &ppf, nullptr,
-          &codec);
-
-      if (!status) {
-        std::cerr << "Getting pixel data failed.\n";
-        exit(EXIT_FAILURE);
-      }
-      if (ppf.frames.empty()) {
-        std::cerr << "No frames on input file.\n";
-        exit(EXIT_FAILURE);
-      }
-      pixels = ppf.info.xsize * ppf.info.ysize;
-      const double t1 = jxl::Now();
-      decode_mps = pixels * ppf.info.num_color_channels * 1E-6 / (t1 - t0);
-    }
-
-    if (FROM_JXL_BOOL(args.lossless_jpeg) && jpegxl::tools::IsJPG(image_data)) {
-      if (!cmdline.GetOption(args.opt_lossless_jpeg_id)->matched()) {
-        std::cerr << "Note: Implicit-default for JPEG is lossless-transcoding. "
-                  << "To silence this message, set --lossless_jpeg=(1|0).\n";
-      }
-      jpeg_bytes = &image_data;
-      if (args.allow_jpeg_reconstruction) {
-        (void)args.color_hints_proxy.target.Foreach([](const std::string& key,
-                                                       const std::string& value)
-                                                        -> jxl::Status {
-          if (value.empty()) {
-            if (key != "jumbf") {
-              std::cerr
-                  << "Cannot strip " << key
-                  << " metadata, try setting --allow_jpeg_reconstruction=0. "
-                     "Note that with that setting byte exact reconstruction "
-                     "of the JPEG file won't be possible.\n";
-              exit(EXIT_FAILURE);
-            }
-          }
-          return true;
-        });
-      }
-    }
+  if (try_non_streaming &&
+      !jpegxl::tools::LoadInput(args.file_in, &cmdline, &args, &input)) {
+    exit(EXIT_FAILURE);
   }
-
   ProcessFlags(codec, ppf, jpeg_bytes, &cmdline, &args, &params);
 
   if (!args.quiet) {
-    PrintMode(ppf, decode_mps, input_bytes, args, cmdline);
-  }
-
-  if (!ppf.metadata.exif.empty()) {
-    jxl::InterpretExif(ppf.metadata.exif, &ppf.info.orientation);
+    PrintMode(ppf, input.decode_mps, input.input_bytes, args, cmdline);
   }
 
-  if (!ppf.metadata.exif.empty() || !ppf.metadata.xmp.empty() ||
-      !ppf.metadata.jhgm.empty() || !ppf.metadata.jumbf.empty() ||
-      !ppf.metadata.iptc.empty() ||
-      (FROM_JXL_BOOL(args.lossless_jpeg) &&
-       FROM_JXL_BOOL(args.allow_jpeg_reconstruction))) {
-    if (args.container == jxl::Override::kDefault) {
-      args.container = jxl::Override::kOn;
-    } else if (args.container == jxl::Override::kOff) {
-      cmdline.VerbosePrintf(
-          1, "Stripping all metadata due to explicit container=0\n");
-      ppf.metadata.exif.clear();
-      ppf.metadata.xmp.clear();
-      ppf.metadata.jumbf.clear();
-      ppf.metadata.jhgm.clear();
-      ppf.metadata.iptc.clear();
-      args.allow_jpeg_reconstruction = JXL_FALSE;
-    }
-  }
+  ProcessMetadata(&cmdline, &args, &ppf);
 
   size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
   int64_t flag_num_worker_threads = args.num_threads;
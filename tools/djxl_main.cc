@@ -18,6 +18,7 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/extras/alpha_blend.h"
@@ -25,9 +26,13 @@
 #include "lib/extras/dec/jxl.h"
 #include "lib/extras/enc/encode.h"
 #include "lib/extras/enc/jpg.h"
+#include "lib/extras/mmap.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
 #include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "tools/batch.h"
 #include "tools/cmdline.h"
 #include "tools/codec_config.h"
 #include "tools/file_io.h"
@@ -85,6 +90,20 @@ struct DecompressArgs {
                             "default, 0 == do not use multithreading).",
                             &num_threads, &ParseSigned, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "batch", "LIST",
+        "Decode the files listed in LIST, one 'INPUT OUTPUT' pair per line, "
+        "instead of\n"
+        "    the INPUT and OUTPUT arguments. All files share one thread pool "
+        "and inputs\n"
+        "    are read while the previous files are decoded.",
+        &batch_list, &ParseString, 1);
+
+    cmdline->AddOptionValue('\0', "batch_jobs", "N",
+                            "How many files of --batch to decode at once, "
+                            "default is 4.",
+                            &batch_jobs, &ParseUnsigned, 1);
+
     opt_bits_per_sample_id = cmdline->AddOptionValue(
         '\0', "bits_per_sample", "N",
         "Sets the output bit depth. The value 0 (default for PNM) "
@@ -120,6 +139,14 @@ struct DecompressArgs {
                            "Allow decoding of truncated files.",
                            &allow_partial_files, &SetBooleanTrue, 1);
 
+    cmdline->AddOptionFlag(
+        '\0', "streaming_output",
+        "Write the output file while decoding instead of holding the whole "
+        "image in memory.\n"
+        "    Only for PNG, PGM and PPM output of images with a single frame "
+        "and no extra channels, others are written after decoding.",
+        &streaming_output, &SetBooleanTrue, 1);
+
     if (jxl::extras::GetJPEGEncoder()) {
       cmdline->AddOptionFlag(
           'j', "pixels_to_jpeg",
@@ -220,7 +247,7 @@ struct DecompressArgs {
   // Validate the passed arguments, checking whether all passed options are
   // compatible. Returns whether the validation was successful.
   bool ValidateArgs(const CommandLineParser& cmdline) const {
-    if (file_in == nullptr) {
+    if (file_in == nullptr && batch_list.empty()) {
       fprintf(stderr, "Missing INPUT filename.\n");
       return false;
     }
@@ -241,11 +268,14 @@ struct DecompressArgs {
   size_t num_reps = 1;
   bool disable_output = false;
   int32_t num_threads = -1;
+  std::string batch_list;
+  size_t batch_jobs = 4;
   int bits_per_sample = -1;
   double display_nits = 0.0;
   std::string color_space;
   uint32_t downsampling = 0;
   bool allow_partial_files = false;
+  bool streaming_output = false;
   bool pixels_to_jpeg = false;
   size_t jpeg_quality = 95;
   bool use_sjpeg = false;
@@ -346,7 +376,7 @@ bool ParseBackgroundColor(const std::string& background_desc,
 }
 
 bool DecompressJxlReconstructJPEG(const jpegxl::tools::DecompressArgs& args,
-                                  const std::vector<uint8_t>& compressed,
+                                  jxl::Span<const uint8_t> compressed,
                                   void* runner,
                                   std::vector<uint8_t>* jpeg_bytes,
                                   jpegxl::tools::SpeedStats* stats) {
@@ -371,10 +401,10 @@ bool DecompressJxlReconstructJPEG(const jpegxl::tools::DecompressArgs& args,
 
 bool DecompressJxlToPackedPixelFile(
     const jpegxl::tools::DecompressArgs& args,
-    const std::vector<uint8_t>& compressed,
+    jxl::Span<const uint8_t> compressed,
     const std::vector<JxlPixelFormat>& accepted_formats, void* runner,
-    jxl::extras::PackedPixelFile* ppf, size_t* decoded_bytes,
-    jpegxl::tools::SpeedStats* stats) {
+    jxl::extras::PackedRowSink* row_sink, jxl::extras::PackedPixelFile* ppf,
+    size_t* decoded_bytes, jpegxl::tools::SpeedStats* stats) {
   jxl::extras::JXLDecompressParams dparams;
   dparams.max_downsampling = args.downsampling;
   dparams.accepted_formats = accepted_formats;
@@ -384,6 +414,7 @@ bool DecompressJxlToPackedPixelFile(
   dparams.runner = JxlThreadParallelRunner;
   dparams.runner_opaque = runner;
   dparams.allow_partial_input = args.allow_partial_files;
+  dparams.row_sink = row_sink;
   if (args.bits_per_sample == 0) {
     dparams.output_bitdepth.type = JXL_BIT_DEPTH_FROM_CODESTREAM;
   } else if (args.bits_per_sample > 0) {
@@ -403,51 +434,45 @@ bool DecompressJxlToPackedPixelFile(
   return true;
 }
 
-}  // namespace
-
-int main(int argc, const char* argv[]) {
-  std::string version = jpegxl::tools::CodecConfigString(JxlDecoderVersion());
-  jpegxl::tools::DecompressArgs args;
-  jpegxl::tools::CommandLineParser cmdline;
-  args.AddCommandLineOptions(&cmdline);
-
-  if (!cmdline.Parse(argc, argv)) {
-    // Parse already printed the actual error cause.
-    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
-    return EXIT_FAILURE;
-  }
-
-  if (args.version) {
-    fprintf(stdout, "djxl %s\n", version.c_str());
-    fprintf(stdout, "Copyright (c) the JPEG XL Project\n");
-    return EXIT_SUCCESS;
-  }
-  if (!args.quiet) {
-    fprintf(stderr, "JPEG XL decoder %s\n", version.c_str());
-  }
-
-  if (cmdline.HelpFlagPassed() || !args.file_in) {
-    cmdline.PrintHelp();
-    return EXIT_SUCCESS;
-  }
-
-  if (!args.ValidateArgs(cmdline)) {
-    // ValidateArgs already printed the actual error cause.
-    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
-    return EXIT_FAILURE;
-  }
+// The compressed input. Files are memory mapped when possible, so that the
+// decoder reads them directly, without first copying the whole file into
+// memory.
+struct CompressedInput {
+  jxl::MemoryMappedFile mapped_file;
+  std::vector<uint8_t> file_bytes;
+  jxl::Span<const uint8_t> compressed;
+};
 
-  std::vector<uint8_t> compressed;
-  // Reading compressed JPEG XL input
-  if (!jpegxl::tools::ReadFile(args.file_in, &compressed)) {
-    fprintf(stderr, "couldn't load %s\n", args.file_in);
-    return EXIT_FAILURE;
+bool ReadCompressedInput(const char* file_in, CompressedInput* input) {
+  if (strcmp(file_in, "-") != 0) {
+    jxl::StatusOr<jxl::MemoryMappedFile> mapped =
+        jxl::MemoryMappedFile::Init(file_in);
+    if (mapped.ok()) {
+      input->mapped_file = std::move(mapped).value_();
+      // The codestream is mostly read in order.
+      input->mapped_file.AdviseSequential();
+      input->compressed =
+          jxl::Bytes(input->mapped_file.data(), input->mapped_file.size());
+    }
   }
-  if (!args.quiet) {
-    cmdline.VerbosePrintf(1, "Read %" PRIuS " compressed bytes.\n",
-                          compressed.size());
+  if (input->compressed.data() == nullptr) {
+    // stdin, or the file could not be mapped (e.g. it is empty or a pipe).
+    if (!jpegxl::tools::ReadFile(file_in, &input->file_bytes)) {
+      fprintf(stderr, "couldn't load %s\n", file_in);
+      return false;
+    }
+    input->compressed =
+        jxl::Bytes(input->file_bytes.data(), input->file_bytes.size());
   }
+  return true;
+}
 
+// Decodes `compressed` to the output of `args`, which is adjusted to the
+// output format.
+int DecompressToOutput(const jpegxl::tools::CommandLineParser& cmdline,
+                       jpegxl::tools::DecompressArgs args,
+                       jxl::Span<const uint8_t> compressed, void* runner,
+                       jpegxl::tools::SpeedStats* stats) {
   if (!args.file_out && !args.disable_output) {
     std::cerr
         << "No output file specified and --disable_output flag not passed.\n";
@@ -481,17 +506,6 @@ int main(int argc, const char* argv[]) {
     args.bits_per_sample = 0;
   }
 
-  jpegxl::tools::SpeedStats stats;
-  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
-  {
-    int64_t flag_num_worker_threads = args.num_threads;
-    if (flag_num_worker_threads > -1) {
-      num_worker_threads = flag_num_worker_threads;
-    }
-  }
-  auto runner = JxlThreadParallelRunnerMake(
-      /*memory_manager=*/nullptr, num_worker_threads);
-
   bool decode_to_pixels = (codec != jxl::extras::Codec::kJPG);
   if (args.opt_jpeg_quality_id >= 0 &&
       (args.pixels_to_jpeg ||
@@ -503,8 +517,8 @@ int main(int argc, const char* argv[]) {
   if (!decode_to_pixels) {
     std::vector<uint8_t> bytes;
     for (size_t i = 0; i < num_reps; ++i) {
-      if (!DecompressJxlReconstructJPEG(args, compressed, runner.get(), &bytes,
-                                        &stats)) {
+      if (!DecompressJxlReconstructJPEG(args, compressed, runner, &bytes,
+                                        stats)) {
         if (bytes.empty()) {
           if (!args.quiet) {
             fprintf(stderr,
@@ -555,23 +569,67 @@ int main(int argc, const char* argv[]) {
         }
       }
     }
+    // The file is only created once the decoder starts writing rows to it,
+    // images that can not be streamed are written after decoding.
+    std::unique_ptr<jpegxl::tools::FileWrapper> streaming_file;
+    std::unique_ptr<jxl::extras::PackedRowSink> row_sink;
+    if (args.streaming_output && encoder && num_reps == 1 &&
+        !args.alpha_blend && args.preview_out.empty()) {
+      row_sink = encoder->CreateRowSink(
+          [&](const uint8_t* data, size_t size) -> jxl::Status {
+            if (!streaming_file) {
+              streaming_file = jxl::make_unique<jpegxl::tools::FileWrapper>(
+                  filename_out, "wb");
+              if (!*streaming_file) {
+                fprintf(stderr, "Could not open %s for writing\n",
+                        filename_out.c_str());
+              }
+            }
+            if (!*streaming_file) return false;
+            if (fwrite(data, 1, size, *streaming_file) != size) {
+              fprintf(stderr, "Could not write to file\n");
+              return false;
+            }
+            return true;
+          });
+      if (!row_sink && !args.quiet) {
+        fprintf(stderr,
+                "Warning: --streaming_output is not supported for this "
+                "output format.\n");
+      }
+    }
     jxl::extras::PackedPixelFile ppf;
     size_t decoded_bytes = 0;
     for (size_t i = 0; i < num_reps; ++i) {
       if (!DecompressJxlToPackedPixelFile(args, compressed, accepted_formats,
-                                          runner.get(), &ppf, &decoded_bytes,
-                                          &stats)) {
+                                          runner, row_sink.get(), &ppf,
+                                          &decoded_bytes, stats)) {
         fprintf(stderr, "DecompressJxlToPackedPixelFile failed\n");
+        if (streaming_file && filename_out != "-") {
+          streaming_file.reset();
+          remove(filename_out.c_str());
+        }
         return EXIT_FAILURE;
       }
     }
+    // The decoder leaves out the frames that went to the row sink.
+    const bool streamed = row_sink && ppf.frames.empty();
     if (!args.quiet) cmdline.VerbosePrintf(0, "Decoded to pixels.\n");
     if (args.print_read_bytes) {
       fprintf(stderr, "Decoded bytes: %" PRIuS "\n", decoded_bytes);
     }
+    if (streamed) {
+      if (!args.quiet) {
+        cmdline.VerbosePrintf(1, "Wrote output to %s\n", filename_out.c_str());
+      }
+      if (!WriteOptionalOutput(args.icc_out, ppf.icc) ||
+          !WriteOptionalOutput(args.orig_icc_out, ppf.orig_icc)) {
+        return EXIT_FAILURE;
+      }
+    }
     // When --disable_output was parsed, `filename_out` is empty and we don't
     // need to write files.
-    if (encoder) {
+    if (encoder && !streamed) {
       if (args.alpha_blend) {
         float background[3];
         if (!ParseBackgroundColor(args.background_spec, background)) {
@@ -622,6 +680,119 @@ int main(int argc, const char* argv[]) {
       }
     }
   }
+  return EXIT_SUCCESS;
+}
+
+// Decodes the files of --batch with one thread pool, the next inputs are read
+// while the previous ones are decoded.
+int RunBatchMode(const jpegxl::tools::CommandLineParser& cmdline,
+                 const jpegxl::tools::DecompressArgs& args, void* runner) {
+  std::vector<jpegxl::tools::BatchEntry> entries;
+  if (!jpegxl::tools::ReadBatchList(args.batch_list, &entries)) {
+    return EXIT_FAILURE;
+  }
+  std::vector<std::unique_ptr<CompressedInput>> inputs(entries.size());
+  const auto prepare = [&](size_t i) -> bool {
+    inputs[i] = jxl::make_unique<CompressedInput>();
+    if (!ReadCompressedInput(entries[i].input.c_str(), inputs[i].get())) {
+      inputs[i].reset();
+      return false;
+    }
+    return true;
+  };
+  const auto process = [&](size_t i) -> bool {
+    std::unique_ptr<CompressedInput> input = std::move(inputs[i]);
+    jpegxl::tools::DecompressArgs file_args = args;
+    file_args.file_in = entries[i].input.c_str();
+    file_args.file_out = entries[i].output.c_str();
+    file_args.num_reps = 1;
+    jpegxl::tools::SpeedStats stats;
+    if (DecompressToOutput(cmdline, file_args, input->compressed, runner,
+                           &stats) != EXIT_SUCCESS) {
+      fprintf(stderr, "Failed to decode %s\n", entries[i].input.c_str());
+      return false;
+    }
+    return true;
+  };
+  const double t0 = jxl::Now();
+  const size_t num_failed =
+      jpegxl::tools::RunBatch(entries.size(), args.batch_jobs,
+                              args.batch_jobs, prepare, process);
+  const double t1 = jxl::Now();
+  if (!args.quiet) {
+    cmdline.VerbosePrintf(0, "Decoded %" PRIuS " files in %.3f s",
+                          entries.size() - num_failed, t1 - t0);
+    if (num_failed != 0) {
+      cmdline.VerbosePrintf(0, ", %" PRIuS " failed", num_failed);
+    }
+    cmdline.VerbosePrintf(0, ".\n");
+  }
+  return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  std::string version = jpegxl::tools::CodecConfigString(JxlDecoderVersion());
+  jpegxl::tools::DecompressArgs args;
+  jpegxl::tools::CommandLineParser cmdline;
+  args.AddCommandLineOptions(&cmdline);
+
+  if (!cmdline.Parse(argc, argv)) {
+    // Parse already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (args.version) {
+    fprintf(stdout, "djxl %s\n", version.c_str());
+    fprintf(stdout, "Copyright (c) the JPEG XL Project\n");
+    return EXIT_SUCCESS;
+  }
+  if (!args.quiet) {
+    fprintf(stderr, "JPEG XL decoder %s\n", version.c_str());
+  }
+
+  if (cmdline.HelpFlagPassed() || (!args.file_in && args.batch_list.empty())) {
+    cmdline.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+
+  if (!args.ValidateArgs(cmdline)) {
+    // ValidateArgs already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  {
+    int64_t flag_num_worker_threads = args.num_threads;
+    if (flag_num_worker_threads > -1) {
+      num_worker_threads = flag_num_worker_threads;
+    }
+  }
+  auto runner = JxlThreadParallelRunnerMake(
+      /*memory_manager=*/nullptr, num_worker_threads);
+
+  if (!args.batch_list.empty()) {
+    if (args.num_reps > 1 && !args.quiet) {
+      fprintf(stderr, "Warning: --num_reps is ignored with --batch.\n");
+    }
+    return RunBatchMode(cmdline, args, runner.get());
+  }
+
+  CompressedInput input;
+  if (!ReadCompressedInput(args.file_in, &input)) return EXIT_FAILURE;
+  const jxl::Span<const uint8_t> compressed = input.compressed;
+  if (!args.quiet) {
+    cmdline.VerbosePrintf(1, "Read %" PRIuS " compressed bytes.\n",
+                          compressed.size());
+  }
+
+  jpegxl::tools::SpeedStats stats;
+  const int ret =
+      DecompressToOutput(cmdline, args, compressed, runner.get(), &stats);
+  if (ret != EXIT_SUCCESS) return ret;
   if (!args.quiet) {
     stats.Print(num_worker_threads);
   }
@@ -18,7 +18,8 @@
 int main(int argc, char** argv) {
   if (argc < 3) {
     fprintf(stderr,
-            "Usage: %s in.png out.jxl [effort] [num_reps] [num_threads]\n",
+            "Usage: %s in.png out.jxl [effort] [num_reps] [num_threads] "
+            "[max_error]\n",
             argv[0]);
     return 1;
   }
@@ -28,6 +29,7 @@ int main(int argc, char** argv) {
   int effort = argc >= 4 ? atoi(argv[3]) : 2;
   size_t num_reps = argc >= 5 ? atoi(argv[4]) : 1;
   size_t num_threads = argc >= 6 ? atoi(argv[5]) : 0;
+  int max_error = argc >= 7 ? atoi(argv[6]) : 0;
 
   if (effort < 0 || effort > 127) {
     fprintf(
@@ -36,6 +38,12 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  if (max_error < 0 || max_error > 4) {
+    fprintf(stderr,
+            "Max error should be between 0 (lossless, default) and 4\n");
+    return 1;
+  }
+
   unsigned char* png;
   unsigned w;
   unsigned h;
@@ -87,9 +95,10 @@ int main(int argc, char** argv) {
   for (size_t _ = 0; _ < num_reps; _++) {
     free(encoded);
     encoded = nullptr;
-    encoded_size = JxlFastLosslessEncode(
+    encoded_size = JxlFastNearLosslessEncode(
         png, width, stride, height, nb_chans, bitdepth,
-        /*big_endian=*/true, effort, &encoded, &num_threads, +parallel_runner);
+        /*big_endian=*/true, effort, max_error, &encoded, &num_threads,
+        +parallel_runner);
     if (encoded_size == 0) return EXIT_FAILURE;
   }
   auto stop = std::chrono::high_resolution_clock::now();
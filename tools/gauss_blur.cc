@@ -17,7 +17,7 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
-#include "lib/jxl/base/common.h"             // RoundUpTo
+#include "lib/jxl/base/common.h"             // DivCeil, RoundUpTo
 #include "lib/jxl/base/compiler_specific.h"  // JXL_RESTRICT
 #include "lib/jxl/base/matrix_ops.h"         // Inv3x3Matrix
 HWY_BEFORE_NAMESPACE();
@@ -368,11 +368,11 @@ void VerticalStrip(const RecursiveGaussian& rg, const size_t x,
   }
 }
 
-// Apply 1D vertical scan to multiple columns (one per vector lane).
-// Not yet parallelized.
-void FastGaussianVertical(const RecursiveGaussian& rg, const size_t xsize,
-                          const size_t ysize, const GetConstRow& in,
-                          const GetRow& out, ThreadPool* /* pool */) {
+// Apply 1D vertical scan to multiple columns (one per vector lane). Each task
+// processes one strip of columns.
+Status FastGaussianVertical(const RecursiveGaussian& rg, const size_t xsize,
+                            const size_t ysize, const GetConstRow& in,
+                            const GetRow& out, ThreadPool* pool) {
   const HWY_FULL(float) df;
   constexpr size_t kCacheLineLanes = 64 / sizeof(float);
   constexpr size_t kVN = MaxLanes(df);
@@ -380,14 +380,21 @@ void FastGaussianVertical(const RecursiveGaussian& rg, const size_t xsize,
       (kVN < kCacheLineLanes) ? (kCacheLineLanes / kVN) : 4;
   constexpr size_t kFastPace = kCacheLineVectors * kVN;
 
-  // TODO(eustas): why pool is unused?
-  size_t x = 0;
-  for (; x + kFastPace <= xsize; x += kFastPace) {
-    VerticalStrip<kCacheLineVectors>(rg, x, ysize, in, out);
-  }
-  for (; x < xsize; x += kVN) {
-    VerticalStrip<1>(rg, x, ysize, in, out);
-  }
+  const size_t num_fast = xsize / kFastPace;
+  const size_t fast_end = num_fast * kFastPace;
+  const size_t num_tasks = num_fast + DivCeil(xsize - fast_end, kVN);
+  const auto process_strip = [&](const uint32_t task,
+                                 size_t /*thread*/) -> Status {
+    if (task < num_fast) {
+      VerticalStrip<kCacheLineVectors>(rg, task * kFastPace, ysize, in, out);
+    } else {
+      VerticalStrip<1>(rg, fast_end + (task - num_fast) * kVN, ysize, in, out);
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_tasks, ThreadPool::NoInit,
+                                process_strip, "FastGaussianVertical"));
+  return true;
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -527,8 +534,8 @@ Status FastGaussian(const RecursiveGaussian& rg, const size_t xsize,
                     const GetRow& temp, const GetRow& out, ThreadPool* pool) {
   JXL_RETURN_IF_ERROR(FastGaussianHorizontal(rg, xsize, ysize, in, temp, pool));
   GetConstRow temp_in = [&](size_t y) { return temp(y); };
-  HWY_DYNAMIC_DISPATCH(FastGaussianVertical)
-  (rg, xsize, ysize, temp_in, out, pool);
+  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(FastGaussianVertical)(
+      rg, xsize, ysize, temp_in, out, pool));
   return true;
 }
 
@@ -365,6 +365,32 @@ TEST(GaussBlurTest, TestRandom) {
   TestRandomForSizes(-6.0f, 6.0f, 7.0f);
 }
 
+TEST(GaussBlurTest, TestPool) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 301;
+  const size_t ysize = 67;
+  JXL_TEST_ASSIGN_OR_DIE(ImageF in,
+                         ImageF::Create(memory_manager, xsize, ysize));
+  RandomFillImage(&in, -1.0f, 1.0f, 12345);
+  JXL_TEST_ASSIGN_OR_DIE(ImageF temp,
+                         ImageF::Create(memory_manager, xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(ImageF expected,
+                         ImageF::Create(memory_manager, xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(ImageF out,
+                         ImageF::Create(memory_manager, xsize, ysize));
+  const auto rg = CreateRecursiveGaussian(2.5);
+  ASSERT_TRUE(FastGaussian(
+      rg, xsize, ysize, [&](size_t y) { return in.ConstRow(y); },
+      [&](size_t y) { return temp.Row(y); },
+      [&](size_t y) { return expected.Row(y); }));
+  test::ThreadPoolForTests pool(4);
+  ASSERT_TRUE(FastGaussian(
+      rg, xsize, ysize, [&](size_t y) { return in.ConstRow(y); },
+      [&](size_t y) { return temp.Row(y); },
+      [&](size_t y) { return out.Row(y); }, pool.get()));
+  JXL_TEST_ASSERT_OK(SamePixels(expected, out, _));
+}
+
 TEST(GaussBlurTest, TestSign) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   const size_t xsize = 500;
@@ -0,0 +1,95 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "lib/extras/codec.h"
+#include "lib/extras/gain_map_render.h"
+#include "tools/cmdline.h"
+#include "tools/file_io.h"
+#include "tools/hdr/image_utils.h"
+#include "tools/no_memory_manager.h"
+#include "tools/thread_pool_internal.h"
+
+int main(int argc, const char** argv) {
+  jpegxl::tools::ThreadPoolInternal pool;
+
+  jpegxl::tools::CommandLineParser parser;
+  float display_headroom = 0;
+  auto display_headroom_option = parser.AddOptionValue(
+      'H', "display_headroom", "stops",
+      "headroom of the target display above SDR white, in stops (log2)",
+      &display_headroom, &jpegxl::tools::ParseFloat, 0);
+  float sdr_white_nits = 203;
+  parser.AddOptionValue(
+      'w', "sdr_white_nits", "nits",
+      "luminance of SDR white on the target display (default: 203)",
+      &sdr_white_nits, &jpegxl::tools::ParseFloat, 0);
+  bool pq = false;
+  parser.AddOptionFlag('p', "pq",
+                       "write the output with absolute luminance using PQ", &pq,
+                       &jpegxl::tools::SetBooleanTrue, 0);
+  const char* input_filename = nullptr;
+  auto input_filename_option = parser.AddPositionalOption(
+      "input", true, "input JPEG XL image with a gain map", &input_filename, 0);
+  const char* output_filename = nullptr;
+  auto output_filename_option = parser.AddPositionalOption(
+      "output", true, "output image", &output_filename, 0);
+
+  if (!parser.Parse(argc, argv)) {
+    fprintf(stderr, "See -h for help.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (parser.HelpFlagPassed()) {
+    parser.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+
+  if (!parser.GetOption(display_headroom_option)->matched()) {
+    fprintf(stderr,
+            "Missing required argument --display_headroom.\nSee -h for "
+            "help.\n");
+    return EXIT_FAILURE;
+  }
+  if (!parser.GetOption(input_filename_option)->matched()) {
+    fprintf(stderr, "Missing input filename.\nSee -h for help.\n");
+    return EXIT_FAILURE;
+  }
+  if (!parser.GetOption(output_filename_option)->matched()) {
+    fprintf(stderr, "Missing output filename.\nSee -h for help.\n");
+    return EXIT_FAILURE;
+  }
+
+  jxl::CodecInOut image{jpegxl::tools::NoMemoryManager()};
+  std::vector<uint8_t> encoded;
+  JPEGXL_TOOLS_CHECK(jpegxl::tools::ReadFile(input_filename, &encoded));
+  JPEGXL_TOOLS_CHECK(
+      jxl::SetFromBytes(jxl::Bytes(encoded), &image, pool.get()));
+  if (image.blobs.jhgm.empty()) {
+    fprintf(stderr, "%s has no gain map.\n", input_filename);
+    return EXIT_FAILURE;
+  }
+  JPEGXL_TOOLS_CHECK(jxl::ApplyGainMap(display_headroom, sdr_white_nits,
+                                       &image, pool.get()));
+  // The gain map is consumed by the rendering.
+  image.blobs.jhgm.clear();
+
+  jxl::ColorEncoding c_out = image.metadata.m.color_encoding;
+  jxl::cms::TransferFunction tf =
+      pq ? jxl::TransferFunction::kPQ : jxl::TransferFunction::kSRGB;
+  c_out.Tf().SetTransferFunction(tf);
+  JPEGXL_TOOLS_CHECK(c_out.CreateICC());
+  JPEGXL_TOOLS_CHECK(
+      jpegxl::tools::TransformCodecInOutTo(image, c_out, pool.get()));
+  image.metadata.m.color_encoding = c_out;
+  JPEGXL_TOOLS_CHECK(
+      jpegxl::tools::Encode(image, output_filename, &encoded, pool.get()));
+  JPEGXL_TOOLS_CHECK(jpegxl::tools::WriteFile(output_filename, encoded));
+  return EXIT_SUCCESS;
+}
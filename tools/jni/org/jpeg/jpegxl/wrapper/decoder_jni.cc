@@ -8,7 +8,7 @@
 #include <jni.h>
 #include <jxl/codestream_header.h>
 #include <jxl/decode.h>
-#include <jxl/thread_parallel_runner.h>
+#include <jxl/decode_cxx.h>
 #include <jxl/types.h>
 
 #include <cstdint>
@@ -88,26 +88,21 @@ Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
     return FAILURE("Failed to access ICC buffer");
   }
 
-  JxlDecoder* dec = JxlDecoderCreate(nullptr);
-
-  constexpr size_t kNumThreads = 0;  // Do everything in this thread.
-  void* runner = JxlThreadParallelRunnerCreate(nullptr, kNumThreads);
+  // Image loaders call this for many images, twice per image, from a few
+  // threads: reuse one decoder per thread instead of creating one per call.
+  // Without a parallel runner, everything is done in this thread.
+  static thread_local JxlDecoderPtr decoder = JxlDecoderMake(nullptr);
+  if (!decoder) return FAILURE("Failed to create decoder");
+  JxlDecoder* dec = decoder.get();
+  JxlDecoderReset(dec);
 
   struct Defer {
     JxlDecoder* dec;
-    void* runner;
-    ~Defer() {
-      JxlThreadParallelRunnerDestroy(runner);
-      JxlDecoderDestroy(dec);
-    }
-  } defer{dec, runner};
+    // Do not keep a reference to the input until the next call.
+    ~Defer() { JxlDecoderReleaseInput(dec); }
+  } defer{dec};
 
-  auto status =
-      JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner, runner);
-  if (status != JXL_DEC_SUCCESS) {
-    return FAILURE("Failed to set parallel runner");
-  }
-  status = JxlDecoderSubscribeEvents(
+  auto status = JxlDecoderSubscribeEvents(
       dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE | JXL_DEC_COLOR_ENCODING);
   if (status != JXL_DEC_SUCCESS) {
     return FAILURE("Failed to subscribe for events");
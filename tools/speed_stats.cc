@@ -11,6 +11,13 @@
 #include <cstdio>
 #include <string>
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace jpegxl {
 namespace tools {
 
@@ -108,5 +115,87 @@ bool SpeedStats::Print(size_t worker_threads) {
   return true;
 }
 
+const char* PerfCounters::Name(Counter counter) {
+  switch (counter) {
+    case kCycles:
+      return "cycles";
+    case kInstructions:
+      return "instructions";
+    case kCacheMisses:
+      return "llc_misses";
+    case kBranchMisses:
+      return "branch_misses";
+  }
+  return "unknown";
+}
+
+#if defined(__linux__)
+
+PerfCounters::PerfCounters() {
+  fds_.fill(-1);
+  static const uint64_t kConfigs[kNumCounters] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  for (size_t i = 0; i < kNumCounters; ++i) {
+    // Without the leader, the others are of no use.
+    if (i != kCycles && fds_[kCycles] < 0) break;
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = kConfigs[i];
+    attr.disabled = (i == kCycles) ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING | PERF_FORMAT_ID;
+    fds_[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr,
+                                       /*pid=*/0, /*cpu=*/-1,
+                                       /*group_fd=*/fds_[kCycles],
+                                       /*flags=*/0));
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds_) {
+    if (fd >= 0) close(fd);
+  }
+}
+
+void PerfCounters::Start() {
+  if (!Available()) return;
+  ioctl(fds_[kCycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds_[kCycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounters::Counts PerfCounters::Stop() {
+  Counts counts;
+  counts.fill(-1);
+  if (!Available()) return counts;
+  ioctl(fds_[kCycles], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  for (size_t i = 0; i < kNumCounters; ++i) {
+    if (fds_[i] < 0) continue;
+    // value, time enabled, time running, id.
+    uint64_t data[4];
+    if (read(fds_[i], data, sizeof(data)) != sizeof(data)) continue;
+    if (data[2] == 0) continue;
+    // Scales up when the counters were multiplexed with others.
+    counts[i] = static_cast<double>(data[0]) * data[1] / data[2];
+  }
+  return counts;
+}
+
+#else  // __linux__
+
+PerfCounters::PerfCounters() { fds_.fill(-1); }
+PerfCounters::~PerfCounters() = default;
+void PerfCounters::Start() {}
+PerfCounters::Counts PerfCounters::Stop() {
+  Counts counts;
+  counts.fill(-1);
+  return counts;
+}
+
+#endif  // __linux__
+
 }  // namespace tools
 }  // namespace jpegxl
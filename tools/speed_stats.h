@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <array>
 #include <vector>
 
 namespace jpegxl {
@@ -55,6 +56,36 @@ class SpeedStats {
   size_t file_size_ = 0;
 };
 
+// Hardware performance counters of the calling thread, from perf_event on
+// Linux. Unavailable elsewhere, or when the kernel does not allow them (see
+// /proc/sys/kernel/perf_event_paranoid); single counters can also be missing,
+// e.g. in virtual machines.
+class PerfCounters {
+ public:
+  enum Counter { kCycles, kInstructions, kCacheMisses, kBranchMisses };
+  static constexpr size_t kNumCounters = 4;
+
+  // Counts of each Counter, negative if that one is unavailable.
+  using Counts = std::array<double, kNumCounters>;
+
+  static const char* Name(Counter counter);
+
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool Available() const { return fds_[kCycles] >= 0; }
+
+  // Counts from zero until Stop().
+  void Start();
+  Counts Stop();
+
+ private:
+  // Group leader first, -1 if unavailable.
+  std::array<int, kNumCounters> fds_;
+};
+
 }  // namespace tools
 }  // namespace jpegxl
 
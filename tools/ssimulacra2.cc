@@ -33,6 +33,7 @@ Design:
 #include <utility>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -49,19 +50,22 @@ using ::jxl::ImageBundle;
 using ::jxl::ImageF;
 using ::jxl::Status;
 using ::jxl::StatusOr;
+using ::jxl::ThreadPool;
 
 const float kC2 = 0.0009f;
 const int kNumScales = 6;
 
-StatusOr<Image3F> Downsample(const Image3F& in, size_t fx, size_t fy) {
+StatusOr<Image3F> Downsample(const Image3F& in, size_t fx, size_t fy,
+                             ThreadPool* pool) {
   const size_t out_xsize = (in.xsize() + fx - 1) / fx;
   const size_t out_ysize = (in.ysize() + fy - 1) / fy;
   JXL_ASSIGN_OR_RETURN(
       Image3F out,
       Image3F::Create(jpegxl::tools::NoMemoryManager(), out_xsize, out_ysize));
   const float normalize = 1.0f / (fx * fy);
-  for (size_t c = 0; c < 3; ++c) {
-    for (size_t oy = 0; oy < out_ysize; ++oy) {
+  const auto process_row = [&](const uint32_t oy,
+                               size_t /*thread*/) -> Status {
+    for (size_t c = 0; c < 3; ++c) {
       float* JXL_RESTRICT row_out = out.PlaneRow(c, oy);
       for (size_t ox = 0; ox < out_xsize; ++ox) {
         float sum = 0.0f;
@@ -75,13 +79,17 @@ StatusOr<Image3F> Downsample(const Image3F& in, size_t fx, size_t fy) {
         row_out[ox] = sum * normalize;
       }
     }
-  }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, out_ysize, ThreadPool::NoInit,
+                                process_row, "SSIMULACRA2Downsample"));
   return out;
 }
 
-void Multiply(const Image3F& a, const Image3F& b, Image3F* mul) {
-  for (size_t c = 0; c < 3; ++c) {
-    for (size_t y = 0; y < a.ysize(); ++y) {
+Status Multiply(const Image3F& a, const Image3F& b, Image3F* mul,
+                ThreadPool* pool) {
+  const auto process_row = [&](const uint32_t y, size_t /*thread*/) -> Status {
+    for (size_t c = 0; c < 3; ++c) {
       const float* JXL_RESTRICT in1 = a.PlaneRow(c, y);
       const float* JXL_RESTRICT in2 = b.PlaneRow(c, y);
       float* JXL_RESTRICT out = mul->PlaneRow(c, y);
@@ -89,7 +97,10 @@ void Multiply(const Image3F& a, const Image3F& b, Image3F* mul) {
         out[x] = in1[x] * in2[x];
       }
     }
-  }
+    return true;
+  };
+  return RunOnPool(pool, 0, a.ysize(), ThreadPool::NoInit, process_row,
+                   "SSIMULACRA2Multiply");
 }
 
 // Temporary storage for Gaussian blur, reused for multiple images.
@@ -103,21 +114,22 @@ class Blur {
     return result;
   }
 
-  Status BlurPlane(const ImageF& in, ImageF* JXL_RESTRICT out) {
+  Status BlurPlane(const ImageF& in, ImageF* JXL_RESTRICT out,
+                   ThreadPool* pool) {
     JXL_RETURN_IF_ERROR(FastGaussian(
         rg_, in.xsize(), in.ysize(), [&](size_t y) { return in.ConstRow(y); },
         [&](size_t y) { return temp_.Row(y); },
-        [&](size_t y) { return out->Row(y); }));
+        [&](size_t y) { return out->Row(y); }, pool));
     return true;
   }
 
-  StatusOr<Image3F> operator()(const Image3F& in) {
+  StatusOr<Image3F> operator()(const Image3F& in, ThreadPool* pool) {
     JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
     JXL_ASSIGN_OR_RETURN(
         Image3F out, Image3F::Create(memory_manager, in.xsize(), in.ysize()));
-    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(0), &out.Plane(0)));
-    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(1), &out.Plane(1)));
-    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(2), &out.Plane(2)));
+    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(0), &out.Plane(0), pool));
+    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(1), &out.Plane(1), pool));
+    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(2), &out.Plane(2), pool));
     return out;
   }
 
@@ -137,10 +149,14 @@ double quartic(double x) {
   x *= x;
   return x;
 }
-void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
-             const Image3F& s22, const Image3F& s12, double* plane_averages) {
+// Each channel is summed up by one task, so the result does not depend on the
+// number of threads.
+Status SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
+               const Image3F& s22, const Image3F& s12, double* plane_averages,
+               ThreadPool* pool) {
   const double onePerPixels = 1.0 / (m1.ysize() * m1.xsize());
-  for (size_t c = 0; c < 3; ++c) {
+  const auto process_channel = [&](const uint32_t c,
+                                   size_t /*thread*/) -> Status {
     double sum1[2] = {0.0};
     for (size_t y = 0; y < m1.ysize(); ++y) {
       const float* JXL_RESTRICT row_m1 = m1.PlaneRow(c, y);
@@ -181,13 +197,18 @@ void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
     }
     plane_averages[c * 2] = onePerPixels * sum1[0];
     plane_averages[c * 2 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
-  }
+    return true;
+  };
+  return RunOnPool(pool, 0, 3, ThreadPool::NoInit, process_channel,
+                   "SSIMULACRA2SSIMMap");
 }
 
-void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
-                 const Image3F& mu2, double* plane_averages) {
+Status EdgeDiffMap(const Image3F& img1, const Image3F& mu1,
+                   const Image3F& img2, const Image3F& mu2,
+                   double* plane_averages, ThreadPool* pool) {
   const double onePerPixels = 1.0 / (img1.ysize() * img1.xsize());
-  for (size_t c = 0; c < 3; ++c) {
+  const auto process_channel = [&](const uint32_t c,
+                                   size_t /*thread*/) -> Status {
     double sum1[4] = {0.0};
     for (size_t y = 0; y < img1.ysize(); ++y) {
       const float* JXL_RESTRICT row1 = img1.PlaneRow(c, y);
@@ -216,7 +237,10 @@ void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
     plane_averages[c * 4 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
     plane_averages[c * 4 + 2] = onePerPixels * sum1[2];
     plane_averages[c * 4 + 3] = sqrt(sqrt(onePerPixels * sum1[3]));
-  }
+    return true;
+  };
+  return RunOnPool(pool, 0, 3, ThreadPool::NoInit, process_channel,
+                   "SSIMULACRA2EdgeDiffMap");
 }
 
 /* Get all components in more or less 0..1 range
@@ -258,6 +282,35 @@ void AlphaBlend(ImageBundle& img, float bg) {
   }
 }
 
+// Returns a copy of `in` in linear sRGB, blended against the gray background
+// `bg` if it has alpha.
+StatusOr<ImageBundle> ToLinearSRGB(const ImageBundle& in, float bg,
+                                   ThreadPool* pool) {
+  JXL_ASSIGN_OR_RETURN(ImageBundle out, in.Copy());
+  if (in.HasAlpha()) AlphaBlend(out, bg);
+  out.ClearExtraChannels();
+  JXL_RETURN_IF_ERROR(
+      out.TransformTo(jxl::ColorEncoding::LinearSRGB(out.IsGray()),
+                      *JxlGetDefaultCms(), pool));
+  return out;
+}
+
+// Replaces the linear sRGB image in `ib` by its 2x downsampled version.
+Status DownsampleLinear(ImageBundle* ib, ThreadPool* pool) {
+  JXL_ASSIGN_OR_RETURN(Image3F tmp, Downsample(*ib->color(), 2, 2, pool));
+  return ib->SetFromImage(std::move(tmp),
+                          jxl::ColorEncoding::LinearSRGB(ib->IsGray()));
+}
+
+// Converts the linear sRGB image in `ib` to the positive XYB used by the
+// metric, shrinking `xyb` to its size.
+Status ToPositiveXYB(const ImageBundle& ib, Image3F* xyb, ThreadPool* pool) {
+  JXL_RETURN_IF_ERROR(xyb->ShrinkTo(ib.xsize(), ib.ysize()));
+  JXL_RETURN_IF_ERROR(jxl::ToXYB(ib, pool, xyb, *JxlGetDefaultCms(), nullptr));
+  MakePositiveXYB(*xyb);
+  return true;
+}
+
 }  // namespace
 
 /*
@@ -443,85 +496,92 @@ double Msssim::Score() const {
   return ssim;
 }
 
-StatusOr<Msssim> ComputeSSIMULACRA2(const ImageBundle& orig,
-                                    const ImageBundle& dist, float bg) {
+StatusOr<Ssimulacra2Reference> Ssimulacra2Reference::Create(
+    const ImageBundle& orig, float bg, ThreadPool* pool) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
-  Msssim msssim;
+  Ssimulacra2Reference reference;
+  reference.xsize_ = orig.xsize();
+  reference.ysize_ = orig.ysize();
+  reference.bg_ = bg;
 
+  JXL_ASSIGN_OR_RETURN(ImageBundle linear, ToLinearSRGB(orig, bg, pool));
   JXL_ASSIGN_OR_RETURN(
-      Image3F img1,
-      Image3F::Create(memory_manager, orig.xsize(), orig.ysize()));
-  JXL_ASSIGN_OR_RETURN(
-      Image3F img2,
-      Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
-
-  JXL_ASSIGN_OR_RETURN(ImageBundle orig2, orig.Copy());
-  JXL_ASSIGN_OR_RETURN(ImageBundle dist2, dist.Copy());
-
-  if (orig.HasAlpha()) AlphaBlend(orig2, bg);
-  if (dist.HasAlpha()) AlphaBlend(dist2, bg);
-  orig2.ClearExtraChannels();
-  dist2.ClearExtraChannels();
-
-  JXL_RETURN_IF_ERROR(orig2.TransformTo(
-      jxl::ColorEncoding::LinearSRGB(orig2.IsGray()), *JxlGetDefaultCms()));
-  JXL_RETURN_IF_ERROR(dist2.TransformTo(
-      jxl::ColorEncoding::LinearSRGB(dist2.IsGray()), *JxlGetDefaultCms()));
-
-  JXL_RETURN_IF_ERROR(
-      jxl::ToXYB(orig2, nullptr, &img1, *JxlGetDefaultCms(), nullptr));
-  JXL_RETURN_IF_ERROR(
-      jxl::ToXYB(dist2, nullptr, &img2, *JxlGetDefaultCms(), nullptr));
-  MakePositiveXYB(img1);
-  MakePositiveXYB(img2);
-
-  JXL_ASSIGN_OR_RETURN(
-      Image3F mul, Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
-  JXL_ASSIGN_OR_RETURN(Blur blur, Blur::Create(img1.xsize(), img1.ysize()));
+      Image3F mul, Image3F::Create(memory_manager, orig.xsize(), orig.ysize()));
+  JXL_ASSIGN_OR_RETURN(Blur blur, Blur::Create(orig.xsize(), orig.ysize()));
 
   for (int scale = 0; scale < kNumScales; scale++) {
-    if (img1.xsize() < 8 || img1.ysize() < 8) {
+    if (linear.xsize() < 8 || linear.ysize() < 8) {
       break;
     }
     if (scale) {
-      JXL_ASSIGN_OR_RETURN(Image3F tmp, Downsample(*orig2.color(), 2, 2));
-      JXL_RETURN_IF_ERROR(orig2.SetFromImage(
-          std::move(tmp), jxl::ColorEncoding::LinearSRGB(orig2.IsGray())));
-      JXL_ASSIGN_OR_RETURN(tmp, Downsample(*dist2.color(), 2, 2));
-      JXL_RETURN_IF_ERROR(dist2.SetFromImage(
-          std::move(tmp), jxl::ColorEncoding::LinearSRGB(dist2.IsGray())));
-      JXL_RETURN_IF_ERROR(img1.ShrinkTo(orig2.xsize(), orig2.ysize()));
-      JXL_RETURN_IF_ERROR(img2.ShrinkTo(orig2.xsize(), orig2.ysize()));
-      JXL_RETURN_IF_ERROR(
-          jxl::ToXYB(orig2, nullptr, &img1, *JxlGetDefaultCms(), nullptr));
-      JXL_RETURN_IF_ERROR(
-          jxl::ToXYB(dist2, nullptr, &img2, *JxlGetDefaultCms(), nullptr));
-      MakePositiveXYB(img1);
-      MakePositiveXYB(img2);
+      JXL_RETURN_IF_ERROR(DownsampleLinear(&linear, pool));
     }
-    JXL_RETURN_IF_ERROR(mul.ShrinkTo(img1.xsize(), img1.ysize()));
-    JXL_RETURN_IF_ERROR(blur.ShrinkTo(img1.xsize(), img1.ysize()));
+    Scale s;
+    JXL_ASSIGN_OR_RETURN(
+        s.img, Image3F::Create(memory_manager, linear.xsize(), linear.ysize()));
+    JXL_RETURN_IF_ERROR(ToPositiveXYB(linear, &s.img, pool));
+    JXL_RETURN_IF_ERROR(mul.ShrinkTo(s.img.xsize(), s.img.ysize()));
+    JXL_RETURN_IF_ERROR(blur.ShrinkTo(s.img.xsize(), s.img.ysize()));
+
+    JXL_RETURN_IF_ERROR(Multiply(s.img, s.img, &mul, pool));
+    JXL_ASSIGN_OR_RETURN(s.sigma_sq, blur(mul, pool));
+    JXL_ASSIGN_OR_RETURN(s.mu, blur(s.img, pool));
+    reference.scales_.push_back(std::move(s));
+  }
+  return reference;
+}
 
-    Multiply(img1, img1, &mul);
-    JXL_ASSIGN_OR_RETURN(Image3F sigma1_sq, blur(mul));
+StatusOr<Msssim> Ssimulacra2Reference::Compare(const ImageBundle& distorted,
+                                               ThreadPool* pool) const {
+  if (distorted.xsize() != xsize_ || distorted.ysize() != ysize_) {
+    return JXL_FAILURE("Image size mismatch");
+  }
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  Msssim msssim;
 
-    Multiply(img2, img2, &mul);
-    JXL_ASSIGN_OR_RETURN(Image3F sigma2_sq, blur(mul));
+  JXL_ASSIGN_OR_RETURN(ImageBundle linear,
+                       ToLinearSRGB(distorted, bg_, pool));
+  JXL_ASSIGN_OR_RETURN(Image3F img2,
+                       Image3F::Create(memory_manager, xsize_, ysize_));
+  JXL_ASSIGN_OR_RETURN(Image3F mul,
+                       Image3F::Create(memory_manager, xsize_, ysize_));
+  JXL_ASSIGN_OR_RETURN(Blur blur, Blur::Create(xsize_, ysize_));
 
-    Multiply(img1, img2, &mul);
-    JXL_ASSIGN_OR_RETURN(Image3F sigma12, blur(mul));
+  for (size_t scale = 0; scale < scales_.size(); scale++) {
+    const Scale& ref = scales_[scale];
+    if (scale) {
+      JXL_RETURN_IF_ERROR(DownsampleLinear(&linear, pool));
+    }
+    JXL_RETURN_IF_ERROR(ToPositiveXYB(linear, &img2, pool));
+    JXL_RETURN_IF_ERROR(mul.ShrinkTo(img2.xsize(), img2.ysize()));
+    JXL_RETURN_IF_ERROR(blur.ShrinkTo(img2.xsize(), img2.ysize()));
 
-    JXL_ASSIGN_OR_RETURN(Image3F mu1, blur(img1));
-    JXL_ASSIGN_OR_RETURN(Image3F mu2, blur(img2));
+    JXL_RETURN_IF_ERROR(Multiply(img2, img2, &mul, pool));
+    JXL_ASSIGN_OR_RETURN(Image3F sigma2_sq, blur(mul, pool));
+
+    JXL_RETURN_IF_ERROR(Multiply(ref.img, img2, &mul, pool));
+    JXL_ASSIGN_OR_RETURN(Image3F sigma12, blur(mul, pool));
+
+    JXL_ASSIGN_OR_RETURN(Image3F mu2, blur(img2, pool));
 
     MsssimScale sscale;
-    SSIMMap(mu1, mu2, sigma1_sq, sigma2_sq, sigma12, sscale.avg_ssim);
-    EdgeDiffMap(img1, mu1, img2, mu2, sscale.avg_edgediff);
+    JXL_RETURN_IF_ERROR(SSIMMap(ref.mu, mu2, ref.sigma_sq, sigma2_sq, sigma12,
+                                sscale.avg_ssim, pool));
+    JXL_RETURN_IF_ERROR(EdgeDiffMap(ref.img, ref.mu, img2, mu2,
+                                    sscale.avg_edgediff, pool));
     msssim.scales.push_back(sscale);
   }
   return msssim;
 }
 
+StatusOr<Msssim> ComputeSSIMULACRA2(const ImageBundle& orig,
+                                    const ImageBundle& dist, float bg,
+                                    ThreadPool* pool) {
+  JXL_ASSIGN_OR_RETURN(Ssimulacra2Reference reference,
+                       Ssimulacra2Reference::Create(orig, bg, pool));
+  return reference.Compare(dist, pool);
+}
+
 StatusOr<Msssim> ComputeSSIMULACRA2(const ImageBundle& orig,
                                     const ImageBundle& distorted) {
   return ComputeSSIMULACRA2(orig, distorted, 0.5f);
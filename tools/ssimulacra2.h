@@ -6,9 +6,12 @@
 #ifndef TOOLS_SSIMULACRA2_H_
 #define TOOLS_SSIMULACRA2_H_
 
+#include <cstddef>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 
 struct MsssimScale {
@@ -22,12 +25,45 @@ struct Msssim {
   double Score() const;
 };
 
+// The reference image of SSIMULACRA 2, with its multi-scale XYB pyramid and
+// blurred statistics computed once, so that many distorted images can be
+// scored against it.
+class Ssimulacra2Reference {
+ public:
+  // In case of alpha transparency, assume a gray background of intensity 'bg'
+  // (in range 0..1); the distorted images are blended the same way.
+  static jxl::StatusOr<Ssimulacra2Reference> Create(
+      const jxl::ImageBundle &orig, float bg = 0.5f,
+      jxl::ThreadPool *pool = nullptr);
+
+  // Computes the SSIMULACRA 2 score of 'distorted', which must have the size
+  // of the reference image. May be called concurrently. The result does not
+  // depend on 'pool'.
+  jxl::StatusOr<Msssim> Compare(const jxl::ImageBundle &distorted,
+                                jxl::ThreadPool *pool = nullptr) const;
+
+ private:
+  struct Scale {
+    jxl::Image3F img;
+    jxl::Image3F mu;
+    jxl::Image3F sigma_sq;
+  };
+
+  Ssimulacra2Reference() = default;
+
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  float bg_ = 0.5f;
+  std::vector<Scale> scales_;
+};
+
 // Computes the SSIMULACRA 2 score between reference image 'orig' and
 // distorted image 'distorted'. In case of alpha transparency, assume
 // a gray background if intensity 'bg' (in range 0..1).
 jxl::StatusOr<Msssim> ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
                                          const jxl::ImageBundle &distorted,
-                                         float bg);
+                                         float bg,
+                                         jxl::ThreadPool *pool = nullptr);
 jxl::StatusOr<Msssim> ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
                                          const jxl::ImageBundle &distorted);
 
@@ -18,6 +18,7 @@
 #include "tools/file_io.h"
 #include "tools/no_memory_manager.h"
 #include "tools/ssimulacra2.h"
+#include "tools/thread_pool_internal.h"
 
 #define QUIT(M)               \
   fprintf(stderr, "%s\n", M); \
@@ -80,19 +81,23 @@ int main(int argc, char** argv) {
     QUIT("Image size mismatch.");
   }
 
+  jpegxl::tools::ThreadPoolInternal pool;
   if (!io1.Main().HasAlpha()) {
     JXL_ASSIGN_OR_QUIT(Msssim msssim,
-                       ComputeSSIMULACRA2(io1.Main(), io2.Main()),
+                       ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.5f,
+                                          pool.get()),
                        "ComputeSSIMULACRA2 failed.");
     printf("%.8f\n", msssim.Score());
   } else {
     // in case of alpha transparency: blend against dark and bright backgrounds
     // and return the worst of both scores
     JXL_ASSIGN_OR_QUIT(Msssim msssim0,
-                       ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.1f),
+                       ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.1f,
+                                          pool.get()),
                        "ComputeSSIMULACRA2 failed.");
     JXL_ASSIGN_OR_QUIT(Msssim msssim1,
-                       ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.9f),
+                       ComputeSSIMULACRA2(io1.Main(), io2.Main(), 0.9f,
+                                          pool.get()),
                        "ComputeSSIMULACRA2 failed.");
     printf("%.8f\n", std::min(msssim0.Score(), msssim1.Score()));
   }
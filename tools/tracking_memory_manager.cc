@@ -59,6 +59,11 @@ void* TrackingMemoryManager::Alloc(void* opaque, size_t size) {
     self->bytes_in_use_ = new_bytes_in_use;
     self->max_bytes_in_use = std::max(self->max_bytes_in_use, new_bytes_in_use);
     self->total_bytes_allocated = new_total;
+    if (self->tagger_ != nullptr) {
+      const size_t tag = self->tagger_();
+      self->tag_allocations[tag]++;
+      self->tag_bytes_allocated[tag] += size;
+    }
   }
   void* result = self->inner_->alloc(self->inner_->opaque, size);
   if (result != nullptr) {
@@ -115,10 +120,24 @@ jxl::Status TrackingMemoryManager::Reset() {
     return JXL_FAILURE("Internal logic error");
   }
   seen_oom = false;
-  max_bytes_in_use = 0;
+  ResetStats();
+  return true;
+}
+
+void TrackingMemoryManager::ResetStats() {
+  std::lock_guard<std::mutex> guard(numbers_mutex_);
+  max_bytes_in_use = bytes_in_use_;
   total_allocations = 0;
   total_bytes_allocated = 0;
-  return true;
+  std::fill(tag_allocations.begin(), tag_allocations.end(), 0);
+  std::fill(tag_bytes_allocated.begin(), tag_bytes_allocated.end(), 0);
+}
+
+void TrackingMemoryManager::SetTagger(size_t (*tagger)(), size_t num_tags) {
+  std::lock_guard<std::mutex> guard(numbers_mutex_);
+  tagger_ = tagger;
+  tag_allocations.assign(num_tags, 0);
+  tag_bytes_allocated.assign(num_tags, 0);
 }
 
 }  // namespace tools
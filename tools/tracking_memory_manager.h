@@ -13,6 +13,7 @@
 #include <cstdio>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include "lib/jxl/base/status.h"
 
@@ -31,10 +32,21 @@ class TrackingMemoryManager {
 
   jxl::Status Reset();
 
+  // Restarts the statistics below from the bytes currently in use, without
+  // requiring that all allocations have been freed, unlike Reset().
+  void ResetStats();
+
+  // Also counts the allocations per tag, as returned by `tagger` at
+  // allocation time, which must be less than `num_tags`.
+  void SetTagger(size_t (*tagger)(), size_t num_tags);
+
   bool seen_oom = false;
   uint64_t max_bytes_in_use = 0;
   uint64_t total_allocations = 0;
   uint64_t total_bytes_allocated = 0;
+  // Indexed by tag, only with SetTagger().
+  std::vector<uint64_t> tag_allocations;
+  std::vector<uint64_t> tag_bytes_allocated;
 
  private:
   static void* Alloc(void* opaque, size_t size);
@@ -47,6 +59,7 @@ class TrackingMemoryManager {
   uint64_t total_cap_;
   uint64_t bytes_in_use_ = 0;
   uint64_t num_allocations_ = 0;
+  size_t (*tagger_)() = nullptr;
   JxlMemoryManager outer_;
   JxlMemoryManager default_;
   JxlMemoryManager* inner_;
@@ -53,9 +53,11 @@ const processJobs = () => {
     decoder._free(buffer);
     const outputLength = decoder.HEAP32[result >> 2];
     const outputAddr = decoder.HEAP32[(result + 4) >> 2];
+    // WASM memory can not be transferred; copy once (subarray is a view) into
+    // a buffer that is then transferred to the client without a copy.
     const output = new Uint8Array(outputLength);
     const outputSrc = new Uint8Array(decoder.HEAP8.buffer);
-    output.set(outputSrc.slice(outputAddr, outputAddr + outputLength));
+    output.set(outputSrc.subarray(outputAddr, outputAddr + outputLength));
     decoder._jxlCleanup(result);
     const response = {uid: job.uid, data: output, msg: msg};
     postMessage(response, [output.buffer]);